@@ -55,9 +55,25 @@
 #define BContextLog(context, ...) BLog_ContextLog((context), BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 #define BLOG_CCCC(context) BLog_MakeChannelContext((context), BLOG_CURRENT_CHANNEL)
 
+// raw argument types for BLog_AppendRaw, keep in sync with the binary decoder!
+#define BLOG_RAW_BADDR 1
+
 typedef void (*_BLog_log_func) (int channel, int level, const char *msg);
 typedef void (*_BLog_free_func) (void);
 
+/**
+ * Backend for binary logging. In binary mode, the message buffer holds an
+ * encoded record rather than text, and formatting is deferred to an offline
+ * decoder. The append functions are called with the log mutex held and
+ * must write to blog_global.logbuf starting at blog_global.logbuf_pos.
+ */
+struct _BLog_binary_backend {
+    void (*append_func) (const char *fmt, va_list vl);
+    void (*append_bytes_func) (MemRef data);
+    void (*append_raw_func) (int type, MemRef data);
+    void (*log_func) (int channel, int level, const char *data, int len);
+};
+
 struct _BLog_channel {
     const char *name;
     int loglevel;
@@ -70,6 +86,7 @@ struct _BLog_global {
     struct _BLog_channel channels[BLOG_NUM_CHANNELS];
     _BLog_log_func log_func;
     _BLog_free_func free_func;
+    const struct _BLog_binary_backend *binary;
     BMutex mutex;
 #ifndef NDEBUG
     int logging;
@@ -96,19 +113,23 @@ typedef struct {
 static int BLogGlobal_GetChannelByName (const char *channel_name);
 
 static void BLog_Init (_BLog_log_func log_func, _BLog_free_func free_func);
+static void BLog_InitBinaryBackend (const struct _BLog_binary_backend *binary, _BLog_free_func free_func);
 static void BLog_Free (void);
 static void BLog_SetChannelLoglevel (int channel, int loglevel);
 static int BLog_WouldLog (int channel, int level);
+static int BLog_IsBinary (void);
 static void BLog_Begin (void);
 static void BLog_AppendVarArg (const char *fmt, va_list vl);
 static void BLog_Append (const char *fmt, ...);
 static void BLog_AppendBytes (MemRef data);
+static void BLog_AppendRaw (int type, MemRef data);
 static void BLog_Finish (int channel, int level);
 static void BLog_LogToChannelVarArg (int channel, int level, const char *fmt, va_list vl);
 static void BLog_LogToChannel (int channel, int level, const char *fmt, ...);
 static void BLog_LogViaFuncVarArg (BLog_logfunc func, void *arg, int channel, int level, const char *fmt, va_list vl);
 static void BLog_LogViaFunc (BLog_logfunc func, void *arg, int channel, int level, const char *fmt, ...);
 static BLogContext BLog_RootContext (void);
+static BLogContext BLog_NullContext (void);
 static BLogContext BLog_MakeContext (BLog_logfunc logfunc, void *logfunc_user);
 static void BLog_ContextLogVarArg (BLogContext context, int channel, int level, const char *fmt, va_list vl);
 static void BLog_ContextLog (BLogContext context, int channel, int level, const char *fmt, ...);
@@ -144,6 +165,7 @@ void BLog_Init (_BLog_log_func log_func, _BLog_free_func free_func)
     
     blog_global.log_func = log_func;
     blog_global.free_func = free_func;
+    blog_global.binary = NULL;
 #ifndef NDEBUG
     blog_global.logging = 0;
 #endif
@@ -153,6 +175,19 @@ void BLog_Init (_BLog_log_func log_func, _BLog_free_func free_func)
     ASSERT_FORCE(BMutex_Init(&blog_global.mutex))
 }
 
+void BLog_InitBinaryBackend (const struct _BLog_binary_backend *binary, _BLog_free_func free_func)
+{
+    ASSERT(binary)
+    ASSERT(binary->append_func)
+    ASSERT(binary->append_bytes_func)
+    ASSERT(binary->append_raw_func)
+    ASSERT(binary->log_func)
+    
+    BLog_Init(NULL, free_func);
+    
+    blog_global.binary = binary;
+}
+
 void BLog_Free (void)
 {
     ASSERT(blog_global.initialized)
@@ -187,6 +222,13 @@ int BLog_WouldLog (int channel, int level)
     return (level <= blog_global.channels[channel].loglevel);
 }
 
+int BLog_IsBinary (void)
+{
+    ASSERT(blog_global.initialized)
+    
+    return !!blog_global.binary;
+}
+
 void BLog_Begin (void)
 {
     ASSERT(blog_global.initialized)
@@ -208,6 +250,11 @@ void BLog_AppendVarArg (const char *fmt, va_list vl)
     ASSERT(blog_global.logbuf_pos >= 0)
     ASSERT(blog_global.logbuf_pos < sizeof(blog_global.logbuf))
     
+    if (blog_global.binary) {
+        blog_global.binary->append_func(fmt, vl);
+        return;
+    }
+    
     int w = vsnprintf(blog_global.logbuf + blog_global.logbuf_pos, sizeof(blog_global.logbuf) - blog_global.logbuf_pos, fmt, vl);
     
     if (w >= sizeof(blog_global.logbuf) - blog_global.logbuf_pos) {
@@ -239,6 +286,11 @@ void BLog_AppendBytes (MemRef data)
     ASSERT(blog_global.logbuf_pos >= 0)
     ASSERT(blog_global.logbuf_pos < sizeof(blog_global.logbuf))
     
+    if (blog_global.binary) {
+        blog_global.binary->append_bytes_func(data);
+        return;
+    }
+    
     size_t avail = (sizeof(blog_global.logbuf) - 1) - blog_global.logbuf_pos;
     data.len = (data.len > avail ? avail : data.len);
     
@@ -247,6 +299,17 @@ void BLog_AppendBytes (MemRef data)
     blog_global.logbuf[blog_global.logbuf_pos] = '\0';
 }
 
+void BLog_AppendRaw (int type, MemRef data)
+{
+    ASSERT(blog_global.initialized)
+#ifndef NDEBUG
+    ASSERT(blog_global.logging)
+#endif
+    ASSERT(blog_global.binary)
+    
+    blog_global.binary->append_raw_func(type, data);
+}
+
 void BLog_Finish (int channel, int level)
 {
     ASSERT(blog_global.initialized)
@@ -259,9 +322,13 @@ void BLog_Finish (int channel, int level)
     
     ASSERT(blog_global.logbuf_pos >= 0)
     ASSERT(blog_global.logbuf_pos < sizeof(blog_global.logbuf))
-    ASSERT(blog_global.logbuf[blog_global.logbuf_pos] == '\0')
+    ASSERT(blog_global.binary || blog_global.logbuf[blog_global.logbuf_pos] == '\0')
     
-    blog_global.log_func(channel, level, blog_global.logbuf);
+    if (blog_global.binary) {
+        blog_global.binary->log_func(channel, level, blog_global.logbuf, blog_global.logbuf_pos);
+    } else {
+        blog_global.log_func(channel, level, blog_global.logbuf);
+    }
     
 #ifndef NDEBUG
     blog_global.logging = 0;
@@ -353,6 +420,15 @@ static BLogContext BLog_RootContext (void)
     return BLog_MakeContext(BLog__root_logfunc, NULL);
 }
 
+static BLogContext BLog_NullContext (void)
+{
+    // messages logged via this context are discarded
+    BLogContext context;
+    context.logfunc = NULL;
+    context.logfunc_user = NULL;
+    return context;
+}
+
 static BLogContext BLog_MakeContext (BLog_logfunc logfunc, void *logfunc_user)
 {
     ASSERT(logfunc)
@@ -365,6 +441,10 @@ static BLogContext BLog_MakeContext (BLog_logfunc logfunc, void *logfunc_user)
 
 static void BLog_ContextLogVarArg (BLogContext context, int channel, int level, const char *fmt, va_list vl)
 {
+    if (!context.logfunc) {
+        return;
+    }
+    
     BLog_LogViaFuncVarArg(context.logfunc, context.logfunc_user, channel, level, fmt, vl);
 }
 
@@ -0,0 +1,434 @@
+/**
+ * @file BLog_binary.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <misc/read_write_int.h>
+#include <misc/minmax.h>
+
+#include "BLog_binary.h"
+
+#define FORMAT_TABLE_SIZE 1024
+#define FILE_BUFFER_SIZE 65536
+#define FLUSH_THRESHOLD 4096
+#define FLUSH_INTERVAL 1
+
+struct format_def {
+    int supported; // if not, the message is formatted as text
+    uint32_t id;
+    int num_convs;
+    struct BLogBinary_conv convs[BLOG_BINARY_MAX_CONVERSIONS];
+    char str[];
+};
+
+struct format_entry {
+    const char *fmt;
+    struct format_def *def;
+};
+
+static struct {
+    FILE *file;
+    uint32_t next_format_id;
+    int full;
+    size_t unflushed;
+    time_t flush_time;
+    struct format_entry formats[FORMAT_TABLE_SIZE];
+    uint8_t channel_defined[BLOG_NUM_CHANNELS];
+} binary_global;
+
+static size_t hash_format_ptr (const char *fmt)
+{
+    uintptr_t x = (uintptr_t)fmt;
+    x ^= x >> 16;
+    x *= UINT32_C(0x45d9f3b);
+    x ^= x >> 16;
+    return x % FORMAT_TABLE_SIZE;
+}
+
+static struct format_def * define_format (const char *fmt)
+{
+    size_t len = strlen(fmt);
+    
+    struct format_def *def = malloc(sizeof(*def) + len + 1);
+    if (!def) {
+        return NULL;
+    }
+    
+    memcpy(def->str, fmt, len + 1);
+    
+    // formats we cannot handle are remembered too, so they are not
+    // parsed again on every call
+    def->supported = (len <= UINT16_MAX && BLogBinary_ParseFormat(fmt, def->convs, &def->num_convs));
+    if (!def->supported) {
+        return def;
+    }
+    
+    def->id = binary_global.next_format_id++;
+    
+    char hdr[7];
+    badvpn_write_le8(BLOG_BINARY_REC_FORMAT, hdr + 0);
+    badvpn_write_le32(def->id, hdr + 1);
+    badvpn_write_le16(len, hdr + 5);
+    fwrite(hdr, sizeof(hdr), 1, binary_global.file);
+    fwrite(fmt, len, 1, binary_global.file);
+    
+    return def;
+}
+
+static struct format_def * lookup_format (const char *fmt)
+{
+    size_t start = hash_format_ptr(fmt);
+    size_t i = start;
+    
+    do {
+        struct format_entry *e = &binary_global.formats[i];
+        
+        if (!e->fmt) {
+            // not seen yet, define it
+            struct format_def *def = define_format(fmt);
+            if (!def) {
+                return NULL;
+            }
+            e->fmt = fmt;
+            e->def = def;
+            return (def->supported ? def : NULL);
+        }
+        
+        if (e->fmt == fmt) {
+            // The pointer matches, but the string may have been replaced
+            // since (e.g. an unloaded module); this is still far cheaper
+            // than formatting.
+            if (strcmp(e->def->str, fmt)) {
+                struct format_def *def = define_format(fmt);
+                if (!def) {
+                    return NULL;
+                }
+                free(e->def);
+                e->def = def;
+            }
+            return (e->def->supported ? e->def : NULL);
+        }
+        
+        i = (i + 1) % FORMAT_TABLE_SIZE;
+    } while (i != start);
+    
+    // table is full
+    return NULL;
+}
+
+static char * reserve (int len)
+{
+    if (binary_global.full || len > sizeof(blog_global.logbuf) - blog_global.logbuf_pos) {
+        binary_global.full = 1;
+        return NULL;
+    }
+    
+    char *ptr = blog_global.logbuf + blog_global.logbuf_pos;
+    blog_global.logbuf_pos += len;
+    return ptr;
+}
+
+static int write_le32 (uint32_t x)
+{
+    char *ptr = reserve(4);
+    if (!ptr) {
+        return 0;
+    }
+    badvpn_write_le32(x, ptr);
+    return 1;
+}
+
+static int write_le64 (uint64_t x)
+{
+    char *ptr = reserve(8);
+    if (!ptr) {
+        return 0;
+    }
+    badvpn_write_le64(x, ptr);
+    return 1;
+}
+
+static int write_double (double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return write_le64(bits);
+}
+
+static int write_data (const char *data, size_t len)
+{
+    char *ptr = reserve(2 + len);
+    if (!ptr) {
+        return 0;
+    }
+    badvpn_write_le16(len, ptr);
+    memcpy(ptr + 2, data, len);
+    return 1;
+}
+
+static void append_text (const char *fmt, va_list vl)
+{
+    if (binary_global.full) {
+        return;
+    }
+    
+    int avail = sizeof(blog_global.logbuf) - blog_global.logbuf_pos - 3;
+    if (avail <= 0) {
+        binary_global.full = 1;
+        return;
+    }
+    
+    char *ptr = blog_global.logbuf + blog_global.logbuf_pos;
+    int w = vsnprintf(ptr + 3, avail, fmt, vl);
+    if (w < 0) {
+        return;
+    }
+    if (w >= avail) {
+        w = avail - 1;
+        binary_global.full = 1;
+    }
+    
+    badvpn_write_le8(BLOG_BINARY_SEG_TEXT, ptr);
+    badvpn_write_le16(w, ptr + 1);
+    blog_global.logbuf_pos += 3 + w;
+}
+
+static int append_args (struct format_def *def, va_list vl)
+{
+    for (int i = 0; i < def->num_convs; i++) {
+        struct BLogBinary_conv *conv = &def->convs[i];
+        int prec = conv->prec;
+        
+        if (conv->star_width) {
+            if (!write_le32(va_arg(vl, int))) {
+                return 0;
+            }
+        }
+        
+        if (conv->star_prec) {
+            prec = va_arg(vl, int);
+            if (!write_le32(prec)) {
+                return 0;
+            }
+        }
+        
+        int res;
+        switch (conv->type) {
+            case BLOG_BINARY_ARG_INT:
+                res = write_le32(va_arg(vl, int));
+                break;
+            case BLOG_BINARY_ARG_LONG:
+                res = write_le64(va_arg(vl, long));
+                break;
+            case BLOG_BINARY_ARG_LLONG:
+                res = write_le64(va_arg(vl, long long));
+                break;
+            case BLOG_BINARY_ARG_SIZE:
+                res = write_le64(va_arg(vl, size_t));
+                break;
+            case BLOG_BINARY_ARG_INTMAX:
+                res = write_le64(va_arg(vl, intmax_t));
+                break;
+            case BLOG_BINARY_ARG_PTRDIFF:
+                res = write_le64(va_arg(vl, ptrdiff_t));
+                break;
+            case BLOG_BINARY_ARG_DOUBLE:
+                res = write_double(va_arg(vl, double));
+                break;
+            case BLOG_BINARY_ARG_LDOUBLE:
+                res = write_double(va_arg(vl, long double));
+                break;
+            case BLOG_BINARY_ARG_POINTER:
+                res = write_le64((uintptr_t)va_arg(vl, void *));
+                break;
+            case BLOG_BINARY_ARG_STRING: {
+                const char *str = va_arg(vl, const char *);
+                if (!str) {
+                    str = "(null)";
+                }
+                size_t max = (prec >= 0 && prec < BLOG_BINARY_MAX_STRING) ? prec : BLOG_BINARY_MAX_STRING;
+                size_t len = 0;
+                while (len < max && str[len]) {
+                    len++;
+                }
+                res = write_data(str, len);
+            } break;
+            default:
+                ASSERT(0)
+                res = 0;
+        }
+        
+        if (!res) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+static void binary_append (const char *fmt, va_list vl)
+{
+    if (binary_global.full) {
+        return;
+    }
+    
+    struct format_def *def = lookup_format(fmt);
+    if (!def) {
+        // unsupported format or table full, format it now
+        append_text(fmt, vl);
+        return;
+    }
+    
+    int seg_start = blog_global.logbuf_pos;
+    
+    char *ptr = reserve(5);
+    if (!ptr) {
+        return;
+    }
+    badvpn_write_le8(BLOG_BINARY_SEG_FORMAT, ptr);
+    badvpn_write_le32(def->id, ptr + 1);
+    
+    if (!append_args(def, vl)) {
+        // drop the partial segment
+        blog_global.logbuf_pos = seg_start;
+    }
+}
+
+static void binary_append_bytes (MemRef data)
+{
+    size_t len = bmin_size(data.len, UINT16_MAX);
+    
+    char *ptr = reserve(3 + len);
+    if (!ptr) {
+        return;
+    }
+    badvpn_write_le8(BLOG_BINARY_SEG_BYTES, ptr);
+    badvpn_write_le16(len, ptr + 1);
+    memcpy(ptr + 3, data.ptr, len);
+}
+
+static void binary_append_raw (int type, MemRef data)
+{
+    ASSERT(type > 0 && type <= UINT8_MAX)
+    ASSERT(data.len <= UINT8_MAX)
+    
+    char *ptr = reserve(3 + data.len);
+    if (!ptr) {
+        return;
+    }
+    badvpn_write_le8(BLOG_BINARY_SEG_RAW, ptr);
+    badvpn_write_le8(type, ptr + 1);
+    badvpn_write_le8(data.len, ptr + 2);
+    memcpy(ptr + 3, data.ptr, data.len);
+}
+
+static void binary_log (int channel, int level, const char *data, int len)
+{
+    ASSERT(len >= 0)
+    ASSERT(len <= UINT16_MAX)
+    
+    if (!binary_global.channel_defined[channel]) {
+        const char *name = blog_global.channels[channel].name;
+        size_t name_len = bmin_size(strlen(name), UINT8_MAX);
+        
+        char hdr[4];
+        badvpn_write_le8(BLOG_BINARY_REC_CHANNEL, hdr + 0);
+        badvpn_write_le16(channel, hdr + 1);
+        badvpn_write_le8(name_len, hdr + 3);
+        fwrite(hdr, sizeof(hdr), 1, binary_global.file);
+        fwrite(name, name_len, 1, binary_global.file);
+        binary_global.unflushed += sizeof(hdr) + name_len;
+        
+        binary_global.channel_defined[channel] = 1;
+    }
+    
+    char hdr[6];
+    badvpn_write_le8(BLOG_BINARY_REC_MESSAGE, hdr + 0);
+    badvpn_write_le16(channel, hdr + 1);
+    badvpn_write_le8(level, hdr + 3);
+    badvpn_write_le16(len, hdr + 4);
+    fwrite(hdr, sizeof(hdr), 1, binary_global.file);
+    fwrite(data, len, 1, binary_global.file);
+    binary_global.unflushed += sizeof(hdr) + len;
+    
+    // write out warnings and errors right away since they may precede
+    // termination, and other messages once enough of them have accumulated
+    // or when the last write was at least FLUSH_INTERVAL seconds ago
+    time_t now = time(NULL);
+    if (level <= BLOG_WARNING || binary_global.unflushed >= FLUSH_THRESHOLD || now - binary_global.flush_time >= FLUSH_INTERVAL) {
+        fflush(binary_global.file);
+        binary_global.unflushed = 0;
+        binary_global.flush_time = now;
+    }
+    
+    binary_global.full = 0;
+}
+
+static void binary_free (void)
+{
+    for (size_t i = 0; i < FORMAT_TABLE_SIZE; i++) {
+        free(binary_global.formats[i].def);
+    }
+    
+    fclose(binary_global.file);
+}
+
+static const struct _BLog_binary_backend binary_backend = {
+    .append_func = binary_append,
+    .append_bytes_func = binary_append_bytes,
+    .append_raw_func = binary_append_raw,
+    .log_func = binary_log
+};
+
+int BLog_InitBinary (const char *path)
+{
+    memset(&binary_global, 0, sizeof(binary_global));
+    
+    if (!(binary_global.file = fopen(path, "ab"))) {
+        return 0;
+    }
+    
+    setvbuf(binary_global.file, NULL, _IOFBF, FILE_BUFFER_SIZE);
+    
+    if (fwrite(BLOG_BINARY_MAGIC, BLOG_BINARY_MAGIC_LEN, 1, binary_global.file) != 1) {
+        fclose(binary_global.file);
+        return 0;
+    }
+    
+    binary_global.flush_time = time(NULL);
+    
+    BLog_InitBinaryBackend(&binary_backend, binary_free);
+    
+    return 1;
+}
@@ -0,0 +1,286 @@
+/**
+ * @file BLog_binary.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * BLog backend which writes compact binary records instead of text.
+ * The call site only records a format string identifier and the raw
+ * arguments; rendering is done offline by badvpn-blog-decoder.
+ * Format strings are defined in the stream the first time they are used.
+ */
+
+#ifndef BADVPN_BLOG_BINARY_H
+#define BADVPN_BLOG_BINARY_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <misc/memref.h>
+#include <system/BAddr.h>
+#include <base/BLog.h>
+
+#define BLOG_BINARY_MAGIC "BLOGBIN1"
+#define BLOG_BINARY_MAGIC_LEN 8
+
+// record types
+#define BLOG_BINARY_REC_START 'B' // rest of BLOG_BINARY_MAGIC, resets definitions
+#define BLOG_BINARY_REC_FORMAT 'F' // le32 id, le16 len, format string
+#define BLOG_BINARY_REC_CHANNEL 'C' // le16 channel, le8 len, channel name
+#define BLOG_BINARY_REC_MESSAGE 'M' // le16 channel, le8 level, le16 len, segments
+
+// segment types within a message
+#define BLOG_BINARY_SEG_FORMAT 'f' // le32 format id, arguments
+#define BLOG_BINARY_SEG_BYTES 'b' // le16 len, data
+#define BLOG_BINARY_SEG_RAW 'r' // le8 raw type, le8 len, data
+#define BLOG_BINARY_SEG_TEXT 't' // le16 len, preformatted text
+
+// argument types
+#define BLOG_BINARY_ARG_INT 1 // le32
+#define BLOG_BINARY_ARG_LONG 2 // le64
+#define BLOG_BINARY_ARG_LLONG 3 // le64
+#define BLOG_BINARY_ARG_SIZE 4 // le64
+#define BLOG_BINARY_ARG_INTMAX 5 // le64
+#define BLOG_BINARY_ARG_PTRDIFF 6 // le64
+#define BLOG_BINARY_ARG_DOUBLE 7 // le64, bits of double
+#define BLOG_BINARY_ARG_LDOUBLE 8 // le64, bits of double
+#define BLOG_BINARY_ARG_STRING 9 // le16 len, data
+#define BLOG_BINARY_ARG_POINTER 10 // le64
+
+#define BLOG_BINARY_MAX_CONVERSIONS 16
+#define BLOG_BINARY_MAX_STRING 512
+
+struct BLogBinary_conv {
+    uint8_t type;
+    uint8_t star_width;
+    uint8_t star_prec;
+    int prec;
+    int spec_start;
+    int spec_len;
+};
+
+/**
+ * Opens the given file for appending and initializes logging into it.
+ * 
+ * @param path file to write to
+ * @return 1 on success, 0 on failure
+ */
+int BLog_InitBinary (const char *path) WARN_UNUSED;
+
+/**
+ * Determines the argument types of a printf format string.
+ * 
+ * @param fmt format string
+ * @param convs array of at least BLOG_BINARY_MAX_CONVERSIONS elements
+ *              where the conversions will be stored. For each conversion,
+ *              spec_start and spec_len delimit its specification (from '%'
+ *              to the conversion character), and prec is the constant
+ *              precision, or -1 if there is none.
+ * @param out_num on success, the number of conversions will be stored here
+ * @return 1 on success, 0 if the format contains an unsupported conversion
+ *         or too many conversions
+ */
+static int BLogBinary_ParseFormat (const char *fmt, struct BLogBinary_conv *convs, int *out_num);
+
+/**
+ * Appends an address to the log message being built (see {@link BLog_Begin}).
+ * With a binary logger, IP addresses are stored raw and only printed
+ * by the decoder.
+ * 
+ * @param addr address to append
+ */
+static void BLog_AppendAddr (BAddr *addr);
+
+static int BLogBinary_ParseFormat (const char *fmt, struct BLogBinary_conv *convs, int *out_num)
+{
+    ASSERT(fmt)
+    ASSERT(convs)
+    ASSERT(out_num)
+    
+    int num = 0;
+    const char *p = fmt;
+    
+    while (*p) {
+        if (*p != '%') {
+            p++;
+            continue;
+        }
+        
+        if (p[1] == '%') {
+            p += 2;
+            continue;
+        }
+        
+        if (num == BLOG_BINARY_MAX_CONVERSIONS) {
+            return 0;
+        }
+        
+        struct BLogBinary_conv *conv = &convs[num];
+        conv->star_width = 0;
+        conv->star_prec = 0;
+        conv->prec = -1;
+        conv->spec_start = p - fmt;
+        p++;
+        
+        // flags
+        while (*p && strchr("-+ #0'", *p)) {
+            p++;
+        }
+        
+        // width
+        if (*p == '*') {
+            conv->star_width = 1;
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9') {
+                p++;
+            }
+        }
+        
+        // precision
+        if (*p == '.') {
+            p++;
+            if (*p == '*') {
+                conv->star_prec = 1;
+                p++;
+            } else {
+                int prec = 0;
+                while (*p >= '0' && *p <= '9') {
+                    if (prec < 100000) {
+                        prec = 10 * prec + (*p - '0');
+                    }
+                    p++;
+                }
+                conv->prec = prec;
+            }
+        }
+        
+        // length modifier
+        int len_mod = 0;
+        switch (*p) {
+            case 'h':
+                p += (p[1] == 'h' ? 2 : 1);
+                break;
+            case 'l':
+                if (p[1] == 'l') {
+                    len_mod = BLOG_BINARY_ARG_LLONG;
+                    p += 2;
+                } else {
+                    len_mod = BLOG_BINARY_ARG_LONG;
+                    p++;
+                }
+                break;
+            case 'q':
+                len_mod = BLOG_BINARY_ARG_LLONG;
+                p++;
+                break;
+            case 'L':
+                len_mod = BLOG_BINARY_ARG_LDOUBLE;
+                p++;
+                break;
+            case 'j':
+                len_mod = BLOG_BINARY_ARG_INTMAX;
+                p++;
+                break;
+            case 'z':
+                len_mod = BLOG_BINARY_ARG_SIZE;
+                p++;
+                break;
+            case 't':
+                len_mod = BLOG_BINARY_ARG_PTRDIFF;
+                p++;
+                break;
+        }
+        
+        // conversion
+        switch (*p) {
+            case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+                if (len_mod == BLOG_BINARY_ARG_LDOUBLE) {
+                    return 0;
+                }
+                conv->type = (len_mod ? len_mod : BLOG_BINARY_ARG_INT);
+                break;
+            case 'c':
+                if (len_mod) {
+                    return 0;
+                }
+                conv->type = BLOG_BINARY_ARG_INT;
+                break;
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                conv->type = (len_mod == BLOG_BINARY_ARG_LDOUBLE ? BLOG_BINARY_ARG_LDOUBLE : BLOG_BINARY_ARG_DOUBLE);
+                break;
+            case 's':
+                if (len_mod) {
+                    return 0;
+                }
+                conv->type = BLOG_BINARY_ARG_STRING;
+                break;
+            case 'p':
+                conv->type = BLOG_BINARY_ARG_POINTER;
+                break;
+            default:
+                return 0;
+        }
+        p++;
+        
+        conv->spec_len = (p - fmt) - conv->spec_start;
+        num++;
+    }
+    
+    *out_num = num;
+    return 1;
+}
+
+void BLog_AppendAddr (BAddr *addr)
+{
+    BAddr_Assert(addr);
+    
+    if (BLog_IsBinary()) {
+        char raw[1 + 16 + 2];
+        switch (addr->type) {
+            case BADDR_TYPE_IPV4:
+                raw[0] = BADDR_TYPE_IPV4;
+                memcpy(raw + 1, &addr->ipv4.ip, 4);
+                memcpy(raw + 5, &addr->ipv4.port, 2);
+                BLog_AppendRaw(BLOG_RAW_BADDR, MemRef_Make(raw, 7));
+                return;
+            case BADDR_TYPE_IPV6:
+                raw[0] = BADDR_TYPE_IPV6;
+                memcpy(raw + 1, addr->ipv6.ip, 16);
+                memcpy(raw + 17, &addr->ipv6.port, 2);
+                BLog_AppendRaw(BLOG_RAW_BADDR, MemRef_Make(raw, 19));
+                return;
+        }
+    }
+    
+    char str[BADDR_MAX_PRINT_LEN];
+    BAddr_Print(addr, str);
+    BLog_AppendBytes(MemRef_MakeCstr(str));
+}
+
+#endif
@@ -87,6 +87,38 @@ void BPendingGroup_ExecuteJob (BPendingGroup *g)
     return;
 }
 
+int BPendingGroup_ExecuteJobs (BPendingGroup *g, int max_jobs, const int *stop)
+{
+    ASSERT(!BPending__List_IsEmpty(&g->jobs))
+    ASSERT(max_jobs > 0)
+    ASSERT(stop)
+    DebugObject_Access(&g->d_obj);
+    
+    int num = 0;
+    
+    do {
+        // get a job
+        BSmallPending *p = BPending__List_First(&g->jobs);
+        ASSERT(!BPending__ListIsRemoved(p))
+        ASSERT(p->pending)
+        
+        // remove from jobs list
+        BPending__List_RemoveFirst(&g->jobs);
+        
+        // set not pending
+        BPending__ListMarkRemoved(p);
+#ifndef NDEBUG
+        p->pending = 0;
+#endif
+        
+        // execute job
+        p->handler(p->user);
+        num++;
+    } while (num < max_jobs && !*stop && !BPending__List_IsEmpty(&g->jobs));
+    
+    return num;
+}
+
 BSmallPending * BPendingGroup_PeekJob (BPendingGroup *g)
 {
     DebugObject_Access(&g->d_obj);
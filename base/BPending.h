@@ -69,6 +69,15 @@ typedef void (*BPending_handler) (void *user);
 
 /**
  * Object that contains a list of jobs pending execution.
+ * 
+ * Jobs are executed in LIFO order: a job set from a job handler runs before
+ * any job that was already pending. As a consequence, a chain of jobs which
+ * keeps setting new jobs (e.g. a sink that completes each packet right away)
+ * starves all the jobs which were set before it, until the chain ends.
+ * Code which starts several such chains at once, and wants them to proceed
+ * together, should hold them back until all of them have been set up, for
+ * example from a timer, since timers are only dispatched when there are no
+ * jobs.
  */
 typedef struct {
     BPending__List jobs;
@@ -133,6 +142,21 @@ int BPendingGroup_HasJobs (BPendingGroup *g);
  */
 void BPendingGroup_ExecuteJob (BPendingGroup *g);
 
+/**
+ * Executes jobs from the top of the job list until the list becomes empty,
+ * max_jobs jobs have been executed, or *stop becomes nonzero (it is checked
+ * after every job). Each job is executed as in {@link BPendingGroup_ExecuteJob}.
+ * This is equivalent to calling {@link BPendingGroup_ExecuteJob} in a loop,
+ * but avoids the per-job overhead of doing so.
+ * There must be at least one job in job list.
+ * 
+ * @param g the object
+ * @param max_jobs maximum number of jobs to execute. Must be >0.
+ * @param stop pointer to a flag which causes the function to return when set
+ * @return number of jobs executed, >0
+ */
+int BPendingGroup_ExecuteJobs (BPendingGroup *g, int max_jobs, const int *stop);
+
 /**
  * Returns the top job on the job list, or NULL if there are none.
  * 
@@ -0,0 +1,474 @@
+/**
+ * @file blog_decoder.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Decoder for log files written by the binary logger (--logger binary).
+ * Renders each record as the stdout logger would have.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include <misc/read_write_int.h>
+#include <misc/debug.h>
+#include <base/BLog_binary.h>
+#include <system/BAddr.h>
+
+#define MAX_OUTPUT 65536
+#define MAX_SPEC 64
+
+struct format {
+    char *str;
+    int num_convs;
+    struct BLogBinary_conv convs[BLOG_BINARY_MAX_CONVERSIONS];
+};
+
+static const char *level_names[] = { NULL, "ERROR", "WARNING", "NOTICE", "INFO", "DEBUG" };
+
+static FILE *in_file;
+static struct format **formats;
+static size_t num_formats;
+static char *channels[UINT16_MAX + 1];
+
+static char out[MAX_OUTPUT];
+static size_t out_len;
+
+static const char *payload;
+static size_t payload_left;
+
+static int read_exact (void *buf, size_t len)
+{
+    return (len == 0 || fread(buf, len, 1, in_file) == 1);
+}
+
+static void reset_definitions (void)
+{
+    for (size_t i = 0; i < num_formats; i++) {
+        if (formats[i]) {
+            free(formats[i]->str);
+            free(formats[i]);
+        }
+    }
+    free(formats);
+    formats = NULL;
+    num_formats = 0;
+    
+    for (size_t i = 0; i <= UINT16_MAX; i++) {
+        free(channels[i]);
+        channels[i] = NULL;
+    }
+}
+
+static void out_append (const char *data, size_t len)
+{
+    size_t avail = (MAX_OUTPUT - 1) - out_len;
+    if (len > avail) {
+        len = avail;
+    }
+    memcpy(out + out_len, data, len);
+    out_len += len;
+}
+
+static const char * take (size_t len)
+{
+    if (len > payload_left) {
+        return NULL;
+    }
+    const char *ptr = payload;
+    payload += len;
+    payload_left -= len;
+    return ptr;
+}
+
+static void append_literal (const char *str, size_t len)
+{
+    size_t i = 0;
+    while (i < len) {
+        out_append(&str[i], 1);
+        // "%%" was left for printf
+        i += (str[i] == '%' && i + 1 < len && str[i + 1] == '%') ? 2 : 1;
+    }
+}
+
+#define PRINT_CONV(val) \
+    do { \
+        if (conv->star_width && conv->star_prec) { \
+            w = snprintf(tmp, sizeof(tmp), spec, width, prec, (val)); \
+        } else if (conv->star_width) { \
+            w = snprintf(tmp, sizeof(tmp), spec, width, (val)); \
+        } else if (conv->star_prec) { \
+            w = snprintf(tmp, sizeof(tmp), spec, prec, (val)); \
+        } else { \
+            w = snprintf(tmp, sizeof(tmp), spec, (val)); \
+        } \
+    } while (0)
+
+static int render_conv (const struct format *f, const struct BLogBinary_conv *conv)
+{
+    char spec[MAX_SPEC];
+    char tmp[1024];
+    int width = 0;
+    int prec = 0;
+    int w = 0;
+    const char *p;
+    
+    if (conv->spec_len >= MAX_SPEC) {
+        return 0;
+    }
+    memcpy(spec, f->str + conv->spec_start, conv->spec_len);
+    spec[conv->spec_len] = '\0';
+    
+    if (conv->star_width) {
+        if (!(p = take(4))) {
+            return 0;
+        }
+        width = (int32_t)badvpn_read_le32(p);
+    }
+    
+    if (conv->star_prec) {
+        if (!(p = take(4))) {
+            return 0;
+        }
+        prec = (int32_t)badvpn_read_le32(p);
+    }
+    
+    if (conv->type == BLOG_BINARY_ARG_STRING) {
+        if (!(p = take(2))) {
+            return 0;
+        }
+        size_t len = badvpn_read_le16(p);
+        if (len > BLOG_BINARY_MAX_STRING || !(p = take(len))) {
+            return 0;
+        }
+        char str[BLOG_BINARY_MAX_STRING + 1];
+        memcpy(str, p, len);
+        str[len] = '\0';
+        PRINT_CONV(str);
+    }
+    else if (conv->type == BLOG_BINARY_ARG_INT) {
+        if (!(p = take(4))) {
+            return 0;
+        }
+        PRINT_CONV((int)(int32_t)badvpn_read_le32(p));
+    }
+    else {
+        if (!(p = take(8))) {
+            return 0;
+        }
+        uint64_t x = badvpn_read_le64(p);
+        double d;
+        memcpy(&d, &x, sizeof(d));
+        
+        switch (conv->type) {
+            case BLOG_BINARY_ARG_LONG:
+                PRINT_CONV((long)(int64_t)x);
+                break;
+            case BLOG_BINARY_ARG_LLONG:
+                PRINT_CONV((long long)(int64_t)x);
+                break;
+            case BLOG_BINARY_ARG_SIZE:
+                PRINT_CONV((size_t)x);
+                break;
+            case BLOG_BINARY_ARG_INTMAX:
+                PRINT_CONV((intmax_t)(int64_t)x);
+                break;
+            case BLOG_BINARY_ARG_PTRDIFF:
+                PRINT_CONV((ptrdiff_t)(int64_t)x);
+                break;
+            case BLOG_BINARY_ARG_DOUBLE:
+                PRINT_CONV(d);
+                break;
+            case BLOG_BINARY_ARG_LDOUBLE:
+                PRINT_CONV((long double)d);
+                break;
+            case BLOG_BINARY_ARG_POINTER:
+                PRINT_CONV((void *)(uintptr_t)x);
+                break;
+            default:
+                return 0;
+        }
+    }
+    
+    if (w > 0) {
+        out_append(tmp, (w < sizeof(tmp) ? w : sizeof(tmp) - 1));
+    }
+    
+    return 1;
+}
+
+static int render_format_segment (void)
+{
+    const char *p = take(4);
+    if (!p) {
+        return 0;
+    }
+    uint32_t id = badvpn_read_le32(p);
+    
+    if (id >= num_formats || !formats[id]) {
+        fprintf(stderr, "undefined format %"PRIu32"\n", id);
+        return 0;
+    }
+    struct format *f = formats[id];
+    
+    size_t pos = 0;
+    for (int i = 0; i < f->num_convs; i++) {
+        const struct BLogBinary_conv *conv = &f->convs[i];
+        append_literal(f->str + pos, conv->spec_start - pos);
+        if (!render_conv(f, conv)) {
+            return 0;
+        }
+        pos = conv->spec_start + conv->spec_len;
+    }
+    append_literal(f->str + pos, strlen(f->str + pos));
+    
+    return 1;
+}
+
+static int render_raw_segment (void)
+{
+    const char *p = take(2);
+    if (!p) {
+        return 0;
+    }
+    int type = badvpn_read_le8(p);
+    size_t len = badvpn_read_le8(p + 1);
+    if (!(p = take(len))) {
+        return 0;
+    }
+    
+    switch (type) {
+        case BLOG_RAW_BADDR: {
+            BAddr addr;
+            if (len == 7 && p[0] == BADDR_TYPE_IPV4) {
+                addr.type = BADDR_TYPE_IPV4;
+                memcpy(&addr.ipv4.ip, p + 1, 4);
+                memcpy(&addr.ipv4.port, p + 5, 2);
+            }
+            else if (len == 19 && p[0] == BADDR_TYPE_IPV6) {
+                addr.type = BADDR_TYPE_IPV6;
+                memcpy(addr.ipv6.ip, p + 1, 16);
+                memcpy(&addr.ipv6.port, p + 17, 2);
+            }
+            else {
+                return 0;
+            }
+            char str[BADDR_MAX_PRINT_LEN];
+            BAddr_Print(&addr, str);
+            out_append(str, strlen(str));
+        } break;
+        
+        default:
+            out_append("(?)", 3);
+    }
+    
+    return 1;
+}
+
+static int render_message (const char *data, size_t len)
+{
+    payload = data;
+    payload_left = len;
+    out_len = 0;
+    
+    while (payload_left > 0) {
+        const char *p = take(1);
+        switch (*p) {
+            case BLOG_BINARY_SEG_FORMAT:
+                if (!render_format_segment()) {
+                    return 0;
+                }
+                break;
+            
+            case BLOG_BINARY_SEG_BYTES:
+            case BLOG_BINARY_SEG_TEXT: {
+                if (!(p = take(2))) {
+                    return 0;
+                }
+                size_t data_len = badvpn_read_le16(p);
+                if (!(p = take(data_len))) {
+                    return 0;
+                }
+                out_append(p, data_len);
+            } break;
+            
+            case BLOG_BINARY_SEG_RAW:
+                if (!render_raw_segment()) {
+                    return 0;
+                }
+                break;
+            
+            default:
+                return 0;
+        }
+    }
+    
+    out[out_len] = '\0';
+    return 1;
+}
+
+static int process_record (int type)
+{
+    char hdr[8];
+    
+    switch (type) {
+        case BLOG_BINARY_REC_START: {
+            if (!read_exact(hdr, BLOG_BINARY_MAGIC_LEN - 1) || memcmp(hdr, BLOG_BINARY_MAGIC + 1, BLOG_BINARY_MAGIC_LEN - 1)) {
+                fprintf(stderr, "bad magic\n");
+                return 0;
+            }
+            reset_definitions();
+        } break;
+        
+        case BLOG_BINARY_REC_FORMAT: {
+            if (!read_exact(hdr, 6)) {
+                return 0;
+            }
+            uint32_t id = badvpn_read_le32(hdr);
+            size_t len = badvpn_read_le16(hdr + 4);
+            
+            struct format *f = malloc(sizeof(*f));
+            if (!f || !(f->str = malloc(len + 1))) {
+                free(f);
+                return 0;
+            }
+            if (!read_exact(f->str, len)) {
+                free(f->str);
+                free(f);
+                return 0;
+            }
+            f->str[len] = '\0';
+            if (!BLogBinary_ParseFormat(f->str, f->convs, &f->num_convs)) {
+                fprintf(stderr, "bad format %"PRIu32"\n", id);
+                free(f->str);
+                free(f);
+                return 0;
+            }
+            
+            if (id >= num_formats) {
+                size_t new_num = (id < 64 ? 128 : 2 * (size_t)id);
+                struct format **new_formats = realloc(formats, new_num * sizeof(formats[0]));
+                if (!new_formats) {
+                    free(f->str);
+                    free(f);
+                    return 0;
+                }
+                memset(new_formats + num_formats, 0, (new_num - num_formats) * sizeof(formats[0]));
+                formats = new_formats;
+                num_formats = new_num;
+            }
+            if (formats[id]) {
+                free(formats[id]->str);
+                free(formats[id]);
+            }
+            formats[id] = f;
+        } break;
+        
+        case BLOG_BINARY_REC_CHANNEL: {
+            if (!read_exact(hdr, 3)) {
+                return 0;
+            }
+            int channel = badvpn_read_le16(hdr);
+            size_t len = badvpn_read_le8(hdr + 2);
+            char *name = malloc(len + 1);
+            if (!name || !read_exact(name, len)) {
+                free(name);
+                return 0;
+            }
+            name[len] = '\0';
+            free(channels[channel]);
+            channels[channel] = name;
+        } break;
+        
+        case BLOG_BINARY_REC_MESSAGE: {
+            if (!read_exact(hdr, 5)) {
+                return 0;
+            }
+            int channel = badvpn_read_le16(hdr);
+            int level = badvpn_read_le8(hdr + 2);
+            size_t len = badvpn_read_le16(hdr + 3);
+            
+            static char data[UINT16_MAX];
+            if (!read_exact(data, len)) {
+                return 0;
+            }
+            
+            if (level < BLOG_ERROR || level > BLOG_DEBUG || !render_message(data, len)) {
+                fprintf(stderr, "bad message record\n");
+                return 0;
+            }
+            
+            printf("%s(%s): %s\n", level_names[level], (channels[channel] ? channels[channel] : "?"), out);
+        } break;
+        
+        default:
+            fprintf(stderr, "bad record type %d\n", type);
+            return 0;
+    }
+    
+    return 1;
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [<file>]\n", (argc > 0 ? argv[0] : ""));
+        return 1;
+    }
+    
+    if (argc == 2) {
+        if (!(in_file = fopen(argv[1], "rb"))) {
+            fprintf(stderr, "failed to open %s\n", argv[1]);
+            return 1;
+        }
+    } else {
+        in_file = stdin;
+    }
+    
+    int res = 0;
+    int type;
+    
+    while ((type = getc(in_file)) != EOF) {
+        if (!process_record(type)) {
+            res = 1;
+            break;
+        }
+    }
+    
+    reset_definitions();
+    
+    if (in_file != stdin) {
+        fclose(in_file);
+    }
+    
+    return res;
+}
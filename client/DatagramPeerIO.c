@@ -34,17 +34,28 @@
 #define DATAGRAMPEERIO_MODE_NONE 0
 #define DATAGRAMPEERIO_MODE_CONNECT 1
 #define DATAGRAMPEERIO_MODE_BIND 2
+#define DATAGRAMPEERIO_MODE_SHARED_CONNECT 3
+#define DATAGRAMPEERIO_MODE_SHARED_BIND 4
 
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
 static void init_io (DatagramPeerIO *o);
 static void free_io (DatagramPeerIO *o);
+#ifndef BADVPN_USE_WINAPI
+static void init_shared_io (DatagramPeerIO *o);
+static void free_shared_io (DatagramPeerIO *o);
+#endif
 static void dgram_handler (DatagramPeerIO *o, int event);
 static void reset_mode (DatagramPeerIO *o);
 static void recv_decoder_notifier_handler (DatagramPeerIO *o, uint8_t *data, int data_len);
 
 void init_io (DatagramPeerIO *o)
 {
+    // enable busy polling
+    if (o->busy_poll_us > 0 && !BDatagram_SetBusyPoll(&o->dgram, o->busy_poll_us)) {
+        PeerLog(o, BLOG_WARNING, "BDatagram_SetBusyPoll failed");
+    }
+    
     // init dgram recv interface
     BDatagram_RecvAsync_Init(&o->dgram, o->effective_socket_mtu);
     
@@ -73,6 +84,28 @@ void free_io (DatagramPeerIO *o)
     BDatagram_RecvAsync_Free(&o->dgram);
 }
 
+#ifndef BADVPN_USE_WINAPI
+
+void init_shared_io (DatagramPeerIO *o)
+{
+    // connect source
+    PacketRecvConnector_ConnectInput(&o->recv_connector, DatagramSharedSocket_Port_GetRecvIf(&o->port));
+    
+    // connect sink
+    PacketPassConnector_ConnectOutput(&o->send_connector, DatagramSharedSocket_Port_GetSendIf(&o->port));
+}
+
+void free_shared_io (DatagramPeerIO *o)
+{
+    // disconnect sink
+    PacketPassConnector_DisconnectOutput(&o->send_connector);
+    
+    // disconnect source
+    PacketRecvConnector_DisconnectInput(&o->recv_connector);
+}
+
+#endif
+
 void dgram_handler (DatagramPeerIO *o, int event)
 {
     DebugObject_Access(&o->d_obj);
@@ -92,8 +125,6 @@ void dgram_handler (DatagramPeerIO *o, int event)
 
 void reset_mode (DatagramPeerIO *o)
 {
-    ASSERT(o->mode == DATAGRAMPEERIO_MODE_NONE || o->mode == DATAGRAMPEERIO_MODE_CONNECT || o->mode == DATAGRAMPEERIO_MODE_BIND)
-    
     if (o->mode == DATAGRAMPEERIO_MODE_NONE) {
         return;
     }
@@ -101,11 +132,29 @@ void reset_mode (DatagramPeerIO *o)
     // remove recv notifier handler
     PacketPassNotifier_SetHandler(&o->recv_notifier, NULL, NULL);
     
-    // free I/O
-    free_io(o);
-    
-    // free datagram object
-    BDatagram_Free(&o->dgram);
+    switch (o->mode) {
+        case DATAGRAMPEERIO_MODE_CONNECT:
+        case DATAGRAMPEERIO_MODE_BIND: {
+            // free I/O
+            free_io(o);
+            
+            // free datagram object
+            BDatagram_Free(&o->dgram);
+        } break;
+        
+#ifndef BADVPN_USE_WINAPI
+        case DATAGRAMPEERIO_MODE_SHARED_CONNECT:
+        case DATAGRAMPEERIO_MODE_SHARED_BIND: {
+            // free I/O
+            free_shared_io(o);
+            
+            // free port
+            DatagramSharedSocket_Port_Free(&o->port);
+        } break;
+#endif
+        
+        default: ASSERT(0);
+    }
     
     // set mode
     o->mode = DATAGRAMPEERIO_MODE_NONE;
@@ -113,9 +162,21 @@ void reset_mode (DatagramPeerIO *o)
 
 void recv_decoder_notifier_handler (DatagramPeerIO *o, uint8_t *data, int data_len)
 {
-    ASSERT(o->mode == DATAGRAMPEERIO_MODE_BIND)
+    ASSERT(o->mode == DATAGRAMPEERIO_MODE_BIND || o->mode == DATAGRAMPEERIO_MODE_SHARED_BIND)
     DebugObject_Access(&o->d_obj);
     
+#ifndef BADVPN_USE_WINAPI
+    if (o->mode == DATAGRAMPEERIO_MODE_SHARED_BIND) {
+        BAddr addr;
+        BIPAddr local_addr;
+        ASSERT_EXECUTE(DatagramSharedSocket_Port_GetLastReceiveAddrs(&o->port, &addr, &local_addr))
+        
+        // update addresses
+        DatagramSharedSocket_Port_SetSendAddrs(&o->port, addr, local_addr);
+        return;
+    }
+#endif
+    
     // obtain addresses from last received packet
     BAddr addr;
     BIPAddr local_addr;
@@ -142,6 +203,7 @@ int DatagramPeerIO_Init (
     PacketPassInterface *recv_userif,
     int otp_warning_count,
     BThreadWorkDispatcher *twd,
+    int pipeline_depth,
     void *user,
     BLog_logfunc logfunc,
     DatagramPeerIO_handler_error handler_error,
@@ -153,6 +215,7 @@ int DatagramPeerIO_Init (
     ASSERT(socket_mtu >= 0)
     spproto_assert_security_params(sp_params);
     ASSERT(num_frames > 0)
+    ASSERT(pipeline_depth >= 1)
     ASSERT(PacketPassInterface_GetMTU(recv_userif) >= payload_mtu)
     if (SPPROTO_HAVE_OTP(sp_params)) {
         ASSERT(otp_warning_count > 0)
@@ -166,6 +229,7 @@ int DatagramPeerIO_Init (
     o->user = user;
     o->logfunc = logfunc;
     o->handler_error = handler_error;
+    o->busy_poll_us = 0;
     
     // check num frames (for FragmentProtoAssembler)
     if (num_frames >= FPA_MAX_TIME) {
@@ -205,7 +269,7 @@ int DatagramPeerIO_Init (
     PacketPassNotifier_Init(&o->recv_notifier, FragmentProtoAssembler_GetInput(&o->recv_assembler), BReactor_PendingGroup(o->reactor));
     
     // init decoder
-    if (!SPProtoDecoder_Init(&o->recv_decoder, PacketPassNotifier_GetInput(&o->recv_notifier), o->sp_params, 2, BReactor_PendingGroup(o->reactor), twd, o->user, o->logfunc)) {
+    if (!SPProtoDecoder_Init(&o->recv_decoder, PacketPassNotifier_GetInput(&o->recv_notifier), o->sp_params, 2, BReactor_PendingGroup(o->reactor), twd, pipeline_depth, o->user, o->logfunc)) {
         PeerLog(o, BLOG_ERROR, "SPProtoDecoder_Init failed");
         goto fail1;
     }
@@ -226,7 +290,7 @@ int DatagramPeerIO_Init (
     FragmentProtoDisassembler_Init(&o->send_disassembler, o->reactor, o->payload_mtu, o->spproto_payload_mtu, -1, latency);
     
     // init encoder
-    if (!SPProtoEncoder_Init(&o->send_encoder, FragmentProtoDisassembler_GetOutput(&o->send_disassembler), o->sp_params, otp_warning_count, BReactor_PendingGroup(o->reactor), twd)) {
+    if (!SPProtoEncoder_Init(&o->send_encoder, FragmentProtoDisassembler_GetOutput(&o->send_disassembler), o->sp_params, otp_warning_count, BReactor_PendingGroup(o->reactor), twd, pipeline_depth)) {
         PeerLog(o, BLOG_ERROR, "SPProtoEncoder_Init failed");
         goto fail3;
     }
@@ -364,21 +428,95 @@ fail0:
     return 0;
 }
 
-void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key)
+#ifndef BADVPN_USE_WINAPI
+
+int DatagramPeerIO_ConnectShared (DatagramPeerIO *o, DatagramSharedSocket *shared, BAddr addr, int have_connid, uint64_t connid)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(DatagramSharedSocket_GetMTU(shared) >= o->effective_socket_mtu)
+    ASSERT(have_connid == 0 || have_connid == 1)
+    
+    // reset mode
+    reset_mode(o);
+    
+    // check address
+    if (addr.type != DatagramSharedSocket_GetFamily(shared)) {
+        PeerLog(o, BLOG_ERROR, "address family does not match shared socket");
+        goto fail0;
+    }
+    
+    // init port
+    if (!DatagramSharedSocket_Port_InitConnect(&o->port, shared, o->effective_socket_mtu, addr, have_connid, connid)) {
+        PeerLog(o, BLOG_ERROR, "DatagramSharedSocket_Port_InitConnect failed");
+        goto fail0;
+    }
+    
+    // init I/O
+    init_shared_io(o);
+    
+    // set mode
+    o->mode = DATAGRAMPEERIO_MODE_SHARED_CONNECT;
+    
+    return 1;
+    
+fail0:
+    return 0;
+}
+
+int DatagramPeerIO_BindShared (DatagramPeerIO *o, DatagramSharedSocket *shared, uint64_t *out_connid)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(DatagramSharedSocket_GetMTU(shared) >= o->effective_socket_mtu)
+    
+    // reset mode
+    reset_mode(o);
+    
+    // init port
+    if (!DatagramSharedSocket_Port_InitBind(&o->port, shared, o->effective_socket_mtu, out_connid)) {
+        PeerLog(o, BLOG_ERROR, "DatagramSharedSocket_Port_InitBind failed");
+        goto fail0;
+    }
+    
+    // init I/O
+    init_shared_io(o);
+    
+    // set recv notifier handler
+    PacketPassNotifier_SetHandler(&o->recv_notifier, (PacketPassNotifier_handler_notify)recv_decoder_notifier_handler, o);
+    
+    // set mode
+    o->mode = DATAGRAMPEERIO_MODE_SHARED_BIND;
+    
+    return 1;
+    
+fail0:
+    return 0;
+}
+
+#endif
+
+void DatagramPeerIO_SetBusyPoll (DatagramPeerIO *o, int usecs)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(usecs >= 0)
+    
+    o->busy_poll_us = usecs;
+}
+
+void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key, int aead_role)
 {
-    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(SPPROTO_HAVE_KEY(o->sp_params))
     DebugObject_Access(&o->d_obj);
     
     // set sending key
-    SPProtoEncoder_SetEncryptionKey(&o->send_encoder, encryption_key);
+    SPProtoEncoder_SetEncryptionKey(&o->send_encoder, encryption_key, aead_role);
     
     // set receiving key
-    SPProtoDecoder_SetEncryptionKey(&o->recv_decoder, encryption_key);
+    SPProtoDecoder_SetEncryptionKey(&o->recv_decoder, encryption_key, aead_role);
 }
 
 void DatagramPeerIO_RemoveEncryptionKey (DatagramPeerIO *o)
 {
-    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(SPPROTO_HAVE_KEY(o->sp_params))
     DebugObject_Access(&o->d_obj);
     
     // remove sending key
@@ -55,6 +55,10 @@
 #include <client/SPProtoEncoder.h>
 #include <client/SPProtoDecoder.h>
 
+#ifndef BADVPN_USE_WINAPI
+#include <client/DatagramSharedSocket.h>
+#endif
+
 /**
  * Callback function invoked when an error occurs with the peer connection.
  * The object has entered default state.
@@ -95,6 +99,8 @@ typedef void (*DatagramPeerIO_handler_otp_ready) (void *user);
  *                 Datagrams are being received on the socket. Datagrams are not being
  *                 sent initially. When a datagram is received, its source address is
  *                 used as a destination address for sending datagrams.
+ *     - shared connecting, shared binding - like connecting and binding, but using a
+ *                 port on a {@link DatagramSharedSocket} instead of an own socket.
  */
 typedef struct {
     DebugObject d_obj;
@@ -104,6 +110,7 @@ typedef struct {
     void *user;
     BLog_logfunc logfunc;
     DatagramPeerIO_handler_error handler_error;
+    int busy_poll_us;
     int spproto_payload_mtu;
     int effective_socket_mtu;
     
@@ -125,6 +132,11 @@ typedef struct {
     
     // datagram object
     BDatagram dgram;
+    
+#ifndef BADVPN_USE_WINAPI
+    // shared socket port
+    DatagramSharedSocket_port port;
+#endif
 } DatagramPeerIO;
 
 /**
@@ -148,6 +160,8 @@ typedef struct {
  * @param otp_warning_count If using OTPs, after how many encoded packets to call the handler.
  *                          In this case, must be >0 and <=sp_params.otp_num.
  * @param twd thread work dispatcher
+ * @param pipeline_depth number of packets which may be encrypted and decrypted at once,
+ *                       see {@link SPProtoEncoder_Init}. Must be >=1.
  * @param user value to pass to handlers
  * @param logfunc function which prepends the log prefix using {@link BLog_Append}
  * @param handler_error error handler
@@ -166,6 +180,7 @@ int DatagramPeerIO_Init (
     PacketPassInterface *recv_userif,
     int otp_warning_count,
     BThreadWorkDispatcher *twd,
+    int pipeline_depth,
     void *user,
     BLog_logfunc logfunc,
     DatagramPeerIO_handler_error handler_error,
@@ -213,18 +228,65 @@ int DatagramPeerIO_Connect (DatagramPeerIO *o, BAddr addr) WARN_UNUSED;
  */
 int DatagramPeerIO_Bind (DatagramPeerIO *o, BAddr addr) WARN_UNUSED;
 
+#ifndef BADVPN_USE_WINAPI
+
+/**
+ * Attempts to establish connection to the peer which has bound to an address,
+ * using a port on a shared socket.
+ * On success, the interface enters shared connecting mode.
+ * On failure, the interface enters default mode.
+ *
+ * @param o the object
+ * @param shared shared socket. Its MTU must be >= the socket MTU given to
+ *               {@link DatagramPeerIO_Init}.
+ * @param addr address to send packets to. Its family must match the shared socket.
+ * @param have_connid whether the peer bound to a shared socket and gave us a
+ *                    connection ID. Must be 0 or 1.
+ * @param connid connection ID to put in front of sent datagrams, if have_connid is 1
+ * @return 1 on success, 0 on failure
+ */
+int DatagramPeerIO_ConnectShared (DatagramPeerIO *o, DatagramSharedSocket *shared, BAddr addr, int have_connid, uint64_t connid) WARN_UNUSED;
+
+/**
+ * Prepares for the peer to connect to a shared socket.
+ * On success, the interface enters shared binding mode.
+ * On failure, the interface enters default mode.
+ *
+ * @param o the object
+ * @param shared shared socket. Its MTU must be >= the socket MTU given to
+ *               {@link DatagramPeerIO_Init}.
+ * @param out_connid returns the connection ID which the peer must be given
+ * @return 1 on success, 0 on failure
+ */
+int DatagramPeerIO_BindShared (DatagramPeerIO *o, DatagramSharedSocket *shared, uint64_t *out_connid) WARN_UNUSED;
+
+#endif
+
+/**
+ * Sets the SO_BUSY_POLL time for sockets created by subsequent
+ * {@link DatagramPeerIO_Connect} and {@link DatagramPeerIO_Bind} calls.
+ * Failure to set the option is not fatal.
+ *
+ * @param o the object
+ * @param usecs busy poll time in microseconds. Must be >=0; 0 leaves the
+ *              socket default.
+ */
+void DatagramPeerIO_SetBusyPoll (DatagramPeerIO *o, int usecs);
+
 /**
  * Sets the encryption key to use for sending and receiving.
- * Encryption must be enabled.
+ * Encryption or AEAD must be enabled.
  *
  * @param o the object
  * @param encryption_key key to use
+ * @param aead_role our role, see {@link SPProtoEncoder_SetEncryptionKey}. The
+ *                  peer must use the other role.
  */
-void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key);
+void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key, int aead_role);
 
 /**
  * Removed the encryption key to use for sending and receiving.
- * Encryption must be enabled.
+ * Encryption or AEAD must be enabled.
  *
  * @param o the object
  */
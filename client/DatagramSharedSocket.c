@@ -0,0 +1,1115 @@
+/**
+ * @file DatagramSharedSocket.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <misc/balloc.h>
+#include <misc/nonblocking.h>
+#include <misc/read_write_int.h>
+#include <misc/hashfun.h>
+#include <misc/offset.h>
+#include <system/BNetwork.h>
+#include <security/BRandom.h>
+
+#include <client/DatagramSharedSocket.h>
+
+#include <generated/blog_channel_DatagramSharedSocket.h>
+
+#define HASH_BUCKETS 1024
+
+struct sys_addr {
+    socklen_t len;
+    union {
+        struct sockaddr generic;
+        struct sockaddr_in ipv4;
+        struct sockaddr_in6 ipv6;
+    } addr;
+};
+
+struct DatagramSharedSocket_sock {
+    DatagramSharedSocket *s;
+    int fd;
+    BFileDescriptor bfd;
+    int wait_events;
+};
+
+struct DatagramSharedSocket_msg {
+    struct sys_addr addr;
+    struct iovec iov;
+    union {
+#ifdef BADVPN_FREEBSD
+        char in[CMSG_SPACE(sizeof(struct in_addr))];
+#else
+        char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#endif
+        char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    } cdata;
+};
+
+#ifdef BADVPN_LINUX
+typedef struct mmsghdr sys_mmsghdr;
+#else
+typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} sys_mmsghdr;
+#endif
+
+static size_t addr_hash (BAddr *addr)
+{
+    switch (addr->type) {
+        case BADDR_TYPE_IPV4:
+            return (size_t)(((uint64_t)addr->ipv4.ip << 16 | addr->ipv4.port) * UINT64_C(0x9E3779B97F4A7C15) >> 32);
+        case BADDR_TYPE_IPV6:
+            return badvpn_djb2_hash_bin(addr->ipv6.ip, sizeof(addr->ipv6.ip)) * 31 + addr->ipv6.port;
+        default:
+            return 0;
+    }
+}
+
+#include "DatagramSharedSocket_addrhash.h"
+#include <structure/CHash_impl.h>
+
+#include "DatagramSharedSocket_idhash.h"
+#include <structure/CHash_impl.h>
+
+static int family_socket_to_sys (int family)
+{
+    switch (family) {
+        case BADDR_TYPE_IPV4:
+            return AF_INET;
+        case BADDR_TYPE_IPV6:
+            return AF_INET6;
+    }
+    
+    ASSERT(0);
+    return 0;
+}
+
+static void addr_socket_to_sys (struct sys_addr *out, BAddr addr)
+{
+    switch (addr.type) {
+        case BADDR_TYPE_IPV4: {
+            out->len = sizeof(out->addr.ipv4);
+            memset(&out->addr.ipv4, 0, sizeof(out->addr.ipv4));
+            out->addr.ipv4.sin_family = AF_INET;
+            out->addr.ipv4.sin_port = addr.ipv4.port;
+            out->addr.ipv4.sin_addr.s_addr = addr.ipv4.ip;
+        } break;
+        
+        case BADDR_TYPE_IPV6: {
+            out->len = sizeof(out->addr.ipv6);
+            memset(&out->addr.ipv6, 0, sizeof(out->addr.ipv6));
+            out->addr.ipv6.sin6_family = AF_INET6;
+            out->addr.ipv6.sin6_port = addr.ipv6.port;
+            memcpy(out->addr.ipv6.sin6_addr.s6_addr, addr.ipv6.ip, 16);
+        } break;
+        
+        default: ASSERT(0);
+    }
+}
+
+static void addr_sys_to_socket (BAddr *out, struct sys_addr *addr)
+{
+    switch (addr->addr.generic.sa_family) {
+        case AF_INET: {
+            BAddr_InitIPv4(out, addr->addr.ipv4.sin_addr.s_addr, addr->addr.ipv4.sin_port);
+        } break;
+        
+        case AF_INET6: {
+            BAddr_InitIPv6(out, addr->addr.ipv6.sin6_addr.s6_addr, addr->addr.ipv6.sin6_port);
+        } break;
+        
+        default: {
+            BAddr_InitNone(out);
+        } break;
+    }
+}
+
+static void set_pktinfo (int fd, int family)
+{
+    int opt = 1;
+    
+    switch (family) {
+        case BADDR_TYPE_IPV4: {
+#ifdef BADVPN_FREEBSD
+            if (setsockopt(fd, IPPROTO_IP, IP_RECVDSTADDR, &opt, sizeof(opt)) < 0) {
+                BLog(BLOG_ERROR, "setsockopt(IP_RECVDSTADDR) failed");
+            }
+#else
+            if (setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &opt, sizeof(opt)) < 0) {
+                BLog(BLOG_ERROR, "setsockopt(IP_PKTINFO) failed");
+            }
+#endif
+        } break;
+        
+#ifdef IPV6_RECVPKTINFO
+        case BADDR_TYPE_IPV6: {
+            if (setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &opt, sizeof(opt)) < 0) {
+                BLog(BLOG_ERROR, "setsockopt(IPV6_RECVPKTINFO) failed");
+            }
+        } break;
+#endif
+    }
+}
+
+static void read_local_addr (struct msghdr *msg, BIPAddr *out)
+{
+    BIPAddr_InitInvalid(out);
+    
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+#ifdef BADVPN_FREEBSD
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
+            struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
+            BIPAddr_InitIPv4(out, addrinfo->s_addr);
+        }
+#else
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+            BIPAddr_InitIPv4(out, pktinfo->ipi_addr.s_addr);
+        }
+#endif
+        else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+            struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+            BIPAddr_InitIPv6(out, pktinfo->ipi6_addr.s6_addr);
+        }
+    }
+}
+
+static size_t write_local_addr (struct DatagramSharedSocket_msg *m, BIPAddr local_addr)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = &m->cdata;
+    msg.msg_controllen = sizeof(m->cdata);
+    
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    
+    switch (local_addr.type) {
+        case BADDR_TYPE_IPV4: {
+#ifdef BADVPN_FREEBSD
+            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_addr)));
+            cmsg->cmsg_level = IPPROTO_IP;
+            cmsg->cmsg_type = IP_SENDSRCADDR;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
+            struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
+            addrinfo->s_addr = local_addr.ipv4;
+            return CMSG_SPACE(sizeof(struct in_addr));
+#else
+            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_pktinfo)));
+            cmsg->cmsg_level = IPPROTO_IP;
+            cmsg->cmsg_type = IP_PKTINFO;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+            struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+            pktinfo->ipi_spec_dst.s_addr = local_addr.ipv4;
+            return CMSG_SPACE(sizeof(struct in_pktinfo));
+#endif
+        } break;
+        
+        case BADDR_TYPE_IPV6: {
+            memset(cmsg, 0, CMSG_SPACE(sizeof(struct in6_pktinfo)));
+            cmsg->cmsg_level = IPPROTO_IPV6;
+            cmsg->cmsg_type = IPV6_PKTINFO;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+            struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+            memcpy(pktinfo->ipi6_addr.s6_addr, local_addr.ipv6, 16);
+            return CMSG_SPACE(sizeof(struct in6_pktinfo));
+        } break;
+    }
+    
+    return 0;
+}
+
+static int sys_recvmmsg (int fd, sys_mmsghdr *msgs, int num)
+{
+#ifdef BADVPN_LINUX
+    return recvmmsg(fd, msgs, num, MSG_DONTWAIT, NULL);
+#else
+    int i;
+    for (i = 0; i < num; i++) {
+        ssize_t bytes = recvmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+        if (bytes < 0) {
+            return (i > 0 ? i : -1);
+        }
+        msgs[i].msg_len = bytes;
+    }
+    return i;
+#endif
+}
+
+static int sys_sendmmsg (int fd, sys_mmsghdr *msgs, int num)
+{
+#ifdef BADVPN_LINUX
+    return sendmmsg(fd, msgs, num, 0);
+#else
+    int i;
+    for (i = 0; i < num; i++) {
+        ssize_t bytes = sendmsg(fd, &msgs[i].msg_hdr, 0);
+        if (bytes < 0) {
+            return (i > 0 ? i : -1);
+        }
+        msgs[i].msg_len = bytes;
+    }
+    return i;
+#endif
+}
+
+static int buf_size (DatagramSharedSocket *o)
+{
+    return DATAGRAMSHAREDSOCKET_HEADER_SIZE + o->mtu;
+}
+
+static uint8_t ** alloc_bufs (int num, int size)
+{
+    uint8_t **bufs = (uint8_t **)BAllocArray(num, sizeof(bufs[0]));
+    if (!bufs) {
+        return NULL;
+    }
+    
+    for (int i = 0; i < num; i++) {
+        if (!(bufs[i] = (uint8_t *)BAlloc(size))) {
+            while (i-- > 0) {
+                BFree(bufs[i]);
+            }
+            BFree(bufs);
+            return NULL;
+        }
+    }
+    
+    return bufs;
+}
+
+static void free_bufs (uint8_t **bufs, int num)
+{
+    for (int i = 0; i < num; i++) {
+        BFree(bufs[i]);
+    }
+    BFree(bufs);
+}
+
+static int ips_equal (BIPAddr *addr1, BIPAddr *addr2)
+{
+    return (addr1->type == addr2->type && (addr1->type == BADDR_TYPE_NONE || BIPAddr_Compare(addr1, addr2)));
+}
+
+static void port_deliver (DatagramSharedSocket_port *o, const uint8_t *data, int data_len, BAddr *remote_addr, BIPAddr *local_addr)
+{
+    ASSERT(o->recv_data)
+    
+    memcpy(o->recv_data, data, data_len);
+    
+    o->have_last_addrs = 1;
+    o->last_remote_addr = *remote_addr;
+    o->last_local_addr = *local_addr;
+    
+    o->recv_data = NULL;
+    
+    PacketRecvInterface_Done(&o->recv_if, data_len);
+}
+
+static int port_data_offset (DatagramSharedSocket_port *o)
+{
+    // the connection ID stays in front of the payload in the buffers
+    return (o->recv_connid != 0 ? DATAGRAMSHAREDSOCKET_HEADER_SIZE : 0);
+}
+
+static void port_receive (DatagramSharedSocket_port *o, uint8_t **buf, int data_len, BAddr *remote_addr, BIPAddr *local_addr)
+{
+    DatagramSharedSocket *s = o->s;
+    
+    if (data_len > o->mtu) {
+        return;
+    }
+    
+    // pass it on directly if the user is waiting
+    if (o->recv_data) {
+        port_deliver(o, *buf + port_data_offset(o), data_len, remote_addr, local_addr);
+        return;
+    }
+    
+    // queue it, or drop it if the queue is full
+    if (o->queue_count == s->port_queue_len) {
+        return;
+    }
+    
+    // take the receive buffer in exchange for a free queue buffer, so that
+    // queued datagrams are not copied twice
+    int i = (o->queue_start + o->queue_count) % s->port_queue_len;
+    uint8_t *queue_buf = o->queue_bufs[i];
+    o->queue_bufs[i] = *buf;
+    *buf = queue_buf;
+    o->queue_lens[i] = data_len;
+    o->queue_remote_addrs[i] = *remote_addr;
+    o->queue_local_addrs[i] = *local_addr;
+    o->queue_count++;
+}
+
+static void dispatch_datagram (DatagramSharedSocket *o, uint8_t **buf, int data_len, BAddr *remote_addr, BIPAddr *local_addr)
+{
+    uint8_t *data = *buf;
+    
+    DatagramSharedSocket_port *port = DatagramSharedSocket__AddrHash_Lookup(&o->addr_hash, 0, remote_addr).ptr;
+    
+    if (port) {
+        // ports in bind mode always receive a connection ID
+        if (port->recv_connid != 0) {
+            if (data_len < DATAGRAMSHAREDSOCKET_HEADER_SIZE || badvpn_read_le64((char *)data) != port->recv_connid) {
+                return;
+            }
+            data_len -= DATAGRAMSHAREDSOCKET_HEADER_SIZE;
+        }
+    } else {
+        // unknown source address, look at the connection ID
+        if (data_len < DATAGRAMSHAREDSOCKET_HEADER_SIZE) {
+            return;
+        }
+        
+        uint64_t connid = badvpn_read_le64((char *)data);
+        if (connid == 0) {
+            return;
+        }
+        
+        port = DatagramSharedSocket__IdHash_Lookup(&o->id_hash, 0, connid).ptr;
+        if (!port) {
+            return;
+        }
+        
+        data_len -= DATAGRAMSHAREDSOCKET_HEADER_SIZE;
+    }
+    
+    port_receive(port, buf, data_len, remote_addr, local_addr);
+}
+
+static int recv_batch (struct DatagramSharedSocket_sock *sock)
+{
+    DatagramSharedSocket *o = sock->s;
+    sys_mmsghdr *mmsgs = (sys_mmsghdr *)o->recv_mmsgs;
+    
+    // prepare message headers
+    for (int i = 0; i < o->batch_size; i++) {
+        struct DatagramSharedSocket_msg *m = &o->recv_msgs[i];
+        struct msghdr *msg = &mmsgs[i].msg_hdr;
+        
+        m->iov.iov_base = o->recv_bufs[i];
+        m->iov.iov_len = buf_size(o);
+        
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_name = &m->addr.addr.generic;
+        msg->msg_namelen = sizeof(m->addr.addr);
+        msg->msg_iov = &m->iov;
+        msg->msg_iovlen = 1;
+        msg->msg_control = &m->cdata;
+        msg->msg_controllen = sizeof(m->cdata);
+    }
+    
+    // receive a batch
+    int num = sys_recvmmsg(sock->fd, mmsgs, o->batch_size);
+    if (num < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            BLog(BLOG_ERROR, "recvmmsg failed");
+        }
+        return 0;
+    }
+    
+    // pass datagrams to ports
+    for (int i = 0; i < num; i++) {
+        struct DatagramSharedSocket_msg *m = &o->recv_msgs[i];
+        struct msghdr *msg = &mmsgs[i].msg_hdr;
+        
+        if ((msg->msg_flags & MSG_TRUNC)) {
+            continue;
+        }
+        
+        m->addr.len = msg->msg_namelen;
+        BAddr remote_addr;
+        addr_sys_to_socket(&remote_addr, &m->addr);
+        if (remote_addr.type != o->family) {
+            continue;
+        }
+        
+        BIPAddr local_addr;
+        read_local_addr(msg, &local_addr);
+        
+        dispatch_datagram(o, &o->recv_bufs[i], mmsgs[i].msg_len, &remote_addr, &local_addr);
+    }
+    
+    return num;
+}
+
+static void do_recv (struct DatagramSharedSocket_sock *sock)
+{
+    // keep receiving while batches come full
+    for (int i = 0; i < DATAGRAMSHAREDSOCKET_RECV_BATCH_LIMIT; i++) {
+        if (recv_batch(sock) < sock->s->batch_size) {
+            break;
+        }
+    }
+}
+
+static void append_send (DatagramSharedSocket *o, DatagramSharedSocket_port *port)
+{
+    ASSERT(o->send_start + o->send_count < o->batch_size)
+    ASSERT(port->send_busy)
+    ASSERT(port->have_remote)
+    
+    int i = o->send_start + o->send_count;
+    struct DatagramSharedSocket_msg *m = &o->send_msgs[i];
+    struct msghdr *msg = &((sys_mmsghdr *)o->send_mmsgs)[i].msg_hdr;
+    uint8_t *buf = o->send_bufs + (size_t)i * buf_size(o);
+    
+    // write connection ID and payload
+    int len = 0;
+    if (port->have_send_connid) {
+        badvpn_write_le64(port->send_connid, (char *)buf);
+        len += DATAGRAMSHAREDSOCKET_HEADER_SIZE;
+    }
+    memcpy(buf + len, port->send_data, port->send_data_len);
+    len += port->send_data_len;
+    
+    m->iov.iov_base = buf;
+    m->iov.iov_len = len;
+    addr_socket_to_sys(&m->addr, port->remote_addr);
+    
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &m->addr.addr.generic;
+    msg->msg_namelen = m->addr.len;
+    msg->msg_iov = &m->iov;
+    msg->msg_iovlen = 1;
+    msg->msg_controllen = write_local_addr(m, port->local_addr);
+    msg->msg_control = (msg->msg_controllen > 0 ? &m->cdata : NULL);
+    
+    o->send_count++;
+}
+
+static void flush_send (DatagramSharedSocket *o);
+
+static void request_flush (DatagramSharedSocket *o)
+{
+    struct DatagramSharedSocket_sock *sock = &o->socks[o->send_sock];
+    
+    // wait for the socket to become writable
+    if (!(sock->wait_events & BREACTOR_WRITE)) {
+        sock->wait_events |= BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->reactor, &sock->bfd, sock->wait_events);
+    }
+}
+
+static void port_send (DatagramSharedSocket_port *o)
+{
+    ASSERT(o->send_busy)
+    ASSERT(!o->send_waiting)
+    ASSERT(o->have_remote)
+    DatagramSharedSocket *s = o->s;
+    
+    // wait if the batch is full, the socket is blocked or we have sent enough
+    // in this reactor iteration
+    if (s->send_blocked || s->send_start + s->send_count == s->batch_size || !BReactorLimit_Increment(&o->send_limit)) {
+        LinkedList1_Append(&s->send_waiting, &o->send_waiting_node);
+        o->send_waiting = 1;
+        
+        // accept it once the socket is writable
+        request_flush(s);
+        return;
+    }
+    
+    // copy the packet into the batch
+    append_send(s, o);
+    
+    // done with the packet
+    o->send_busy = 0;
+    PacketPassInterface_Done(&o->send_if);
+    
+    // send the batch once it is full, or when there is nothing else to do
+    if (s->send_start + s->send_count == s->batch_size) {
+        flush_send(s);
+    } else {
+        request_flush(s);
+    }
+}
+
+static void flush_send (DatagramSharedSocket *o)
+{
+    ASSERT(!o->send_blocked)
+    
+    while (o->send_count > 0) {
+        struct DatagramSharedSocket_sock *sock = &o->socks[o->send_sock];
+        
+        int num = sys_sendmmsg(sock->fd, (sys_mmsghdr *)o->send_mmsgs + o->send_start, o->send_count);
+        if (num < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // wait for the socket
+                o->send_blocked = 1;
+                request_flush(o);
+                return;
+            }
+            
+            // drop the datagram which failed
+            BLog(BLOG_NOTICE, "sendmmsg failed");
+            num = 1;
+        }
+        
+        o->send_start += num;
+        o->send_count -= num;
+    }
+    
+    o->send_start = 0;
+    
+    // spread sending over the sockets
+    o->send_sock = (o->send_sock + 1) % o->num_socks;
+}
+
+static void admit_waiting (DatagramSharedSocket *o)
+{
+    ASSERT(!o->send_blocked)
+    
+    // accept packets which were waiting
+    while (!LinkedList1_IsEmpty(&o->send_waiting)) {
+        // make room
+        if (o->send_count == o->batch_size) {
+            flush_send(o);
+            if (o->send_blocked) {
+                return;
+            }
+        }
+        
+        DatagramSharedSocket_port *port = UPPER_OBJECT(LinkedList1_GetFirst(&o->send_waiting), DatagramSharedSocket_port, send_waiting_node);
+        ASSERT(port->send_waiting)
+        
+        LinkedList1_Remove(&o->send_waiting, &port->send_waiting_node);
+        port->send_waiting = 0;
+        
+        append_send(o, port);
+        
+        port->send_busy = 0;
+        PacketPassInterface_Done(&port->send_if);
+    }
+    
+    if (o->send_count > 0) {
+        request_flush(o);
+    }
+}
+
+static void sock_fd_handler (struct DatagramSharedSocket_sock *sock, int events)
+{
+    DatagramSharedSocket *o = sock->s;
+    DebugObject_Access(&o->d_obj);
+    
+    if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && (sock->wait_events & BREACTOR_WRITE))) {
+        sock->wait_events &= ~BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->reactor, &sock->bfd, sock->wait_events);
+        
+        o->send_blocked = 0;
+        flush_send(o);
+        
+        if (!o->send_blocked) {
+            admit_waiting(o);
+        }
+    }
+    
+    if ((events & (BREACTOR_READ|BREACTOR_ERROR|BREACTOR_HUP))) {
+        do_recv(sock);
+    }
+}
+
+static void port_send_if_handler_send (DatagramSharedSocket_port *o, uint8_t *data, int data_len)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(!o->send_busy)
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->mtu)
+    
+    o->send_busy = 1;
+    o->send_data = data;
+    o->send_data_len = data_len;
+    
+    // hold the packet until there is somewhere to send it
+    if (!o->have_remote) {
+        return;
+    }
+    
+    port_send(o);
+}
+
+static void port_recv_if_handler_recv (DatagramSharedSocket_port *o, uint8_t *data)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(!o->recv_data)
+    
+    DatagramSharedSocket *s = o->s;
+    
+    o->recv_data = data;
+    
+    // pass on a queued datagram
+    if (o->queue_count > 0) {
+        int i = o->queue_start;
+        o->queue_start = (o->queue_start + 1) % s->port_queue_len;
+        o->queue_count--;
+        
+        port_deliver(o, o->queue_bufs[i] + port_data_offset(o), o->queue_lens[i], &o->queue_remote_addrs[i], &o->queue_local_addrs[i]);
+    }
+}
+
+static int port_init (DatagramSharedSocket_port *o, DatagramSharedSocket *s, int mtu)
+{
+    ASSERT(mtu >= 0)
+    ASSERT(mtu <= s->mtu)
+    
+    o->s = s;
+    o->mtu = mtu;
+    o->have_remote = 0;
+    o->in_addr_hash = 0;
+    o->recv_connid = 0;
+    o->have_send_connid = 0;
+    
+    // allocate receive queue
+    if (!(o->queue_bufs = alloc_bufs(s->port_queue_len, buf_size(s)))) {
+        goto fail0;
+    }
+    if (!(o->queue_lens = (int *)BAllocArray(s->port_queue_len, sizeof(o->queue_lens[0])))) {
+        goto fail1;
+    }
+    if (!(o->queue_remote_addrs = (BAddr *)BAllocArray(s->port_queue_len, sizeof(o->queue_remote_addrs[0])))) {
+        goto fail2;
+    }
+    if (!(o->queue_local_addrs = (BIPAddr *)BAllocArray(s->port_queue_len, sizeof(o->queue_local_addrs[0])))) {
+        goto fail3;
+    }
+    o->queue_start = 0;
+    o->queue_count = 0;
+    
+    // init send interface
+    PacketPassInterface_Init(&o->send_if, o->mtu, (PacketPassInterface_handler_send)port_send_if_handler_send, o, BReactor_PendingGroup(s->reactor));
+    o->send_busy = 0;
+    o->send_waiting = 0;
+    BReactorLimit_Init(&o->send_limit, s->reactor, DATAGRAMSHAREDSOCKET_PORT_SEND_LIMIT);
+    
+    // init recv interface
+    PacketRecvInterface_Init(&o->recv_if, o->mtu, (PacketRecvInterface_handler_recv)port_recv_if_handler_recv, o, BReactor_PendingGroup(s->reactor));
+    o->recv_data = NULL;
+    o->have_last_addrs = 0;
+    
+    DebugObject_Init(&o->d_obj);
+    DebugCounter_Increment(&s->d_ports_ctr);
+    return 1;
+    
+fail3:
+    BFree(o->queue_remote_addrs);
+fail2:
+    BFree(o->queue_lens);
+fail1:
+    free_bufs(o->queue_bufs, s->port_queue_len);
+fail0:
+    BLog(BLOG_ERROR, "failed to allocate port");
+    return 0;
+}
+
+int DatagramSharedSocket_Init (DatagramSharedSocket *o, BReactor *reactor, BAddr addr, int num_sockets, int mtu, int batch_size, int port_queue_len, int busy_poll_us)
+{
+    ASSERT(addr.type == BADDR_TYPE_IPV4 || addr.type == BADDR_TYPE_IPV6)
+    ASSERT(num_sockets >= 1)
+    ASSERT(num_sockets <= DATAGRAMSHAREDSOCKET_MAX_SOCKETS)
+    ASSERT(mtu >= 0)
+    ASSERT(batch_size >= 1)
+    ASSERT(port_queue_len >= 1)
+    ASSERT(busy_poll_us >= 0)
+    BNetwork_Assert();
+    
+    // init arguments
+    o->reactor = reactor;
+    o->family = addr.type;
+    o->mtu = mtu;
+    o->batch_size = batch_size;
+    o->port_queue_len = port_queue_len;
+    
+    // check sizes
+    if (o->mtu > INT_MAX - DATAGRAMSHAREDSOCKET_HEADER_SIZE) {
+        BLog(BLOG_ERROR, "MTU is too big");
+        goto fail0;
+    }
+    
+    // allocate receive batch
+    if (!(o->recv_msgs = (struct DatagramSharedSocket_msg *)BAllocArray(o->batch_size, sizeof(o->recv_msgs[0])))) {
+        goto fail0;
+    }
+    if (!(o->recv_mmsgs = BAllocArray(o->batch_size, sizeof(sys_mmsghdr)))) {
+        goto fail1;
+    }
+    if (!(o->recv_bufs = alloc_bufs(o->batch_size, buf_size(o)))) {
+        goto fail2;
+    }
+    
+    // allocate send batch
+    if (!(o->send_msgs = (struct DatagramSharedSocket_msg *)BAllocArray(o->batch_size, sizeof(o->send_msgs[0])))) {
+        goto fail3;
+    }
+    if (!(o->send_mmsgs = BAllocArray(o->batch_size, sizeof(sys_mmsghdr)))) {
+        goto fail4;
+    }
+    if (!(o->send_bufs = (uint8_t *)BAllocArray2(o->batch_size, buf_size(o), 1))) {
+        goto fail5;
+    }
+    
+    // init hash tables
+    if (!DatagramSharedSocket__AddrHash_Init(&o->addr_hash, HASH_BUCKETS)) {
+        BLog(BLOG_ERROR, "DatagramSharedSocket__AddrHash_Init failed");
+        goto fail6;
+    }
+    if (!DatagramSharedSocket__IdHash_Init(&o->id_hash, HASH_BUCKETS)) {
+        BLog(BLOG_ERROR, "DatagramSharedSocket__IdHash_Init failed");
+        goto fail7;
+    }
+    
+    // allocate sockets
+    if (!(o->socks = (struct DatagramSharedSocket_sock *)BAllocArray(num_sockets, sizeof(o->socks[0])))) {
+        goto fail8;
+    }
+    
+    // init sockets
+    struct sys_addr sysaddr;
+    addr_socket_to_sys(&sysaddr, addr);
+    for (o->num_socks = 0; o->num_socks < num_sockets; o->num_socks++) {
+        struct DatagramSharedSocket_sock *sock = &o->socks[o->num_socks];
+        sock->s = o;
+        
+        if ((sock->fd = socket(family_socket_to_sys(o->family), SOCK_DGRAM, 0)) < 0) {
+            BLog(BLOG_ERROR, "socket failed");
+            goto fail9;
+        }
+        
+        if (!badvpn_set_nonblocking(sock->fd)) {
+            BLog(BLOG_ERROR, "badvpn_set_nonblocking failed");
+            goto fail10;
+        }
+        
+        if (num_sockets > 1) {
+#ifdef SO_REUSEPORT
+            int opt = 1;
+            if (setsockopt(sock->fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+                BLog(BLOG_ERROR, "setsockopt(SO_REUSEPORT) failed");
+                goto fail10;
+            }
+#else
+            BLog(BLOG_ERROR, "SO_REUSEPORT is not supported");
+            goto fail10;
+#endif
+        }
+        
+        int bufsize = DATAGRAMSHAREDSOCKET_SOCKET_BUFFER;
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)) < 0) {
+            BLog(BLOG_WARNING, "setsockopt(SO_RCVBUF) failed");
+        }
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)) < 0) {
+            BLog(BLOG_WARNING, "setsockopt(SO_SNDBUF) failed");
+        }
+        
+        if (busy_poll_us > 0) {
+#ifdef SO_BUSY_POLL
+            if (setsockopt(sock->fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)) < 0) {
+                BLog(BLOG_WARNING, "setsockopt(SO_BUSY_POLL) failed");
+            }
+#else
+            BLog(BLOG_WARNING, "SO_BUSY_POLL is not supported");
+#endif
+        }
+        
+        set_pktinfo(sock->fd, o->family);
+        
+        if (bind(sock->fd, &sysaddr.addr.generic, sysaddr.len) < 0) {
+            BLog(BLOG_ERROR, "bind failed");
+            goto fail10;
+        }
+        
+        BFileDescriptor_Init(&sock->bfd, sock->fd, (BFileDescriptor_handler)sock_fd_handler, sock);
+        if (!BReactor_AddFileDescriptor(o->reactor, &sock->bfd)) {
+            BLog(BLOG_ERROR, "BReactor_AddFileDescriptor failed");
+            goto fail10;
+        }
+        
+        sock->wait_events = BREACTOR_READ;
+        BReactor_SetFileDescriptorEvents(o->reactor, &sock->bfd, sock->wait_events);
+        
+        continue;
+        
+    fail10:
+        if (close(sock->fd) < 0) {
+            BLog(BLOG_ERROR, "close failed");
+        }
+        goto fail9;
+    }
+    
+    // init sending
+    o->send_start = 0;
+    o->send_count = 0;
+    o->send_sock = 0;
+    o->send_blocked = 0;
+    LinkedList1_Init(&o->send_waiting);
+    
+    DebugCounter_Init(&o->d_ports_ctr);
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail9:
+    while (o->num_socks-- > 0) {
+        BReactor_RemoveFileDescriptor(o->reactor, &o->socks[o->num_socks].bfd);
+        if (close(o->socks[o->num_socks].fd) < 0) {
+            BLog(BLOG_ERROR, "close failed");
+        }
+    }
+    BFree(o->socks);
+fail8:
+    DatagramSharedSocket__IdHash_Free(&o->id_hash);
+fail7:
+    DatagramSharedSocket__AddrHash_Free(&o->addr_hash);
+fail6:
+    BFree(o->send_bufs);
+fail5:
+    BFree(o->send_mmsgs);
+fail4:
+    BFree(o->send_msgs);
+fail3:
+    free_bufs(o->recv_bufs, o->batch_size);
+fail2:
+    BFree(o->recv_mmsgs);
+fail1:
+    BFree(o->recv_msgs);
+fail0:
+    return 0;
+}
+
+void DatagramSharedSocket_Free (DatagramSharedSocket *o)
+{
+    DebugObject_Free(&o->d_obj);
+    DebugCounter_Free(&o->d_ports_ctr);
+    ASSERT(LinkedList1_IsEmpty(&o->send_waiting))
+    
+    // free sockets
+    for (int i = 0; i < o->num_socks; i++) {
+        BReactor_RemoveFileDescriptor(o->reactor, &o->socks[i].bfd);
+        if (close(o->socks[i].fd) < 0) {
+            BLog(BLOG_ERROR, "close failed");
+        }
+    }
+    BFree(o->socks);
+    
+    // free hash tables
+    DatagramSharedSocket__IdHash_Free(&o->id_hash);
+    DatagramSharedSocket__AddrHash_Free(&o->addr_hash);
+    
+    // free batches
+    BFree(o->send_bufs);
+    BFree(o->send_mmsgs);
+    BFree(o->send_msgs);
+    free_bufs(o->recv_bufs, o->batch_size);
+    BFree(o->recv_mmsgs);
+    BFree(o->recv_msgs);
+}
+
+int DatagramSharedSocket_GetFamily (DatagramSharedSocket *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->family;
+}
+
+int DatagramSharedSocket_GetMTU (DatagramSharedSocket *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->mtu;
+}
+
+int DatagramSharedSocket_Port_InitConnect (DatagramSharedSocket_port *o, DatagramSharedSocket *s, int mtu, BAddr remote_addr, int have_send_connid, uint64_t send_connid)
+{
+    DebugObject_Access(&s->d_obj);
+    ASSERT(remote_addr.type == s->family)
+    ASSERT(have_send_connid == 0 || have_send_connid == 1)
+    
+    // check address
+    if (DatagramSharedSocket__AddrHash_Lookup(&s->addr_hash, 0, &remote_addr).ptr) {
+        BLog(BLOG_ERROR, "another port has this remote address");
+        return 0;
+    }
+    
+    if (!port_init(o, s, mtu)) {
+        return 0;
+    }
+    
+    // set connection ID to send
+    o->have_send_connid = have_send_connid;
+    o->send_connid = send_connid;
+    
+    // set remote address
+    o->have_remote = 1;
+    o->remote_addr = remote_addr;
+    BIPAddr_InitInvalid(&o->local_addr);
+    
+    // insert to address hash
+    DatagramSharedSocket__AddrHashRef ref = {o, o};
+    ASSERT_EXECUTE(DatagramSharedSocket__AddrHash_Insert(&s->addr_hash, 0, ref, NULL))
+    o->in_addr_hash = 1;
+    
+    return 1;
+}
+
+int DatagramSharedSocket_Port_InitBind (DatagramSharedSocket_port *o, DatagramSharedSocket *s, int mtu, uint64_t *out_connid)
+{
+    DebugObject_Access(&s->d_obj);
+    ASSERT(out_connid)
+    
+    if (!port_init(o, s, mtu)) {
+        return 0;
+    }
+    
+    // choose an unused connection ID
+    do {
+        BRandom_randomize((uint8_t *)&o->recv_connid, sizeof(o->recv_connid));
+    } while (o->recv_connid == 0 || DatagramSharedSocket__IdHash_Lookup(&s->id_hash, 0, o->recv_connid).ptr);
+    
+    // insert to ID hash
+    DatagramSharedSocket__IdHashRef ref = {o, o};
+    ASSERT_EXECUTE(DatagramSharedSocket__IdHash_Insert(&s->id_hash, 0, ref, NULL))
+    
+    *out_connid = o->recv_connid;
+    return 1;
+}
+
+void DatagramSharedSocket_Port_Free (DatagramSharedSocket_port *o)
+{
+    DatagramSharedSocket *s = o->s;
+    DebugObject_Free(&o->d_obj);
+    DebugCounter_Decrement(&s->d_ports_ctr);
+    
+    // remove from hash tables
+    if (o->in_addr_hash) {
+        DatagramSharedSocket__AddrHashRef ref = {o, o};
+        DatagramSharedSocket__AddrHash_Remove(&s->addr_hash, 0, ref);
+    }
+    if (o->recv_connid != 0) {
+        DatagramSharedSocket__IdHashRef ref = {o, o};
+        DatagramSharedSocket__IdHash_Remove(&s->id_hash, 0, ref);
+    }
+    
+    // stop waiting to send
+    if (o->send_waiting) {
+        LinkedList1_Remove(&s->send_waiting, &o->send_waiting_node);
+    }
+    
+    // free interfaces
+    PacketRecvInterface_Free(&o->recv_if);
+    BReactorLimit_Free(&o->send_limit);
+    PacketPassInterface_Free(&o->send_if);
+    
+    // free receive queue
+    BFree(o->queue_local_addrs);
+    BFree(o->queue_remote_addrs);
+    BFree(o->queue_lens);
+    free_bufs(o->queue_bufs, s->port_queue_len);
+}
+
+void DatagramSharedSocket_Port_SetSendAddrs (DatagramSharedSocket_port *o, BAddr remote_addr, BIPAddr local_addr)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(remote_addr.type == o->s->family)
+    
+    DatagramSharedSocket *s = o->s;
+    
+    // nothing to do if the addresses are the same
+    if (o->have_remote && BAddr_Compare(&o->remote_addr, &remote_addr) && ips_equal(&o->local_addr, &local_addr)) {
+        return;
+    }
+    
+    // remove from address hash
+    if (o->in_addr_hash) {
+        DatagramSharedSocket__AddrHashRef ref = {o, o};
+        DatagramSharedSocket__AddrHash_Remove(&s->addr_hash, 0, ref);
+        o->in_addr_hash = 0;
+    }
+    
+    // set addresses
+    o->remote_addr = remote_addr;
+    o->local_addr = local_addr;
+    
+    // insert to address hash, taking the address from another port if needed
+    DatagramSharedSocket__AddrHashRef ref = {o, o};
+    DatagramSharedSocket__AddrHashRef existing;
+    if (!DatagramSharedSocket__AddrHash_Insert(&s->addr_hash, 0, ref, &existing)) {
+        BLog(BLOG_INFO, "taking remote address from another port");
+        DatagramSharedSocket__AddrHash_Remove(&s->addr_hash, 0, existing);
+        existing.ptr->in_addr_hash = 0;
+        ASSERT_EXECUTE(DatagramSharedSocket__AddrHash_Insert(&s->addr_hash, 0, ref, NULL))
+    }
+    o->in_addr_hash = 1;
+    
+    // send a held packet
+    if (!o->have_remote) {
+        o->have_remote = 1;
+        
+        if (o->send_busy) {
+            port_send(o);
+        }
+    }
+}
+
+int DatagramSharedSocket_Port_GetLastReceiveAddrs (DatagramSharedSocket_port *o, BAddr *remote_addr, BIPAddr *local_addr)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    if (!o->have_last_addrs) {
+        return 0;
+    }
+    
+    *remote_addr = o->last_remote_addr;
+    *local_addr = o->last_local_addr;
+    return 1;
+}
+
+PacketPassInterface * DatagramSharedSocket_Port_GetSendIf (DatagramSharedSocket_port *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return &o->send_if;
+}
+
+PacketRecvInterface * DatagramSharedSocket_Port_GetRecvIf (DatagramSharedSocket_port *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return &o->recv_if;
+}
@@ -0,0 +1,298 @@
+/**
+ * @file DatagramSharedSocket.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * UDP socket shared by many peers, with datagrams demultiplexed to per-peer
+ * ports and moved in batches.
+ */
+
+#ifndef BADVPN_CLIENT_DATAGRAMSHAREDSOCKET_H
+#define BADVPN_CLIENT_DATAGRAMSHAREDSOCKET_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/debugcounter.h>
+#include <structure/CHash.h>
+#include <structure/LinkedList1.h>
+#include <base/DebugObject.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BAddr.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/PacketRecvInterface.h>
+
+/**
+ * Size of the connection ID header in front of datagrams sent to ports
+ * which are waiting for their remote address.
+ */
+#define DATAGRAMSHAREDSOCKET_HEADER_SIZE 8
+
+#define DATAGRAMSHAREDSOCKET_MAX_SOCKETS 64
+
+/**
+ * How many datagrams a port may send in one reactor iteration before waiting
+ * for the next one, like BDATAGRAM_SEND_LIMIT.
+ */
+#define DATAGRAMSHAREDSOCKET_PORT_SEND_LIMIT 2
+
+/**
+ * How many full batches may be received from one socket when it becomes
+ * readable, before going back to the reactor.
+ */
+#define DATAGRAMSHAREDSOCKET_RECV_BATCH_LIMIT 16
+
+/**
+ * Socket buffer size (SO_RCVBUF and SO_SNDBUF) requested for the sockets, since
+ * they carry the traffic of all peers. The kernel may limit it further.
+ */
+#define DATAGRAMSHAREDSOCKET_SOCKET_BUFFER 4194304
+
+struct DatagramSharedSocket_port_s;
+struct DatagramSharedSocket_sock;
+struct DatagramSharedSocket_msg;
+
+typedef struct DatagramSharedSocket_port_s *DatagramSharedSocket__hash_link;
+
+#include "DatagramSharedSocket_addrhash.h"
+#include <structure/CHash_decl.h>
+
+#include "DatagramSharedSocket_idhash.h"
+#include <structure/CHash_decl.h>
+
+/**
+ * UDP socket shared by many peers.
+ * 
+ * One or more sockets (with SO_REUSEPORT) are bound to the same address. Each peer
+ * is represented by a port ({@link DatagramSharedSocket_port}), which provides the
+ * same send and receive interfaces as {@link BDatagram}.
+ * 
+ * A port in connect mode knows its remote address, and received datagrams are given
+ * to it based on their source address. A port in bind mode does not know its remote
+ * address until told with {@link DatagramSharedSocket_Port_SetSendAddrs}; it is
+ * identified by a random connection ID, which the other side puts in front of every
+ * datagram ({@link DATAGRAMSHAREDSOCKET_HEADER_SIZE} bytes, little endian). The
+ * other side learns the connection ID out of band.
+ * 
+ * Where available, datagrams are received with recvmmsg() and sent with sendmmsg(),
+ * up to batch_size at a time. Sends are collected until the batch is full or the
+ * socket reports that it is writable, which the reactor only checks once it has
+ * run out of pending jobs.
+ */
+typedef struct {
+    BReactor *reactor;
+    int family;
+    int mtu;
+    int batch_size;
+    int port_queue_len;
+    int num_socks;
+    struct DatagramSharedSocket_sock *socks;
+    struct DatagramSharedSocket_msg *recv_msgs;
+    void *recv_mmsgs;
+    uint8_t **recv_bufs;
+    struct DatagramSharedSocket_msg *send_msgs;
+    void *send_mmsgs;
+    uint8_t *send_bufs;
+    int send_start;
+    int send_count;
+    int send_sock;
+    int send_blocked;
+    LinkedList1 send_waiting;
+    DatagramSharedSocket__AddrHash addr_hash;
+    DatagramSharedSocket__IdHash id_hash;
+    DebugCounter d_ports_ctr;
+    DebugObject d_obj;
+} DatagramSharedSocket;
+
+/**
+ * One peer's endpoint on a {@link DatagramSharedSocket}.
+ */
+typedef struct DatagramSharedSocket_port_s {
+    DatagramSharedSocket *s;
+    int mtu;
+    int have_remote;
+    BAddr remote_addr;
+    BIPAddr local_addr;
+    int in_addr_hash;
+    uint64_t recv_connid;
+    int have_send_connid;
+    uint64_t send_connid;
+    DatagramSharedSocket__hash_link addr_hash_next;
+    DatagramSharedSocket__hash_link id_hash_next;
+    
+    // sending
+    PacketPassInterface send_if;
+    int send_busy;
+    int send_waiting;
+    BReactorLimit send_limit;
+    const uint8_t *send_data;
+    int send_data_len;
+    LinkedList1Node send_waiting_node;
+    
+    // receiving
+    PacketRecvInterface recv_if;
+    uint8_t *recv_data;
+    uint8_t **queue_bufs;
+    int *queue_lens;
+    BAddr *queue_remote_addrs;
+    BIPAddr *queue_local_addrs;
+    int queue_start;
+    int queue_count;
+    int have_last_addrs;
+    BAddr last_remote_addr;
+    BIPAddr last_local_addr;
+    
+    DebugObject d_obj;
+} DatagramSharedSocket_port;
+
+/**
+ * Initializes the object.
+ * {@link BNetwork_GlobalInit} must have been done.
+ * 
+ * @param o the object
+ * @param reactor reactor we live in
+ * @param addr address to bind to. Must be an IPv4 or IPv6 address.
+ * @param num_sockets number of sockets to bind to the address using SO_REUSEPORT,
+ *                    for spreading receive work in the kernel. Must be >=1 and
+ *                    <=DATAGRAMSHAREDSOCKET_MAX_SOCKETS.
+ * @param mtu maximum payload size of datagrams sent and received through ports,
+ *            excluding the connection ID header. Must be >=0.
+ * @param batch_size maximum number of datagrams to receive or send with one system
+ *                   call. Must be >=1.
+ * @param port_queue_len number of received datagrams each port can hold while its
+ *                       user is not ready to receive them. Must be >=1.
+ * @param busy_poll_us SO_BUSY_POLL time for the sockets; 0 leaves the socket default.
+ *                     Failure to set the option is not fatal. Must be >=0.
+ * @return 1 on success, 0 on failure
+ */
+int DatagramSharedSocket_Init (DatagramSharedSocket *o, BReactor *reactor, BAddr addr, int num_sockets, int mtu, int batch_size, int port_queue_len, int busy_poll_us) WARN_UNUSED;
+
+/**
+ * Frees the object.
+ * There must be no ports.
+ * 
+ * @param o the object
+ */
+void DatagramSharedSocket_Free (DatagramSharedSocket *o);
+
+/**
+ * Returns the address family of the socket.
+ * 
+ * @param o the object
+ * @return address family, BADDR_TYPE_IPV4 or BADDR_TYPE_IPV6
+ */
+int DatagramSharedSocket_GetFamily (DatagramSharedSocket *o);
+
+/**
+ * Returns the maximum payload size of datagrams, as passed to
+ * {@link DatagramSharedSocket_Init}.
+ * 
+ * @param o the object
+ * @return MTU
+ */
+int DatagramSharedSocket_GetMTU (DatagramSharedSocket *o);
+
+/**
+ * Initializes a port in connect mode.
+ * Received datagrams from the given address are passed to the port.
+ * The remote address must not be used by another port.
+ * 
+ * @param o the port
+ * @param s shared socket. The family of remote_addr must match it.
+ * @param mtu MTU of the port's interfaces; longer datagrams are not received.
+ *            Must be >=0 and <= the MTU of the shared socket.
+ * @param remote_addr address to send datagrams to
+ * @param have_send_connid whether to put a connection ID in front of sent datagrams,
+ *                         because the remote side is a port in bind mode. Must be 0 or 1.
+ * @param send_connid connection ID to send, if have_send_connid is 1
+ * @return 1 on success, 0 on failure
+ */
+int DatagramSharedSocket_Port_InitConnect (DatagramSharedSocket_port *o, DatagramSharedSocket *s, int mtu, BAddr remote_addr, int have_send_connid, uint64_t send_connid) WARN_UNUSED;
+
+/**
+ * Initializes a port in bind mode.
+ * Received datagrams starting with the returned connection ID are passed to the port.
+ * Nothing can be sent until {@link DatagramSharedSocket_Port_SetSendAddrs} is called.
+ * 
+ * @param o the port
+ * @param s shared socket
+ * @param mtu MTU of the port's interfaces; longer datagrams are not received.
+ *            Must be >=0 and <= the MTU of the shared socket.
+ * @param out_connid returns the connection ID, which the remote side must put in front
+ *                   of the datagrams it sends
+ * @return 1 on success, 0 on failure
+ */
+int DatagramSharedSocket_Port_InitBind (DatagramSharedSocket_port *o, DatagramSharedSocket *s, int mtu, uint64_t *out_connid) WARN_UNUSED;
+
+/**
+ * Frees the port.
+ * 
+ * @param o the port
+ */
+void DatagramSharedSocket_Port_Free (DatagramSharedSocket_port *o);
+
+/**
+ * Sets the addresses for sending. Datagrams from the remote address will also
+ * be passed to the port from now on; if another port had this remote address,
+ * it loses it.
+ * 
+ * @param o the port
+ * @param remote_addr remote address. Its family must match the shared socket.
+ * @param local_addr local IP address to send from, or invalid for any
+ */
+void DatagramSharedSocket_Port_SetSendAddrs (DatagramSharedSocket_port *o, BAddr remote_addr, BIPAddr local_addr);
+
+/**
+ * Returns the addresses of the last datagram passed to the port's receive interface.
+ * 
+ * @param o the port
+ * @param remote_addr returns the source address
+ * @param local_addr returns the local IP address it was received on, or invalid
+ * @return 1 on success, 0 if nothing was received yet
+ */
+int DatagramSharedSocket_Port_GetLastReceiveAddrs (DatagramSharedSocket_port *o, BAddr *remote_addr, BIPAddr *local_addr);
+
+/**
+ * Returns the port's send interface. Its MTU is the MTU of the port.
+ * A packet is held while the port has no remote address.
+ * 
+ * @param o the port
+ * @return send interface
+ */
+PacketPassInterface * DatagramSharedSocket_Port_GetSendIf (DatagramSharedSocket_port *o);
+
+/**
+ * Returns the port's receive interface. Its MTU is the MTU of the port.
+ * 
+ * @param o the port
+ * @return receive interface
+ */
+PacketRecvInterface * DatagramSharedSocket_Port_GetRecvIf (DatagramSharedSocket_port *o);
+
+#endif
@@ -0,0 +1,12 @@
+#define CHASH_PARAM_NAME DatagramSharedSocket__AddrHash
+#define CHASH_PARAM_ENTRY struct DatagramSharedSocket_port_s
+#define CHASH_PARAM_LINK DatagramSharedSocket__hash_link
+#define CHASH_PARAM_KEY BAddr *
+#define CHASH_PARAM_ARG int
+#define CHASH_PARAM_NULL ((DatagramSharedSocket__hash_link)NULL)
+#define CHASH_PARAM_DEREF(arg, link) (link)
+#define CHASH_PARAM_ENTRYHASH(arg, entry) (addr_hash(&(entry).ptr->remote_addr))
+#define CHASH_PARAM_KEYHASH(arg, key) (addr_hash((key)))
+#define CHASH_PARAM_COMPARE_ENTRIES(arg, entry1, entry2) (BAddr_Compare(&(entry1).ptr->remote_addr, &(entry2).ptr->remote_addr))
+#define CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key1, entry2) (BAddr_Compare((key1), &(entry2).ptr->remote_addr))
+#define CHASH_PARAM_ENTRY_NEXT addr_hash_next
@@ -0,0 +1,13 @@
+#define CHASH_PARAM_NAME DatagramSharedSocket__IdHash
+#define CHASH_PARAM_ENTRY struct DatagramSharedSocket_port_s
+#define CHASH_PARAM_LINK DatagramSharedSocket__hash_link
+#define CHASH_PARAM_KEY uint64_t
+#define CHASH_PARAM_ARG int
+#define CHASH_PARAM_NULL ((DatagramSharedSocket__hash_link)NULL)
+#define CHASH_PARAM_DEREF(arg, link) (link)
+#define CHASH_PARAM_ENTRYHASH(arg, entry) ((size_t)(entry).ptr->recv_connid)
+#define CHASH_PARAM_KEYHASH(arg, key) ((size_t)(key))
+#define CHASH_PARAM_ENTRYHASH_IS_CHEAP 1
+#define CHASH_PARAM_COMPARE_ENTRIES(arg, entry1, entry2) ((entry1).ptr->recv_connid == (entry2).ptr->recv_connid)
+#define CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key1, entry2) ((key1) == (entry2).ptr->recv_connid)
+#define CHASH_PARAM_ENTRY_NEXT id_hash_next
@@ -40,15 +40,29 @@
 
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
-#include "FragmentProtoAssembler_tree.h"
-#include <structure/SAvl_impl.h>
+// frame IDs are 16-bit, so a bigger table would not help
+#define MAX_TABLE_SIZE 65536
+
+static struct FragmentProtoAssembler_frame ** frame_slot (FragmentProtoAssembler *o, fragmentproto_frameid id)
+{
+    return &o->frames_table[id & o->frames_table_mask];
+}
+
+static struct FragmentProtoAssembler_frame * lookup_frame (FragmentProtoAssembler *o, fragmentproto_frameid id)
+{
+    struct FragmentProtoAssembler_frame *frame = *frame_slot(o, id);
+    
+    return ((frame && frame->id == id) ? frame : NULL);
+}
 
 static void free_frame (FragmentProtoAssembler *o, struct FragmentProtoAssembler_frame *frame)
 {
+    ASSERT(*frame_slot(o, frame->id) == frame)
+    
     // remove from used list
     LinkedList1_Remove(&o->frames_used, &frame->list_node);
-    // remove from used tree
-    FPAFramesTree_Remove(&o->frames_used_tree, 0, frame);
+    // remove from table
+    *frame_slot(o, frame->id) = NULL;
     
     // append to free list
     LinkedList1_Append(&o->frames_free, &frame->list_node);
@@ -69,7 +83,14 @@ static void free_oldest_frame (FragmentProtoAssembler *o)
 
 static struct FragmentProtoAssembler_frame * allocate_new_frame (FragmentProtoAssembler *o, fragmentproto_frameid id)
 {
-    ASSERT(!FPAFramesTree_LookupExact(&o->frames_used_tree, 0, id))
+    ASSERT(!lookup_frame(o, id))
+    
+    // if another frame uses the table slot, free it
+    struct FragmentProtoAssembler_frame *colliding = *frame_slot(o, id);
+    if (colliding) {
+        PeerLog(o, BLOG_INFO, "freeing frame with colliding ID");
+        free_frame(o, colliding);
+    }
     
     // if there are no free entries, free the oldest used one
     if (LinkedList1_IsEmpty(&o->frames_free)) {
@@ -95,9 +116,8 @@ static struct FragmentProtoAssembler_frame * allocate_new_frame (FragmentProtoAs
     
     // append to used list
     LinkedList1_Append(&o->frames_used, &frame->list_node);
-    // insert to used tree
-    int res = FPAFramesTree_Insert(&o->frames_used_tree, 0, frame, NULL);
-    ASSERT_EXECUTE(res)
+    // insert to table
+    *frame_slot(o, id) = frame;
     
     return frame;
 }
@@ -177,7 +197,21 @@ static int process_chunk (FragmentProtoAssembler *o, fragmentproto_frameid frame
     ASSERT(chunk_end <= o->output_mtu)
     
     // lookup frame
-    struct FragmentProtoAssembler_frame *frame = FPAFramesTree_LookupExact(&o->frames_used_tree, 0, frame_id);
+    struct FragmentProtoAssembler_frame *frame = lookup_frame(o, frame_id);
+    
+    // a whole frame in one chunk can be passed on straight from the input packet,
+    // which stays valid until the output is done
+    if (!frame && chunk_start == 0 && is_last) {
+        PeerLog(o, BLOG_DEBUG, "frame complete in one chunk");
+        
+        o->stats.num_frames++;
+        o->stats.num_direct_frames++;
+        o->stats.num_direct_bytes += chunk_len;
+        
+        PacketPassInterface_Sender_Send(o->output, payload, chunk_len);
+        return 1;
+    }
+    
     if (!frame) {
         // frame not found, add a new one
         frame = allocate_new_frame(o, frame_id);
@@ -272,6 +306,8 @@ static int process_chunk (FragmentProtoAssembler *o, fragmentproto_frameid frame
     // free frame entry
     free_frame(o, frame);
     
+    o->stats.num_frames++;
+    
     // send frame
     PacketPassInterface_Sender_Send(o->output, frame->buffer, frame->length);
     
@@ -410,6 +446,21 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
         goto fail3;
     }
     
+    // choose table size, a power of two with room for twice the frames
+    size_t table_size = 1;
+    while (table_size < MAX_TABLE_SIZE && table_size < 2 * (size_t)num_frames) {
+        table_size *= 2;
+    }
+    o->frames_table_mask = table_size - 1;
+    
+    // allocate table
+    if (!(o->frames_table = (struct FragmentProtoAssembler_frame **)BAllocArray(table_size, sizeof(o->frames_table[0])))) {
+        goto fail4;
+    }
+    for (size_t i = 0; i < table_size; i++) {
+        o->frames_table[i] = NULL;
+    }
+    
     // init frame lists
     LinkedList1_Init(&o->frames_free);
     LinkedList1_Init(&o->frames_used);
@@ -425,8 +476,8 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
         LinkedList1_Append(&o->frames_free, &frame->list_node);
     }
     
-    // init tree
-    FPAFramesTree_Init(&o->frames_used_tree);
+    // clear statistics
+    memset(&o->stats, 0, sizeof(o->stats));
     
     // have no input packet
     o->in_len = -1;
@@ -435,6 +486,8 @@ int FragmentProtoAssembler_Init (FragmentProtoAssembler *o, int input_mtu, Packe
     
     return 1;
     
+fail4:
+    BFree(o->frames_buffer);
 fail3:
     BFree(o->frames_chunks);
 fail2:
@@ -448,6 +501,9 @@ void FragmentProtoAssembler_Free (FragmentProtoAssembler *o)
 {
     DebugObject_Free(&o->d_obj);
 
+    // free table
+    BFree(o->frames_table);
+    
     // free buffers
     BFree(o->frames_buffer);
     
@@ -467,3 +523,10 @@ PacketPassInterface * FragmentProtoAssembler_GetInput (FragmentProtoAssembler *o
     
     return &o->input;
 }
+
+void FragmentProtoAssembler_GetStats (FragmentProtoAssembler *o, FragmentProtoAssemblerStats *out_stats)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    *out_stats = o->stats;
+}
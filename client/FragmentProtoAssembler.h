@@ -38,20 +38,13 @@
 
 #include <protocol/fragmentproto.h>
 #include <misc/debug.h>
-#include <misc/compare.h>
 #include <base/DebugObject.h>
 #include <base/BLog.h>
 #include <structure/LinkedList1.h>
-#include <structure/SAvl.h>
 #include <flow/PacketPassInterface.h>
 
 #define FPA_MAX_TIME UINT32_MAX
 
-struct FragmentProtoAssembler_frame;
-
-#include "FragmentProtoAssembler_tree.h"
-#include <structure/SAvl_decl.h>
-
 struct FragmentProtoAssembler_chunk {
     int start;
     int len;
@@ -62,20 +55,33 @@ struct FragmentProtoAssembler_frame {
     struct FragmentProtoAssembler_chunk *chunks; // array of chunks, up to num_chunks
     uint8_t *buffer; // buffer with frame data, size output_mtu
     // everything below only defined when frame entry is used
-    fragmentproto_frameid id; // frame identifier
+    fragmentproto_frameid id; // frame identifier, also determines the frame's slot in frames_table
     uint32_t time; // packet time when the last chunk was received
-    FPAFramesTreeNode tree_node; // node fields in tree for searching frames by id
     int num_chunks; // number of valid chunks
     int sum; // sum of all chunks' lengths
     int length; // length of the frame, or -1 if not yet known
     int length_so_far; // if length=-1, current data set's upper bound
 };
 
+/**
+ * Statistics of a {@link FragmentProtoAssembler}, see {@link FragmentProtoAssembler_GetStats}.
+ */
+typedef struct {
+    uint64_t num_frames; // frames passed to the output
+    uint64_t num_direct_frames; // frames which came in a single chunk and were passed on without copying
+    uint64_t num_direct_bytes; // bytes in such frames
+} FragmentProtoAssemblerStats;
+
 /**
  * Object which decodes packets according to FragmentProto.
  *
  * Input is with {@link PacketPassInterface}.
  * Output is with {@link PacketPassInterface}.
+ *
+ * A frame which comes in a single chunk is passed to the output directly from
+ * the input packet. Frames in multiple chunks are assembled in frame entries,
+ * found by frame ID in a direct-mapped table; a new frame takes the slot of an
+ * older one whose ID maps to the same slot.
  */
 typedef struct {
     void *user;
@@ -91,7 +97,9 @@ typedef struct {
     uint8_t *frames_buffer;
     LinkedList1 frames_free;
     LinkedList1 frames_used;
-    FPAFramesTree frames_used_tree;
+    struct FragmentProtoAssembler_frame **frames_table;
+    int frames_table_mask;
+    FragmentProtoAssemblerStats stats;
     int in_len;
     uint8_t *in;
     int in_pos;
@@ -131,4 +139,12 @@ void FragmentProtoAssembler_Free (FragmentProtoAssembler *o);
  */
 PacketPassInterface * FragmentProtoAssembler_GetInput (FragmentProtoAssembler *o);
 
+/**
+ * Returns statistics accumulated since the object was initialized.
+ *
+ * @param o the object
+ * @param out_stats where to store the statistics
+ */
+void FragmentProtoAssembler_GetStats (FragmentProtoAssembler *o, FragmentProtoAssemblerStats *out_stats);
+
 #endif
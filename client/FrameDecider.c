@@ -29,6 +29,7 @@
 
 #include <string.h>
 #include <stddef.h>
+#include <limits.h>
 
 #include <misc/debug.h>
 #include <misc/offset.h>
@@ -51,27 +52,238 @@
 
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
-static int compare_macs (const uint8_t *mac1, const uint8_t *mac2)
+#include "FrameDecider_groups_tree.h"
+#include <structure/SAvl_impl.h>
+
+static int table_size_for (int num_entries, int *out_shift)
 {
-    int c = memcmp(mac1, mac2, 6);
-    return B_COMPARE(c, 0);
+    // a power of two at least twice the number of entries, so that the table
+    // is at most half full and probing always finds an empty slot
+    int size = 2;
+    int shift = 31;
+    while (size < 2 * num_entries) {
+        size *= 2;
+        shift--;
+    }
+    
+    *out_shift = shift;
+    return size;
 }
 
-#include "FrameDecider_macs_tree.h"
-#include <structure/SAvl_impl.h>
+static uint32_t hash_mac (const uint8_t *mac)
+{
+    uint64_t x = 0;
+    memcpy(&x, mac, 6);
+    return (x * UINT64_C(0x9E3779B97F4A7C15)) >> 32;
+}
 
-#include "FrameDecider_groups_tree.h"
-#include <structure/SAvl_impl.h>
+static uint32_t hash_sig (uint32_t sig)
+{
+    return sig * UINT32_C(2654435761);
+}
 
-#include "FrameDecider_multicast_tree.h"
-#include <structure/SAvl_impl.h>
+static void macs_table_place (FrameDecider *o, uint32_t hash, struct _FrameDecider_mac_entry *entry)
+{
+    int mask = o->macs_table_size - 1;
+    
+    int i = hash >> o->macs_table_shift;
+    while (o->macs_table[i].entry) {
+        i = (i + 1) & mask;
+    }
+    
+    o->macs_table[i].hash = hash;
+    o->macs_table[i].entry = entry;
+    o->macs_table_count++;
+}
+
+static int macs_table_reserve (FrameDecider *o, int num_entries)
+{
+    if (2 * num_entries <= o->macs_table_size) {
+        return 1;
+    }
+    
+    int shift;
+    int size = table_size_for(num_entries, &shift);
+    
+    struct _FrameDecider_mac_slot *table = (struct _FrameDecider_mac_slot *)BAllocArray(size, sizeof(table[0]));
+    if (!table) {
+        return 0;
+    }
+    for (int i = 0; i < size; i++) {
+        table[i].entry = NULL;
+    }
+    
+    struct _FrameDecider_mac_slot *old_table = o->macs_table;
+    int old_size = o->macs_table_size;
+    
+    o->macs_table = table;
+    o->macs_table_size = size;
+    o->macs_table_shift = shift;
+    o->macs_table_count = 0;
+    
+    for (int i = 0; i < old_size; i++) {
+        if (old_table[i].entry) {
+            macs_table_place(o, old_table[i].hash, old_table[i].entry);
+        }
+    }
+    
+    BFree(old_table);
+    
+    return 1;
+}
+
+static struct _FrameDecider_mac_entry * macs_table_lookup (FrameDecider *o, const uint8_t *mac)
+{
+    if (o->macs_table_count == 0) {
+        return NULL;
+    }
+    
+    uint32_t hash = hash_mac(mac);
+    int mask = o->macs_table_size - 1;
+    
+    for (int i = hash >> o->macs_table_shift;; i = (i + 1) & mask) {
+        struct _FrameDecider_mac_slot *slot = &o->macs_table[i];
+        
+        if (!slot->entry) {
+            return NULL;
+        }
+        
+        // compare the hash first so that most mismatches don't touch the entry
+        if (slot->hash == hash && !memcmp(slot->entry->mac, mac, 6)) {
+            return slot->entry;
+        }
+    }
+}
+
+static void macs_table_remove (FrameDecider *o, struct _FrameDecider_mac_entry *entry)
+{
+    ASSERT(o->macs_table_count > 0)
+    
+    int mask = o->macs_table_size - 1;
+    
+    // find the entry's slot
+    int i = hash_mac(entry->mac) >> o->macs_table_shift;
+    while (o->macs_table[i].entry != entry) {
+        ASSERT(o->macs_table[i].entry)
+        i = (i + 1) & mask;
+    }
+    
+    // move back following entries which would no longer be found past the hole
+    for (int j = (i + 1) & mask; o->macs_table[j].entry; j = (j + 1) & mask) {
+        int home = o->macs_table[j].hash >> o->macs_table_shift;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            o->macs_table[i] = o->macs_table[j];
+            i = j;
+        }
+    }
+    
+    o->macs_table[i].entry = NULL;
+    o->macs_table_count--;
+}
+
+static void multicast_table_place (FrameDecider *o, struct _FrameDecider_group_entry *master)
+{
+    int mask = o->multicast_table_size - 1;
+    
+    int i = hash_sig(master->master.sig) >> o->multicast_table_shift;
+    while (o->multicast_table[i].master) {
+        i = (i + 1) & mask;
+    }
+    
+    o->multicast_table[i].sig = master->master.sig;
+    o->multicast_table[i].master = master;
+    o->multicast_table_count++;
+}
+
+static int multicast_table_reserve (FrameDecider *o, int num_entries)
+{
+    if (2 * num_entries <= o->multicast_table_size) {
+        return 1;
+    }
+    
+    int shift;
+    int size = table_size_for(num_entries, &shift);
+    
+    struct _FrameDecider_multicast_slot *table = (struct _FrameDecider_multicast_slot *)BAllocArray(size, sizeof(table[0]));
+    if (!table) {
+        return 0;
+    }
+    for (int i = 0; i < size; i++) {
+        table[i].master = NULL;
+    }
+    
+    struct _FrameDecider_multicast_slot *old_table = o->multicast_table;
+    int old_size = o->multicast_table_size;
+    
+    o->multicast_table = table;
+    o->multicast_table_size = size;
+    o->multicast_table_shift = shift;
+    o->multicast_table_count = 0;
+    
+    for (int i = 0; i < old_size; i++) {
+        if (old_table[i].master) {
+            multicast_table_place(o, old_table[i].master);
+        }
+    }
+    
+    BFree(old_table);
+    
+    return 1;
+}
+
+static struct _FrameDecider_group_entry * multicast_table_lookup (FrameDecider *o, uint32_t sig)
+{
+    if (o->multicast_table_count == 0) {
+        return NULL;
+    }
+    
+    int mask = o->multicast_table_size - 1;
+    
+    for (int i = hash_sig(sig) >> o->multicast_table_shift;; i = (i + 1) & mask) {
+        struct _FrameDecider_multicast_slot *slot = &o->multicast_table[i];
+        
+        if (!slot->master) {
+            return NULL;
+        }
+        
+        if (slot->sig == sig) {
+            return slot->master;
+        }
+    }
+}
+
+static void multicast_table_remove (FrameDecider *o, struct _FrameDecider_group_entry *master)
+{
+    ASSERT(o->multicast_table_count > 0)
+    
+    int mask = o->multicast_table_size - 1;
+    
+    // find the master's slot
+    int i = hash_sig(master->master.sig) >> o->multicast_table_shift;
+    while (o->multicast_table[i].master != master) {
+        ASSERT(o->multicast_table[i].master)
+        i = (i + 1) & mask;
+    }
+    
+    // move back following entries which would no longer be found past the hole
+    for (int j = (i + 1) & mask; o->multicast_table[j].master; j = (j + 1) & mask) {
+        int home = hash_sig(o->multicast_table[j].sig) >> o->multicast_table_shift;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            o->multicast_table[i] = o->multicast_table[j];
+            i = j;
+        }
+    }
+    
+    o->multicast_table[i].master = NULL;
+    o->multicast_table_count--;
+}
 
 static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
 {
     FrameDecider *d = o->d;
     
-    // locate entry in tree
-    struct _FrameDecider_mac_entry *e_entry = FDMacsTree_LookupExact(&d->macs_tree, 0, mac);
+    // locate entry in table
+    struct _FrameDecider_mac_entry *e_entry = macs_table_lookup(d, mac);
     if (e_entry) {
         if (e_entry->peer == o) {
             // this is our MAC; only move it to the end of the used list
@@ -81,7 +293,7 @@ static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
         }
         
         // some other peer has that MAC; disassociate it
-        FDMacsTree_Remove(&d->macs_tree, 0, e_entry);
+        macs_table_remove(d, e_entry);
         LinkedList1_Remove(&e_entry->peer->mac_entries_used, &e_entry->list_node);
         LinkedList1_Append(&e_entry->peer->mac_entries_free, &e_entry->list_node);
     }
@@ -102,7 +314,7 @@ static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
         ASSERT(entry->peer == o)
         
         // remove from used
-        FDMacsTree_Remove(&d->macs_tree, 0, entry);
+        macs_table_remove(d, entry);
         LinkedList1_Remove(&o->mac_entries_used, &entry->list_node);
     }
     
@@ -113,8 +325,7 @@ static void add_mac_to_peer (FrameDeciderPeer *o, uint8_t *mac)
     
     // add to used
     LinkedList1_Append(&o->mac_entries_used, &entry->list_node);
-    int res = FDMacsTree_Insert(&d->macs_tree, 0, entry, NULL);
-    ASSERT_EXECUTE(res)
+    macs_table_place(d, hash_mac(entry->mac), entry);
 }
 
 static uint32_t compute_sig_for_group (uint32_t group)
@@ -135,7 +346,7 @@ static void add_to_multicast (FrameDecider *d, struct _FrameDecider_group_entry
     // compute sig
     uint32_t sig = compute_sig_for_group(group_entry->group);
     
-    struct _FrameDecider_group_entry *master = FDMulticastTree_LookupExact(&d->multicast_tree, 0, sig);
+    struct _FrameDecider_group_entry *master = multicast_table_lookup(d, sig);
     if (master) {
         // use existing master
         ASSERT(master->is_master)
@@ -154,9 +365,8 @@ static void add_to_multicast (FrameDecider *d, struct _FrameDecider_group_entry
         // set sig
         group_entry->master.sig = sig;
         
-        // insert to multicast tree
-        int res = FDMulticastTree_Insert(&d->multicast_tree, 0, group_entry, NULL);
-        ASSERT_EXECUTE(res)
+        // insert to multicast table
+        multicast_table_place(d, group_entry);
         
         // init list node
         LinkedList3Node_InitLonely(&group_entry->sig_list_node);
@@ -169,8 +379,8 @@ static void remove_from_multicast (FrameDecider *d, struct _FrameDecider_group_e
     uint32_t sig = compute_sig_for_group(group_entry->group);
     
     if (group_entry->is_master) {
-        // remove master from multicast tree
-        FDMulticastTree_Remove(&d->multicast_tree, 0, group_entry);
+        // remove master from multicast table
+        multicast_table_remove(d, group_entry);
         
         if (!LinkedList3Node_IsLonely(&group_entry->sig_list_node)) {
             // at least one more group entry for this sig; make another entry the master
@@ -186,9 +396,8 @@ static void remove_from_multicast (FrameDecider *d, struct _FrameDecider_group_e
             // set sig
             newmaster->master.sig = sig;
             
-            // insert to multicast tree
-            int res = FDMulticastTree_Insert(&d->multicast_tree, 0, newmaster, NULL);
-            ASSERT_EXECUTE(res)
+            // insert to multicast table
+            multicast_table_place(d, newmaster);
         }
     }
     
@@ -285,8 +494,8 @@ static void lower_group_timers_to_lmqt (FrameDecider *d, uint32_t group)
     // compute sig
     uint32_t sig = compute_sig_for_group(group);
     
-    // look up the sig in multicast tree
-    struct _FrameDecider_group_entry *master = FDMulticastTree_LookupExact(&d->multicast_tree, 0, sig);
+    // look up the sig in multicast table
+    struct _FrameDecider_group_entry *master = multicast_table_lookup(d, sig);
     if (!master) {
         return;
     }
@@ -335,11 +544,18 @@ void FrameDecider_Init (FrameDecider *o, int max_peer_macs, int max_peer_groups,
     // init peers list
     LinkedList1_Init(&o->peers_list);
     
-    // init MAC tree
-    FDMacsTree_Init(&o->macs_tree);
+    // set no peers
+    o->num_peers = 0;
+    
+    // init MAC table, allocated when peers are added
+    o->macs_table = NULL;
+    o->macs_table_size = 0;
+    o->macs_table_count = 0;
     
-    // init multicast tree
-    FDMulticastTree_Init(&o->multicast_tree);
+    // init multicast table, allocated when peers are added
+    o->multicast_table = NULL;
+    o->multicast_table_size = 0;
+    o->multicast_table_count = 0;
     
     // init decide state
     o->decide_state = DECIDE_STATE_NONE;
@@ -352,10 +568,16 @@ void FrameDecider_Init (FrameDecider *o, int max_peer_macs, int max_peer_groups,
 
 void FrameDecider_Free (FrameDecider *o)
 {
-    ASSERT(FDMulticastTree_IsEmpty(&o->multicast_tree))
-    ASSERT(FDMacsTree_IsEmpty(&o->macs_tree))
+    ASSERT(o->multicast_table_count == 0)
+    ASSERT(o->macs_table_count == 0)
     ASSERT(LinkedList1_IsEmpty(&o->peers_list))
     DebugObject_Free(&o->d_obj);
+    
+    // free multicast table
+    BFree(o->multicast_table);
+    
+    // free MAC table
+    BFree(o->macs_table);
 }
 
 void FrameDecider_AnalyzeAndDecide (FrameDecider *o, const uint8_t *frame, int frame_len)
@@ -483,8 +705,8 @@ out:;
         // extract group's sig from destination MAC
         uint32_t sig = compute_sig_for_mac(eh.dest);
         
-        // look up the sig in multicast tree
-        struct _FrameDecider_group_entry *master = FDMulticastTree_LookupExact(&o->multicast_tree, 0, sig);
+        // look up the sig in multicast table
+        struct _FrameDecider_group_entry *master = multicast_table_lookup(o, sig);
         if (master) {
             ASSERT(master->is_master)
             
@@ -496,7 +718,7 @@ out:;
     }
     
     // look for MAC entry
-    struct _FrameDecider_mac_entry *entry = FDMacsTree_LookupExact(&o->macs_tree, 0, eh.dest);
+    struct _FrameDecider_mac_entry *entry = macs_table_lookup(o, eh.dest);
     if (entry) {
         o->decide_state = DECIDE_STATE_UNICAST;
         o->decide_unicast_peer = entry->peer;
@@ -562,6 +784,18 @@ int FrameDeciderPeer_Init (FrameDeciderPeer *o, FrameDecider *d, void *user, BLo
     o->user = user;
     o->logfunc = logfunc;
     
+    // grow tables to hold the entries of this peer
+    if (d->num_peers + 1 > INT_MAX / 4 / d->max_peer_macs || d->num_peers + 1 > INT_MAX / 4 / d->max_peer_groups) {
+        PeerLog(o, BLOG_ERROR, "too many peers");
+        goto fail0;
+    }
+    if (!macs_table_reserve(d, (d->num_peers + 1) * d->max_peer_macs) ||
+        !multicast_table_reserve(d, (d->num_peers + 1) * d->max_peer_groups)
+    ) {
+        PeerLog(o, BLOG_ERROR, "failed to grow tables");
+        goto fail0;
+    }
+    
     // allocate MAC entries
     if (!(o->mac_entries = (struct _FrameDecider_mac_entry *)BAllocArray(d->max_peer_macs, sizeof(struct _FrameDecider_mac_entry)))) {
         PeerLog(o, BLOG_ERROR, "failed to allocate MAC entries");
@@ -576,6 +810,7 @@ int FrameDeciderPeer_Init (FrameDeciderPeer *o, FrameDecider *d, void *user, BLo
     
     // insert to peers list
     LinkedList1_Append(&d->peers_list, &o->list_node);
+    d->num_peers++;
     
     // init MAC entry lists
     LinkedList1_Init(&o->mac_entries_free);
@@ -647,12 +882,12 @@ void FrameDeciderPeer_Free (FrameDeciderPeer *o)
         BReactor_RemoveTimer(d->reactor, &entry->timer);
     }
     
-    // remove used MAC entries from tree
+    // remove used MAC entries from table
     for (node = LinkedList1_GetFirst(&o->mac_entries_used); node; node = LinkedList1Node_Next(node)) {
         struct _FrameDecider_mac_entry *entry = UPPER_OBJECT(node, struct _FrameDecider_mac_entry, list_node);
         
-        // remove from tree
-        FDMacsTree_Remove(&d->macs_tree, 0, entry);
+        // remove from table
+        macs_table_remove(d, entry);
     }
     
     // remove from peers list
@@ -660,6 +895,7 @@ void FrameDeciderPeer_Free (FrameDeciderPeer *o)
         d->decide_flood_current = LinkedList1Node_Next(d->decide_flood_current);
     }
     LinkedList1_Remove(&d->peers_list, &o->list_node);
+    d->num_peers--;
     
     // free group entries
     BFree(o->group_entries);
@@ -30,6 +30,11 @@
  * 
  * Mudule which decides to which peers frames from the device are to be
  * forwarded.
+ * 
+ * Destination MAC addresses and multicast group signatures are looked up in
+ * open-addressed hash tables with linear probing. The tables are sized for the
+ * maximum number of entries of all peers and kept at most half full, growing
+ * when peers are added.
  */
 
 #ifndef BADVPN_CLIENT_FRAMEDECIDER_H
@@ -48,23 +53,14 @@ struct _FrameDeciderPeer;
 struct _FrameDecider_mac_entry;
 struct _FrameDecider_group_entry;
 
-typedef const uint8_t *FDMacsTree_key;
-
-#include "FrameDecider_macs_tree.h"
-#include <structure/SAvl_decl.h>
-
 #include "FrameDecider_groups_tree.h"
 #include <structure/SAvl_decl.h>
 
-#include "FrameDecider_multicast_tree.h"
-#include <structure/SAvl_decl.h>
-
 struct _FrameDecider_mac_entry {
     struct _FrameDeciderPeer *peer;
     LinkedList1Node list_node; // node in FrameDeciderPeer.mac_entries_free or FrameDeciderPeer.mac_entries_used
     // defined when used:
-    uint8_t mac[6];
-    FDMacsTreeNode tree_node; // node in FrameDecider.macs_tree, indexed by mac
+    uint8_t mac[6]; // also in FrameDecider.macs_table
 };
 
 struct _FrameDecider_group_entry {
@@ -81,11 +77,20 @@ struct _FrameDecider_group_entry {
     int is_master;
     // defined when used and we are master:
     struct {
-        uint32_t sig; // last 23 bits of group address
-        FDMulticastTreeNode tree_node; // node in FrameDecider.multicast_tree, indexed by sig
+        uint32_t sig; // last 23 bits of group address, also in FrameDecider.multicast_table
     } master;
 };
 
+struct _FrameDecider_mac_slot {
+    uint32_t hash; // hash of entry->mac, checked before entry->mac is compared
+    struct _FrameDecider_mac_entry *entry; // NULL if the slot is empty
+};
+
+struct _FrameDecider_multicast_slot {
+    uint32_t sig;
+    struct _FrameDecider_group_entry *master; // NULL if the slot is empty
+};
+
 /**
  * Object that represents a local device.
  */
@@ -96,8 +101,15 @@ typedef struct {
     btime_t igmp_last_member_query_time;
     BReactor *reactor;
     LinkedList1 peers_list;
-    FDMacsTree macs_tree;
-    FDMulticastTree multicast_tree;
+    int num_peers;
+    struct _FrameDecider_mac_slot *macs_table;
+    int macs_table_size;
+    int macs_table_shift;
+    int macs_table_count;
+    struct _FrameDecider_multicast_slot *multicast_table;
+    int multicast_table_size;
+    int multicast_table_shift;
+    int multicast_table_count;
     int decide_state;
     LinkedList1Node *decide_flood_current;
     struct _FrameDeciderPeer *decide_unicast_peer;
@@ -30,6 +30,7 @@
 #include <string.h>
 
 #include <misc/balign.h>
+#include <misc/balloc.h>
 #include <misc/byteorder.h>
 #include <security/BHash.h>
 
@@ -39,21 +40,79 @@
 
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
-static void decode_work_func (SPProtoDecoder *o)
+#define SLOT_STATE_FREE 1
+#define SLOT_STATE_WORKING 2
+#define SLOT_STATE_DONE 3
+
+static struct SPProtoDecoder_slot * get_slot (SPProtoDecoder *o, int i)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->in_len <= o->input_mtu)
+    ASSERT(i >= 0)
+    ASSERT(i < o->depth)
     
-    uint8_t *in = o->in;
-    int in_len = o->in_len;
+    return &o->slots[(o->slots_start + i) % o->depth];
+}
+
+static void free_key (SPProtoDecoder *o)
+{
+    ASSERT(SPPROTO_HAVE_KEY(o->sp_params))
+    ASSERT(o->have_encryption_key)
+    
+    for (int i = 0; i < o->depth; i++) {
+        struct SPProtoDecoder_slot *s = &o->slots[i];
+        if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+            BAEAD_Free(&s->aead);
+        } else {
+            BEncryption_Free(&s->encryptor);
+        }
+    }
+}
+
+static void decode_work_func (struct SPProtoDecoder_slot *s)
+{
+    SPProtoDecoder *o = s->o;
+    ASSERT(s->in_len >= 0)
+    ASSERT(s->in_len <= o->input_mtu)
     
-    o->tw_out_len = -1;
+    uint8_t *in = s->in;
+    int in_len = s->in_len;
+    
+    s->tw_out_len = -1;
     
     uint8_t *plaintext;
     int plaintext_len;
     
     // decrypt if needed
-    if (!SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        // input must have a nonce and a tag
+        if (in_len < SPPROTO_AEAD_OVERHEAD) {
+            PeerLog(o, BLOG_WARNING, "packet too short for nonce and tag");
+            return;
+        }
+        
+        // check if we have encryption key
+        if (!o->have_encryption_key) {
+            PeerLog(o, BLOG_WARNING, "have no encryption key");
+            return;
+        }
+        
+        // the nonce must be one the peer could have used; in particular,
+        // never accept our own nonces reflected back at us
+        if (memcmp(in, o->aead_peer_nonce_prefix, SPPROTO_AEAD_NONCE_PREFIX_LEN)) {
+            PeerLog(o, BLOG_WARNING, "packet has wrong nonce prefix");
+            return;
+        }
+        
+        // decrypt in place and verify tag
+        uint8_t *ciphertext = in + BAEAD_NONCE_SIZE;
+        int ciphertext_len = in_len - SPPROTO_AEAD_OVERHEAD;
+        if (!BAEAD_Decrypt(&s->aead, in, ciphertext, ciphertext, ciphertext_len, ciphertext + ciphertext_len)) {
+            PeerLog(o, BLOG_WARNING, "packet failed authentication");
+            return;
+        }
+        plaintext = ciphertext;
+        plaintext_len = ciphertext_len;
+    }
+    else if (!SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
         plaintext = in;
         plaintext_len = in_len;
     } else {
@@ -82,8 +141,8 @@ static void decode_work_func (SPProtoDecoder *o)
         // decrypt
         uint8_t *ciphertext = in + o->enc_block_size;
         int ciphertext_len = in_len - o->enc_block_size;
-        plaintext = o->buf;
-        BEncryption_Decrypt(&o->encryptor, ciphertext, plaintext, ciphertext_len, iv);
+        plaintext = s->buf;
+        BEncryption_Decrypt(&s->encryptor, ciphertext, plaintext, ciphertext_len, iv);
         
         // read padding
         if (ciphertext_len < o->enc_block_size) {
@@ -125,8 +184,8 @@ static void decode_work_func (SPProtoDecoder *o)
         // remember seed and OTP (can't check from here)
         struct spproto_otpdata header_otpd;
         memcpy(&header_otpd, header + SPPROTO_HEADER_OTPDATA_OFF(o->sp_params), sizeof(header_otpd));
-        o->tw_out_seed_id = ltoh16(header_otpd.seed_id);
-        o->tw_out_otp = header_otpd.otp;
+        s->tw_out_seed_id = ltoh16(header_otpd.seed_id);
+        s->tw_out_otp = header_otpd.otp;
     }
     
     // check hash
@@ -150,91 +209,155 @@ static void decode_work_func (SPProtoDecoder *o)
     }
     
     // return packet
-    o->tw_out = plaintext + SPPROTO_HEADER_LEN(o->sp_params);
-    o->tw_out_len = plaintext_len - SPPROTO_HEADER_LEN(o->sp_params);
+    s->tw_out = plaintext + SPPROTO_HEADER_LEN(o->sp_params);
+    s->tw_out_len = plaintext_len - SPPROTO_HEADER_LEN(o->sp_params);
 }
 
-static void decode_work_handler (SPProtoDecoder *o)
+static void release_slot (SPProtoDecoder *o)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->tw_have)
-    DebugObject_Access(&o->d_obj);
+    ASSERT(o->slots_count > 0)
+    ASSERT(get_slot(o, 0)->state == SLOT_STATE_DONE)
     
-    // free work
-    BThreadWork_Free(&o->tw);
-    o->tw_have = 0;
-    
-    // check OTP
-    if (SPPROTO_HAVE_OTP(o->sp_params) && o->tw_out_len >= 0) {
-        if (!OTPChecker_CheckOTP(&o->otpchecker, o->tw_out_seed_id, o->tw_out_otp)) {
-            PeerLog(o, BLOG_WARNING, "packet has wrong OTP");
-            o->tw_out_len = -1;
-        }
-    }
+    // free slot
+    get_slot(o, 0)->state = SLOT_STATE_FREE;
+    o->slots_start = (o->slots_start + 1) % o->depth;
+    o->slots_count--;
     
-    if (o->tw_out_len < 0) {
-        // cannot decode, finish input packet
+    // accept the next input packet if we were holding it back
+    if (o->input_blocked) {
+        o->input_blocked = 0;
         PacketPassInterface_Done(&o->input);
-        o->in_len = -1;
-    } else {
+    }
+}
+
+static void maybe_output (SPProtoDecoder *o)
+{
+    while (!o->output_busy && o->slots_count > 0) {
+        struct SPProtoDecoder_slot *s = get_slot(o, 0);
+        if (s->state != SLOT_STATE_DONE) {
+            return;
+        }
+        
+        // check OTP
+        if (SPPROTO_HAVE_OTP(o->sp_params) && s->tw_out_len >= 0) {
+            if (!OTPChecker_CheckOTP(&o->otpchecker, s->tw_out_seed_id, s->tw_out_otp)) {
+                PeerLog(o, BLOG_WARNING, "packet has wrong OTP");
+                s->tw_out_len = -1;
+            }
+        }
+        
+        if (s->tw_out_len < 0) {
+            // cannot decode, drop packet
+            release_slot(o);
+            continue;
+        }
+        
         // submit decoded packet to output
-        PacketPassInterface_Sender_Send(o->output, o->tw_out, o->tw_out_len);
+        o->output_busy = 1;
+        PacketPassInterface_Sender_Send(o->output, s->tw_out, s->tw_out_len);
+        return;
     }
 }
 
+static void decode_work_handler (struct SPProtoDecoder_slot *s)
+{
+    SPProtoDecoder *o = s->o;
+    ASSERT(s->state == SLOT_STATE_WORKING)
+    DebugObject_Access(&o->d_obj);
+    
+    // free work
+    BThreadWork_Free(&s->tw);
+    
+    // packet is decoded
+    s->state = SLOT_STATE_DONE;
+    
+    // possibly output packet
+    maybe_output(o);
+}
+
 static void input_handler_send (SPProtoDecoder *o, uint8_t *data, int data_len)
 {
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->input_mtu)
-    ASSERT(o->in_len == -1)
-    ASSERT(!o->tw_have)
+    ASSERT(!o->input_blocked)
+    ASSERT(o->slots_count < o->depth)
     DebugObject_Access(&o->d_obj);
     
-    // remember input
-    o->in = data;
-    o->in_len = data_len;
+    struct SPProtoDecoder_slot *s = get_slot(o, o->slots_count);
+    ASSERT(s->state == SLOT_STATE_FREE)
+    
+    // remember input; with one slot, decode in the input buffer
+    if (o->depth == 1) {
+        s->in = data;
+    } else {
+        memcpy(s->in, data, data_len);
+    }
+    s->in_len = data_len;
+    o->slots_count++;
     
     // start decoding
-    BThreadWork_Init(&o->tw, o->twd, (BThreadWork_handler_done)decode_work_handler, o, (BThreadWork_work_func)decode_work_func, o);
-    o->tw_have = 1;
+    BThreadWork_Init(&s->tw, o->twd, (BThreadWork_handler_done)decode_work_handler, s, (BThreadWork_work_func)decode_work_func, s);
+    s->state = SLOT_STATE_WORKING;
+    
+    // accept the next packet if we have room for it
+    if (o->depth > 1 && o->slots_count < o->depth) {
+        PacketPassInterface_Done(&o->input);
+    } else {
+        o->input_blocked = 1;
+    }
 }
 
 static void output_handler_done (SPProtoDecoder *o)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(!o->tw_have)
+    ASSERT(o->output_busy)
+    ASSERT(o->slots_count > 0)
     DebugObject_Access(&o->d_obj);
     
-    // finish input packet
-    PacketPassInterface_Done(&o->input);
-    o->in_len = -1;
+    o->output_busy = 0;
+    
+    // finish packet
+    release_slot(o);
+    
+    // output the next packet
+    maybe_output(o);
 }
 
 static void maybe_stop_work_and_ignore (SPProtoDecoder *o)
 {
-    ASSERT(!(o->tw_have) || o->in_len >= 0)
+    int have_dropped = 0;
     
-    if (o->tw_have) {
+    for (int i = 0; i < o->slots_count; i++) {
+        struct SPProtoDecoder_slot *s = get_slot(o, i);
+        if (s->state != SLOT_STATE_WORKING) {
+            continue;
+        }
+        
         // free work
-        BThreadWork_Free(&o->tw);
-        o->tw_have = 0;
+        BThreadWork_Free(&s->tw);
         
-        // ignore packet, receive next one
-        PacketPassInterface_Done(&o->input);
-        o->in_len = -1;
+        // ignore packet
+        s->state = SLOT_STATE_DONE;
+        s->tw_out_len = -1;
+        have_dropped = 1;
+    }
+    
+    if (have_dropped) {
+        maybe_output(o);
     }
 }
 
-int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct spproto_security_params sp_params, int num_otp_seeds, BPendingGroup *pg, BThreadWorkDispatcher *twd, void *user, BLog_logfunc logfunc)
+int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct spproto_security_params sp_params, int num_otp_seeds, BPendingGroup *pg, BThreadWorkDispatcher *twd, int pipeline_depth, void *user, BLog_logfunc logfunc)
 {
     spproto_assert_security_params(sp_params);
     ASSERT(spproto_carrier_mtu_for_payload_mtu(sp_params, PacketPassInterface_GetMTU(output)) >= 0)
     ASSERT(!SPPROTO_HAVE_OTP(sp_params) || num_otp_seeds >= 2)
+    ASSERT(pipeline_depth >= 1)
     
     // init arguments
     o->output = output;
     o->sp_params = sp_params;
     o->twd = twd;
+    o->depth = pipeline_depth;
     o->user = user;
     o->logfunc = logfunc;
     
@@ -258,14 +381,38 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
     // calculate input MTU
     o->input_mtu = spproto_carrier_mtu_for_payload_mtu(o->sp_params, o->output_mtu);
     
-    // allocate plaintext buffer
+    // allocate slots
+    if (!(o->slots = (struct SPProtoDecoder_slot *)BAllocArray(o->depth, sizeof(o->slots[0])))) {
+        goto fail0;
+    }
+    
+    // calculate slot buffer sizes; with one slot, the input buffer is given by the sender
+    int in_size = (o->depth > 1 ? o->input_mtu : 0);
+    int buf_size = 0;
     if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        int buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->output_mtu + 1), o->enc_block_size);
-        if (!(o->buf = (uint8_t *)malloc(buf_size))) {
-            goto fail0;
+        buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->output_mtu + 1), o->enc_block_size);
+    }
+    
+    // allocate slot buffers
+    o->slots_mem = NULL;
+    if (in_size + buf_size > 0) {
+        if (!(o->slots_mem = (uint8_t *)BAllocArray(o->depth, in_size + buf_size))) {
+            goto fail0a;
         }
     }
     
+    // init slots
+    for (int i = 0; i < o->depth; i++) {
+        struct SPProtoDecoder_slot *s = &o->slots[i];
+        uint8_t *mem = (o->slots_mem ? o->slots_mem + (size_t)i * (in_size + buf_size) : NULL);
+        s->o = o;
+        s->state = SLOT_STATE_FREE;
+        s->in = (in_size > 0 ? mem : NULL);
+        s->buf = (buf_size > 0 ? mem + in_size : NULL);
+    }
+    o->slots_start = 0;
+    o->slots_count = 0;
+    
     // init input
     PacketPassInterface_Init(&o->input, o->input_mtu, (PacketPassInterface_handler_send)input_handler_send, o, pg);
     
@@ -277,15 +424,13 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
     }
     
     // have no encryption key
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) { 
+    if (SPPROTO_HAVE_KEY(o->sp_params)) { 
         o->have_encryption_key = 0;
     }
     
-    // have no input packet
-    o->in_len = -1;
-    
-    // have no work
-    o->tw_have = 0;
+    // not holding back input, not sending output
+    o->input_blocked = 0;
+    o->output_busy = 0;
     
     DebugObject_Init(&o->d_obj);
     
@@ -293,9 +438,11 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
     
 fail1:
     PacketPassInterface_Free(&o->input);
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
+    if (o->slots_mem) {
+        BFree(o->slots_mem);
     }
+fail0a:
+    BFree(o->slots);
 fail0:
     return 0;
 }
@@ -305,13 +452,16 @@ void SPProtoDecoder_Free (SPProtoDecoder *o)
     DebugObject_Free(&o->d_obj);
     
     // free work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
+    for (int i = 0; i < o->slots_count; i++) {
+        struct SPProtoDecoder_slot *s = get_slot(o, i);
+        if (s->state == SLOT_STATE_WORKING) {
+            BThreadWork_Free(&s->tw);
+        }
     }
     
-    // free encryptor
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+    // free encryptors
+    if (SPPROTO_HAVE_KEY(o->sp_params) && o->have_encryption_key) {
+        free_key(o);
     }
     
     // free OTP checker
@@ -322,10 +472,11 @@ void SPProtoDecoder_Free (SPProtoDecoder *o)
     // free input
     PacketPassInterface_Free(&o->input);
     
-    // free plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
+    // free slots
+    if (o->slots_mem) {
+        BFree(o->slots_mem);
     }
+    BFree(o->slots);
 }
 
 PacketPassInterface * SPProtoDecoder_GetInput (SPProtoDecoder *o)
@@ -335,9 +486,10 @@ PacketPassInterface * SPProtoDecoder_GetInput (SPProtoDecoder *o)
     return &o->input;
 }
 
-void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key)
+void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key, int aead_role)
 {
-    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(SPPROTO_HAVE_KEY(o->sp_params))
+    ASSERT(aead_role == SPPROTO_AEAD_ROLE_MASTER || aead_role == SPPROTO_AEAD_ROLE_SLAVE)
     DebugObject_Access(&o->d_obj);
     
     // stop existing work
@@ -345,11 +497,24 @@ void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key
     
     // free encryptor
     if (o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+        free_key(o);
     }
     
-    // init encryptor
-    BEncryption_Init(&o->encryptor, BENCRYPTION_MODE_DECRYPT, o->sp_params.encryption_mode, encryption_key);
+    // init encryptors
+    for (int i = 0; i < o->depth; i++) {
+        struct SPProtoDecoder_slot *s = &o->slots[i];
+        if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+            BAEAD_Init(&s->aead, BAEAD_MODE_DECRYPT, o->sp_params.aead_mode, encryption_key);
+        } else {
+            BEncryption_Init(&s->encryptor, BENCRYPTION_MODE_DECRYPT, o->sp_params.encryption_mode, encryption_key);
+        }
+    }
+    
+    // accept the nonce prefix of the other role
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        int peer_role = (aead_role == SPPROTO_AEAD_ROLE_MASTER ? SPPROTO_AEAD_ROLE_SLAVE : SPPROTO_AEAD_ROLE_MASTER);
+        spproto_aead_nonce_prefix(peer_role, o->aead_peer_nonce_prefix);
+    }
     
     // have encryption key
     o->have_encryption_key = 1;
@@ -357,7 +522,7 @@ void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key
 
 void SPProtoDecoder_RemoveEncryptionKey (SPProtoDecoder *o)
 {
-    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(SPPROTO_HAVE_KEY(o->sp_params))
     DebugObject_Access(&o->d_obj);
     
     // stop existing work
@@ -365,7 +530,7 @@ void SPProtoDecoder_RemoveEncryptionKey (SPProtoDecoder *o)
     
     if (o->have_encryption_key) {
         // free encryptor
-        BEncryption_Free(&o->encryptor);
+        free_key(o);
         
         // have no encryption key
         o->have_encryption_key = 0;
@@ -41,6 +41,7 @@
 #include <base/BLog.h>
 #include <protocol/spproto.h>
 #include <security/BEncryption.h>
+#include <security/BAEAD.h>
 #include <security/OTPChecker.h>
 #include <flow/PacketPassInterface.h>
 
@@ -51,15 +52,44 @@
  */
 typedef void (*SPProtoDecoder_otp_handler) (void *user);
 
+struct SPProtoDecoder_s;
+
+/**
+ * Packet slot of {@link SPProtoDecoder}.
+ */
+struct SPProtoDecoder_slot {
+    struct SPProtoDecoder_s *o;
+    int state;
+    uint8_t *in;
+    uint8_t *buf;
+    BEncryption encryptor;
+    BAEAD aead;
+    int in_len;
+    BThreadWork tw;
+    uint16_t tw_out_seed_id;
+    otp_t tw_out_otp;
+    uint8_t *tw_out;
+    int tw_out_len;
+};
+
 /**
  * Object which decodes packets according to SPProto.
  * Input is with {@link PacketPassInterface}.
  * Output is with {@link PacketPassInterface}.
+ * 
+ * With a pipeline depth of one, a packet is decoded in the input buffer and
+ * the next one is accepted only after it has been sent to the output. With a
+ * larger depth, input packets are copied into slots and accepted immediately
+ * while a slot is free, and up to that many packets are decoded in parallel.
+ * Decoded packets are sent to the output in the order they were received.
+ * Each slot has its own cipher context, since these cannot be used by
+ * multiple threads at once.
  */
-typedef struct {
+typedef struct SPProtoDecoder_s {
     PacketPassInterface *output;
     struct spproto_security_params sp_params;
     BThreadWorkDispatcher *twd;
+    int depth;
     void *user;
     BLog_logfunc logfunc;
     int output_mtu;
@@ -67,19 +97,16 @@ typedef struct {
     int enc_block_size;
     int enc_key_size;
     int input_mtu;
-    uint8_t *buf;
     PacketPassInterface input;
     OTPChecker otpchecker;
     int have_encryption_key;
-    BEncryption encryptor;
-    uint8_t *in;
-    int in_len;
-    int tw_have;
-    BThreadWork tw;
-    uint16_t tw_out_seed_id;
-    otp_t tw_out_otp;
-    uint8_t *tw_out;
-    int tw_out_len;
+    uint8_t aead_peer_nonce_prefix[SPPROTO_AEAD_NONCE_PREFIX_LEN];
+    int input_blocked;
+    int output_busy;
+    struct SPProtoDecoder_slot *slots;
+    uint8_t *slots_mem;
+    int slots_start;
+    int slots_count;
     DebugObject d_obj;
 } SPProtoDecoder;
 
@@ -97,11 +124,13 @@ typedef struct {
  *                      receiving packets. Must be >=2 if using OTPs.
  * @param pg pending group
  * @param twd thread work dispatcher
+ * @param pipeline_depth maximum number of packets being decoded at once. Must be >=1.
+ *                       With 1, packets are decoded directly in the input buffer.
  * @param user argument to handlers
  * @param logfunc function which prepends the log prefix using {@link BLog_Append}
  * @return 1 on success, 0 on failure
  */
-int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct spproto_security_params sp_params, int num_otp_seeds, BPendingGroup *pg, BThreadWorkDispatcher *twd, void *user, BLog_logfunc logfunc) WARN_UNUSED;
+int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct spproto_security_params sp_params, int num_otp_seeds, BPendingGroup *pg, BThreadWorkDispatcher *twd, int pipeline_depth, void *user, BLog_logfunc logfunc) WARN_UNUSED;
 
 /**
  * Frees the object.
@@ -122,16 +151,21 @@ PacketPassInterface * SPProtoDecoder_GetInput (SPProtoDecoder *o);
 
 /**
  * Sets an encryption key for decrypting packets.
- * Encryption must be enabled.
+ * Encryption or AEAD must be enabled.
+ * With AEAD, only packets whose nonce prefix belongs to the other role are
+ * accepted.
  *
  * @param o the object
  * @param encryption_key key to use
+ * @param aead_role our role, SPPROTO_AEAD_ROLE_MASTER or SPPROTO_AEAD_ROLE_SLAVE,
+ *                  the same as given to our own {@link SPProtoEncoder}.
+ *                  Must be valid even without AEAD.
  */
-void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key);
+void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key, int aead_role);
 
 /**
  * Removes an encryption key if one is configured.
- * Encryption must be enabled.
+ * Encryption or AEAD must be enabled.
  *
  * @param o the object
  */
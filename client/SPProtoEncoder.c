@@ -31,6 +31,7 @@
 #include <stdlib.h>
 
 #include <misc/balign.h>
+#include <misc/balloc.h>
 #include <misc/offset.h>
 #include <misc/byteorder.h>
 #include <security/BRandom.h>
@@ -38,45 +39,76 @@
 
 #include "SPProtoEncoder.h"
 
+#define SLOT_STATE_FREE 1
+#define SLOT_STATE_WAITING 2
+#define SLOT_STATE_WORKING 3
+#define SLOT_STATE_DONE 4
+
+static struct SPProtoEncoder_slot * get_slot (SPProtoEncoder *o, int i);
+static uint8_t * plaintext_location (SPProtoEncoder *o, struct SPProtoEncoder_slot *s);
 static int can_encode (SPProtoEncoder *o);
-static void encode_packet (SPProtoEncoder *o);
-static void encode_work_func (SPProtoEncoder *o);
-static void encode_work_handler (SPProtoEncoder *o);
+static void encode_packet (SPProtoEncoder *o, struct SPProtoEncoder_slot *s);
+static void encode_work_func (struct SPProtoEncoder_slot *s);
+static void encode_work_handler (struct SPProtoEncoder_slot *s);
 static void maybe_encode (SPProtoEncoder *o);
+static void maybe_receive (SPProtoEncoder *o);
+static void maybe_output (SPProtoEncoder *o);
 static void output_handler_recv (SPProtoEncoder *o, uint8_t *data);
 static void input_handler_done (SPProtoEncoder *o, int data_len);
 static void handler_job_hander (SPProtoEncoder *o);
 static void otpgenerator_handler (SPProtoEncoder *o);
 static void maybe_stop_work (SPProtoEncoder *o);
+static void free_key (SPProtoEncoder *o);
 
-static int can_encode (SPProtoEncoder *o)
+static struct SPProtoEncoder_slot * get_slot (SPProtoEncoder *o, int i)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    ASSERT(i >= 0)
+    ASSERT(i < o->depth)
     
+    return &o->slots[(o->slots_start + i) % o->depth];
+}
+
+static uint8_t * plaintext_location (SPProtoEncoder *o, struct SPProtoEncoder_slot *s)
+{
+    ASSERT(s->out)
+    
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        // encrypted in place, after the nonce
+        return s->out + BAEAD_NONCE_SIZE;
+    }
+    
+    return (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? s->buf : s->out);
+}
+
+static int can_encode (SPProtoEncoder *o)
+{
     return (
         (!SPPROTO_HAVE_OTP(o->sp_params) || OTPGenerator_GetPosition(&o->otpgen) < o->sp_params.otp_num) &&
-        (!SPPROTO_HAVE_ENCRYPTION(o->sp_params) || o->have_encryption_key)
+        (!SPPROTO_HAVE_KEY(o->sp_params) || o->have_encryption_key)
     );
 }
 
-static void encode_packet (SPProtoEncoder *o)
+static void encode_packet (SPProtoEncoder *o, struct SPProtoEncoder_slot *s)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    ASSERT(s->state == SLOT_STATE_WAITING)
+    ASSERT(s->in_len >= 0)
     ASSERT(can_encode(o))
     
     // generate OTP, remember seed ID
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
-        o->tw_seed_id = o->otpgen_seed_id;
-        o->tw_otp = OTPGenerator_GetOTP(&o->otpgen);
+        s->tw_seed_id = o->otpgen_seed_id;
+        s->tw_otp = OTPGenerator_GetOTP(&o->otpgen);
+    }
+    
+    // take AEAD nonce counter; it is consumed even if the work is cancelled
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        s->tw_aead_counter = o->aead_counter++;
     }
     
     // start work
-    BThreadWork_Init(&o->tw, o->twd, (BThreadWork_handler_done)encode_work_handler, o, (BThreadWork_work_func)encode_work_func, o);
-    o->tw_have = 1;
+    s->tw_encoded = 0;
+    BThreadWork_Init(&s->tw, o->twd, (BThreadWork_handler_done)encode_work_handler, s, (BThreadWork_work_func)encode_work_func, s);
+    s->state = SLOT_STATE_WORKING;
     
     // schedule OTP warning handler
     if (SPPROTO_HAVE_OTP(o->sp_params) && OTPGenerator_GetPosition(&o->otpgen) == o->otp_warning_count) {
@@ -84,28 +116,27 @@ static void encode_packet (SPProtoEncoder *o)
     }
 }
 
-static void encode_work_func (SPProtoEncoder *o)
+static void encode_work_func (struct SPProtoEncoder_slot *s)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(!SPPROTO_HAVE_ENCRYPTION(o->sp_params) || o->have_encryption_key)
-    
-    ASSERT(o->in_len <= o->input_mtu)
+    SPProtoEncoder *o = s->o;
+    ASSERT(s->in_len >= 0)
+    ASSERT(s->in_len <= o->input_mtu)
+    ASSERT(!SPPROTO_HAVE_KEY(o->sp_params) || o->have_encryption_key)
     
     // determine plaintext location
-    uint8_t *plaintext = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? o->buf : o->out);
+    uint8_t *plaintext = plaintext_location(o, s);
     
     // plaintext begins with header
     uint8_t *header = plaintext;
     
     // plaintext is header + payload
-    int plaintext_len = SPPROTO_HEADER_LEN(o->sp_params) + o->in_len;
+    int plaintext_len = SPPROTO_HEADER_LEN(o->sp_params) + s->in_len;
     
     // write OTP
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
         struct spproto_otpdata header_otpd;
-        header_otpd.seed_id = htol16(o->tw_seed_id);
-        header_otpd.otp = o->tw_otp;
+        header_otpd.seed_id = htol16(s->tw_seed_id);
+        header_otpd.otp = s->tw_otp;
         memcpy(header + SPPROTO_HEADER_OTPDATA_OFF(o->sp_params), &header_otpd, sizeof(header_otpd));
     }
     
@@ -123,7 +154,18 @@ static void encode_work_func (SPProtoEncoder *o)
     
     int out_len;
     
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        // write nonce
+        uint8_t *nonce = s->out;
+        memcpy(nonce, o->aead_nonce_prefix, SPPROTO_AEAD_NONCE_PREFIX_LEN);
+        uint64_t counter = htol64(s->tw_aead_counter);
+        memcpy(nonce + SPPROTO_AEAD_NONCE_PREFIX_LEN, &counter, sizeof(counter));
+        
+        // encrypt in place and append tag
+        BAEAD_Encrypt(&s->aead, nonce, plaintext, plaintext, plaintext_len, plaintext + plaintext_len);
+        out_len = BAEAD_NONCE_SIZE + plaintext_len + BAEAD_TAG_SIZE;
+    }
+    else if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
         // encrypting pad(header + payload)
         int cyphertext_len = balign_up((plaintext_len + 1), o->enc_block_size);
         
@@ -134,80 +176,145 @@ static void encode_work_func (SPProtoEncoder *o)
         }
         
         // generate IV
-        BRandom_randomize(o->out, o->enc_block_size);
+        BRandom_randomize(s->out, o->enc_block_size);
         
         // copy IV because BEncryption_Encrypt changes the IV
         uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
-        memcpy(iv, o->out, o->enc_block_size);
+        memcpy(iv, s->out, o->enc_block_size);
         
         // encrypt
-        BEncryption_Encrypt(&o->encryptor, plaintext, o->out + o->enc_block_size, cyphertext_len, iv);
+        BEncryption_Encrypt(&s->encryptor, plaintext, s->out + o->enc_block_size, cyphertext_len, iv);
         out_len = o->enc_block_size + cyphertext_len;
     } else {
         out_len = plaintext_len;
     }
     
     // remember length
-    o->tw_out_len = out_len;
+    s->tw_out_len = out_len;
+    
+    // the plaintext may now be gone (AEAD encrypts in place), so the
+    // packet must not be encoded again if the work is cancelled
+    s->tw_encoded = 1;
 }
 
-static void encode_work_handler (SPProtoEncoder *o)
+static void encode_work_handler (struct SPProtoEncoder_slot *s)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(o->tw_have)
+    SPProtoEncoder *o = s->o;
+    ASSERT(s->state == SLOT_STATE_WORKING)
+    DebugObject_Access(&o->d_obj);
     
     // free work
-    BThreadWork_Free(&o->tw);
-    o->tw_have = 0;
+    BThreadWork_Free(&s->tw);
     
-    // finish packet
-    o->in_len = -1;
-    o->out_have = 0;
-    PacketRecvInterface_Done(&o->output, o->tw_out_len);
+    // packet is encoded
+    s->state = SLOT_STATE_DONE;
+    
+    // possibly output packet
+    maybe_output(o);
 }
 
 static void maybe_encode (SPProtoEncoder *o)
 {
-    if (o->in_len >= 0 && o->out_have && !o->tw_have && can_encode(o)) {
-        encode_packet(o);
+    // start encoding waiting packets, in order
+    for (int i = 0; i < o->slots_count; i++) {
+        struct SPProtoEncoder_slot *s = get_slot(o, i);
+        if (s->state != SLOT_STATE_WAITING) {
+            continue;
+        }
+        if (!can_encode(o)) {
+            break;
+        }
+        encode_packet(o, s);
+    }
+}
+
+static void maybe_receive (SPProtoEncoder *o)
+{
+    // with one slot, we receive into the output buffer, so we need one
+    if (o->receiving || o->slots_count == o->depth || (o->depth == 1 && !o->out_have)) {
+        return;
     }
+    
+    struct SPProtoEncoder_slot *s = get_slot(o, o->slots_count);
+    ASSERT(s->state == SLOT_STATE_FREE)
+    
+    if (o->depth == 1) {
+        s->out = o->out;
+    }
+    
+    // schedule receive
+    o->receiving = 1;
+    PacketRecvInterface_Receiver_Recv(o->input, plaintext_location(o, s) + SPPROTO_HEADER_LEN(o->sp_params));
+}
+
+static void maybe_output (SPProtoEncoder *o)
+{
+    if (!o->out_have || o->slots_count == 0) {
+        return;
+    }
+    
+    struct SPProtoEncoder_slot *s = get_slot(o, 0);
+    if (s->state != SLOT_STATE_DONE) {
+        return;
+    }
+    
+    int out_len = s->tw_out_len;
+    
+    // copy packet to output, unless it was encoded there
+    if (o->depth > 1) {
+        memcpy(o->out, s->out, out_len);
+    }
+    
+    // free slot
+    s->state = SLOT_STATE_FREE;
+    o->slots_start = (o->slots_start + 1) % o->depth;
+    o->slots_count--;
+    
+    // finish packet
+    o->out_have = 0;
+    PacketRecvInterface_Done(&o->output, out_len);
+    
+    // continue receiving
+    maybe_receive(o);
 }
 
 static void output_handler_recv (SPProtoEncoder *o, uint8_t *data)
 {
-    ASSERT(o->in_len == -1)
     ASSERT(!o->out_have)
-    ASSERT(!o->tw_have)
     DebugObject_Access(&o->d_obj);
     
     // remember output packet
     o->out_have = 1;
     o->out = data;
     
-    // determine plaintext location
-    uint8_t *plaintext = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? o->buf : o->out);
-    
-    // schedule receive
-    PacketRecvInterface_Receiver_Recv(o->input, plaintext + SPPROTO_HEADER_LEN(o->sp_params));
+    // output a packet if we have one, else receive one
+    if (o->slots_count > 0) {
+        maybe_output(o);
+    } else {
+        maybe_receive(o);
+    }
 }
 
 static void input_handler_done (SPProtoEncoder *o, int data_len)
 {
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->input_mtu)
-    ASSERT(o->in_len == -1)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    ASSERT(o->receiving)
+    ASSERT(o->slots_count < o->depth)
     DebugObject_Access(&o->d_obj);
     
     // remember input packet
-    o->in_len = data_len;
+    struct SPProtoEncoder_slot *s = get_slot(o, o->slots_count);
+    s->in_len = data_len;
+    s->state = SLOT_STATE_WAITING;
+    o->slots_count++;
+    o->receiving = 0;
     
     // encode if possible
-    if (can_encode(o)) {
-        encode_packet(o);
-    }
+    maybe_encode(o);
+    
+    // read ahead
+    maybe_receive(o);
 }
 
 static void handler_job_hander (SPProtoEncoder *o)
@@ -233,16 +340,83 @@ static void otpgenerator_handler (SPProtoEncoder *o)
     maybe_encode(o);
 }
 
+static void swap_slot_packets (struct SPProtoEncoder_slot *s1, struct SPProtoEncoder_slot *s2)
+{
+    ASSERT(s1->state != SLOT_STATE_WORKING)
+    ASSERT(s2->state != SLOT_STATE_WORKING)
+    
+    int state = s1->state;
+    int in_len = s1->in_len;
+    uint8_t *out = s1->out;
+    uint8_t *buf = s1->buf;
+    
+    s1->state = s2->state;
+    s1->in_len = s2->in_len;
+    s1->out = s2->out;
+    s1->buf = s2->buf;
+    
+    s2->state = state;
+    s2->in_len = in_len;
+    s2->out = out;
+    s2->buf = buf;
+}
+
 static void maybe_stop_work (SPProtoEncoder *o)
 {
-    // stop existing work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
-        o->tw_have = 0;
+    // stop existing work. If the work got to encode the packet, the packet is
+    // discarded like the ones already done; otherwise it is encoded again later.
+    for (int i = 0; i < o->slots_count; i++) {
+        struct SPProtoEncoder_slot *s = get_slot(o, i);
+        if (s->state != SLOT_STATE_WORKING) {
+            continue;
+        }
+        
+        BThreadWork_Free(&s->tw);
+        s->state = (s->tw_encoded ? SLOT_STATE_DONE : SLOT_STATE_WAITING);
+    }
+    
+    // discard packets encoded with the old key, the peer would not be able to
+    // decode them. Keep the remaining packets in order, followed by the slot
+    // we may be receiving into.
+    int kept = 0;
+    for (int i = 0; i < o->slots_count; i++) {
+        struct SPProtoEncoder_slot *s = get_slot(o, i);
+        ASSERT(s->state == SLOT_STATE_WAITING || s->state == SLOT_STATE_DONE)
+        
+        if (s->state == SLOT_STATE_DONE) {
+            s->state = SLOT_STATE_FREE;
+            continue;
+        }
+        
+        if (kept != i) {
+            swap_slot_packets(get_slot(o, kept), s);
+        }
+        kept++;
+    }
+    
+    if (o->receiving && kept != o->slots_count) {
+        swap_slot_packets(get_slot(o, kept), get_slot(o, o->slots_count));
+    }
+    
+    o->slots_count = kept;
+}
+
+static void free_key (SPProtoEncoder *o)
+{
+    ASSERT(SPPROTO_HAVE_KEY(o->sp_params))
+    ASSERT(o->have_encryption_key)
+    
+    for (int i = 0; i < o->depth; i++) {
+        struct SPProtoEncoder_slot *s = &o->slots[i];
+        if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+            BAEAD_Free(&s->aead);
+        } else {
+            BEncryption_Free(&s->encryptor);
+        }
     }
 }
 
-int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct spproto_security_params sp_params, int otp_warning_count, BPendingGroup *pg, BThreadWorkDispatcher *twd)
+int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct spproto_security_params sp_params, int otp_warning_count, BPendingGroup *pg, BThreadWorkDispatcher *twd, int pipeline_depth)
 {
     spproto_assert_security_params(sp_params);
     ASSERT(spproto_carrier_mtu_for_payload_mtu(sp_params, PacketRecvInterface_GetMTU(input)) >= 0)
@@ -250,12 +424,14 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
         ASSERT(otp_warning_count > 0)
         ASSERT(otp_warning_count <= sp_params.otp_num)
     }
+    ASSERT(pipeline_depth >= 1)
     
     // init arguments
     o->input = input;
     o->sp_params = sp_params;
     o->otp_warning_count = otp_warning_count;
     o->twd = twd;
+    o->depth = pipeline_depth;
     
     // set no handlers
     o->handler = NULL;
@@ -279,7 +455,7 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
     }
     
     // have no encryption key
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) { 
+    if (SPPROTO_HAVE_KEY(o->sp_params)) { 
         o->have_encryption_key = 0;
     }
     
@@ -292,33 +468,61 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
     // init input
     PacketRecvInterface_Receiver_Init(o->input, (PacketRecvInterface_handler_done)input_handler_done, o);
     
-    // have no input in buffer
-    o->in_len = -1;
-    
     // init output
     PacketRecvInterface_Init(&o->output, o->output_mtu, (PacketRecvInterface_handler_recv)output_handler_recv, o, pg);
     
     // have no output available
     o->out_have = 0;
     
-    // allocate plaintext buffer
+    // allocate slots
+    if (!(o->slots = (struct SPProtoEncoder_slot *)BAllocArray(o->depth, sizeof(o->slots[0])))) {
+        goto fail1;
+    }
+    
+    // calculate slot buffer sizes; with one slot, the output buffer is given by the receiver
+    int out_size = (o->depth > 1 ? o->output_mtu : 0);
+    int buf_size = 0;
     if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        int buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->input_mtu + 1), o->enc_block_size);
-        if (!(o->buf = (uint8_t *)malloc(buf_size))) {
-            goto fail1;
+        buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->input_mtu + 1), o->enc_block_size);
+    }
+    
+    // allocate slot buffers
+    o->slots_mem = NULL;
+    if (out_size + buf_size > 0) {
+        if (!(o->slots_mem = (uint8_t *)BAllocArray(o->depth, out_size + buf_size))) {
+            goto fail2;
         }
     }
     
+    // init slots
+    for (int i = 0; i < o->depth; i++) {
+        struct SPProtoEncoder_slot *s = &o->slots[i];
+        uint8_t *mem = (o->slots_mem ? o->slots_mem + (size_t)i * (out_size + buf_size) : NULL);
+        s->o = o;
+        s->state = SLOT_STATE_FREE;
+        s->out = (out_size > 0 ? mem : NULL);
+        s->buf = (buf_size > 0 ? mem + out_size : NULL);
+    }
+    o->slots_start = 0;
+    o->slots_count = 0;
+    
     // init handler job
     BPending_Init(&o->handler_job, pg, (BPending_handler)handler_job_hander, o);
     
-    // have no work
-    o->tw_have = 0;
+    // not receiving
+    o->receiving = 0;
+    
+    // start reading ahead
+    if (o->depth > 1) {
+        maybe_receive(o);
+    }
     
     DebugObject_Init(&o->d_obj);
     
     return 1;
     
+fail2:
+    BFree(o->slots);
 fail1:
     PacketRecvInterface_Free(&o->output);
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
@@ -333,26 +537,30 @@ void SPProtoEncoder_Free (SPProtoEncoder *o)
     DebugObject_Free(&o->d_obj);
     
     // free work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
+    for (int i = 0; i < o->slots_count; i++) {
+        struct SPProtoEncoder_slot *s = get_slot(o, i);
+        if (s->state == SLOT_STATE_WORKING) {
+            BThreadWork_Free(&s->tw);
+        }
     }
     
     // free handler job
     BPending_Free(&o->handler_job);
     
-    // free plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
+    // free encryptors
+    if (SPPROTO_HAVE_KEY(o->sp_params) && o->have_encryption_key) {
+        free_key(o);
+    }
+    
+    // free slots
+    if (o->slots_mem) {
+        BFree(o->slots_mem);
     }
+    BFree(o->slots);
     
     // free output
     PacketRecvInterface_Free(&o->output);
     
-    // free encryptor
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
-    }
-    
     // free otp generator
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
         OTPGenerator_Free(&o->otpgen);
@@ -366,9 +574,10 @@ PacketRecvInterface * SPProtoEncoder_GetOutput (SPProtoEncoder *o)
     return &o->output;
 }
 
-void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key)
+void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key, int aead_role)
 {
-    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(SPPROTO_HAVE_KEY(o->sp_params))
+    ASSERT(aead_role == SPPROTO_AEAD_ROLE_MASTER || aead_role == SPPROTO_AEAD_ROLE_SLAVE)
     DebugObject_Access(&o->d_obj);
     
     // stop existing work
@@ -376,22 +585,37 @@ void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key
     
     // free encryptor
     if (o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+        free_key(o);
+    }
+    
+    // init encryptors
+    for (int i = 0; i < o->depth; i++) {
+        struct SPProtoEncoder_slot *s = &o->slots[i];
+        if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+            BAEAD_Init(&s->aead, BAEAD_MODE_ENCRYPT, o->sp_params.aead_mode, encryption_key);
+        } else {
+            BEncryption_Init(&s->encryptor, BENCRYPTION_MODE_ENCRYPT, o->sp_params.encryption_mode, encryption_key);
+        }
     }
     
-    // init encryptor
-    BEncryption_Init(&o->encryptor, BENCRYPTION_MODE_ENCRYPT, o->sp_params.encryption_mode, encryption_key);
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        // Both directions share the key, so our nonces are kept apart
+        // from the peer's by a prefix fixed by our role.
+        spproto_aead_nonce_prefix(aead_role, o->aead_nonce_prefix);
+        o->aead_counter = 0;
+    }
     
     // have encryption key
     o->have_encryption_key = 1;
     
     // possibly continue I/O
     maybe_encode(o);
+    maybe_receive(o);
 }
 
 void SPProtoEncoder_RemoveEncryptionKey (SPProtoEncoder *o)
 {
-    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(SPPROTO_HAVE_KEY(o->sp_params))
     DebugObject_Access(&o->d_obj);
     
     // stop existing work
@@ -399,11 +623,14 @@ void SPProtoEncoder_RemoveEncryptionKey (SPProtoEncoder *o)
     
     if (o->have_encryption_key) {
         // free encryptor
-        BEncryption_Free(&o->encryptor);
+        free_key(o);
         
         // have no encryption key
         o->have_encryption_key = 0;
     }
+    
+    // refill slots freed by discarded packets
+    maybe_receive(o);
 }
 
 void SPProtoEncoder_SetOTPSeed (SPProtoEncoder *o, uint16_t seed_id, uint8_t *key, uint8_t *iv)
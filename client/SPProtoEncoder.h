@@ -40,6 +40,7 @@
 #include <protocol/spproto.h>
 #include <base/DebugObject.h>
 #include <security/BEncryption.h>
+#include <security/BAEAD.h>
 #include <security/OTPGenerator.h>
 #include <flow/PacketRecvInterface.h>
 #include <threadwork/BThreadWork.h>
@@ -52,18 +53,48 @@
  */
 typedef void (*SPProtoEncoder_handler) (void *user);
 
+struct SPProtoEncoder_s;
+
+/**
+ * Packet slot of {@link SPProtoEncoder}.
+ */
+struct SPProtoEncoder_slot {
+    struct SPProtoEncoder_s *o;
+    int state;
+    uint8_t *out;
+    uint8_t *buf;
+    BEncryption encryptor;
+    BAEAD aead;
+    int in_len;
+    BThreadWork tw;
+    int tw_encoded;
+    uint16_t tw_seed_id;
+    otp_t tw_otp;
+    uint64_t tw_aead_counter;
+    int tw_out_len;
+};
+
 /**
  * Object which encodes packets according to SPProto.
  *
  * Input is with {@link PacketRecvInterface}.
  * Output is with {@link PacketRecvInterface}.
+ * 
+ * With a pipeline depth of one, a packet is received directly into the output
+ * buffer and encoded there, one packet at a time. With a larger depth, the object
+ * reads ahead up to that many packets into its own slots and keeps their encoding
+ * work in flight in parallel, so that a single busy link can use multiple
+ * {@link BThreadWorkDispatcher} threads. Encoded packets are copied to the output
+ * in the order they were received. Each slot has its own cipher context, since
+ * these cannot be used by multiple threads at once.
  */
-typedef struct {
+typedef struct SPProtoEncoder_s {
     PacketRecvInterface *input;
     struct spproto_security_params sp_params;
     int otp_warning_count;
     SPProtoEncoder_handler handler;
     BThreadWorkDispatcher *twd;
+    int depth;
     void *user;
     int hash_size;
     int enc_block_size;
@@ -72,20 +103,19 @@ typedef struct {
     uint16_t otpgen_seed_id;
     uint16_t otpgen_pending_seed_id;
     int have_encryption_key;
-    BEncryption encryptor;
+    uint8_t aead_nonce_prefix[SPPROTO_AEAD_NONCE_PREFIX_LEN];
+    uint64_t aead_counter;
     int input_mtu;
     int output_mtu;
-    int in_len;
     PacketRecvInterface output;
     int out_have;
     uint8_t *out;
-    uint8_t *buf;
     BPending handler_job;
-    int tw_have;
-    BThreadWork tw;
-    uint16_t tw_seed_id;
-    otp_t tw_otp;
-    int tw_out_len;
+    struct SPProtoEncoder_slot *slots;
+    uint8_t *slots_mem;
+    int slots_start;
+    int slots_count;
+    int receiving;
     DebugObject d_obj;
 } SPProtoEncoder;
 
@@ -103,9 +133,11 @@ typedef struct {
  *                          In this case, must be >0 and <=sp_params.otp_num.
  * @param pg pending group
  * @param twd thread work dispatcher
+ * @param pipeline_depth maximum number of packets being encoded at once. Must be >=1.
+ *                       With 1, packets are encoded directly in the output buffer.
  * @return 1 on success, 0 on failure
  */
-int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct spproto_security_params sp_params, int otp_warning_count, BPendingGroup *pg, BThreadWorkDispatcher *twd) WARN_UNUSED;
+int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct spproto_security_params sp_params, int otp_warning_count, BPendingGroup *pg, BThreadWorkDispatcher *twd, int pipeline_depth) WARN_UNUSED;
 
 /**
  * Frees the object.
@@ -126,16 +158,24 @@ PacketRecvInterface * SPProtoEncoder_GetOutput (SPProtoEncoder *o);
 
 /**
  * Sets an encryption key to use.
- * Encryption must be enabled.
+ * Encryption or AEAD must be enabled.
+ * With AEAD, the key must be a new one, since the nonce counter restarts.
+ * Packets already encoded with the previous key which have not been output
+ * yet are discarded, since the peer would not be able to decode them.
  *
  * @param o the object
  * @param encryption_key key to use
+ * @param aead_role our role, SPPROTO_AEAD_ROLE_MASTER or SPPROTO_AEAD_ROLE_SLAVE.
+ *                  The peer must use the other role. Determines the AEAD
+ *                  nonce prefix; must be valid even without AEAD.
  */
-void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key);
+void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key, int aead_role);
 
 /**
  * Removes an encryption key if one is configured.
- * Encryption must be enabled.
+ * Encryption or AEAD must be enabled.
+ * Packets already encoded with the key which have not been output yet
+ * are discarded.
  *
  * @param o the object
  */
@@ -34,6 +34,7 @@
 
 #include <misc/offset.h>
 #include <misc/byteorder.h>
+#include <misc/minmax.h>
 
 #include <client/StreamPeerIO.h>
 
@@ -337,13 +338,37 @@ int init_io (StreamPeerIO *pio, sslsocket *sock)
     // init receiving
     StreamRecvConnector_ConnectInput(&pio->input_connector, recv_if);
     
-    // init sending
-    PacketStreamSender_Init(&pio->output_pss, send_if, PACKETPROTO_ENCLEN(pio->payload_mtu), BReactor_PendingGroup(pio->reactor));
-    PacketPassConnector_ConnectOutput(&pio->output_connector, PacketStreamSender_GetInput(&pio->output_pss));
+    // init sending. With SSL, coalesce packets so that they don't each
+    // become a separate record.
+    if (pio->ssl) {
+        int enc_mtu = PACKETPROTO_ENCLEN(pio->payload_mtu);
+        if (!PacketStreamCoalescer_Init(&pio->output_coalescer, send_if, enc_mtu, bmax_int(enc_mtu, BSSLCONNECTION_MAX_RECORD_DATA), -1, pio->reactor)) {
+            PeerLog(pio, BLOG_ERROR, "PacketStreamCoalescer_Init failed");
+            goto fail1;
+        }
+        PacketPassConnector_ConnectOutput(&pio->output_connector, PacketStreamCoalescer_GetInput(&pio->output_coalescer));
+    } else {
+        PacketStreamSender_Init(&pio->output_pss, send_if, PACKETPROTO_ENCLEN(pio->payload_mtu), BReactor_PendingGroup(pio->reactor));
+        PacketPassConnector_ConnectOutput(&pio->output_connector, PacketStreamSender_GetInput(&pio->output_pss));
+    }
     
     pio->sock = sock;
     
     return 1;
+    
+fail1:
+    if (pio->ssl) {
+        BSSLConnection_ReleaseBuffers(&pio->sslcon);
+    }
+    PacketProtoDecoder_Reset(&pio->input_decoder);
+    StreamRecvConnector_DisconnectInput(&pio->input_connector);
+    if (pio->ssl) {
+        BSSLConnection_Free(&pio->sslcon);
+    } else {
+        BConnection_RecvAsync_Free(&sock->con);
+        BConnection_SendAsync_Free(&sock->con);
+    }
+    return 0;
 }
 
 void free_io (StreamPeerIO *pio)
@@ -360,7 +385,11 @@ void free_io (StreamPeerIO *pio)
     
     // free sending
     PacketPassConnector_DisconnectOutput(&pio->output_connector);
-    PacketStreamSender_Free(&pio->output_pss);
+    if (pio->ssl) {
+        PacketStreamCoalescer_Free(&pio->output_coalescer);
+    } else {
+        PacketStreamSender_Free(&pio->output_pss);
+    }
     
     // free receiving
     StreamRecvConnector_DisconnectInput(&pio->input_connector);
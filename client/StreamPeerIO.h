@@ -53,6 +53,7 @@
 #include <flow/PacketPassConnector.h>
 #include <flow/StreamRecvConnector.h>
 #include <flow/SingleStreamSender.h>
+#include <flowextra/PacketStreamCoalescer.h>
 #include <client/PasswordListener.h>
 
 /**
@@ -127,6 +128,7 @@ typedef struct {
     
     // sending objects
     PacketStreamSender output_pss;
+    PacketStreamCoalescer output_coalescer;
     
     DebugObject d_obj;
 } StreamPeerIO;
@@ -47,6 +47,7 @@
 #include <structure/LinkedList1.h>
 #include <base/DebugObject.h>
 #include <base/BLog.h>
+#include <base/BLog_binary.h>
 #include <security/BSecurity.h>
 #include <security/BRandom.h>
 #include <system/BSignal.h>
@@ -71,6 +72,7 @@
 
 #define LOGGER_STDOUT 1
 #define LOGGER_SYSLOG 2
+#define LOGGER_BINARY 3
 
 // command-line options
 struct ext_addr_option  {
@@ -91,9 +93,11 @@ struct {
     char *logger_syslog_facility;
     char *logger_syslog_ident;
     #endif
+    char *logger_binary_file;
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     int threads;
+    int pin_threads;
     int use_threads_for_ssl_handshake;
     int use_threads_for_ssl_data;
     int ssl;
@@ -108,6 +112,7 @@ struct {
     struct bind_addr_option bind_addrs[MAX_BIND_ADDRS];
     int transport_mode;
     int encryption_mode;
+    int aead_mode;
     int hash_mode;
     int otp_mode;
     int otp_num;
@@ -123,6 +128,11 @@ struct {
     int igmp_last_member_query_time;
     int allow_peer_talk_without_ssl;
     int max_peers;
+    int reactor_spin_us;
+    int udp_busy_poll_us;
+    int crypto_pipeline;
+    int udp_shared_sockets;
+    int udp_shared_batch;
 } options;
 
 // bind addresses
@@ -143,6 +153,12 @@ struct bind_addr bind_addrs[MAX_BIND_ADDRS];
 // TCP listeners
 PasswordListener listeners[MAX_BIND_ADDRS];
 
+#ifndef BADVPN_USE_WINAPI
+// shared UDP sockets, one per bind address
+DatagramSharedSocket shared_socks[MAX_BIND_ADDRS];
+int num_shared_socks;
+#endif
+
 // SPProto parameters (UDP only)
 struct spproto_security_params sp_params;
 
@@ -239,6 +255,7 @@ static void peer_log (struct peer_data *peer, int level, const char *fmt, ...);
 
 // see if we are the master relative to this peer
 static int peer_am_master (struct peer_data *peer);
+static int peer_aead_role (struct peer_data *peer);
 
 // frees PeerChat, disconnecting it from the server flow
 static void peer_free_chat (struct peer_data *peer);
@@ -315,7 +332,7 @@ static void peer_bind (struct peer_data *peer);
 
 static void peer_bind_one_address (struct peer_data *peer, int addr_index, int *cont);
 
-static void peer_connect (struct peer_data *peer, BAddr addr, uint8_t *encryption_key, uint64_t password);
+static void peer_connect (struct peer_data *peer, BAddr addr, uint8_t *encryption_key, int have_password, uint64_t password);
 
 static int peer_start_msg (struct peer_data *peer, void **data, int type, int len);
 
@@ -405,6 +422,12 @@ int main (int argc, char *argv[])
             }
             break;
         #endif
+        case LOGGER_BINARY:
+            if (!BLog_InitBinary(options.logger_binary_file)) {
+                fprintf(stderr, "Failed to initialize binary logger\n");
+                goto fail0;
+            }
+            break;
         default:
             ASSERT(0);
     }
@@ -481,6 +504,9 @@ int main (int argc, char *argv[])
         goto fail1;
     }
     
+    // configure adaptive spinning
+    BReactor_SetSpinTime(&ss, options.reactor_spin_us);
+    
     // setup signal handler
     if (!BSignal_Init(&ss, signal_handler, NULL)) {
         BLog(BLOG_ERROR, "BSignal_Init failed");
@@ -488,8 +514,12 @@ int main (int argc, char *argv[])
     }
     
     // init thread work dispatcher
-    if (!BThreadWorkDispatcher_Init(&twd, &ss, options.threads)) {
-        BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init failed");
+    struct BThreadWorkDispatcher_params twd_params;
+    twd_params.num_threads = options.threads;
+    twd_params.queue_size = 0;
+    twd_params.pin_threads = options.pin_threads;
+    if (!BThreadWorkDispatcher_Init2(&twd, &ss, twd_params)) {
+        BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init2 failed");
         goto fail3;
     }
     
@@ -514,6 +544,23 @@ int main (int argc, char *argv[])
         }
     }
     
+#ifndef BADVPN_USE_WINAPI
+    // init shared UDP sockets
+    num_shared_socks = 0;
+    if (options.udp_shared_sockets > 0) {
+        while (num_shared_socks < num_bind_addrs) {
+            struct bind_addr *addr = &bind_addrs[num_shared_socks];
+            if (!DatagramSharedSocket_Init(&shared_socks[num_shared_socks], &ss, addr->addr, options.udp_shared_sockets, CLIENT_UDP_MTU - DATAGRAMSHAREDSOCKET_HEADER_SIZE,
+                                           options.udp_shared_batch, CLIENT_UDP_SHARED_PORT_QUEUE, options.udp_busy_poll_us
+            )) {
+                BLog(BLOG_ERROR, "DatagramSharedSocket_Init failed");
+                goto fail8;
+            }
+            num_shared_socks++;
+        }
+    }
+#endif
+    
     // init device
     if (!BTap_Init(&device, &ss, options.tapdev, device_error_handler, NULL, 0)) {
         BLog(BLOG_ERROR, "BTap_Init failed");
@@ -607,6 +654,11 @@ fail10:
 fail9:
     BTap_Free(&device);
 fail8:
+#ifndef BADVPN_USE_WINAPI
+    while (num_shared_socks-- > 0) {
+        DatagramSharedSocket_Free(&shared_socks[num_shared_socks]);
+    }
+#endif
     if (options.transport_mode == TRANSPORT_MODE_TCP) {
         while (num_listeners-- > 0) {
             PasswordListener_Free(&listeners[num_listeners]);
@@ -665,9 +717,13 @@ void print_help (const char *name)
         "            [--syslog-ident <string>]\n"
         "        )\n"
         #endif
+        "        (logger=binary?\n"
+        "            [--binlog-file <file>]\n"
+        "        )\n"
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--threads <integer>]\n"
+        "        [--pin-threads]\n"
         "        [--use-threads-for-ssl-handshake]\n"
         "        [--use-threads-for-ssl-data]\n"
         "        [--ssl --nssdb <string> --client-cert-name <string>]\n"
@@ -682,10 +738,15 @@ void print_help (const char *name)
         "        ] ...\n"
         "        --transport-mode <udp/tcp>\n"
         "        (transport-mode=udp?\n"
-        "            --encryption-mode <blowfish/aes/none>\n"
+        "            --encryption-mode <blowfish/aes/aes128-gcm/chacha20-poly1305/none>\n"
         "            --hash-mode <md5/sha1/none>\n"
         "            [--otp <blowfish/aes> <num> <num-warn>]\n"
         "            [--fragmentation-latency <milliseconds>]\n"
+        "            [--udp-busy-poll <microseconds>]\n"
+        "            [--crypto-pipeline <num-packets>]\n"
+        #ifndef BADVPN_USE_WINAPI
+        "            [--udp-shared-sockets <num> [--udp-shared-batch <num-packets>]]\n"
+        #endif
         "        )\n"
         "        (transport-mode=tcp?\n"
         "            (ssl? [--peer-ssl])\n"
@@ -699,6 +760,7 @@ void print_help (const char *name)
         "        [--igmp-last-member-query-time <ms>]\n"
         "        [--allow-peer-talk-without-ssl]\n"
         "        [--max-peers <number>]\n"
+        "        [--reactor-spin <microseconds>]\n"
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -722,11 +784,13 @@ int parse_arguments (int argc, char *argv[])
     options.logger_syslog_facility = "daemon";
     options.logger_syslog_ident = argv[0];
     #endif
+    options.logger_binary_file = "badvpn.blog";
     options.loglevel = -1;
     for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
         options.loglevels[i] = -1;
     }
     options.threads = 0;
+    options.pin_threads = 0;
     options.use_threads_for_ssl_handshake = 0;
     options.use_threads_for_ssl_data = 0;
     options.ssl = 0;
@@ -739,6 +803,7 @@ int parse_arguments (int argc, char *argv[])
     options.num_bind_addrs = 0;
     options.transport_mode = -1;
     options.encryption_mode = -1;
+    options.aead_mode = SPPROTO_AEAD_MODE_NONE;
     options.hash_mode = -1;
     options.otp_mode = SPPROTO_OTP_MODE_NONE;
     options.fragmentation_latency = PEER_DEFAULT_UDP_FRAGMENTATION_LATENCY;
@@ -752,8 +817,16 @@ int parse_arguments (int argc, char *argv[])
     options.igmp_last_member_query_time = DEFAULT_IGMP_LAST_MEMBER_QUERY_TIME;
     options.allow_peer_talk_without_ssl = 0;
     options.max_peers = DEFAULT_MAX_PEERS;
+    options.reactor_spin_us = 0;
+    options.udp_busy_poll_us = 0;
+    options.crypto_pipeline = 1;
+    options.udp_shared_sockets = 0;
+    options.udp_shared_batch = CLIENT_UDP_SHARED_DEFAULT_BATCH;
     
     int have_fragmentation_latency = 0;
+    int have_udp_busy_poll = 0;
+    int have_crypto_pipeline = 0;
+    int have_udp_shared_batch = 0;
     
     int i;
     for (i = 1; i < argc; i++) {
@@ -778,6 +851,9 @@ int parse_arguments (int argc, char *argv[])
                 options.logger = LOGGER_SYSLOG;
             }
             #endif
+            else if (!strcmp(arg2, "binary")) {
+                options.logger = LOGGER_BINARY;
+            }
             else {
                 fprintf(stderr, "%s: wrong argument\n", arg);
                 return 0;
@@ -802,6 +878,14 @@ int parse_arguments (int argc, char *argv[])
             i++;
         }
         #endif
+        else if (!strcmp(arg, "--binlog-file")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.logger_binary_file = argv[i + 1];
+            i++;
+        }
         else if (!strcmp(arg, "--loglevel")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -839,6 +923,9 @@ int parse_arguments (int argc, char *argv[])
             options.threads = atoi(argv[i + 1]);
             i++;
         }
+        else if (!strcmp(arg, "--pin-threads")) {
+            options.pin_threads = 1;
+        }
         else if (!strcmp(arg, "--use-threads-for-ssl-handshake")) {
             options.use_threads_for_ssl_handshake = 1;
         }
@@ -986,6 +1073,14 @@ int parse_arguments (int argc, char *argv[])
             else if (!strcmp(arg2, "aes")) {
                 options.encryption_mode = BENCRYPTION_CIPHER_AES;
             }
+            else if (!strcmp(arg2, "aes128-gcm")) {
+                options.encryption_mode = SPPROTO_ENCRYPTION_MODE_NONE;
+                options.aead_mode = BAEAD_CIPHER_AES128_GCM;
+            }
+            else if (!strcmp(arg2, "chacha20-poly1305") && BAEAD_cipher_valid(BAEAD_CIPHER_CHACHA20_POLY1305)) {
+                options.encryption_mode = SPPROTO_ENCRYPTION_MODE_NONE;
+                options.aead_mode = BAEAD_CIPHER_CHACHA20_POLY1305;
+            }
             else {
                 fprintf(stderr, "%s: wrong argument\n", arg);
                 return 0;
@@ -1142,6 +1237,66 @@ int parse_arguments (int argc, char *argv[])
             }
             i++;
         }
+        else if (!strcmp(arg, "--reactor-spin")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.reactor_spin_us = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--udp-busy-poll")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.udp_busy_poll_us = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            have_udp_busy_poll = 1;
+            i++;
+        }
+        else if (!strcmp(arg, "--crypto-pipeline")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.crypto_pipeline = atoi(argv[i + 1])) < 1) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            have_crypto_pipeline = 1;
+            i++;
+        }
+        #ifndef BADVPN_USE_WINAPI
+        else if (!strcmp(arg, "--udp-shared-sockets")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.udp_shared_sockets = atoi(argv[i + 1])) < 1 || options.udp_shared_sockets > DATAGRAMSHAREDSOCKET_MAX_SOCKETS) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--udp-shared-batch")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.udp_shared_batch = atoi(argv[i + 1])) < 1) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            have_udp_shared_batch = 1;
+            i++;
+        }
+        #endif
         else if (!strcmp(arg, "--allow-peer-talk-without-ssl")) {
             options.allow_peer_talk_without_ssl = 1;
         }
@@ -1185,6 +1340,11 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    if (!(options.aead_mode == SPPROTO_AEAD_MODE_NONE || options.hash_mode == SPPROTO_HASH_MODE_NONE)) {
+        fprintf(stderr, "False: AEAD --encryption-mode => --hash-mode none\n");
+        return 0;
+    }
+    
     if (!(!(options.otp_mode != SPPROTO_OTP_MODE_NONE) || (options.transport_mode == TRANSPORT_MODE_UDP))) {
         fprintf(stderr, "False: --otp => UDP\n");
         return 0;
@@ -1195,6 +1355,26 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    if (!(!have_udp_busy_poll || (options.transport_mode == TRANSPORT_MODE_UDP))) {
+        fprintf(stderr, "False: --udp-busy-poll => UDP\n");
+        return 0;
+    }
+    
+    if (!(!have_crypto_pipeline || (options.transport_mode == TRANSPORT_MODE_UDP))) {
+        fprintf(stderr, "False: --crypto-pipeline => UDP\n");
+        return 0;
+    }
+    
+    if (!(!(options.udp_shared_sockets > 0) || (options.transport_mode == TRANSPORT_MODE_UDP))) {
+        fprintf(stderr, "False: --udp-shared-sockets => UDP\n");
+        return 0;
+    }
+    
+    if (!(!have_udp_shared_batch || (options.udp_shared_sockets > 0))) {
+        fprintf(stderr, "False: --udp-shared-batch => --udp-shared-sockets\n");
+        return 0;
+    }
+    
     if (!(!options.peer_ssl || (options.ssl && options.transport_mode == TRANSPORT_MODE_TCP))) {
         fprintf(stderr, "False: --peer-ssl => (--ssl && TCP)\n");
         return 0;
@@ -1292,6 +1472,7 @@ int process_arguments (void)
     // initialize SPProto parameters
     if (options.transport_mode == TRANSPORT_MODE_UDP) {
         sp_params.encryption_mode = options.encryption_mode;
+        sp_params.aead_mode = options.aead_mode;
         sp_params.hash_mode = options.hash_mode;
         sp_params.otp_mode = options.otp_mode;
         if (options.otp_mode > 0) {
@@ -1589,6 +1770,12 @@ int peer_am_master (struct peer_data *peer)
     return (my_id > peer->id);
 }
 
+int peer_aead_role (struct peer_data *peer)
+{
+    // both peers agree on who is master, so their nonce prefixes differ
+    return (peer_am_master(peer) ? SPPROTO_AEAD_ROLE_MASTER : SPPROTO_AEAD_ROLE_SLAVE);
+}
+
 void peer_free_chat (struct peer_data *peer)
 {
     ASSERT(peer->have_chat)
@@ -1618,11 +1805,19 @@ int peer_init_link (struct peer_data *peer)
     // init transport-specific link objects
     PacketPassInterface *link_if;
     if (options.transport_mode == TRANSPORT_MODE_UDP) {
+        // leave room for the connection ID when using shared sockets
+        int udp_mtu = CLIENT_UDP_MTU;
+#ifndef BADVPN_USE_WINAPI
+        if (options.udp_shared_sockets > 0) {
+            udp_mtu -= DATAGRAMSHAREDSOCKET_HEADER_SIZE;
+        }
+#endif
+        
         // init DatagramPeerIO
         if (!DatagramPeerIO_Init(
-            &peer->pio.udp.pio, &ss, data_mtu, CLIENT_UDP_MTU, sp_params,
+            &peer->pio.udp.pio, &ss, data_mtu, udp_mtu, sp_params,
             options.fragmentation_latency, PEER_UDP_ASSEMBLER_NUM_FRAMES, recv_if,
-            options.otp_num_warn, &twd, peer,
+            options.otp_num_warn, &twd, options.crypto_pipeline, peer,
             (BLog_logfunc)peer_logfunc,
             (DatagramPeerIO_handler_error)peer_udp_pio_handler_error,
             (DatagramPeerIO_handler_otp_warning)peer_udp_pio_handler_seed_warning,
@@ -1632,6 +1827,9 @@ int peer_init_link (struct peer_data *peer)
             goto fail1;
         }
         
+        // set busy polling for the peer socket
+        DatagramPeerIO_SetBusyPoll(&peer->pio.udp.pio, options.udp_busy_poll_us);
+        
         if (SPPROTO_HAVE_OTP(sp_params)) {
             // init send seed state
             peer->pio.udp.sendseed_nextid = 0;
@@ -2052,26 +2250,41 @@ void peer_msg_youconnect (struct peer_data *peer, uint8_t *data, int data_len)
     msg_youconnectParser_Forwardaddr(&parser);
     
     uint8_t *key = NULL;
+    int have_password = 0;
     uint64_t password = 0;
     
     // read additonal parameters
     if (options.transport_mode == TRANSPORT_MODE_UDP) {
-        if (SPPROTO_HAVE_ENCRYPTION(sp_params)) {
+        if (SPPROTO_HAVE_KEY(sp_params)) {
             int key_len;
             if (!msg_youconnectParser_Getkey(&parser, &key, &key_len)) {
                 peer_log(peer, BLOG_WARNING, "msg_youconnect: no key");
                 return;
             }
-            if (key_len != BEncryption_cipher_key_size(sp_params.encryption_mode)) {
+            if (key_len != SPPROTO_KEY_SIZE(sp_params)) {
                 peer_log(peer, BLOG_WARNING, "msg_youconnect: wrong key size");
                 return;
             }
         }
+        
+        // a password is the connection ID of a peer using a shared socket
+        have_password = msg_youconnectParser_Getpassword(&parser, &password);
+        
+        int shared = 0;
+#ifndef BADVPN_USE_WINAPI
+        shared = (options.udp_shared_sockets > 0);
+#endif
+        if (have_password && !shared) {
+            peer_log(peer, BLOG_WARNING, "msg_youconnect: peer uses a shared socket, which requires --udp-shared-sockets");
+            peer_send_simple(peer, MSGID_CANNOTCONNECT);
+            return;
+        }
     } else {
         if (!msg_youconnectParser_Getpassword(&parser, &password)) {
             peer_log(peer, BLOG_WARNING, "msg_youconnect: no password");
             return;
         }
+        have_password = 1;
     }
     
     if (!msg_youconnectParser_GotEverything(&parser)) {
@@ -2081,7 +2294,7 @@ void peer_msg_youconnect (struct peer_data *peer, uint8_t *data, int data_len)
     
     peer_log(peer, BLOG_INFO, "connecting");
     
-    peer_connect(peer, addr, key, password);
+    peer_connect(peer, addr, key, have_password, password);
 }
 
 void peer_msg_cannotconnect (struct peer_data *peer, uint8_t *data, int data_len)
@@ -2358,27 +2571,41 @@ void peer_bind_one_address (struct peer_data *peer, int addr_index, int *cont)
         // get addr
         struct bind_addr *addr = &bind_addrs[addr_index];
         
-        // try binding to all ports in the range
-        int port_add;
-        for (port_add = 0; port_add < addr->num_ports; port_add++) {
-            BAddr tryaddr = addr->addr;
-            BAddr_SetPort(&tryaddr, hton16(ntoh16(BAddr_GetPort(&tryaddr)) + port_add));
-            if (DatagramPeerIO_Bind(&peer->pio.udp.pio, tryaddr)) {
-                break;
-            }
-        }
-        if (port_add == addr->num_ports) {
-            BLog(BLOG_NOTICE, "failed to bind to any port");
-            *cont = 1;
-            return;
+        int port_add = 0;
+        uint64_t connid = 0;
+        
+#ifndef BADVPN_USE_WINAPI
+        if (options.udp_shared_sockets > 0) {
+            // get a port on the shared socket
+            if (!DatagramPeerIO_BindShared(&peer->pio.udp.pio, &shared_socks[addr_index], &connid)) {
+                BLog(BLOG_NOTICE, "failed to bind to shared socket");
+                *cont = 1;
+                return;
+            }
+        } else
+#endif
+        {
+            // try binding to all ports in the range
+            for (port_add = 0; port_add < addr->num_ports; port_add++) {
+                BAddr tryaddr = addr->addr;
+                BAddr_SetPort(&tryaddr, hton16(ntoh16(BAddr_GetPort(&tryaddr)) + port_add));
+                if (DatagramPeerIO_Bind(&peer->pio.udp.pio, tryaddr)) {
+                    break;
+                }
+            }
+            if (port_add == addr->num_ports) {
+                BLog(BLOG_NOTICE, "failed to bind to any port");
+                *cont = 1;
+                return;
+            }
         }
         
-        uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
+        uint8_t key[SPPROTO_MAX_KEY_SIZE];
         
         // generate and set encryption key
-        if (SPPROTO_HAVE_ENCRYPTION(sp_params)) {
-            BRandom_randomize(key, BEncryption_cipher_key_size(sp_params.encryption_mode));
-            DatagramPeerIO_SetEncryptionKey(&peer->pio.udp.pio, key);
+        if (SPPROTO_HAVE_KEY(sp_params)) {
+            BRandom_randomize(key, SPPROTO_KEY_SIZE(sp_params));
+            DatagramPeerIO_SetEncryptionKey(&peer->pio.udp.pio, key, peer_aead_role(peer));
         }
         
         // schedule sending OTP seed
@@ -2387,7 +2614,7 @@ void peer_bind_one_address (struct peer_data *peer, int addr_index, int *cont)
         }
         
         // send connectinfo
-        peer_send_conectinfo(peer, addr_index, port_add, key, 0);
+        peer_send_conectinfo(peer, addr_index, port_add, key, connid);
     } else {
         // order StreamPeerIO to listen
         uint64_t pass;
@@ -2402,7 +2629,7 @@ void peer_bind_one_address (struct peer_data *peer, int addr_index, int *cont)
     *cont = 0;
 }
 
-void peer_connect (struct peer_data *peer, BAddr addr, uint8_t* encryption_key, uint64_t password)
+void peer_connect (struct peer_data *peer, BAddr addr, uint8_t* encryption_key, int have_password, uint64_t password)
 {
     // get a fresh link
     peer_cleanup_connections(peer);
@@ -2413,6 +2640,29 @@ void peer_connect (struct peer_data *peer, BAddr addr, uint8_t* encryption_key,
     }
     
     if (options.transport_mode == TRANSPORT_MODE_UDP) {
+#ifndef BADVPN_USE_WINAPI
+        if (options.udp_shared_sockets > 0) {
+            // find a shared socket for the address family
+            int i;
+            for (i = 0; i < num_shared_socks; i++) {
+                if (DatagramSharedSocket_GetFamily(&shared_socks[i]) == addr.type) {
+                    break;
+                }
+            }
+            if (i == num_shared_socks) {
+                peer_log(peer, BLOG_NOTICE, "no shared socket for address family");
+                peer_reset(peer);
+                return;
+            }
+            
+            // order DatagramPeerIO to connect through the shared socket
+            if (!DatagramPeerIO_ConnectShared(&peer->pio.udp.pio, &shared_socks[i], addr, have_password, password)) {
+                peer_log(peer, BLOG_NOTICE, "DatagramPeerIO_ConnectShared failed");
+                peer_reset(peer);
+                return;
+            }
+        } else
+#endif
         // order DatagramPeerIO to connect
         if (!DatagramPeerIO_Connect(&peer->pio.udp.pio, addr)) {
             peer_log(peer, BLOG_NOTICE, "DatagramPeerIO_Connect failed");
@@ -2421,8 +2671,8 @@ void peer_connect (struct peer_data *peer, BAddr addr, uint8_t* encryption_key,
         }
         
         // set encryption key
-        if (SPPROTO_HAVE_ENCRYPTION(sp_params)) {
-            DatagramPeerIO_SetEncryptionKey(&peer->pio.udp.pio, encryption_key);
+        if (SPPROTO_HAVE_KEY(sp_params)) {
+            DatagramPeerIO_SetEncryptionKey(&peer->pio.udp.pio, encryption_key, peer_aead_role(peer));
         }
         
         // generate and send a send seed
@@ -2517,8 +2767,8 @@ void peer_send_conectinfo (struct peer_data *peer, int addr_index, int port_adju
     
     // remember encryption key size
     int key_size = 0; // to remove warning
-    if (options.transport_mode == TRANSPORT_MODE_UDP && SPPROTO_HAVE_ENCRYPTION(sp_params)) {
-        key_size = BEncryption_cipher_key_size(sp_params.encryption_mode);
+    if (options.transport_mode == TRANSPORT_MODE_UDP && SPPROTO_HAVE_KEY(sp_params)) {
+        key_size = SPPROTO_KEY_SIZE(sp_params);
     }
     
     // calculate message length ..
@@ -2533,12 +2783,12 @@ void peer_send_conectinfo (struct peer_data *peer, int addr_index, int port_adju
     }
     
     // encryption key
-    if (options.transport_mode == TRANSPORT_MODE_UDP && SPPROTO_HAVE_ENCRYPTION(sp_params)) {
+    if (options.transport_mode == TRANSPORT_MODE_UDP && SPPROTO_HAVE_KEY(sp_params)) {
         msg_len += msg_youconnect_SIZEkey(key_size);
     }
     
-    // password
-    if (options.transport_mode == TRANSPORT_MODE_TCP) {
+    // password, or connection ID when using shared UDP sockets
+    if (options.transport_mode == TRANSPORT_MODE_TCP || pass != 0) {
         msg_len += msg_youconnect_SIZEpassword;
     }
     
@@ -2588,13 +2838,13 @@ void peer_send_conectinfo (struct peer_data *peer, int addr_index, int port_adju
     }
     
     // write encryption key
-    if (options.transport_mode == TRANSPORT_MODE_UDP && SPPROTO_HAVE_ENCRYPTION(sp_params)) {
+    if (options.transport_mode == TRANSPORT_MODE_UDP && SPPROTO_HAVE_KEY(sp_params)) {
         uint8_t *key_dst = msg_youconnectWriter_Addkey(&writer, key_size);
         memcpy(key_dst, enckey, key_size);
     }
     
     // write password
-    if (options.transport_mode == TRANSPORT_MODE_TCP) {
+    if (options.transport_mode == TRANSPORT_MODE_TCP || pass != 0) {
         msg_youconnectWriter_Addpassword(&writer, pass);
     }
     
@@ -54,6 +54,12 @@
 // maximum UDP payload size
 #define CLIENT_UDP_MTU 1472
 
+// default number of datagrams moved per system call with --udp-shared-sockets
+#define CLIENT_UDP_SHARED_DEFAULT_BATCH 32
+
+// number of received datagrams a peer can hold on a shared UDP socket
+#define CLIENT_UDP_SHARED_PORT_QUEUE 64
+
 // maximum number of pending TCP PasswordListener clients
 #define TCP_MAX_PASSWORD_LISTENER_CLIENTS 50
 
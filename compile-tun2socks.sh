@@ -106,6 +106,7 @@ lwip/custom/sys.c
 tun2socks/tun2socks.c
 base/DebugObject.c
 base/BLog.c
+base/BLog_binary.c
 base/BPending.c
 flowextra/PacketPassInactivityMonitor.c
 tun2socks/SocksUdpGwClient.c
@@ -68,6 +68,7 @@ flow/PacketProtoEncoder.c
 flow/PacketProtoDecoder.c
 base/DebugObject.c
 base/BLog.c
+base/BLog_binary.c
 base/BPending.c
 udpgw/udpgw.c
 "
@@ -32,29 +32,357 @@
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
 
 #include <misc/balloc.h>
+#include <misc/balign.h>
+#include <misc/byteorder.h>
 #include <security/BRandom.h>
 #include <security/BEncryption.h>
+#include <security/BHash.h>
+#include <security/BAEAD.h>
 #include <base/DebugObject.h>
 
+#define PACKET_MAX 65536
+
 static void usage (char *name)
 {
     printf(
         "Usage: %s <enc/dec> <ciper> <num_blocks> <num_ops>\n"
-        "    <cipher> is one of (blowfish, aes).\n",
-        name
+        "       %s packet <enc/dec> <scheme> <packet_size> <num_packets>\n"
+        "       %s backends <enc/dec> <cipher> <buffer_size> <num_ops>\n"
+        "    <cipher> is one of (blowfish, aes).\n"
+        "    <scheme> is one of (blowfish-md5, aes-md5, aes-sha1, aes128-gcm, chacha20-poly1305).\n",
+        name, name, name
     );
     
     exit(1);
 }
 
+// Per-packet protection work as done by SPProto (SPProtoEncoder/SPProtoDecoder):
+// either hash + random IV + CBC encryption, or single-pass AEAD with a counter nonce.
+struct packet_scheme {
+    const char *name;
+    int cipher;
+    int hash;
+    int aead;
+};
+
+static const struct packet_scheme packet_schemes[] = {
+    {"blowfish-md5", BENCRYPTION_CIPHER_BLOWFISH, BHASH_TYPE_MD5, 0},
+    {"aes-md5", BENCRYPTION_CIPHER_AES, BHASH_TYPE_MD5, 0},
+    {"aes-sha1", BENCRYPTION_CIPHER_AES, BHASH_TYPE_SHA1, 0},
+    {"aes128-gcm", 0, 0, BAEAD_CIPHER_AES128_GCM},
+    {"chacha20-poly1305", 0, 0, BAEAD_CIPHER_CHACHA20_POLY1305},
+};
+
+static int cbc_encode (BEncryption *enc, int hash, uint8_t *plaintext, int plaintext_len, uint8_t *out)
+{
+    int block_size = BEncryption_cipher_block_size(enc->cipher);
+    int hash_size = BHash_size(hash);
+    
+    // hash over header + payload, hash field zeroed
+    memset(plaintext, 0, hash_size);
+    uint8_t digest[BHASH_MAX_SIZE];
+    BHash_calculate(hash, plaintext, plaintext_len, digest);
+    memcpy(plaintext, digest, hash_size);
+    
+    // pad
+    int ciphertext_len = balign_up(plaintext_len + 1, block_size);
+    plaintext[plaintext_len] = 1;
+    memset(plaintext + plaintext_len + 1, 0, ciphertext_len - (plaintext_len + 1));
+    
+    // random IV, encrypt
+    BRandom_randomize(out, block_size);
+    uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
+    memcpy(iv, out, block_size);
+    BEncryption_Encrypt(enc, plaintext, out + block_size, ciphertext_len, iv);
+    
+    return block_size + ciphertext_len;
+}
+
+static int cbc_decode (BEncryption *dec, int hash, uint8_t *in, int in_len, uint8_t *plaintext)
+{
+    int block_size = BEncryption_cipher_block_size(dec->cipher);
+    int hash_size = BHash_size(hash);
+    
+    uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
+    memcpy(iv, in, block_size);
+    int ciphertext_len = in_len - block_size;
+    BEncryption_Decrypt(dec, in + block_size, plaintext, ciphertext_len, iv);
+    
+    int i = ciphertext_len - 1;
+    while (i >= 0 && plaintext[i] == 0) {
+        i--;
+    }
+    if (i < 0 || plaintext[i] != 1) {
+        return 0;
+    }
+    
+    uint8_t digest[BHASH_MAX_SIZE];
+    memcpy(digest, plaintext, hash_size);
+    memset(plaintext, 0, hash_size);
+    uint8_t digest_calc[BHASH_MAX_SIZE];
+    BHash_calculate(hash, plaintext, i, digest_calc);
+    
+    return !memcmp(digest, digest_calc, hash_size);
+}
+
+static int packet_bench (char *name, char *mode_str, char *scheme_str, int packet_size, int num_packets)
+{
+    const struct packet_scheme *scheme = NULL;
+    for (size_t i = 0; i < sizeof(packet_schemes) / sizeof(packet_schemes[0]); i++) {
+        if (!strcmp(scheme_str, packet_schemes[i].name)) {
+            scheme = &packet_schemes[i];
+        }
+    }
+    
+    int decode;
+    if (!strcmp(mode_str, "enc")) {
+        decode = 0;
+    }
+    else if (!strcmp(mode_str, "dec")) {
+        decode = 1;
+    }
+    else {
+        usage(name);
+    }
+    
+    if (!scheme || (scheme->aead && !BAEAD_cipher_valid(scheme->aead)) || packet_size < 0 || packet_size > PACKET_MAX || num_packets < 0) {
+        usage(name);
+    }
+    
+    int key_size = (scheme->aead ? BAEAD_cipher_key_size(scheme->aead) : BEncryption_cipher_key_size(scheme->cipher));
+    uint8_t key[BAEAD_MAX_KEY_SIZE];
+    BRandom_randomize(key, key_size);
+    
+    // room for header, padding, IV or nonce and tag
+    static uint8_t plaintext[PACKET_MAX + 128];
+    static uint8_t packet[PACKET_MAX + 128];
+    static uint8_t decoded[PACKET_MAX + 128];
+    
+    int header_len = (scheme->aead ? 0 : BHash_size(scheme->hash));
+    int plaintext_len = header_len + packet_size;
+    BRandom_randomize(plaintext, plaintext_len);
+    
+    BEncryption enc;
+    BEncryption dec;
+    BAEAD aead_enc;
+    BAEAD aead_dec;
+    uint8_t nonce[BAEAD_NONCE_SIZE];
+    uint64_t counter = 0;
+    BRandom_randomize(nonce, BAEAD_NONCE_SIZE);
+    
+    if (scheme->aead) {
+        BAEAD_Init(&aead_enc, BAEAD_MODE_ENCRYPT, scheme->aead, key);
+        BAEAD_Init(&aead_dec, BAEAD_MODE_DECRYPT, scheme->aead, key);
+    } else {
+        BEncryption_Init(&enc, BENCRYPTION_MODE_ENCRYPT, scheme->cipher, key);
+        BEncryption_Init(&dec, BENCRYPTION_MODE_DECRYPT, scheme->cipher, key);
+    }
+    
+    // encode one packet up front for decoding
+    int packet_len;
+    if (scheme->aead) {
+        memcpy(packet, nonce, BAEAD_NONCE_SIZE);
+        BAEAD_Encrypt(&aead_enc, packet, plaintext, packet + BAEAD_NONCE_SIZE, plaintext_len, packet + BAEAD_NONCE_SIZE + plaintext_len);
+        packet_len = BAEAD_NONCE_SIZE + plaintext_len + BAEAD_TAG_SIZE;
+    } else {
+        packet_len = cbc_encode(&enc, scheme->hash, plaintext, plaintext_len, packet);
+    }
+    
+    int ok = 1;
+    clock_t start = clock();
+    
+    for (int i = 0; i < num_packets; i++) {
+        if (!decode) {
+            if (scheme->aead) {
+                uint64_t ctr = htol64(counter++);
+                memcpy(nonce + 4, &ctr, sizeof(ctr));
+                memcpy(packet, nonce, BAEAD_NONCE_SIZE);
+                BAEAD_Encrypt(&aead_enc, packet, plaintext, packet + BAEAD_NONCE_SIZE, plaintext_len, packet + BAEAD_NONCE_SIZE + plaintext_len);
+            } else {
+                cbc_encode(&enc, scheme->hash, plaintext, plaintext_len, packet);
+            }
+        } else {
+            if (scheme->aead) {
+                int ct_len = packet_len - BAEAD_NONCE_SIZE - BAEAD_TAG_SIZE;
+                ok &= BAEAD_Decrypt(&aead_dec, packet, packet + BAEAD_NONCE_SIZE, decoded, ct_len, packet + BAEAD_NONCE_SIZE + ct_len);
+            } else {
+                ok &= cbc_decode(&dec, scheme->hash, packet, packet_len, decoded);
+            }
+        }
+    }
+    
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    
+    if (scheme->aead) {
+        BAEAD_Free(&aead_dec);
+        BAEAD_Free(&aead_enc);
+    } else {
+        BEncryption_Free(&dec);
+        BEncryption_Free(&enc);
+    }
+    
+    if (!ok) {
+        printf("decoding failed\n");
+        return 0;
+    }
+    
+    if (secs <= 0) {
+        secs = 1e-9;
+    }
+    
+    printf("%s %s packet_size=%d packets=%d cpu_time=%.3fs rate=%.0f pkt/s throughput=%.3f Gbit/s per core\n",
+           scheme->name, mode_str, packet_size, num_packets, secs, num_packets / secs, (double)packet_size * num_packets * 8 / secs / 1e9);
+    
+    return 1;
+}
+
+static const char *backend_names[] = {
+    [BENCRYPTION_BACKEND_EVP] = "evp",
+    [BENCRYPTION_BACKEND_LOWLEVEL] = "lowlevel",
+};
+
+static uint64_t cycles_now (void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t nsecs_now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Runs the same CBC workload through each BEncryption backend and reports
+// cycles per byte (TSC cycles, where available) and nanoseconds per byte.
+static int backends_bench (char *name, char *mode_str, char *cipher_str, int buffer_size, int num_ops)
+{
+    int mode;
+    if (!strcmp(mode_str, "enc")) {
+        mode = BENCRYPTION_MODE_ENCRYPT;
+    }
+    else if (!strcmp(mode_str, "dec")) {
+        mode = BENCRYPTION_MODE_DECRYPT;
+    }
+    else {
+        usage(name);
+    }
+    
+    int cipher;
+    if (!strcmp(cipher_str, "blowfish")) {
+        cipher = BENCRYPTION_CIPHER_BLOWFISH;
+    }
+    else if (!strcmp(cipher_str, "aes")) {
+        cipher = BENCRYPTION_CIPHER_AES;
+    }
+    else {
+        usage(name);
+    }
+    
+    int block_size = BEncryption_cipher_block_size(cipher);
+    
+    if (buffer_size <= 0 || buffer_size > PACKET_MAX || buffer_size % block_size != 0 || num_ops <= 0) {
+        usage(name);
+    }
+    
+    uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
+    BRandom_randomize(key, BEncryption_cipher_key_size(cipher));
+    
+    static uint8_t in[PACKET_MAX];
+    static uint8_t out[PACKET_MAX];
+    BRandom_randomize(in, buffer_size);
+    
+    uint8_t iv_init[BENCRYPTION_MAX_BLOCK_SIZE];
+    BRandom_randomize(iv_init, block_size);
+    
+    uint8_t results[2][PACKET_MAX];
+    int have_results[2] = {0, 0};
+    
+    for (int backend = BENCRYPTION_BACKEND_EVP; backend <= BENCRYPTION_BACKEND_LOWLEVEL; backend++) {
+        int idx = backend - BENCRYPTION_BACKEND_EVP;
+        
+        BEncryption enc;
+        if (!BEncryption_InitBackend(&enc, mode, cipher, key, backend)) {
+            printf("%s %s %s: backend not available\n", cipher_str, mode_str, backend_names[backend]);
+            continue;
+        }
+        
+        // one pass for comparing output between backends
+        uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
+        memcpy(iv, iv_init, block_size);
+        if (mode == BENCRYPTION_MODE_ENCRYPT) {
+            BEncryption_Encrypt(&enc, in, results[idx], buffer_size, iv);
+        } else {
+            BEncryption_Decrypt(&enc, in, results[idx], buffer_size, iv);
+        }
+        have_results[idx] = 1;
+        
+        uint64_t start_ns = nsecs_now();
+        uint64_t start_cycles = cycles_now();
+        
+        for (int i = 0; i < num_ops; i++) {
+            if (mode == BENCRYPTION_MODE_ENCRYPT) {
+                BEncryption_Encrypt(&enc, in, out, buffer_size, iv);
+            } else {
+                BEncryption_Decrypt(&enc, in, out, buffer_size, iv);
+            }
+        }
+        
+        uint64_t cycles = cycles_now() - start_cycles;
+        uint64_t ns = nsecs_now() - start_ns;
+        
+        BEncryption_Free(&enc);
+        
+        double bytes = (double)buffer_size * num_ops;
+        
+        printf("%s %s %s buffer_size=%d ops=%d", cipher_str, mode_str, backend_names[backend], buffer_size, num_ops);
+#ifdef HAVE_RDTSC
+        printf(" cycles/byte=%.2f", cycles / bytes);
+#else
+        (void)cycles;
+        printf(" cycles/byte=n/a");
+#endif
+        printf(" ns/byte=%.3f throughput=%.3f Gbit/s\n", ns / bytes, bytes * 8 / (ns ? ns : 1));
+    }
+    
+    if (have_results[0] && have_results[1] && memcmp(results[0], results[1], buffer_size)) {
+        printf("backend outputs differ\n");
+        return 0;
+    }
+    
+    return 1;
+}
+
 int main (int argc, char **argv)
 {
     if (argc <= 0) {
         return 1;
     }
     
+    if (argc == 6 && !strcmp(argv[1], "packet")) {
+        int res = packet_bench(argv[0], argv[2], argv[3], atoi(argv[4]), atoi(argv[5]));
+        DebugObjectGlobal_Finish();
+        return !res;
+    }
+    
+    if (argc == 6 && !strcmp(argv[1], "backends")) {
+        int res = backends_bench(argv[0], argv[2], argv[3], atoi(argv[4]), atoi(argv[5]));
+        DebugObjectGlobal_Finish();
+        return !res;
+    }
+    
     if (argc != 5) {
         usage(argv[0]);
     }
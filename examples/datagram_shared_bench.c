@@ -0,0 +1,376 @@
+/**
+ * @file datagram_shared_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Loopback benchmark for {@link DatagramSharedSocket}. A number of emulated
+ * peers exchange datagrams with a local side in both directions, where the local
+ * side uses either one {@link BDatagram} per peer (classic) or bound ports on a
+ * shared socket (shared). Each remote peer uses its own {@link BDatagram} in both
+ * cases, putting the connection ID in front of datagrams to a shared socket.
+ * Traffic can be limited to one direction, to measure receiving (rx) or
+ * sending (tx) on the local side by itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <misc/read_write_int.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BNetwork.h>
+#include <system/BDatagram.h>
+#include <client/DatagramSharedSocket.h>
+
+#define MTU 1400
+#define PORT_QUEUE_LEN 64
+
+struct endpoint {
+    PacketPassInterface *send_if;
+    PacketRecvInterface *recv_if;
+    uint64_t num_sent;
+    uint64_t num_received;
+    int learn_addr;
+    int send_len;
+    uint8_t send_buf[DATAGRAMSHAREDSOCKET_HEADER_SIZE + MTU];
+    uint8_t recv_buf[MTU];
+    BDatagram dgram;
+    DatagramSharedSocket_port port;
+};
+
+struct peer {
+    struct endpoint local;
+    struct endpoint remote;
+};
+
+static BReactor reactor;
+static BTimer stop_timer;
+static int shared_mode;
+static int num_peers;
+static int packet_size;
+static int stopping;
+static int local_sends;
+static int remote_sends;
+static DatagramSharedSocket local_shared;
+static struct peer *peers;
+
+static void dgram_handler (void *unused, int event)
+{
+    fprintf(stderr, "datagram error\n");
+    BReactor_Quit(&reactor, 1);
+}
+
+static void send_handler_done (struct endpoint *e)
+{
+    e->num_sent++;
+    
+    if (!stopping) {
+        PacketPassInterface_Sender_Send(e->send_if, e->send_buf, e->send_len);
+    }
+}
+
+static void recv_handler_done (struct endpoint *e, int data_len)
+{
+    e->num_received++;
+    
+    // bound ports learn where to send from what they receive
+    if (e->learn_addr) {
+        BAddr remote_addr;
+        BIPAddr local_addr;
+        ASSERT_EXECUTE(DatagramSharedSocket_Port_GetLastReceiveAddrs(&e->port, &remote_addr, &local_addr))
+        DatagramSharedSocket_Port_SetSendAddrs(&e->port, remote_addr, local_addr);
+    }
+    
+    PacketRecvInterface_Receiver_Recv(e->recv_if, e->recv_buf);
+}
+
+static void stop_timer_handler (void *unused)
+{
+    stopping = 1;
+    BReactor_Quit(&reactor, 0);
+}
+
+static void start_endpoint (struct endpoint *e, int sends)
+{
+    PacketPassInterface_Sender_Init(e->send_if, (PacketPassInterface_handler_done)send_handler_done, e);
+    PacketRecvInterface_Receiver_Init(e->recv_if, (PacketRecvInterface_handler_done)recv_handler_done, e);
+    
+    if (sends) {
+        PacketPassInterface_Sender_Send(e->send_if, e->send_buf, e->send_len);
+    }
+    PacketRecvInterface_Receiver_Recv(e->recv_if, e->recv_buf);
+}
+
+static int init_dgram (struct endpoint *e, BAddr bind_addr, BAddr *out_addr)
+{
+    if (!BDatagram_Init(&e->dgram, BADDR_TYPE_IPV4, &reactor, NULL, dgram_handler)) {
+        goto fail0;
+    }
+    
+    if (!BDatagram_Bind(&e->dgram, bind_addr) || !BDatagram_GetLocalAddr(&e->dgram, out_addr)) {
+        goto fail1;
+    }
+    
+    BDatagram_SendAsync_Init(&e->dgram, DATAGRAMSHAREDSOCKET_HEADER_SIZE + MTU);
+    BDatagram_RecvAsync_Init(&e->dgram, MTU);
+    e->send_if = BDatagram_SendAsync_GetIf(&e->dgram);
+    e->recv_if = BDatagram_RecvAsync_GetIf(&e->dgram);
+    e->learn_addr = 0;
+    e->send_len = packet_size;
+    return 1;
+    
+fail1:
+    BDatagram_Free(&e->dgram);
+fail0:
+    return 0;
+}
+
+static void free_dgram (struct endpoint *e)
+{
+    BDatagram_RecvAsync_Free(&e->dgram);
+    BDatagram_SendAsync_Free(&e->dgram);
+    BDatagram_Free(&e->dgram);
+}
+
+static int init_peer_classic (struct peer *p, BAddr bind_addr)
+{
+    BAddr local_addr;
+    BAddr remote_addr;
+    
+    if (!init_dgram(&p->local, bind_addr, &local_addr)) {
+        goto fail0;
+    }
+    
+    if (!init_dgram(&p->remote, bind_addr, &remote_addr)) {
+        goto fail1;
+    }
+    
+    BIPAddr any;
+    BIPAddr_InitInvalid(&any);
+    BDatagram_SetSendAddrs(&p->local.dgram, remote_addr, any);
+    BDatagram_SetSendAddrs(&p->remote.dgram, local_addr, any);
+    return 1;
+    
+fail1:
+    free_dgram(&p->local);
+fail0:
+    return 0;
+}
+
+static void free_peer_classic (struct peer *p)
+{
+    free_dgram(&p->remote);
+    free_dgram(&p->local);
+}
+
+static int init_peer_shared (struct peer *p, BAddr bind_addr, BAddr local_shared_addr)
+{
+    // the local side waits on a bound port
+    uint64_t connid;
+    if (!DatagramSharedSocket_Port_InitBind(&p->local.port, &local_shared, MTU, &connid)) {
+        goto fail0;
+    }
+    p->local.send_if = DatagramSharedSocket_Port_GetSendIf(&p->local.port);
+    p->local.recv_if = DatagramSharedSocket_Port_GetRecvIf(&p->local.port);
+    p->local.learn_addr = 1;
+    p->local.send_len = packet_size;
+    
+    // the remote peer connects from its own socket
+    BAddr remote_addr;
+    if (!init_dgram(&p->remote, bind_addr, &remote_addr)) {
+        goto fail1;
+    }
+    
+    BIPAddr any;
+    BIPAddr_InitInvalid(&any);
+    BDatagram_SetSendAddrs(&p->remote.dgram, local_shared_addr, any);
+    
+    // put the connection ID in front of its datagrams
+    badvpn_write_le64(connid, (char *)p->remote.send_buf);
+    p->remote.send_len = DATAGRAMSHAREDSOCKET_HEADER_SIZE + packet_size;
+    return 1;
+    
+fail1:
+    DatagramSharedSocket_Port_Free(&p->local.port);
+fail0:
+    return 0;
+}
+
+static void free_peer_shared (struct peer *p)
+{
+    free_dgram(&p->remote);
+    DatagramSharedSocket_Port_Free(&p->local.port);
+}
+
+static void usage (const char *name)
+{
+    fprintf(stderr, "Usage: %s <classic/shared> <num_peers> <milliseconds> [packet_size] [num_sockets] [batch_size] [port] [both/rx/tx]\n", name);
+    exit(1);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc < 4 || argc > 9) {
+        usage(argv[0]);
+    }
+    
+    if (!strcmp(argv[1], "classic")) {
+        shared_mode = 0;
+    } else if (!strcmp(argv[1], "shared")) {
+        shared_mode = 1;
+    } else {
+        usage(argv[0]);
+    }
+    num_peers = atoi(argv[2]);
+    int duration = atoi(argv[3]);
+    packet_size = (argc > 4 ? atoi(argv[4]) : 1200);
+    int num_sockets = (argc > 5 ? atoi(argv[5]) : 1);
+    int batch_size = (argc > 6 ? atoi(argv[6]) : 32);
+    int port = (argc > 7 ? atoi(argv[7]) : 7300);
+    const char *direction = (argc > 8 ? argv[8] : "both");
+    
+    if (!strcmp(direction, "both")) {
+        local_sends = 1;
+        remote_sends = 1;
+    } else if (!strcmp(direction, "rx")) {
+        remote_sends = 1;
+    } else if (!strcmp(direction, "tx")) {
+        local_sends = 1;
+    } else {
+        usage(argv[0]);
+    }
+    
+    if (num_peers < 1 || duration < 1 || packet_size < 0 || packet_size > MTU || num_sockets < 1 || num_sockets > DATAGRAMSHAREDSOCKET_MAX_SOCKETS ||
+        batch_size < 1 || port < 1 || port > UINT16_MAX
+    ) {
+        usage(argv[0]);
+    }
+    
+    int ret = 1;
+    
+    BLog_InitStdout();
+    BTime_Init();
+    
+    if (!BNetwork_GlobalInit()) {
+        fprintf(stderr, "BNetwork_GlobalInit failed\n");
+        goto fail0;
+    }
+    
+    if (!BReactor_Init(&reactor)) {
+        fprintf(stderr, "BReactor_Init failed\n");
+        goto fail0;
+    }
+    
+    if (!(peers = (struct peer *)calloc(num_peers, sizeof(peers[0])))) {
+        fprintf(stderr, "calloc failed\n");
+        goto fail1;
+    }
+    
+    BAddr bind_addr;
+    BAddr_InitIPv4(&bind_addr, hton32(0x7f000001), 0);
+    
+    BAddr local_shared_addr;
+    BAddr_InitIPv4(&local_shared_addr, hton32(0x7f000001), hton16(port));
+    
+    if (shared_mode && !DatagramSharedSocket_Init(&local_shared, &reactor, local_shared_addr, num_sockets, MTU, batch_size, PORT_QUEUE_LEN, 0)) {
+        fprintf(stderr, "DatagramSharedSocket_Init failed\n");
+        goto fail2;
+    }
+    
+    BTimer_Init(&stop_timer, duration, stop_timer_handler, NULL);
+    
+    int num_inited;
+    for (num_inited = 0; num_inited < num_peers; num_inited++) {
+        struct peer *p = &peers[num_inited];
+        if (!(shared_mode ? init_peer_shared(p, bind_addr, local_shared_addr) : init_peer_classic(p, bind_addr))) {
+            fprintf(stderr, "failed to init peer %d\n", num_inited);
+            goto fail3;
+        }
+        start_endpoint(&p->local, local_sends);
+        start_endpoint(&p->remote, remote_sends);
+    }
+    
+    BReactor_SetTimer(&reactor, &stop_timer);
+    
+    btime_t start = btime_gettime();
+    int exec_ret = BReactor_Exec(&reactor);
+    btime_t elapsed = btime_gettime() - start;
+    
+    if (exec_ret != 0) {
+        goto fail3;
+    }
+    
+    uint64_t local_sent = 0;
+    uint64_t local_received = 0;
+    uint64_t remote_sent = 0;
+    uint64_t remote_received = 0;
+    for (int i = 0; i < num_peers; i++) {
+        local_sent += peers[i].local.num_sent;
+        local_received += peers[i].local.num_received;
+        remote_sent += peers[i].remote.num_sent;
+        remote_received += peers[i].remote.num_received;
+    }
+    
+    double secs = (elapsed > 0 ? elapsed : 1) / 1000.0;
+    printf("%s peers=%d packet_size=%d sockets=%d batch=%d time=%.3fs local: sent=%.0f pkt/s received=%.0f pkt/s remote: sent=%.0f pkt/s received=%.0f pkt/s\n",
+           argv[1], num_peers, packet_size, (shared_mode ? num_sockets : num_peers), (shared_mode ? batch_size : 1), secs,
+           local_sent / secs, local_received / secs, remote_sent / secs, remote_received / secs);
+    
+    ret = 0;
+    
+fail3:
+    BReactor_RemoveTimer(&reactor, &stop_timer);
+    while (num_inited-- > 0) {
+        if (shared_mode) {
+            free_peer_shared(&peers[num_inited]);
+        } else {
+            free_peer_classic(&peers[num_inited]);
+        }
+    }
+    if (shared_mode) {
+        DatagramSharedSocket_Free(&local_shared);
+    }
+fail2:
+    free(peers);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
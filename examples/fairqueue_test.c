@@ -29,13 +29,16 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stddef.h>
+#include <inttypes.h>
 
 #include <misc/debug.h>
 #include <system/BReactor.h>
 #include <base/BLog.h>
 #include <system/BTime.h>
 #include <flow/PacketPassFairQueue.h>
+#include <flow/PacketPassDRRQueue.h>
 #include <examples/FastPacketSource.h>
 #include <examples/TimerPacketSink.h>
 
@@ -43,6 +46,9 @@
 #define REMOVE_INTERVAL 1
 #define NUM_INPUTS 3
 
+#define BENCH_MTU 1500
+#define BENCH_PACKET_WEIGHT 1
+
 BReactor reactor;
 TimerPacketSink sink;
 PacketPassFairQueue fq;
@@ -103,7 +109,197 @@ static void timer_handler (void *user)
     reset_input();
 }
 
-int main ()
+struct bench_source {
+    FastPacketSource src;
+    uint64_t sent_bytes;
+    uint8_t data[BENCH_MTU];
+};
+
+struct bench_sink {
+    PacketPassInterface input;
+    BTimer start_timer;
+    struct bench_source *sources;
+    int started;
+    uint8_t *held_pkt;
+    int held_len;
+    uint64_t count;
+    uint64_t limit;
+    btime_t start_time;
+};
+
+static void bench_sink_complete (struct bench_sink *bs, uint8_t *pkt, int pkt_len)
+{
+    // the first bytes of a packet identify its source
+    uint32_t index;
+    memcpy(&index, pkt, sizeof(index));
+    bs->sources[index].sent_bytes += pkt_len;
+    
+    if (++bs->count == bs->limit) {
+        BReactor_Quit(&reactor, 0);
+    }
+    
+    PacketPassInterface_Done(&bs->input);
+}
+
+static void bench_sink_handler_send (struct bench_sink *bs, uint8_t *pkt, int pkt_len)
+{
+    // hold the first packet until all the flows have queued theirs (see BPendingGroup)
+    if (!bs->started) {
+        bs->held_pkt = pkt;
+        bs->held_len = pkt_len;
+        return;
+    }
+    
+    bench_sink_complete(bs, pkt, pkt_len);
+}
+
+static void bench_start_timer_handler (struct bench_sink *bs)
+{
+    bs->started = 1;
+    bs->start_time = btime_gettime();
+    
+    if (bs->held_pkt) {
+        bench_sink_complete(bs, bs->held_pkt, bs->held_len);
+    }
+}
+
+static void bench_init (struct bench_sink *bs, int num_flows, uint64_t num_packets)
+{
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    
+    PacketPassInterface_Init(&bs->input, BENCH_MTU, (PacketPassInterface_handler_send)bench_sink_handler_send, bs, BReactor_PendingGroup(&reactor));
+    
+    BTimer_Init(&bs->start_timer, 0, (BTimer_handler)bench_start_timer_handler, bs);
+    BReactor_SetTimer(&reactor, &bs->start_timer);
+    
+    bs->sources = malloc(num_flows * sizeof(bs->sources[0]));
+    ASSERT_FORCE(bs->sources)
+    bs->started = 0;
+    bs->held_pkt = NULL;
+    bs->count = 0;
+    bs->limit = num_packets;
+    
+    for (int i = 0; i < num_flows; i++) {
+        struct bench_source *src = &bs->sources[i];
+        uint32_t index = i;
+        memset(src->data, 0, sizeof(src->data));
+        memcpy(src->data, &index, sizeof(index));
+        src->sent_bytes = 0;
+    }
+}
+
+static int bench_packet_len (int i)
+{
+    return 64 + (i * 97) % (BENCH_MTU - 64);
+}
+
+static void bench_report (const char *name, struct bench_sink *bs, int num_flows)
+{
+    btime_t elapsed = btime_gettime() - bs->start_time;
+    if (elapsed <= 0) {
+        elapsed = 1;
+    }
+    
+    // Jain's fairness index over the bytes each flow got through
+    double sum = 0.0;
+    double sum_sq = 0.0;
+    for (int i = 0; i < num_flows; i++) {
+        double x = bs->sources[i].sent_bytes;
+        sum += x;
+        sum_sq += x * x;
+    }
+    double fairness = (sum_sq > 0.0 ? (sum * sum) / (num_flows * sum_sq) : 1.0);
+    
+    printf("%-6s flows=%d packets=%"PRIu64" time=%"PRIi64"ms rate=%.0f packets/s %.1f ns/packet fairness=%.4f\n",
+           name, num_flows, bs->count, (int64_t)elapsed, bs->count * 1000.0 / elapsed,
+           elapsed * 1000000.0 / bs->count, fairness);
+}
+
+static void bench_free (struct bench_sink *bs)
+{
+    free(bs->sources);
+    BReactor_RemoveTimer(&reactor, &bs->start_timer);
+    PacketPassInterface_Free(&bs->input);
+    BReactor_Free(&reactor);
+}
+
+static void bench_fair (int num_flows, uint64_t num_packets)
+{
+    struct bench_sink bs;
+    bench_init(&bs, num_flows, num_packets);
+    
+    PacketPassFairQueue q;
+    ASSERT_FORCE(PacketPassFairQueue_Init(&q, &bs.input, BReactor_PendingGroup(&reactor), 0, BENCH_PACKET_WEIGHT))
+    
+    PacketPassFairQueueFlow *qflows = malloc(num_flows * sizeof(qflows[0]));
+    ASSERT_FORCE(qflows)
+    
+    for (int i = 0; i < num_flows; i++) {
+        PacketPassFairQueueFlow_Init(&qflows[i], &q);
+        FastPacketSource_Init(&bs.sources[i].src, PacketPassFairQueueFlow_GetInput(&qflows[i]), bs.sources[i].data, bench_packet_len(i), BReactor_PendingGroup(&reactor));
+    }
+    
+    BReactor_Exec(&reactor);
+    
+    bench_report("fair", &bs, num_flows);
+    
+    PacketPassFairQueue_PrepareFree(&q);
+    for (int i = 0; i < num_flows; i++) {
+        FastPacketSource_Free(&bs.sources[i].src);
+        PacketPassFairQueueFlow_Free(&qflows[i]);
+    }
+    free(qflows);
+    PacketPassFairQueue_Free(&q);
+    bench_free(&bs);
+}
+
+static void bench_drr (int num_flows, uint64_t num_packets)
+{
+    struct bench_sink bs;
+    bench_init(&bs, num_flows, num_packets);
+    
+    PacketPassDRRQueue q;
+    ASSERT_FORCE(PacketPassDRRQueue_Init(&q, &bs.input, BReactor_PendingGroup(&reactor), 0, BENCH_PACKET_WEIGHT, BENCH_MTU + BENCH_PACKET_WEIGHT))
+    
+    PacketPassDRRQueueFlow *qflows = malloc(num_flows * sizeof(qflows[0]));
+    ASSERT_FORCE(qflows)
+    
+    for (int i = 0; i < num_flows; i++) {
+        PacketPassDRRQueueFlow_Init(&qflows[i], &q);
+        FastPacketSource_Init(&bs.sources[i].src, PacketPassDRRQueueFlow_GetInput(&qflows[i]), bs.sources[i].data, bench_packet_len(i), BReactor_PendingGroup(&reactor));
+    }
+    
+    BReactor_Exec(&reactor);
+    
+    bench_report("drr", &bs, num_flows);
+    
+    PacketPassDRRQueue_PrepareFree(&q);
+    for (int i = 0; i < num_flows; i++) {
+        FastPacketSource_Free(&bs.sources[i].src);
+        PacketPassDRRQueueFlow_Free(&qflows[i]);
+    }
+    free(qflows);
+    PacketPassDRRQueue_Free(&q);
+    bench_free(&bs);
+}
+
+static int bench_main (int argc, char **argv)
+{
+    int num_flows = (argc > 2 ? atoi(argv[2]) : 1000);
+    uint64_t num_packets = (argc > 3 ? strtoull(argv[3], NULL, 10) : 5000000);
+    
+    if (num_flows <= 0 || num_packets == 0) {
+        fprintf(stderr, "Usage: %s bench [num_flows] [num_packets]\n", argv[0]);
+        return 1;
+    }
+    
+    bench_fair(num_flows, num_packets);
+    bench_drr(num_flows, num_packets);
+    
+    return 0;
+}
+
+int main (int argc, char **argv)
 {
     // initialize logging
     BLog_InitStdout();
@@ -111,6 +307,11 @@ int main ()
     // init time
     BTime_Init();
     
+    // benchmark mode: compare PacketPassFairQueue and PacketPassDRRQueue
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+        return bench_main(argc, argv);
+    }
+    
     // initialize reactor
     if (!BReactor_Init(&reactor)) {
         DEBUG("BReactor_Init failed");
@@ -0,0 +1,429 @@
+/**
+ * @file flow_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <misc/debug.h>
+#include <misc/minmax.h>
+#include <protocol/packetproto.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/StreamPassInterface.h>
+#include <flow/StreamRecvInterface.h>
+#include <flow/PacketCopier.h>
+#include <flow/PacketBuffer.h>
+#include <flow/PacketPassFairQueue.h>
+#include <flow/PacketPassDRRQueue.h>
+#include <flow/PacketProtoEncoder.h>
+#include <flow/PacketProtoDecoder.h>
+#include <flow/PacketStreamSender.h>
+#include <flow/PacketRouter.h>
+#include <flow/RouteBuffer.h>
+#include <examples/FastPacketSource.h>
+
+#define MTU 1500
+#define BUFFER_PACKETS 16
+#define NUM_QUEUE_FLOWS 4
+
+#ifdef FLOW_BENCH_COUNT_ALLOCS
+
+// Allocations from the statically linked badvpn code are counted through
+// the linker's --wrap option, see examples/CMakeLists.txt.
+
+static uint64_t num_allocs;
+
+void * __real_malloc (size_t size);
+void * __real_calloc (size_t nmemb, size_t size);
+void * __real_realloc (void *ptr, size_t size);
+void * __wrap_malloc (size_t size);
+void * __wrap_calloc (size_t nmemb, size_t size);
+void * __wrap_realloc (void *ptr, size_t size);
+
+void * __wrap_malloc (size_t size)
+{
+    num_allocs++;
+    return __real_malloc(size);
+}
+
+void * __wrap_calloc (size_t nmemb, size_t size)
+{
+    num_allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void * __wrap_realloc (void *ptr, size_t size)
+{
+    num_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+#endif
+
+static uint64_t get_num_allocs (void)
+{
+#ifdef FLOW_BENCH_COUNT_ALLOCS
+    return num_allocs;
+#else
+    return 0;
+#endif
+}
+
+struct bench {
+    const char *name;
+    void (*init) (int psize);
+    void (*free) (void);
+    int hold_first;
+};
+
+static BReactor reactor;
+static uint8_t packet_data[MTU];
+
+// sink at the end of every chain
+static struct {
+    PacketPassInterface input;
+    BTimer start_timer;
+    int started;
+    uint8_t *held_pkt;
+    uint64_t count;
+    uint64_t limit;
+    btime_t start_time;
+    uint64_t start_allocs;
+    BReactorStats start_stats;
+} sink;
+
+static void sink_complete (void)
+{
+    if (++sink.count == sink.limit) {
+        BReactor_Quit(&reactor, 0);
+    }
+    
+    PacketPassInterface_Done(&sink.input);
+}
+
+static void sink_handler_send (void *unused, uint8_t *data, int data_len)
+{
+    // hold the first packet until all the chain components are set up (see BPendingGroup)
+    if (!sink.started) {
+        sink.held_pkt = data;
+        return;
+    }
+    
+    sink_complete();
+}
+
+static void sink_start_timer_handler (void *unused)
+{
+    sink.started = 1;
+    sink.start_time = btime_gettime();
+    sink.start_allocs = get_num_allocs();
+    BReactor_GetStats(&reactor, &sink.start_stats);
+    
+    if (sink.held_pkt) {
+        sink_complete();
+    }
+}
+
+// loopback connecting a stream output to a stream input
+static struct {
+    StreamPassInterface input;
+    StreamRecvInterface output;
+    uint8_t *send_data;
+    int send_len;
+    uint8_t *recv_data;
+    int recv_avail;
+} pipe_s;
+
+static void pipe_transfer (void)
+{
+    if (!pipe_s.send_data || !pipe_s.recv_data) {
+        return;
+    }
+    
+    int len = bmin_int(pipe_s.send_len, pipe_s.recv_avail);
+    memcpy(pipe_s.recv_data, pipe_s.send_data, len);
+    pipe_s.send_data = NULL;
+    pipe_s.recv_data = NULL;
+    
+    StreamPassInterface_Done(&pipe_s.input, len);
+    StreamRecvInterface_Done(&pipe_s.output, len);
+}
+
+static void pipe_input_handler_send (void *unused, uint8_t *data, int data_len)
+{
+    pipe_s.send_data = data;
+    pipe_s.send_len = data_len;
+    pipe_transfer();
+}
+
+static void pipe_output_handler_recv (void *unused, uint8_t *data, int data_len)
+{
+    pipe_s.recv_data = data;
+    pipe_s.recv_avail = data_len;
+    pipe_transfer();
+}
+
+static void pipe_init (void)
+{
+    StreamPassInterface_Init(&pipe_s.input, pipe_input_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    StreamRecvInterface_Init(&pipe_s.output, pipe_output_handler_recv, NULL, BReactor_PendingGroup(&reactor));
+    pipe_s.send_data = NULL;
+    pipe_s.recv_data = NULL;
+}
+
+static void pipe_free (void)
+{
+    StreamRecvInterface_Free(&pipe_s.output);
+    StreamPassInterface_Free(&pipe_s.input);
+}
+
+// components used by the benchmarks
+static FastPacketSource sources[NUM_QUEUE_FLOWS];
+static PacketCopier copier;
+static PacketBuffer buffer;
+static PacketPassFairQueue fair_queue;
+static PacketPassFairQueueFlow fair_flows[NUM_QUEUE_FLOWS];
+static PacketPassDRRQueue drr_queue;
+static PacketPassDRRQueueFlow drr_flows[NUM_QUEUE_FLOWS];
+static PacketProtoEncoder encoder;
+static PacketBuffer encoder_buffer;
+static PacketStreamSender stream_sender;
+static PacketProtoDecoder decoder;
+static PacketRouter router;
+static RouteBuffer route_buffer;
+
+// source -> PacketCopier -> PacketBuffer -> sink
+static void buffer_init (int psize)
+{
+    PacketCopier_Init(&copier, MTU, BReactor_PendingGroup(&reactor));
+    ASSERT_FORCE(PacketBuffer_Init(&buffer, PacketCopier_GetOutput(&copier), &sink.input, BUFFER_PACKETS, BReactor_PendingGroup(&reactor)))
+    FastPacketSource_Init(&sources[0], PacketCopier_GetInput(&copier), packet_data, psize, BReactor_PendingGroup(&reactor));
+}
+
+static void buffer_free (void)
+{
+    FastPacketSource_Free(&sources[0]);
+    PacketBuffer_Free(&buffer);
+    PacketCopier_Free(&copier);
+}
+
+// sources -> PacketPassFairQueue -> sink
+static void fairqueue_init (int psize)
+{
+    ASSERT_FORCE(PacketPassFairQueue_Init(&fair_queue, &sink.input, BReactor_PendingGroup(&reactor), 0, 1))
+    for (int i = 0; i < NUM_QUEUE_FLOWS; i++) {
+        PacketPassFairQueueFlow_Init(&fair_flows[i], &fair_queue);
+        FastPacketSource_Init(&sources[i], PacketPassFairQueueFlow_GetInput(&fair_flows[i]), packet_data, psize, BReactor_PendingGroup(&reactor));
+    }
+}
+
+static void fairqueue_free (void)
+{
+    PacketPassFairQueue_PrepareFree(&fair_queue);
+    for (int i = 0; i < NUM_QUEUE_FLOWS; i++) {
+        FastPacketSource_Free(&sources[i]);
+        PacketPassFairQueueFlow_Free(&fair_flows[i]);
+    }
+    PacketPassFairQueue_Free(&fair_queue);
+}
+
+// sources -> PacketPassDRRQueue -> sink
+static void drrqueue_init (int psize)
+{
+    ASSERT_FORCE(PacketPassDRRQueue_Init(&drr_queue, &sink.input, BReactor_PendingGroup(&reactor), 0, 1, MTU + 1))
+    for (int i = 0; i < NUM_QUEUE_FLOWS; i++) {
+        PacketPassDRRQueueFlow_Init(&drr_flows[i], &drr_queue);
+        FastPacketSource_Init(&sources[i], PacketPassDRRQueueFlow_GetInput(&drr_flows[i]), packet_data, psize, BReactor_PendingGroup(&reactor));
+    }
+}
+
+static void drrqueue_free (void)
+{
+    PacketPassDRRQueue_PrepareFree(&drr_queue);
+    for (int i = 0; i < NUM_QUEUE_FLOWS; i++) {
+        FastPacketSource_Free(&sources[i]);
+        PacketPassDRRQueueFlow_Free(&drr_flows[i]);
+    }
+    PacketPassDRRQueue_Free(&drr_queue);
+}
+
+static void decoder_handler_error (void *unused)
+{
+    DEBUG("decoder error");
+    ASSERT_FORCE(0)
+}
+
+// source -> PacketCopier -> PacketProtoEncoder -> PacketBuffer -> PacketStreamSender
+//        -> loopback -> PacketProtoDecoder -> sink
+static void proto_init (int psize)
+{
+    pipe_init();
+    ASSERT_FORCE(PacketProtoDecoder_Init(&decoder, &pipe_s.output, &sink.input, BReactor_PendingGroup(&reactor), NULL, decoder_handler_error))
+    PacketStreamSender_Init(&stream_sender, &pipe_s.input, PACKETPROTO_ENCLEN(MTU), BReactor_PendingGroup(&reactor));
+    PacketCopier_Init(&copier, MTU, BReactor_PendingGroup(&reactor));
+    PacketProtoEncoder_Init(&encoder, PacketCopier_GetOutput(&copier), BReactor_PendingGroup(&reactor));
+    ASSERT_FORCE(PacketBuffer_Init(&encoder_buffer, PacketProtoEncoder_GetOutput(&encoder), PacketStreamSender_GetInput(&stream_sender), BUFFER_PACKETS, BReactor_PendingGroup(&reactor)))
+    FastPacketSource_Init(&sources[0], PacketCopier_GetInput(&copier), packet_data, psize, BReactor_PendingGroup(&reactor));
+}
+
+static void proto_free (void)
+{
+    FastPacketSource_Free(&sources[0]);
+    PacketBuffer_Free(&encoder_buffer);
+    PacketProtoEncoder_Free(&encoder);
+    PacketCopier_Free(&copier);
+    PacketStreamSender_Free(&stream_sender);
+    PacketProtoDecoder_Free(&decoder);
+    pipe_free();
+}
+
+static void router_handler (void *unused, uint8_t *buf, int recv_len)
+{
+    // drop if the buffer is full
+    PacketRouter_Route(&router, recv_len, &route_buffer, NULL, 0, 0);
+}
+
+// source -> PacketCopier -> PacketRouter -> RouteBuffer -> sink
+static void route_init (int psize)
+{
+    ASSERT_FORCE(RouteBuffer_Init(&route_buffer, MTU, &sink.input, BUFFER_PACKETS))
+    PacketCopier_Init(&copier, MTU, BReactor_PendingGroup(&reactor));
+    ASSERT_FORCE(PacketRouter_Init(&router, MTU, 0, PacketCopier_GetOutput(&copier), router_handler, NULL, BReactor_PendingGroup(&reactor)))
+    FastPacketSource_Init(&sources[0], PacketCopier_GetInput(&copier), packet_data, psize, BReactor_PendingGroup(&reactor));
+}
+
+static void route_free (void)
+{
+    FastPacketSource_Free(&sources[0]);
+    PacketRouter_Free(&router);
+    PacketCopier_Free(&copier);
+    RouteBuffer_Free(&route_buffer);
+}
+
+static const struct bench benches[] = {
+    {"buffer", buffer_init, buffer_free, 1},
+    {"fairqueue", fairqueue_init, fairqueue_free, 1},
+    {"drrqueue", drrqueue_init, drrqueue_free, 1},
+    {"proto", proto_init, proto_free, 1},
+    // PacketRouter keeps receiving (and dropping) while the sink holds a
+    // packet, so the start timer would never get a chance to run
+    {"route", route_init, route_free, 0},
+};
+
+static const int packet_sizes[] = {64, 512, 1400};
+
+static void run_bench (const struct bench *b, int psize, uint64_t num_packets)
+{
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    
+    PacketPassInterface_Init(&sink.input, MTU, sink_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    BTimer_Init(&sink.start_timer, 0, sink_start_timer_handler, NULL);
+    if (b->hold_first) {
+        BReactor_SetTimer(&reactor, &sink.start_timer);
+    }
+    sink.started = !b->hold_first;
+    sink.held_pkt = NULL;
+    sink.count = 0;
+    sink.limit = num_packets;
+    
+    b->init(psize);
+    
+    if (!b->hold_first) {
+        sink.start_time = btime_gettime();
+        sink.start_allocs = get_num_allocs();
+        BReactor_GetStats(&reactor, &sink.start_stats);
+    }
+    
+    BReactor_Exec(&reactor);
+    
+    btime_t elapsed = bmax_int64(1, btime_gettime() - sink.start_time);
+    uint64_t allocs = get_num_allocs() - sink.start_allocs;
+    BReactorStats stats;
+    BReactor_GetStats(&reactor, &stats);
+    
+    uint64_t batches = stats.num_job_batches - sink.start_stats.num_job_batches;
+    uint64_t timed_batches = stats.num_timed_batches - sink.start_stats.num_timed_batches;
+    int64_t batch_ns = stats.job_batch_ns - sink.start_stats.job_batch_ns;
+    
+    printf("%-10s size=%-5d packets=%-9"PRIu64" time=%-6"PRIi64"ms rate=%-9.0f ns/packet=%-8.1f jobs/packet=%-6.2f batches/packet=%-7.3f ns/batch=%-8.0f max_batch_us=%-6.0f allocs/packet=",
+           b->name, psize, sink.count, (int64_t)elapsed, sink.count * 1000.0 / elapsed, elapsed * 1000000.0 / sink.count,
+           (double)(stats.num_jobs - sink.start_stats.num_jobs) / sink.count,
+           (double)batches / sink.count, (timed_batches > 0 ? (double)batch_ns / timed_batches : 0.0), stats.max_job_batch_ns / 1000.0);
+#ifdef FLOW_BENCH_COUNT_ALLOCS
+    printf("%.4f\n", (double)allocs / sink.count);
+#else
+    B_USE(allocs)
+    printf("n/a\n");
+#endif
+    
+    b->free();
+    
+    BReactor_RemoveTimer(&reactor, &sink.start_timer);
+    PacketPassInterface_Free(&sink.input);
+    BReactor_Free(&reactor);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc > 3 || (argc > 1 && !strcmp(argv[1], "--help"))) {
+        fprintf(stderr, "Usage: %s [num_packets] [benchmark/all]\n", (argc > 0 ? argv[0] : ""));
+        return 1;
+    }
+    
+    uint64_t num_packets = (argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000);
+    const char *only = (argc > 2 && strcmp(argv[2], "all") ? argv[2] : NULL);
+    
+    if (num_packets == 0) {
+        fprintf(stderr, "num_packets must be positive\n");
+        return 1;
+    }
+    
+    BLog_InitStdout();
+    BTime_Init();
+    
+    memset(packet_data, 'x', sizeof(packet_data));
+    
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (only && strcmp(only, benches[i].name)) {
+            continue;
+        }
+        for (size_t j = 0; j < sizeof(packet_sizes) / sizeof(packet_sizes[0]); j++) {
+            run_bench(&benches[i], packet_sizes[j], num_packets);
+        }
+    }
+    
+    BLog_Free();
+    
+    return 0;
+}
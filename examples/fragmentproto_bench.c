@@ -0,0 +1,190 @@
+/**
+ * @file fragmentproto_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * FragmentProto loopback benchmark. Frames go through a
+ * {@link FragmentProtoDisassembler} and straight into a {@link FragmentProtoAssembler},
+ * and the rate of frames and of copies the assembler avoided is reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <flow/SinglePacketBuffer.h>
+#include <client/FragmentProtoDisassembler.h>
+#include <client/FragmentProtoAssembler.h>
+
+#define FRAME_MTU 9000
+#define NUM_FRAMES 4
+
+static BReactor reactor;
+static FragmentProtoDisassembler disassembler;
+static SinglePacketBuffer link_buffer;
+static FragmentProtoAssembler assembler;
+static PacketPassInterface *source;
+static PacketPassInterface sink;
+static uint8_t payload[FRAME_MTU];
+static int frame_size;
+static uint64_t num_sent;
+static uint64_t num_received;
+static uint64_t num_packets;
+static int bad_frames;
+
+static void send_frame (void)
+{
+    // tag the frame with its sequence number so the sink can check ordering
+    memcpy(payload, &num_sent, sizeof(num_sent));
+    num_sent++;
+    
+    PacketPassInterface_Sender_Send(source, payload, frame_size);
+}
+
+static void source_handler_done (void *unused)
+{
+    if (num_sent < num_packets) {
+        send_frame();
+    }
+}
+
+static void sink_handler_send (void *unused, uint8_t *data, int data_len)
+{
+    uint64_t seq;
+    memcpy(&seq, data, sizeof(seq));
+    
+    if (data_len != frame_size || seq != num_received || memcmp(data + sizeof(seq), payload + sizeof(seq), frame_size - sizeof(seq))) {
+        bad_frames = 1;
+    }
+    
+    if (++num_received == num_packets) {
+        BReactor_Quit(&reactor, 0);
+    }
+    
+    PacketPassInterface_Done(&sink);
+}
+
+static void logfunc (void *unused)
+{
+}
+
+static void usage (const char *name)
+{
+    fprintf(stderr, "Usage: %s <num_frames> <frame_size> [carrier_mtu]\n", name);
+    exit(1);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 3 && argc != 4) {
+        usage(argv[0]);
+    }
+    
+    num_packets = strtoull(argv[1], NULL, 10);
+    frame_size = atoi(argv[2]);
+    int carrier_mtu = (argc > 3 ? atoi(argv[3]) : 1400);
+    
+    if (num_packets == 0 || frame_size < (int)sizeof(uint64_t) || frame_size > FRAME_MTU || carrier_mtu <= (int)sizeof(struct fragmentproto_chunk_header)) {
+        usage(argv[0]);
+    }
+    
+    int ret = 1;
+    
+    BLog_InitStdout();
+    BTime_Init();
+    
+    if (!BReactor_Init(&reactor)) {
+        fprintf(stderr, "BReactor_Init failed\n");
+        goto fail0;
+    }
+    
+    for (int i = 0; i < FRAME_MTU; i++) {
+        payload[i] = i;
+    }
+    
+    PacketPassInterface_Init(&sink, FRAME_MTU, sink_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    
+    FragmentProtoDisassembler_Init(&disassembler, &reactor, FRAME_MTU, carrier_mtu, -1, -1);
+    
+    if (!FragmentProtoAssembler_Init(&assembler, carrier_mtu, &sink, NUM_FRAMES, fragmentproto_max_chunks_for_frame(carrier_mtu, FRAME_MTU),
+                                     BReactor_PendingGroup(&reactor), NULL, logfunc)) {
+        fprintf(stderr, "FragmentProtoAssembler_Init failed\n");
+        goto fail1;
+    }
+    
+    if (!SinglePacketBuffer_Init(&link_buffer, FragmentProtoDisassembler_GetOutput(&disassembler), FragmentProtoAssembler_GetInput(&assembler), BReactor_PendingGroup(&reactor))) {
+        fprintf(stderr, "SinglePacketBuffer_Init failed\n");
+        goto fail2;
+    }
+    
+    source = FragmentProtoDisassembler_GetInput(&disassembler);
+    PacketPassInterface_Sender_Init(source, source_handler_done, NULL);
+    send_frame();
+    
+    btime_t start = btime_gettime();
+    BReactor_Exec(&reactor);
+    btime_t elapsed = btime_gettime() - start;
+    
+    if (bad_frames) {
+        printf("frames were corrupted or reordered\n");
+        goto fail3;
+    }
+    
+    FragmentProtoAssemblerStats stats;
+    FragmentProtoAssembler_GetStats(&assembler, &stats);
+    
+    double secs = (elapsed > 0 ? elapsed : 1) / 1000.0;
+    printf("frame_size=%d carrier_mtu=%d frames=%llu time=%.3fs rate=%.0f frames/s copies_avoided=%.0f /s (%.3f Gbit/s not copied)\n",
+           frame_size, carrier_mtu, (unsigned long long)num_packets, secs, num_packets / secs,
+           stats.num_direct_frames / secs, (double)stats.num_direct_bytes * 8 / secs / 1e9);
+    
+    ret = 0;
+    
+fail3:
+    SinglePacketBuffer_Free(&link_buffer);
+fail2:
+    FragmentProtoAssembler_Free(&assembler);
+fail1:
+    FragmentProtoDisassembler_Free(&disassembler);
+    PacketPassInterface_Free(&sink);
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
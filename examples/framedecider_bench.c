@@ -0,0 +1,286 @@
+/**
+ * @file framedecider_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * {@link FrameDecider} benchmark. A number of peers each register their full
+ * quota of MAC addresses and multicast groups, then frames are decided for known
+ * unicast and multicast destinations, and frames from peers are analyzed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <misc/balloc.h>
+#include <misc/ethernet_proto.h>
+#include <misc/ipv4_proto.h>
+#include <misc/igmp_proto.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <client/FrameDecider.h>
+
+#define MAX_PEER_GROUPS 4
+#define NUM_PATTERNS 4096
+#define IGMP_FRAME_LEN (sizeof(struct ethernet_header) + sizeof(struct ipv4_header) + sizeof(struct igmp_base) + sizeof(struct igmp_v2_extra))
+
+static BReactor reactor;
+static FrameDecider decider;
+static FrameDeciderPeer *peers;
+static int num_peers;
+static int max_peer_macs;
+static uint32_t rand_state = 1;
+
+static uint32_t next_rand (void)
+{
+    rand_state = rand_state * UINT32_C(1103515245) + 12345;
+    return rand_state >> 8;
+}
+
+static void make_mac (uint8_t *mac, int peer, int index)
+{
+    mac[0] = 0x02;
+    mac[1] = peer >> 16;
+    mac[2] = peer >> 8;
+    mac[3] = peer;
+    mac[4] = index >> 8;
+    mac[5] = index;
+}
+
+static uint32_t make_group (int peer, int index)
+{
+    // 239.x.y.z with distinct low 23 bits for every peer and index
+    return hton32(UINT32_C(0xEF000000) | ((uint32_t)(peer & 0x1FFF) << 10) | (uint32_t)index);
+}
+
+static void make_unicast_frame (uint8_t *frame, const uint8_t *dest, const uint8_t *source)
+{
+    struct ethernet_header eh;
+    memcpy(eh.dest, dest, sizeof(eh.dest));
+    memcpy(eh.source, source, sizeof(eh.source));
+    eh.type = hton16(0x0806);
+    memcpy(frame, &eh, sizeof(eh));
+}
+
+static void make_igmp_report (uint8_t *frame, const uint8_t *source, uint32_t group)
+{
+    struct ethernet_header eh;
+    memset(eh.dest, 0, sizeof(eh.dest));
+    memcpy(eh.source, source, sizeof(eh.source));
+    eh.type = hton16(ETHERTYPE_IPV4);
+    memcpy(frame, &eh, sizeof(eh));
+    
+    struct ipv4_header ih;
+    memset(&ih, 0, sizeof(ih));
+    ih.version4_ihl4 = IPV4_MAKE_VERSION_IHL(sizeof(ih));
+    ih.total_length = hton16(sizeof(ih) + sizeof(struct igmp_base) + sizeof(struct igmp_v2_extra));
+    ih.ttl = hton8(1);
+    ih.protocol = hton8(IPV4_PROTOCOL_IGMP);
+    ih.destination_address = group;
+    ih.checksum = ipv4_checksum(&ih, NULL, 0);
+    memcpy(frame + sizeof(eh), &ih, sizeof(ih));
+    
+    struct igmp_base ib;
+    memset(&ib, 0, sizeof(ib));
+    ib.type = hton8(IGMP_TYPE_V2_MEMBERSHIP_REPORT);
+    memcpy(frame + sizeof(eh) + sizeof(ih), &ib, sizeof(ib));
+    
+    struct igmp_v2_extra ie;
+    ie.group = group;
+    memcpy(frame + sizeof(eh) + sizeof(ih) + sizeof(ib), &ie, sizeof(ie));
+}
+
+static void peer_logfunc (void *unused)
+{
+}
+
+static double run_decide (uint8_t (*frames)[sizeof(struct ethernet_header)], uint64_t num_frames, uint64_t *out_dests)
+{
+    uint64_t dests = 0;
+    
+    btime_t start = btime_gettime();
+    
+    for (uint64_t i = 0; i < num_frames; i++) {
+        FrameDecider_AnalyzeAndDecide(&decider, frames[i % NUM_PATTERNS], sizeof(struct ethernet_header));
+        while (FrameDecider_NextDestination(&decider)) {
+            dests++;
+        }
+    }
+    
+    btime_t elapsed = btime_gettime() - start;
+    
+    *out_dests = dests;
+    return (elapsed > 0 ? elapsed : 1) / 1000.0;
+}
+
+static double run_analyze (uint8_t (*frames)[sizeof(struct ethernet_header)], int *frame_peers, uint64_t num_frames)
+{
+    btime_t start = btime_gettime();
+    
+    for (uint64_t i = 0; i < num_frames; i++) {
+        FrameDeciderPeer_Analyze(&peers[frame_peers[i % NUM_PATTERNS]], frames[i % NUM_PATTERNS], sizeof(struct ethernet_header));
+    }
+    
+    btime_t elapsed = btime_gettime() - start;
+    
+    return (elapsed > 0 ? elapsed : 1) / 1000.0;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s <num_peers> <max_peer_macs> <num_frames>\n", argv[0]);
+        return 1;
+    }
+    
+    num_peers = atoi(argv[1]);
+    max_peer_macs = atoi(argv[2]);
+    uint64_t num_frames = strtoull(argv[3], NULL, 10);
+    
+    if (num_peers <= 0 || num_peers > 0x1FFF || max_peer_macs <= 0 || max_peer_macs > 0xFFFF || num_frames == 0) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+    
+    int ret = 1;
+    
+    BLog_InitStdout();
+    BLog_SetChannelLoglevel(BLOG_CHANNEL_FrameDecider, BLOG_WARNING);
+    BTime_Init();
+    
+    uint8_t (*frames)[sizeof(struct ethernet_header)] = BAllocArray(NUM_PATTERNS, sizeof(*frames));
+    int *frame_peers = BAllocArray(NUM_PATTERNS, sizeof(*frame_peers));
+    if (!frames || !frame_peers) {
+        fprintf(stderr, "BAllocArray failed\n");
+        goto fail0;
+    }
+    
+    if (!BReactor_Init(&reactor)) {
+        fprintf(stderr, "BReactor_Init failed\n");
+        goto fail0;
+    }
+    
+    FrameDecider_Init(&decider, max_peer_macs, MAX_PEER_GROUPS, 260000, 2000, &reactor);
+    
+    if (!(peers = BAllocArray(num_peers, sizeof(peers[0])))) {
+        fprintf(stderr, "BAllocArray failed\n");
+        goto fail1;
+    }
+    
+    int num_inited = 0;
+    while (num_inited < num_peers) {
+        if (!FrameDeciderPeer_Init(&peers[num_inited], &decider, NULL, peer_logfunc)) {
+            fprintf(stderr, "FrameDeciderPeer_Init failed\n");
+            goto fail2;
+        }
+        num_inited++;
+    }
+    
+    // register all MACs and groups of every peer
+    uint8_t broadcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    for (int p = 0; p < num_peers; p++) {
+        uint8_t frame[IGMP_FRAME_LEN];
+        uint8_t mac[6];
+        
+        for (int m = 0; m < max_peer_macs; m++) {
+            make_mac(mac, p, m);
+            make_unicast_frame(frame, broadcast, mac);
+            FrameDeciderPeer_Analyze(&peers[p], frame, sizeof(struct ethernet_header));
+        }
+        
+        for (int g = 0; g < MAX_PEER_GROUPS; g++) {
+            make_igmp_report(frame, mac, make_group(p, g));
+            FrameDeciderPeer_Analyze(&peers[p], frame, IGMP_FRAME_LEN);
+        }
+    }
+    
+    uint8_t src[6] = {0x02, 0xff, 0xff, 0xff, 0xff, 0xff};
+    uint64_t dests;
+    
+    // unicast to known MACs
+    for (int i = 0; i < NUM_PATTERNS; i++) {
+        uint8_t mac[6];
+        make_mac(mac, next_rand() % num_peers, next_rand() % max_peer_macs);
+        make_unicast_frame(frames[i], mac, src);
+    }
+    double secs = run_decide(frames, num_frames, &dests);
+    if (dests != num_frames) {
+        printf("unicast frames were not delivered to a single peer\n");
+        goto fail2;
+    }
+    printf("unicast:   peers=%d macs=%d rate=%.0f frames/s\n", num_peers, max_peer_macs, num_frames / secs);
+    
+    // multicast to joined groups
+    for (int i = 0; i < NUM_PATTERNS; i++) {
+        uint32_t group = ntoh32(make_group(next_rand() % num_peers, next_rand() % MAX_PEER_GROUPS));
+        uint8_t mac[6] = {0x01, 0x00, 0x5e, (group >> 16) & 0x7F, group >> 8, group};
+        make_unicast_frame(frames[i], mac, src);
+    }
+    secs = run_decide(frames, num_frames, &dests);
+    if (dests != num_frames) {
+        printf("multicast frames were not delivered to a single peer\n");
+        goto fail2;
+    }
+    printf("multicast: peers=%d groups=%d rate=%.0f frames/s\n", num_peers, MAX_PEER_GROUPS, num_frames / secs);
+    
+    // frames from peers with their own source MACs
+    for (int i = 0; i < NUM_PATTERNS; i++) {
+        uint8_t mac[6];
+        frame_peers[i] = next_rand() % num_peers;
+        make_mac(mac, frame_peers[i], next_rand() % max_peer_macs);
+        make_unicast_frame(frames[i], broadcast, mac);
+    }
+    secs = run_analyze(frames, frame_peers, num_frames);
+    printf("analyze:   peers=%d macs=%d rate=%.0f frames/s\n", num_peers, max_peer_macs, num_frames / secs);
+    
+    ret = 0;
+    
+fail2:
+    while (num_inited > 0) {
+        FrameDeciderPeer_Free(&peers[--num_inited]);
+    }
+    BFree(peers);
+fail1:
+    FrameDecider_Free(&decider);
+    BReactor_Free(&reactor);
+fail0:
+    BFree(frame_peers);
+    BFree(frames);
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
@@ -0,0 +1,597 @@
+/**
+ * @file ncd_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Benchmark for the NCD interpreter, using generated programs:
+ *   - parse: parsing a program of n processes with m statements each,
+ *   - init: {@link NCDInterpreter_Init} on such a program,
+ *   - spawn: a Foreach over a list of n elements, with m statements in the body,
+ *     measuring the creation and teardown of the child processes,
+ *   - churn: m rounds of spawning and tearing down a Foreach over a list of
+ *     n elements (with three statements in the body), by backtracking,
+ *   - advance: n processes with m statements each, which a main process
+ *     waits for using depend() before exiting,
+ *   - call: like spawn, but each statement in the body calls pure functions
+ *     on a list of n strings from the parent process, which doesn't change
+ *     between iterations,
+ *   - manager: a Foreach over a list of n elements starting a named process
+ *     for each using process_manager, followed by m restarts of each,
+ *   - regex: like spawn, but each statement in the body is a regex_match() of
+ *     the element, with a different regex per statement,
+ *   - val: copying and comparing a list of n maps with m entries each,
+ *   - cache: building the program of the parse test from a file, with
+ *     {@link NCDBuildProgram_Build} versus loading it from a warm program cache.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <misc/debug.h>
+#include <misc/expstring.h>
+#include <misc/write_file.h>
+#include <misc/concat_strings.h>
+#include <base/BLog.h>
+#include <base/BPending.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BProcess.h>
+#include <udevmonitor/NCDUdevManager.h>
+#include <random/BRandom2.h>
+#include <threadwork/BThreadWork.h>
+#include <ncd/NCDConfigParser.h>
+#include <ncd/NCDBuildProgram.h>
+#include <ncd/NCDSugar.h>
+#include <ncd/NCDInterpreter.h>
+#include <ncd/NCDStringIndex.h>
+#include <ncd/NCDVal.h>
+
+#define FORCE(cmd) if (!(cmd)) { fprintf(stderr, "failed: %s\n", #cmd); exit(1); }
+
+static BReactor reactor;
+static BProcessManager manager;
+static NCDUdevManager umanager;
+static BRandom2 random2;
+static BThreadWorkDispatcher twd;
+static NCDInterpreter interpreter;
+static BPending next_job;
+static int have_interpreter;
+static char *program_text;
+static int iterations_left;
+static int64_t init_ns;
+static int64_t run_ns;
+static int64_t run_start;
+
+static void append (ExpString *str, const char *fmt, int a, int b)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), fmt, a, b);
+    FORCE(ExpString_Append(str, buf))
+}
+
+static char * gen_processes (int n, int m, int advance)
+{
+    ExpString str;
+    FORCE(ExpString_Init(&str))
+    
+    for (int i = 0; i < n; i++) {
+        append(&str, "process p%d {\n", i, 0);
+        for (int j = 0; j < m; j++) {
+            append(&str, "    var(\"%d\") v%d;\n", j, j);
+        }
+        if (advance) {
+            append(&str, "    provide(\"p%d\");\n", i, 0);
+        }
+        FORCE(ExpString_Append(&str, "}\n"))
+    }
+    
+    if (advance) {
+        FORCE(ExpString_Append(&str, "process main {\n"))
+        for (int i = 0; i < n; i++) {
+            append(&str, "    depend(\"p%d\") d%d;\n", i, i);
+        }
+        FORCE(ExpString_Append(&str, "    exit(\"0\");\n}\n"))
+    }
+    
+    return ExpString_Get(&str);
+}
+
+static char * gen_spawn (int n, int m)
+{
+    ExpString str;
+    FORCE(ExpString_Init(&str))
+    
+    FORCE(ExpString_Append(&str, "process main {\n    value({"))
+    for (int i = 0; i < n; i++) {
+        append(&str, (i > 0 ? ", \"%d\"" : "\"%d\""), i, 0);
+    }
+    FORCE(ExpString_Append(&str, "}) list;\n    Foreach (list As x) {\n"))
+    for (int j = 0; j < m; j++) {
+        append(&str, "        var(x) v%d;\n", j, 0);
+    }
+    FORCE(ExpString_Append(&str, "    };\n    exit(\"0\");\n}\n"))
+    
+    return ExpString_Get(&str);
+}
+
+static char * gen_churn (int n, int m)
+{
+    ExpString str;
+    FORCE(ExpString_Init(&str))
+    
+    FORCE(ExpString_Append(&str, "process main {\n    value({"))
+    for (int i = 0; i < n; i++) {
+        append(&str, (i > 0 ? ", \"%d\"" : "\"%d\""), i, 0);
+    }
+    FORCE(ExpString_Append(&str, "}) list;\n    var(\"0\") i;\n    backtrack_point() point;\n"))
+    append(&str, "    num_lesser(i, \"%d\") do_more;\n", m, 0);
+    FORCE(ExpString_Append(&str, "    If (do_more) {\n"
+                                 "        Foreach (list As x) {\n"
+                                 "            var(x) v0;\n            var(x) v1;\n            var(x) v2;\n"
+                                 "        };\n"
+                                 "        num_add(i, \"1\") new_i;\n        i->set(new_i);\n        point->go();\n"
+                                 "    };\n    exit(\"0\");\n}\n"))
+    
+    return ExpString_Get(&str);
+}
+
+static char * gen_call (int n, int m)
+{
+    ExpString str;
+    FORCE(ExpString_Init(&str))
+    
+    FORCE(ExpString_Append(&str, "process main {\n    value({"))
+    for (int i = 0; i < n; i++) {
+        append(&str, (i > 0 ? ", \"%d\"" : "\"%d\""), i, 0);
+    }
+    FORCE(ExpString_Append(&str, "}) list;\n    Foreach (list As x) {\n"))
+    for (int j = 0; j < m; j++) {
+        append(&str, "        var(@decode_value(@encode_value(list))) v%d;\n", j, 0);
+    }
+    FORCE(ExpString_Append(&str, "    };\n    exit(\"0\");\n}\n"))
+    
+    return ExpString_Get(&str);
+}
+
+static char * gen_manager (int n, int m)
+{
+    ExpString str;
+    FORCE(ExpString_Init(&str))
+    
+    FORCE(ExpString_Append(&str, "process main {\n    value({"))
+    for (int i = 0; i < n; i++) {
+        append(&str, (i > 0 ? ", \"%d\"" : "\"%d\""), i, 0);
+    }
+    FORCE(ExpString_Append(&str, "}) list;\n    process_manager() mgr;\n    Foreach (list As x) {\n"
+                                 "        mgr->start({\"child\", x}, \"child\", {});\n    };\n"))
+    for (int j = 0; j < m; j++) {
+        append(&str, "    Foreach (list As x) {\n        mgr->stop({\"child\", x});\n"
+                     "        mgr->start({\"child\", x}, \"child\", {});\n    } r%d;\n", j, 0);
+    }
+    FORCE(ExpString_Append(&str, "    exit(\"0\");\n}\n\ntemplate child {\n    var(\"1\") x;\n}\n"))
+    
+    return ExpString_Get(&str);
+}
+
+static char * gen_regex (int n, int m)
+{
+    ExpString str;
+    FORCE(ExpString_Init(&str))
+    
+    FORCE(ExpString_Append(&str, "process main {\n    value({"))
+    for (int i = 0; i < n; i++) {
+        append(&str, (i > 0 ? ", \"%d\"" : "\"%d\""), i, 0);
+    }
+    FORCE(ExpString_Append(&str, "}) list;\n    Foreach (list As x) {\n"))
+    for (int j = 0; j < m; j++) {
+        append(&str, "        regex_match(x, \"^([0-9]+)(%d|[a-f]+)?$\") r%d;\n", j, j);
+    }
+    FORCE(ExpString_Append(&str, "    };\n    exit(\"0\");\n}\n"))
+    
+    return ExpString_Get(&str);
+}
+
+static NCDProgram parse_program (void)
+{
+    NCDProgram program;
+    FORCE(NCDConfigParser_Parse(program_text, strlen(program_text), &program))
+    return program;
+}
+
+static void interpreter_handler_finished (void *user, int exit_code)
+{
+    run_ns += btime_gettime_ns() - run_start;
+    
+    // the interpreter can't be freed from here
+    BPending_Set(&next_job);
+}
+
+static void start_iteration (void)
+{
+    NCDProgram program = parse_program();
+    
+    struct NCDInterpreter_params params;
+    params.handler_finished = interpreter_handler_finished;
+    params.user = NULL;
+    params.retry_time = 1000;
+    params.extra_args = NULL;
+    params.num_extra_args = 0;
+    params.profile = 0;
+    params.reactor = &reactor;
+    params.manager = &manager;
+    params.umanager = &umanager;
+    params.random2 = &random2;
+    params.twd = &twd;
+    
+    int64_t start = btime_gettime_ns();
+    FORCE(NCDInterpreter_Init(&interpreter, program, params))
+    run_start = btime_gettime_ns();
+    init_ns += run_start - start;
+    
+    have_interpreter = 1;
+}
+
+static void next_job_handler (void *unused)
+{
+    if (have_interpreter) {
+        NCDInterpreter_Free(&interpreter);
+        have_interpreter = 0;
+    }
+    
+    if (iterations_left == 0) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    iterations_left--;
+    
+    start_iteration();
+}
+
+static void run_interpreter (int iterations)
+{
+    iterations_left = iterations;
+    init_ns = 0;
+    run_ns = 0;
+    
+    BPending_Set(&next_job);
+    BReactor_Exec(&reactor);
+}
+
+static void bench_parse (int n, int m, int iterations)
+{
+    program_text = gen_processes(n, m, 0);
+    size_t len = strlen(program_text);
+    
+    int64_t start = btime_gettime_ns();
+    for (int i = 0; i < iterations; i++) {
+        NCDProgram program = parse_program();
+        NCDProgram_Free(&program);
+    }
+    double secs = (btime_gettime_ns() - start) / 1e9;
+    
+    printf("parse processes=%d statements=%d bytes=%zu time=%.3fs avg=%.3fms MB/s=%.1f\n",
+           n, m, len, secs, secs * 1000 / iterations, len * (double)iterations / secs / 1e6);
+    
+    free(program_text);
+}
+
+static void bench_init (int n, int m, int iterations)
+{
+    program_text = gen_processes(n, m, 0);
+    
+    int64_t total_ns = 0;
+    for (int i = 0; i < iterations; i++) {
+        NCDProgram program = parse_program();
+        
+        struct NCDInterpreter_params params;
+        params.handler_finished = interpreter_handler_finished;
+        params.user = NULL;
+        params.retry_time = 1000;
+        params.extra_args = NULL;
+        params.num_extra_args = 0;
+        params.profile = 0;
+        params.reactor = &reactor;
+        params.manager = &manager;
+        params.umanager = &umanager;
+        params.random2 = &random2;
+        params.twd = &twd;
+        
+        int64_t start = btime_gettime_ns();
+        FORCE(NCDInterpreter_Init(&interpreter, program, params))
+        total_ns += btime_gettime_ns() - start;
+        
+        // freeing is allowed before any jobs have run
+        NCDInterpreter_Free(&interpreter);
+    }
+    
+    printf("init processes=%d statements=%d avg=%.3fms\n", n, m, total_ns / 1e6 / iterations);
+    
+    free(program_text);
+}
+
+static void bench_spawn (int n, int m, int iterations)
+{
+    program_text = gen_spawn(n, m);
+    
+    run_interpreter(iterations);
+    
+    double secs = run_ns / 1e9;
+    printf("spawn children=%d statements=%d avg_init=%.3fms avg_run=%.3fms children/s=%.0f statements/s=%.0f\n",
+           n, m, init_ns / 1e6 / iterations, run_ns / 1e6 / iterations,
+           (double)n * iterations / secs, (double)n * m * iterations / secs);
+    
+    free(program_text);
+}
+
+static void bench_churn (int n, int m, int iterations)
+{
+    program_text = gen_churn(n, m);
+    
+    run_interpreter(iterations);
+    
+    // per round, the If body and the Foreach children
+    double secs = run_ns / 1e9;
+    printf("churn children=%d rounds=%d avg_init=%.3fms avg_run=%.3fms processes/s=%.0f\n",
+           n, m, init_ns / 1e6 / iterations, run_ns / 1e6 / iterations, (double)(n + 1) * m * iterations / secs);
+    
+    free(program_text);
+}
+
+static void bench_call (int n, int m, int iterations)
+{
+    program_text = gen_call(n, m);
+    
+    run_interpreter(iterations);
+    
+    double secs = run_ns / 1e9;
+    printf("call children=%d statements=%d avg_init=%.3fms avg_run=%.3fms statements/s=%.0f\n",
+           n, m, init_ns / 1e6 / iterations, run_ns / 1e6 / iterations, (double)n * m * iterations / secs);
+    
+    free(program_text);
+}
+
+static void bench_manager (int n, int m, int iterations)
+{
+    program_text = gen_manager(n, m);
+    
+    run_interpreter(iterations);
+    
+    double secs = run_ns / 1e9;
+    printf("manager processes=%d restarts=%d avg_init=%.3fms avg_run=%.3fms starts/s=%.0f\n",
+           n, m, init_ns / 1e6 / iterations, run_ns / 1e6 / iterations, (double)n * (m + 1) * iterations / secs);
+    
+    free(program_text);
+}
+
+static void bench_regex (int n, int m, int iterations)
+{
+    program_text = gen_regex(n, m);
+    
+    run_interpreter(iterations);
+    
+    double secs = run_ns / 1e9;
+    printf("regex children=%d statements=%d avg_init=%.3fms avg_run=%.3fms matches/s=%.0f\n",
+           n, m, init_ns / 1e6 / iterations, run_ns / 1e6 / iterations, (double)n * m * iterations / secs);
+    
+    free(program_text);
+}
+
+static void bench_advance (int n, int m, int iterations)
+{
+    program_text = gen_processes(n, m, 1);
+    
+    run_interpreter(iterations);
+    
+    double secs = run_ns / 1e9;
+    double statements = (double)n * (m + 2) + 1;
+    printf("advance processes=%d statements=%d avg_init=%.3fms avg_run=%.3fms statements/s=%.0f\n",
+           n, m, init_ns / 1e6 / iterations, run_ns / 1e6 / iterations, statements * iterations / secs);
+    
+    free(program_text);
+}
+
+static void bench_val (int n, int m, int iterations)
+{
+    NCDStringIndex string_index;
+    FORCE(NCDStringIndex_Init(&string_index))
+    
+    NCDValMem mem;
+    NCDValMem_Init(&mem, &string_index);
+    
+    // build a list of maps
+    NCDValRef list = NCDVal_NewList(&mem, n);
+    FORCE(!NCDVal_IsInvalid(list))
+    for (int i = 0; i < n; i++) {
+        NCDValRef map = NCDVal_NewMap(&mem, m);
+        FORCE(!NCDVal_IsInvalid(map))
+        for (int j = 0; j < m; j++) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "key%d", j);
+            NCDValRef key = NCDVal_NewString(&mem, buf);
+            snprintf(buf, sizeof(buf), "value%d-%d", i, j);
+            NCDValRef val = NCDVal_NewString(&mem, buf);
+            FORCE(!NCDVal_IsInvalid(key) && !NCDVal_IsInvalid(val))
+            int inserted;
+            FORCE(NCDVal_MapInsert(map, key, val, &inserted) && inserted)
+        }
+        FORCE(NCDVal_ListAppend(list, map))
+    }
+    
+    double values = (double)n * (1 + 2 * m) + 1;
+    
+    NCDValMem copy_mem;
+    NCDValRef copy;
+    
+    int64_t copy_ns = 0;
+    int64_t compare_ns = 0;
+    for (int i = 0; i < iterations; i++) {
+        NCDValMem_Init(&copy_mem, &string_index);
+        
+        int64_t start = btime_gettime_ns();
+        copy = NCDVal_NewCopy(&copy_mem, list);
+        copy_ns += btime_gettime_ns() - start;
+        FORCE(!NCDVal_IsInvalid(copy))
+        
+        start = btime_gettime_ns();
+        int cmp = NCDVal_Compare(list, copy);
+        compare_ns += btime_gettime_ns() - start;
+        FORCE(cmp == 0)
+        
+        NCDValMem_Free(&copy_mem);
+    }
+    
+    printf("val maps=%d entries=%d values=%.0f copy_avg=%.3fms copy_values/s=%.0f compare_avg=%.3fms compare_values/s=%.0f\n",
+           n, m, values, copy_ns / 1e6 / iterations, values * iterations / (copy_ns / 1e9),
+           compare_ns / 1e6 / iterations, values * iterations / (compare_ns / 1e9));
+    
+    NCDValMem_Free(&mem);
+    NCDStringIndex_Free(&string_index);
+}
+
+static void bench_cache (int n, int m, int iterations)
+{
+    program_text = gen_processes(n, m, 0);
+    
+    char file_path[] = "/tmp/ncd_bench_XXXXXX";
+    int fd = mkstemp(file_path);
+    FORCE(fd >= 0)
+    close(fd);
+    FORCE(write_file(file_path, MemRef_MakeCstr(program_text)))
+    
+    char *cache_path = concat_strings(2, file_path, ".cache");
+    FORCE(cache_path)
+    
+    // build as without a cache, including the desugaring the interpreter would do
+    int64_t start = btime_gettime_ns();
+    for (int i = 0; i < iterations; i++) {
+        NCDProgram program;
+        FORCE(NCDBuildProgram_Build(file_path, &program))
+        FORCE(NCDSugar_Desugar(&program))
+        NCDProgram_Free(&program);
+    }
+    double build_secs = (btime_gettime_ns() - start) / 1e9;
+    
+    // warm the cache
+    NCDProgram program;
+    FORCE(NCDBuildProgram_BuildCached(file_path, cache_path, &program))
+    NCDProgram_Free(&program);
+    
+    start = btime_gettime_ns();
+    for (int i = 0; i < iterations; i++) {
+        FORCE(NCDBuildProgram_BuildCached(file_path, cache_path, &program))
+        NCDProgram_Free(&program);
+    }
+    double cached_secs = (btime_gettime_ns() - start) / 1e9;
+    
+    printf("cache processes=%d statements=%d build_avg=%.3fms cached_avg=%.3fms speedup=%.1fx\n",
+           n, m, build_secs * 1000 / iterations, cached_secs * 1000 / iterations, build_secs / cached_secs);
+    
+    unlink(cache_path);
+    unlink(file_path);
+    free(cache_path);
+    free(program_text);
+}
+
+static void usage (const char *name)
+{
+    fprintf(stderr, "Usage: %s <test> <n> <m> <iterations>\n", name);
+    fprintf(stderr, "    <test> is one of (parse, init, spawn, churn, call, regex, manager, advance, val, cache); see the source for what n and m mean.\n");
+    exit(1);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 5) {
+        usage(argv[0]);
+    }
+    
+    const char *test = argv[1];
+    int n = atoi(argv[2]);
+    int m = atoi(argv[3]);
+    int iterations = atoi(argv[4]);
+    
+    if (n <= 0 || m < 0 || iterations <= 0) {
+        usage(argv[0]);
+    }
+    
+    BLog_InitStdout();
+    BLog_SetChannelLoglevel(BLOG_CHANNEL_ncd, BLOG_WARNING);
+    BLog_SetChannelLoglevel(BLOG_CHANNEL_NCDBuildProgram, BLOG_WARNING);
+    BLog_SetChannelLoglevel(BLOG_CHANNEL_NCDProgramCache, BLOG_WARNING);
+    BLog_SetChannelLoglevel(BLOG_CHANNEL_ncd_regex_match, BLOG_WARNING);
+    BTime_Init();
+    
+    FORCE(BReactor_Init(&reactor))
+    FORCE(BProcessManager_Init(&manager, &reactor))
+    NCDUdevManager_Init(&umanager, 1, &reactor, &manager);
+    FORCE(BRandom2_Init(&random2, BRANDOM2_INIT_LAZY))
+    FORCE(BThreadWorkDispatcher_Init(&twd, &reactor, 0))
+    BPending_Init(&next_job, BReactor_PendingGroup(&reactor), next_job_handler, NULL);
+    
+    if (!strcmp(test, "parse")) {
+        bench_parse(n, m, iterations);
+    } else if (!strcmp(test, "init")) {
+        bench_init(n, m, iterations);
+    } else if (!strcmp(test, "spawn")) {
+        bench_spawn(n, m, iterations);
+    } else if (!strcmp(test, "churn")) {
+        bench_churn(n, m, iterations);
+    } else if (!strcmp(test, "call")) {
+        bench_call(n, m, iterations);
+    } else if (!strcmp(test, "regex")) {
+        bench_regex(n, m, iterations);
+    } else if (!strcmp(test, "manager")) {
+        bench_manager(n, m, iterations);
+    } else if (!strcmp(test, "advance")) {
+        bench_advance(n, m, iterations);
+    } else if (!strcmp(test, "val")) {
+        bench_val(n, m, iterations);
+    } else if (!strcmp(test, "cache")) {
+        bench_cache(n, m, iterations);
+    } else {
+        usage(argv[0]);
+    }
+    
+    BPending_Free(&next_job);
+    BThreadWorkDispatcher_Free(&twd);
+    BRandom2_Free(&random2);
+    NCDUdevManager_Free(&umanager);
+    BProcessManager_Free(&manager);
+    BReactor_Free(&reactor);
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+}
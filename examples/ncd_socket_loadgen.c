@@ -0,0 +1,335 @@
+/**
+ * @file ncd_socket_loadgen.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Load generator for NCD socket servers, such as ncd/examples/tcp_line_echo_server.ncd.
+ * Keeps a number of connections open at once; each one sends a number of lines
+ * in one go, waits until all of them have been echoed back, checks them and
+ * closes, after which its slot opens a new connection, until the given total
+ * number of connections has been made. Reports connections and lines per second.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <misc/debug.h>
+#include <misc/expstring.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BNetwork.h>
+#include <system/BConnection.h>
+
+#define LG_STATE_IDLE 0
+#define LG_STATE_CONNECTING 1
+#define LG_STATE_CONNECTED 2
+
+struct lg_client {
+    int index;
+    int state;
+    BConnector connector;
+    BConnection con;
+    size_t sent;
+    size_t received;
+    char *recv_buf;
+};
+
+static BReactor reactor;
+static BAddr server_addr;
+static struct lg_client *clients;
+static int concurrency;
+static int num_connections;
+static int lines_per_connection;
+static char *payload;
+static size_t payload_len;
+static int num_started;
+static int num_finished;
+static int failed;
+
+static void client_start (struct lg_client *c);
+
+static void client_free (struct lg_client *c)
+{
+    switch (c->state) {
+        case LG_STATE_CONNECTING: {
+            BConnector_Free(&c->connector);
+        } break;
+        
+        case LG_STATE_CONNECTED: {
+            BConnection_RecvAsync_Free(&c->con);
+            BConnection_SendAsync_Free(&c->con);
+            BConnection_Free(&c->con);
+        } break;
+    }
+    
+    c->state = LG_STATE_IDLE;
+}
+
+static void client_fail (struct lg_client *c, const char *what)
+{
+    fprintf(stderr, "client %d: %s\n", c->index, what);
+    
+    client_free(c);
+    
+    failed = 1;
+    BReactor_Quit(&reactor, 1);
+}
+
+static void client_send (struct lg_client *c)
+{
+    size_t left = payload_len - c->sent;
+    StreamPassInterface_Sender_Send(BConnection_SendAsync_GetIf(&c->con), (uint8_t *)payload + c->sent, (left > INT_MAX ? INT_MAX : left));
+}
+
+static void client_recv (struct lg_client *c)
+{
+    size_t left = payload_len - c->received;
+    StreamRecvInterface_Receiver_Recv(BConnection_RecvAsync_GetIf(&c->con), (uint8_t *)c->recv_buf + c->received, (left > INT_MAX ? INT_MAX : left));
+}
+
+static void connection_handler (struct lg_client *c, int event)
+{
+    ASSERT(c->state == LG_STATE_CONNECTED)
+    
+    client_fail(c, (event == BCONNECTION_EVENT_RECVCLOSED ? "connection closed by server" : "connection error"));
+}
+
+static void send_handler_done (struct lg_client *c, int data_len)
+{
+    ASSERT(c->state == LG_STATE_CONNECTED)
+    
+    c->sent += data_len;
+    
+    if (c->sent < payload_len) {
+        client_send(c);
+    }
+}
+
+static void recv_handler_done (struct lg_client *c, int data_len)
+{
+    ASSERT(c->state == LG_STATE_CONNECTED)
+    
+    c->received += data_len;
+    
+    if (c->received < payload_len) {
+        client_recv(c);
+        return;
+    }
+    
+    if (memcmp(c->recv_buf, payload, payload_len)) {
+        client_fail(c, "echoed data does not match");
+        return;
+    }
+    
+    client_free(c);
+    num_finished++;
+    
+    if (num_finished == num_connections) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    if (num_started < num_connections) {
+        client_start(c);
+    }
+}
+
+static void connector_handler (struct lg_client *c, int is_error)
+{
+    ASSERT(c->state == LG_STATE_CONNECTING)
+    
+    if (is_error) {
+        client_fail(c, "connection failed");
+        return;
+    }
+    
+    if (!BConnection_Init(&c->con, BConnection_source_connector(&c->connector), &reactor, c, (BConnection_handler)connection_handler)) {
+        client_fail(c, "BConnection_Init failed");
+        return;
+    }
+    
+    BConnector_Free(&c->connector);
+    
+    BConnection_SendAsync_Init(&c->con);
+    BConnection_RecvAsync_Init(&c->con);
+    StreamPassInterface_Sender_Init(BConnection_SendAsync_GetIf(&c->con), (StreamPassInterface_handler_done)send_handler_done, c);
+    StreamRecvInterface_Receiver_Init(BConnection_RecvAsync_GetIf(&c->con), (StreamRecvInterface_handler_done)recv_handler_done, c);
+    
+    c->state = LG_STATE_CONNECTED;
+    c->sent = 0;
+    c->received = 0;
+    
+    client_send(c);
+    client_recv(c);
+}
+
+static void client_start (struct lg_client *c)
+{
+    ASSERT(c->state == LG_STATE_IDLE)
+    ASSERT(num_started < num_connections)
+    
+    if (!BConnector_Init(&c->connector, server_addr, &reactor, c, (BConnector_handler)connector_handler)) {
+        client_fail(c, "BConnector_Init failed");
+        return;
+    }
+    
+    c->state = LG_STATE_CONNECTING;
+    num_started++;
+}
+
+static int make_payload (void)
+{
+    ExpString str;
+    if (!ExpString_Init(&str)) {
+        return 0;
+    }
+    
+    for (int i = 0; i < lines_per_connection; i++) {
+        char line[64];
+        sprintf(line, "line %d of the load generator\n", i);
+        if (!ExpString_Append(&str, line)) {
+            ExpString_Free(&str);
+            return 0;
+        }
+    }
+    
+    payload = ExpString_Get(&str);
+    payload_len = ExpString_Length(&str);
+    return 1;
+}
+
+static void usage (const char *name)
+{
+    fprintf(stderr, "Usage: %s <server_addr> <concurrency> <num_connections> <lines_per_connection>\n", name);
+    exit(1);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 5) {
+        usage(argv[0]);
+    }
+    
+    concurrency = atoi(argv[2]);
+    num_connections = atoi(argv[3]);
+    lines_per_connection = atoi(argv[4]);
+    
+    if (concurrency <= 0 || num_connections <= 0 || lines_per_connection <= 0) {
+        usage(argv[0]);
+    }
+    
+    if (concurrency > num_connections) {
+        concurrency = num_connections;
+    }
+    
+    int ret = 1;
+    
+    BLog_InitStdout();
+    for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
+        BLog_SetChannelLoglevel(i, BLOG_WARNING);
+    }
+    BTime_Init();
+    
+    if (!BNetwork_GlobalInit()) {
+        fprintf(stderr, "BNetwork_GlobalInit failed\n");
+        goto fail0;
+    }
+    
+    if (!BAddr_Parse(&server_addr, argv[1], NULL, 0)) {
+        fprintf(stderr, "BAddr_Parse failed\n");
+        goto fail0;
+    }
+    
+    if (!make_payload()) {
+        fprintf(stderr, "make_payload failed\n");
+        goto fail0;
+    }
+    
+    if (!BReactor_Init(&reactor)) {
+        fprintf(stderr, "BReactor_Init failed\n");
+        goto fail1;
+    }
+    
+    if (!(clients = (struct lg_client *)calloc(concurrency, sizeof(clients[0])))) {
+        fprintf(stderr, "calloc failed\n");
+        goto fail2;
+    }
+    
+    for (int i = 0; i < concurrency; i++) {
+        struct lg_client *c = &clients[i];
+        c->index = i;
+        c->state = LG_STATE_IDLE;
+        if (!(c->recv_buf = (char *)malloc(payload_len))) {
+            fprintf(stderr, "malloc failed\n");
+            goto fail3;
+        }
+    }
+    
+    btime_t start_time = btime_gettime();
+    
+    for (int i = 0; i < concurrency && !failed; i++) {
+        client_start(&clients[i]);
+    }
+    
+    if (!failed) {
+        BReactor_Exec(&reactor);
+    }
+    
+    if (!failed) {
+        btime_t elapsed = btime_gettime() - start_time;
+        double secs = (elapsed > 0 ? elapsed : 1) / 1000.0;
+        uint64_t lines = (uint64_t)num_finished * lines_per_connection;
+        printf("concurrency=%d connections=%d lines=%d time=%.3fs rate=%.0f conn/s %.0f lines/s\n",
+               concurrency, num_finished, lines_per_connection, secs, num_finished / secs, lines / secs);
+        ret = 0;
+    }
+    
+fail3:
+    for (int i = 0; i < concurrency; i++) {
+        client_free(&clients[i]);
+        free(clients[i].recv_buf);
+    }
+    free(clients);
+fail2:
+    BReactor_Free(&reactor);
+fail1:
+    free(payload);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
@@ -28,6 +28,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <ncd/NCDVal.h>
 #include <ncd/NCDStringIndex.h>
@@ -36,6 +38,7 @@
 #include <misc/debug.h>
 #include <misc/balloc.h>
 #include <misc/offset.h>
+#include <system/BTime.h>
 
 #define FORCE(cmd) if (!(cmd)) { fprintf(stderr, "failed\n"); exit(1); }
 
@@ -107,7 +110,313 @@ static void print_value (NCDValRef val, unsigned int indent)
     }
 }
 
-int main ()
+static NCDValRef make_key (NCDValMem *mem, int i)
+{
+    char buf[32];
+    sprintf(buf, "interface-%d", i);
+    NCDValRef key = NCDVal_NewString(mem, buf);
+    FORCE( !NCDVal_IsInvalid(key) )
+    return key;
+}
+
+static void test_large_map (NCDStringIndex *string_index, int n)
+{
+    NCDValMem mem;
+    NCDValMem_Init(&mem, string_index);
+    
+    NCDValRef map = NCDVal_NewMap(&mem, n);
+    FORCE( !NCDVal_IsInvalid(map) )
+    
+    char buf[32];
+    int res;
+    
+    for (int i = 0; i < n; i++) {
+        NCDValRef key = make_key(&mem, i);
+        NCDValRef val = NCDVal_NewStringBin(&mem, (const uint8_t *)&i, sizeof(i));
+        FORCE( !NCDVal_IsInvalid(val) )
+        
+        // duplicates are rejected
+        if (i > 0) {
+            FORCE( NCDVal_MapInsert(map, make_key(&mem, i / 2), val, &res) && !res )
+        }
+        
+        FORCE( NCDVal_MapInsert(map, key, val, &res) && res )
+        
+        // look up a few keys while inserting, so that lookups interleave
+        // with inserts into an already indexed map
+        if (i % 7 == 0) {
+            sprintf(buf, "interface-%d", i / 3);
+            FORCE( !NCDVal_IsInvalid(NCDVal_MapGetValue(map, buf)) )
+            sprintf(buf, "interface-%d", i + 1);
+            FORCE( NCDVal_IsInvalid(NCDVal_MapGetValue(map, buf)) )
+        }
+    }
+    
+    FORCE( NCDVal_MapCount(map) == n )
+    
+    // insertion order is preserved
+    int pos = 0;
+    for (NCDValMapElem e = NCDVal_MapFirst(map); !NCDVal_MapElemInvalid(e); e = NCDVal_MapNext(map, e)) {
+        NCDValRef val = NCDVal_MapElemVal(map, e);
+        FORCE( NCDVal_StringLength(val) == sizeof(pos) && !memcmp(NCDVal_StringData(val), &pos, sizeof(pos)) )
+        pos++;
+    }
+    FORCE( pos == n )
+    
+    // ordered iteration is sorted
+    NCDValRef prev = NCDVal_NewInvalid();
+    for (NCDValMapElem e = NCDVal_MapOrderedFirst(map); !NCDVal_MapElemInvalid(e); e = NCDVal_MapOrderedNext(map, e)) {
+        NCDValRef key = NCDVal_MapElemKey(map, e);
+        FORCE( NCDVal_IsInvalid(prev) || NCDVal_Compare(prev, key) < 0 )
+        prev = key;
+    }
+    
+    // lookups in a copy of the whole memory object, and with keys from
+    // another memory object
+    NCDValMem mem2;
+    FORCE( NCDValMem_InitCopy(&mem2, &mem) )
+    NCDValRef map2 = NCDVal_Moved(&mem2, map);
+    
+    NCDValMem kmem;
+    NCDValMem_Init(&kmem, string_index);
+    
+    for (int i = 0; i < n; i++) {
+        NCDValRef key = make_key(&kmem, i);
+        NCDValMapElem e = NCDVal_MapFindKey(map2, key);
+        FORCE( !NCDVal_MapElemInvalid(e) )
+        NCDValRef val = NCDVal_MapElemVal(map2, e);
+        FORCE( !memcmp(NCDVal_StringData(val), &i, sizeof(i)) )
+        
+        NCDValRef absent = make_key(&kmem, n + i);
+        FORCE( NCDVal_MapElemInvalid(NCDVal_MapFindKey(map2, absent)) )
+    }
+    
+    NCDValRef copy = NCDVal_NewCopy(&kmem, map);
+    FORCE( !NCDVal_IsInvalid(copy) )
+    FORCE( NCDVal_Compare(copy, map) == 0 )
+    FORCE( !NCDVal_IsInvalid(NCDVal_MapGetValue(copy, "interface-0")) )
+    FORCE( NCDVal_Hash(copy) == NCDVal_Hash(map) )
+    
+    // the same entries inserted in another order make an equal map,
+    // with the same hash
+    NCDValRef reversed = NCDVal_NewMap(&kmem, n);
+    FORCE( !NCDVal_IsInvalid(reversed) )
+    for (int i = n - 1; i >= 0; i--) {
+        NCDValRef val = NCDVal_NewStringBin(&kmem, (const uint8_t *)&i, sizeof(i));
+        FORCE( !NCDVal_IsInvalid(val) )
+        FORCE( NCDVal_MapInsert(reversed, make_key(&kmem, i), val, &res) && res )
+    }
+    FORCE( NCDVal_Compare(reversed, map) == 0 )
+    FORCE( NCDVal_Hash(reversed) == NCDVal_Hash(map) )
+    
+    NCDValMem_Free(&kmem);
+    NCDValMem_Free(&mem2);
+    NCDValMem_Free(&mem);
+}
+
+static void bench_map (NCDStringIndex *string_index, int n, int lookups)
+{
+    NCDValMem mem;
+    NCDValMem_Init(&mem, string_index);
+    
+    char (*keys)[32] = BAllocArray(n, sizeof(keys[0]));
+    FORCE( keys )
+    
+    for (int i = 0; i < n; i++) {
+        sprintf(keys[i], "interface-%d", i);
+    }
+    
+    int64_t start = btime_gettime_ns();
+    
+    NCDValRef map = NCDVal_NewMap(&mem, n);
+    FORCE( !NCDVal_IsInvalid(map) )
+    
+    for (int i = 0; i < n; i++) {
+        NCDValRef key = NCDVal_NewString(&mem, keys[i]);
+        NCDValRef val = NCDVal_NewString(&mem, "up");
+        FORCE( !NCDVal_IsInvalid(key) && !NCDVal_IsInvalid(val) )
+        int res;
+        FORCE( NCDVal_MapInsert(map, key, val, &res) && res )
+    }
+    
+    int64_t build_ns = btime_gettime_ns() - start;
+    
+    // pseudo-random order, to defeat caching of the search path
+    start = btime_gettime_ns();
+    
+    uint32_t x = 1;
+    for (int i = 0; i < lookups; i++) {
+        x = x * 1103515245 + 12345;
+        FORCE( !NCDVal_IsInvalid(NCDVal_MapGetValue(map, keys[(x >> 8) % n])) )
+    }
+    
+    int64_t lookup_ns = btime_gettime_ns() - start;
+    
+    printf("map entries=%d build=%.1fns/entry lookup=%.1fns\n", n, (double)build_ns / n, (double)lookup_ns / lookups);
+    
+    BFree(keys);
+    NCDValMem_Free(&mem);
+}
+
+static NCDValRef make_record_list (NCDValMem *mem, int n)
+{
+    NCDValRef list = NCDVal_NewList(mem, n);
+    FORCE( !NCDVal_IsInvalid(list) )
+    
+    for (int i = 0; i < n; i++) {
+        NCDValRef rec = NCDVal_NewMap(mem, 2);
+        FORCE( !NCDVal_IsInvalid(rec) )
+        
+        NCDValRef name_key = NCDVal_NewString(mem, "name");
+        NCDValRef name_val = make_key(mem, i);
+        NCDValRef state_key = NCDVal_NewString(mem, "state");
+        NCDValRef state_val = NCDVal_NewString(mem, (i % 2) ? "up" : "down");
+        FORCE( !NCDVal_IsInvalid(name_key) && !NCDVal_IsInvalid(name_val) )
+        FORCE( !NCDVal_IsInvalid(state_key) && !NCDVal_IsInvalid(state_val) )
+        
+        int res;
+        FORCE( NCDVal_MapInsert(rec, name_key, name_val, &res) && res )
+        FORCE( NCDVal_MapInsert(rec, state_key, state_val, &res) && res )
+        FORCE( NCDVal_ListAppend(list, rec) )
+    }
+    
+    return list;
+}
+
+static void test_shared (NCDStringIndex *string_index, int n)
+{
+    // build a list in a memory object and share it
+    NCDValMem mem;
+    NCDValMem_Init(&mem, string_index);
+    NCDValRef list = make_record_list(&mem, n);
+    
+    NCDValMem *shared = NCDValMem_Share(&mem);
+    FORCE( shared )
+    ASSERT( NCDValMem_IsShared(shared) )
+    list = NCDVal_Moved(shared, list);
+    
+    // the same list, unshared, for comparison
+    NCDValMem plain_mem;
+    NCDValMem_Init(&plain_mem, string_index);
+    NCDValRef plain = make_record_list(&plain_mem, n);
+    ASSERT( !NCDValMem_IsShared(&plain_mem) )
+    
+    // copy the shared list, and a copy of the copy
+    NCDValMem mem1;
+    NCDValMem_Init(&mem1, string_index);
+    NCDValRef copy1 = NCDVal_NewCopy(&mem1, list);
+    FORCE( !NCDVal_IsInvalid(copy1) )
+    
+    NCDValMem mem2;
+    NCDValMem_Init(&mem2, string_index);
+    NCDValRef copy2 = NCDVal_NewCopy(&mem2, copy1);
+    FORCE( !NCDVal_IsInvalid(copy2) )
+    
+    ASSERT( NCDVal_IsList(copy1) )
+    ASSERT( NCDVal_ListCount(copy1) == n )
+    ASSERT( NCDVal_ListMaxCount(copy1) == n )
+    ASSERT( NCDVal_Compare(copy1, list) == 0 )
+    ASSERT( NCDVal_Compare(copy2, copy1) == 0 )
+    ASSERT( NCDVal_Compare(copy2, plain) == 0 )
+    ASSERT( NCDVal_Compare(plain, copy1) == 0 )
+    ASSERT( NCDVal_Hash(copy2) == NCDVal_Hash(plain) )
+    
+    // elements are accessible through the copies
+    for (int i = 0; i < n; i++) {
+        NCDValRef rec = NCDVal_ListGet(copy2, i);
+        ASSERT( NCDVal_IsMap(rec) )
+        ASSERT( NCDVal_MapCount(rec) == 2 )
+        NCDValRef name = NCDVal_MapGetValue(rec, "name");
+        ASSERT( !NCDVal_IsInvalid(name) )
+        ASSERT( NCDVal_Compare(name, NCDVal_MapGetValue(NCDVal_ListGet(plain, i), "name")) == 0 )
+        ASSERT( NCDVal_StringEquals(NCDVal_MapGetValue(rec, "state"), (i % 2) ? "up" : "down") )
+    }
+    
+    // copy an element out of the copy; maps are shared too
+    if (n > 0) {
+        NCDValRef rec_copy = NCDVal_NewCopy(&mem2, NCDVal_ListGet(copy1, n - 1));
+        FORCE( !NCDVal_IsInvalid(rec_copy) )
+        ASSERT( NCDVal_Compare(rec_copy, NCDVal_ListGet(plain, n - 1)) == 0 )
+        
+        NCDValMapElem e = NCDVal_MapOrderedFirst(rec_copy);
+        ASSERT( !NCDVal_MapElemInvalid(e) )
+        ASSERT( NCDVal_StringEquals(NCDVal_MapElemKey(rec_copy, e), "name") )
+        e = NCDVal_MapOrderedNext(rec_copy, e);
+        ASSERT( NCDVal_StringEquals(NCDVal_MapElemKey(rec_copy, e), "state") )
+        ASSERT( NCDVal_MapElemInvalid(NCDVal_MapOrderedNext(rec_copy, e)) )
+    }
+    
+    // shared values nested in a new list, and used as a map key
+    NCDValRef outer = NCDVal_NewList(&mem2, 2);
+    FORCE( !NCDVal_IsInvalid(outer) )
+    FORCE( NCDVal_ListAppend(outer, copy2) )
+    NCDValRef dict = NCDVal_NewMap(&mem2, 1);
+    FORCE( !NCDVal_IsInvalid(dict) )
+    NCDValRef dict_val = NCDVal_NewString(&mem2, "value");
+    FORCE( !NCDVal_IsInvalid(dict_val) )
+    int res;
+    FORCE( NCDVal_MapInsert(dict, NCDVal_NewCopy(&mem2, copy1), dict_val, &res) && res )
+    FORCE( NCDVal_ListAppend(outer, dict) )
+    ASSERT( !NCDVal_MapElemInvalid(NCDVal_MapFindKey(dict, plain)) )
+    
+    // a deep copy of a list containing shared values
+    NCDValRef outer_copy = NCDVal_NewCopy(&plain_mem, outer);
+    FORCE( !NCDVal_IsInvalid(outer_copy) )
+    ASSERT( NCDVal_Compare(outer_copy, outer) == 0 )
+    
+    // copies of memory objects take their own references
+    NCDValMem mem3;
+    FORCE( NCDValMem_InitCopy(&mem3, &mem2) )
+    NCDValRef outer3 = NCDVal_Moved(&mem3, outer);
+    
+    // the shared list lives as long as any copy refers to it
+    NCDValMem_ReleaseShared(shared);
+    NCDValMem_Free(&mem1);
+    NCDValMem_Free(&mem2);
+    ASSERT( NCDVal_Compare(outer3, outer_copy) == 0 )
+    ASSERT( NCDVal_Compare(NCDVal_ListGet(outer3, 0), plain) == 0 )
+    NCDValMem_Free(&mem3);
+    ASSERT( NCDVal_Compare(outer_copy, outer_copy) == 0 )
+    
+    NCDValMem_Free(&plain_mem);
+}
+
+static void bench_copy (NCDStringIndex *string_index, int n, int copies)
+{
+    for (int share = 0; share <= 1; share++) {
+        NCDValMem mem;
+        NCDValMem_Init(&mem, string_index);
+        NCDValRef list = make_record_list(&mem, n);
+        
+        NCDValMem *src_mem = &mem;
+        if (share) {
+            src_mem = NCDValMem_Share(&mem);
+            FORCE( src_mem )
+            list = NCDVal_Moved(src_mem, list);
+        }
+        
+        int64_t start = btime_gettime_ns();
+        
+        for (int i = 0; i < copies; i++) {
+            NCDValMem copy_mem;
+            NCDValMem_Init(&copy_mem, string_index);
+            FORCE( !NCDVal_IsInvalid(NCDVal_NewCopy(&copy_mem, list)) )
+            NCDValMem_Free(&copy_mem);
+        }
+        
+        int64_t copy_ns = btime_gettime_ns() - start;
+        
+        printf("copy list entries=%d %s=%.1fns\n", n, share ? "shared" : "deep", (double)copy_ns / copies);
+        
+        if (share) {
+            NCDValMem_ReleaseShared(src_mem);
+        } else {
+            NCDValMem_Free(&mem);
+        }
+    }
+}
+
+int main (int argc, char **argv)
 {
     int res;
     
@@ -218,6 +527,30 @@ int main ()
     
     NCDValMem_Free(&mem);
     
+    // Large maps, with lookups interleaved with inserts.
+    
+    for (int n = 1; n <= 4096; n *= 4) {
+        test_large_map(&string_index, n);
+    }
+    
+    // Shared memory objects, referenced instead of copied.
+    
+    for (int n = 0; n <= 1024; n = (n ? n * 4 : 1)) {
+        test_shared(&string_index, n);
+    }
+    
+    // Map benchmark: ncdval_test map_bench <entries> <lookups>
+    
+    if (argc == 4 && !strcmp(argv[1], "map_bench")) {
+        bench_map(&string_index, atoi(argv[2]), atoi(argv[3]));
+    }
+    
+    // Copy benchmark: ncdval_test copy_bench <entries> <copies>
+    
+    if (argc == 4 && !strcmp(argv[1], "copy_bench")) {
+        bench_copy(&string_index, atoi(argv[2]), atoi(argv[3]));
+    }
+    
     NCDStringIndex_Free(&string_index);
     
     return 0;
@@ -0,0 +1,203 @@
+/**
+ * @file otpchecker_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * {@link OTPChecker_CheckOTP} benchmark. Generates OTPs for a few seeds, then
+ * checks every OTP of the newest seed once, followed by random OTPs which
+ * will (almost certainly) be rejected.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <security/BRandom.h>
+#include <security/OTPCalculator.h>
+#include <security/OTPChecker.h>
+#include <threadwork/BThreadWork.h>
+
+#define NUM_SEEDS 3
+#define NUM_TABLES 2
+#define INVALID_FACTOR 8
+
+static BReactor reactor;
+static int generated;
+
+static void checker_handler (void *user)
+{
+    generated = 1;
+}
+
+static uint64_t nsecs_now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench (BThreadWorkDispatcher *twd, int num_otps)
+{
+    int cipher = BENCRYPTION_CIPHER_AES;
+    int ret = 1;
+    
+    OTPChecker checker;
+    if (!OTPChecker_Init(&checker, num_otps, cipher, NUM_TABLES, twd)) {
+        DEBUG("OTPChecker_Init failed");
+        goto fail0;
+    }
+    OTPChecker_SetHandlers(&checker, checker_handler, NULL);
+    
+    OTPCalculator calc;
+    if (!OTPCalculator_Init(&calc, num_otps, cipher)) {
+        DEBUG("OTPCalculator_Init failed");
+        goto fail1;
+    }
+    
+    uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
+    uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
+    
+    // add seeds, waiting for each to be generated
+    for (uint16_t seed_id = 0; seed_id < NUM_SEEDS; seed_id++) {
+        BRandom_randomize(key, sizeof(key));
+        BRandom_randomize(iv, sizeof(iv));
+        generated = 0;
+        OTPChecker_AddSeed(&checker, seed_id, key, iv);
+        
+        // without threads, generation is a job in the reactor's pending group
+        while (!generated) {
+            BPendingGroup_ExecuteJob(BReactor_PendingGroup(&reactor));
+        }
+    }
+    uint16_t seed_id = NUM_SEEDS - 1;
+    
+    // calculate the OTPs of the newest seed, like a sender would
+    otp_t *otps = OTPCalculator_Generate(&calc, key, iv, 1);
+    
+    // check valid OTPs
+    uint64_t start = nsecs_now();
+    int num_valid = 0;
+    for (int i = 0; i < num_otps; i++) {
+        num_valid += OTPChecker_CheckOTP(&checker, seed_id, otps[i]);
+    }
+    uint64_t valid_time = nsecs_now() - start;
+    
+    if (num_valid != num_otps) {
+        printf("only %d of %d valid OTPs accepted\n", num_valid, num_otps);
+        goto fail2;
+    }
+    
+    // check random OTPs
+    int num_invalid = INVALID_FACTOR * num_otps;
+    otp_t *random_otps = (otp_t *)malloc(num_invalid * sizeof(random_otps[0]));
+    if (!random_otps) {
+        DEBUG("malloc failed");
+        goto fail2;
+    }
+    BRandom_randomize((uint8_t *)random_otps, num_invalid * sizeof(random_otps[0]));
+    
+    start = nsecs_now();
+    int num_accepted = 0;
+    for (int i = 0; i < num_invalid; i++) {
+        num_accepted += OTPChecker_CheckOTP(&checker, seed_id, random_otps[i]);
+    }
+    uint64_t invalid_time = nsecs_now() - start;
+    
+    free(random_otps);
+    
+    printf("otp_num=%d valid=%.1fns/check invalid=%.1fns/check (%d accepted)\n", num_otps,
+           (double)valid_time / num_otps, (double)invalid_time / num_invalid, num_accepted);
+    
+    ret = 0;
+    
+fail2:
+    OTPCalculator_Free(&calc);
+fail1:
+    OTPChecker_Free(&checker);
+fail0:
+    return ret;
+}
+
+int main (int argc, char *argv[])
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc > 1 && atoi(argv[1]) <= 0) {
+        printf("Usage: %s [otp_num ...]\n", argv[0]);
+        return 1;
+    }
+    
+    int ret = 1;
+    
+    BLog_InitStdout();
+    
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail0;
+    }
+    
+    BThreadWorkDispatcher twd;
+    if (!BThreadWorkDispatcher_Init(&twd, &reactor, 0)) {
+        DEBUG("BThreadWorkDispatcher_Init failed");
+        goto fail1;
+    }
+    
+    ret = 0;
+    
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            int num_otps = atoi(argv[i]);
+            if (num_otps <= 0 || bench(&twd, num_otps)) {
+                ret = 1;
+                break;
+            }
+        }
+    } else {
+        for (int num_otps = 1024; num_otps <= 65536; num_otps *= 4) {
+            if (bench(&twd, num_otps)) {
+                ret = 1;
+                break;
+            }
+        }
+    }
+    
+    BThreadWorkDispatcher_Free(&twd);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
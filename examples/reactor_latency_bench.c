@@ -0,0 +1,299 @@
+/**
+ * @file reactor_latency_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * UDP ping-pong latency benchmark between two BDatagram endpoints in separate
+ * processes, comparing blocking waits with adaptive spinning of the reactor
+ * (see {@link BReactor_SetSpinTime}) and optionally SO_BUSY_POLL.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BNetwork.h>
+#include <system/BDatagram.h>
+
+#define PING_PORT 40101
+#define ECHO_PORT 40102
+#define PACKET_SIZE 64
+#define MTU 1500
+
+static BReactor reactor;
+static BDatagram dgram;
+static PacketRecvInterface *recv_if;
+static PacketPassInterface *send_if;
+static uint8_t recv_buf[MTU];
+static uint8_t send_buf[MTU];
+static int is_echo;
+
+static int64_t num_pings;
+static int64_t num_done;
+static int64_t *rtts;
+static int64_t ping_time;
+
+static int64_t get_ns (void)
+{
+    struct timespec ts;
+    ASSERT_FORCE(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return ((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void send_ping (void)
+{
+    ping_time = get_ns();
+    PacketPassInterface_Sender_Send(send_if, send_buf, PACKET_SIZE);
+}
+
+static void dgram_handler (void *unused, int event)
+{
+    DEBUG("datagram error");
+    BReactor_Quit(&reactor, 1);
+}
+
+static void send_handler_done (void *unused)
+{
+    // wait for the reply (or the next ping)
+    PacketRecvInterface_Receiver_Recv(recv_if, recv_buf);
+}
+
+static void recv_handler_done (void *unused, int data_len)
+{
+    if (is_echo) {
+        memcpy(send_buf, recv_buf, data_len);
+        PacketPassInterface_Sender_Send(send_if, send_buf, data_len);
+        return;
+    }
+    
+    rtts[num_done++] = get_ns() - ping_time;
+    
+    if (num_done == num_pings) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    send_ping();
+}
+
+static int init_endpoint (uint16_t local_port, uint16_t remote_port, int busy_poll_us)
+{
+    if (!BDatagram_Init(&dgram, BADDR_TYPE_IPV4, &reactor, NULL, dgram_handler)) {
+        DEBUG("BDatagram_Init failed");
+        return 0;
+    }
+    
+    BAddr local_addr;
+    BAddr_InitIPv4(&local_addr, htonl(INADDR_LOOPBACK), htons(local_port));
+    if (!BDatagram_Bind(&dgram, local_addr)) {
+        DEBUG("BDatagram_Bind failed");
+        BDatagram_Free(&dgram);
+        return 0;
+    }
+    
+    if (busy_poll_us > 0 && !BDatagram_SetBusyPoll(&dgram, busy_poll_us)) {
+        DEBUG("BDatagram_SetBusyPoll failed, continuing without");
+    }
+    
+    BAddr remote_addr;
+    BAddr_InitIPv4(&remote_addr, htonl(INADDR_LOOPBACK), htons(remote_port));
+    BIPAddr local_ip;
+    BIPAddr_InitInvalid(&local_ip);
+    BDatagram_SetSendAddrs(&dgram, remote_addr, local_ip);
+    
+    BDatagram_SendAsync_Init(&dgram, MTU);
+    send_if = BDatagram_SendAsync_GetIf(&dgram);
+    PacketPassInterface_Sender_Init(send_if, send_handler_done, NULL);
+    
+    BDatagram_RecvAsync_Init(&dgram, MTU);
+    recv_if = BDatagram_RecvAsync_GetIf(&dgram);
+    PacketRecvInterface_Receiver_Init(recv_if, recv_handler_done, NULL);
+    
+    return 1;
+}
+
+static void free_endpoint (void)
+{
+    BDatagram_RecvAsync_Free(&dgram);
+    BDatagram_SendAsync_Free(&dgram);
+    BDatagram_Free(&dgram);
+}
+
+static void run_echo (int spin_us, int busy_poll_us, int ready_fd)
+{
+    is_echo = 1;
+    
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    BReactor_SetSpinTime(&reactor, spin_us);
+    
+    if (!init_endpoint(ECHO_PORT, PING_PORT, busy_poll_us)) {
+        exit(1);
+    }
+    
+    PacketRecvInterface_Receiver_Recv(recv_if, recv_buf);
+    
+    // tell the parent we are listening
+    char c = 0;
+    ASSERT_FORCE(write(ready_fd, &c, 1) == 1)
+    close(ready_fd);
+    
+    // run until killed
+    BReactor_Exec(&reactor);
+    exit(1);
+}
+
+static int compare_int64 (const void *v1, const void *v2)
+{
+    int64_t a = *(const int64_t *)v1;
+    int64_t b = *(const int64_t *)v2;
+    return (a > b) - (a < b);
+}
+
+static int run_ping (const char *name, int spin_us, int busy_poll_us)
+{
+    int fds[2];
+    if (pipe(fds) < 0) {
+        DEBUG("pipe failed");
+        return 0;
+    }
+    
+    pid_t pid = fork();
+    if (pid < 0) {
+        DEBUG("fork failed");
+        return 0;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        run_echo(spin_us, busy_poll_us, fds[1]);
+    }
+    close(fds[1]);
+    
+    char c;
+    int ok = (read(fds[0], &c, 1) == 1);
+    close(fds[0]);
+    if (!ok) {
+        DEBUG("echo process failed to start");
+        waitpid(pid, NULL, 0);
+        return 0;
+    }
+    
+    is_echo = 0;
+    num_done = 0;
+    memset(send_buf, 'p', PACKET_SIZE);
+    
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    BReactor_SetSpinTime(&reactor, spin_us);
+    
+    int res = init_endpoint(PING_PORT, ECHO_PORT, busy_poll_us);
+    if (res) {
+        send_ping();
+        res = !BReactor_Exec(&reactor);
+        free_endpoint();
+    }
+    
+    BReactor_Free(&reactor);
+    
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    
+    if (!res) {
+        return 0;
+    }
+    
+    qsort(rtts, num_pings, sizeof(rtts[0]), compare_int64);
+    
+    int64_t sum = 0;
+    for (int64_t i = 0; i < num_pings; i++) {
+        sum += rtts[i];
+    }
+    
+    printf("%-6s spin=%-5dus busy_poll=%-5dus pings=%-8"PRIi64" rtt_us: mean=%-8.2f p50=%-8.2f p99=%-8.2f max=%.2f\n",
+           name, spin_us, busy_poll_us, num_pings, sum / 1000.0 / num_pings,
+           rtts[num_pings / 2] / 1000.0, rtts[num_pings * 99 / 100] / 1000.0, rtts[num_pings - 1] / 1000.0);
+    
+    return 1;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc > 4 || (argc > 1 && !strcmp(argv[1], "--help"))) {
+        fprintf(stderr, "Usage: %s [num_pings] [spin_us] [busy_poll_us]\n", (argc > 0 ? argv[0] : ""));
+        return 1;
+    }
+    
+    num_pings = (argc > 1 ? atoll(argv[1]) : 100000);
+    int spin_us = (argc > 2 ? atoi(argv[2]) : 50);
+    int busy_poll_us = (argc > 3 ? atoi(argv[3]) : 0);
+    
+    if (num_pings <= 0 || spin_us <= 0 || busy_poll_us < 0) {
+        fprintf(stderr, "wrong arguments\n");
+        return 1;
+    }
+    
+    BLog_InitStdout();
+    BTime_Init();
+    
+    if (!BNetwork_GlobalInit()) {
+        DEBUG("BNetwork_GlobalInit failed");
+        goto fail0;
+    }
+    
+    if (!(rtts = malloc(num_pings * sizeof(rtts[0])))) {
+        DEBUG("malloc failed");
+        goto fail0;
+    }
+    
+    // flush before forking so buffered output is not duplicated
+    fflush(stdout);
+    
+    if (!run_ping("block", 0, 0) || !run_ping("spin", spin_us, busy_poll_us)) {
+        goto fail1;
+    }
+    
+    free(rtts);
+    BLog_Free();
+    return 0;
+    
+fail1:
+    free(rtts);
+fail0:
+    BLog_Free();
+    return 1;
+}
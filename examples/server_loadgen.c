@@ -0,0 +1,359 @@
+/**
+ * @file server_loadgen.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Load generator for badvpn-server. Connects a number of clients (without SSL),
+ * each of which sends peer messages round-robin to all other clients at a given
+ * rate, and reports how many messages got through in a given time. Used to
+ * compare the server with and without --shards.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <protocol/scproto.h>
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <system/BNetwork.h>
+#include <flow/PacketProtoEncoder.h>
+#include <flow/SinglePacketBuffer.h>
+#include <server_connection/ServerConnection.h>
+
+#define TICK_INTERVAL 10
+#define SERVER_BUFFER_PACKETS 64
+
+struct lg_client {
+    int index;
+    ServerConnection server;
+    int alive;
+    int ready;
+    peerid_t id;
+    PacketRecvInterface source;
+    PacketProtoEncoder encoder;
+    SinglePacketBuffer buffer;
+    uint8_t *blocked_data;
+    peerid_t *peers;
+    int num_peers;
+    int next_peer;
+    uint64_t sent;
+};
+
+static BReactor reactor;
+static BTimer tick_timer;
+static BAddr server_addr;
+static struct lg_client *clients;
+static int num_clients;
+static int rate;
+static int payload_size;
+static int seconds;
+static int running;
+static btime_t start_time;
+static uint64_t num_received;
+static uint64_t start_received;
+static int failed;
+
+static uint64_t total_sent (void)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < num_clients; i++) {
+        sum += clients[i].sent;
+    }
+    return sum;
+}
+
+static void client_free_io (struct lg_client *c)
+{
+    if (c->ready) {
+        ServerConnection_ReleaseBuffers(&c->server);
+        SinglePacketBuffer_Free(&c->buffer);
+        PacketProtoEncoder_Free(&c->encoder);
+        PacketRecvInterface_Free(&c->source);
+        c->ready = 0;
+    }
+}
+
+static void client_free (struct lg_client *c)
+{
+    if (c->alive) {
+        client_free_io(c);
+        ServerConnection_Free(&c->server);
+        c->alive = 0;
+    }
+}
+
+static int client_can_send (struct lg_client *c)
+{
+    if (!running || c->num_peers == 0) {
+        return 0;
+    }
+    
+    // keep to the rate since the start of the measurement
+    btime_t elapsed = btime_gettime() - start_time;
+    return (c->sent < (uint64_t)rate * elapsed / 1000 + 1);
+}
+
+static void client_send (struct lg_client *c, uint8_t *data)
+{
+    peerid_t peer_id = c->peers[c->next_peer];
+    c->next_peer = (c->next_peer + 1) % c->num_peers;
+    
+    struct sc_header header;
+    header.type = htol8(SCID_OUTMSG);
+    memcpy(data, &header, sizeof(header));
+    
+    struct sc_client_outmsg omsg;
+    omsg.clientid = htol16(peer_id);
+    memcpy(data + sizeof(header), &omsg, sizeof(omsg));
+    
+    memset(data + sizeof(header) + sizeof(omsg), 0, payload_size);
+    
+    c->sent++;
+    
+    PacketRecvInterface_Done(&c->source, sizeof(header) + sizeof(omsg) + payload_size);
+}
+
+static void source_handler_recv (struct lg_client *c, uint8_t *data)
+{
+    ASSERT(c->ready)
+    ASSERT(!c->blocked_data)
+    
+    if (!client_can_send(c)) {
+        c->blocked_data = data;
+        return;
+    }
+    
+    client_send(c, data);
+}
+
+static void start_measurement (void)
+{
+    printf("all %d clients connected, measuring for %d seconds\n", num_clients, seconds);
+    
+    running = 1;
+    start_time = btime_gettime();
+    start_received = num_received;
+}
+
+static void tick_handler (void *unused)
+{
+    BReactor_SetTimer(&reactor, &tick_timer);
+    
+    if (!running) {
+        // wait for all clients to know about each other
+        for (int i = 0; i < num_clients; i++) {
+            if (!clients[i].ready || clients[i].num_peers < num_clients - 1) {
+                return;
+            }
+        }
+        start_measurement();
+        return;
+    }
+    
+    if (btime_gettime() - start_time >= (btime_t)seconds * 1000) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    // resume clients waiting for their turn
+    for (int i = 0; i < num_clients; i++) {
+        struct lg_client *c = &clients[i];
+        if (c->ready && c->blocked_data && client_can_send(c)) {
+            uint8_t *data = c->blocked_data;
+            c->blocked_data = NULL;
+            client_send(c, data);
+        }
+    }
+}
+
+static void server_handler_error (struct lg_client *c)
+{
+    fprintf(stderr, "client %d: server connection failed\n", c->index);
+    
+    client_free(c);
+    
+    failed = 1;
+    BReactor_Quit(&reactor, 1);
+}
+
+static void server_handler_ready (struct lg_client *c, peerid_t my_id, uint32_t ext_ip)
+{
+    ASSERT(!c->ready)
+    
+    c->id = my_id;
+    
+    PacketRecvInterface_Init(&c->source, SC_MAX_ENC, (PacketRecvInterface_handler_recv)source_handler_recv, c, BReactor_PendingGroup(&reactor));
+    PacketProtoEncoder_Init(&c->encoder, &c->source, BReactor_PendingGroup(&reactor));
+    if (!SinglePacketBuffer_Init(&c->buffer, PacketProtoEncoder_GetOutput(&c->encoder), ServerConnection_GetSendInterface(&c->server), BReactor_PendingGroup(&reactor))) {
+        fprintf(stderr, "SinglePacketBuffer_Init failed\n");
+        PacketProtoEncoder_Free(&c->encoder);
+        PacketRecvInterface_Free(&c->source);
+        failed = 1;
+        BReactor_Quit(&reactor, 1);
+        return;
+    }
+    
+    c->blocked_data = NULL;
+    c->ready = 1;
+}
+
+static void server_handler_newclient (struct lg_client *c, peerid_t peer_id, int flags, const uint8_t *cert, int cert_len)
+{
+    ASSERT(c->num_peers < num_clients)
+    
+    c->peers[c->num_peers++] = peer_id;
+}
+
+static void server_handler_endclient (struct lg_client *c, peerid_t peer_id)
+{
+    for (int i = 0; i < c->num_peers; i++) {
+        if (c->peers[i] == peer_id) {
+            c->peers[i] = c->peers[--c->num_peers];
+            break;
+        }
+    }
+    
+    if (c->next_peer >= c->num_peers) {
+        c->next_peer = 0;
+    }
+}
+
+static void server_handler_message (struct lg_client *c, peerid_t peer_id, uint8_t *data, int data_len)
+{
+    num_received++;
+}
+
+static void usage (const char *name)
+{
+    fprintf(stderr, "Usage: %s <server_addr> <num_clients> <msgs_per_sec_per_client> <payload_size> <seconds>\n", name);
+    exit(1);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 6) {
+        usage(argv[0]);
+    }
+    
+    num_clients = atoi(argv[2]);
+    rate = atoi(argv[3]);
+    payload_size = atoi(argv[4]);
+    seconds = atoi(argv[5]);
+    
+    if (num_clients < 2 || rate <= 0 || payload_size < 0 || payload_size > SC_MAX_MSGLEN || seconds <= 0) {
+        usage(argv[0]);
+    }
+    
+    int ret = 1;
+    
+    BLog_InitStdout();
+    for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
+        BLog_SetChannelLoglevel(i, BLOG_WARNING);
+    }
+    BTime_Init();
+    
+    if (!BNetwork_GlobalInit()) {
+        fprintf(stderr, "BNetwork_GlobalInit failed\n");
+        goto fail0;
+    }
+    
+    if (!BAddr_Parse(&server_addr, argv[1], NULL, 0)) {
+        fprintf(stderr, "BAddr_Parse failed\n");
+        goto fail0;
+    }
+    
+    if (!BReactor_Init(&reactor)) {
+        fprintf(stderr, "BReactor_Init failed\n");
+        goto fail0;
+    }
+    
+    if (!(clients = (struct lg_client *)calloc(num_clients, sizeof(clients[0])))) {
+        fprintf(stderr, "calloc failed\n");
+        goto fail1;
+    }
+    
+    for (int i = 0; i < num_clients; i++) {
+        struct lg_client *c = &clients[i];
+        c->index = i;
+        if (!(c->peers = (peerid_t *)malloc(num_clients * sizeof(c->peers[0])))) {
+            fprintf(stderr, "malloc failed\n");
+            goto fail2;
+        }
+        
+        if (!ServerConnection_Init(
+            &c->server, &reactor, NULL, server_addr, SC_KEEPALIVE_INTERVAL, SERVER_BUFFER_PACKETS, 0, 0, NULL, NULL, NULL, c,
+            (ServerConnection_handler_error)server_handler_error, (ServerConnection_handler_ready)server_handler_ready,
+            (ServerConnection_handler_newclient)server_handler_newclient, (ServerConnection_handler_endclient)server_handler_endclient,
+            (ServerConnection_handler_message)server_handler_message
+        )) {
+            fprintf(stderr, "ServerConnection_Init failed\n");
+            goto fail2;
+        }
+        c->alive = 1;
+    }
+    
+    BTimer_Init(&tick_timer, TICK_INTERVAL, tick_handler, NULL);
+    BReactor_SetTimer(&reactor, &tick_timer);
+    
+    BReactor_Exec(&reactor);
+    
+    BReactor_RemoveTimer(&reactor, &tick_timer);
+    
+    if (!failed) {
+        double secs = (btime_gettime() - start_time) / 1000.0;
+        uint64_t sent = total_sent();
+        uint64_t received = num_received - start_received;
+        printf("clients=%d rate=%d payload=%d sent=%llu received=%llu (%.1f%%) throughput=%.0f msg/s %.3f MB/s\n",
+               num_clients, rate, payload_size, (unsigned long long)sent, (unsigned long long)received,
+               (sent > 0 ? 100.0 * received / sent : 0.0), received / secs, (double)received * payload_size / secs / 1e6);
+        ret = 0;
+    }
+    
+fail2:
+    for (int i = 0; i < num_clients; i++) {
+        client_free(&clients[i]);
+        free(clients[i].peers);
+    }
+    free(clients);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
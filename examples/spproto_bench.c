@@ -0,0 +1,238 @@
+/**
+ * @file spproto_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * SPProto loopback benchmark. Packets of one link go through an
+ * {@link SPProtoEncoder} and straight into an {@link SPProtoDecoder}, as
+ * between two clients, with a given number of work threads and pipeline depth.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <flow/SinglePacketBuffer.h>
+#include <security/BSecurity.h>
+#include <security/BRandom.h>
+#include <threadwork/BThreadWork.h>
+#include <client/SPProtoEncoder.h>
+#include <client/SPProtoDecoder.h>
+
+#define PAYLOAD_MTU 1400
+
+struct scheme {
+    const char *name;
+    int encryption_mode;
+    int hash_mode;
+    int aead_mode;
+};
+
+static const struct scheme schemes[] = {
+    {"none", SPPROTO_ENCRYPTION_MODE_NONE, SPPROTO_HASH_MODE_NONE, SPPROTO_AEAD_MODE_NONE},
+    {"aes-sha1", BENCRYPTION_CIPHER_AES, BHASH_TYPE_SHA1, SPPROTO_AEAD_MODE_NONE},
+    {"aes128-gcm", SPPROTO_ENCRYPTION_MODE_NONE, SPPROTO_HASH_MODE_NONE, BAEAD_CIPHER_AES128_GCM},
+    {"chacha20-poly1305", SPPROTO_ENCRYPTION_MODE_NONE, SPPROTO_HASH_MODE_NONE, BAEAD_CIPHER_CHACHA20_POLY1305},
+};
+
+static BReactor reactor;
+static BThreadWorkDispatcher twd;
+static PacketRecvInterface source;
+static SPProtoEncoder encoder;
+static SinglePacketBuffer link_buffer;
+static SPProtoDecoder decoder;
+static PacketPassInterface sink;
+static uint8_t payload[PAYLOAD_MTU];
+static int packet_size;
+static uint64_t num_sent;
+static uint64_t num_received;
+static uint64_t num_packets;
+static int bad_packets;
+
+static void source_handler_recv (void *unused, uint8_t *data)
+{
+    if (num_sent == num_packets) {
+        return;
+    }
+    
+    // tag the packet with its sequence number so the sink can check ordering
+    memcpy(data, payload, packet_size);
+    memcpy(data, &num_sent, sizeof(num_sent));
+    num_sent++;
+    
+    PacketRecvInterface_Done(&source, packet_size);
+}
+
+static void sink_handler_send (void *unused, uint8_t *data, int data_len)
+{
+    uint64_t seq;
+    memcpy(&seq, data, sizeof(seq));
+    
+    if (data_len != packet_size || seq != num_received || memcmp(data + sizeof(seq), payload + sizeof(seq), packet_size - sizeof(seq))) {
+        bad_packets = 1;
+    }
+    
+    if (++num_received == num_packets) {
+        BReactor_Quit(&reactor, 0);
+    }
+    
+    PacketPassInterface_Done(&sink);
+}
+
+static void decoder_logfunc (void *unused)
+{
+}
+
+static void usage (const char *name)
+{
+    fprintf(stderr, "Usage: %s <scheme> <threads> <pipeline_depth> <num_packets> [packet_size]\n", name);
+    fprintf(stderr, "    <scheme> is one of (none, aes-sha1, aes128-gcm, chacha20-poly1305).\n");
+    exit(1);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 5 && argc != 6) {
+        usage(argv[0]);
+    }
+    
+    const struct scheme *sch = NULL;
+    for (size_t i = 0; i < sizeof(schemes) / sizeof(schemes[0]); i++) {
+        if (!strcmp(argv[1], schemes[i].name)) {
+            sch = &schemes[i];
+        }
+    }
+    int threads = atoi(argv[2]);
+    int depth = atoi(argv[3]);
+    num_packets = strtoull(argv[4], NULL, 10);
+    packet_size = (argc > 5 ? atoi(argv[5]) : PAYLOAD_MTU);
+    
+    if (!sch || threads < 0 || depth < 1 || num_packets == 0 || packet_size < (int)sizeof(uint64_t) || packet_size > PAYLOAD_MTU) {
+        usage(argv[0]);
+    }
+    
+    int ret = 1;
+    
+    BLog_InitStdout();
+    BTime_Init();
+    
+    if (!BSecurity_GlobalInitThreadSafe()) {
+        fprintf(stderr, "BSecurity_GlobalInitThreadSafe failed\n");
+        goto fail0;
+    }
+    
+    if (!BReactor_Init(&reactor)) {
+        fprintf(stderr, "BReactor_Init failed\n");
+        goto fail1;
+    }
+    
+    if (!BThreadWorkDispatcher_Init(&twd, &reactor, threads)) {
+        fprintf(stderr, "BThreadWorkDispatcher_Init failed\n");
+        goto fail2;
+    }
+    
+    struct spproto_security_params sp_params;
+    memset(&sp_params, 0, sizeof(sp_params));
+    sp_params.encryption_mode = sch->encryption_mode;
+    sp_params.hash_mode = sch->hash_mode;
+    sp_params.aead_mode = sch->aead_mode;
+    sp_params.otp_mode = SPPROTO_OTP_MODE_NONE;
+    
+    BRandom_randomize(payload, sizeof(payload));
+    
+    PacketRecvInterface_Init(&source, PAYLOAD_MTU, source_handler_recv, NULL, BReactor_PendingGroup(&reactor));
+    PacketPassInterface_Init(&sink, PAYLOAD_MTU, sink_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    
+    if (!SPProtoEncoder_Init(&encoder, &source, sp_params, 0, BReactor_PendingGroup(&reactor), &twd, depth)) {
+        fprintf(stderr, "SPProtoEncoder_Init failed\n");
+        goto fail3;
+    }
+    
+    if (!SPProtoDecoder_Init(&decoder, &sink, sp_params, 2, BReactor_PendingGroup(&reactor), &twd, depth, NULL, decoder_logfunc)) {
+        fprintf(stderr, "SPProtoDecoder_Init failed\n");
+        goto fail4;
+    }
+    
+    if (!SinglePacketBuffer_Init(&link_buffer, SPProtoEncoder_GetOutput(&encoder), SPProtoDecoder_GetInput(&decoder), BReactor_PendingGroup(&reactor))) {
+        fprintf(stderr, "SinglePacketBuffer_Init failed\n");
+        goto fail5;
+    }
+    
+    if (SPPROTO_HAVE_KEY(sp_params)) {
+        uint8_t key[SPPROTO_MAX_KEY_SIZE];
+        BRandom_randomize(key, sizeof(key));
+        // the decoder receives from the encoder, so it has the other role
+        SPProtoEncoder_SetEncryptionKey(&encoder, key, SPPROTO_AEAD_ROLE_MASTER);
+        SPProtoDecoder_SetEncryptionKey(&decoder, key, SPPROTO_AEAD_ROLE_SLAVE);
+    }
+    
+    btime_t start = btime_gettime();
+    BReactor_Exec(&reactor);
+    btime_t elapsed = btime_gettime() - start;
+    
+    if (bad_packets) {
+        printf("packets were corrupted or reordered\n");
+        goto fail6;
+    }
+    
+    double secs = (elapsed > 0 ? elapsed : 1) / 1000.0;
+    printf("%s threads=%d depth=%d packet_size=%d packets=%llu time=%.3fs rate=%.0f pkt/s throughput=%.3f Gbit/s\n",
+           sch->name, threads, depth, packet_size, (unsigned long long)num_packets, secs,
+           num_packets / secs, (double)packet_size * num_packets * 8 / secs / 1e9);
+    
+    ret = 0;
+    
+fail6:
+    SinglePacketBuffer_Free(&link_buffer);
+fail5:
+    SPProtoDecoder_Free(&decoder);
+fail4:
+    SPProtoEncoder_Free(&encoder);
+fail3:
+    PacketPassInterface_Free(&sink);
+    PacketRecvInterface_Free(&source);
+    BThreadWorkDispatcher_Free(&twd);
+fail2:
+    BReactor_Free(&reactor);
+fail1:
+    BSecurity_GlobalFreeThreadSafe();
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
@@ -0,0 +1,545 @@
+/**
+ * @file stream_coalesce_bench.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Benchmark for writing packets into a stream, as done in front of
+ * {@link BSSLConnection}, where each write becomes one TLS record.
+ * Packets are produced in bursts, one burst per reactor iteration (as if
+ * decoded from one socket read), and written either with
+ * {@link PacketStreamSender} (one write per packet) or with
+ * {@link PacketStreamCoalescer}. The number of writes and the bytes per
+ * write are reported.
+ * 
+ * With --ssl, the writes go into a {@link BSSLConnection} talking to another
+ * one over a socket pair, using the given NSS database and server certificate
+ * for both ends. The receiving end checks that the stream arrives intact.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/StreamPassInterface.h>
+#include <flow/PacketStreamSender.h>
+#include <flowextra/PacketStreamCoalescer.h>
+
+#ifdef STREAM_COALESCE_BENCH_SSL
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <prinit.h>
+#include <prio.h>
+#include <prerror.h>
+#include <nss/nss.h>
+#include <nss/ssl.h>
+#include <nss/cert.h>
+#include <nss/keyhi.h>
+#include <misc/nsskey.h>
+#include <system/BNetwork.h>
+#include <system/BConnection.h>
+#include <threadwork/BThreadWork.h>
+#include <nspr_support/DummyPRFileDesc.h>
+#include <nspr_support/BSSLConnection.h>
+#endif
+
+#define MAX_PACKET 2048
+#define RECORD_SIZE 16384
+
+static BReactor reactor;
+static BTimer burst_timer;
+static PacketStreamSender sender;
+static PacketStreamCoalescer coalescer;
+static PacketPassInterface *input;
+static StreamPassInterface output;
+static uint8_t packet[MAX_PACKET];
+static int packet_size;
+static int burst;
+static uint64_t num_packets;
+static uint64_t num_sent;
+static int burst_sent;
+static uint64_t bytes_written;
+static uint64_t num_writes;
+static int max_write;
+static btime_t start_time;
+
+#ifdef STREAM_COALESCE_BENCH_SSL
+struct ssl_end {
+    BConnection con;
+    PRFileDesc bottom_prfd;
+    PRFileDesc *ssl_prfd;
+    BSSLConnection sslcon;
+};
+
+static int ssl;
+static BThreadWorkDispatcher twd;
+static CERTCertificate *server_cert;
+static SECKEYPrivateKey *server_key;
+static struct ssl_end ssl_ends[2];
+static int num_ends;
+static int num_up;
+static StreamPassInterface *ssl_send_if;
+static StreamRecvInterface *ssl_recv_if;
+static uint8_t recv_buf[RECORD_SIZE];
+static uint64_t bytes_received;
+static int bad_data;
+#endif
+
+static void send_packet (void)
+{
+    if (num_sent == num_packets) {
+        return;
+    }
+    
+    // continue with the next burst in the next reactor iteration
+    if (burst_sent == burst) {
+        burst_sent = 0;
+        BReactor_SetTimer(&reactor, &burst_timer);
+        return;
+    }
+    
+#ifdef STREAM_COALESCE_BENCH_SSL
+    // give every byte of the stream a value the receiver can check
+    if (ssl) {
+        for (int i = 0; i < packet_size; i++) {
+            packet[i] = (num_sent * packet_size + i) % 251;
+        }
+    }
+#endif
+    
+    num_sent++;
+    burst_sent++;
+    PacketPassInterface_Sender_Send(input, packet, packet_size);
+}
+
+static void start_sending (void)
+{
+    start_time = btime_gettime();
+    send_packet();
+}
+
+static void input_handler_done (void *unused)
+{
+    send_packet();
+}
+
+static void burst_timer_handler (void *unused)
+{
+    send_packet();
+}
+
+static void output_handler_send (void *unused, uint8_t *data, int data_len)
+{
+    num_writes++;
+    bytes_written += data_len;
+    if (data_len > max_write) {
+        max_write = data_len;
+    }
+    
+#ifdef STREAM_COALESCE_BENCH_SSL
+    // with SSL, pass the write on; the benchmark finishes once
+    // everything has been received
+    if (ssl) {
+        StreamPassInterface_Sender_Send(ssl_send_if, data, data_len);
+        return;
+    }
+#endif
+    
+    if (bytes_written == num_packets * packet_size) {
+        BReactor_Quit(&reactor, 0);
+    }
+    
+    StreamPassInterface_Done(&output, data_len);
+}
+
+#ifdef STREAM_COALESCE_BENCH_SSL
+
+static void ssl_send_handler_done (void *unused, int data_len)
+{
+    StreamPassInterface_Done(&output, data_len);
+}
+
+static void ssl_recv_handler_done (void *unused, int data_len)
+{
+    for (int i = 0; i < data_len; i++) {
+        if (recv_buf[i] != (bytes_received + i) % 251) {
+            bad_data = 1;
+        }
+    }
+    bytes_received += data_len;
+    
+    if (bytes_received == num_packets * packet_size) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    StreamRecvInterface_Receiver_Recv(ssl_recv_if, recv_buf, sizeof(recv_buf));
+}
+
+static void connection_handler (void *unused, int event)
+{
+    fprintf(stderr, "connection %s\n", (event == BCONNECTION_EVENT_RECVCLOSED ? "closed" : "error"));
+    BReactor_Quit(&reactor, 1);
+}
+
+static void sslcon_handler (void *unused, int event)
+{
+    if (event == BSSLCONNECTION_EVENT_ERROR) {
+        fprintf(stderr, "SSL error\n");
+        BReactor_Quit(&reactor, 1);
+        return;
+    }
+    
+    // wait for both handshakes
+    if (++num_up < 2) {
+        return;
+    }
+    
+    // the first end sends and the second one receives
+    ssl_send_if = BSSLConnection_GetSendIf(&ssl_ends[0].sslcon);
+    StreamPassInterface_Sender_Init(ssl_send_if, ssl_send_handler_done, NULL);
+    ssl_recv_if = BSSLConnection_GetRecvIf(&ssl_ends[1].sslcon);
+    StreamRecvInterface_Receiver_Init(ssl_recv_if, ssl_recv_handler_done, NULL);
+    StreamRecvInterface_Receiver_Recv(ssl_recv_if, recv_buf, sizeof(recv_buf));
+    
+    start_sending();
+}
+
+static SECStatus auth_certificate_callback (void *arg, PRFileDesc *fd, PRBool checkSig, PRBool isServer)
+{
+    // both ends use the same certificate, there is nobody to verify
+    return SECSuccess;
+}
+
+static int ssl_end_init (struct ssl_end *e, int fd, int server)
+{
+    if (!BConnection_Init(&e->con, BConnection_source_pipe(fd, 1), &reactor, NULL, connection_handler)) {
+        fprintf(stderr, "BConnection_Init failed\n");
+        close(fd);
+        goto fail0;
+    }
+    
+    BConnection_SendAsync_Init(&e->con);
+    BConnection_RecvAsync_Init(&e->con);
+    
+    if (!BSSLConnection_MakeBackend(&e->bottom_prfd, BConnection_SendAsync_GetIf(&e->con), BConnection_RecvAsync_GetIf(&e->con), &twd, 0)) {
+        fprintf(stderr, "BSSLConnection_MakeBackend failed\n");
+        goto fail1;
+    }
+    
+    if (!(e->ssl_prfd = SSL_ImportFD(NULL, &e->bottom_prfd))) {
+        fprintf(stderr, "SSL_ImportFD failed\n");
+        ASSERT_FORCE(PR_Close(&e->bottom_prfd) == PR_SUCCESS)
+        goto fail1;
+    }
+    
+    if (server) {
+        if (SSL_ConfigSecureServer(e->ssl_prfd, server_cert, server_key, NSS_FindCertKEAType(server_cert)) != SECSuccess) {
+            fprintf(stderr, "SSL_ConfigSecureServer failed\n");
+            goto fail2;
+        }
+    } else {
+        if (SSL_AuthCertificateHook(e->ssl_prfd, auth_certificate_callback, NULL) != SECSuccess) {
+            fprintf(stderr, "SSL_AuthCertificateHook failed\n");
+            goto fail2;
+        }
+    }
+    
+    if (SSL_ResetHandshake(e->ssl_prfd, (server ? PR_TRUE : PR_FALSE)) != SECSuccess) {
+        fprintf(stderr, "SSL_ResetHandshake failed\n");
+        goto fail2;
+    }
+    
+    BSSLConnection_Init(&e->sslcon, e->ssl_prfd, 1, BReactor_PendingGroup(&reactor), NULL, sslcon_handler);
+    
+    return 1;
+    
+fail2:
+    ASSERT_FORCE(PR_Close(e->ssl_prfd) == PR_SUCCESS)
+fail1:
+    BConnection_RecvAsync_Free(&e->con);
+    BConnection_SendAsync_Free(&e->con);
+    BConnection_Free(&e->con);
+fail0:
+    return 0;
+}
+
+static void ssl_end_free (struct ssl_end *e)
+{
+    BSSLConnection_Free(&e->sslcon);
+    ASSERT_FORCE(PR_Close(e->ssl_prfd) == PR_SUCCESS)
+    BConnection_RecvAsync_Free(&e->con);
+    BConnection_SendAsync_Free(&e->con);
+    BConnection_Free(&e->con);
+}
+
+static int ssl_init (char *nssdb, char *cert_name)
+{
+    if (!BNetwork_GlobalInit()) {
+        fprintf(stderr, "BNetwork_GlobalInit failed\n");
+        return 0;
+    }
+    
+    PR_Init(PR_USER_THREAD, PR_PRIORITY_NORMAL, 0);
+    
+    if (!DummyPRFileDesc_GlobalInit() || !BSSLConnection_GlobalInit()) {
+        fprintf(stderr, "NSPR layer initialization failed\n");
+        goto fail0;
+    }
+    
+    if (NSS_Init(nssdb) != SECSuccess) {
+        fprintf(stderr, "NSS_Init failed (%d)\n", (int)PR_GetError());
+        goto fail0;
+    }
+    if (NSS_SetDomesticPolicy() != SECSuccess) {
+        fprintf(stderr, "NSS_SetDomesticPolicy failed (%d)\n", (int)PR_GetError());
+        goto fail1;
+    }
+    if (SSL_ConfigServerSessionIDCache(0, 0, 0, NULL) != SECSuccess) {
+        fprintf(stderr, "SSL_ConfigServerSessionIDCache failed (%d)\n", (int)PR_GetError());
+        goto fail1;
+    }
+    
+    if (!open_nss_cert_and_key(cert_name, &server_cert, &server_key)) {
+        fprintf(stderr, "Cannot open certificate and key\n");
+        goto fail2;
+    }
+    
+    if (!BThreadWorkDispatcher_Init(&twd, &reactor, 0)) {
+        fprintf(stderr, "BThreadWorkDispatcher_Init failed\n");
+        goto fail3;
+    }
+    
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        fprintf(stderr, "socketpair failed\n");
+        goto fail4;
+    }
+    
+    // the first end is the client and sends, the second one is the server
+    for (num_ends = 0; num_ends < 2; num_ends++) {
+        if (!ssl_end_init(&ssl_ends[num_ends], fds[num_ends], num_ends == 1)) {
+            if (num_ends == 0) {
+                close(fds[1]);
+            }
+            goto fail5;
+        }
+    }
+    
+    return 1;
+    
+fail5:
+    while (num_ends-- > 0) {
+        ssl_end_free(&ssl_ends[num_ends]);
+    }
+fail4:
+    BThreadWorkDispatcher_Free(&twd);
+fail3:
+    CERT_DestroyCertificate(server_cert);
+    SECKEY_DestroyPrivateKey(server_key);
+fail2:
+    ASSERT_FORCE(SSL_ShutdownServerSessionIDCache() == SECSuccess)
+fail1:
+    ASSERT_FORCE(NSS_Shutdown() == SECSuccess)
+fail0:
+    ASSERT_FORCE(PR_Cleanup() == PR_SUCCESS)
+    PL_ArenaFinish();
+    return 0;
+}
+
+static void ssl_free (void)
+{
+    while (num_ends-- > 0) {
+        ssl_end_free(&ssl_ends[num_ends]);
+    }
+    BThreadWorkDispatcher_Free(&twd);
+    CERT_DestroyCertificate(server_cert);
+    SECKEY_DestroyPrivateKey(server_key);
+    ASSERT_FORCE(SSL_ShutdownServerSessionIDCache() == SECSuccess)
+    ASSERT_FORCE(NSS_Shutdown() == SECSuccess)
+    ASSERT_FORCE(PR_Cleanup() == PR_SUCCESS)
+    PL_ArenaFinish();
+}
+
+#endif
+
+static void usage (const char *name)
+{
+#ifdef STREAM_COALESCE_BENCH_SSL
+    fprintf(stderr, "Usage: %s [--ssl <nssdb> <cert_name>] <mode> <num_packets> <packet_size> <burst> [flush_delay]\n", name);
+#else
+    fprintf(stderr, "Usage: %s <mode> <num_packets> <packet_size> <burst> [flush_delay]\n", name);
+#endif
+    fprintf(stderr, "    <mode> is one of (sender, coalesce).\n");
+    fprintf(stderr, "    [flush_delay] is for coalesce, in milliseconds; -1 (default) flushes when the input drains.\n");
+    exit(1);
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    const char *name = argv[0];
+    
+#ifdef STREAM_COALESCE_BENCH_SSL
+    char *nssdb = NULL;
+    char *cert_name = NULL;
+    if (argc >= 4 && !strcmp(argv[1], "--ssl")) {
+        ssl = 1;
+        nssdb = argv[2];
+        cert_name = argv[3];
+        argc -= 3;
+        argv += 3;
+    }
+#endif
+    
+    if (argc != 5 && argc != 6) {
+        usage(name);
+    }
+    
+    int coalesce;
+    if (!strcmp(argv[1], "sender")) {
+        coalesce = 0;
+    } else if (!strcmp(argv[1], "coalesce")) {
+        coalesce = 1;
+    } else {
+        usage(name);
+    }
+    num_packets = strtoull(argv[2], NULL, 10);
+    packet_size = atoi(argv[3]);
+    burst = atoi(argv[4]);
+    btime_t flush_delay = (argc > 5 ? atoi(argv[5]) : -1);
+    
+    if (num_packets == 0 || packet_size <= 0 || packet_size > MAX_PACKET || burst <= 0) {
+        usage(name);
+    }
+    
+    int ret = 1;
+    
+    BLog_InitStdout();
+    BTime_Init();
+    
+    if (!BReactor_Init(&reactor)) {
+        fprintf(stderr, "BReactor_Init failed\n");
+        goto fail0;
+    }
+    
+#ifdef STREAM_COALESCE_BENCH_SSL
+    if (ssl && !ssl_init(nssdb, cert_name)) {
+        goto fail1;
+    }
+#endif
+    
+    memset(packet, 0x5a, sizeof(packet));
+    
+    BTimer_Init(&burst_timer, 0, burst_timer_handler, NULL);
+    StreamPassInterface_Init(&output, output_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    
+    if (coalesce) {
+        if (!PacketStreamCoalescer_Init(&coalescer, &output, MAX_PACKET, RECORD_SIZE, flush_delay, &reactor)) {
+            fprintf(stderr, "PacketStreamCoalescer_Init failed\n");
+            goto fail2;
+        }
+        input = PacketStreamCoalescer_GetInput(&coalescer);
+    } else {
+        PacketStreamSender_Init(&sender, &output, MAX_PACKET, BReactor_PendingGroup(&reactor));
+        input = PacketStreamSender_GetInput(&sender);
+    }
+    
+    PacketPassInterface_Sender_Init(input, input_handler_done, NULL);
+    
+    // with SSL, sending starts once the handshakes are done
+#ifdef STREAM_COALESCE_BENCH_SSL
+    if (!ssl) {
+        start_sending();
+    }
+#else
+    start_sending();
+#endif
+    int exec_ret = BReactor_Exec(&reactor);
+    btime_t elapsed = btime_gettime() - start_time;
+    
+    if (exec_ret != 0) {
+        goto fail3;
+    }
+    
+    double secs = (elapsed > 0 ? elapsed : 1) / 1000.0;
+    printf("%s packets=%llu packet_size=%d burst=%d time=%.3fs writes=%llu writes/s=%.0f bytes/write=%.1f max_write=%d pkt/s=%.0f\n",
+           argv[1], (unsigned long long)num_packets, packet_size, burst, secs, (unsigned long long)num_writes,
+           num_writes / secs, (double)bytes_written / num_writes, max_write, num_packets / secs);
+    
+#ifdef STREAM_COALESCE_BENCH_SSL
+    if (ssl) {
+        if (bad_data) {
+            printf("ssl: received data does not match what was sent\n");
+            goto fail3;
+        }
+        printf("ssl: received %llu bytes intact\n", (unsigned long long)bytes_received);
+    }
+#endif
+    
+    ret = 0;
+    
+fail3:
+#ifdef STREAM_COALESCE_BENCH_SSL
+    // stop the SSL connections from using our buffers
+    if (ssl) {
+        for (int i = 0; i < num_ends; i++) {
+            BSSLConnection_ReleaseBuffers(&ssl_ends[i].sslcon);
+        }
+    }
+#endif
+    if (coalesce) {
+        PacketStreamCoalescer_Free(&coalescer);
+    } else {
+        PacketStreamSender_Free(&sender);
+    }
+fail2:
+    StreamPassInterface_Free(&output);
+    BReactor_RemoveTimer(&reactor, &burst_timer);
+#ifdef STREAM_COALESCE_BENCH_SSL
+    if (ssl) {
+        ssl_free();
+    }
+fail1:
+#endif
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return ret;
+}
@@ -41,6 +41,7 @@
 #include <misc/loggers_string.h>
 #include <misc/open_standard_streams.h>
 #include <base/BLog.h>
+#include <base/BLog_binary.h>
 #include <system/BReactor.h>
 #include <system/BSignal.h>
 #include <system/BNetwork.h>
@@ -59,6 +60,7 @@
 
 #define LOGGER_STDOUT 1
 #define LOGGER_SYSLOG 2
+#define LOGGER_BINARY 3
 
 // command-line options
 struct {
@@ -69,6 +71,7 @@ struct {
     char *logger_syslog_facility;
     char *logger_syslog_ident;
     #endif
+    char *logger_binary_file;
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     int ssl;
@@ -197,6 +200,12 @@ int main (int argc, char *argv[])
             }
             break;
         #endif
+        case LOGGER_BINARY:
+            if (!BLog_InitBinary(options.logger_binary_file)) {
+                fprintf(stderr, "Failed to initialize binary logger\n");
+                goto fail0;
+            }
+            break;
         default:
             ASSERT(0);
     }
@@ -347,6 +356,9 @@ void print_help (const char *name)
         "            [--syslog-ident <string>]\n"
         "        )\n"
         #endif
+        "        (logger=binary?\n"
+        "            [--binlog-file <file>]\n"
+        "        )\n"
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--ssl --nssdb <string> --client-cert-name <string>]\n"
@@ -376,6 +388,7 @@ int parse_arguments (int argc, char *argv[])
     options.logger_syslog_facility = "daemon";
     options.logger_syslog_ident = argv[0];
     #endif
+    options.logger_binary_file = "badvpn.blog";
     options.loglevel = -1;
     for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
         options.loglevels[i] = -1;
@@ -410,6 +423,9 @@ int parse_arguments (int argc, char *argv[])
                 options.logger = LOGGER_SYSLOG;
             }
             #endif
+            else if (!strcmp(arg2, "binary")) {
+                options.logger = LOGGER_BINARY;
+            }
             else {
                 fprintf(stderr, "%s: wrong argument\n", arg);
                 return 0;
@@ -434,6 +450,14 @@ int parse_arguments (int argc, char *argv[])
             i++;
         }
         #endif
+        else if (!strcmp(arg, "--binlog-file")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.logger_binary_file = argv[i + 1];
+            i++;
+        }
         else if (!strcmp(arg, "--loglevel")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
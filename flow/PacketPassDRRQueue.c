@@ -0,0 +1,371 @@
+/**
+ * @file PacketPassDRRQueue.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include <misc/debug.h>
+#include <misc/offset.h>
+
+#include <flow/PacketPassDRRQueue.h>
+
+static PacketPassDRRQueueFlow * first_queued (PacketPassDRRQueue *m)
+{
+    LinkedList1Node *node = LinkedList1_GetFirst(&m->queued_list);
+    return (node ? UPPER_OBJECT(node, PacketPassDRRQueueFlow, queued.list_node) : NULL);
+}
+
+static void schedule (PacketPassDRRQueue *m)
+{
+    ASSERT(!m->sending_flow)
+    ASSERT(!m->previous_flow)
+    ASSERT(!m->freeing)
+    ASSERT(!LinkedList1_IsEmpty(&m->queued_list))
+    
+    PacketPassDRRQueueFlow *qflow;
+    uint64_t cost;
+    
+    // This loops at most twice: a flow starting its round always
+    // has enough credit, since the quantum covers the largest packet.
+    while (1) {
+        qflow = first_queued(m);
+        ASSERT(qflow->is_queued)
+        
+        cost = (uint64_t)m->packet_weight + qflow->queued.data_len;
+        
+        // start the round of the flow
+        if (qflow != m->round_flow) {
+            m->round_flow = qflow;
+            qflow->deficit += (uint64_t)m->quantum * qflow->weight;
+        }
+        
+        if (cost <= qflow->deficit) {
+            break;
+        }
+        
+        // round is over, move flow to the back, keeping the remaining deficit
+        LinkedList1_Remove(&m->queued_list, &qflow->queued.list_node);
+        LinkedList1_Append(&m->queued_list, &qflow->queued.list_node);
+        m->round_flow = NULL;
+    }
+    
+    // remove flow from queue
+    LinkedList1_Remove(&m->queued_list, &qflow->queued.list_node);
+    qflow->is_queued = 0;
+    
+    // charge flow
+    qflow->deficit -= cost;
+    
+    // schedule send
+    PacketPassInterface_Sender_Send(m->output, qflow->queued.data, qflow->queued.data_len);
+    m->sending_flow = qflow;
+    m->sending_len = qflow->queued.data_len;
+}
+
+static void schedule_job_handler (PacketPassDRRQueue *m)
+{
+    ASSERT(!m->sending_flow)
+    ASSERT(!m->freeing)
+    DebugObject_Access(&m->d_obj);
+    
+    // previous flow didn't send another packet; it becomes inactive
+    // and forfeits the rest of its credit
+    if (m->previous_flow) {
+        ASSERT(m->previous_flow == m->round_flow)
+        m->previous_flow->deficit = 0;
+        m->previous_flow = NULL;
+        m->round_flow = NULL;
+    }
+    
+    if (!LinkedList1_IsEmpty(&m->queued_list)) {
+        schedule(m);
+    }
+}
+
+static void input_handler_send (PacketPassDRRQueueFlow *flow, uint8_t *data, int data_len)
+{
+    PacketPassDRRQueue *m = flow->m;
+    
+    ASSERT(flow != m->sending_flow)
+    ASSERT(!flow->is_queued)
+    ASSERT(!m->freeing)
+    DebugObject_Access(&flow->d_obj);
+    
+    if (flow == m->previous_flow) {
+        // flow continues its round, queue it in front
+        m->previous_flow = NULL;
+        LinkedList1_Prepend(&m->queued_list, &flow->queued.list_node);
+    } else {
+        LinkedList1_Append(&m->queued_list, &flow->queued.list_node);
+    }
+    
+    // queue flow
+    flow->queued.data = data;
+    flow->queued.data_len = data_len;
+    flow->is_queued = 1;
+    
+    if (!m->sending_flow && !BPending_IsSet(&m->schedule_job)) {
+        schedule(m);
+    }
+}
+
+static void output_handler_done (PacketPassDRRQueue *m)
+{
+    ASSERT(m->sending_flow)
+    ASSERT(!m->previous_flow)
+    ASSERT(!BPending_IsSet(&m->schedule_job))
+    ASSERT(!m->freeing)
+    ASSERT(!m->sending_flow->is_queued)
+    
+    PacketPassDRRQueueFlow *flow = m->sending_flow;
+    
+    // sending finished
+    m->sending_flow = NULL;
+    
+    // remember this flow so the schedule job can end its round if it didn't send
+    m->previous_flow = flow;
+    
+    // schedule schedule
+    BPending_Set(&m->schedule_job);
+    
+    // finish flow packet
+    PacketPassInterface_Done(&flow->input);
+    
+    // call busy handler if set
+    if (flow->handler_busy) {
+        // handler is one-shot, unset it before calling
+        PacketPassDRRQueue_handler_busy handler = flow->handler_busy;
+        flow->handler_busy = NULL;
+        
+        // call handler
+        handler(flow->user);
+        return;
+    }
+}
+
+int PacketPassDRRQueue_Init (PacketPassDRRQueue *m, PacketPassInterface *output, BPendingGroup *pg, int use_cancel, int packet_weight, int quantum)
+{
+    ASSERT(packet_weight > 0)
+    ASSERT(quantum > 0)
+    ASSERT(use_cancel == 0 || use_cancel == 1)
+    ASSERT(!use_cancel || PacketPassInterface_HasCancel(output))
+    
+    // init arguments
+    m->output = output;
+    m->pg = pg;
+    m->use_cancel = use_cancel;
+    m->packet_weight = packet_weight;
+    m->quantum = quantum;
+    
+    // make sure that (output MTU + packet_weight <= quantum)
+    if (!(
+        (PacketPassInterface_GetMTU(output) <= quantum) &&
+        (packet_weight <= quantum - PacketPassInterface_GetMTU(output))
+    )) {
+        goto fail0;
+    }
+    
+    // init output
+    PacketPassInterface_Sender_Init(m->output, (PacketPassInterface_handler_done)output_handler_done, m);
+    
+    // not sending
+    m->sending_flow = NULL;
+    
+    // no previous flow
+    m->previous_flow = NULL;
+    
+    // no flow in the middle of a round
+    m->round_flow = NULL;
+    
+    // init queued list
+    LinkedList1_Init(&m->queued_list);
+    
+    // not freeing
+    m->freeing = 0;
+    
+    // init schedule job
+    BPending_Init(&m->schedule_job, m->pg, (BPending_handler)schedule_job_handler, m);
+    
+    DebugObject_Init(&m->d_obj);
+    DebugCounter_Init(&m->d_ctr);
+    return 1;
+    
+fail0:
+    return 0;
+}
+
+void PacketPassDRRQueue_Free (PacketPassDRRQueue *m)
+{
+    ASSERT(LinkedList1_IsEmpty(&m->queued_list))
+    ASSERT(!m->previous_flow)
+    ASSERT(!m->sending_flow)
+    ASSERT(!m->round_flow)
+    DebugCounter_Free(&m->d_ctr);
+    DebugObject_Free(&m->d_obj);
+    
+    // free schedule job
+    BPending_Free(&m->schedule_job);
+}
+
+void PacketPassDRRQueue_PrepareFree (PacketPassDRRQueue *m)
+{
+    DebugObject_Access(&m->d_obj);
+    
+    // set freeing
+    m->freeing = 1;
+}
+
+int PacketPassDRRQueue_GetMTU (PacketPassDRRQueue *m)
+{
+    DebugObject_Access(&m->d_obj);
+    
+    return PacketPassInterface_GetMTU(m->output);
+}
+
+void PacketPassDRRQueueFlow_Init (PacketPassDRRQueueFlow *flow, PacketPassDRRQueue *m)
+{
+    ASSERT(!m->freeing)
+    DebugObject_Access(&m->d_obj);
+    
+    // init arguments
+    flow->m = m;
+    
+    // have no canfree handler
+    flow->handler_busy = NULL;
+    
+    // init input
+    PacketPassInterface_Init(&flow->input, PacketPassInterface_GetMTU(flow->m->output), (PacketPassInterface_handler_send)input_handler_send, flow, m->pg);
+    
+    // set weight and deficit
+    flow->weight = 1;
+    flow->deficit = 0;
+    
+    // is not queued
+    flow->is_queued = 0;
+    
+    DebugObject_Init(&flow->d_obj);
+    DebugCounter_Increment(&m->d_ctr);
+}
+
+void PacketPassDRRQueueFlow_Free (PacketPassDRRQueueFlow *flow)
+{
+    PacketPassDRRQueue *m = flow->m;
+    
+    ASSERT(m->freeing || flow != m->sending_flow)
+    DebugCounter_Decrement(&m->d_ctr);
+    DebugObject_Free(&flow->d_obj);
+    
+    // remove from current flow
+    if (flow == m->sending_flow) {
+        m->sending_flow = NULL;
+    }
+    
+    // remove from previous flow
+    if (flow == m->previous_flow) {
+        m->previous_flow = NULL;
+    }
+    
+    // remove from round flow
+    if (flow == m->round_flow) {
+        m->round_flow = NULL;
+    }
+    
+    // remove from queue
+    if (flow->is_queued) {
+        LinkedList1_Remove(&m->queued_list, &flow->queued.list_node);
+    }
+    
+    // free input
+    PacketPassInterface_Free(&flow->input);
+}
+
+void PacketPassDRRQueueFlow_AssertFree (PacketPassDRRQueueFlow *flow)
+{
+    PacketPassDRRQueue *m = flow->m;
+    B_USE(m)
+    
+    ASSERT(m->freeing || flow != m->sending_flow)
+    DebugObject_Access(&flow->d_obj);
+}
+
+void PacketPassDRRQueueFlow_SetWeight (PacketPassDRRQueueFlow *flow, int weight)
+{
+    PacketPassDRRQueue *m = flow->m;
+    B_USE(m)
+    
+    ASSERT(weight > 0)
+    ASSERT(!m->freeing)
+    DebugObject_Access(&flow->d_obj);
+    
+    flow->weight = weight;
+}
+
+int PacketPassDRRQueueFlow_IsBusy (PacketPassDRRQueueFlow *flow)
+{
+    PacketPassDRRQueue *m = flow->m;
+    
+    ASSERT(!m->freeing)
+    DebugObject_Access(&flow->d_obj);
+    
+    return (flow == m->sending_flow);
+}
+
+void PacketPassDRRQueueFlow_RequestCancel (PacketPassDRRQueueFlow *flow)
+{
+    PacketPassDRRQueue *m = flow->m;
+    
+    ASSERT(flow == m->sending_flow)
+    ASSERT(m->use_cancel)
+    ASSERT(!m->freeing)
+    ASSERT(!BPending_IsSet(&m->schedule_job))
+    DebugObject_Access(&flow->d_obj);
+    
+    // request cancel
+    PacketPassInterface_Sender_RequestCancel(m->output);
+}
+
+void PacketPassDRRQueueFlow_SetBusyHandler (PacketPassDRRQueueFlow *flow, PacketPassDRRQueue_handler_busy handler, void *user)
+{
+    PacketPassDRRQueue *m = flow->m;
+    B_USE(m)
+    
+    ASSERT(flow == m->sending_flow)
+    ASSERT(!m->freeing)
+    DebugObject_Access(&flow->d_obj);
+    
+    // set handler
+    flow->handler_busy = handler;
+    flow->user = user;
+}
+
+PacketPassInterface * PacketPassDRRQueueFlow_GetInput (PacketPassDRRQueueFlow *flow)
+{
+    DebugObject_Access(&flow->d_obj);
+    
+    return &flow->input;
+}
@@ -0,0 +1,221 @@
+/**
+ * @file PacketPassDRRQueue.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Fair queue using {@link PacketPassInterface}, scheduling flows by
+ * deficit round robin.
+ */
+
+#ifndef BADVPN_FLOW_PACKETPASSDRRQUEUE_H
+#define BADVPN_FLOW_PACKETPASSDRRQUEUE_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/debugcounter.h>
+#include <structure/LinkedList1.h>
+#include <base/DebugObject.h>
+#include <base/BPending.h>
+#include <flow/PacketPassInterface.h>
+
+typedef void (*PacketPassDRRQueue_handler_busy) (void *user);
+
+typedef struct PacketPassDRRQueueFlow_s {
+    struct PacketPassDRRQueue_s *m;
+    PacketPassDRRQueue_handler_busy handler_busy;
+    void *user;
+    PacketPassInterface input;
+    int weight;
+    uint64_t deficit;
+    int is_queued;
+    struct {
+        LinkedList1Node list_node;
+        uint8_t *data;
+        int data_len;
+    } queued;
+    DebugObject d_obj;
+} PacketPassDRRQueueFlow;
+
+/**
+ * Fair queue using {@link PacketPassInterface}, scheduling flows by
+ * deficit round robin.
+ * 
+ * Flows with a packet waiting are kept in a FIFO. When a flow reaches the
+ * front of the FIFO it is credited quantum*weight and may keep sending
+ * as long as its credit covers the cost of its packets (packet length plus
+ * packet_weight). Enqueuing and dequeuing are O(1) and, unlike
+ * {@link PacketPassFairQueue}, there is no global virtual time which
+ * would need to be renormalized over all flows.
+ * Since the quantum must cover the largest packet, every flow which
+ * reaches the front of the FIFO sends at least one packet.
+ */
+typedef struct PacketPassDRRQueue_s {
+    PacketPassInterface *output;
+    BPendingGroup *pg;
+    int use_cancel;
+    int packet_weight;
+    int quantum;
+    struct PacketPassDRRQueueFlow_s *sending_flow;
+    int sending_len;
+    struct PacketPassDRRQueueFlow_s *previous_flow;
+    struct PacketPassDRRQueueFlow_s *round_flow;
+    LinkedList1 queued_list;
+    int freeing;
+    BPending schedule_job;
+    DebugObject d_obj;
+    DebugCounter d_ctr;
+} PacketPassDRRQueue;
+
+/**
+ * Initializes the queue.
+ *
+ * @param m the object
+ * @param output output interface
+ * @param pg pending group
+ * @param use_cancel whether cancel functionality is required. Must be 0 or 1.
+ *                   If 1, output must support cancel functionality.
+ * @param packet_weight additional weight a packet bears. Must be >0, to keep
+ *                      the queue fair for zero size packets.
+ * @param quantum credit given to a flow of weight 1 in each round. Must be
+ *                at least the output MTU plus packet_weight.
+ * @return 1 on success, 0 on failure (because the quantum is too small)
+ */
+int PacketPassDRRQueue_Init (PacketPassDRRQueue *m, PacketPassInterface *output, BPendingGroup *pg, int use_cancel, int packet_weight, int quantum) WARN_UNUSED;
+
+/**
+ * Frees the queue.
+ * All flows must have been freed.
+ *
+ * @param m the object
+ */
+void PacketPassDRRQueue_Free (PacketPassDRRQueue *m);
+
+/**
+ * Prepares for freeing the entire queue. Must be called to allow freeing
+ * the flows in the process of freeing the entire queue.
+ * After this function is called, flows and the queue must be freed
+ * before any further I/O.
+ * May be called multiple times.
+ * The queue enters freeing state.
+ *
+ * @param m the object
+ */
+void PacketPassDRRQueue_PrepareFree (PacketPassDRRQueue *m);
+
+/**
+ * Returns the MTU of the queue.
+ *
+ * @param m the object
+ */
+int PacketPassDRRQueue_GetMTU (PacketPassDRRQueue *m);
+
+/**
+ * Initializes a queue flow.
+ * The flow has weight 1.
+ * Queue must not be in freeing state.
+ * Must not be called from queue calls to output.
+ *
+ * @param flow the object
+ * @param m queue to attach to
+ */
+void PacketPassDRRQueueFlow_Init (PacketPassDRRQueueFlow *flow, PacketPassDRRQueue *m);
+
+/**
+ * Frees a queue flow.
+ * Unless the queue is in freeing state:
+ * - The flow must not be busy as indicated by {@link PacketPassDRRQueueFlow_IsBusy}.
+ * - Must not be called from queue calls to output.
+ *
+ * @param flow the object
+ */
+void PacketPassDRRQueueFlow_Free (PacketPassDRRQueueFlow *flow);
+
+/**
+ * Does nothing.
+ * It must be possible to free the flow (see {@link PacketPassDRRQueueFlow_Free}).
+ * 
+ * @param flow the object
+ */
+void PacketPassDRRQueueFlow_AssertFree (PacketPassDRRQueueFlow *flow);
+
+/**
+ * Sets the weight of the flow. In each round, the flow is credited
+ * quantum*weight, so its share of the output is proportional to the weight.
+ * The new weight takes effect from the next round of the flow.
+ * Queue must not be in freeing state.
+ *
+ * @param flow the object
+ * @param weight new weight. Must be >0.
+ */
+void PacketPassDRRQueueFlow_SetWeight (PacketPassDRRQueueFlow *flow, int weight);
+
+/**
+ * Determines if the flow is busy. If the flow is considered busy, it must not
+ * be freed. At any given time, at most one flow will be indicated as busy.
+ * Queue must not be in freeing state.
+ * Must not be called from queue calls to output.
+ *
+ * @param flow the object
+ * @return 0 if not busy, 1 is busy
+ */
+int PacketPassDRRQueueFlow_IsBusy (PacketPassDRRQueueFlow *flow);
+
+/**
+ * Requests the output to stop processing the current packet as soon as possible.
+ * Cancel functionality must be enabled for the queue.
+ * The flow must be busy as indicated by {@link PacketPassDRRQueueFlow_IsBusy}.
+ * Queue must not be in freeing state.
+ * 
+ * @param flow the object
+ */
+void PacketPassDRRQueueFlow_RequestCancel (PacketPassDRRQueueFlow *flow);
+
+/**
+ * Sets up a callback to be called when the flow is no longer busy.
+ * The handler will be called as soon as the flow is no longer busy, i.e. it is not
+ * possible that this flow is no longer busy before the handler is called.
+ * The flow must be busy as indicated by {@link PacketPassDRRQueueFlow_IsBusy}.
+ * Queue must not be in freeing state.
+ * Must not be called from queue calls to output.
+ *
+ * @param flow the object
+ * @param handler callback function. NULL to disable.
+ * @param user value passed to callback function. Ignored if handler is NULL.
+ */
+void PacketPassDRRQueueFlow_SetBusyHandler (PacketPassDRRQueueFlow *flow, PacketPassDRRQueue_handler_busy handler, void *user);
+
+/**
+ * Returns the input interface of the flow.
+ *
+ * @param flow the object
+ * @return input interface
+ */
+PacketPassInterface * PacketPassDRRQueueFlow_GetInput (PacketPassDRRQueueFlow *flow);
+
+#endif
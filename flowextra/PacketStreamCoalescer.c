@@ -0,0 +1,214 @@
+/**
+ * @file PacketStreamCoalescer.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+
+#include "PacketStreamCoalescer.h"
+
+static void start_write (PacketStreamCoalescer *o)
+{
+    ASSERT(o->out_len == -1)
+    ASSERT(o->buf_len > 0)
+    
+    // stop flush triggers
+    BPending_Unset(&o->flush_job);
+    BReactor_RemoveTimer(o->reactor, &o->flush_timer);
+    
+    // write the buffer
+    o->out_len = o->buf_len;
+    o->out_used = 0;
+    StreamPassInterface_Sender_Send(o->output, o->buf, o->out_len);
+}
+
+static void buffer_input (PacketStreamCoalescer *o)
+{
+    ASSERT(o->out_len == -1)
+    ASSERT(o->in_len >= 0)
+    ASSERT(o->in_len <= o->buf_size - o->buf_len)
+    
+    int was_empty = (o->buf_len == 0);
+    
+    // copy packet
+    memcpy(o->buf + o->buf_len, o->in, o->in_len);
+    o->buf_len += o->in_len;
+    o->in_len = -1;
+    
+    // arrange for a flush. The flush job is set before the input gets Done so that
+    // it runs only after the input has no more packets ready.
+    if (o->flush_delay < 0) {
+        if (!BPending_IsSet(&o->flush_job)) {
+            BPending_Set(&o->flush_job);
+        }
+    } else if (was_empty && o->buf_len > 0) {
+        BReactor_SetTimer(o->reactor, &o->flush_timer);
+    }
+    
+    // finish input packet
+    PacketPassInterface_Done(&o->input);
+}
+
+static void flush (PacketStreamCoalescer *o)
+{
+    ASSERT(o->out_len == -1)
+    
+    if (o->buf_len > 0) {
+        start_write(o);
+    }
+}
+
+static void input_handler_send (PacketStreamCoalescer *o, uint8_t *data, int data_len)
+{
+    ASSERT(o->in_len == -1)
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->buf_size)
+    DebugObject_Access(&o->d_obj);
+    
+    // set input packet
+    o->in = data;
+    o->in_len = data_len;
+    
+    // while the buffer is being written, the packet waits in the input
+    if (o->out_len >= 0) {
+        return;
+    }
+    
+    // if the packet doesn't fit, write the buffer first
+    if (data_len > o->buf_size - o->buf_len) {
+        start_write(o);
+        return;
+    }
+    
+    buffer_input(o);
+}
+
+static void output_handler_done (PacketStreamCoalescer *o, int data_len)
+{
+    ASSERT(o->out_len > 0)
+    ASSERT(data_len > 0)
+    ASSERT(data_len <= o->out_len - o->out_used)
+    DebugObject_Access(&o->d_obj);
+    
+    // update number of bytes written
+    o->out_used += data_len;
+    
+    // write more data
+    if (o->out_used < o->out_len) {
+        StreamPassInterface_Sender_Send(o->output, o->buf + o->out_used, o->out_len - o->out_used);
+        return;
+    }
+    
+    // buffer is free
+    o->out_len = -1;
+    o->buf_len = 0;
+    
+    // accept the waiting packet
+    if (o->in_len >= 0) {
+        buffer_input(o);
+    }
+}
+
+static void flush_job_handler (PacketStreamCoalescer *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    flush(o);
+}
+
+static void flush_timer_handler (PacketStreamCoalescer *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    flush(o);
+}
+
+int PacketStreamCoalescer_Init (PacketStreamCoalescer *o, StreamPassInterface *output, int mtu, int buf_size, btime_t flush_delay, BReactor *reactor)
+{
+    ASSERT(mtu >= 0)
+    ASSERT(buf_size > 0)
+    ASSERT(mtu <= buf_size)
+    
+    // init arguments
+    o->reactor = reactor;
+    o->output = output;
+    o->buf_size = buf_size;
+    o->flush_delay = flush_delay;
+    
+    // allocate buffer
+    if (!(o->buf = (uint8_t *)BAlloc(buf_size))) {
+        goto fail0;
+    }
+    
+    // init input
+    PacketPassInterface_Init(&o->input, mtu, (PacketPassInterface_handler_send)input_handler_send, o, BReactor_PendingGroup(o->reactor));
+    
+    // init output
+    StreamPassInterface_Sender_Init(o->output, (StreamPassInterface_handler_done)output_handler_done, o);
+    
+    // init flush job and timer
+    BPending_Init(&o->flush_job, BReactor_PendingGroup(o->reactor), (BPending_handler)flush_job_handler, o);
+    BTimer_Init(&o->flush_timer, (flush_delay < 0 ? 0 : flush_delay), (BTimer_handler)flush_timer_handler, o);
+    
+    // have empty buffer, no output and no input packet
+    o->buf_len = 0;
+    o->out_len = -1;
+    o->in_len = -1;
+    
+    DebugObject_Init(&o->d_obj);
+    
+    return 1;
+    
+fail0:
+    return 0;
+}
+
+void PacketStreamCoalescer_Free (PacketStreamCoalescer *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free flush job and timer
+    BReactor_RemoveTimer(o->reactor, &o->flush_timer);
+    BPending_Free(&o->flush_job);
+    
+    // free input
+    PacketPassInterface_Free(&o->input);
+    
+    // free buffer
+    BFree(o->buf);
+}
+
+PacketPassInterface * PacketStreamCoalescer_GetInput (PacketStreamCoalescer *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return &o->input;
+}
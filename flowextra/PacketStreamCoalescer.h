@@ -0,0 +1,118 @@
+/**
+ * @file PacketStreamCoalescer.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Object which forwards packets obtained with {@link PacketPassInterface}
+ * as a stream with {@link StreamPassInterface}, like {@link PacketStreamSender},
+ * but packs consecutive packets into larger writes.
+ */
+
+#ifndef BADVPN_PACKETSTREAMCOALESCER_H
+#define BADVPN_PACKETSTREAMCOALESCER_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <base/BPending.h>
+#include <system/BReactor.h>
+#include <flow/PacketPassInterface.h>
+#include <flow/StreamPassInterface.h>
+
+/**
+ * Object which forwards packets obtained with {@link PacketPassInterface}
+ * as a stream with {@link StreamPassInterface}, like {@link PacketStreamSender},
+ * but packs consecutive packets into larger writes.
+ * 
+ * Input packets are copied into a buffer. The buffer is handed over to
+ * the output when it cannot hold the next packet, or, if the flush delay
+ * is negative, as soon as the input stops providing packets (detected as a
+ * pending job which only runs once the jobs of the input chain have finished),
+ * or, if the flush delay is non-negative, when that much time has passed since
+ * the first packet went into the buffer. While the buffer is being written to
+ * the output, the next packet is not accepted, so at most one write is in
+ * flight and packets which are not yet in the buffer stay queued in front of
+ * the input, as with {@link PacketStreamSender}. When the output is slower
+ * than the input, the queue fills up and writes grow by themselves.
+ * 
+ * This is intended to sit in front of {@link BSSLConnection}, where every write
+ * becomes a TLS record and an encryption and send call. The buffer costs
+ * buf_size bytes per object, on top of the send buffer of the
+ * {@link BSSLConnection} (BSSLCONNECTION_SEND_BUF_SIZE).
+ */
+typedef struct {
+    BReactor *reactor;
+    StreamPassInterface *output;
+    int buf_size;
+    btime_t flush_delay;
+    PacketPassInterface input;
+    BPending flush_job;
+    BTimer flush_timer;
+    uint8_t *buf;
+    int buf_len;
+    int out_len;
+    int out_used;
+    uint8_t *in;
+    int in_len;
+    DebugObject d_obj;
+} PacketStreamCoalescer;
+
+/**
+ * Initializes the object.
+ *
+ * @param o the object
+ * @param output output interface
+ * @param mtu input MTU. Must be >=0 and <=buf_size.
+ * @param buf_size maximum number of bytes passed to the output in a single write.
+ *                 Must be >0. A buffer of this size is allocated.
+ * @param flush_delay if negative, buffered packets are written as soon as the input
+ *                    has no more packets to give. Otherwise, the time in milliseconds
+ *                    to keep collecting packets after the first one is buffered.
+ * @param reactor reactor we live in
+ * @return 1 on success, 0 on failure
+ */
+int PacketStreamCoalescer_Init (PacketStreamCoalescer *o, StreamPassInterface *output, int mtu, int buf_size, btime_t flush_delay, BReactor *reactor) WARN_UNUSED;
+
+/**
+ * Frees the object.
+ *
+ * @param o the object
+ */
+void PacketStreamCoalescer_Free (PacketStreamCoalescer *o);
+
+/**
+ * Returns the input interface.
+ * Its MTU will be as in {@link PacketStreamCoalescer_Init}.
+ *
+ * @param o the object
+ * @return input interface
+ */
+PacketPassInterface * PacketStreamCoalescer_GetInput (PacketStreamCoalescer *o);
+
+#endif
@@ -146,3 +146,6 @@
 {"ncd_load_module", 4},
 {"ncd_basic_functions", 4},
 {"ncd_objref", 4},
+{"DatagramSharedSocket", 4},
+{"ServerShards", 4},
+{"NCDProgramCache", 4},
@@ -35,9 +35,9 @@
 #define BADVPN_MISC_LOGGERSSTRING_H
 
 #ifdef BADVPN_USE_WINAPI
-#define LOGGERS_STRING "stdout"
+#define LOGGERS_STRING "stdout/binary"
 #else
-#define LOGGERS_STRING "stdout/syslog"
+#define LOGGERS_STRING "stdout/syslog/binary"
 #endif
 
 #endif
@@ -38,6 +38,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 static int read_file (const char *file, uint8_t **out_data, size_t *out_len)
 {
@@ -49,6 +51,13 @@ static int read_file (const char *file, uint8_t **out_data, size_t *out_len)
     size_t buf_len = 0;
     size_t buf_size = 128;
     
+    // for regular files, start with a buffer which fits the whole file and one
+    // more byte, so that it is read at once and EOF is seen without growing
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && (uintmax_t)st.st_size < SIZE_MAX) {
+        buf_size = (size_t)st.st_size + 1;
+    }
+    
     uint8_t *buf = (uint8_t *)malloc(buf_size);
     if (!buf) {
         goto fail1;
@@ -35,8 +35,11 @@
 #include <misc/read_file.h>
 #include <misc/strdup.h>
 #include <misc/concat_strings.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 #include <ncd/NCDConfigParser.h>
+#include <ncd/NCDSugar.h>
+#include <ncd/NCDProgramCache.h>
 
 #include "NCDBuildProgram.h"
 
@@ -52,8 +55,52 @@ struct guard {
 
 struct build_state {
     struct guard *top_guard;
+    int record_files;
+    struct NCDProgramCache_file *files;
+    size_t num_files;
+    size_t files_capacity;
 };
 
+static int record_file (struct build_state *st, const char *file_path, const uint8_t *data, size_t len)
+{
+    if (st->num_files == st->files_capacity) {
+        size_t new_capacity = (st->files_capacity == 0 ? 8 : 2 * st->files_capacity);
+        struct NCDProgramCache_file *new_files = BAllocArray(new_capacity, sizeof(new_files[0]));
+        if (!new_files) {
+            return 0;
+        }
+        
+        if (st->num_files > 0) {
+            memcpy(new_files, st->files, st->num_files * sizeof(new_files[0]));
+        }
+        BFree(st->files);
+        
+        st->files = new_files;
+        st->files_capacity = new_capacity;
+    }
+    
+    char *path = b_strdup(file_path);
+    if (!path) {
+        return 0;
+    }
+    
+    struct NCDProgramCache_file *f = &st->files[st->num_files++];
+    f->path = path;
+    f->size = len;
+    f->hash = NCDProgramCache_Hash(data, len);
+    
+    return 1;
+}
+
+static void free_files (struct build_state *st)
+{
+    for (size_t i = 0; i < st->num_files; i++) {
+        free((char *)st->files[i].path);
+    }
+    
+    BFree(st->files);
+}
+
 static int add_guard (struct guard **first, const char *id_data, size_t id_length)
 {
     struct guard *g = malloc(sizeof(*g));
@@ -202,6 +249,13 @@ static int process_file (struct build_state *st, int depth, const char *file_pat
         goto fail1;
     }
     
+    // remember exactly what was parsed, for validating a program cache
+    if (st->record_files && !record_file(st, file_path, data, len)) {
+        BLog(BLOG_ERROR, "file '%s': record_file failed", file_path);
+        free(data);
+        goto fail1;
+    }
+    
     NCDProgram program;
     res = NCDConfigParser_Parse((char *)data, len, &program);
     free(data);
@@ -305,6 +359,10 @@ int NCDBuildProgram_Build (const char *file_path, NCDProgram *out_program)
     
     struct build_state st;
     st.top_guard = NULL;
+    st.record_files = 0;
+    st.files = NULL;
+    st.num_files = 0;
+    st.files_capacity = 0;
     
     int guarded;
     int res = process_file(&st, 0, file_path, out_program, &guarded);
@@ -315,3 +373,52 @@ int NCDBuildProgram_Build (const char *file_path, NCDProgram *out_program)
     
     return res;
 }
+
+int NCDBuildProgram_BuildCached (const char *file_path, const char *cache_path, NCDProgram *out_program)
+{
+    ASSERT(file_path)
+    ASSERT(cache_path)
+    ASSERT(out_program)
+    
+    if (NCDProgramCache_Load(cache_path, out_program)) {
+        BLog(BLOG_INFO, "loaded program from cache '%s'", cache_path);
+        return 1;
+    }
+    
+    struct build_state st;
+    st.top_guard = NULL;
+    st.record_files = 1;
+    st.files = NULL;
+    st.num_files = 0;
+    st.files_capacity = 0;
+    
+    int ret = 0;
+    
+    NCDProgram program;
+    int guarded;
+    int res = process_file(&st, 0, file_path, &program, &guarded);
+    if (!res) {
+        goto fail0;
+    }
+    
+    ASSERT(!guarded)
+    
+    if (!NCDSugar_Desugar(&program)) {
+        BLog(BLOG_ERROR, "NCDSugar_Desugar failed");
+        NCDProgram_Free(&program);
+        goto fail0;
+    }
+    
+    // failing to write the cache only costs the next startup a rebuild
+    if (!NCDProgramCache_Save(cache_path, &program, st.files, st.num_files)) {
+        BLog(BLOG_WARNING, "failed to write program cache '%s'", cache_path);
+    }
+    
+    *out_program = program;
+    ret = 1;
+    
+fail0:
+    free_files(&st);
+    free_guards(st.top_guard);
+    return ret;
+}
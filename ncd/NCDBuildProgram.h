@@ -46,4 +46,19 @@
  */
 int NCDBuildProgram_Build (const char *file_path, NCDProgram *out_program) WARN_UNUSED;
 
+/**
+ * Like {@link NCDBuildProgram_Build}, but goes through a precompiled program
+ * cache (see {@link NCDProgramCache_Load}). If the cache is valid for the current
+ * contents of the main file and all included files, the program is loaded from it.
+ * Otherwise the program is built, desugared and written to the cache.
+ * In both cases the resulting program is already desugared.
+ * 
+ * @param file_path path to the main file of the program
+ * @param cache_path path to the cache file
+ * @param out_program on success, *out_program will contain the resulting program.
+ *                    On failure, *out_program will be unchanged.
+ * @return 1 on success, 0 on failure
+ */
+int NCDBuildProgram_BuildCached (const char *file_path, const char *cache_path, NCDProgram *out_program) WARN_UNUSED;
+
 #endif
@@ -58,7 +58,12 @@ struct NCDEvaluator__eval_context {
 static int expr_init (struct NCDEvaluator__Expr *o, NCDEvaluator *eval, NCDValue *value);
 static void expr_free (struct NCDEvaluator__Expr *o);
 static int expr_eval (struct NCDEvaluator__Expr *o, struct NCDEvaluator__eval_context const *context, NCDValMem *out_newmem, NCDValRef *out_val);
+static int expr_is_constant (struct NCDEvaluator__Expr *o);
 static int add_expr_recurser (NCDEvaluator *o, NCDValue *value, NCDValMem *mem, NCDValRef *out);
+static void call_free (struct NCDEvaluator__Call *call);
+static int fold_eval_var (void *user, NCD_string_id_t const *varnames, size_t num_names, NCDValMem *mem, NCDValRef *out);
+static int fold_call (NCDEvaluator *o, size_t index, NCDValMem *mem, NCDValRef *out);
+static int eval_pure_call (struct NCDEvaluator__eval_context const *context, int index, NCDValMem *mem, NCDValRef *out);
 static int replace_placeholders_callback (void *arg, int plid, NCDValMem *mem, NCDValRef *out);
 
 static int expr_init (struct NCDEvaluator__Expr *o, NCDEvaluator *eval, NCDValue *value)
@@ -96,6 +101,11 @@ static void expr_free (struct NCDEvaluator__Expr *o)
     NCDValMem_Free(&o->mem);
 }
 
+static int expr_is_constant (struct NCDEvaluator__Expr *o)
+{
+    return !NCDVal_IsSafeRefPlaceholder(o->ref) && o->prog.num_instrs == 0;
+}
+
 static int expr_eval (struct NCDEvaluator__Expr *o, struct NCDEvaluator__eval_context const *context, NCDValMem *out_newmem, NCDValRef *out_val)
 {
     if (!NCDVal_IsSafeRefPlaceholder(o->ref)) {
@@ -249,6 +259,9 @@ static int add_expr_recurser (NCDEvaluator *o, NCDValue *value, NCDValMem *mem,
                 goto fail_invoc0;
             }
             
+            call.pure = (o->have_fold_funcs && o->fold_funcs.func_is_pure(o->fold_funcs.user, call.func_name_id));
+            call.memo_valid = 0;
+            
             if (!(call.args = BAllocArray(NCDValue_ListCount(arg), sizeof(call.args[0])))) {
                 BLog(BLOG_ERROR, "BAllocArray failed");
                 goto fail_invoc0;
@@ -276,6 +289,11 @@ static int add_expr_recurser (NCDEvaluator *o, NCDValue *value, NCDValMem *mem,
             
             *callptr = call;
             
+            // a pure call with constant arguments can be replaced with its result
+            if (call.pure && fold_call(o, index, mem, out)) {
+                break;
+            }
+            
             *out = NCDVal_NewPlaceholder(mem, ((int)index << 1) | 1);
             break;
             
@@ -302,6 +320,157 @@ fail:
     return 0;
 }
 
+static void call_free (struct NCDEvaluator__Call *call)
+{
+    if (call->memo_valid) {
+        NCDValMem_Free(&call->memo_mem);
+    }
+    while (call->num_args-- > 0) {
+        expr_free(&call->args[call->num_args]);
+    }
+    BFree(call->args);
+}
+
+static int fold_eval_var (void *user, NCD_string_id_t const *varnames, size_t num_names, NCDValMem *mem, NCDValRef *out)
+{
+    // only constant arguments are folded, so this is never called
+    ASSERT(0)
+    return 0;
+}
+
+static int fold_call (NCDEvaluator *o, size_t index, NCDValMem *mem, NCDValRef *out)
+{
+    ASSERT(o->have_fold_funcs)
+    ASSERT(index == o->calls.count - 1)
+    
+    struct NCDEvaluator__Call *call = NCDEvaluator__CallVec_Get(&o->calls, index);
+    ASSERT(call->pure)
+    
+    for (size_t i = 0; i < call->num_args; i++) {
+        if (!expr_is_constant(&call->args[i])) {
+            return 0;
+        }
+    }
+    
+    NCDEvaluator_EvalFuncs funcs;
+    funcs.user = o->fold_funcs.user;
+    funcs.func_eval_var = fold_eval_var;
+    funcs.func_eval_call = o->fold_funcs.func_eval_call;
+    
+    struct NCDEvaluator__eval_context context;
+    context.eval = o;
+    context.funcs = &funcs;
+    
+    NCDEvaluatorArgs args;
+    args.context = &context;
+    args.call_index = index;
+    args.values = NCDVal_NewInvalid();
+    
+    NCDValMem temp_mem;
+    NCDValMem_Init(&temp_mem, o->string_index);
+    
+    // if the call fails, leave it to fail at runtime, with proper context in the log
+    NCDValRef result;
+    if (!o->fold_funcs.func_eval_call(o->fold_funcs.user, call->func_name_id, args, &temp_mem, &result)) {
+        goto fail1;
+    }
+    
+    NCDValRef copy = NCDVal_NewCopy(mem, result);
+    if (NCDVal_IsInvalid(copy)) {
+        goto fail1;
+    }
+    
+    NCDValMem_Free(&temp_mem);
+    
+    // the call is no longer needed
+    call_free(call);
+    NCDEvaluator__CallVec_Pop(&o->calls, NULL);
+    
+    o->stats.folded_calls++;
+    
+    *out = copy;
+    return 1;
+    
+fail1:
+    NCDValMem_Free(&temp_mem);
+    return 0;
+}
+
+static int eval_pure_call (struct NCDEvaluator__eval_context const *context, int index, NCDValMem *mem, NCDValRef *out)
+{
+    NCDEvaluator *o = context->eval;
+    struct NCDEvaluator__Call *call = NCDEvaluator__CallVec_Get(&o->calls, index);
+    ASSERT(call->pure)
+    
+    NCDEvaluatorArgs args;
+    args.context = context;
+    args.call_index = index;
+    args.values = NCDVal_NewInvalid();
+    
+    // evaluate all the arguments up front, to compare them with the last call
+    NCDValMem args_mem;
+    NCDValMem_Init(&args_mem, o->string_index);
+    
+    NCDValRef values = NCDVal_NewList(&args_mem, call->num_args);
+    if (NCDVal_IsInvalid(values)) {
+        goto fail1;
+    }
+    
+    for (size_t i = 0; i < call->num_args; i++) {
+        NCDValRef value;
+        if (!NCDEvaluatorArgs_EvalArg(&args, i, &args_mem, &value)) {
+            goto fail1;
+        }
+        if (!NCDVal_ListAppend(values, value)) {
+            BLog(BLOG_ERROR, "depth limit exceeded");
+            goto fail1;
+        }
+    }
+    
+    if (call->memo_valid && NCDVal_Compare(values, NCDVal_FromSafe(&call->memo_mem, call->memo_args)) == 0) {
+        NCDValMem_Free(&args_mem);
+        
+        *out = NCDVal_NewCopy(mem, NCDVal_FromSafe(&call->memo_mem, call->memo_result));
+        if (NCDVal_IsInvalid(*out)) {
+            return 0;
+        }
+        
+        o->stats.memo_hits++;
+        return 1;
+    }
+    
+    args.values = values;
+    
+    NCDValRef result;
+    if (!context->funcs->func_eval_call(context->funcs->user, call->func_name_id, args, mem, &result)) {
+        goto fail1;
+    }
+    
+    o->stats.memo_misses++;
+    
+    // remember the arguments and the result; if there's no memory for that,
+    // just keep the previous ones
+    NCDValRef result_copy = NCDVal_NewCopy(&args_mem, result);
+    if (NCDVal_IsInvalid(result_copy)) {
+        NCDValMem_Free(&args_mem);
+    } else {
+        if (call->memo_valid) {
+            NCDValMem_Free(&call->memo_mem);
+        }
+        call->memo_args = NCDVal_ToSafe(values);
+        call->memo_result = NCDVal_ToSafe(result_copy);
+        call->memo_mem = args_mem;
+        call->memo_valid = 1;
+    }
+    
+    *out = result;
+    return 1;
+    
+fail1:
+    NCDValMem_Free(&args_mem);
+    return 0;
+}
+
 static int replace_placeholders_callback (void *arg, int plid, NCDValMem *mem, NCDValRef *out)
 {
     struct NCDEvaluator__eval_context const *context = arg;
@@ -325,9 +494,15 @@ static int replace_placeholders_callback (void *arg, int plid, NCDValMem *mem, N
         case 1: {
             struct NCDEvaluator__Call *call = NCDEvaluator__CallVec_Get(&o->calls, index);
             
+            if (call->pure) {
+                res = eval_pure_call(context, index, mem, out);
+                break;
+            }
+            
             NCDEvaluatorArgs args;
             args.context = context;
             args.call_index = index;
+            args.values = NCDVal_NewInvalid();
             
             res = context->funcs->func_eval_call(context->funcs->user, call->func_name_id, args, mem, out);
         } break;
@@ -342,9 +517,19 @@ static int replace_placeholders_callback (void *arg, int plid, NCDValMem *mem, N
     return res;
 }
 
-int NCDEvaluator_Init (NCDEvaluator *o, NCDStringIndex *string_index)
+int NCDEvaluator_Init (NCDEvaluator *o, NCDStringIndex *string_index, NCDEvaluator_FoldFuncs const *fold_funcs)
 {
+    ASSERT(!fold_funcs || fold_funcs->func_is_pure)
+    ASSERT(!fold_funcs || fold_funcs->func_eval_call)
+    
     o->string_index = string_index;
+    o->have_fold_funcs = !!fold_funcs;
+    if (fold_funcs) {
+        o->fold_funcs = *fold_funcs;
+    }
+    o->stats.folded_calls = 0;
+    o->stats.memo_hits = 0;
+    o->stats.memo_misses = 0;
     
     if (!NCDEvaluator__VarVec_Init(&o->vars, NCDEVALUATOR_DEFAULT_VARARRAY_CAPACITY)) {
         BLog(BLOG_ERROR, "NCDEvaluator__VarVec_Init failed");
@@ -371,17 +556,18 @@ void NCDEvaluator_Free (NCDEvaluator *o)
     }
     
     for (size_t i = 0; i < o->calls.count; i++) {
-        struct NCDEvaluator__Call *call = NCDEvaluator__CallVec_Get(&o->calls, i);
-        while (call->num_args-- > 0) {
-            expr_free(&call->args[call->num_args]);
-        }
-        BFree(call->args);
+        call_free(NCDEvaluator__CallVec_Get(&o->calls, i));
     }
     
     NCDEvaluator__CallVec_Free(&o->calls);
     NCDEvaluator__VarVec_Free(&o->vars);
 }
 
+void NCDEvaluator_GetStats (NCDEvaluator *o, struct NCDEvaluator_stats *out)
+{
+    *out = o->stats;
+}
+
 int NCDEvaluatorExpr_Init (NCDEvaluatorExpr *o, NCDEvaluator *eval, NCDValue *value)
 {
     return expr_init(&o->expr, eval, value);
@@ -417,6 +603,19 @@ int NCDEvaluatorArgs_EvalArgNewMem (NCDEvaluatorArgs *o, size_t index, NCDValMem
     struct NCDEvaluator__Call *call = NCDEvaluator__CallVec_Get(&o->context->eval->calls, o->call_index);
     ASSERT(index < call->num_args)
     
+    // arguments of a memoized call have already been evaluated
+    if (!NCDVal_IsInvalid(o->values)) {
+        NCDValMem_Init(out_newmem, o->context->eval->string_index);
+        
+        *out_ref = NCDVal_NewCopy(out_newmem, NCDVal_ListGet(o->values, index));
+        if (NCDVal_IsInvalid(*out_ref)) {
+            NCDValMem_Free(out_newmem);
+            return 0;
+        }
+        
+        return 1;
+    }
+    
     return expr_eval(&call->args[index], o->context, out_newmem, out_ref);
 }
 
@@ -424,6 +623,16 @@ int NCDEvaluatorArgs_EvalArg (NCDEvaluatorArgs *o, size_t index, NCDValMem *mem,
 {
     int res = 0;
     
+    if (!NCDVal_IsInvalid(o->values)) {
+        NCDValRef ref = NCDVal_NewCopy(mem, NCDVal_ListGet(o->values, index));
+        if (NCDVal_IsInvalid(ref)) {
+            return 0;
+        }
+        
+        *out_ref = ref;
+        return 1;
+    }
+    
     NCDValMem temp_mem;
     NCDValRef temp_ref;
     if (!NCDEvaluatorArgs_EvalArgNewMem(o, index, &temp_mem, &temp_ref)) {
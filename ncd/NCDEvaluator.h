@@ -31,6 +31,7 @@
 #define BADVPN_NCDEVALUATOR_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include <misc/debug.h>
 #include <structure/Vector.h>
@@ -56,6 +57,11 @@ struct NCDEvaluator__Call {
     NCD_string_id_t func_name_id;
     struct NCDEvaluator__Expr *args;
     size_t num_args;
+    int pure;
+    int memo_valid;
+    NCDValMem memo_mem;
+    NCDValSafeRef memo_args;
+    NCDValSafeRef memo_result;
 };
 
 #include "NCDEvaluator_call_vec.h"
@@ -63,19 +69,10 @@ struct NCDEvaluator__Call {
 
 struct NCDEvaluator__eval_context;
 
-typedef struct {
-    NCDStringIndex *string_index;
-    NCDEvaluator__VarVec vars;
-    NCDEvaluator__CallVec calls;
-} NCDEvaluator;
-
-typedef struct {
-    struct NCDEvaluator__Expr expr;
-} NCDEvaluatorExpr;
-
 typedef struct {
     struct NCDEvaluator__eval_context const *context;
     int call_index;
+    NCDValRef values;
 } NCDEvaluatorArgs;
 
 typedef struct {
@@ -84,8 +81,45 @@ typedef struct {
     int (*func_eval_call) (void *user, NCD_string_id_t func_name_id, NCDEvaluatorArgs args, NCDValMem *mem, NCDValRef *out);
 } NCDEvaluator_EvalFuncs;
 
-int NCDEvaluator_Init (NCDEvaluator *o, NCDStringIndex *string_index) WARN_UNUSED;
+/**
+ * Callbacks used for folding calls to pure functions with constant
+ * arguments into constants, when expressions are initialized.
+ * Calls to pure functions with non-constant arguments are memoized:
+ * all arguments are evaluated, and if they are the same as in the last
+ * evaluation of the call, its result is reused.
+ * 
+ * A function may only be reported as pure if its result depends only on
+ * the values of its arguments, it has no side effects, and it evaluates
+ * all of its arguments unless it fails.
+ */
+typedef struct {
+    void *user;
+    int (*func_is_pure) (void *user, NCD_string_id_t func_name_id);
+    int (*func_eval_call) (void *user, NCD_string_id_t func_name_id, NCDEvaluatorArgs args, NCDValMem *mem, NCDValRef *out);
+} NCDEvaluator_FoldFuncs;
+
+struct NCDEvaluator_stats {
+    uint64_t folded_calls;
+    uint64_t memo_hits;
+    uint64_t memo_misses;
+};
+
+typedef struct {
+    NCDStringIndex *string_index;
+    NCDEvaluator__VarVec vars;
+    NCDEvaluator__CallVec calls;
+    NCDEvaluator_FoldFuncs fold_funcs;
+    int have_fold_funcs;
+    struct NCDEvaluator_stats stats;
+} NCDEvaluator;
+
+typedef struct {
+    struct NCDEvaluator__Expr expr;
+} NCDEvaluatorExpr;
+
+int NCDEvaluator_Init (NCDEvaluator *o, NCDStringIndex *string_index, NCDEvaluator_FoldFuncs const *fold_funcs) WARN_UNUSED;
 void NCDEvaluator_Free (NCDEvaluator *o);
+void NCDEvaluator_GetStats (NCDEvaluator *o, struct NCDEvaluator_stats *out);
 int NCDEvaluatorExpr_Init (NCDEvaluatorExpr *o, NCDEvaluator *eval, NCDValue *value) WARN_UNUSED;
 void NCDEvaluatorExpr_Free (NCDEvaluatorExpr *o);
 int NCDEvaluatorExpr_Eval (NCDEvaluatorExpr *o, NCDEvaluator *eval, NCDEvaluator_EvalFuncs const *funcs, NCDValMem *out_newmem, NCDValRef *out_val) WARN_UNUSED;
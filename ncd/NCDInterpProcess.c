@@ -42,6 +42,8 @@
 
 #include <generated/blog_channel_ncd.h>
 
+#define NCDINTERPPROCESS_CACHE_MAX 256
+
 struct NCDInterpProcess__stmt {
     NCD_string_id_t name;
     NCD_string_id_t cmdname;
@@ -120,6 +122,8 @@ int NCDInterpProcess_Init (NCDInterpProcess *o, NCDProcess *process, NCDStringIn
     o->prealloc_size = -1;
     o->is_template = NCDProcess_IsTemplate(process);
     o->cache = NULL;
+    o->cache_count = 0;
+    o->cache_size = 0;
     
     for (NCDStatement *s = NCDBlock_FirstStatement(block); s; s = NCDBlock_NextStatement(block, s)) {
         ASSERT(NCDStatement_Type(s) == NCDSTATEMENT_REG)
@@ -204,6 +208,9 @@ fail0:
 void NCDInterpProcess_Free (NCDInterpProcess *o)
 {
     DebugObject_Free(&o->d_obj);
+    ASSERT(o->cache_count == 0)
+    
+    BFree(o->cache);
     
     while (o->num_stmts-- > 0) {
         struct NCDInterpProcess__stmt *e = &o->stmts[o->num_stmts];
@@ -373,11 +380,32 @@ int NCDInterpProcess_CachePush (NCDInterpProcess *o, void *elem)
     DebugObject_Access(&o->d_obj);
     ASSERT(elem)
     
-    if (o->cache) {
-        return 0;
+    if (o->cache_count == o->cache_size) {
+        if (o->cache_size == NCDINTERPPROCESS_CACHE_MAX) {
+            return 0;
+        }
+        
+        // grow the array, up to the limit
+        int new_size = (o->cache_size == 0 ? 4 : 2 * o->cache_size);
+        if (new_size > NCDINTERPPROCESS_CACHE_MAX) {
+            new_size = NCDINTERPPROCESS_CACHE_MAX;
+        }
+        
+        void **new_cache = BAllocArray(new_size, sizeof(new_cache[0]));
+        if (!new_cache) {
+            return 0;
+        }
+        
+        if (o->cache_count > 0) {
+            memcpy(new_cache, o->cache, o->cache_count * sizeof(new_cache[0]));
+        }
+        BFree(o->cache);
+        
+        o->cache = new_cache;
+        o->cache_size = new_size;
     }
     
-    o->cache = elem;
+    o->cache[o->cache_count++] = elem;
     
     return 1;
 }
@@ -386,8 +414,9 @@ void * NCDInterpProcess_CachePull (NCDInterpProcess *o)
 {
     DebugObject_Access(&o->d_obj);
     
-    void *elem = o->cache;
-    o->cache = NULL;
+    if (o->cache_count == 0) {
+        return NULL;
+    }
     
-    return elem;
+    return o->cache[--o->cache_count];
 }
@@ -60,7 +60,9 @@ typedef struct {
     int is_template;
     int *hash_buckets;
     size_t num_hash_buckets;
-    void *cache;
+    void **cache;
+    int cache_count;
+    int cache_size;
     DebugObject d_obj;
 } NCDInterpProcess;
 
@@ -79,7 +81,22 @@ int NCDInterpProcess_StatementPreallocOffset (NCDInterpProcess *o, int i);
 const char * NCDInterpProcess_Name (NCDInterpProcess *o);
 int NCDInterpProcess_IsTemplate (NCDInterpProcess *o);
 int NCDInterpProcess_NumStatements (NCDInterpProcess *o);
+
+/**
+ * Keeps an unused element (a process structure of the interpreter) for
+ * reuse by {@link NCDInterpProcess_CachePull}. At most NCDINTERPPROCESS_CACHE_MAX
+ * elements are kept.
+ * 
+ * @return 1 if the element was taken, 0 if the cache is full and the caller
+ *         must free the element itself
+ */
 int NCDInterpProcess_CachePush (NCDInterpProcess *o, void *elem) WARN_UNUSED;
+
+/**
+ * Takes the most recently pushed element out of the cache.
+ * 
+ * @return the element, or NULL if the cache is empty
+ */
 void * NCDInterpProcess_CachePull (NCDInterpProcess *o);
 
 #endif
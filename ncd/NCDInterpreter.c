@@ -32,9 +32,11 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <inttypes.h>
 
 #include <misc/offset.h>
 #include <misc/balloc.h>
+#include <misc/compare.h>
 #include <misc/expstring.h>
 #include <base/BLog.h>
 #include <ncd/NCDSugar.h>
@@ -54,9 +56,24 @@
 #define PSTATE_WAITING 2
 #define PSTATE_TERMINATING 3
 
+struct type_stats {
+    const struct NCDInterpModule *module;
+    uint64_t inits;
+    uint64_t init_failures;
+    int64_t eval_ns;
+    int64_t init_ns;
+    uint64_t ups;
+    uint64_t downs;
+    uint64_t deaths;
+    int64_t die_ns;
+    BAVLNode tree_node;
+};
+
 struct statement {
     NCDModuleInst inst;
     NCDValMem args_mem;
+    NCDValMem *args_shared;
+    struct type_stats *stats;
     int mem_size;
     int i;
 };
@@ -72,6 +89,7 @@ struct process {
     int ap;
     int fp;
     int num_statements;
+    int prealloc_size; // of the template when allocated
     unsigned int error:1;
     unsigned int have_alloc:1;
 #ifndef NDEBUG
@@ -88,6 +106,11 @@ struct func_call_context {
 static void start_terminate (NCDInterpreter *interp, int exit_code);
 static char * implode_id_strings (NCDInterpreter *interp, const NCD_string_id_t *names, size_t num_names, char del);
 static void clear_process_cache (NCDInterpreter *interp);
+static int type_stats_comparator (void *unused, void *v1, void *v2);
+static struct type_stats * get_type_stats (NCDInterpreter *interp, const struct NCDInterpModule *module);
+static void free_type_stats (NCDInterpreter *interp);
+static int type_stats_total_cmp (const void *v1, const void *v2);
+static int64_t profile_time (NCDInterpreter *interp);
 static struct process * process_allocate (NCDInterpreter *interp, NCDInterpProcess *iprocess);
 static void process_release (struct process *p, int no_push);
 static void process_assert_statements_cleared (struct process *p);
@@ -112,10 +135,14 @@ static int process_resolve_object_expr (struct process *p, int pos, const NCD_st
 static int process_resolve_variable_expr (struct process *p, int pos, const NCD_string_id_t *names, size_t num_names, NCDValMem *mem, NCDValRef *out_value);
 static void statement_logfunc (struct statement *ps);
 static void statement_log (struct statement *ps, int level, const char *fmt, ...);
+static void statement_die (struct statement *ps);
+static int statement_try_free (struct statement *ps);
 static struct process * statement_process (struct statement *ps);
 static int statement_mem_is_allocated (struct statement *ps);
 static int statement_mem_size (struct statement *ps);
 static int statement_allocate_memory (struct statement *ps, int alloc_size);
+static int statement_args_worth_sharing (NCDValRef args);
+static void statement_free_args (struct statement *ps);
 static void statement_instance_func_event (NCDModuleInst *inst, int event);
 static int statement_instance_func_getobj (NCDModuleInst *inst, NCD_string_id_t objname, NCDObject *out_object);
 static int statement_instance_func_initprocess (void *vinterp, NCDModuleProcess *mp, NCD_string_id_t template_name);
@@ -128,6 +155,9 @@ static void process_moduleprocess_func_event (struct process *p, int event);
 static int process_moduleprocess_func_getobj (struct process *p, NCD_string_id_t name, NCDObject *out_object);
 static void function_logfunc (void *user);
 static int function_eval_arg (void *user, size_t index, NCDValMem *mem, NCDValRef *out);
+static int fold_func_is_pure (void *user, NCD_string_id_t func_name_id);
+static int fold_func_eval_call (void *user, NCD_string_id_t func_name_id, NCDEvaluatorArgs args, NCDValMem *mem, NCDValRef *out);
+static int fold_eval_arg (void *user, size_t index, NCDValMem *mem, NCDValRef *out);
 
 #define STATEMENT_LOG(ps, channel, ...) if (BLog_WouldLog(BLOG_CURRENT_CHANNEL, channel)) statement_log(ps, channel, __VA_ARGS__)
 
@@ -147,6 +177,7 @@ int NCDInterpreter_Init (NCDInterpreter *o, NCDProgram program, struct NCDInterp
 #ifndef BADVPN_NO_RANDOM
     ASSERT(params.random2);
 #endif
+    ASSERT(params.twd);
     
     // set params
     o->params = params;
@@ -182,6 +213,7 @@ int NCDInterpreter_Init (NCDInterpreter *o, NCDProgram program, struct NCDInterp
 #ifndef BADVPN_NO_RANDOM
     o->module_iparams.random2 = params.random2;
 #endif
+    o->module_iparams.twd = params.twd;
     o->module_iparams.string_index = &o->string_index;
     
     // add module groups to index and allocate string id's for base_type's
@@ -198,8 +230,12 @@ int NCDInterpreter_Init (NCDInterpreter *o, NCDProgram program, struct NCDInterp
         goto fail3;
     }
     
-    // init expression evaluator
-    if (!NCDEvaluator_Init(&o->evaluator, &o->string_index)) {
+    // init expression evaluator, folding calls to pure functions
+    o->fold_call_shared.logfunc = NULL; // a failed fold is retried at runtime, which logs the error
+    o->fold_call_shared.func_eval_arg = fold_eval_arg;
+    o->fold_call_shared.iparams = &o->module_iparams;
+    NCDEvaluator_FoldFuncs fold_funcs = {o, fold_func_is_pure, fold_func_eval_call};
+    if (!NCDEvaluator_Init(&o->evaluator, &o->string_index, &fold_funcs)) {
         BLog(BLOG_ERROR, "NCDEvaluator_Init failed");
         goto fail3;
     }
@@ -228,6 +264,10 @@ int NCDInterpreter_Init (NCDInterpreter *o, NCDProgram program, struct NCDInterp
     // init processes list
     LinkedList1_Init(&o->processes);
     
+    // init statistics
+    BAVL_Init(&o->stats_tree, OFFSET_DIFF(struct type_stats, module, tree_node), type_stats_comparator, NULL);
+    o->stats_processes = 0;
+    
     // init processes
     for (NCDProgramElem *elem = NCDProgram_FirstElem(&o->program); elem; elem = NCDProgram_NextElem(&o->program, elem)) {
         ASSERT(NCDProgramElem_Type(elem) == NCDPROGRAMELEM_PROCESS)
@@ -266,6 +306,8 @@ fail7:;
     }
     // clear process cache (process_free() above may push to cache)
     clear_process_cache(o);
+    // free statistics
+    free_type_stats(o);
     // free interp program
     NCDInterpProg_Free(&o->iprogram);
 fail5:
@@ -301,6 +343,9 @@ void NCDInterpreter_Free (NCDInterpreter *o)
     // clear process cache
     clear_process_cache(o);
     
+    // free statistics
+    free_type_stats(o);
+    
     // free interp program
     NCDInterpProg_Free(&o->iprogram);
     
@@ -324,6 +369,51 @@ void NCDInterpreter_RequestShutdown (NCDInterpreter *o, int exit_code)
     start_terminate(o, exit_code);
 }
 
+void NCDInterpreter_DumpStats (NCDInterpreter *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    if (!o->params.profile) {
+        BLog(BLOG_WARNING, "profiling is not enabled");
+        return;
+    }
+    
+    // collect statistics, sorted by total time
+    size_t count = 0;
+    for (BAVLNode *n = BAVL_GetFirst(&o->stats_tree); n; n = BAVL_GetNext(&o->stats_tree, n)) {
+        count++;
+    }
+    
+    struct type_stats **arr = BAllocArray(count, sizeof(arr[0]));
+    if (count > 0 && !arr) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        return;
+    }
+    
+    size_t i = 0;
+    for (BAVLNode *n = BAVL_GetFirst(&o->stats_tree); n; n = BAVL_GetNext(&o->stats_tree, n)) {
+        arr[i++] = UPPER_OBJECT(n, struct type_stats, tree_node);
+    }
+    qsort(arr, count, sizeof(arr[0]), type_stats_total_cmp);
+    
+    BLog(BLOG_NOTICE, "profile: %"PRIu64" processes created", o->stats_processes);
+    BLog(BLOG_NOTICE, "profile: %-32s %10s %8s %12s %12s %10s %10s %10s %12s", "type", "inits", "failed", "args_us", "init_us", "ups", "downs", "deaths", "die_us");
+    
+    for (i = 0; i < count; i++) {
+        struct type_stats *st = arr[i];
+        BLog(BLOG_NOTICE, "profile: %-32s %10"PRIu64" %8"PRIu64" %12"PRId64" %12"PRId64" %10"PRIu64" %10"PRIu64" %10"PRIu64" %12"PRId64,
+             st->module->module.type, st->inits, st->init_failures, st->eval_ns / 1000, st->init_ns / 1000,
+             st->ups, st->downs, st->deaths, st->die_ns / 1000);
+    }
+    
+    BFree(arr);
+    
+    struct NCDEvaluator_stats eval_stats;
+    NCDEvaluator_GetStats(&o->evaluator, &eval_stats);
+    BLog(BLOG_NOTICE, "profile: %"PRIu64" function calls folded, %"PRIu64" evaluations saved by memoization (%"PRIu64" memoized calls evaluated)",
+         eval_stats.folded_calls, eval_stats.memo_hits, eval_stats.memo_misses);
+}
+
 void start_terminate (NCDInterpreter *interp, int exit_code)
 {
     // remember exit code
@@ -399,18 +489,64 @@ void clear_process_cache (NCDInterpreter *interp)
     }
 }
 
-struct process * process_allocate (NCDInterpreter *interp, NCDInterpProcess *iprocess)
+int type_stats_comparator (void *unused, void *v1, void *v2)
 {
-    ASSERT(iprocess)
+    uintptr_t m1 = (uintptr_t)*(const struct NCDInterpModule **)v1;
+    uintptr_t m2 = (uintptr_t)*(const struct NCDInterpModule **)v2;
+    return B_COMPARE(m1, m2);
+}
+
+struct type_stats * get_type_stats (NCDInterpreter *interp, const struct NCDInterpModule *module)
+{
+    ASSERT(interp->params.profile)
     
-    // try to pull from cache
-    struct process *p = NCDInterpProcess_CachePull(iprocess);
-    if (p) {
-        goto allocated;
+    BAVLNode *n = BAVL_LookupExact(&interp->stats_tree, &module);
+    if (n) {
+        return UPPER_OBJECT(n, struct type_stats, tree_node);
     }
     
-    // get number of statements
-    int num_statements = NCDInterpProcess_NumStatements(iprocess);
+    struct type_stats *st = BAlloc(sizeof(*st));
+    if (!st) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        return NULL;
+    }
+    
+    memset(st, 0, sizeof(*st));
+    st->module = module;
+    
+    int res = BAVL_Insert(&interp->stats_tree, &st->tree_node, NULL);
+    ASSERT_EXECUTE(res)
+    
+    return st;
+}
+
+void free_type_stats (NCDInterpreter *interp)
+{
+    BAVLNode *n;
+    while (n = BAVL_GetFirst(&interp->stats_tree)) {
+        struct type_stats *st = UPPER_OBJECT(n, struct type_stats, tree_node);
+        BAVL_Remove(&interp->stats_tree, &st->tree_node);
+        BFree(st);
+    }
+}
+
+int type_stats_total_cmp (const void *v1, const void *v2)
+{
+    struct type_stats const *st1 = *(struct type_stats * const *)v1;
+    struct type_stats const *st2 = *(struct type_stats * const *)v2;
+    int64_t t1 = st1->eval_ns + st1->init_ns + st1->die_ns;
+    int64_t t2 = st2->eval_ns + st2->init_ns + st2->die_ns;
+    return B_COMPARE(t2, t1);
+}
+
+int64_t profile_time (NCDInterpreter *interp)
+{
+    return (interp->params.profile ? btime_gettime_ns() : 0);
+}
+
+struct process * process_allocate (NCDInterpreter *interp, NCDInterpProcess *iprocess)
+{
+    ASSERT(iprocess)
     
     // get size of preallocated memory
     int mem_size = NCDInterpProcess_PreallocSize(iprocess);
@@ -418,6 +554,19 @@ struct process * process_allocate (NCDInterpreter *interp, NCDInterpProcess *ipr
         goto fail0;
     }
     
+    // try to pull from cache; drop processes laid out before some statement
+    // needed more memory, they would have to allocate it separately
+    struct process *p;
+    while ((p = NCDInterpProcess_CachePull(iprocess))) {
+        if (p->prealloc_size == mem_size) {
+            goto allocated;
+        }
+        process_release(p, 1);
+    }
+    
+    // get number of statements
+    int num_statements = NCDInterpProcess_NumStatements(iprocess);
+    
     // start with size of process structure
     size_t alloc_size = sizeof(struct process);
     
@@ -453,6 +602,7 @@ struct process * process_allocate (NCDInterpreter *interp, NCDInterpProcess *ipr
     p->ap = 0;
     p->fp = 0;
     p->num_statements = num_statements;
+    p->prealloc_size = mem_size;
     p->error = 0;
     p->have_alloc = 0;
     
@@ -561,6 +711,10 @@ int process_new (NCDInterpreter *interp, NCDInterpProcess *iprocess, NCDModulePr
     // insert to processes list
     LinkedList1_Append(&interp->processes, &p->list_node);
     
+    if (interp->params.profile) {
+        interp->stats_processes++;
+    }
+    
     // schedule work
     BSmallPending_Set(&p->work_job, BReactor_PendingGroup(p->reactor));
     
@@ -668,7 +822,7 @@ void process_work_job_handler_working (struct process *p)
         ps->inst.istate = SSTATE_DYING;
         
         // order it to die
-        NCDModuleInst_Die(&ps->inst);
+        statement_die(ps);
         return;
     }
     
@@ -798,11 +952,11 @@ again:
     }
     
     // optimize for statements which can be destroyed immediately
-    if (NCDModuleInst_TryFree(&ps->inst)) {
+    if (statement_try_free(ps)) {
         STATEMENT_LOG(ps, BLOG_INFO, "died");
         
         // free arguments memory
-        NCDValMem_Free(&ps->args_mem);
+        statement_free_args(ps);
         
         // set statement state FORGOTTEN
         ps->inst.istate = SSTATE_FORGOTTEN;
@@ -819,7 +973,7 @@ again:
     ps->inst.istate = SSTATE_DYING;
     
     // order it to die
-    NCDModuleInst_Die(&ps->inst);
+    statement_die(ps);
     return;
 }
 
@@ -867,6 +1021,8 @@ void process_advance (struct process *p)
     
     STATEMENT_LOG(ps, BLOG_INFO, "initializing");
     
+    ps->stats = NULL;
+    
     // need to determine the module and object to use it on (if it's a method)
     const struct NCDInterpModule *module;
     void *method_context = NULL;
@@ -914,6 +1070,12 @@ void process_advance (struct process *p)
         }
     }
     
+    // get statistics for this type of statement
+    if (p->interp->params.profile) {
+        ps->stats = get_type_stats(p->interp, module);
+    }
+    int64_t t_eval = profile_time(p->interp);
+    
     // get evaluator expression for the arguments
     NCDEvaluatorExpr *expr = NCDInterpProcess_GetStatementArgsExpr(p->iprocess, ps->i);
     
@@ -925,6 +1087,17 @@ void process_advance (struct process *p)
         goto fail0;
     }
     
+    // share arguments containing lists or maps, so that modules and
+    // processes can copy these out of the arguments in constant time
+    ps->args_shared = NULL;
+    if (statement_args_worth_sharing(args)) {
+        NCDValMem *shared = NCDValMem_Share(&ps->args_mem);
+        if (shared) {
+            ps->args_shared = shared;
+            args = NCDVal_Moved(shared, args);
+        }
+    }
+    
     // allocate memory
     if (!statement_allocate_memory(ps, module->module.alloc_size)) {
         STATEMENT_LOG(ps, BLOG_ERROR, "failed to allocate memory");
@@ -942,13 +1115,25 @@ void process_advance (struct process *p)
     
     process_assert_pointers(p);
     
+    int64_t t_init = profile_time(p->interp);
+    
     // initialize module instance
     NCDModuleInst_Init(&ps->inst, module, method_context, args, &p->interp->module_params);
+    
+    if (ps->stats) {
+        ps->stats->inits++;
+        ps->stats->eval_ns += t_init - t_eval;
+        ps->stats->init_ns += profile_time(p->interp) - t_init;
+    }
     return;
     
 fail1:
-    NCDValMem_Free(&ps->args_mem);
+    statement_free_args(ps);
 fail0:
+    if (ps->stats) {
+        ps->stats->init_failures++;
+    }
+    
     // set error
     p->error = 1;
     
@@ -1068,6 +1253,40 @@ void statement_log (struct statement *ps, int level, const char *fmt, ...)
     va_end(vl);
 }
 
+void statement_die (struct statement *ps)
+{
+    if (!ps->stats) {
+        NCDModuleInst_Die(&ps->inst);
+        return;
+    }
+    
+    struct process *p = statement_process(ps);
+    int64_t t_start = profile_time(p->interp);
+    
+    NCDModuleInst_Die(&ps->inst);
+    
+    ps->stats->die_ns += profile_time(p->interp) - t_start;
+}
+
+int statement_try_free (struct statement *ps)
+{
+    if (!ps->stats) {
+        return NCDModuleInst_TryFree(&ps->inst);
+    }
+    
+    struct process *p = statement_process(ps);
+    int64_t t_start = profile_time(p->interp);
+    
+    int res = NCDModuleInst_TryFree(&ps->inst);
+    
+    ps->stats->die_ns += profile_time(p->interp) - t_start;
+    if (res) {
+        ps->stats->deaths++;
+    }
+    
+    return res;
+}
+
 struct process * statement_process (struct statement *ps)
 {
     return UPPER_OBJECT(ps - ps->i, struct process, statements);
@@ -1078,6 +1297,32 @@ int statement_mem_is_allocated (struct statement *ps)
     return (ps->mem_size < 0);
 }
 
+int statement_args_worth_sharing (NCDValRef args)
+{
+    ASSERT(NCDVal_IsList(args))
+    
+    // Sharing costs an allocation, and only lists and maps benefit from it,
+    // since strings are always copied.
+    size_t count = NCDVal_ListCount(args);
+    for (size_t j = 0; j < count; j++) {
+        int type = NCDVal_Type(NCDVal_ListGet(args, j));
+        if (type == NCDVAL_LIST || type == NCDVAL_MAP) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+void statement_free_args (struct statement *ps)
+{
+    if (ps->args_shared) {
+        NCDValMem_ReleaseShared(ps->args_shared);
+    } else {
+        NCDValMem_Free(&ps->args_mem);
+    }
+}
+
 int statement_mem_size (struct statement *ps)
 {
     return (ps->mem_size >= 0 ? ps->mem_size : -ps->mem_size);
@@ -1134,6 +1379,10 @@ void statement_instance_func_event (NCDModuleInst *inst, int event)
             
             STATEMENT_LOG(ps, BLOG_INFO, "up");
             
+            if (ps->stats) {
+                ps->stats->ups++;
+            }
+            
             // set state ADULT
             ps->inst.istate = SSTATE_ADULT;
         } break;
@@ -1143,6 +1392,10 @@ void statement_instance_func_event (NCDModuleInst *inst, int event)
             
             STATEMENT_LOG(ps, BLOG_INFO, "down");
             
+            if (ps->stats) {
+                ps->stats->downs++;
+            }
+            
             // set state CHILD
             ps->inst.istate = SSTATE_CHILD;
             
@@ -1163,6 +1416,11 @@ void statement_instance_func_event (NCDModuleInst *inst, int event)
             STATEMENT_LOG(ps, BLOG_INFO, "down");
             STATEMENT_LOG(ps, BLOG_INFO, "up");
             
+            if (ps->stats) {
+                ps->stats->downs++;
+                ps->stats->ups++;
+            }
+            
             // clear error
             if (ps->i < p->ap) {
                 p->error = 0;
@@ -1177,11 +1435,15 @@ void statement_instance_func_event (NCDModuleInst *inst, int event)
         case NCDMODULE_EVENT_DEAD: {
             STATEMENT_LOG(ps, BLOG_INFO, "died");
             
+            if (ps->stats) {
+                ps->stats->deaths++;
+            }
+            
             // free instance
             NCDModuleInst_Free(&ps->inst);
             
             // free arguments memory
-            NCDValMem_Free(&ps->args_mem);
+            statement_free_args(ps);
             
             // set state FORGOTTEN
             ps->inst.istate = SSTATE_FORGOTTEN;
@@ -1200,11 +1462,15 @@ void statement_instance_func_event (NCDModuleInst *inst, int event)
         case NCDMODULE_EVENT_DEADERROR: {
             STATEMENT_LOG(ps, BLOG_ERROR, "died with error");
             
+            if (ps->stats) {
+                ps->stats->deaths++;
+            }
+            
             // free instance
             NCDModuleInst_Free(&ps->inst);
             
             // free arguments memory
-            NCDValMem_Free(&ps->args_mem);
+            statement_free_args(ps);
             
             // set state FORGOTTEN
             ps->inst.istate = SSTATE_FORGOTTEN;
@@ -1386,3 +1652,29 @@ int function_eval_arg (void *user, size_t index, NCDValMem *mem, NCDValRef *out)
     
     return NCDEvaluatorArgs_EvalArg(context->args, index, mem, out);
 }
+
+int fold_func_is_pure (void *user, NCD_string_id_t func_name_id)
+{
+    NCDInterpreter *interp = user;
+    
+    struct NCDInterpFunction const *ifunc = NCDModuleIndex_FindFunction(&interp->mindex, func_name_id);
+    
+    return ifunc && (ifunc->function.flags & NCDMODULEFUNCTION_FLAG_PURE);
+}
+
+int fold_func_eval_call (void *user, NCD_string_id_t func_name_id, NCDEvaluatorArgs args, NCDValMem *mem, NCDValRef *out)
+{
+    NCDInterpreter *interp = user;
+    
+    struct NCDInterpFunction const *ifunc = NCDModuleIndex_FindFunction(&interp->mindex, func_name_id);
+    ASSERT(ifunc)
+    
+    return NCDCall_DoIt(&interp->fold_call_shared, &args, ifunc, NCDEvaluatorArgs_Count(&args), mem, out);
+}
+
+int fold_eval_arg (void *user, size_t index, NCDValMem *mem, NCDValRef *out)
+{
+    NCDEvaluatorArgs *args = user;
+    
+    return NCDEvaluatorArgs_EvalArg(args, index, mem, out);
+}
@@ -36,6 +36,7 @@
 #include <base/DebugObject.h>
 #include <system/BTime.h>
 #include <system/BReactor.h>
+#include <threadwork/BThreadWork.h>
 #include <ncd/NCDStringIndex.h>
 #include <ncd/NCDModuleIndex.h>
 #include <ncd/NCDAst.h>
@@ -43,6 +44,7 @@
 #include <ncd/NCDInterpProg.h>
 #include <ncd/NCDModule.h>
 #include <structure/LinkedList1.h>
+#include <structure/BAVL.h>
 
 #ifndef BADVPN_NO_PROCESS
 #include <system/BProcess.h>
@@ -72,6 +74,7 @@ struct NCDInterpreter_params {
     btime_t retry_time;
     char **extra_args;
     int num_extra_args;
+    int profile; // collect timing per statement type, see NCDInterpreter_DumpStats()
     
     // possibly shared resources
     BReactor *reactor;
@@ -84,6 +87,7 @@ struct NCDInterpreter_params {
 #ifndef BADVPN_NO_RANDOM
     BRandom2 *random2;
 #endif
+    BThreadWorkDispatcher *twd;
 };
 
 typedef struct {
@@ -113,10 +117,15 @@ typedef struct {
     struct NCDModuleInst_params module_params;
     struct NCDModuleInst_iparams module_iparams;
     struct NCDCall_interp_shared module_call_shared;
+    struct NCDCall_interp_shared fold_call_shared;
     
     // processes
     LinkedList1 processes;
     
+    // timing per statement type, if profiling
+    BAVL stats_tree;
+    uint64_t stats_processes;
+    
     DebugObject d_obj;
 } NCDInterpreter;
 
@@ -154,4 +163,15 @@ void NCDInterpreter_Free (NCDInterpreter *o);
  */
 void NCDInterpreter_RequestShutdown (NCDInterpreter *o, int exit_code);
 
+/**
+ * Logs the timing counters collected for each statement type (module), if the
+ * interpreter was initialized with the profile parameter set. For every type,
+ * this shows how many statements were initialized, the time spent evaluating
+ * their arguments and in the module's init function, how often they went up and
+ * down, and the time spent in the module when asking them to die.
+ * 
+ * @param o the interpreter
+ */
+void NCDInterpreter_DumpStats (NCDInterpreter *o);
+
 #endif
@@ -699,6 +699,10 @@ void NCDCall_SetResult (NCDCall const *o, NCDValRef ref)
 
 BLogContext NCDCall_LogContext (NCDCall const *o)
 {
+    if (!o->interp_shared->logfunc) {
+        return BLog_NullContext();
+    }
+    
     return BLog_MakeContext(o->interp_shared->logfunc, o->interp_user);
 }
 
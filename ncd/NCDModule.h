@@ -34,6 +34,7 @@
 
 #include <misc/debug.h>
 #include <system/BReactor.h>
+#include <threadwork/BThreadWork.h>
 #include <base/BLog.h>
 #include <ncd/NCDVal.h>
 #include <ncd/NCDObject.h>
@@ -335,6 +336,11 @@ struct NCDModuleInst_iparams {
      */
     BRandom2 *random2;
 #endif
+    /**
+     * Thread work dispatcher, for doing blocking operations (e.g. file I/O)
+     * outside of the event loop.
+     */
+    BThreadWorkDispatcher *twd;
     /**
      * String index which keeps a mapping between strings and string identifiers.
      */
@@ -1165,6 +1171,7 @@ struct NCDCall_interp_shared {
     /**
      * A callack for log messages originating from the function call.
      * The first argument is the interp_user argument to NCDCall_DoIt.
+     * If NULL, the messages are discarded.
      */
     BLog_logfunc logfunc;
     
@@ -1211,8 +1218,21 @@ struct NCDModuleFunction {
      * Callback for evaluating the function.
      */
     void (*func_eval) (NCDCall call);
+    
+    /**
+     * Function flags.
+     * 
+     * NCDMODULEFUNCTION_FLAG_PURE - the result of the function depends only
+     *   on the values of its arguments, the function has no side effects,
+     *   and it evaluates all of its arguments unless it fails. The interpreter
+     *   may evaluate calls with constant arguments when the program is loaded,
+     *   and reuse the result of a call when its arguments have not changed.
+     */
+    int flags;
 };
 
+#define NCDMODULEFUNCTION_FLAG_PURE (1 << 0)
+
 /**
  * Represents an {@link NCDModuleFunction} within an interpreter.
  * This structure is initialized by the interpreter when it loads a module group.
@@ -0,0 +1,696 @@
+/**
+ * @file NCDProgramCache.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <misc/debug.h>
+#include <misc/balloc.h>
+#include <misc/read_file.h>
+#include <misc/write_file.h>
+#include <misc/expstring.h>
+#include <misc/concat_strings.h>
+#include <base/BLog.h>
+
+#include "NCDProgramCache.h"
+
+#include <generated/blog_channel_NCDProgramCache.h>
+
+#define CACHE_MAGIC UINT32_C(0x4e434450)
+#define CACHE_VERSION 1
+#define NULL_STRING UINT32_MAX
+#define MAX_VALUE_DEPTH 1000
+
+struct reader {
+    const uint8_t *data;
+    size_t len;
+};
+
+uint64_t NCDProgramCache_Hash (const uint8_t *data, size_t len)
+{
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    
+    for (size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= UINT64_C(0x100000001b3);
+    }
+    
+    return h;
+}
+
+static int put_u8 (ExpString *out, uint8_t x)
+{
+    return ExpString_AppendByte(out, x);
+}
+
+static int put_u32 (ExpString *out, uint32_t x)
+{
+    return ExpString_AppendBinary(out, (const uint8_t *)&x, sizeof(x));
+}
+
+static int put_u64 (ExpString *out, uint64_t x)
+{
+    return ExpString_AppendBinary(out, (const uint8_t *)&x, sizeof(x));
+}
+
+// strings are stored with a terminating null so that the loader can use
+// them directly from the mapping
+static int put_string (ExpString *out, const char *data, size_t len)
+{
+    if (len >= NULL_STRING) {
+        return 0;
+    }
+    
+    return put_u32(out, len) && ExpString_AppendBinary(out, (const uint8_t *)data, len) && put_u8(out, 0);
+}
+
+static int put_cstring (ExpString *out, const char *str)
+{
+    if (!str) {
+        return put_u32(out, NULL_STRING);
+    }
+    
+    return put_string(out, str, strlen(str));
+}
+
+static int put_value (ExpString *out, NCDValue *v)
+{
+    if (!put_u8(out, NCDValue_Type(v))) {
+        return 0;
+    }
+    
+    switch (NCDValue_Type(v)) {
+        case NCDVALUE_STRING: {
+            return put_string(out, NCDValue_StringValue(v), NCDValue_StringLength(v));
+        } break;
+        
+        case NCDVALUE_LIST: {
+            if (!put_u32(out, NCDValue_ListCount(v))) {
+                return 0;
+            }
+            
+            for (NCDValue *e = NCDValue_ListFirst(v); e; e = NCDValue_ListNext(v, e)) {
+                if (!put_value(out, e)) {
+                    return 0;
+                }
+            }
+        } break;
+        
+        case NCDVALUE_MAP: {
+            if (!put_u32(out, NCDValue_MapCount(v))) {
+                return 0;
+            }
+            
+            for (NCDValue *ek = NCDValue_MapFirstKey(v); ek; ek = NCDValue_MapNextKey(v, ek)) {
+                if (!put_value(out, ek) || !put_value(out, NCDValue_MapKeyValue(v, ek))) {
+                    return 0;
+                }
+            }
+        } break;
+        
+        case NCDVALUE_VAR: {
+            return put_cstring(out, NCDValue_VarName(v));
+        } break;
+        
+        case NCDVALUE_INVOC: {
+            return put_value(out, NCDValue_InvocFunc(v)) && put_value(out, NCDValue_InvocArg(v));
+        } break;
+        
+        default:
+            return 0;
+    }
+    
+    return 1;
+}
+
+static int put_process (ExpString *out, NCDProcess *proc)
+{
+    NCDBlock *block = NCDProcess_Block(proc);
+    
+    if (!put_u8(out, !!NCDProcess_IsTemplate(proc)) || !put_cstring(out, NCDProcess_Name(proc)) ||
+        !put_u32(out, NCDBlock_NumStatements(block))
+    ) {
+        return 0;
+    }
+    
+    for (NCDStatement *st = NCDBlock_FirstStatement(block); st; st = NCDBlock_NextStatement(block, st)) {
+        if (NCDStatement_Type(st) != NCDSTATEMENT_REG) {
+            BLog(BLOG_ERROR, "program is not desugared");
+            return 0;
+        }
+        
+        if (!put_cstring(out, NCDStatement_Name(st)) || !put_cstring(out, NCDStatement_RegObjName(st)) ||
+            !put_cstring(out, NCDStatement_RegCmdName(st)) || !put_value(out, NCDStatement_RegArgs(st))
+        ) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+static int encode (ExpString *out, NCDProcess **procs, size_t num_procs, const struct NCDProgramCache_file *files, size_t num_files)
+{
+    if (!put_u32(out, CACHE_MAGIC) || !put_u32(out, CACHE_VERSION) || !put_u32(out, num_files)) {
+        return 0;
+    }
+    
+    for (size_t i = 0; i < num_files; i++) {
+        if (!put_cstring(out, files[i].path) || !put_u64(out, files[i].size) || !put_u64(out, files[i].hash)) {
+            return 0;
+        }
+    }
+    
+    if (!put_u32(out, num_procs)) {
+        return 0;
+    }
+    
+    // write processes in reverse, see decode_program()
+    for (size_t i = num_procs; i > 0; i--) {
+        if (!put_process(out, procs[i - 1])) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+static int get_bytes (struct reader *r, size_t len, const uint8_t **out)
+{
+    if (len > r->len) {
+        return 0;
+    }
+    
+    *out = r->data;
+    r->data += len;
+    r->len -= len;
+    
+    return 1;
+}
+
+static int get_u8 (struct reader *r, uint8_t *out)
+{
+    const uint8_t *p;
+    if (!get_bytes(r, sizeof(*out), &p)) {
+        return 0;
+    }
+    
+    *out = *p;
+    return 1;
+}
+
+static int get_u32 (struct reader *r, uint32_t *out)
+{
+    const uint8_t *p;
+    if (!get_bytes(r, sizeof(*out), &p)) {
+        return 0;
+    }
+    
+    memcpy(out, p, sizeof(*out));
+    return 1;
+}
+
+static int get_u64 (struct reader *r, uint64_t *out)
+{
+    const uint8_t *p;
+    if (!get_bytes(r, sizeof(*out), &p)) {
+        return 0;
+    }
+    
+    memcpy(out, p, sizeof(*out));
+    return 1;
+}
+
+static int get_string (struct reader *r, const char **out_data, size_t *out_len)
+{
+    uint32_t len;
+    const uint8_t *p;
+    if (!get_u32(r, &len) || len == NULL_STRING || !get_bytes(r, (size_t)len + 1, &p) || p[len] != 0) {
+        return 0;
+    }
+    
+    *out_data = (const char *)p;
+    *out_len = len;
+    return 1;
+}
+
+static int get_cstring (struct reader *r, int nullable, const char **out)
+{
+    if (nullable && r->len >= sizeof(uint32_t)) {
+        uint32_t len;
+        memcpy(&len, r->data, sizeof(len));
+        if (len == NULL_STRING) {
+            r->data += sizeof(len);
+            r->len -= sizeof(len);
+            *out = NULL;
+            return 1;
+        }
+    }
+    
+    const char *data;
+    size_t len;
+    if (!get_string(r, &data, &len) || strlen(data) != len) {
+        return 0;
+    }
+    
+    *out = data;
+    return 1;
+}
+
+static int get_value (struct reader *r, int depth, NCDValue *out)
+{
+    uint8_t type;
+    if (depth > MAX_VALUE_DEPTH || !get_u8(r, &type)) {
+        return 0;
+    }
+    
+    switch (type) {
+        case NCDVALUE_STRING: {
+            const char *data;
+            size_t len;
+            if (!get_string(r, &data, &len)) {
+                return 0;
+            }
+            return NCDValue_InitStringBin(out, (const uint8_t *)data, len);
+        } break;
+        
+        case NCDVALUE_LIST: {
+            uint32_t count;
+            if (!get_u32(r, &count)) {
+                return 0;
+            }
+            
+            NCDValue_InitList(out);
+            
+            for (uint32_t i = 0; i < count; i++) {
+                NCDValue e;
+                if (!get_value(r, depth + 1, &e)) {
+                    goto fail_list;
+                }
+                if (!NCDValue_ListAppend(out, e)) {
+                    NCDValue_Free(&e);
+                    goto fail_list;
+                }
+            }
+            
+            return 1;
+            
+        fail_list:
+            NCDValue_Free(out);
+            return 0;
+        } break;
+        
+        case NCDVALUE_MAP: {
+            uint32_t count;
+            if (!get_u32(r, &count)) {
+                return 0;
+            }
+            
+            // the AST only supports prepending map entries, so collect the
+            // entries first and insert them in reverse
+            if (count > r->len / 2) {
+                return 0;
+            }
+            
+            NCDValue *entries = (count > 0 ? BAllocArray(2 * (size_t)count, sizeof(entries[0])) : NULL);
+            if (count > 0 && !entries) {
+                return 0;
+            }
+            
+            uint32_t num_read = 0;
+            while (num_read < count) {
+                if (!get_value(r, depth + 1, &entries[2 * num_read])) {
+                    goto fail_map0;
+                }
+                if (!get_value(r, depth + 1, &entries[2 * num_read + 1])) {
+                    NCDValue_Free(&entries[2 * num_read]);
+                    goto fail_map0;
+                }
+                num_read++;
+            }
+            
+            NCDValue_InitMap(out);
+            
+            while (num_read > 0) {
+                NCDValue *e = &entries[2 * (num_read - 1)];
+                if (!NCDValue_MapPrepend(out, e[0], e[1])) {
+                    goto fail_map1;
+                }
+                num_read--;
+            }
+            
+            BFree(entries);
+            return 1;
+            
+        fail_map1:
+            NCDValue_Free(out);
+        fail_map0:
+            while (num_read > 0) {
+                num_read--;
+                NCDValue_Free(&entries[2 * num_read]);
+                NCDValue_Free(&entries[2 * num_read + 1]);
+            }
+            BFree(entries);
+            return 0;
+        } break;
+        
+        case NCDVALUE_VAR: {
+            const char *name;
+            if (!get_cstring(r, 0, &name)) {
+                return 0;
+            }
+            return NCDValue_InitVar(out, name);
+        } break;
+        
+        case NCDVALUE_INVOC: {
+            NCDValue func;
+            if (!get_value(r, depth + 1, &func)) {
+                return 0;
+            }
+            
+            NCDValue arg;
+            if (!get_value(r, depth + 1, &arg)) {
+                NCDValue_Free(&func);
+                return 0;
+            }
+            
+            if (!NCDValue_InitInvoc(out, func, arg)) {
+                NCDValue_Free(&func);
+                NCDValue_Free(&arg);
+                return 0;
+            }
+            
+            return 1;
+        } break;
+        
+        default:
+            return 0;
+    }
+}
+
+static int get_statement (struct reader *r, NCDStatement *out)
+{
+    const char *name;
+    const char *objname;
+    const char *cmdname;
+    if (!get_cstring(r, 1, &name) || !get_cstring(r, 1, &objname) || !get_cstring(r, 0, &cmdname)) {
+        return 0;
+    }
+    
+    NCDValue args;
+    if (!get_value(r, 0, &args)) {
+        return 0;
+    }
+    
+    if (NCDValue_Type(&args) != NCDVALUE_LIST || !NCDStatement_InitReg(out, name, objname, cmdname, args)) {
+        NCDValue_Free(&args);
+        return 0;
+    }
+    
+    return 1;
+}
+
+static int get_process (struct reader *r, NCDProcess *out)
+{
+    uint8_t is_template;
+    const char *name;
+    uint32_t num_statements;
+    if (!get_u8(r, &is_template) || !get_cstring(r, 0, &name) || !get_u32(r, &num_statements)) {
+        return 0;
+    }
+    
+    NCDBlock block;
+    NCDBlock_Init(&block);
+    
+    NCDStatement *last = NULL;
+    
+    for (uint32_t i = 0; i < num_statements; i++) {
+        NCDStatement st;
+        if (!get_statement(r, &st)) {
+            goto fail;
+        }
+        
+        int res = (last ? NCDBlock_InsertStatementAfter(&block, last, st) : NCDBlock_PrependStatement(&block, st));
+        if (!res) {
+            NCDStatement_Free(&st);
+            goto fail;
+        }
+        
+        last = (last ? NCDBlock_NextStatement(&block, last) : NCDBlock_FirstStatement(&block));
+    }
+    
+    if (!NCDProcess_Init(out, is_template, name, block)) {
+        goto fail;
+    }
+    
+    return 1;
+    
+fail:
+    NCDBlock_Free(&block);
+    return 0;
+}
+
+static int check_files (struct reader *r)
+{
+    uint32_t num_files;
+    if (!get_u32(r, &num_files)) {
+        return 0;
+    }
+    
+    for (uint32_t i = 0; i < num_files; i++) {
+        const char *path;
+        uint64_t size;
+        uint64_t hash;
+        if (!get_cstring(r, 0, &path) || !get_u64(r, &size) || !get_u64(r, &hash)) {
+            return 0;
+        }
+        
+        uint8_t *data;
+        size_t len;
+        if (!read_file(path, &data, &len)) {
+            BLog(BLOG_INFO, "file '%s' is no longer readable", path);
+            return 0;
+        }
+        
+        int same = (len == size && NCDProgramCache_Hash(data, len) == hash);
+        free(data);
+        
+        if (!same) {
+            BLog(BLOG_INFO, "file '%s' has changed", path);
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+static int decode_program (struct reader *r, NCDProgram *out_program)
+{
+    uint32_t num_processes;
+    if (!get_u32(r, &num_processes)) {
+        return 0;
+    }
+    
+    NCDProgram program;
+    NCDProgram_Init(&program);
+    
+    // processes are stored in reverse order, since the AST only supports
+    // prepending program elements
+    for (uint32_t i = 0; i < num_processes; i++) {
+        NCDProcess proc;
+        if (!get_process(r, &proc)) {
+            goto fail;
+        }
+        
+        NCDProgramElem elem;
+        NCDProgramElem_InitProcess(&elem, proc);
+        
+        if (!NCDProgram_PrependElem(&program, elem)) {
+            NCDProgramElem_Free(&elem);
+            goto fail;
+        }
+    }
+    
+    if (r->len != 0) {
+        goto fail;
+    }
+    
+    *out_program = program;
+    return 1;
+    
+fail:
+    NCDProgram_Free(&program);
+    return 0;
+}
+
+int NCDProgramCache_Load (const char *cache_path, NCDProgram *out_program)
+{
+    ASSERT(cache_path)
+    ASSERT(out_program)
+    
+    int ret = 0;
+    
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            BLog(BLOG_INFO, "cache '%s' does not exist", cache_path);
+        } else {
+            BLog(BLOG_WARNING, "cache '%s': open failed", cache_path);
+        }
+        goto fail0;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        BLog(BLOG_WARNING, "cache '%s': fstat failed", cache_path);
+        goto fail1;
+    }
+    
+    if (st.st_size <= 0 || (uintmax_t)st.st_size > SIZE_MAX) {
+        BLog(BLOG_WARNING, "cache '%s': bad size", cache_path);
+        goto fail1;
+    }
+    
+    size_t map_len = st.st_size;
+    
+    void *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        BLog(BLOG_WARNING, "cache '%s': mmap failed", cache_path);
+        goto fail1;
+    }
+    
+    struct reader r;
+    r.data = map;
+    r.len = map_len;
+    
+    uint32_t magic;
+    uint32_t version;
+    if (!get_u32(&r, &magic) || !get_u32(&r, &version) || magic != CACHE_MAGIC || version != CACHE_VERSION) {
+        BLog(BLOG_INFO, "cache '%s' has an unknown format", cache_path);
+        goto fail2;
+    }
+    
+    if (!check_files(&r)) {
+        BLog(BLOG_INFO, "cache '%s' is stale", cache_path);
+        goto fail2;
+    }
+    
+    if (!decode_program(&r, out_program)) {
+        BLog(BLOG_WARNING, "cache '%s' is corrupt", cache_path);
+        goto fail2;
+    }
+    
+    ret = 1;
+    
+fail2:
+    munmap(map, map_len);
+fail1:
+    close(fd);
+fail0:
+    return ret;
+}
+
+int NCDProgramCache_Save (const char *cache_path, NCDProgram *program, const struct NCDProgramCache_file *files, size_t num_files)
+{
+    ASSERT(cache_path)
+    ASSERT(program)
+    ASSERT(files || num_files == 0)
+    
+    int ret = 0;
+    
+    size_t num_elems = NCDProgram_NumElems(program);
+    
+    if (num_files >= UINT32_MAX || num_elems >= UINT32_MAX) {
+        BLog(BLOG_ERROR, "program too large");
+        goto fail0;
+    }
+    
+    NCDProcess **procs = BAllocArray(num_elems, sizeof(procs[0]));
+    if (num_elems > 0 && !procs) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail0;
+    }
+    
+    size_t num_procs = 0;
+    for (NCDProgramElem *elem = NCDProgram_FirstElem(program); elem; elem = NCDProgram_NextElem(program, elem)) {
+        if (NCDProgramElem_Type(elem) != NCDPROGRAMELEM_PROCESS) {
+            BLog(BLOG_ERROR, "program contains unresolved includes");
+            goto fail1;
+        }
+        procs[num_procs++] = NCDProgramElem_Process(elem);
+    }
+    
+    ExpString out;
+    if (!ExpString_Init(&out)) {
+        BLog(BLOG_ERROR, "ExpString_Init failed");
+        goto fail1;
+    }
+    
+    if (!encode(&out, procs, num_elems, files, num_files)) {
+        BLog(BLOG_ERROR, "failed to encode program");
+        goto fail2;
+    }
+    
+    char *tmp_path = concat_strings(2, cache_path, ".tmp");
+    if (!tmp_path) {
+        BLog(BLOG_ERROR, "concat_strings failed");
+        goto fail2;
+    }
+    
+    if (!write_file(tmp_path, ExpString_GetMr(&out))) {
+        BLog(BLOG_ERROR, "cache '%s': failed to write '%s'", cache_path, tmp_path);
+        unlink(tmp_path);
+        goto fail3;
+    }
+    
+    if (rename(tmp_path, cache_path) < 0) {
+        BLog(BLOG_ERROR, "cache '%s': rename failed", cache_path);
+        unlink(tmp_path);
+        goto fail3;
+    }
+    
+    ret = 1;
+    
+fail3:
+    free(tmp_path);
+fail2:
+    ExpString_Free(&out);
+fail1:
+    BFree(procs);
+fail0:
+    return ret;
+}
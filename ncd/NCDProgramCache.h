@@ -0,0 +1,90 @@
+/**
+ * @file NCDProgramCache.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Precompiled program cache. A built and desugared {@link NCDProgram} is
+ * stored in a flat binary file together with the path, size and content hash
+ * of every source file it was built from, so that a restart with unchanged
+ * sources can skip parsing, include resolution and desugaring.
+ * 
+ * The file is in native byte order and is only meant to be read back on the
+ * same machine; a file with a foreign layout is simply treated as stale.
+ */
+
+#ifndef BADVPN_NCD_PROGRAMCACHE_H
+#define BADVPN_NCD_PROGRAMCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <ncd/NCDAst.h>
+
+/**
+ * Describes one source file that a cached program depends on.
+ * The size and hash must be of the exact contents that were parsed.
+ */
+struct NCDProgramCache_file {
+    const char *path;
+    uint64_t size;
+    uint64_t hash;
+};
+
+/**
+ * Computes the content hash used to validate source files (64-bit FNV-1a).
+ */
+uint64_t NCDProgramCache_Hash (const uint8_t *data, size_t len);
+
+/**
+ * Loads a program from a cache file, if the cache is valid.
+ * The cache is valid if it can be read and decoded and every source file it
+ * lists still has the recorded size and content hash.
+ * 
+ * @param cache_path path to the cache file
+ * @param out_program on success, *out_program will contain the cached program,
+ *                    in desugared form. On failure, it will be unchanged.
+ * @return 1 if the program was loaded, 0 if the cache is missing, stale or corrupt
+ */
+int NCDProgramCache_Load (const char *cache_path, NCDProgram *out_program) WARN_UNUSED;
+
+/**
+ * Writes a program to a cache file. The file is written under a temporary
+ * name and then renamed over cache_path, so a concurrent reader never sees a
+ * partially written cache.
+ * 
+ * @param cache_path path to the cache file
+ * @param program program to store. It must be desugared, i.e. consist only of
+ *                processes whose statements are all of type NCDSTATEMENT_REG.
+ * @param files source files the program was built from
+ * @param num_files number of elements in files
+ * @return 1 on success, 0 on failure
+ */
+int NCDProgramCache_Save (const char *cache_path, NCDProgram *program, const struct NCDProgramCache_file *files, size_t num_files) WARN_UNUSED;
+
+#endif
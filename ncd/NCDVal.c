@@ -45,6 +45,7 @@
 
 #define NCDVAL_FIRST_SIZE 256
 #define NCDVAL_MAX_DEPTH 32
+#define NCDVAL_MAP_HASH_MIN 16
 
 #define TYPE_MASK_EXTERNAL_TYPE ((1 << 3) - 1)
 #define TYPE_MASK_INTERNAL_TYPE ((1 << 5) - 1)
@@ -53,6 +54,8 @@
 #define STOREDSTRING_TYPE (NCDVAL_STRING | (0 << 3))
 #define IDSTRING_TYPE (NCDVAL_STRING | (1 << 3))
 #define EXTERNALSTRING_TYPE (NCDVAL_STRING | (2 << 3))
+#define SHAREDLIST_TYPE (NCDVAL_LIST | (1 << 3))
+#define SHAREDMAP_TYPE (NCDVAL_MAP | (1 << 3))
 
 #define NCDVAL_INSTR_PLACEHOLDER 0
 #define NCDVAL_INSTR_REINSERT 1
@@ -96,16 +99,35 @@ struct NCDVal__externalstring {
     struct NCDVal__ref ref;
 };
 
+struct NCDVal__sharedref {
+    int type;
+    NCDVal__idx target_idx;
+    NCDValMem *target_mem;
+    struct NCDVal__ref ref;
+};
+
+struct NCDVal__sharedmem {
+    BRefTarget ref_target;
+    NCDValMem mem;
+};
+
 typedef struct NCDVal__mapelem NCDVal__maptree_entry;
 typedef NCDValMem *NCDVal__maptree_arg;
 
 #include "NCDVal_maptree.h"
 #include <structure/CAvl_decl.h>
 
+struct NCDVal__maphashent {
+    NCDVal__idx elempos;
+    uint32_t hash;
+};
+
 struct NCDVal__map {
     int type;
     NCDVal__idx maxcount;
     NCDVal__idx count;
+    NCDVal__idx hash_size;
+    int hash_built;
     NCDVal__MapTree tree;
     struct NCDVal__mapelem elems[];
 };
@@ -134,7 +156,9 @@ static int make_type (int internal_type, int depth)
            internal_type == NCDVAL_MAP ||
            internal_type == STOREDSTRING_TYPE ||
            internal_type == IDSTRING_TYPE ||
-           internal_type == EXTERNALSTRING_TYPE)
+           internal_type == EXTERNALSTRING_TYPE ||
+           internal_type == SHAREDLIST_TYPE ||
+           internal_type == SHAREDMAP_TYPE)
     ASSERT(depth >= 0)
     ASSERT(depth <= NCDVAL_MAX_DEPTH)
     
@@ -178,6 +202,8 @@ static void * buffer_at (NCDValMem *o, NCDVal__idx idx)
 
 static NCDVal__idx buffer_allocate (NCDValMem *o, NCDVal__idx alloc_size, NCDVal__idx align)
 {
+    ASSERT(!o->shared_target)
+    
     NCDVal__idx mod = o->used % align;
     NCDVal__idx align_extra = mod ? (align - mod) : 0;
     
@@ -283,7 +309,8 @@ static void assert_val_only (NCDValMem *mem, NCDVal__idx idx)
             ASSERT(map_e->maxcount >= 0)
             ASSERT(map_e->count >= 0)
             ASSERT(map_e->count <= map_e->maxcount)
-            ASSERT(idx + sizeof(struct NCDVal__map) + map_e->maxcount * sizeof(struct NCDVal__mapelem) <= mem->used)
+            ASSERT(map_e->hash_size == 0 || map_e->hash_size >= 2 * map_e->maxcount)
+            ASSERT(idx + sizeof(struct NCDVal__map) + map_e->maxcount * sizeof(struct NCDVal__mapelem) + map_e->hash_size * sizeof(struct NCDVal__maphashent) <= mem->used)
         } break;
         case IDSTRING_TYPE: {
             ASSERT(idx + sizeof(struct NCDVal__idstring) <= mem->used)
@@ -297,6 +324,21 @@ static void assert_val_only (NCDValMem *mem, NCDVal__idx idx)
             ASSERT(!exs_e->ref.target || exs_e->ref.next >= -1)
             ASSERT(!exs_e->ref.target || exs_e->ref.next < mem->used)
         } break;
+        case SHAREDLIST_TYPE:
+        case SHAREDMAP_TYPE: {
+            ASSERT(idx + sizeof(struct NCDVal__sharedref) <= mem->used)
+            struct NCDVal__sharedref *sr_e = buffer_at(mem, idx);
+            ASSERT(sr_e->target_mem)
+            ASSERT(sr_e->target_mem != mem)
+            ASSERT(sr_e->target_mem->shared_target)
+            ASSERT(sr_e->ref.target == sr_e->target_mem->shared_target)
+            ASSERT(sr_e->ref.next >= -1)
+            ASSERT(sr_e->ref.next < mem->used)
+            assert_val_only(sr_e->target_mem, sr_e->target_idx);
+            int *target_type_ptr = buffer_at(sr_e->target_mem, sr_e->target_idx);
+            ASSERT(get_internal_type(*target_type_ptr) == get_external_type(sr_e->type))
+            ASSERT(get_depth(*target_type_ptr) == get_depth(sr_e->type))
+        } break;
         default: ASSERT(0);
     }
 #endif
@@ -340,6 +382,102 @@ static NCDVal__idx make_map_elem_idx (NCDVal__idx mapidx, NCDVal__idx pos)
     return mapidx + offsetof(struct NCDVal__map, elems) + pos * sizeof(struct NCDVal__mapelem);
 }
 
+static struct NCDVal__maphashent * map_hash_table (struct NCDVal__map *map_e)
+{
+    ASSERT(map_e->hash_size > 0)
+    
+    return (struct NCDVal__maphashent *)&map_e->elems[map_e->maxcount];
+}
+
+static uint32_t map_hash_key (NCDValRef key)
+{
+    // must be consistent with NCDVal_Compare; only strings are hashed by
+    // content, which is what keys practically always are
+    switch (NCDVal_Type(key)) {
+        case NCDVAL_STRING: {
+            MemRef data = NCDVal_StringMemRef(key);
+            uint32_t h = UINT32_C(2166136261);
+            for (size_t i = 0; i < data.len; i++) {
+                h ^= (uint8_t)data.ptr[i];
+                h *= UINT32_C(16777619);
+            }
+            return h;
+        } break;
+        
+        case NCDVAL_LIST:
+            return NCDVal_ListCount(key) * UINT32_C(2654435761) + 1;
+        
+        case NCDVAL_MAP:
+            return NCDVal_MapCount(key) * UINT32_C(2654435761) + 2;
+        
+        case NCDVAL_PLACEHOLDER:
+            return NCDVal_PlaceholderId(key) * UINT32_C(2654435761) + 3;
+        
+        default:
+            ASSERT(0);
+            return 0;
+    }
+}
+
+static void map_hash_add (NCDValMem *mem, struct NCDVal__map *map_e, NCDVal__idx elempos)
+{
+    ASSERT(map_e->hash_size > 0)
+    ASSERT(elempos >= 0)
+    ASSERT(elempos < map_e->maxcount)
+    
+    struct NCDVal__maphashent *table = map_hash_table(map_e);
+    uint32_t mask = map_e->hash_size - 1;
+    uint32_t hash = map_hash_key(make_ref(mem, map_e->elems[elempos].key_idx));
+    
+    // linear probing; the table is at most half full
+    uint32_t i = hash & mask;
+    while (table[i].elempos >= 0) {
+        i = (i + 1) & mask;
+    }
+    
+    table[i].elempos = elempos;
+    table[i].hash = hash;
+}
+
+static void map_hash_build (NCDValMem *mem, struct NCDVal__map *map_e)
+{
+    ASSERT(map_e->hash_size > 0)
+    ASSERT(!map_e->hash_built)
+    
+    struct NCDVal__maphashent *table = map_hash_table(map_e);
+    for (NCDVal__idx i = 0; i < map_e->hash_size; i++) {
+        table[i].elempos = -1;
+    }
+    
+    for (NCDVal__idx i = 0; i < map_e->count; i++) {
+        map_hash_add(mem, map_e, i);
+    }
+    
+    map_e->hash_built = 1;
+}
+
+static NCDVal__idx map_hash_lookup (NCDValRef map, struct NCDVal__map *map_e, NCDValRef key)
+{
+    ASSERT(map_e->hash_built)
+    
+    struct NCDVal__maphashent *table = map_hash_table(map_e);
+    uint32_t mask = map_e->hash_size - 1;
+    uint32_t hash = map_hash_key(key);
+    
+    for (uint32_t i = hash & mask; table[i].elempos >= 0; i = (i + 1) & mask) {
+        if (table[i].hash != hash) {
+            continue;
+        }
+        
+        struct NCDVal__mapelem *me_e = &map_e->elems[table[i].elempos];
+        if (NCDVal_Compare(key, make_ref(map.mem, me_e->key_idx)) == 0) {
+            return make_map_elem_idx(map.idx, table[i].elempos);
+        }
+    }
+    
+    return -1;
+}
+
 static int get_val_depth (NCDValRef val)
 {
     ASSERT(val.idx != -1)
@@ -366,23 +504,70 @@ static void register_ref (NCDValMem *o, NCDVal__idx refidx, struct NCDVal__ref *
     o->first_ref = refidx;
 }
 
-#include "NCDVal_maptree.h"
-#include <structure/CAvl_impl.h>
-
-void NCDValMem_Init (NCDValMem *o, NCDStringIndex *string_index)
+static NCDValRef resolve_shared (NCDValRef val)
 {
-    ASSERT(string_index)
+    ASSERT(val.idx >= 0)
     
-    o->string_index = string_index;
-    o->size = NCDVAL_FASTBUF_SIZE;
-    o->used = 0;
-    o->first_ref = -1;
+    // shared references are registered as references, so a memory object
+    // without any references does not contain any
+    if (val.mem->first_ref == -1) {
+        return val;
+    }
+    
+    // read just the type first, since only shared references are
+    // aligned for struct NCDVal__sharedref
+    int *type_ptr = buffer_at(val.mem, val.idx);
+    ASSERT(get_external_type(*type_ptr) == NCDVAL_LIST || get_external_type(*type_ptr) == NCDVAL_MAP)
+    
+    // this is only used for lists and maps, of which only the shared
+    // reference types have this bit set
+    if (!(*type_ptr & (1 << 3))) {
+        return val;
+    }
+    
+    struct NCDVal__sharedref *sr_e = buffer_at(val.mem, val.idx);
+    
+    return make_ref(sr_e->target_mem, sr_e->target_idx);
 }
 
-void NCDValMem_Free (NCDValMem *o)
+static NCDValRef make_shared_ref (NCDValMem *mem, NCDValMem *target_mem, NCDVal__idx target_idx)
 {
-    assert_mem(o);
+    ASSERT(mem != target_mem)
+    ASSERT(target_mem->shared_target)
+    assert_val_only(target_mem, target_idx);
+    
+    int *target_type_ptr = buffer_at(target_mem, target_idx);
+    int target_type = *target_type_ptr;
+    ASSERT(get_internal_type(target_type) == NCDVAL_LIST || get_internal_type(target_type) == NCDVAL_MAP)
+    
+    int internal_type = (get_internal_type(target_type) == NCDVAL_LIST) ? SHAREDLIST_TYPE : SHAREDMAP_TYPE;
+    
+    NCDVal__idx size = sizeof(struct NCDVal__sharedref);
+    NCDVal__idx idx = buffer_allocate(mem, size, __alignof(struct NCDVal__sharedref));
+    if (idx < 0) {
+        goto fail0;
+    }
+    
+    if (!BRefTarget_Ref(target_mem->shared_target)) {
+        goto fail0;
+    }
+    
+    struct NCDVal__sharedref *sr_e = buffer_at(mem, idx);
+    sr_e->type = make_type(internal_type, get_depth(target_type));
+    sr_e->target_idx = target_idx;
+    sr_e->target_mem = target_mem;
+    sr_e->ref.target = target_mem->shared_target;
+    
+    register_ref(mem, idx + offsetof(struct NCDVal__sharedref, ref), &sr_e->ref);
     
+    return make_ref(mem, idx);
+    
+fail0:
+    return NCDVal_NewInvalid();
+}
+
+static void mem_free_contents (NCDValMem *o)
+{
     NCDVal__idx refidx = o->first_ref;
     while (refidx != -1) {
         struct NCDVal__ref *ref = buffer_at(o, refidx);
@@ -396,11 +581,42 @@ void NCDValMem_Free (NCDValMem *o)
     }
 }
 
+static void sharedmem_release (BRefTarget *ref_target)
+{
+    struct NCDVal__sharedmem *sm = UPPER_OBJECT(ref_target, struct NCDVal__sharedmem, ref_target);
+    
+    mem_free_contents(&sm->mem);
+    BFree(sm);
+}
+
+#include "NCDVal_maptree.h"
+#include <structure/CAvl_impl.h>
+
+void NCDValMem_Init (NCDValMem *o, NCDStringIndex *string_index)
+{
+    ASSERT(string_index)
+    
+    o->string_index = string_index;
+    o->shared_target = NULL;
+    o->size = NCDVAL_FASTBUF_SIZE;
+    o->used = 0;
+    o->first_ref = -1;
+}
+
+void NCDValMem_Free (NCDValMem *o)
+{
+    assert_mem(o);
+    ASSERT(!o->shared_target)
+    
+    mem_free_contents(o);
+}
+
 int NCDValMem_InitCopy (NCDValMem *o, NCDValMem *other)
 {
     assert_mem(other);
     
     o->string_index = other->string_index;
+    o->shared_target = NULL;
     o->size = other->size;
     o->used = other->used;
     o->first_ref = other->first_ref;
@@ -441,6 +657,41 @@ fail0:
     return 0;
 }
 
+NCDValMem * NCDValMem_Share (NCDValMem *o)
+{
+    assert_mem(o);
+    ASSERT(!o->shared_target)
+    
+    struct NCDVal__sharedmem *sm = BAlloc(sizeof(*sm));
+    if (!sm) {
+        return NULL;
+    }
+    
+    // Values are addressed by offsets within the memory object, so moving it
+    // is just a matter of copying the structure (including any fast buffer).
+    sm->mem = *o;
+    
+    BRefTarget_Init(&sm->ref_target, sharedmem_release);
+    sm->mem.shared_target = &sm->ref_target;
+    
+    return &sm->mem;
+}
+
+void NCDValMem_ReleaseShared (NCDValMem *o)
+{
+    assert_mem(o);
+    ASSERT(o->shared_target)
+    
+    BRefTarget_Deref(o->shared_target);
+}
+
+int NCDValMem_IsShared (NCDValMem *o)
+{
+    assert_mem(o);
+    
+    return !!o->shared_target;
+}
+
 NCDStringIndex * NCDValMem_StringIndex (NCDValMem *o)
 {
     assert_mem(o);
@@ -515,6 +766,13 @@ NCDValRef NCDVal_NewCopy (NCDValMem *mem, NCDValRef val)
     void *ptr = buffer_at(val.mem, val.idx);
     
     switch (get_internal_type(*(int *)ptr)) {
+        case SHAREDLIST_TYPE:
+        case SHAREDMAP_TYPE: {
+            struct NCDVal__sharedref *sr_e = ptr;
+            
+            return make_shared_ref(mem, sr_e->target_mem, sr_e->target_idx);
+        } break;
+        
         case STOREDSTRING_TYPE: {
             struct NCDVal__string *str_e = ptr;
             
@@ -533,6 +791,11 @@ NCDValRef NCDVal_NewCopy (NCDValMem *mem, NCDValRef val)
         } break;
         
         case NCDVAL_LIST: {
+            // lists and maps in an immutable memory object are shared, not copied
+            if (val.mem->shared_target) {
+                return make_shared_ref(mem, val.mem, val.idx);
+            }
+            
             struct NCDVal__list *list_e = ptr;
             
             NCDVal__idx size = sizeof(struct NCDVal__list) + list_e->maxcount * sizeof(NCDVal__idx);
@@ -564,6 +827,10 @@ NCDValRef NCDVal_NewCopy (NCDValMem *mem, NCDValRef val)
         } break;
         
         case NCDVAL_MAP: {
+            if (val.mem->shared_target) {
+                return make_shared_ref(mem, val.mem, val.idx);
+            }
+            
             size_t count = NCDVal_MapCount(val);
             
             NCDValRef copy = NCDVal_NewMap(mem, count);
@@ -630,6 +897,15 @@ int NCDVal_Compare (NCDValRef val1, NCDValRef val2)
         return (type1 > type2) - (type1 < type2);
     }
     
+    // references to the same shared value are trivially equal
+    if (type1 == NCDVAL_LIST || type1 == NCDVAL_MAP) {
+        val1 = resolve_shared(val1);
+        val2 = resolve_shared(val2);
+        if (val1.mem == val2.mem && val1.idx == val2.idx) {
+            return 0;
+        }
+    }
+    
     switch (type1) {
         case NCDVAL_STRING: {
             size_t len1 = NCDVal_StringLength(val1);
@@ -707,6 +983,55 @@ int NCDVal_Compare (NCDValRef val1, NCDValRef val2)
     }
 }
 
+size_t NCDVal_Hash (NCDValRef val)
+{
+    assert_val(val);
+    
+    switch (NCDVal_Type(val)) {
+        case NCDVAL_STRING: {
+            MemRef data = NCDVal_StringMemRef(val);
+            size_t h = 2166136261u;
+            for (size_t i = 0; i < data.len; i++) {
+                h ^= (uint8_t)data.ptr[i];
+                h *= 16777619u;
+            }
+            return h;
+        } break;
+        
+        case NCDVAL_LIST: {
+            size_t count = NCDVal_ListCount(val);
+            size_t h = count * 2654435761u + 1;
+            
+            for (size_t i = 0; i < count; i++) {
+                h = h * 31 + NCDVal_Hash(NCDVal_ListGet(val, i));
+            }
+            
+            return h;
+        } break;
+        
+        case NCDVAL_MAP: {
+            size_t h = NCDVal_MapCount(val) * 2654435761u + 2;
+            
+            // entries are combined independently of their order, which
+            // differs between equal maps
+            for (NCDValMapElem e = NCDVal_MapFirst(val); !NCDVal_MapElemInvalid(e); e = NCDVal_MapNext(val, e)) {
+                size_t eh = NCDVal_Hash(NCDVal_MapElemKey(val, e)) * 31 + NCDVal_Hash(NCDVal_MapElemVal(val, e));
+                h += eh ^ (eh >> 16);
+            }
+            
+            return h;
+        } break;
+        
+        case NCDVAL_PLACEHOLDER: {
+            return (size_t)NCDVal_PlaceholderId(val) * 2654435761u + 3;
+        } break;
+        
+        default:
+            ASSERT(0);
+            return 0;
+    }
+}
+
 NCDValSafeRef NCDVal_ToSafe (NCDValRef val)
 {
     NCDVal_Assert(val);
@@ -1192,9 +1517,11 @@ int NCDVal_ListAppend (NCDValRef list, NCDValRef elem)
     ASSERT(NCDVal_IsList(list))
     ASSERT(NCDVal_ListCount(list) < NCDVal_ListMaxCount(list))
     ASSERT(elem.mem == list.mem)
+    ASSERT(!list.mem->shared_target)
     assert_val_only(list.mem, elem.idx);
     
     struct NCDVal__list *list_e = buffer_at(list.mem, list.idx);
+    ASSERT(get_internal_type(list_e->type) == NCDVAL_LIST)
     
     int new_type = list_e->type;
     if (!bump_depth(&new_type, get_val_depth(elem))) {
@@ -1211,6 +1538,8 @@ size_t NCDVal_ListCount (NCDValRef list)
 {
     ASSERT(NCDVal_IsList(list))
     
+    list = resolve_shared(list);
+    
     struct NCDVal__list *list_e = buffer_at(list.mem, list.idx);
     
     return list_e->count;
@@ -1220,6 +1549,8 @@ size_t NCDVal_ListMaxCount (NCDValRef list)
 {
     ASSERT(NCDVal_IsList(list))
     
+    list = resolve_shared(list);
+    
     struct NCDVal__list *list_e = buffer_at(list.mem, list.idx);
     
     return list_e->maxcount;
@@ -1230,6 +1561,8 @@ NCDValRef NCDVal_ListGet (NCDValRef list, size_t pos)
     ASSERT(NCDVal_IsList(list))
     ASSERT(pos < NCDVal_ListCount(list))
     
+    list = resolve_shared(list);
+    
     struct NCDVal__list *list_e = buffer_at(list.mem, list.idx);
     
     ASSERT(pos < list_e->count)
@@ -1243,6 +1576,8 @@ int NCDVal_ListRead (NCDValRef list, int num, ...)
     ASSERT(NCDVal_IsList(list))
     ASSERT(num >= 0)
     
+    list = resolve_shared(list);
+    
     struct NCDVal__list *list_e = buffer_at(list.mem, list.idx);
     
     if (num != list_e->count) {
@@ -1268,6 +1603,8 @@ int NCDVal_ListReadStart (NCDValRef list, int start, int num, ...)
     ASSERT(start <= NCDVal_ListCount(list))
     ASSERT(num >= 0)
     
+    list = resolve_shared(list);
+    
     struct NCDVal__list *list_e = buffer_at(list.mem, list.idx);
     
     if (num != list_e->count - start) {
@@ -1292,6 +1629,8 @@ int NCDVal_ListReadHead (NCDValRef list, int num, ...)
     ASSERT(NCDVal_IsList(list))
     ASSERT(num >= 0)
     
+    list = resolve_shared(list);
+    
     struct NCDVal__list *list_e = buffer_at(list.mem, list.idx);
     
     if (num > list_e->count) {
@@ -1327,6 +1666,26 @@ NCDValRef NCDVal_NewMap (NCDValMem *mem, size_t maxcount)
     }
     
     NCDVal__idx size = sizeof(struct NCDVal__map) + maxcount * sizeof(struct NCDVal__mapelem);
+    
+    // Reserve space for a hash index in maps which may become large. It is
+    // only built on the first lookup, but the space must be allocated now,
+    // since lookups must not move the memory buffer.
+    NCDVal__idx hash_size = 0;
+    if (maxcount >= NCDVAL_MAP_HASH_MIN) {
+        hash_size = 1;
+        while (hash_size < 2 * maxcount) {
+            if (hash_size > NCDVAL_MAXIDX / 2) {
+                goto fail;
+            }
+            hash_size *= 2;
+        }
+        
+        if (hash_size > (NCDVAL_MAXIDX - size) / sizeof(struct NCDVal__maphashent)) {
+            goto fail;
+        }
+        size += hash_size * sizeof(struct NCDVal__maphashent);
+    }
+    
     NCDVal__idx idx = buffer_allocate(mem, size, __alignof(struct NCDVal__map));
     if (idx < 0) {
         goto fail;
@@ -1336,6 +1695,8 @@ NCDValRef NCDVal_NewMap (NCDValMem *mem, size_t maxcount)
     map_e->type = make_type(NCDVAL_MAP, 0);
     map_e->maxcount = maxcount;
     map_e->count = 0;
+    map_e->hash_size = hash_size;
+    map_e->hash_built = 0;
     NCDVal__MapTree_Init(&map_e->tree);
     
     return make_ref(mem, idx);
@@ -1350,10 +1711,12 @@ int NCDVal_MapInsert (NCDValRef map, NCDValRef key, NCDValRef val, int *out_inse
     ASSERT(NCDVal_MapCount(map) < NCDVal_MapMaxCount(map))
     ASSERT(key.mem == map.mem)
     ASSERT(val.mem == map.mem)
+    ASSERT(!map.mem->shared_target)
     assert_val_only(map.mem, key.idx);
     assert_val_only(map.mem, val.idx);
     
     struct NCDVal__map *map_e = buffer_at(map.mem, map.idx);
+    ASSERT(get_internal_type(map_e->type) == NCDVAL_MAP)
     
     int new_type = map_e->type;
     if (!bump_depth(&new_type, get_val_depth(key)) || !bump_depth(&new_type, get_val_depth(val))) {
@@ -1378,6 +1741,10 @@ int NCDVal_MapInsert (NCDValRef map, NCDValRef key, NCDValRef val, int *out_inse
     map_e->type = new_type;
     map_e->count++;
     
+    if (map_e->hash_built) {
+        map_hash_add(map.mem, map_e, map_e->count - 1);
+    }
+    
     if (out_inserted) {
         *out_inserted = 1;
     }
@@ -1391,6 +1758,8 @@ size_t NCDVal_MapCount (NCDValRef map)
 {
     ASSERT(NCDVal_IsMap(map))
     
+    map = resolve_shared(map);
+    
     struct NCDVal__map *map_e = buffer_at(map.mem, map.idx);
     
     return map_e->count;
@@ -1400,6 +1769,8 @@ size_t NCDVal_MapMaxCount (NCDValRef map)
 {
     ASSERT(NCDVal_IsMap(map))
     
+    map = resolve_shared(map);
+    
     struct NCDVal__map *map_e = buffer_at(map.mem, map.idx);
     
     return map_e->maxcount;
@@ -1416,6 +1787,8 @@ NCDValMapElem NCDVal_MapFirst (NCDValRef map)
 {
     ASSERT(NCDVal_IsMap(map))
     
+    map = resolve_shared(map);
+    
     struct NCDVal__map *map_e = buffer_at(map.mem, map.idx);
     
     if (map_e->count == 0) {
@@ -1430,6 +1803,9 @@ NCDValMapElem NCDVal_MapFirst (NCDValRef map)
 
 NCDValMapElem NCDVal_MapNext (NCDValRef map, NCDValMapElem me)
 {
+    ASSERT(NCDVal_IsMap(map))
+    
+    map = resolve_shared(map);
     assert_map_elem(map, me);
     
     struct NCDVal__map *map_e = buffer_at(map.mem, map.idx);
@@ -1452,6 +1828,8 @@ NCDValMapElem NCDVal_MapOrderedFirst (NCDValRef map)
 {
     ASSERT(NCDVal_IsMap(map))
     
+    map = resolve_shared(map);
+    
     struct NCDVal__map *map_e = buffer_at(map.mem, map.idx);
     
     NCDVal__MapTreeRef ref = NCDVal__MapTree_GetFirst(&map_e->tree, map.mem);
@@ -1462,6 +1840,9 @@ NCDValMapElem NCDVal_MapOrderedFirst (NCDValRef map)
 
 NCDValMapElem NCDVal_MapOrderedNext (NCDValRef map, NCDValMapElem me)
 {
+    ASSERT(NCDVal_IsMap(map))
+    
+    map = resolve_shared(map);
     assert_map_elem(map, me);
     
     struct NCDVal__map *map_e = buffer_at(map.mem, map.idx);
@@ -1474,6 +1855,9 @@ NCDValMapElem NCDVal_MapOrderedNext (NCDValRef map, NCDValMapElem me)
 
 NCDValRef NCDVal_MapElemKey (NCDValRef map, NCDValMapElem me)
 {
+    ASSERT(NCDVal_IsMap(map))
+    
+    map = resolve_shared(map);
     assert_map_elem(map, me);
     
     struct NCDVal__mapelem *me_e = buffer_at(map.mem, me.elemidx);
@@ -1483,6 +1867,9 @@ NCDValRef NCDVal_MapElemKey (NCDValRef map, NCDValMapElem me)
 
 NCDValRef NCDVal_MapElemVal (NCDValRef map, NCDValMapElem me)
 {
+    ASSERT(NCDVal_IsMap(map))
+    
+    map = resolve_shared(map);
     assert_map_elem(map, me);
     
     struct NCDVal__mapelem *me_e = buffer_at(map.mem, me.elemidx);
@@ -1495,8 +1882,27 @@ NCDValMapElem NCDVal_MapFindKey (NCDValRef map, NCDValRef key)
     ASSERT(NCDVal_IsMap(map))
     assert_val(key);
     
+    map = resolve_shared(map);
+    
     struct NCDVal__map *map_e = buffer_at(map.mem, map.idx);
     
+    if (map_e->hash_size > 0 && map_e->count >= NCDVAL_MAP_HASH_MIN) {
+        // The index is a cache which is not observable through the API, so
+        // it is built on first use even if the memory object is shared.
+        // This is safe because values are only ever accessed from the
+        // thread owning them, and copies of shared maps refer to the shared
+        // memory object instead of duplicating the map.
+        if (!map_e->hash_built) {
+            map_hash_build(map.mem, map_e);
+        }
+        
+        NCDVal__idx elemidx = map_hash_lookup(map, map_e, key);
+        ASSERT(elemidx == -1 || (assert_map_elem_only(map, elemidx), 1))
+        ASSERT(elemidx == NCDVal__MapTree_LookupExact(&map_e->tree, map.mem, key).link)
+        
+        return make_map_elem(elemidx);
+    }
+    
     NCDVal__MapTreeRef ref = NCDVal__MapTree_LookupExact(&map_e->tree, map.mem, key);
     ASSERT(ref.link == -1 || (assert_map_elem_only(map, ref.link), 1))
     
@@ -1510,6 +1916,7 @@ NCDValRef NCDVal_MapGetValue (NCDValRef map, const char *key_str)
     
     NCDValMem mem;
     mem.string_index = map.mem->string_index;
+    mem.shared_target = NULL;
     mem.size = NCDVAL_FASTBUF_SIZE;
     mem.used = sizeof(struct NCDVal__externalstring);
     mem.first_ref = -1;
@@ -1545,7 +1952,9 @@ static void replaceprog_build_recurser (NCDValMem *mem, NCDVal__idx idx, size_t
     switch (get_internal_type(*((int *)(ptr)))) {
         case STOREDSTRING_TYPE:
         case IDSTRING_TYPE:
-        case EXTERNALSTRING_TYPE: {
+        case EXTERNALSTRING_TYPE:
+        case SHAREDLIST_TYPE:
+        case SHAREDMAP_TYPE: {
         } break;
         
         case NCDVAL_LIST: {
@@ -1728,6 +2137,9 @@ int NCDValReplaceProg_Execute (NCDValReplaceProg prog, NCDValMem *mem, NCDVal_re
                     BLog(BLOG_ERROR, "duplicate key in map");
                     return 0;
                 }
+                
+                // the key has changed, so any hash index is stale
+                map_e->hash_built = 0;
             } break;
             
             case NCDVAL_INSTR_BUMPDEPTH: {
@@ -83,6 +83,40 @@ void NCDValMem_Free (NCDValMem *o);
  */
 int NCDValMem_InitCopy (NCDValMem *o, NCDValMem *other) WARN_UNUSED;
 
+/**
+ * Turns a value memory object into an immutable, reference-counted shared
+ * memory object, and returns a pointer to it. On success, the original memory
+ * object is consumed and must not be used or freed; references into it must
+ * be converted using {@link NCDVal_Moved} or {@link NCDVal_FromSafe} with the
+ * returned pointer.
+ * 
+ * Lists and maps within a shared memory object are never copied;
+ * {@link NCDVal_NewCopy} instead creates a small reference to them, which
+ * keeps the shared memory object alive for as long as it exists. Accessing
+ * elements through such a reference yields references into the shared memory
+ * object. Nothing may be added to a shared memory object; the only thing
+ * still written to it is the hash index of large maps, which is built on the
+ * first lookup (see {@link NCDVal_MapFindKey}).
+ * 
+ * The caller owns one reference, which it must release using
+ * {@link NCDValMem_ReleaseShared} (and not {@link NCDValMem_Free}).
+ * Returns NULL on failure, in which case the original is unchanged.
+ */
+NCDValMem * NCDValMem_Share (NCDValMem *o) WARN_UNUSED;
+
+/**
+ * Releases the caller's reference to a shared memory object obtained from
+ * {@link NCDValMem_Share}. The memory object is freed once no copies of its
+ * values refer to it anymore.
+ */
+void NCDValMem_ReleaseShared (NCDValMem *o);
+
+/**
+ * Determines if a value memory object is a shared memory object obtained from
+ * {@link NCDValMem_Share}.
+ */
+int NCDValMem_IsShared (NCDValMem *o);
+
 /**
  * Get the string index of a value memory object.
  */
@@ -146,6 +180,8 @@ int NCDVal_PlaceholderId (NCDValRef val);
  * object (including 'mem').
  * Returns a reference to the copied value. On out of memory, returns
  * an invalid reference.
+ * Lists and maps within shared memory objects (see {@link NCDValMem_Share})
+ * are not copied, but referenced, in constant time.
  */
 NCDValRef NCDVal_NewCopy (NCDValMem *mem, NCDValRef val);
 
@@ -155,6 +191,13 @@ NCDValRef NCDVal_NewCopy (NCDValMem *mem, NCDValRef val);
  */
 int NCDVal_Compare (NCDValRef val1, NCDValRef val2);
 
+/**
+ * Computes a hash of a value, which must not be an invalid reference.
+ * Values which are equal according to {@link NCDVal_Compare} have equal
+ * hashes. This takes time linear in the size of the value.
+ */
+size_t NCDVal_Hash (NCDValRef val);
+
 /**
  * Converts a value reference to a safe referece format, which remains valid
  * if the memory object is moved (safe references do not contain a pointer
@@ -419,6 +462,10 @@ size_t NCDVal_ListMaxCount (NCDValRef list);
  * The 'list' reference must point to a list value.
  * The position 'pos' must refer to an existing element, i.e.
  * pos < NCDVal_ListCount().
+ * If the list was obtained by copying a list from a shared memory object,
+ * the returned reference points into that shared memory object, and not
+ * into the memory object of 'list'. The same is true for all other functions
+ * returning list elements or map keys and values.
  */
 NCDValRef NCDVal_ListGet (NCDValRef list, size_t pos);
 
@@ -455,6 +502,8 @@ int NCDVal_IsMap (NCDValRef val);
  * Builds a new map value. The 'maxcount' argument specifies how
  * many entry slots to preallocate. Not more than that many
  * entries may be inserted to the map using {@link NCDVal_MapInsert}.
+ * For larger 'maxcount', space for a hash index is also reserved;
+ * see {@link NCDVal_MapFindKey}.
  * Returns a reference to the new value, or an invalid reference
  * on out of memory.
  */
@@ -545,6 +594,10 @@ NCDValRef NCDVal_MapElemVal (NCDValRef map, NCDValMapElem me);
  * If the key exists in the map, returns a reference to the corresponding
  * map entry.
  * If the key does not exist, returns an invalid map entry reference.
+ * For large maps, the first lookup builds a hash index of the keys in
+ * space reserved by {@link NCDVal_NewMap}, so lookups never allocate
+ * memory or move values. This also happens for maps in shared memory
+ * objects.
  */
 NCDValMapElem NCDVal_MapFindKey (NCDValRef map, NCDValRef key);
 
@@ -33,6 +33,7 @@
 #include <stddef.h>
 
 #include <misc/maxalign.h>
+#include <misc/BRefTarget.h>
 
 #define NCDVAL_FASTBUF_SIZE 64
 #define NCDVAL_MAXIDX INT_MAX
@@ -43,6 +44,7 @@ typedef int NCDVal__idx;
 
 typedef struct {
     NCDStringIndex *string_index;
+    BRefTarget *shared_target;
     NCDVal__idx size;
     NCDVal__idx used;
     NCDVal__idx first_ref;
@@ -35,12 +35,14 @@
 #include <base/BLog.h>
 #include <system/BTime.h>
 #include <system/BReactor.h>
+#include <threadwork/BThreadWork.h>
 #include <ncd/NCDInterpreter.h>
 #include <ncd/NCDConfigParser.h>
 
 #include <generated/blog_channel_ncd.h>
 
 static BReactor reactor;
+static BThreadWorkDispatcher twd;
 static int running;
 static NCDInterpreter interpreter;
 
@@ -66,6 +68,12 @@ int main ()
     
     BReactor_EmscriptenInit(&reactor);
     
+    // there are no threads, works are done in the event loop
+    if (!BThreadWorkDispatcher_Init(&twd, &reactor, 0)) {
+        fprintf(stderr, "--- BThreadWorkDispatcher_Init failed ---\n");
+        return 1;
+    }
+    
     running = 0;
     
     return 0;
@@ -109,7 +117,9 @@ void emncd_start (const char *program_text, int loglevel)
     params.retry_time = 5000;
     params.extra_args = NULL;
     params.num_extra_args = 0;
+    params.profile = 0;
     params.reactor = &reactor;
+    params.twd = &twd;
     
     if (!NCDInterpreter_Init(&interpreter, program, params)) {
         fprintf(stderr, "--- failed to initialize the interpreter ---\n");
@@ -60,23 +60,37 @@
 #include <misc/offset.h>
 #include <misc/debug.h>
 #include <misc/balloc.h>
+#include <misc/hashfun.h>
 #include <structure/LinkedList1.h>
 #include <structure/LinkedList3.h>
+#include <structure/CHash.h>
 
 #include <ncd/module_common.h>
 
 #include <generated/blog_channel_ncd_depend.h>
 
+#define INITIAL_HASH_BUCKETS 16
+
+struct provide;
+struct depend;
+
+#include "depend_phash.h"
+#include <structure/CHash_decl.h>
+
+#include "depend_dhash.h"
+#include <structure/CHash_decl.h>
+
 struct provide {
     NCDModuleInst *i;
     MemRef name;
+    size_t name_hash;
     int is_queued;
     union {
         struct {
             LinkedList3Node queued_node; // node in list which begins with provide.queued_provides_firstnode
         };
         struct {
-            LinkedList1Node provides_node; // node in provides
+            struct provide *hash_next; // node in provides_hash
             LinkedList1 depends;
             LinkedList3Node queued_provides_firstnode;
             int dying;
@@ -87,27 +101,129 @@ struct provide {
 struct depend {
     NCDModuleInst *i;
     MemRef name;
+    size_t name_hash;
     struct provide *p;
-    LinkedList1Node node;
+    LinkedList1Node node; // node in provide.depends if p!=NULL, else in the waiting list of the name
+    int is_head;
+    // if p==NULL and is_head, we represent our name in free_depends_hash
+    // and hold the list of depends waiting for it, in the order they started waiting
+    struct depend *hash_next;
+    LinkedList1 waiting;
 };
 
 struct global {
-    LinkedList1 provides;
-    LinkedList1 free_depends;
+    ProvidesHash provides_hash;
+    size_t num_provides;
+    FreeDependsHash free_depends_hash;
+    size_t num_free_names;
 };
 
+#include "depend_phash.h"
+#include <structure/CHash_impl.h>
+
+#include "depend_dhash.h"
+#include <structure/CHash_impl.h>
+
+static size_t hash_name (MemRef name)
+{
+    return badvpn_djb2_hash_bin((const uint8_t *)name.ptr, name.len);
+}
+
 static struct provide * find_provide (struct global *g, MemRef name)
 {
-    for (LinkedList1Node *n = LinkedList1_GetFirst(&g->provides); n; n = LinkedList1Node_Next(n)) {
-        struct provide *p = UPPER_OBJECT(n, struct provide, provides_node);
-        ASSERT(!p->is_queued)
+    ProvidesHashRef ref = ProvidesHash_Lookup(&g->provides_hash, 0, name);
+    ASSERT(!ref.ptr || !ref.ptr->is_queued)
+    
+    return ref.ptr;
+}
+
+static void add_provide (struct global *g, struct provide *p)
+{
+    ProvidesHashRef ref = {p, p};
+    int res = ProvidesHash_Insert(&g->provides_hash, 0, ref, NULL);
+    ASSERT_EXECUTE(res)
+    g->num_provides++;
+    
+    // keep chains short; if this fails, lookups just get slower
+    if (g->num_provides > g->provides_hash.num_buckets) {
+        ProvidesHash_MultiplyBuckets(&g->provides_hash, 0, 1);
+    }
+}
+
+static void remove_provide (struct global *g, struct provide *p)
+{
+    ASSERT(g->num_provides > 0)
+    
+    ProvidesHashRef ref = {p, p};
+    ProvidesHash_Remove(&g->provides_hash, 0, ref);
+    g->num_provides--;
+}
+
+static void insert_free_head (struct global *g, struct depend *head)
+{
+    ASSERT(head->is_head)
+    
+    FreeDependsHashRef ref = {head, head};
+    int res = FreeDependsHash_Insert(&g->free_depends_hash, 0, ref, NULL);
+    ASSERT_EXECUTE(res)
+}
+
+static void add_free_depend (struct global *g, struct depend *d)
+{
+    // if others are waiting for this name, queue behind them
+    struct depend *head = FreeDependsHash_Lookup(&g->free_depends_hash, 0, d->name).ptr;
+    if (head) {
+        ASSERT(head->is_head)
         
-        if (MemRef_Equal(p->name, name)) {
-            return p;
-        }
+        d->is_head = 0;
+        LinkedList1_Append(&head->waiting, &d->node);
+        return;
+    }
+    
+    // otherwise we represent the name
+    d->is_head = 1;
+    LinkedList1_Init(&d->waiting);
+    LinkedList1_Append(&d->waiting, &d->node);
+    insert_free_head(g, d);
+    g->num_free_names++;
+    
+    // keep chains short; if this fails, lookups just get slower
+    if (g->num_free_names > g->free_depends_hash.num_buckets) {
+        FreeDependsHash_MultiplyBuckets(&g->free_depends_hash, 0, 1);
+    }
+}
+
+static void remove_free_depend (struct global *g, struct depend *d)
+{
+    ASSERT(g->num_free_names > 0)
+    
+    if (!d->is_head) {
+        struct depend *head = FreeDependsHash_Lookup(&g->free_depends_hash, 0, d->name).ptr;
+        ASSERT(head)
+        ASSERT(head->is_head)
+        
+        LinkedList1_Remove(&head->waiting, &d->node);
+        return;
+    }
+    
+    // remove from waiting list and free depends hash
+    LinkedList1_Remove(&d->waiting, &d->node);
+    FreeDependsHashRef ref = {d, d};
+    FreeDependsHash_Remove(&g->free_depends_hash, 0, ref);
+    
+    // if nobody else is waiting, forget the name
+    LinkedList1Node *n = LinkedList1_GetFirst(&d->waiting);
+    if (!n) {
+        g->num_free_names--;
+        return;
     }
     
-    return NULL;
+    // otherwise hand the list to the next depend in line
+    struct depend *next = UPPER_OBJECT(n, struct depend, node);
+    ASSERT(!next->is_head)
+    next->is_head = 1;
+    next->waiting = d->waiting;
+    insert_free_head(g, next);
 }
 
 static void provide_promote (struct provide *o)
@@ -118,8 +234,8 @@ static void provide_promote (struct provide *o)
     // set not queued
     o->is_queued = 0;
     
-    // insert to provides list
-    LinkedList1_Append(&g->provides, &o->provides_node);
+    // insert to provides hash
+    add_provide(g, o);
     
     // init depends list
     LinkedList1_Init(&o->depends);
@@ -127,31 +243,37 @@ static void provide_promote (struct provide *o)
     // set not dying
     o->dying = 0;
     
-    // attach free depends with this name
-    LinkedList1Node *n = LinkedList1_GetFirst(&g->free_depends);
-    while (n) {
-        LinkedList1Node *next = LinkedList1Node_Next(n);
-        struct depend *d = UPPER_OBJECT(n, struct depend, node);
-        ASSERT(!d->p)
-        
-        if (!MemRef_Equal(d->name, o->name)) {
-            n = next;
-            continue;
-        }
-        
-        // remove from free depends list
-        LinkedList1_Remove(&g->free_depends, &d->node);
+    // attach depends waiting for this name, in the order they started waiting
+    struct depend *head = FreeDependsHash_Lookup(&g->free_depends_hash, 0, o->name).ptr;
+    if (head) {
+        ASSERT(head->is_head)
         
-        // insert to provide's list
-        LinkedList1_Append(&o->depends, &d->node);
+        // remove name from free depends hash
+        FreeDependsHashRef ref = {head, head};
+        FreeDependsHash_Remove(&g->free_depends_hash, 0, ref);
+        g->num_free_names--;
         
-        // set provide
-        d->p = o;
+        LinkedList1Node *n;
+        while (n = LinkedList1_GetFirst(&head->waiting)) {
+            struct depend *d = UPPER_OBJECT(n, struct depend, node);
+            ASSERT(!d->p)
+            
+            // move to provide's list
+            LinkedList1_Remove(&head->waiting, &d->node);
+            LinkedList1_Append(&o->depends, &d->node);
+            
+            // set provide
+            d->is_head = 0;
+            d->p = o;
+        }
+    }
+    
+    // signal depends up
+    for (LinkedList1Node *n = LinkedList1_GetFirst(&o->depends); n; n = LinkedList1Node_Next(n)) {
+        struct depend *d = UPPER_OBJECT(n, struct depend, node);
+        ASSERT(d->p == o)
         
-        // signal up
         NCDModuleInst_Backend_Up(d->i);
-        
-        n = next;
     }
 }
 
@@ -167,20 +289,38 @@ static int func_globalinit (struct NCDInterpModuleGroup *group, const struct NCD
     // set group state pointer
     group->group_state = g;
     
-    // init provides list
-    LinkedList1_Init(&g->provides);
+    // init provides hash
+    if (!ProvidesHash_Init(&g->provides_hash, INITIAL_HASH_BUCKETS)) {
+        BLog(BLOG_ERROR, "ProvidesHash_Init failed");
+        goto fail1;
+    }
+    g->num_provides = 0;
     
-    // init free depends list
-    LinkedList1_Init(&g->free_depends);
+    // init free depends hash
+    if (!FreeDependsHash_Init(&g->free_depends_hash, INITIAL_HASH_BUCKETS)) {
+        BLog(BLOG_ERROR, "FreeDependsHash_Init failed");
+        goto fail2;
+    }
+    g->num_free_names = 0;
     
     return 1;
+    
+fail2:
+    ProvidesHash_Free(&g->provides_hash);
+fail1:
+    BFree(g);
+    return 0;
 }
 
 static void func_globalfree (struct NCDInterpModuleGroup *group)
 {
     struct global *g = group->group_state;
-    ASSERT(LinkedList1_IsEmpty(&g->free_depends))
-    ASSERT(LinkedList1_IsEmpty(&g->provides))
+    ASSERT(g->num_free_names == 0)
+    ASSERT(g->num_provides == 0)
+    
+    // free hashes
+    FreeDependsHash_Free(&g->free_depends_hash);
+    ProvidesHash_Free(&g->provides_hash);
     
     // free global state structure
     BFree(g);
@@ -203,6 +343,7 @@ static void provide_func_new_templ (void *vo, NCDModuleInst *i, const struct NCD
         goto fail0;
     }
     o->name = NCDVal_StringMemRef(name_arg);
+    o->name_hash = hash_name(o->name);
     
     // signal up.
     // This comes above provide_promote(), so that effects on related depend statements are
@@ -257,8 +398,8 @@ static void provide_free (struct provide *o)
         // remove from existing provide's queued provides list
         LinkedList3Node_Free(&o->queued_node);
     } else {
-        // remove from provides list
-        LinkedList1_Remove(&g->provides, &o->provides_node);
+        // remove from provides hash
+        remove_provide(g, o);
         
         // if we have provides queued, promote the first one
         if (LinkedList3Node_Next(&o->queued_provides_firstnode)) {
@@ -320,6 +461,7 @@ static void depend_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleI
         goto fail0;
     }
     o->name = NCDVal_StringMemRef(name_arg);
+    o->name_hash = hash_name(o->name);
     
     // find a provide with our name
     struct provide *p = find_provide(g, o->name);
@@ -335,8 +477,8 @@ static void depend_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleI
         // signal up
         NCDModuleInst_Backend_Up(o->i);
     } else {
-        // insert to free depends list
-        LinkedList1_Append(&g->free_depends, &o->node);
+        // insert to free depends hash
+        add_free_depend(g, o);
         
         // set no provide
         o->p = NULL;
@@ -362,8 +504,8 @@ static void depend_free (struct depend *o)
             provide_free(o->p);
         }
     } else {
-        // remove free depends list
-        LinkedList1_Remove(&g->free_depends, &o->node);
+        // remove from free depends hash
+        remove_free_depend(g, o);
     }
     
     NCDModuleInst_Backend_Dead(o->i);
@@ -391,8 +533,8 @@ static void depend_func_clean (void *vo)
     // remove from provide's list
     LinkedList1_Remove(&p->depends, &o->node);
     
-    // insert to free depends list
-    LinkedList1_Append(&g->free_depends, &o->node);
+    // insert to free depends hash
+    add_free_depend(g, o);
     
     // set no provide
     o->p = NULL;
@@ -0,0 +1,13 @@
+#define CHASH_PARAM_NAME FreeDependsHash
+#define CHASH_PARAM_ENTRY struct depend
+#define CHASH_PARAM_LINK struct depend *
+#define CHASH_PARAM_KEY MemRef
+#define CHASH_PARAM_ARG int
+#define CHASH_PARAM_NULL ((struct depend *)NULL)
+#define CHASH_PARAM_DEREF(arg, link) (link)
+#define CHASH_PARAM_ENTRYHASH(arg, entry) ((entry).ptr->name_hash)
+#define CHASH_PARAM_KEYHASH(arg, key) badvpn_djb2_hash_bin((const uint8_t *)(key).ptr, (key).len)
+#define CHASH_PARAM_ENTRYHASH_IS_CHEAP 1
+#define CHASH_PARAM_COMPARE_ENTRIES(arg, entry1, entry2) MemRef_Equal((entry1).ptr->name, (entry2).ptr->name)
+#define CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key1, entry2) MemRef_Equal((key1), (entry2).ptr->name)
+#define CHASH_PARAM_ENTRY_NEXT hash_next
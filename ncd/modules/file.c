@@ -38,10 +38,9 @@
  * 
  * Description:
  *   Reads the contents of a file. Reports an error if something goes wrong.
- *   WARNING: this uses fopen/fread/fclose, blocking the entire interpreter while
- *            the file is being read. For this reason, you should only use this
- *            to read small local files which will be read quickly, and especially
- *            not files on network mounts.
+ *   The file is read in a worker thread (see BThreadWorkDispatcher), and the
+ *   statement goes up once it has been read completely. Other processes keep
+ *   running meanwhile.
  * 
  * Synopsis:
  *   file_write(string filename, string contents)
@@ -54,10 +53,8 @@
  *            fails, the file may remain in an inconsistent state indefinitely.
  *            If this is a problem, you should write the new contents to a temporary
  *            file and rename this temporary file to the live file.
- *   WARNING: this uses fopen/fwrite/fclose, blocking the entire interpreter while
- *            the file is being written. For this reason, you should only use this
- *            to write small local files which will be written quickly, and especially
- *            not files on network mounts.
+ *   The file is written in a worker thread, like in file_read(), and the statement
+ *   goes up once it has been written completely.
  * 
  * Synopsis:
  *   file_stat(string filename)
@@ -86,15 +83,37 @@
 #include <misc/read_file.h>
 #include <misc/write_file.h>
 #include <misc/parse_number.h>
+#include <misc/balloc.h>
+#include <misc/offset.h>
+#include <misc/BRefTarget.h>
+#include <threadwork/BThreadWork.h>
 
 #include <ncd/module_common.h>
 
 #include <generated/blog_channel_ncd_file.h>
 
+struct read_data {
+    BRefTarget ref_target;
+    uint8_t *data;
+    size_t len;
+};
+
 struct read_instance {
     NCDModuleInst *i;
-    uint8_t *file_data;
-    size_t file_len;
+    NCDValNullTermString filename_nts;
+    BThreadWork work;
+    int working;
+    int succeeded;
+    struct read_data *rdata;
+};
+
+struct write_instance {
+    NCDModuleInst *i;
+    NCDValNullTermString filename_nts;
+    MemRef contents;
+    BThreadWork work;
+    int working;
+    int succeeded;
 };
 
 struct stat_instance {
@@ -103,6 +122,48 @@ struct stat_instance {
     struct stat result;
 };
 
+static void read_data_ref_target_func_release (BRefTarget *ref_target)
+{
+    struct read_data *rd = UPPER_OBJECT(ref_target, struct read_data, ref_target);
+    
+    free(rd->data);
+    BFree(rd);
+}
+
+static void read_work_func (struct read_instance *o)
+{
+    // this runs in a worker thread, so only touch the file and our own state
+    o->succeeded = read_file(o->filename_nts.data, &o->rdata->data, &o->rdata->len);
+}
+
+static void read_work_handler_done (struct read_instance *o)
+{
+    ASSERT(o->working)
+    
+    // free work
+    BThreadWork_Free(&o->work);
+    o->working = 0;
+    
+    if (!o->succeeded) {
+        ModuleLog(o->i, BLOG_ERROR, "failed to read file");
+        
+        // the data was never read, so nothing refers to it
+        BFree(o->rdata);
+        
+        // free name
+        NCDValNullTermString_Free(&o->filename_nts);
+        
+        NCDModuleInst_Backend_DeadError(o->i);
+        return;
+    }
+    
+    // the data now belongs to the reference target
+    BRefTarget_Init(&o->rdata->ref_target, read_data_ref_target_func_release);
+    
+    // signal up
+    NCDModuleInst_Backend_Up(o->i);
+}
+
 static void read_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleInst_new_params *params)
 {
     struct read_instance *o = vo;
@@ -120,24 +181,25 @@ static void read_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleIns
     }
     
     // get null terminated name
-    NCDValNullTermString filename_nts;
-    if (!NCDVal_StringNullTerminate(filename_arg, &filename_nts)) {
+    if (!NCDVal_StringNullTerminate(filename_arg, &o->filename_nts)) {
         ModuleLog(i, BLOG_ERROR, "NCDVal_StringNullTerminate failed");
         goto fail0;
     }
     
-    // read file
-    int res = read_file(filename_nts.data, &o->file_data, &o->file_len);
-    NCDValNullTermString_Free(&filename_nts);
-    if (!res) {
-        ModuleLog(i, BLOG_ERROR, "failed to read file");
-        goto fail0;
+    // allocate data holder
+    if (!(o->rdata = BAlloc(sizeof(*o->rdata)))) {
+        ModuleLog(i, BLOG_ERROR, "BAlloc failed");
+        goto fail1;
     }
     
-    // signal up
-    NCDModuleInst_Backend_Up(i);
+    // read the file in a worker thread
+    o->succeeded = 0;
+    BThreadWork_Init(&o->work, i->params->iparams->twd, (BThreadWork_handler_done)read_work_handler_done, o, (BThreadWork_work_func)read_work_func, o);
+    o->working = 1;
     return;
     
+fail1:
+    NCDValNullTermString_Free(&o->filename_nts);
 fail0:
     NCDModuleInst_Backend_DeadError(i);
 }
@@ -146,8 +208,23 @@ static void read_func_die (void *vo)
 {
     struct read_instance *o = vo;
     
-    // free data
-    free(o->file_data);
+    if (o->working) {
+        // stop reading, waiting for the worker if it is busy with our file
+        BThreadWork_Free(&o->work);
+        
+        // free any data it read, nothing refers to it yet
+        if (o->succeeded) {
+            free(o->rdata->data);
+        }
+        BFree(o->rdata);
+    }
+    else {
+        // release our reference to the data
+        BRefTarget_Deref(&o->rdata->ref_target);
+    }
+    
+    // free name
+    NCDValNullTermString_Free(&o->filename_nts);
     
     NCDModuleInst_Backend_Dead(o->i);
 }
@@ -157,15 +234,46 @@ static int read_func_getvar2 (void *vo, NCD_string_id_t name, NCDValMem *mem, NC
     struct read_instance *o = vo;
     
     if (name == NCD_STRING_EMPTY) {
-        *out = NCDVal_NewStringBin(mem, o->file_data, o->file_len);
+        *out = NCDVal_NewExternalString(mem, (const char *)o->rdata->data, o->rdata->len, &o->rdata->ref_target);
         return 1;
     }
     
     return 0;
 }
 
-static void write_func_new (void *unused, NCDModuleInst *i, const struct NCDModuleInst_new_params *params)
+static void write_work_func (struct write_instance *o)
+{
+    // this runs in a worker thread, so only touch the file and our own state
+    o->succeeded = write_file(o->filename_nts.data, o->contents);
+}
+
+static void write_work_handler_done (struct write_instance *o)
+{
+    ASSERT(o->working)
+    
+    // free work
+    BThreadWork_Free(&o->work);
+    o->working = 0;
+    
+    if (!o->succeeded) {
+        ModuleLog(o->i, BLOG_ERROR, "failed to write file");
+        
+        // free name
+        NCDValNullTermString_Free(&o->filename_nts);
+        
+        NCDModuleInst_Backend_DeadError(o->i);
+        return;
+    }
+    
+    // signal up
+    NCDModuleInst_Backend_Up(o->i);
+}
+
+static void write_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleInst_new_params *params)
 {
+    struct write_instance *o = vo;
+    o->i = i;
+    
     // read arguments
     NCDValRef filename_arg;
     NCDValRef contents_arg;
@@ -179,28 +287,39 @@ static void write_func_new (void *unused, NCDModuleInst *i, const struct NCDModu
     }
     
     // get null terminated name
-    NCDValNullTermString filename_nts;
-    if (!NCDVal_StringNullTerminate(filename_arg, &filename_nts)) {
+    if (!NCDVal_StringNullTerminate(filename_arg, &o->filename_nts)) {
         ModuleLog(i, BLOG_ERROR, "NCDVal_StringNullTerminate failed");
         goto fail0;
     }
     
-    // write file
-    int res = write_file(filename_nts.data, NCDVal_StringMemRef(contents_arg));
-    NCDValNullTermString_Free(&filename_nts);
-    if (!res) {
-        ModuleLog(i, BLOG_ERROR, "failed to write file");
-        goto fail0;
-    }
+    // the arguments stay unchanged while we exist, so the worker can use them
+    o->contents = NCDVal_StringMemRef(contents_arg);
     
-    // signal up
-    NCDModuleInst_Backend_Up(i);
+    // write the file in a worker thread
+    o->succeeded = 0;
+    BThreadWork_Init(&o->work, i->params->iparams->twd, (BThreadWork_handler_done)write_work_handler_done, o, (BThreadWork_work_func)write_work_func, o);
+    o->working = 1;
     return;
     
 fail0:
     NCDModuleInst_Backend_DeadError(i);
 }
 
+static void write_func_die (void *vo)
+{
+    struct write_instance *o = vo;
+    
+    // stop writing, waiting for the worker if it is busy with our file
+    if (o->working) {
+        BThreadWork_Free(&o->work);
+    }
+    
+    // free name
+    NCDValNullTermString_Free(&o->filename_nts);
+    
+    NCDModuleInst_Backend_Dead(o->i);
+}
+
 static void stat_func_new_common (void *vo, NCDModuleInst *i, const struct NCDModuleInst_new_params *params, int is_lstat)
 {
     struct stat_instance *o = vo;
@@ -321,7 +440,9 @@ static struct NCDModule modules[] = {
         .alloc_size = sizeof(struct read_instance)
     }, {
         .type = "file_write",
-        .func_new2 = write_func_new
+        .func_new2 = write_func_new,
+        .func_die = write_func_die,
+        .alloc_size = sizeof(struct write_instance)
     }, {
         .type = "file_stat",
         .func_new2 = stat_func_new,
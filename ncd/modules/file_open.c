@@ -60,6 +60,9 @@
  * 
  * Description:
  *   Reads data from an opened file. The file must not be in error state.
+ *   The data is read in a worker thread (see BThreadWorkDispatcher), and the
+ *   statement goes up once it has been read. If write(), seek(), close() or another
+ *   read() is done on the file before that, it first waits for this read to finish.
  *   If reading fails, this statement will never go up, the error state of the
  *   file_open() statement will be set, and the file_open() statement will trigger
  *   backtracking (go down and up).
@@ -106,6 +109,7 @@
 #include <misc/balloc.h>
 #include <misc/parse_number.h>
 #include <ncd/extra/NCDBuf.h>
+#include <threadwork/BThreadWork.h>
 
 #include <ncd/module_common.h>
 
@@ -113,16 +117,24 @@
 
 #define READ_BUF_SIZE 8192
 
+struct read_instance;
+
 struct open_instance {
     NCDModuleInst *i;
     FILE *fh;
     NCDBufStore store;
+    struct read_instance *reading;
 };
 
 struct read_instance {
     NCDModuleInst *i;
+    struct open_instance *open_inst;
     NCDBuf *buf;
+    size_t buf_size;
     size_t length;
+    int read_error;
+    int work_done;
+    BThreadWork work;
 };
 
 static int parse_mode (MemRef mr, char *out)
@@ -186,6 +198,76 @@ static void trigger_error (struct open_instance *o)
     NCDModuleInst_Backend_Up(o->i);
 }
 
+static void read_work_func (struct read_instance *o)
+{
+    // this runs in a worker thread; the file is not used by anyone else until
+    // the read is finished
+    FILE *fh = o->open_inst->fh;
+    char *data = NCDBuf_Data(o->buf);
+    
+    while (o->length < o->buf_size) {
+        // read
+        size_t readed = fread(data + o->length, 1, o->buf_size - o->length, fh);
+        if (readed == 0) {
+            break;
+        }
+        ASSERT(readed <= o->buf_size - o->length)
+        
+        // increment length
+        o->length += readed;
+    }
+    
+    // we couldn't read anything due to an error
+    o->read_error = (o->length == 0 && !feof(fh));
+    
+    o->work_done = 1;
+}
+
+static void read_complete (struct read_instance *o)
+{
+    struct open_instance *open_inst = o->open_inst;
+    ASSERT(open_inst->reading == o)
+    ASSERT(o->work_done)
+    
+    // the file is available to others again
+    open_inst->reading = NULL;
+    o->open_inst = NULL;
+    
+    // if reading failed, trigger error in the open instance, and don't go up
+    if (o->read_error) {
+        ModuleLog(o->i, BLOG_ERROR, "fread failed");
+        trigger_error(open_inst);
+        return;
+    }
+    
+    // go up
+    NCDModuleInst_Backend_Up(o->i);
+}
+
+static void read_work_handler_done (struct read_instance *o)
+{
+    // free work
+    BThreadWork_Free(&o->work);
+    
+    read_complete(o);
+}
+
+static void finish_reading (struct open_instance *o)
+{
+    struct read_instance *r = o->reading;
+    if (!r) {
+        return;
+    }
+    
+    // wait for the worker, or do the read here if it hasn't started it yet
+    BThreadWork_Free(&r->work);
+    if (!r->work_done) {
+        read_work_func(r);
+    }
+    
+    read_complete(r);
+}
+
 static void open_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleInst_new_params *params)
 {
     struct open_instance *o = vo;
@@ -241,6 +323,9 @@ static void open_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleIns
     // init store
     NCDBufStore_Init(&o->store, read_size_opt);
     
+    // set not reading
+    o->reading = NULL;
+    
     // null terminate filename
     NCDValNullTermString filename_nts;
     if (!NCDVal_StringNullTerminate(filename_arg, &filename_nts)) {
@@ -269,6 +354,12 @@ static void open_func_die (void *vo)
 {
     struct open_instance *o = vo;
     
+    // stop any read in progress; that read will never go up
+    if (o->reading) {
+        BThreadWork_Free(&o->reading->work);
+        o->reading->open_inst = NULL;
+    }
+    
     // close file
     if (o->fh) {
         if (fclose(o->fh) != 0) {
@@ -308,6 +399,9 @@ static void read_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleIns
     // get open instance
     struct open_instance *open_inst = NCDModuleInst_Backend_GetUser((NCDModuleInst *)params->method_user);
     
+    // wait for any previous read
+    finish_reading(open_inst);
+    
     // make sure it's not in error
     if (!open_inst->fh) {
         ModuleLog(o->i, BLOG_ERROR, "open instance is in error");
@@ -322,32 +416,15 @@ static void read_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleIns
     }
     
     // starting with empty buffer
-    char *data = NCDBuf_Data(o->buf);
-    size_t buf_size = NCDBufStore_BufSize(&open_inst->store);
+    o->open_inst = open_inst;
+    o->buf_size = NCDBufStore_BufSize(&open_inst->store);
     o->length = 0;
+    o->read_error = 0;
+    o->work_done = 0;
     
-    while (o->length < buf_size) {
-        // read
-        size_t readed = fread(data + o->length, 1, buf_size - o->length, open_inst->fh);
-        if (readed == 0) {
-            break;
-        }
-        ASSERT(readed <= buf_size - o->length)
-        
-        // increment length
-        o->length += readed;
-    }
-    
-    // if we couldn't read anything due to an error, trigger
-    // error in the open instance, and don't go up
-    if (o->length == 0 && !feof(open_inst->fh)) {
-        ModuleLog(o->i, BLOG_ERROR, "fread failed");
-        trigger_error(open_inst);
-        return;
-    }
-    
-    // go up
-    NCDModuleInst_Backend_Up(i);
+    // read in a worker thread
+    open_inst->reading = o;
+    BThreadWork_Init(&o->work, i->params->iparams->twd, (BThreadWork_handler_done)read_work_handler_done, o, (BThreadWork_work_func)read_work_func, o);
     return;
     
 fail0:
@@ -358,6 +435,13 @@ static void read_func_die (void *vo)
 {
     struct read_instance *o = vo;
     
+    // stop reading, waiting for the worker if it is busy with our file
+    if (o->open_inst) {
+        ASSERT(o->open_inst->reading == o)
+        BThreadWork_Free(&o->work);
+        o->open_inst->reading = NULL;
+    }
+    
     // release buffer
     BRefTarget_Deref(NCDBuf_RefTarget(o->buf));
     
@@ -397,6 +481,9 @@ static void write_func_new (void *unused, NCDModuleInst *i, const struct NCDModu
     // get open instance
     struct open_instance *open_inst = NCDModuleInst_Backend_GetUser((NCDModuleInst *)params->method_user);
     
+    // wait for any read
+    finish_reading(open_inst);
+    
     // make sure it's not in error
     if (!open_inst->fh) {
         ModuleLog(i, BLOG_ERROR, "open instance is in error");
@@ -486,6 +573,9 @@ static void seek_func_new (void *unused, NCDModuleInst *i, const struct NCDModul
     // get open instance
     struct open_instance *open_inst = NCDModuleInst_Backend_GetUser((NCDModuleInst *)params->method_user);
     
+    // wait for any read
+    finish_reading(open_inst);
+    
     // make sure it's not in error
     if (!open_inst->fh) {
         ModuleLog(i, BLOG_ERROR, "open instance is in error");
@@ -518,6 +608,9 @@ static void close_func_new (void *unused, NCDModuleInst *i, const struct NCDModu
     // get open instance
     struct open_instance *open_inst = NCDModuleInst_Backend_GetUser((NCDModuleInst *)params->method_user);
     
+    // wait for any read
+    finish_reading(open_inst);
+    
     // make sure it's not in error
     if (!open_inst->fh) {
         ModuleLog(i, BLOG_ERROR, "open instance is in error");
@@ -76,6 +76,7 @@
 #include <misc/strdup.h>
 #include <misc/balloc.h>
 #include <structure/LinkedList1.h>
+#include <structure/CHash.h>
 
 #include <ncd/module_common.h>
 
@@ -83,20 +84,31 @@
 
 #define RETRY_TIME 10000
 
+#define INITIAL_HASH_BUCKETS 16
+
 #define PROCESS_STATE_RUNNING 1
 #define PROCESS_STATE_STOPPING 2
 #define PROCESS_STATE_RESTARTING 3
 #define PROCESS_STATE_RETRYING 4
 
+struct process;
+
+#include "process_manager_hash.h"
+#include <structure/CHash_decl.h>
+
 struct instance {
     NCDModuleInst *i;
     LinkedList1 processes_list;
+    ProcessesHash processes_hash; // processes which have a name
+    size_t num_named;
     int dying;
 };
 
 struct process {
     struct instance *manager;
     LinkedList1Node processes_list_node;
+    struct process *hash_next; // node in processes_hash, if named
+    size_t name_hash;
     BSmallTimer retry_timer; // running if state=retrying
     int state;
     NCD_string_id_t template_name;
@@ -109,7 +121,9 @@ struct process {
     NCDModuleProcess module_process; // if state!=retrying
 };
 
+static NCDValRef process_name (struct process *p);
 static struct process * find_process (struct instance *o, NCDValRef name);
+static int copy_name_args (struct instance *o, NCDValMem *out_mem, NCDValMem *mem, NCDValSafeRef name, NCDValSafeRef args, NCDValSafeRef *out_name, NCDValSafeRef *out_args);
 static int process_new (struct instance *o, NCDValMem *mem, NCDValSafeRef name, NCDValSafeRef template_name, NCDValSafeRef args);
 static void process_free (struct process *p);
 static void process_try (struct process *p);
@@ -121,21 +135,50 @@ static void process_stop (struct process *p);
 static int process_restart (struct process *p, NCDValMem *mem, NCDValSafeRef name, NCDValSafeRef template_name, NCDValSafeRef args);
 static void instance_free (struct instance *o);
 
+#include "process_manager_hash.h"
+#include <structure/CHash_impl.h>
+
+static NCDValRef process_name (struct process *p)
+{
+    return NCDVal_FromSafe(&p->current_mem, p->current_name);
+}
+
 static struct process * find_process (struct instance *o, NCDValRef name)
 {
     ASSERT(!NCDVal_IsInvalid(name))
     
-    LinkedList1Node *n = LinkedList1_GetFirst(&o->processes_list);
-    while (n) {
-        struct process *p = UPPER_OBJECT(n, struct process, processes_list_node);
-        ASSERT(p->manager == o)
-        if (!NCDVal_IsInvalid(NCDVal_FromSafe(&p->current_mem, p->current_name)) && NCDVal_Compare(NCDVal_FromSafe(&p->current_mem, p->current_name), name) == 0) {
-            return p;
+    ProcessesHashRef ref = ProcessesHash_Lookup(&o->processes_hash, 0, name);
+    ASSERT(!ref.ptr || ref.ptr->manager == o)
+    
+    return ref.ptr;
+}
+
+static int copy_name_args (struct instance *o, NCDValMem *out_mem, NCDValMem *mem, NCDValSafeRef name, NCDValSafeRef args, NCDValSafeRef *out_name, NCDValSafeRef *out_args)
+{
+    NCDValMem_Init(out_mem, o->i->params->iparams->string_index);
+    
+    // copy only the name and arguments, not the entire statement arguments;
+    // if these are shared, the arguments list is copied in constant time
+    NCDValRef name_copy = NCDVal_NewInvalid();
+    if (!NCDVal_IsInvalid(NCDVal_FromSafe(mem, name))) {
+        name_copy = NCDVal_NewCopy(out_mem, NCDVal_FromSafe(mem, name));
+        if (NCDVal_IsInvalid(name_copy)) {
+            goto fail1;
         }
-        n = LinkedList1Node_Next(n);
     }
     
-    return NULL;
+    NCDValRef args_copy = NCDVal_NewCopy(out_mem, NCDVal_FromSafe(mem, args));
+    if (NCDVal_IsInvalid(args_copy)) {
+        goto fail1;
+    }
+    
+    *out_name = NCDVal_ToSafe(name_copy);
+    *out_args = NCDVal_ToSafe(args_copy);
+    return 1;
+    
+fail1:
+    NCDValMem_Free(out_mem);
+    return 0;
 }
 
 static int process_new (struct instance *o, NCDValMem *mem, NCDValSafeRef name, NCDValSafeRef template_name, NCDValSafeRef args)
@@ -168,15 +211,25 @@ static int process_new (struct instance *o, NCDValMem *mem, NCDValSafeRef name,
         goto fail1;
     }
     
-    // init current mem as a copy of mem
-    if (!NCDValMem_InitCopy(&p->current_mem, mem)) {
-        ModuleLog(o->i, BLOG_ERROR, "NCDValMem_InitCopy failed");
+    // copy name and args to current mem
+    if (!copy_name_args(o, &p->current_mem, mem, name, args, &p->current_name, &p->current_args)) {
+        ModuleLog(o->i, BLOG_ERROR, "failed to copy name and arguments");
         goto fail1;
     }
     
-    // remember name and args
-    p->current_name = name;
-    p->current_args = args;
+    // insert to processes hash
+    if (!NCDVal_IsInvalid(process_name(p))) {
+        p->name_hash = NCDVal_Hash(process_name(p));
+        ProcessesHashRef ref = {p, p};
+        int res = ProcessesHash_Insert(&o->processes_hash, 0, ref, NULL);
+        ASSERT_EXECUTE(res)
+        o->num_named++;
+        
+        // keep chains short; if this fails, lookups just get slower
+        if (o->num_named > o->processes_hash.num_buckets) {
+            ProcessesHash_MultiplyBuckets(&o->processes_hash, 0, 1);
+        }
+    }
     
     // try starting it
     process_try(p);
@@ -193,6 +246,14 @@ static void process_free (struct process *p)
 {
     struct instance *o = p->manager;
     
+    // remove from processes hash
+    if (!NCDVal_IsInvalid(process_name(p))) {
+        ASSERT(o->num_named > 0)
+        ProcessesHashRef ref = {p, p};
+        ProcessesHash_Remove(&o->processes_hash, 0, ref);
+        o->num_named--;
+    }
+    
     // free current mem
     NCDValMem_Free(&p->current_mem);
     
@@ -360,16 +421,12 @@ static int process_restart (struct process *p, NCDValMem *mem, NCDValSafeRef nam
     ASSERT(NCDVal_IsString(NCDVal_FromSafe(mem, template_name)))
     ASSERT(NCDVal_IsList(NCDVal_FromSafe(mem, args)))
     
-    // copy mem to next mem
-    if (!NCDValMem_InitCopy(&p->next_mem, mem)) {
-        ModuleLog(o->i, BLOG_ERROR, "NCDValMem_InitCopy failed");
+    // copy name and args to next mem
+    if (!copy_name_args(o, &p->next_mem, mem, name, args, &p->next_name, &p->next_args)) {
+        ModuleLog(o->i, BLOG_ERROR, "failed to copy name and arguments");
         goto fail0;
     }
     
-    // remember name and args to next
-    p->next_name = name;
-    p->next_args = args;
-    
     // set state
     p->state = PROCESS_STATE_RESTARTING;
     return 1;
@@ -392,6 +449,13 @@ static void func_new (void *vo, NCDModuleInst *i, const struct NCDModuleInst_new
     // init processes list
     LinkedList1_Init(&o->processes_list);
     
+    // init processes hash
+    if (!ProcessesHash_Init(&o->processes_hash, INITIAL_HASH_BUCKETS)) {
+        ModuleLog(o->i, BLOG_ERROR, "ProcessesHash_Init failed");
+        goto fail0;
+    }
+    o->num_named = 0;
+    
     // set not dying
     o->dying = 0;
     
@@ -406,6 +470,10 @@ fail0:
 void instance_free (struct instance *o)
 {
     ASSERT(LinkedList1_IsEmpty(&o->processes_list))
+    ASSERT(o->num_named == 0)
+    
+    // free processes hash
+    ProcessesHash_Free(&o->processes_hash);
     
     NCDModuleInst_Backend_Dead(o->i);
 }
@@ -0,0 +1,13 @@
+#define CHASH_PARAM_NAME ProcessesHash
+#define CHASH_PARAM_ENTRY struct process
+#define CHASH_PARAM_LINK struct process *
+#define CHASH_PARAM_KEY NCDValRef
+#define CHASH_PARAM_ARG int
+#define CHASH_PARAM_NULL ((struct process *)NULL)
+#define CHASH_PARAM_DEREF(arg, link) (link)
+#define CHASH_PARAM_ENTRYHASH(arg, entry) ((entry).ptr->name_hash)
+#define CHASH_PARAM_KEYHASH(arg, key) NCDVal_Hash((key))
+#define CHASH_PARAM_ENTRYHASH_IS_CHEAP 1
+#define CHASH_PARAM_COMPARE_ENTRIES(arg, entry1, entry2) (NCDVal_Compare(process_name((entry1).ptr), process_name((entry2).ptr)) == 0)
+#define CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key1, entry2) (NCDVal_Compare((key1), process_name((entry2).ptr)) == 0)
+#define CHASH_PARAM_ENTRY_NEXT hash_next
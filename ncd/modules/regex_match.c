@@ -62,11 +62,18 @@
  *   from the end of the just-replaced portion until no more regular expressions match.
  *   If multiple regular expressions match at the least position, the one that appears
  *   first in the 'regex' argument wins.
+ * 
+ * Compiled regular expressions are kept in an interpreter-wide cache of the
+ * REGEX_CACHE_SIZE least recently used ones, shared by regex_match() and
+ * regex_replace(), so statements which are re-run with the same regex don't
+ * compile it again. The cache hit counts and the compile time saved are logged
+ * at the info level when the interpreter exits.
  */
 
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <inttypes.h>
 #include <regex.h>
 
 #include <misc/string_begins_with.h>
@@ -74,12 +81,47 @@
 #include <misc/expstring.h>
 #include <misc/debug.h>
 #include <misc/balloc.h>
+#include <misc/offset.h>
+#include <misc/hashfun.h>
+#include <system/BTime.h>
+#include <structure/LinkedList1.h>
+#include <structure/CHash.h>
 
 #include <ncd/module_common.h>
 
 #include <generated/blog_channel_ncd_regex_match.h>
 
 #define MAX_MATCHES 64
+#define REGEX_CACHE_SIZE 64
+#define REGEX_CACHE_BUCKETS 128
+
+struct regex_key {
+    MemRef pattern;
+    int cflags;
+};
+
+struct regex_entry {
+    struct regex_key key;
+    size_t key_hash;
+    struct regex_entry *hash_next;
+    LinkedList1Node lru_list_node; // only when not in use
+    int refs;
+    int64_t compile_ns;
+    regex_t preg;
+};
+
+#include "regex_match_hash.h"
+#include <structure/CHash_decl.h>
+
+struct global {
+    RegexCacheHash hash;
+    LinkedList1 lru_list; // entries not in use, most recently used first
+    size_t num_entries;
+    uint64_t num_hits;
+    uint64_t num_misses;
+    uint64_t num_evictions;
+    int64_t saved_ns;
+};
 
 struct instance {
     NCDModuleInst *i;
@@ -94,6 +136,189 @@ struct replace_instance {
     MemRef output;
 };
 
+static size_t regex_key_hash (struct regex_key key)
+{
+    return badvpn_djb2_hash_bin((const uint8_t *)key.pattern.ptr, key.pattern.len) ^ (size_t)key.cflags;
+}
+
+static int regex_key_equal (struct regex_key key1, struct regex_key key2)
+{
+    return key1.cflags == key2.cflags && MemRef_Equal(key1.pattern, key2.pattern);
+}
+
+#include "regex_match_hash.h"
+#include <structure/CHash_impl.h>
+
+static void free_entry (struct global *g, struct regex_entry *e)
+{
+    ASSERT(e->refs == 0)
+    ASSERT(g->num_entries > 0)
+    
+    // remove from cache
+    RegexCacheHashRef ref = {e, e};
+    RegexCacheHash_Remove(&g->hash, 0, ref);
+    LinkedList1_Remove(&g->lru_list, &e->lru_list_node);
+    g->num_entries--;
+    
+    // free compiled regex and pattern
+    regfree(&e->preg);
+    BFree((char *)e->key.pattern.ptr);
+    BFree(e);
+}
+
+static void trim_cache (struct global *g)
+{
+    // evict least recently used entries which are not in use
+    LinkedList1Node *ln;
+    while (g->num_entries > REGEX_CACHE_SIZE && (ln = LinkedList1_GetLast(&g->lru_list))) {
+        free_entry(g, UPPER_OBJECT(ln, struct regex_entry, lru_list_node));
+        g->num_evictions++;
+    }
+}
+
+// Returns the compiled regex for a pattern, from the cache or newly compiled.
+// It must be released with regex_release() and stays valid until then.
+// On failure returns NULL, and *out_error is the regcomp() error or 0 if
+// allocation failed.
+static struct regex_entry * regex_acquire (NCDModuleInst *i, MemRef pattern, int cflags, int *out_error)
+{
+    struct global *g = ModuleGlobal(i);
+    
+    struct regex_key key = {pattern, cflags};
+    RegexCacheHashRef ref = RegexCacheHash_Lookup(&g->hash, 0, key);
+    
+    if (ref.ptr) {
+        struct regex_entry *e = ref.ptr;
+        
+        // take out of the LRU list while it's used
+        if (e->refs == 0) {
+            LinkedList1_Remove(&g->lru_list, &e->lru_list_node);
+        }
+        e->refs++;
+        
+        g->num_hits++;
+        g->saved_ns += e->compile_ns;
+        
+        return e;
+    }
+    
+    g->num_misses++;
+    
+    // allocate entry
+    struct regex_entry *e = BAlloc(sizeof(*e));
+    if (!e) {
+        ModuleLog(i, BLOG_ERROR, "BAlloc failed");
+        goto fail0;
+    }
+    
+    // copy pattern, null terminated
+    char *pattern_copy = BAllocSize(bsize_add(bsize_fromsize(pattern.len), bsize_fromsize(1)));
+    if (!pattern_copy) {
+        ModuleLog(i, BLOG_ERROR, "BAllocSize failed");
+        goto fail1;
+    }
+    MemRef_CopyOut(pattern, pattern_copy);
+    pattern_copy[pattern.len] = '\0';
+    
+    // compile regex
+    int64_t start_ns = btime_gettime_ns();
+    int res = regcomp(&e->preg, pattern_copy, cflags);
+    if (res != 0) {
+        *out_error = res;
+        BFree(pattern_copy);
+        BFree(e);
+        return NULL;
+    }
+    e->compile_ns = btime_gettime_ns() - start_ns;
+    
+    // insert to cache
+    e->key.pattern = MemRef_Make(pattern_copy, pattern.len);
+    e->key.cflags = cflags;
+    e->key_hash = regex_key_hash(e->key);
+    e->refs = 1;
+    RegexCacheHashRef eref = {e, e};
+    int inserted = RegexCacheHash_Insert(&g->hash, 0, eref, NULL);
+    ASSERT_EXECUTE(inserted)
+    g->num_entries++;
+    
+    return e;
+    
+fail1:
+    BFree(e);
+fail0:
+    *out_error = 0;
+    return NULL;
+}
+
+static void regex_release (NCDModuleInst *i, struct regex_entry *e)
+{
+    struct global *g = ModuleGlobal(i);
+    ASSERT(e->refs > 0)
+    
+    // when no longer used, it becomes the most recently used entry
+    e->refs--;
+    if (e->refs == 0) {
+        LinkedList1_Prepend(&g->lru_list, &e->lru_list_node);
+        trim_cache(g);
+    }
+}
+
+static int func_globalinit (struct NCDInterpModuleGroup *group, const struct NCDModuleInst_iparams *params)
+{
+    // allocate global state structure
+    struct global *g = BAlloc(sizeof(*g));
+    if (!g) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        return 0;
+    }
+    
+    // set group state pointer
+    group->group_state = g;
+    
+    // init cache
+    if (!RegexCacheHash_Init(&g->hash, REGEX_CACHE_BUCKETS)) {
+        BLog(BLOG_ERROR, "RegexCacheHash_Init failed");
+        goto fail1;
+    }
+    LinkedList1_Init(&g->lru_list);
+    g->num_entries = 0;
+    
+    // init statistics
+    g->num_hits = 0;
+    g->num_misses = 0;
+    g->num_evictions = 0;
+    g->saved_ns = 0;
+    
+    return 1;
+    
+fail1:
+    BFree(g);
+    return 0;
+}
+
+static void func_globalfree (struct NCDInterpModuleGroup *group)
+{
+    struct global *g = group->group_state;
+    
+    if (g->num_hits > 0 || g->num_misses > 0) {
+        BLog(BLOG_INFO, "regex cache: %"PRIu64" hits, %"PRIu64" misses, %"PRIu64" evictions, %.3f ms compile time saved",
+             g->num_hits, g->num_misses, g->num_evictions, g->saved_ns / 1000000.0);
+    }
+    
+    // free entries
+    LinkedList1Node *ln;
+    while ((ln = LinkedList1_GetFirst(&g->lru_list))) {
+        free_entry(g, UPPER_OBJECT(ln, struct regex_entry, lru_list_node));
+    }
+    ASSERT(g->num_entries == 0)
+    
+    // free cache
+    RegexCacheHash_Free(&g->hash);
+    
+    // free global state structure
+    BFree(g);
+}
+
 static void func_new (void *vo, NCDModuleInst *i, const struct NCDModuleInst_new_params *params)
 {
     struct instance *o = vo;
@@ -118,29 +343,23 @@ static void func_new (void *vo, NCDModuleInst *i, const struct NCDModuleInst_new
         goto fail0;
     }
     
-    // null terminate regex
-    NCDValNullTermString regex_nts;
-    if (!NCDVal_StringNullTerminate(regex_arg, &regex_nts)) {
-        ModuleLog(i, BLOG_ERROR, "NCDVal_StringNullTerminate failed");
-        goto fail0;
-    }
-    
-    // compile regex
-    regex_t preg;
-    int ret = regcomp(&preg, regex_nts.data, REG_EXTENDED);
-    NCDValNullTermString_Free(&regex_nts);
-    if (ret != 0) {
-        ModuleLog(o->i, BLOG_ERROR, "regcomp failed (error=%d)", ret);
+    // get compiled regex
+    int ret;
+    struct regex_entry *re = regex_acquire(i, NCDVal_StringMemRef(regex_arg), REG_EXTENDED, &ret);
+    if (!re) {
+        if (ret != 0) {
+            ModuleLog(o->i, BLOG_ERROR, "regcomp failed (error=%d)", ret);
+        }
         goto fail0;
     }
     
     // execute match
     o->matches[0].rm_so = 0;
     o->matches[0].rm_eo = o->input.len;
-    o->succeeded = (regexec(&preg, o->input.ptr, MAX_MATCHES, o->matches, REG_STARTEND) == 0);
+    o->succeeded = (regexec(&re->preg, o->input.ptr, MAX_MATCHES, o->matches, REG_STARTEND) == 0);
     
-    // free regex
-    regfree(&preg);
+    // release regex
+    regex_release(i, re);
     
     // signal up
     NCDModuleInst_Backend_Up(o->i);
@@ -205,7 +424,7 @@ static void replace_func_new (void *vo, NCDModuleInst *i, const struct NCDModule
     size_t num_regex = NCDVal_ListCount(regex_arg);
     
     // allocate array for compiled regex's
-    regex_t *regs = BAllocArray(num_regex, sizeof(regs[0]));
+    struct regex_entry **regs = BAllocArray(num_regex, sizeof(regs[0]));
     if (!regs) {
         ModuleLog(i, BLOG_ERROR, "BAllocArray failed");
         goto fail1;
@@ -222,17 +441,11 @@ static void replace_func_new (void *vo, NCDModuleInst *i, const struct NCDModule
             goto fail2;
         }
         
-        // null terminate regex
-        NCDValNullTermString regex_nts;
-        if (!NCDVal_StringNullTerminate(regex, &regex_nts)) {
-            ModuleLog(i, BLOG_ERROR, "NCDVal_StringNullTerminate failed");
-            goto fail2;
-        }
-        
-        int res = regcomp(&regs[num_done_regex], regex_nts.data, REG_EXTENDED);
-        NCDValNullTermString_Free(&regex_nts);
-        if (res != 0) {
-            ModuleLog(i, BLOG_ERROR, "regcomp failed for pair %zu (error=%d)", num_done_regex, res);
+        int res;
+        if (!(regs[num_done_regex] = regex_acquire(i, NCDVal_StringMemRef(regex), REG_EXTENDED, &res))) {
+            if (res != 0) {
+                ModuleLog(i, BLOG_ERROR, "regcomp failed for pair %zu (error=%d)", num_done_regex, res);
+            }
             goto fail2;
         }
         
@@ -260,7 +473,7 @@ static void replace_func_new (void *vo, NCDModuleInst *i, const struct NCDModule
             regmatch_t this_match;
             this_match.rm_so = 0;
             this_match.rm_eo = in.len - in_pos;
-            if (regexec(&regs[j], in.ptr + in_pos, 1, &this_match, REG_STARTEND) == 0 && (!have_match || this_match.rm_so < match.rm_so)) {
+            if (regexec(&regs[j]->preg, in.ptr + in_pos, 1, &this_match, REG_STARTEND) == 0 && (!have_match || this_match.rm_so < match.rm_so)) {
                 have_match = 1;
                 match_regex = j;
                 match = this_match;
@@ -297,7 +510,7 @@ static void replace_func_new (void *vo, NCDModuleInst *i, const struct NCDModule
     
     // free compiled regex's
     while (num_done_regex-- > 0) {
-        regfree(&regs[num_done_regex]);
+        regex_release(i, regs[num_done_regex]);
     }
     
     // free array
@@ -311,7 +524,7 @@ fail3:
     ExpString_Free(&out);
 fail2:
     while (num_done_regex-- > 0) {
-        regfree(&regs[num_done_regex]);
+        regex_release(i, regs[num_done_regex]);
     }
     BFree(regs);
 fail1:
@@ -358,5 +571,7 @@ static struct NCDModule modules[] = {
 };
 
 const struct NCDModuleGroup ncdmodule_regex_match = {
+    .func_globalinit = func_globalinit,
+    .func_globalfree = func_globalfree,
     .modules = modules
 };
@@ -0,0 +1,13 @@
+#define CHASH_PARAM_NAME RegexCacheHash
+#define CHASH_PARAM_ENTRY struct regex_entry
+#define CHASH_PARAM_LINK struct regex_entry *
+#define CHASH_PARAM_KEY struct regex_key
+#define CHASH_PARAM_ARG int
+#define CHASH_PARAM_NULL ((struct regex_entry *)NULL)
+#define CHASH_PARAM_DEREF(arg, link) (link)
+#define CHASH_PARAM_ENTRYHASH(arg, entry) ((entry).ptr->key_hash)
+#define CHASH_PARAM_KEYHASH(arg, key) regex_key_hash((key))
+#define CHASH_PARAM_ENTRYHASH_IS_CHEAP 1
+#define CHASH_PARAM_COMPARE_ENTRIES(arg, entry1, entry2) regex_key_equal((entry1).ptr->key, (entry2).ptr->key)
+#define CHASH_PARAM_COMPARE_KEY_ENTRY(arg, key1, entry2) regex_key_equal((key1), (entry2).ptr->key)
+#define CHASH_PARAM_ENTRY_NEXT hash_next
@@ -35,6 +35,10 @@
  *   "read_size" - the maximum number of bytes that can be read by a single
  *     read() call. Must be greater than zero. Greater values may improve
  *     performance, but will increase memory usage. Default: 8192.
+ *   "framing" - how incoming data is split into read() results. "none"
+ *     (default) returns whatever was received. "line" returns one line per
+ *     read(), without the terminating newline character; lines longer than
+ *     read_size bytes are treated as a connection error.
  * 
  * Variables:
  *   string is_error - "true" if there was an error with the connection,
@@ -82,6 +86,11 @@
  *   WARNING: this may return an arbitrarily small chunk of data. There is
  *   no significance to the size of the chunks. Correct code will behave
  *   the same no matter how the incoming data stream is split up.
+ *   If the socket was created with the "line" framing option, each read()
+ *   instead returns exactly one line (possibly empty), with the newline
+ *   removed. Lines are served from an internal buffer, so a burst of lines
+ *   does not need a receive operation per line. If EOF is reached in the
+ *   middle of a line, the partial line is returned before EOF.
  *   WARNING: if a read() is terminated while it is still in progress, i.e.
  *   has not gone up yet, then the connection is automatically closed, as
  *   if close() was called.
@@ -115,6 +124,10 @@
  *   "read_size" - the maximum number of bytes that can be read by a single
  *     read() call. Must be greater than zero. Greater values may improve
  *     performance, but will increase memory usage. Default: 8192.
+ *   "framing" - how incoming data is split into read() results. "none"
+ *     (default) returns whatever was received. "line" returns one line per
+ *     read(), without the terminating newline character; lines longer than
+ *     read_size bytes are treated as a connection error.
  * 
  * Variables:
  *   string is_error - "true" if listening failed to inittialize, "false" if
@@ -138,9 +151,12 @@
  *   the same methods as sys.connect(), i.e. read(), write() and close().
  *   When an error occurs with the connection, the socket is automatically
  *   closed, triggering process termination.
+ *   Connection structures and their receive buffers are kept in a small pool
+ *   after their process terminates and are reused for new clients.
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <sys/types.h>
@@ -149,6 +165,7 @@
 
 #include <misc/offset.h>
 #include <misc/debug.h>
+#include <misc/balloc.h>
 #include <structure/LinkedList0.h>
 #include <system/BConnection.h>
 #include <system/BConnectionGeneric.h>
@@ -167,7 +184,11 @@
 #define CONNECTION_STATE_ERROR 3
 #define CONNECTION_STATE_ABORTED 4
 
+#define FRAMING_NONE 0
+#define FRAMING_LINE 1
+
 #define DEFAULT_READ_BUF_SIZE 8192
+#define LISTEN_POOL_SIZE 32
 
 struct connection {
     union {
@@ -187,10 +208,15 @@ struct connection {
     unsigned int type:2;
     unsigned int state:3;
     unsigned int recv_closed:1;
+    unsigned int framing:1;
     BConnection connection;
     NCDBufStore store;
     struct read_instance *read_inst;
     struct write_instance *write_inst;
+    char *line_buf; // allocated on first read with FRAMING_LINE
+    size_t line_start;
+    size_t line_len;
+    size_t line_scanned; // bytes after line_start known not to contain '\n'
 };
 
 struct read_instance {
@@ -198,6 +224,7 @@ struct read_instance {
     struct connection *con_inst;
     NCDBuf *buf;
     size_t read_size;
+    int eof;
 };
 
 struct write_instance {
@@ -210,11 +237,14 @@ struct listen_instance {
     NCDModuleInst *i;
     unsigned int have_error:1;
     unsigned int dying:1;
+    unsigned int framing:1;
     size_t read_buf_size;
-    NCDValRef client_template;
+    NCD_string_id_t client_template_id;
     NCDValRef client_template_args;
     BListener listener;
     LinkedList0 clients_list;
+    LinkedList0 pool_list;
+    int pool_count;
 };
 
 enum {STRING_SOCKET, STRING_SYS_SOCKET, STRING_CLIENT_ADDR};
@@ -223,9 +253,13 @@ static const char *strings[] = {
     "_socket", "sys.socket", "client_addr", NULL
 };
 
-static int parse_options (NCDModuleInst *i, NCDValRef options, size_t *out_read_size);
+static int parse_options (NCDModuleInst *i, NCDValRef options, size_t *out_read_size, int *out_framing);
 static void connection_log (struct connection *o, int level, const char *fmt, ...);
 static void connection_free_connection (struct connection *o);
+static void connection_free_buffers (struct connection *o);
+static int connection_take_line (struct connection *o, struct read_instance *re);
+static void connection_take_rest (struct connection *o, struct read_instance *re);
+static void connection_recv_line (struct connection *o);
 static void connection_error (struct connection *o);
 static void connection_abort (struct connection *o);
 static void connection_connector_handler (void *user, int is_error);
@@ -238,12 +272,15 @@ static int connection_process_func_getspecialobj (struct NCDModuleProcess_s *pro
 static int connection_process_socket_obj_func_getvar (const NCDObject *obj, NCD_string_id_t name, NCDValMem *mem, NCDValRef *out_value);
 static int connection_process_caller_obj_func_getobj (const NCDObject *obj, NCD_string_id_t name, NCDObject *out_object);
 static void listen_listener_handler (void *user);
+static void listen_free_pool (struct listen_instance *o);
 
-static int parse_options (NCDModuleInst *i, NCDValRef options, size_t *out_read_size)
+static int parse_options (NCDModuleInst *i, NCDValRef options, size_t *out_read_size, int *out_framing)
 {
     ASSERT(out_read_size)
+    ASSERT(out_framing)
     
     *out_read_size = DEFAULT_READ_BUF_SIZE;
+    *out_framing = FRAMING_NONE;
     
     if (!NCDVal_IsInvalid(options)) {
         if (!NCDVal_IsMap(options)) {
@@ -264,6 +301,20 @@ static int parse_options (NCDModuleInst *i, NCDValRef options, size_t *out_read_
             *out_read_size = read_size;
         }
         
+        if (!NCDVal_IsInvalid(value = NCDVal_MapGetValue(options, "framing"))) {
+            if (NCDVal_StringEquals(value, "none")) {
+                *out_framing = FRAMING_NONE;
+            }
+            else if (NCDVal_StringEquals(value, "line")) {
+                *out_framing = FRAMING_LINE;
+            }
+            else {
+                ModuleLog(i, BLOG_ERROR, "wrong framing");
+                return 0;
+            }
+            num_recognized++;
+        }
+        
         if (NCDVal_MapCount(options) > num_recognized) {
             ModuleLog(i, BLOG_ERROR, "unrecognized options present");
             return 0;
@@ -322,10 +373,89 @@ static void connection_free_connection (struct connection *o)
     // free connection
     BConnection_Free(&o->connection);
     
+    // free buffers, unless the structure goes back to the listener's pool
+    if (o->type == CONNECTION_TYPE_CONNECT) {
+        connection_free_buffers(o);
+    }
+}
+
+static void connection_free_buffers (struct connection *o)
+{
+    // free line buffer
+    if (o->line_buf) {
+        BFree(o->line_buf);
+    }
+    
     // free store
     NCDBufStore_Free(&o->store);
 }
 
+static int connection_take_line (struct connection *o, struct read_instance *re)
+{
+    ASSERT(o->framing == FRAMING_LINE)
+    ASSERT(o->line_buf)
+    ASSERT(o->line_scanned <= o->line_len)
+    
+    char *data = o->line_buf + o->line_start;
+    
+    // look for the end of the line in the part not yet scanned
+    char *nl = memchr(data + o->line_scanned, '\n', o->line_len - o->line_scanned);
+    if (!nl) {
+        o->line_scanned = o->line_len;
+        return 0;
+    }
+    
+    // give the line to the read operation
+    size_t len = nl - data;
+    memcpy(NCDBuf_Data(re->buf), data, len);
+    re->read_size = len;
+    re->eof = 0;
+    
+    // consume the line and the newline
+    o->line_start += len + 1;
+    o->line_len -= len + 1;
+    o->line_scanned = 0;
+    if (o->line_len == 0) {
+        o->line_start = 0;
+    }
+    
+    return 1;
+}
+
+static void connection_take_rest (struct connection *o, struct read_instance *re)
+{
+    ASSERT(o->framing == FRAMING_LINE)
+    
+    // give the partial line to the read operation, or report eof
+    if (o->line_len > 0) {
+        memcpy(NCDBuf_Data(re->buf), o->line_buf + o->line_start, o->line_len);
+    }
+    re->read_size = o->line_len;
+    re->eof = (o->line_len == 0);
+    
+    o->line_start = 0;
+    o->line_len = 0;
+    o->line_scanned = 0;
+}
+
+static void connection_recv_line (struct connection *o)
+{
+    ASSERT(o->framing == FRAMING_LINE)
+    ASSERT(o->line_buf)
+    ASSERT(o->line_len < NCDBufStore_BufSize(&o->store))
+    
+    // move the incomplete line to the start of the buffer
+    if (o->line_start > 0) {
+        memmove(o->line_buf, o->line_buf + o->line_start, o->line_len);
+        o->line_start = 0;
+    }
+    
+    // receive into the free space
+    size_t avail = NCDBufStore_BufSize(&o->store) - o->line_len;
+    int to_read = (avail > INT_MAX ? INT_MAX : avail);
+    StreamRecvInterface_Receiver_Recv(BConnection_RecvAsync_GetIf(&o->connection), (uint8_t *)o->line_buf + o->line_len, to_read);
+}
+
 static void connection_error (struct connection *o)
 {
     ASSERT(o->state == CONNECTION_STATE_CONNECTING ||
@@ -415,6 +545,12 @@ static void connection_complete_establish (struct connection *o)
     // init store
     NCDBufStore_Init(&o->store, o->connect.read_buf_size);
     
+    // set no line buffer
+    o->line_buf = NULL;
+    o->line_start = 0;
+    o->line_len = 0;
+    o->line_scanned = 0;
+    
     // set not reading, not writing, recv not closed
     o->read_inst = NULL;
     o->write_inst = NULL;
@@ -439,7 +575,12 @@ static void connection_connection_handler (void *user, int event)
         if (o->read_inst) {
             ASSERT(o->read_inst->con_inst == o)
             o->read_inst->con_inst = NULL;
-            o->read_inst->read_size = 0;
+            if (o->framing == FRAMING_LINE) {
+                connection_take_rest(o, o->read_inst);
+            } else {
+                o->read_inst->read_size = 0;
+                o->read_inst->eof = 1;
+            }
             NCDModuleInst_Backend_Up(o->read_inst->i);
             o->read_inst = NULL;
         }
@@ -494,9 +635,26 @@ static void connection_recv_handler_done (void *user, int data_len)
     
     struct read_instance *re = o->read_inst;
     
+    if (o->framing == FRAMING_LINE) {
+        o->line_len += data_len;
+        
+        // if we don't have a complete line yet, receive more
+        if (!connection_take_line(o, re)) {
+            if (o->line_len == NCDBufStore_BufSize(&o->store)) {
+                connection_log(o, BLOG_ERROR, "line too long");
+                connection_error(o);
+                return;
+            }
+            connection_recv_line(o);
+            return;
+        }
+    } else {
+        re->read_size = data_len;
+        re->eof = 0;
+    }
+    
     // finish read operation
     re->con_inst = NULL;
-    re->read_size = data_len;
     NCDModuleInst_Backend_Up(re->i);
     o->read_inst = NULL;
 }
@@ -528,8 +686,14 @@ static void connection_process_handler (struct NCDModuleProcess_s *process, int
             // free process
             NCDModuleProcess_Free(&o->listen.process);
             
-            // free connection structure
-            free(o);
+            // keep connection structure for the next client, or free it
+            if (!li->dying && li->pool_count < LISTEN_POOL_SIZE) {
+                LinkedList0_Prepend(&li->pool_list, &o->listen.clients_list_node);
+                li->pool_count++;
+            } else {
+                connection_free_buffers(o);
+                free(o);
+            }
             
             // if listener is dying and this was the last process, have it die
             if (li->dying && LinkedList0_IsEmpty(&li->clients_list)) {
@@ -589,16 +753,32 @@ static void listen_listener_handler (void *user)
     ASSERT(!o->have_error)
     ASSERT(!o->dying)
     
-    // allocate connection structure
-    struct connection *con = malloc(sizeof(*con));
-    if (!con) {
-        ModuleLog(o->i, BLOG_ERROR, "malloc failed");
-        goto fail0;
-    }
+    struct connection *con;
     
-    // set connection type and listen instance
-    con->type = CONNECTION_TYPE_LISTEN;
-    con->listen.listen_inst = o;
+    // take connection structure from pool, or allocate a new one
+    LinkedList0Node *ln = LinkedList0_GetFirst(&o->pool_list);
+    if (ln) {
+        con = UPPER_OBJECT(ln, struct connection, listen.clients_list_node);
+        ASSERT(con->listen.listen_inst == o)
+        LinkedList0_Remove(&o->pool_list, &con->listen.clients_list_node);
+        o->pool_count--;
+    } else {
+        if (!(con = malloc(sizeof(*con)))) {
+            ModuleLog(o->i, BLOG_ERROR, "malloc failed");
+            goto fail0;
+        }
+        
+        // set connection type and listen instance
+        con->type = CONNECTION_TYPE_LISTEN;
+        con->listen.listen_inst = o;
+        con->framing = o->framing;
+        
+        // init store
+        NCDBufStore_Init(&con->store, o->read_buf_size);
+        
+        // set no line buffer
+        con->line_buf = NULL;
+    }
     
     // init connection
     if (!BConnection_Init(&con->connection, BConnection_source_listener(&o->listener, &con->listen.addr), o->i->params->iparams->reactor, con, connection_connection_handler)) {
@@ -615,8 +795,8 @@ static void listen_listener_handler (void *user)
     StreamRecvInterface_Receiver_Init(BConnection_RecvAsync_GetIf(&con->connection), connection_recv_handler_done, con);
     
     // init process
-    if (!NCDModuleProcess_InitValue(&con->listen.process, o->i, o->client_template, o->client_template_args, connection_process_handler)) {
-        ModuleLog(o->i, BLOG_ERROR, "NCDModuleProcess_InitValue failed");
+    if (!NCDModuleProcess_InitId(&con->listen.process, o->i, o->client_template_id, o->client_template_args, connection_process_handler)) {
+        ModuleLog(o->i, BLOG_ERROR, "NCDModuleProcess_InitId failed");
         goto fail2;
     }
     
@@ -626,8 +806,10 @@ static void listen_listener_handler (void *user)
     // insert to clients list
     LinkedList0_Prepend(&o->clients_list, &con->listen.clients_list_node);
     
-    // init store
-    NCDBufStore_Init(&con->store, o->read_buf_size);
+    // set line buffer empty
+    con->line_start = 0;
+    con->line_len = 0;
+    con->line_scanned = 0;
     
     // set not reading, not writing, recv not closed
     con->read_inst = NULL;
@@ -643,11 +825,25 @@ fail2:
     BConnection_SendAsync_Free(&con->connection);
     BConnection_Free(&con->connection);
 fail1:
+    connection_free_buffers(con);
     free(con);
 fail0:
     return;
 }
 
+static void listen_free_pool (struct listen_instance *o)
+{
+    LinkedList0Node *ln;
+    while ((ln = LinkedList0_GetFirst(&o->pool_list))) {
+        struct connection *con = UPPER_OBJECT(ln, struct connection, listen.clients_list_node);
+        ASSERT(con->listen.listen_inst == o)
+        LinkedList0_Remove(&o->pool_list, &con->listen.clients_list_node);
+        connection_free_buffers(con);
+        free(con);
+    }
+    o->pool_count = 0;
+}
+
 static int connect_custom_addr_handler (void *user, NCDValRef protocol, NCDValRef data)
 {
     NCDValRef *device_path = user;
@@ -682,9 +878,11 @@ static void connect_func_new (void *vo, NCDModuleInst *i, const struct NCDModule
     }
     
     // parse options
-    if (!parse_options(i, options_arg, &o->connect.read_buf_size)) {
+    int framing;
+    if (!parse_options(i, options_arg, &o->connect.read_buf_size, &framing)) {
         goto fail0;
     }
+    o->framing = framing;
     
     // read address
     struct BConnection_addr address;
@@ -807,10 +1005,40 @@ static void read_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleIns
         goto fail0;
     }
     
+    if (con_inst->framing == FRAMING_LINE) {
+        // allocate line buffer
+        if (!con_inst->line_buf && !(con_inst->line_buf = BAlloc(NCDBufStore_BufSize(&con_inst->store)))) {
+            ModuleLog(i, BLOG_ERROR, "BAlloc failed");
+            goto fail1;
+        }
+        
+        // if a complete line is buffered, or eof was reached, go up immediately
+        int have_line = connection_take_line(con_inst, o);
+        if (!have_line && con_inst->recv_closed) {
+            connection_take_rest(con_inst, o);
+        }
+        if (have_line || con_inst->recv_closed) {
+            o->con_inst = NULL;
+            NCDModuleInst_Backend_Up(i);
+            return;
+        }
+        
+        // set connection
+        o->con_inst = con_inst;
+        
+        // register read operation in connection
+        con_inst->read_inst = o;
+        
+        // receive
+        connection_recv_line(con_inst);
+        return;
+    }
+    
     // if eof was reached, go up immediately
     if (con_inst->recv_closed) {
         o->con_inst = NULL;
         o->read_size = 0;
+        o->eof = 1;
         NCDModuleInst_Backend_Up(i);
         return;
     }
@@ -827,6 +1055,8 @@ static void read_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleIns
     StreamRecvInterface_Receiver_Recv(BConnection_RecvAsync_GetIf(&con_inst->connection), (uint8_t *)NCDBuf_Data(o->buf), to_read);
     return;
     
+fail1:
+    BRefTarget_Deref(NCDBuf_RefTarget(o->buf));
 fail0:
     NCDModuleInst_Backend_DeadError(i);
 }
@@ -859,7 +1089,7 @@ static int read_func_getvar (void *vo, NCD_string_id_t name, NCDValMem *mem, NCD
     }
     
     if (name == NCD_STRING_EOF || name == NCD_STRING_NOT_EOF) {
-        *out = ncd_make_boolean(mem, (o->read_size == 0) == (name == NCD_STRING_EOF));
+        *out = ncd_make_boolean(mem, o->eof == (name == NCD_STRING_EOF));
         return 1;
     }
     
@@ -986,12 +1216,24 @@ static void listen_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleI
     }
     
     // parse options
-    if (!parse_options(i, options_arg, &o->read_buf_size)) {
+    int framing;
+    if (!parse_options(i, options_arg, &o->read_buf_size, &framing)) {
         goto fail0;
     }
+    o->framing = framing;
     
-    // remember client template and arguments
-    o->client_template = client_template_arg;
+    // resolve client template name once, for all clients
+    if (NCDVal_IsIdString(client_template_arg)) {
+        o->client_template_id = NCDVal_IdStringId(client_template_arg);
+    } else {
+        o->client_template_id = NCDStringIndex_GetBinMr(i->params->iparams->string_index, NCDVal_StringMemRef(client_template_arg));
+        if (o->client_template_id < 0) {
+            ModuleLog(i, BLOG_ERROR, "NCDStringIndex_GetBinMr failed");
+            goto fail0;
+        }
+    }
+    
+    // remember client template arguments
     o->client_template_args = args_arg;
     
     // set no error, not dying
@@ -1014,6 +1256,10 @@ static void listen_func_new (void *vo, NCDModuleInst *i, const struct NCDModuleI
     // init clients list
     LinkedList0_Init(&o->clients_list);
     
+    // init pool
+    LinkedList0_Init(&o->pool_list);
+    o->pool_count = 0;
+    
     // go up
     NCDModuleInst_Backend_Up(i);
     return;
@@ -1033,9 +1279,10 @@ static void listen_func_die (void *vo)
     struct listen_instance *o = vo;
     ASSERT(!o->dying)
     
-    // free listener
+    // free listener and pooled connections
     if (!o->have_error) {
         BListener_Free(&o->listener);
+        listen_free_pool(o);
     }
     
     // if we have no clients, die right away
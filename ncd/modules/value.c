@@ -207,6 +207,9 @@ struct value {
         } map_parent;
     };
     
+    NCDValMem *snapshot; // shared copy of a list or map, or NULL
+    NCDValSafeRef snapshot_ref;
+    
     int type;
     union {
         struct {
@@ -235,6 +238,8 @@ struct value {
 static const char * get_type_str (int type);
 static void value_cleanup (struct value *v);
 static void value_delete (struct value *v);
+static void value_free_snapshot (struct value *v);
+static void value_changed (struct value *v);
 static struct value * value_init_storedstring (NCDModuleInst *i, MemRef str);
 static struct value * value_init_idstring (NCDModuleInst *i, NCD_string_id_t id, NCDStringIndex *string_index);
 static struct value * value_init_externalstring (NCDModuleInst *i, MemRef data, BRefTarget *ref_target);
@@ -256,6 +261,7 @@ static void value_map_remove (struct value *map, struct value *v);
 static void value_map_remove2 (struct value *map, struct value *v, NCDValMem *out_mem, NCDValSafeRef *out_key);
 static struct value * value_init_fromvalue (NCDModuleInst *i, NCDValRef value);
 static int value_to_value (NCDModuleInst *i, struct value *v, NCDValMem *mem, NCDValRef *out_value);
+static int value_build_snapshot (NCDModuleInst *i, struct value *v);
 static struct value * value_get (NCDModuleInst *i, struct value *v, NCDValRef where, int no_error);
 static struct value * value_get_path (NCDModuleInst *i, struct value *v, NCDValRef path);
 static struct value * value_insert (NCDModuleInst *i, struct value *v, NCDValRef where, NCDValRef what, int is_replace, struct value **out_oldv);
@@ -331,6 +337,7 @@ static void value_cleanup (struct value *v)
         default: ASSERT(0);
     }
     
+    value_free_snapshot(v);
     free(v);
 }
 
@@ -386,9 +393,26 @@ static void value_delete (struct value *v)
         default: ASSERT(0);
     }
     
+    value_free_snapshot(v);
     free(v);
 }
 
+static void value_free_snapshot (struct value *v)
+{
+    if (v->snapshot) {
+        NCDValMem_ReleaseShared(v->snapshot);
+        v->snapshot = NULL;
+    }
+}
+
+static void value_changed (struct value *v)
+{
+    // the snapshots of the value and of all values containing it are stale
+    for (; v; v = v->parent) {
+        value_free_snapshot(v);
+    }
+}
+
 static struct value * value_init_storedstring (NCDModuleInst *i, MemRef str)
 {
     struct value *v = malloc(sizeof(*v));
@@ -399,6 +423,7 @@ static struct value * value_init_storedstring (NCDModuleInst *i, MemRef str)
     
     LinkedList0_Init(&v->refs_list);
     v->parent = NULL;
+    v->snapshot = NULL;
     v->type = STOREDSTRING_TYPE;
     
     char *buf;
@@ -432,6 +457,7 @@ static struct value * value_init_idstring (NCDModuleInst *i, NCD_string_id_t id,
     
     LinkedList0_Init(&v->refs_list);
     v->parent = NULL;
+    v->snapshot = NULL;
     v->type = IDSTRING_TYPE;
     
     v->idstring.id = id;
@@ -460,6 +486,7 @@ static struct value * value_init_externalstring (NCDModuleInst *i, MemRef data,
     
     LinkedList0_Init(&v->refs_list);
     v->parent = NULL;
+    v->snapshot = NULL;
     v->type = EXTERNALSTRING_TYPE;
     
     v->externalstring.data = data.ptr;
@@ -532,6 +559,8 @@ static void value_string_set_rstr (struct value *v, NCDRefString *rstr, size_t l
     v->storedstring.rstr = rstr;
     v->storedstring.length = length;
     v->storedstring.size = size;
+    
+    value_changed(v);
 }
 
 static struct value * value_init_list (NCDModuleInst *i)
@@ -544,6 +573,7 @@ static struct value * value_init_list (NCDModuleInst *i)
     
     LinkedList0_Init(&v->refs_list);
     v->parent = NULL;
+    v->snapshot = NULL;
     v->type = NCDVAL_LIST;
     
     IndexedList_Init(&v->list.list_contents_il);
@@ -597,6 +627,8 @@ static int value_list_insert (NCDModuleInst *i, struct value *list, struct value
     IndexedList_InsertAt(&list->list.list_contents_il, &v->list_parent.list_contents_il_node, index);
     v->parent = list;
     
+    value_changed(list);
+    
     return 1;
 }
 
@@ -607,6 +639,8 @@ static void value_list_remove (struct value *list, struct value *v)
     
     IndexedList_Remove(&list->list.list_contents_il, &v->list_parent.list_contents_il_node);
     v->parent = NULL;
+    
+    value_changed(list);
 }
 
 static struct value * value_init_map (NCDModuleInst *i)
@@ -619,6 +653,7 @@ static struct value * value_init_map (NCDModuleInst *i)
     
     LinkedList0_Init(&v->refs_list);
     v->parent = NULL;
+    v->snapshot = NULL;
     v->type = NCDVAL_MAP;
     
     MapTree_Init(&v->map.map_tree);
@@ -674,6 +709,8 @@ static int value_map_insert (struct value *map, struct value *v, NCDValMem mem,
     ASSERT_EXECUTE(res)
     v->parent = map;
     
+    value_changed(map);
+    
     return 1;
 }
 
@@ -685,6 +722,8 @@ static void value_map_remove (struct value *map, struct value *v)
     MapTree_Remove(&map->map.map_tree, 0, v);
     NCDValMem_Free(&v->map_parent.key_mem);
     v->parent = NULL;
+    
+    value_changed(map);
 }
 
 static void value_map_remove2 (struct value *map, struct value *v, NCDValMem *out_mem, NCDValSafeRef *out_key)
@@ -698,6 +737,8 @@ static void value_map_remove2 (struct value *map, struct value *v, NCDValMem *ou
     *out_mem = v->map_parent.key_mem;
     *out_key = NCDVal_ToSafe(v->map_parent.key);
     v->parent = NULL;
+    
+    value_changed(map);
 }
 
 static struct value * value_init_fromvalue (NCDModuleInst *i, NCDValRef value)
@@ -812,45 +853,79 @@ static int value_to_value (NCDModuleInst *i, struct value *v, NCDValMem *mem, NC
             }
         } break;
         
-        case NCDVAL_LIST: {
-            *out_value = NCDVal_NewList(mem, value_list_len(v));
+        case NCDVAL_LIST:
+        case NCDVAL_MAP: {
+            // lists and maps are built once into a shared snapshot, which can
+            // then be referenced in constant time until the value changes
+            if (!v->snapshot && !value_build_snapshot(i, v)) {
+                goto fail;
+            }
+            
+            *out_value = NCDVal_NewCopy(mem, NCDVal_FromSafe(v->snapshot, v->snapshot_ref));
             if (NCDVal_IsInvalid(*out_value)) {
                 goto fail;
             }
+        } break;
+        
+        default: ASSERT(0);
+    }
+    
+    return 1;
+    
+fail:
+    return 0;
+}
+
+static int value_build_snapshot (NCDModuleInst *i, struct value *v)
+{
+    ASSERT(v->type == NCDVAL_LIST || v->type == NCDVAL_MAP)
+    ASSERT(!v->snapshot)
+    
+    NCDValMem mem;
+    NCDValMem_Init(&mem, i->params->iparams->string_index);
+    
+    NCDValRef out_value;
+    
+    switch (v->type) {
+        case NCDVAL_LIST: {
+            out_value = NCDVal_NewList(&mem, value_list_len(v));
+            if (NCDVal_IsInvalid(out_value)) {
+                goto fail;
+            }
             
             for (size_t index = 0; index < value_list_len(v); index++) {
                 NCDValRef eval;
-                if (!value_to_value(i, value_list_at(v, index), mem, &eval)) {
+                if (!value_to_value(i, value_list_at(v, index), &mem, &eval)) {
                     goto fail;
                 }
                 
-                if (!NCDVal_ListAppend(*out_value, eval)) {
+                if (!NCDVal_ListAppend(out_value, eval)) {
                     goto fail;
                 }
             }
         } break;
         
         case NCDVAL_MAP: {
-            *out_value = NCDVal_NewMap(mem, value_map_len(v));
-            if (NCDVal_IsInvalid(*out_value)) {
+            out_value = NCDVal_NewMap(&mem, value_map_len(v));
+            if (NCDVal_IsInvalid(out_value)) {
                 goto fail;
             }
             
             for (size_t index = 0; index < value_map_len(v); index++) {
                 struct value *ev = value_map_at(v, index);
                 
-                NCDValRef key = NCDVal_NewCopy(mem, ev->map_parent.key);
+                NCDValRef key = NCDVal_NewCopy(&mem, ev->map_parent.key);
                 if (NCDVal_IsInvalid(key)) {
                     goto fail;
                 }
                 
                 NCDValRef val;
-                if (!value_to_value(i, ev, mem, &val)) {
+                if (!value_to_value(i, ev, &mem, &val)) {
                     goto fail;
                 }
                 
                 int inserted;
-                if (!NCDVal_MapInsert(*out_value, key, val, &inserted)) {
+                if (!NCDVal_MapInsert(out_value, key, val, &inserted)) {
                     goto fail;
                 }
                 ASSERT_EXECUTE(inserted)
@@ -860,9 +935,17 @@ static int value_to_value (NCDModuleInst *i, struct value *v, NCDValMem *mem, NC
         default: ASSERT(0);
     }
     
+    NCDValMem *shared = NCDValMem_Share(&mem);
+    if (!shared) {
+        goto fail;
+    }
+    
+    v->snapshot = shared;
+    v->snapshot_ref = NCDVal_ToSafe(NCDVal_Moved(shared, out_value));
     return 1;
     
 fail:
+    NCDValMem_Free(&mem);
     return 0;
 }
 
@@ -1127,6 +1210,7 @@ static int value_append (NCDModuleInst *i, struct value *v, NCDValRef data)
                 char *existing_buf = (char *)NCDRefString_GetBuf(v->storedstring.rstr);
                 NCDVal_StringCopyOut(data, 0, append_length, existing_buf + v_str.len);
                 v->storedstring.length = new_length;
+                value_changed(v);
             } else {
                 // only allocate power-of-two sizez
                 size_t new_size = 16;
@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
 
 #include <misc/version.h>
 #include <misc/loglevel.h>
@@ -39,9 +40,11 @@
 #include <base/BLog.h>
 #include <system/BReactor.h>
 #include <system/BSignal.h>
+#include <system/BUnixSignal.h>
 #include <system/BProcess.h>
 #include <udevmonitor/NCDUdevManager.h>
 #include <random/BRandom2.h>
+#include <threadwork/BThreadWork.h>
 #include <ncd/NCDInterpreter.h>
 #include <ncd/NCDBuildProgram.h>
 
@@ -73,6 +76,8 @@ static struct {
     int retry_time;
     int signal_exit_code;
     int no_udev;
+    int profile;
+    char *program_cache;
     char **extra_args;
     int num_extra_args;
 } options;
@@ -89,14 +94,21 @@ static NCDUdevManager umanager;
 // random number generator
 static BRandom2 random2;
 
+// thread work dispatcher for blocking I/O
+static BThreadWorkDispatcher twd;
+
 // interpreter
 static NCDInterpreter interpreter;
 
+// SIGUSR1 handler for dumping profiling statistics
+static BUnixSignal profile_signal;
+
 // forward declarations of functions
 static void print_help (const char *name);
 static void print_version (void);
 static int parse_arguments (int argc, char *argv[]);
 static void signal_handler (void *unused);
+static void profile_signal_handler (void *unused, int signo);
 static void interpreter_handler_finished (void *user, int exit_code);
 
 int main (int argc, char **argv)
@@ -198,11 +210,23 @@ int main (int argc, char **argv)
         goto fail4;
     }
     
+    // init thread work dispatcher
+    if (!BThreadWorkDispatcher_Init(&twd, &reactor, NUM_IO_THREADS)) {
+        BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init failed");
+        goto fail5;
+    }
+    
     // build program
     NCDProgram program;
-    if (!NCDBuildProgram_Build(options.config_file, &program)) {
+    int build_res;
+    if (options.program_cache) {
+        build_res = NCDBuildProgram_BuildCached(options.config_file, options.program_cache, &program);
+    } else {
+        build_res = NCDBuildProgram_Build(options.config_file, &program);
+    }
+    if (!build_res) {
         BLog(BLOG_ERROR, "failed to build program");
-        goto fail5;
+        goto fail6;
     }
     
     // setup interpreter parameters
@@ -212,20 +236,33 @@ int main (int argc, char **argv)
     params.retry_time = options.retry_time;
     params.extra_args = options.extra_args;
     params.num_extra_args = options.num_extra_args;
+    params.profile = options.profile;
     params.reactor = &reactor;
     params.manager = &manager;
     params.umanager = &umanager;
     params.random2 = &random2;
+    params.twd = &twd;
     
     // initialize interpreter
     if (!NCDInterpreter_Init(&interpreter, program, params)) {
-        goto fail5;
+        goto fail6;
     }
     
     // don't enter event loop if syntax check is requested
     if (options.syntax_only) {
         main_exit_code = 0;
-        goto fail6;
+        goto fail7;
+    }
+    
+    // dump profiling statistics on SIGUSR1
+    if (options.profile) {
+        sigset_t sset;
+        sigemptyset(&sset);
+        sigaddset(&sset, SIGUSR1);
+        if (!BUnixSignal_Init(&profile_signal, &reactor, sset, profile_signal_handler, NULL)) {
+            BLog(BLOG_ERROR, "BUnixSignal_Init failed");
+            goto fail7;
+        }
     }
     
     BLog(BLOG_NOTICE, "entering event loop");
@@ -233,9 +270,20 @@ int main (int argc, char **argv)
     // enter event loop
     main_exit_code = BReactor_Exec(&reactor);
     
-fail6:
+    if (options.profile) {
+        // dump profiling statistics
+        NCDInterpreter_DumpStats(&interpreter);
+        
+        // free SIGUSR1 handler
+        BUnixSignal_Free(&profile_signal, 0);
+    }
+    
+fail7:
     // free interpreter
     NCDInterpreter_Free(&interpreter);
+fail6:
+    // free thread work dispatcher
+    BThreadWorkDispatcher_Free(&twd);
 fail5:
     // remove signal handler
     BSignal_Finish();
@@ -281,6 +329,8 @@ void print_help (const char *name)
         "        [--config-file <ncd_program_file>]\n"
         "        [--syntax-only]\n"
         "        [--signal-exit-code <number>]\n"
+        "        [--profile]\n"
+        "        [--program-cache <file>]\n"
         "        [-- program_args...]\n"
         "        [<ncd_program_file> program_args...]\n" ,
         name
@@ -314,6 +364,8 @@ int parse_arguments (int argc, char *argv[])
     options.retry_time = DEFAULT_RETRY_TIME;
     options.signal_exit_code = DEFAULT_SIGNAL_EXIT_CODE;
     options.no_udev = 0;
+    options.profile = 0;
+    options.program_cache = NULL;
     options.extra_args = NULL;
     options.num_extra_args = 0;
     
@@ -431,6 +483,17 @@ int parse_arguments (int argc, char *argv[])
         else if (!strcmp(arg, "--no-udev")) {
             options.no_udev = 1;
         }
+        else if (!strcmp(arg, "--profile")) {
+            options.profile = 1;
+        }
+        else if (!strcmp(arg, "--program-cache")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.program_cache = argv[i + 1];
+            i++;
+        }
         else if (!strcmp(arg, "--")) {
             options.extra_args = &argv[i + 1];
             options.num_extra_args = argc - i - 1;
@@ -471,6 +534,11 @@ void signal_handler (void *unused)
     NCDInterpreter_RequestShutdown(&interpreter, options.signal_exit_code);
 }
 
+void profile_signal_handler (void *unused, int signo)
+{
+    NCDInterpreter_DumpStats(&interpreter);
+}
+
 void interpreter_handler_finished (void *user, int exit_code)
 {
     BReactor_Quit(&reactor, exit_code);
@@ -38,3 +38,6 @@
 
 // default loglevel
 #define DEFAULT_LOGLEVEL BLOG_WARNING
+
+// number of threads for blocking I/O of modules (e.g. file reads)
+#define NUM_IO_THREADS 2
@@ -160,8 +160,8 @@ static PRInt32 method_write (PRFileDesc *fd, const void *buf, PRInt32 amount)
     }
     
     // limit amount to buffer size
-    if (amount > BSSLCONNECTION_BUF_SIZE) {
-        amount = BSSLCONNECTION_BUF_SIZE;
+    if (amount > BSSLCONNECTION_SEND_BUF_SIZE) {
+        amount = BSSLCONNECTION_SEND_BUF_SIZE;
     }
     
     // init buffer
@@ -47,6 +47,14 @@
 
 #define BSSLCONNECTION_BUF_SIZE 4096
 
+// largest amount of application data NSS puts into one record
+#define BSSLCONNECTION_MAX_RECORD_DATA 16384
+
+// the send buffer holds a whole record (header, data and maximum expansion),
+// so that each record goes out with a single write to the socket. This is
+// about 18 KB per connection, in place of BSSLCONNECTION_BUF_SIZE.
+#define BSSLCONNECTION_SEND_BUF_SIZE (5 + BSSLCONNECTION_MAX_RECORD_DATA + 2048)
+
 #define BSSLCONNECTION_FLAG_THREADWORK_HANDSHAKE (1 << 0)
 #define BSSLCONNECTION_FLAG_THREADWORK_IO (1 << 1)
 
@@ -84,7 +92,7 @@ struct BSSLConnection_backend {
     BThreadWorkDispatcher *twd;
     int flags;
     BSSLConnection *con;
-    uint8_t send_buf[BSSLCONNECTION_BUF_SIZE];
+    uint8_t send_buf[BSSLCONNECTION_SEND_BUF_SIZE];
     int send_busy;
     int send_pos;
     int send_len;
@@ -52,6 +52,17 @@
  *     bytes as needed to align to block size,
  *   - the padded plaintext is encrypted, and
  *   - the initialization vector (IV) is prepended.
+ * 
+ * If AEAD encryption is used instead (no block cipher encryption and no hashes):
+ *   - the plaintext is encrypted and authenticated in a single pass,
+ *   - the nonce is prepended, and
+ *   - the authentication tag is appended.
+ * The nonce consists of a 32-bit little endian prefix identifying the sender's
+ * role (see {@link spproto_aead_nonce_prefix}), followed by a 64-bit little
+ * endian packet counter which starts from zero when a key is set. Both
+ * directions use the same key, so the prefixes keep their nonces apart, and
+ * a receiver only accepts the prefix of the other role. A key must never be
+ * set again after it has been used.
  */
 
 #ifndef BADVPN_PROTOCOL_SPPROTO_H
@@ -65,11 +76,21 @@
 #include <misc/packed.h>
 #include <security/BHash.h>
 #include <security/BEncryption.h>
+#include <security/BAEAD.h>
 #include <security/OTPCalculator.h>
 
 #define SPPROTO_HASH_MODE_NONE 0
 #define SPPROTO_ENCRYPTION_MODE_NONE 0
 #define SPPROTO_OTP_MODE_NONE 0
+#define SPPROTO_AEAD_MODE_NONE 0
+
+#define SPPROTO_AEAD_NONCE_PREFIX_LEN 4
+
+#define SPPROTO_AEAD_ROLE_MASTER 0
+#define SPPROTO_AEAD_ROLE_SLAVE 1
+#define SPPROTO_AEAD_OVERHEAD (BAEAD_NONCE_SIZE + BAEAD_TAG_SIZE)
+
+#define SPPROTO_MAX_KEY_SIZE (BENCRYPTION_MAX_KEY_SIZE > BAEAD_MAX_KEY_SIZE ? BENCRYPTION_MAX_KEY_SIZE : BAEAD_MAX_KEY_SIZE)
 
 /**
  * Stores security parameters for SPProto.
@@ -101,6 +122,14 @@ struct spproto_security_params {
      * OTPs generated from a single seed.
      */
     int otp_num;
+    
+    /**
+     * AEAD mode.
+     * Either SPPROTO_AEAD_MODE_NONE for no AEAD, or a valid {@link BAEAD}
+     * cipher. If not SPPROTO_AEAD_MODE_NONE, encryption_mode and hash_mode
+     * must both be none, since the AEAD cipher provides both.
+     */
+    int aead_mode;
 };
 
 #define SPPROTO_HAVE_HASH(_params) ((_params).hash_mode != SPPROTO_HASH_MODE_NONE)
@@ -114,6 +143,16 @@ struct spproto_security_params {
 
 #define SPPROTO_HAVE_OTP(_params) ((_params).otp_mode != SPPROTO_OTP_MODE_NONE)
 
+#define SPPROTO_HAVE_AEAD(_params) ((_params).aead_mode != SPPROTO_AEAD_MODE_NONE)
+
+// whether an encryption key has to be agreed upon, for either encryption or AEAD
+#define SPPROTO_HAVE_KEY(_params) (SPPROTO_HAVE_ENCRYPTION(_params) || SPPROTO_HAVE_AEAD(_params))
+#define SPPROTO_KEY_SIZE(_params) ( \
+    SPPROTO_HAVE_AEAD(_params) ? \
+    BAEAD_cipher_key_size((_params).aead_mode) : \
+    BEncryption_cipher_key_size((_params).encryption_mode) \
+)
+
 B_START_PACKED
 struct spproto_otpdata {
     uint16_t seed_id;
@@ -138,6 +177,24 @@ static void spproto_assert_security_params (struct spproto_security_params param
     ASSERT(params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE || BEncryption_cipher_valid(params.encryption_mode))
     ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || BEncryption_cipher_valid(params.otp_mode))
     ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || params.otp_num > 0)
+    ASSERT(params.aead_mode == SPPROTO_AEAD_MODE_NONE || BAEAD_cipher_valid(params.aead_mode))
+    ASSERT(params.aead_mode == SPPROTO_AEAD_MODE_NONE || (params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE && params.hash_mode == SPPROTO_HASH_MODE_NONE))
+}
+
+/**
+ * Writes the AEAD nonce prefix used by the sender with the given role.
+ * 
+ * @param role SPPROTO_AEAD_ROLE_MASTER or SPPROTO_AEAD_ROLE_SLAVE
+ * @param out SPPROTO_AEAD_NONCE_PREFIX_LEN bytes will be written here
+ */
+static void spproto_aead_nonce_prefix (int role, uint8_t *out)
+{
+    ASSERT(role == SPPROTO_AEAD_ROLE_MASTER || role == SPPROTO_AEAD_ROLE_SLAVE)
+    
+    out[0] = role;
+    out[1] = 0;
+    out[2] = 0;
+    out[3] = 0;
 }
 
 /**
@@ -154,7 +211,9 @@ static int spproto_payload_mtu_for_carrier_mtu (struct spproto_security_params p
     spproto_assert_security_params(params);
     ASSERT(carrier_mtu >= 0)
     
-    if (params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE) {
+    if (SPPROTO_HAVE_AEAD(params)) {
+        return (carrier_mtu - SPPROTO_AEAD_OVERHEAD - SPPROTO_HEADER_LEN(params));
+    } else if (params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE) {
         return (carrier_mtu - SPPROTO_HEADER_LEN(params));
     } else {
         int block_size = BEncryption_cipher_block_size(params.encryption_mode);
@@ -175,7 +234,13 @@ static int spproto_carrier_mtu_for_payload_mtu (struct spproto_security_params p
     spproto_assert_security_params(params);
     ASSERT(payload_mtu >= 0)
     
-    if (params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE) {
+    if (SPPROTO_HAVE_AEAD(params)) {
+        if (payload_mtu > INT_MAX - (SPPROTO_AEAD_OVERHEAD + SPPROTO_HEADER_LEN(params))) {
+            return -1;
+        }
+        
+        return (SPPROTO_AEAD_OVERHEAD + SPPROTO_HEADER_LEN(params) + payload_mtu);
+    } else if (params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE) {
         if (payload_mtu > INT_MAX - SPPROTO_HEADER_LEN(params)) {
             return -1;
         }
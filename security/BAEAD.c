@@ -0,0 +1,135 @@
+/**
+ * @file BAEAD.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <security/BAEAD.h>
+
+static const EVP_CIPHER * get_evp_cipher (int cipher)
+{
+    switch (cipher) {
+        case BAEAD_CIPHER_AES128_GCM:
+            return EVP_aes_128_gcm();
+        #ifdef BAEAD_HAVE_CHACHA20_POLY1305
+        case BAEAD_CIPHER_CHACHA20_POLY1305:
+            return EVP_chacha20_poly1305();
+        #endif
+        default:
+            ASSERT(0)
+            return NULL;
+    }
+}
+
+int BAEAD_cipher_valid (int cipher)
+{
+    switch (cipher) {
+        case BAEAD_CIPHER_AES128_GCM:
+        #ifdef BAEAD_HAVE_CHACHA20_POLY1305
+        case BAEAD_CIPHER_CHACHA20_POLY1305:
+        #endif
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int BAEAD_cipher_key_size (int cipher)
+{
+    switch (cipher) {
+        case BAEAD_CIPHER_AES128_GCM:
+            return BAEAD_CIPHER_AES128_GCM_KEY_SIZE;
+        case BAEAD_CIPHER_CHACHA20_POLY1305:
+            return BAEAD_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+        default:
+            ASSERT(0)
+            return 0;
+    }
+}
+
+void BAEAD_Init (BAEAD *o, int mode, int cipher, const uint8_t *key)
+{
+    ASSERT(mode == BAEAD_MODE_ENCRYPT || mode == BAEAD_MODE_DECRYPT)
+    ASSERT(BAEAD_cipher_valid(cipher))
+    
+    o->mode = mode;
+    o->cipher = cipher;
+    
+    // create context
+    ASSERT_FORCE(o->ctx = EVP_CIPHER_CTX_new())
+    
+    // set cipher and nonce length; the key is expanded once here, and
+    // only the nonce is changed for every message
+    int enc = (mode == BAEAD_MODE_ENCRYPT);
+    ASSERT_FORCE(EVP_CipherInit_ex(o->ctx, get_evp_cipher(cipher), NULL, NULL, NULL, enc) == 1)
+    ASSERT_FORCE(EVP_CIPHER_CTX_ctrl(o->ctx, EVP_CTRL_AEAD_SET_IVLEN, BAEAD_NONCE_SIZE, NULL) == 1)
+    ASSERT_FORCE(EVP_CipherInit_ex(o->ctx, NULL, NULL, key, NULL, enc) == 1)
+    
+    DebugObject_Init(&o->d_obj);
+}
+
+void BAEAD_Free (BAEAD *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    EVP_CIPHER_CTX_free(o->ctx);
+}
+
+void BAEAD_Encrypt (BAEAD *o, const uint8_t *nonce, const uint8_t *in, uint8_t *out, int len, uint8_t *tag)
+{
+    ASSERT(o->mode == BAEAD_MODE_ENCRYPT)
+    ASSERT(len >= 0)
+    DebugObject_Access(&o->d_obj);
+    
+    int outl;
+    
+    ASSERT_FORCE(EVP_EncryptInit_ex(o->ctx, NULL, NULL, NULL, nonce) == 1)
+    if (len > 0) {
+        ASSERT_FORCE(EVP_EncryptUpdate(o->ctx, out, &outl, in, len) == 1)
+        ASSERT(outl == len)
+    }
+    ASSERT_FORCE(EVP_EncryptFinal_ex(o->ctx, out + len, &outl) == 1)
+    ASSERT(outl == 0)
+    ASSERT_FORCE(EVP_CIPHER_CTX_ctrl(o->ctx, EVP_CTRL_AEAD_GET_TAG, BAEAD_TAG_SIZE, tag) == 1)
+}
+
+int BAEAD_Decrypt (BAEAD *o, const uint8_t *nonce, const uint8_t *in, uint8_t *out, int len, const uint8_t *tag)
+{
+    ASSERT(o->mode == BAEAD_MODE_DECRYPT)
+    ASSERT(len >= 0)
+    DebugObject_Access(&o->d_obj);
+    
+    int outl;
+    
+    ASSERT_FORCE(EVP_DecryptInit_ex(o->ctx, NULL, NULL, NULL, nonce) == 1)
+    if (len > 0) {
+        ASSERT_FORCE(EVP_DecryptUpdate(o->ctx, out, &outl, in, len) == 1)
+        ASSERT(outl == len)
+    }
+    ASSERT_FORCE(EVP_CIPHER_CTX_ctrl(o->ctx, EVP_CTRL_AEAD_SET_TAG, BAEAD_TAG_SIZE, (void *)tag) == 1)
+    
+    return (EVP_DecryptFinal_ex(o->ctx, out + len, &outl) == 1);
+}
@@ -0,0 +1,143 @@
+/**
+ * @file BAEAD.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Authenticated encryption (AEAD) ciphers, implemented with OpenSSL EVP.
+ * Encryption and authentication are done in a single pass over the data.
+ */
+
+#ifndef BADVPN_SECURITY_BAEAD_H
+#define BADVPN_SECURITY_BAEAD_H
+
+#include <stdint.h>
+
+#include <openssl/opensslv.h>
+#include <openssl/evp.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+
+#define BAEAD_MODE_ENCRYPT 1
+#define BAEAD_MODE_DECRYPT 2
+
+#define BAEAD_NONCE_SIZE 12
+#define BAEAD_TAG_SIZE 16
+#define BAEAD_MAX_KEY_SIZE 32
+
+#define BAEAD_CIPHER_AES128_GCM 1
+#define BAEAD_CIPHER_AES128_GCM_KEY_SIZE 16
+
+#define BAEAD_CIPHER_CHACHA20_POLY1305 2
+#define BAEAD_CIPHER_CHACHA20_POLY1305_KEY_SIZE 32
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305)
+#define BAEAD_HAVE_CHACHA20_POLY1305 1
+#endif
+
+// NOTE: update the maximums above when adding a cipher!
+
+/**
+ * AEAD cipher context with a fixed key.
+ * An object must not be used by multiple threads at the same time.
+ */
+typedef struct {
+    DebugObject d_obj;
+    int mode;
+    int cipher;
+    EVP_CIPHER_CTX *ctx;
+} BAEAD;
+
+/**
+ * Checks if the given cipher number is valid and supported
+ * by the OpenSSL library we were built with.
+ * 
+ * @param cipher cipher number
+ * @return 1 if valid, 0 if not
+ */
+int BAEAD_cipher_valid (int cipher);
+
+/**
+ * Returns the key size of a cipher.
+ * 
+ * @param cipher cipher number. Must be valid.
+ * @return key size in bytes
+ */
+int BAEAD_cipher_key_size (int cipher);
+
+/**
+ * Initializes the object.
+ * {@link BSecurity_GlobalInitThreadSafe} must have been done if this object
+ * will be used from a non-main thread.
+ * 
+ * @param o the object
+ * @param mode BAEAD_MODE_ENCRYPT or BAEAD_MODE_DECRYPT
+ * @param cipher cipher number. Must be valid.
+ * @param key encryption key, {@link BAEAD_cipher_key_size} bytes
+ */
+void BAEAD_Init (BAEAD *o, int mode, int cipher, const uint8_t *key);
+
+/**
+ * Frees the object.
+ * 
+ * @param o the object
+ */
+void BAEAD_Free (BAEAD *o);
+
+/**
+ * Encrypts data and computes the authentication tag.
+ * The object must have been initialized with mode BAEAD_MODE_ENCRYPT.
+ * A nonce must never be used twice with the same key.
+ * 
+ * @param o the object
+ * @param nonce nonce, BAEAD_NONCE_SIZE bytes
+ * @param in data to encrypt
+ * @param out where to write the ciphertext. May be the same as in, but the
+ *            buffers must not otherwise overlap.
+ * @param len length of data. Must be >=0.
+ * @param tag where to write the tag, BAEAD_TAG_SIZE bytes
+ */
+void BAEAD_Encrypt (BAEAD *o, const uint8_t *nonce, const uint8_t *in, uint8_t *out, int len, uint8_t *tag);
+
+/**
+ * Decrypts data and verifies the authentication tag.
+ * The object must have been initialized with mode BAEAD_MODE_DECRYPT.
+ * If verification fails, the contents of out are undefined.
+ * 
+ * @param o the object
+ * @param nonce nonce, BAEAD_NONCE_SIZE bytes
+ * @param in data to decrypt
+ * @param out where to write the plaintext. May be the same as in, but the
+ *            buffers must not otherwise overlap.
+ * @param len length of data. Must be >=0.
+ * @param tag tag to verify, BAEAD_TAG_SIZE bytes
+ * @return 1 if the data is authentic, 0 if not
+ */
+int BAEAD_Decrypt (BAEAD *o, const uint8_t *nonce, const uint8_t *in, uint8_t *out, int len, const uint8_t *tag) WARN_UNUSED;
+
+#endif
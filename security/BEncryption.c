@@ -27,6 +27,8 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <openssl/err.h>
+
 #include <base/BLog.h>
 
 #include <security/BEncryption.h>
@@ -57,6 +59,89 @@ int BEncryption_cipher_block_size (int cipher)
     }
 }
 
+static const EVP_CIPHER * evp_cipher (int cipher)
+{
+    switch (cipher) {
+        case BENCRYPTION_CIPHER_BLOWFISH:
+            return EVP_bf_cbc();
+        case BENCRYPTION_CIPHER_AES:
+            return EVP_aes_128_cbc();
+        default:
+            ASSERT(0)
+            return NULL;
+    }
+}
+
+static EVP_CIPHER_CTX * evp_init_ctx (int cipher, uint8_t *key, int enc)
+{
+    const EVP_CIPHER *type = evp_cipher(cipher);
+    if (!type) {
+        goto fail0;
+    }
+    
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        goto fail0;
+    }
+    
+    // Blowfish has a variable key length, set it before the key
+    if (!EVP_CipherInit_ex(ctx, type, NULL, NULL, NULL, enc)) {
+        goto fail1;
+    }
+    if (!EVP_CIPHER_CTX_set_key_length(ctx, BEncryption_cipher_key_size(cipher))) {
+        goto fail1;
+    }
+    if (!EVP_CipherInit_ex(ctx, NULL, NULL, key, NULL, enc)) {
+        goto fail1;
+    }
+    
+    // we only ever process whole blocks
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    
+    return ctx;
+    
+fail1:
+    EVP_CIPHER_CTX_free(ctx);
+fail0:
+    ERR_clear_error();
+    return NULL;
+}
+
+static int evp_init (BEncryption *enc, uint8_t *key)
+{
+    enc->evp.encrypt = NULL;
+    enc->evp.decrypt = NULL;
+    
+    if (enc->mode&BENCRYPTION_MODE_ENCRYPT) {
+        if (!(enc->evp.encrypt = evp_init_ctx(enc->cipher, key, 1))) {
+            goto fail0;
+        }
+    }
+    
+    if (enc->mode&BENCRYPTION_MODE_DECRYPT) {
+        if (!(enc->evp.decrypt = evp_init_ctx(enc->cipher, key, 0))) {
+            goto fail1;
+        }
+    }
+    
+    return 1;
+    
+fail1:
+    if (enc->evp.encrypt) {
+        EVP_CIPHER_CTX_free(enc->evp.encrypt);
+    }
+fail0:
+    return 0;
+}
+
+static void evp_crypt (EVP_CIPHER_CTX *ctx, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
+{
+    int out_len;
+    ASSERT_FORCE(EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1))
+    ASSERT_FORCE(EVP_CipherUpdate(ctx, out, &out_len, in, len))
+    ASSERT(out_len == len)
+}
+
 int BEncryption_cipher_key_size (int cipher)
 {
     switch (cipher) {
@@ -71,15 +156,30 @@ int BEncryption_cipher_key_size (int cipher)
 }
 
 void BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key)
+{
+    int res = BEncryption_InitBackend(enc, mode, cipher, key, BENCRYPTION_BACKEND_AUTO);
+    ASSERT_EXECUTE(res)
+}
+
+int BEncryption_InitBackend (BEncryption *enc, int mode, int cipher, uint8_t *key, int backend)
 {
     ASSERT(!(mode&~(BENCRYPTION_MODE_ENCRYPT|BENCRYPTION_MODE_DECRYPT)))
     ASSERT((mode&BENCRYPTION_MODE_ENCRYPT) || (mode&BENCRYPTION_MODE_DECRYPT))
+    ASSERT(BEncryption_cipher_valid(cipher))
+    ASSERT(backend == BENCRYPTION_BACKEND_AUTO || backend == BENCRYPTION_BACKEND_EVP || backend == BENCRYPTION_BACKEND_LOWLEVEL)
     
     enc->mode = mode;
     enc->cipher = cipher;
+    enc->use_evp = 0;
     
     #ifdef BADVPN_USE_CRYPTODEV
     
+    enc->use_cryptodev = 0;
+    
+    if (backend != BENCRYPTION_BACKEND_AUTO) {
+        goto fail1;
+    }
+    
     switch (enc->cipher) {
         case BENCRYPTION_CIPHER_AES:
             enc->cryptodev.cipher = CRYPTO_AES_CBC;
@@ -119,10 +219,20 @@ fail2:
     ASSERT_FORCE(close(enc->cryptodev.fd) == 0)
 fail1:
     
-    enc->use_cryptodev = 0;
-    
     #endif
     
+    if (backend == BENCRYPTION_BACKEND_AUTO || backend == BENCRYPTION_BACKEND_EVP) {
+        // EVP may not provide some ciphers (e.g. Blowfish without the legacy
+        // provider in OpenSSL 3), in which case we fall back to the low-level functions
+        if (evp_init(enc, key)) {
+            enc->use_evp = 1;
+            goto success;
+        }
+        if (backend == BENCRYPTION_BACKEND_EVP) {
+            return 0;
+        }
+    }
+    
     int res;
     
     switch (enc->cipher) {
@@ -144,11 +254,11 @@ fail1:
             ;
     }
     
-    #ifdef BADVPN_USE_CRYPTODEV
 success:
-    #endif
     // init debug object
     DebugObject_Init(&enc->d_obj);
+    
+    return 1;
 }
 
 void BEncryption_Free (BEncryption *enc)
@@ -165,6 +275,15 @@ void BEncryption_Free (BEncryption *enc)
     }
     
     #endif
+    
+    if (enc->use_evp) {
+        if (enc->evp.encrypt) {
+            EVP_CIPHER_CTX_free(enc->evp.encrypt);
+        }
+        if (enc->evp.decrypt) {
+            EVP_CIPHER_CTX_free(enc->evp.decrypt);
+        }
+    }
 }
 
 void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
@@ -191,6 +310,21 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
     
     #endif
     
+    if (enc->use_evp) {
+        if (len == 0) {
+            return;
+        }
+        
+        int block_size = BEncryption_cipher_block_size(enc->cipher);
+        
+        evp_crypt(enc->evp.encrypt, in, out, len, iv);
+        
+        // the next IV is the last ciphertext block
+        memcpy(iv, out + len - block_size, block_size);
+        
+        return;
+    }
+    
     switch (enc->cipher) {
         case BENCRYPTION_CIPHER_BLOWFISH:
             BF_cbc_encrypt(in, out, len, &enc->blowfish, iv, BF_ENCRYPT);
@@ -227,6 +361,25 @@ void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
     
     #endif
     
+    if (enc->use_evp) {
+        if (len == 0) {
+            return;
+        }
+        
+        int block_size = BEncryption_cipher_block_size(enc->cipher);
+        
+        // the next IV is the last ciphertext block; save it since
+        // decryption may be in-place
+        uint8_t next_iv[BENCRYPTION_MAX_BLOCK_SIZE];
+        memcpy(next_iv, in + len - block_size, block_size);
+        
+        evp_crypt(enc->evp.decrypt, in, out, len, iv);
+        
+        memcpy(iv, next_iv, block_size);
+        
+        return;
+    }
+    
     switch (enc->cipher) {
         case BENCRYPTION_CIPHER_BLOWFISH:
             BF_cbc_encrypt(in, out, len, &enc->blowfish, iv, BF_DECRYPT);
@@ -50,6 +50,7 @@
 
 #include <openssl/blowfish.h>
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 
 #include <misc/debug.h>
 #include <base/DebugObject.h>
@@ -57,6 +58,10 @@
 #define BENCRYPTION_MODE_ENCRYPT 1
 #define BENCRYPTION_MODE_DECRYPT 2
 
+#define BENCRYPTION_BACKEND_AUTO 0
+#define BENCRYPTION_BACKEND_EVP 1
+#define BENCRYPTION_BACKEND_LOWLEVEL 2
+
 #define BENCRYPTION_MAX_BLOCK_SIZE 16
 #define BENCRYPTION_MAX_KEY_SIZE 16
 
@@ -72,6 +77,7 @@
 
 /**
  * Block cipher encryption abstraction.
+ * An object must not be used by multiple threads at the same time.
  */
 typedef struct {
     DebugObject d_obj;
@@ -80,6 +86,11 @@ typedef struct {
     #ifdef BADVPN_USE_CRYPTODEV
     int use_cryptodev;
     #endif
+    int use_evp;
+    struct {
+        EVP_CIPHER_CTX *encrypt;
+        EVP_CIPHER_CTX *decrypt;
+    } evp;
     union {
         BF_KEY blowfish;
         struct {
@@ -135,6 +146,24 @@ int BEncryption_cipher_key_size (int cipher);
  */
 void BEncryption_Init (BEncryption *enc, int mode, int cipher, uint8_t *key);
 
+/**
+ * Initializes the object using a specific implementation.
+ * With BENCRYPTION_BACKEND_AUTO, this is the same as {@link BEncryption_Init},
+ * which prefers /dev/crypto (if compiled in), then OpenSSL EVP (which can use
+ * pipelined AES-NI code), then the OpenSSL low-level cipher functions.
+ * Other backends are mostly useful for benchmarking.
+ * 
+ * @param enc the object
+ * @param mode as in {@link BEncryption_Init}
+ * @param cipher cipher number. Must be valid.
+ * @param key encryption key
+ * @param backend BENCRYPTION_BACKEND_AUTO, BENCRYPTION_BACKEND_EVP or
+ *                BENCRYPTION_BACKEND_LOWLEVEL
+ * @return 1 on success, 0 if the requested backend is not available for
+ *         this cipher. Always succeeds with BENCRYPTION_BACKEND_AUTO.
+ */
+int BEncryption_InitBackend (BEncryption *enc, int mode, int cipher, uint8_t *key, int backend);
+
 /**
  * Frees the object.
  * 
@@ -33,45 +33,43 @@
 
 #include <security/OTPChecker.h>
 
+static int OTPChecker_Table_Index (OTPChecker *mc, otp_t otp);
 static void OTPChecker_Table_Empty (OTPChecker *mc, struct OTPChecker_table *t);
 static void OTPChecker_Table_AddOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp);
 static void OTPChecker_Table_Generate (OTPChecker *mc, struct OTPChecker_table *t, OTPCalculator *calc, uint8_t *key, uint8_t *iv);
 static int OTPChecker_Table_CheckOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp);
 
+int OTPChecker_Table_Index (OTPChecker *mc, otp_t otp)
+{
+    return (uint32_t)(otp * UINT32_C(2654435761)) >> mc->entries_shift;
+}
+
 void OTPChecker_Table_Empty (OTPChecker *mc, struct OTPChecker_table *t)
 {
-    for (int i = 0; i < mc->num_entries; i++) {
-        t->entries[i].avail = -1;
-    }
+    memset(t->entries, 0, (size_t)mc->num_entries * sizeof(t->entries[0]));
 }
 
 void OTPChecker_Table_AddOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp)
 {
-    // calculate starting index
-    int start_index = otp % mc->num_entries;
+    int mask = mc->num_entries - 1;
     
     // try indexes starting with the base position
-    for (int i = 0; i < mc->num_entries; i++) {
-        int index = bmodadd_int(start_index, i, mc->num_entries);
-        struct OTPChecker_entry *entry = &t->entries[index];
+    for (int index = OTPChecker_Table_Index(mc, otp);; index = (index + 1) & mask) {
+        OTPChecker_entry *entry = &t->entries[index];
         
         // if we find a free index, use it
-        if (entry->avail < 0) {
-            entry->otp = otp;
-            entry->avail = 1;
+        if (*entry == 0) {
+            *entry = ((uint64_t)otp << 32) | 2;
             return;
         }
         
-        // if we find a used index with the same mac,
+        // if we find a used index with the same OTP,
         // use it by incrementing its count
-        if (entry->otp == otp) {
-            entry->avail++;
+        if ((otp_t)(*entry >> 32) == otp) {
+            (*entry)++;
             return;
         }
     }
-    
-    // will never add more macs than we can hold
-    ASSERT(0)
 }
 
 void OTPChecker_Table_Generate (OTPChecker *mc, struct OTPChecker_table *t, OTPCalculator *calc, uint8_t *key, uint8_t *iv)
@@ -90,32 +88,27 @@ void OTPChecker_Table_Generate (OTPChecker *mc, struct OTPChecker_table *t, OTPC
 
 int OTPChecker_Table_CheckOTP (OTPChecker *mc, struct OTPChecker_table *t, otp_t otp)
 {
-    // calculate starting index
-    int start_index = otp % mc->num_entries;
+    int mask = mc->num_entries - 1;
     
-    // try indexes starting with the base position
-    for (int i = 0; i < mc->num_entries; i++) {
-        int index = bmodadd_int(start_index, i, mc->num_entries);
-        struct OTPChecker_entry *entry = &t->entries[index];
+    // try indexes starting with the base position;
+    // there are always empty entries, so this terminates
+    for (int index = OTPChecker_Table_Index(mc, otp);; index = (index + 1) & mask) {
+        OTPChecker_entry *entry = &t->entries[index];
         
-        // if we find an empty entry, there is no such mac
-        if (entry->avail < 0) {
+        // if we find an empty entry, there is no such OTP
+        if (*entry == 0) {
             return 0;
         }
         
         // if we find a matching entry, check its count
-        if (entry->otp == otp) {
-            if (entry->avail > 0) {
-                entry->avail--;
+        if ((otp_t)(*entry >> 32) == otp) {
+            if ((uint32_t)*entry > 1) {
+                (*entry)--;
                 return 1;
             }
             return 0;
         }
     }
-    
-    // there are always empty slots
-    ASSERT(0)
-    return 0;
 }
 
 static void work_func (OTPChecker *mc)
@@ -163,11 +156,17 @@ int OTPChecker_Init (OTPChecker *mc, int num_otps, int cipher, int num_tables, B
     // set no handlers
     mc->handler = NULL;
     
-    // set number of entries
-    if (mc->num_otps > INT_MAX / 2) {
+    // set number of entries, a power of two at least twice the number of OTPs,
+    // so that the tables are at most half full
+    if (mc->num_otps > INT_MAX / 4) {
         goto fail0;
     }
-    mc->num_entries = 2 * mc->num_otps;
+    mc->num_entries = 2;
+    mc->entries_shift = 31;
+    while (mc->num_entries < 2 * mc->num_otps) {
+        mc->num_entries *= 2;
+        mc->entries_shift--;
+    }
     
     // set no tables used
     mc->tables_used = 0;
@@ -184,7 +183,7 @@ int OTPChecker_Init (OTPChecker *mc, int num_otps, int cipher, int num_tables, B
     }
     
     // allocate entries
-    if (!(mc->entries = (struct OTPChecker_entry *)BAllocArray2(mc->num_tables, mc->num_entries, sizeof(mc->entries[0])))) {
+    if (!(mc->entries = (OTPChecker_entry *)BAllocArray2(mc->num_tables, mc->num_entries, sizeof(mc->entries[0])))) {
         goto fail2;
     }
     
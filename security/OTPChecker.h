@@ -43,14 +43,15 @@
 #include <base/DebugObject.h>
 #include <threadwork/BThreadWork.h>
 
-struct OTPChecker_entry {
-    otp_t otp;
-    int avail;
-};
+/**
+ * Hash table entry: the OTP in the upper 32 bits, and the number of times
+ * it may still be accepted plus one in the lower 32 bits. Zero means empty.
+ */
+typedef uint64_t OTPChecker_entry;
 
 struct OTPChecker_table {
     uint16_t id;
-    struct OTPChecker_entry *entries;
+    OTPChecker_entry *entries;
 };
 
 /**
@@ -71,12 +72,13 @@ typedef struct {
     int num_otps;
     int cipher;
     int num_entries;
+    int entries_shift;
     int num_tables;
     int tables_used;
     int next_table;
     OTPCalculator calc;
     struct OTPChecker_table *tables;
-    struct OTPChecker_entry *entries;
+    OTPChecker_entry *entries;
     int tw_have;
     BThreadWork tw;
     uint8_t tw_key[BENCRYPTION_MAX_KEY_SIZE];
@@ -0,0 +1,204 @@
+/**
+ * @file ServerShardQueue.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include <server/ServerShardQueue.h>
+
+#define RECORD_HEADER 8
+#define RECORD_SIZE(len) (RECORD_HEADER + (((len) + 7) & ~7))
+
+static struct ServerShardQueue_block * new_block (ServerShardQueue *o)
+{
+    // reuse the spare block if the consumer left one
+    struct ServerShardQueue_block *b = __atomic_exchange_n(&o->spare, NULL, __ATOMIC_ACQUIRE);
+    if (!b && !(b = (struct ServerShardQueue_block *)malloc(sizeof(*b)))) {
+        return NULL;
+    }
+    
+    b->next = NULL;
+    b->committed = 0;
+    
+    return b;
+}
+
+int ServerShardQueue_Init (ServerShardQueue *o)
+{
+    o->spare = NULL;
+    
+    // allocate first block
+    struct ServerShardQueue_block *b = new_block(o);
+    if (!b) {
+        return 0;
+    }
+    
+    // init producer
+    o->tail = b;
+    o->write_pos = 0;
+    o->write_len = -1;
+    
+    // init consumer
+    o->head = b;
+    o->read_pos = 0;
+    o->read_bytes = 0;
+    
+    // nothing queued
+    o->queued_bytes = 0;
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+}
+
+void ServerShardQueue_Free (ServerShardQueue *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free blocks
+    struct ServerShardQueue_block *b = o->head;
+    while (b) {
+        struct ServerShardQueue_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    
+    // free spare block
+    if (o->spare) {
+        free(o->spare);
+    }
+}
+
+uint8_t * ServerShardQueue_StartMessage (ServerShardQueue *o, int len)
+{
+    ASSERT(len >= 0)
+    ASSERT(len <= SERVERSHARDQUEUE_MAX_MESSAGE)
+    ASSERT(o->write_len == -1)
+    DebugObject_Access(&o->d_obj);
+    
+    // continue in a new block if the message doesn't fit
+    if (o->write_pos + RECORD_SIZE(len) > SERVERSHARDQUEUE_BLOCK_SIZE) {
+        struct ServerShardQueue_block *b = new_block(o);
+        if (!b) {
+            return NULL;
+        }
+        
+        // the consumer moves on once it sees the next block, so everything
+        // in the current block must have been committed by now
+        __atomic_store_n(&o->tail->next, b, __ATOMIC_RELEASE);
+        
+        o->tail = b;
+        o->write_pos = 0;
+    }
+    
+    // write length
+    uint8_t *record = o->tail->data + o->write_pos;
+    *(int32_t *)record = len;
+    
+    o->write_len = len;
+    
+    return record + RECORD_HEADER;
+}
+
+void ServerShardQueue_EndMessage (ServerShardQueue *o)
+{
+    ASSERT(o->write_len >= 0)
+    DebugObject_Access(&o->d_obj);
+    
+    int size = RECORD_SIZE(o->write_len);
+    
+    // publish
+    o->write_pos += size;
+    __atomic_store_n(&o->tail->committed, o->write_pos, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&o->queued_bytes, size, __ATOMIC_RELAXED);
+    
+    o->write_len = -1;
+}
+
+size_t ServerShardQueue_QueuedBytes (ServerShardQueue *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return __atomic_load_n(&o->queued_bytes, __ATOMIC_RELAXED);
+}
+
+int ServerShardQueue_Peek (ServerShardQueue *o, uint8_t **data, int *len)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    while (o->read_pos == __atomic_load_n(&o->head->committed, __ATOMIC_ACQUIRE)) {
+        // the producer commits the last message of a block before linking
+        // the next block, so look at the committed position once more
+        struct ServerShardQueue_block *next = __atomic_load_n(&o->head->next, __ATOMIC_ACQUIRE);
+        if (!next) {
+            return 0;
+        }
+        if (o->read_pos != __atomic_load_n(&o->head->committed, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        
+        // leave the block for the producer to reuse
+        struct ServerShardQueue_block *old = __atomic_exchange_n(&o->spare, o->head, __ATOMIC_RELEASE);
+        if (old) {
+            free(old);
+        }
+        
+        o->head = next;
+        o->read_pos = 0;
+    }
+    
+    uint8_t *record = o->head->data + o->read_pos;
+    if (len) {
+        *len = *(int32_t *)record;
+    }
+    if (data) {
+        *data = record + RECORD_HEADER;
+    }
+    
+    return 1;
+}
+
+void ServerShardQueue_Next (ServerShardQueue *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->read_pos < __atomic_load_n(&o->head->committed, __ATOMIC_ACQUIRE))
+    
+    int size = RECORD_SIZE(*(int32_t *)(o->head->data + o->read_pos));
+    
+    o->read_pos += size;
+    o->read_bytes += size;
+}
+
+void ServerShardQueue_Release (ServerShardQueue *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    if (o->read_bytes > 0) {
+        __atomic_sub_fetch(&o->queued_bytes, o->read_bytes, __ATOMIC_RELAXED);
+        o->read_bytes = 0;
+    }
+}
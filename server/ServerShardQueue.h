@@ -0,0 +1,162 @@
+/**
+ * @file ServerShardQueue.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Unbounded single-producer single-consumer message queue for passing
+ * messages between the threads of a sharded server.
+ */
+
+#ifndef BADVPN_SERVER_SERVERSHARDQUEUE_H
+#define BADVPN_SERVER_SERVERSHARDQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+
+/**
+ * Size of the blocks messages are stored in.
+ */
+#define SERVERSHARDQUEUE_BLOCK_SIZE 32768
+
+/**
+ * Maximum length of a message.
+ */
+#define SERVERSHARDQUEUE_MAX_MESSAGE (SERVERSHARDQUEUE_BLOCK_SIZE - 8)
+
+struct ServerShardQueue_block {
+    struct ServerShardQueue_block *next;
+    int committed;
+    uint8_t data[SERVERSHARDQUEUE_BLOCK_SIZE];
+};
+
+/**
+ * Unbounded single-producer single-consumer message queue.
+ * 
+ * Messages are stored in a chain of fixed-size blocks. The producer only writes
+ * to the last block and the consumer only reads from the first one; a block
+ * which has been read completely is kept as a spare for the producer. Neither
+ * side takes a lock or makes a system call; waking up the consumer is up to the
+ * user.
+ * 
+ * The queue keeps a count of the bytes in it, which the producer may use to
+ * stop pushing when the consumer is falling behind.
+ */
+typedef struct {
+    // producer
+    struct ServerShardQueue_block *tail;
+    int write_pos;
+    int write_len;
+    char pad1[64];
+    // consumer
+    struct ServerShardQueue_block *head;
+    int read_pos;
+    size_t read_bytes;
+    char pad2[64];
+    // shared
+    struct ServerShardQueue_block *spare;
+    size_t queued_bytes;
+    char pad3[64];
+    DebugObject d_obj;
+} ServerShardQueue;
+
+/**
+ * Initializes the queue.
+ * 
+ * @param o the object
+ * @return 1 on success, 0 on failure
+ */
+int ServerShardQueue_Init (ServerShardQueue *o) WARN_UNUSED;
+
+/**
+ * Frees the queue, discarding any messages in it.
+ * Neither side may be using the queue.
+ * 
+ * @param o the object
+ */
+void ServerShardQueue_Free (ServerShardQueue *o);
+
+/**
+ * Starts writing a message. Producer only.
+ * The message must be finished with {@link ServerShardQueue_EndMessage} before
+ * another one is started.
+ * 
+ * @param o the object
+ * @param len length of the message. Must be >=0 and <=SERVERSHARDQUEUE_MAX_MESSAGE.
+ * @return pointer to write the message to, or NULL if out of memory
+ */
+uint8_t * ServerShardQueue_StartMessage (ServerShardQueue *o, int len);
+
+/**
+ * Publishes the message started with {@link ServerShardQueue_StartMessage}
+ * to the consumer. Producer only.
+ * 
+ * @param o the object
+ */
+void ServerShardQueue_EndMessage (ServerShardQueue *o);
+
+/**
+ * Returns the number of bytes the consumer has not yet released.
+ * Producer only; the value may be larger than the actual one.
+ * 
+ * @param o the object
+ * @return number of queued bytes
+ */
+size_t ServerShardQueue_QueuedBytes (ServerShardQueue *o);
+
+/**
+ * Returns the first message in the queue. Consumer only.
+ * The message stays valid until {@link ServerShardQueue_Next} is called.
+ * 
+ * @param o the object
+ * @param data the message will be returned here, if not NULL
+ * @param len the length of the message will be returned here, if not NULL
+ * @return 1 if there was a message, 0 if the queue was empty
+ */
+int ServerShardQueue_Peek (ServerShardQueue *o, uint8_t **data, int *len);
+
+/**
+ * Removes the first message from the queue. Consumer only.
+ * There must be a message, as reported by {@link ServerShardQueue_Peek}.
+ * 
+ * @param o the object
+ */
+void ServerShardQueue_Next (ServerShardQueue *o);
+
+/**
+ * Releases the space of the messages removed so far from the byte count
+ * reported to the producer. Consumer only. This is meant to be called once
+ * after a batch of messages rather than for every message.
+ * 
+ * @param o the object
+ */
+void ServerShardQueue_Release (ServerShardQueue *o);
+
+#endif
@@ -0,0 +1,1713 @@
+/**
+ * @file ServerShards.c
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+
+#ifdef BADVPN_LINUX
+#include <sys/eventfd.h>
+#endif
+
+#include <ssl.h>
+#include <cert.h>
+
+#include <misc/offset.h>
+#include <misc/byteorder.h>
+#include <misc/balloc.h>
+#include <misc/compare.h>
+#include <base/BLog.h>
+#include <base/BLog_binary.h>
+#include <system/BConnection.h>
+#include <flow/PacketProtoDecoder.h>
+#include <flow/PacketStreamSender.h>
+#include <flowextra/PacketStreamCoalescer.h>
+#include <flow/PacketPassPriorityQueue.h>
+#include <flow/PacketPassFairQueue.h>
+#include <flow/PacketProtoFlow.h>
+#include <nspr_support/BSSLConnection.h>
+
+#include <server/ServerShards.h>
+
+#include <generated/blog_channel_ServerShards.h>
+
+#define MSG_QUIT 1
+#define MSG_ADD_CLIENT 2
+#define MSG_REMOVE_CLIENT 3
+#define MSG_CONTROL 4
+#define MSG_ENDPOINT_OPEN 5
+#define MSG_ENDPOINT_CLOSE 6
+#define MSG_ROUTE_ADD 7
+#define MSG_ROUTE_DEL 8
+#define MSG_CLIENT_UP 9
+#define MSG_CLIENT_PACKET 10
+#define MSG_CLIENT_DOWN 11
+#define MSG_FLOW_OVERFLOW 12
+#define MSG_FLOW_DONE 13
+#define MSG_INMSG 14
+
+#define REMOVAL_RETRY_TIME 100
+
+#define CLIENT_STATE_HANDSHAKE 1
+#define CLIENT_STATE_LINK 2
+#define CLIENT_STATE_DOWN 3
+
+// message between threads, possibly followed by data
+struct msg {
+    int type;
+    // ADD_CLIENT: socket
+    int fd;
+    // ROUTE_ADD: shard of destination client
+    int shard;
+    // ADD_CLIENT: client ID; ROUTE_*: destination client ID
+    peerid_t id;
+    // client key, or flow key for ENDPOINT_* and FLOW_*
+    uint64_t key;
+    // ROUTE_*: flow key; ENDPOINT_OPEN: destination client key
+    uint64_t key2;
+    // ADD_CLIENT: client address
+    BAddr addr;
+};
+
+// peer message from one shard to another, followed by the payload
+struct inmsg {
+    int type;
+    peerid_t src_id;
+    uint64_t flow_key;
+};
+
+struct shard_client {
+    struct ServerShards_shard *sh;
+    uint64_t key;
+    peerid_t id;
+    BAddr addr;
+    int state;
+    
+    // connection
+    BConnection con;
+    PRFileDesc bottom_prfd;
+    PRFileDesc *ssl_prfd;
+    BSSLConnection sslcon;
+    
+    // no data timer
+    BTimer disconnect_timer;
+    
+    // input
+    PacketProtoDecoder input_decoder;
+    PacketPassInterface input_interface;
+    
+    // output common
+    PacketStreamSender output_sender;
+    PacketStreamCoalescer output_coalescer;
+    PacketPassPriorityQueue output_priorityqueue;
+    
+    // output control flow
+    PacketPassPriorityQueueFlow output_control_qflow;
+    PacketProtoFlow output_control_oflow;
+    BufferWriter *output_control_input;
+    
+    // output peers flow
+    PacketPassPriorityQueueFlow output_peers_qflow;
+    PacketPassFairQueue output_peers_fairqueue;
+    
+    // whether the client has sent hello, and whether its flows start accepted
+    int got_hello;
+    int implicit_accept;
+    
+    // flows from this client (by destination ID)
+    BAVL routes_tree;
+    
+    // flows to this client
+    LinkedList1 endpoints_list;
+    
+    // node in shard clients tree (by key) and list
+    BAVLNode tree_node;
+    LinkedList1Node list_node;
+};
+
+struct shard_route {
+    uint64_t flow_key;
+    peerid_t dest_id;
+    int dest_shard;
+    int accepted;
+    int overflowed;
+    BAVLNode tree_node;
+};
+
+struct shard_endpoint {
+    struct shard_client *client;
+    uint64_t key;
+    PacketPassFairQueueFlow qflow;
+    PacketProtoFlow oflow;
+    BufferWriter *input;
+    int closing;
+    int overflowed;
+    BAVLNode tree_node;
+    LinkedList1Node list_node;
+};
+
+static int uint64_comparator (void *unused, uint64_t *v1, uint64_t *v2)
+{
+    return B_COMPARE(*v1, *v2);
+}
+
+static int peerid_comparator (void *unused, peerid_t *p1, peerid_t *p2)
+{
+    return B_COMPARE(*p1, *p2);
+}
+
+static ServerShardQueue * get_queue (ServerShards *o, int from, int to)
+{
+    ASSERT(from != to)
+    
+    return &o->queues[from * (o->params.num_shards + 1) + to];
+}
+
+static struct ServerShards_inbox * get_inbox (ServerShards *o, int index)
+{
+    return (index == o->params.num_shards ? &o->inbox : &o->shards[index].inbox);
+}
+
+static int inbox_init (struct ServerShards_inbox *in, BReactor *reactor, BFileDescriptor_handler handler, void *user)
+{
+    in->notified = 0;
+    
+    #ifdef BADVPN_LINUX
+    
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        BLog(BLOG_ERROR, "eventfd failed");
+        goto fail0;
+    }
+    in->fds[0] = fd;
+    in->fds[1] = fd;
+    
+    #else
+    
+    if (pipe(in->fds) < 0) {
+        BLog(BLOG_ERROR, "pipe failed");
+        goto fail0;
+    }
+    
+    if (fcntl(in->fds[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(in->fds[1], F_SETFL, O_NONBLOCK) < 0) {
+        BLog(BLOG_ERROR, "fcntl failed");
+        goto fail1;
+    }
+    
+    #endif
+    
+    BFileDescriptor_Init(&in->bfd, in->fds[0], handler, user);
+    if (!BReactor_AddFileDescriptor(reactor, &in->bfd)) {
+        BLog(BLOG_ERROR, "BReactor_AddFileDescriptor failed");
+        goto fail1;
+    }
+    BReactor_SetFileDescriptorEvents(reactor, &in->bfd, BREACTOR_READ);
+    
+    return 1;
+    
+fail1:
+    ASSERT_FORCE(close(in->fds[0]) == 0)
+    if (in->fds[1] != in->fds[0]) {
+        ASSERT_FORCE(close(in->fds[1]) == 0)
+    }
+fail0:
+    return 0;
+}
+
+static void inbox_free (struct ServerShards_inbox *in, BReactor *reactor)
+{
+    BReactor_RemoveFileDescriptor(reactor, &in->bfd);
+    
+    ASSERT_FORCE(close(in->fds[0]) == 0)
+    if (in->fds[1] != in->fds[0]) {
+        ASSERT_FORCE(close(in->fds[1]) == 0)
+    }
+}
+
+static void inbox_wakeup (struct ServerShards_inbox *in)
+{
+    #ifdef BADVPN_LINUX
+    uint64_t v = 1;
+    #else
+    uint8_t v = 0;
+    #endif
+    int res = write(in->fds[1], &v, sizeof(v));
+    if (res < 0) {
+        int error = errno;
+        ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
+    }
+}
+
+static void inbox_notify (struct ServerShards_inbox *in)
+{
+    // the consumer clears the flag before looking at the queues, so if it is
+    // still set, the message will be seen without waking the consumer up
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&in->notified, __ATOMIC_RELAXED) || __atomic_exchange_n(&in->notified, 1, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    
+    inbox_wakeup(in);
+}
+
+static void inbox_begin (struct ServerShards_inbox *in)
+{
+    // read the notification
+    uint8_t b[64];
+    int res = read(in->fds[0], b, sizeof(b));
+    if (res < 0) {
+        int error = errno;
+        ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
+    }
+    
+    // allow producers to notify us again, then look at the queues
+    __atomic_store_n(&in->notified, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void inbox_end (struct ServerShards_inbox *in, int more)
+{
+    // if we stopped before emptying the queues, come back after the reactor
+    // has had a look at other file descriptors
+    if (more) {
+        __atomic_store_n(&in->notified, 1, __ATOMIC_SEQ_CST);
+        inbox_wakeup(in);
+    }
+}
+
+static struct msg make_msg (int type, uint64_t key)
+{
+    struct msg m;
+    memset(&m, 0, sizeof(m));
+    m.type = type;
+    m.fd = -1;
+    m.key = key;
+    return m;
+}
+
+static int push_msg (ServerShards *o, int from, int to, struct msg m, const uint8_t *data, int data_len)
+{
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= SERVERSHARDQUEUE_MAX_MESSAGE - (int)sizeof(m))
+    
+    ServerShardQueue *q = get_queue(o, from, to);
+    
+    uint8_t *p = ServerShardQueue_StartMessage(q, sizeof(m) + data_len);
+    if (!p) {
+        BLog(BLOG_ERROR, "failed to allocate message %d", m.type);
+        return 0;
+    }
+    
+    memcpy(p, &m, sizeof(m));
+    if (data_len > 0) {
+        memcpy(p + sizeof(m), data, data_len);
+    }
+    
+    ServerShardQueue_EndMessage(q);
+    inbox_notify(get_inbox(o, to));
+    
+    return 1;
+}
+
+static void client_logfunc (struct shard_client *sc)
+{
+    BLog_Append("shard %d: client %d (", sc->sh->index, (int)sc->id);
+    BLog_AppendAddr(&sc->addr);
+    BLog_Append("): ");
+}
+
+static void client_log (struct shard_client *sc, int level, const char *fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    BLog_LogViaFuncVarArg((BLog_logfunc)client_logfunc, sc, BLOG_CURRENT_CHANNEL, level, fmt, vl);
+    va_end(vl);
+}
+
+static void shard_push_main (struct ServerShards_shard *sh, struct msg m, const uint8_t *data, int data_len)
+{
+    push_msg(sh->s, sh->index, sh->s->params.num_shards, m, data, data_len);
+}
+
+static struct shard_client * find_client (struct ServerShards_shard *sh, uint64_t key)
+{
+    BAVLNode *node = BAVL_LookupExact(&sh->clients_tree, &key);
+    if (!node) {
+        return NULL;
+    }
+    
+    return UPPER_OBJECT(node, struct shard_client, tree_node);
+}
+
+static struct shard_endpoint * find_endpoint (struct ServerShards_shard *sh, uint64_t key)
+{
+    BAVLNode *node = BAVL_LookupExact(&sh->endpoints_tree, &key);
+    if (!node) {
+        return NULL;
+    }
+    
+    return UPPER_OBJECT(node, struct shard_endpoint, tree_node);
+}
+
+static struct shard_route * find_route (struct shard_client *sc, peerid_t dest_id)
+{
+    ASSERT(sc->state == CLIENT_STATE_LINK)
+    
+    BAVLNode *node = BAVL_LookupExact(&sc->routes_tree, &dest_id);
+    if (!node) {
+        return NULL;
+    }
+    
+    return UPPER_OBJECT(node, struct shard_route, tree_node);
+}
+
+static void route_free (struct shard_client *sc, struct shard_route *r)
+{
+    BAVL_Remove(&sc->routes_tree, &r->tree_node);
+    free(r);
+}
+
+static void endpoint_free (struct shard_endpoint *ep)
+{
+    struct ServerShards_shard *sh = ep->client->sh;
+    PacketPassFairQueueFlow_AssertFree(&ep->qflow);
+    
+    // tell the main thread that the flow is gone, if it asked for it
+    if (ep->closing) {
+        shard_push_main(sh, make_msg(MSG_FLOW_DONE, ep->key), NULL, 0);
+    }
+    
+    // free I/O
+    PacketProtoFlow_Free(&ep->oflow);
+    PacketPassFairQueueFlow_Free(&ep->qflow);
+    
+    // remove from client list and shard tree
+    LinkedList1_Remove(&ep->client->endpoints_list, &ep->list_node);
+    BAVL_Remove(&sh->endpoints_tree, &ep->tree_node);
+    
+    free(ep);
+}
+
+static void endpoint_qflow_handler_busy (struct shard_endpoint *ep)
+{
+    ASSERT(ep->closing)
+    ASSERT(!PacketPassFairQueueFlow_IsBusy(&ep->qflow))
+    
+    endpoint_free(ep);
+    return;
+}
+
+static void endpoint_overflow (struct shard_endpoint *ep)
+{
+    // report once, the main thread will reset the flow
+    if (ep->overflowed || ep->closing) {
+        return;
+    }
+    ep->overflowed = 1;
+    
+    shard_push_main(ep->client->sh, make_msg(MSG_FLOW_OVERFLOW, ep->key), NULL, 0);
+}
+
+static void endpoint_write (struct shard_endpoint *ep, peerid_t src_id, const uint8_t *payload, int payload_len)
+{
+    ASSERT(payload_len >= 0)
+    ASSERT(payload_len <= SC_MAX_MSGLEN)
+    
+    uint8_t *packet;
+    if (!BufferWriter_StartPacket(ep->input, &packet)) {
+        endpoint_overflow(ep);
+        return;
+    }
+    
+    struct sc_header header;
+    header.type = htol8(SCID_INMSG);
+    memcpy(packet, &header, sizeof(header));
+    
+    struct sc_server_inmsg omsg;
+    omsg.clientid = htol16(src_id);
+    memcpy(packet + sizeof(header), &omsg, sizeof(omsg));
+    memcpy(packet + sizeof(header) + sizeof(omsg), payload, payload_len);
+    
+    BufferWriter_EndPacket(ep->input, sizeof(header) + sizeof(omsg) + payload_len);
+}
+
+static void client_free_sender (struct shard_client *sc)
+{
+    if (sc->sh->s->params.ssl) {
+        PacketStreamCoalescer_Free(&sc->output_coalescer);
+    } else {
+        PacketStreamSender_Free(&sc->output_sender);
+    }
+}
+
+static void client_dealloc_io (struct shard_client *sc)
+{
+    ASSERT(sc->state == CLIENT_STATE_LINK)
+    
+    // stop using any buffers before they get freed
+    if (sc->sh->s->params.ssl) {
+        BSSLConnection_ReleaseBuffers(&sc->sslcon);
+    }
+    
+    // free routes
+    BAVLNode *tnode;
+    while (tnode = BAVL_GetFirst(&sc->routes_tree)) {
+        route_free(sc, UPPER_OBJECT(tnode, struct shard_route, tree_node));
+    }
+    
+    // allow freeing fair queue flows
+    PacketPassFairQueue_PrepareFree(&sc->output_peers_fairqueue);
+    
+    // free endpoints
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&sc->endpoints_list)) {
+        endpoint_free(UPPER_OBJECT(node, struct shard_endpoint, list_node));
+    }
+    
+    // allow freeing priority queue flows
+    PacketPassPriorityQueue_PrepareFree(&sc->output_priorityqueue);
+    
+    // free output peers flow
+    PacketPassFairQueue_Free(&sc->output_peers_fairqueue);
+    PacketPassPriorityQueueFlow_Free(&sc->output_peers_qflow);
+    
+    // free output control flow
+    PacketProtoFlow_Free(&sc->output_control_oflow);
+    PacketPassPriorityQueueFlow_Free(&sc->output_control_qflow);
+    
+    // free output common
+    PacketPassPriorityQueue_Free(&sc->output_priorityqueue);
+    client_free_sender(sc);
+    
+    // free input
+    PacketProtoDecoder_Free(&sc->input_decoder);
+    PacketPassInterface_Free(&sc->input_interface);
+}
+
+static void client_teardown (struct shard_client *sc)
+{
+    ASSERT(sc->state != CLIENT_STATE_DOWN)
+    struct ServerShards_shard *sh = sc->sh;
+    
+    // free I/O
+    if (sc->state == CLIENT_STATE_LINK) {
+        client_dealloc_io(sc);
+    }
+    
+    // stop disconnect timer
+    BReactor_RemoveTimer(&sh->reactor, &sc->disconnect_timer);
+    
+    // free SSL
+    if (sh->s->params.ssl) {
+        BSSLConnection_Free(&sc->sslcon);
+        ASSERT_FORCE(PR_Close(sc->ssl_prfd) == PR_SUCCESS)
+    }
+    
+    // free connection
+    BConnection_RecvAsync_Free(&sc->con);
+    BConnection_SendAsync_Free(&sc->con);
+    BConnection_Free(&sc->con);
+    
+    sc->state = CLIENT_STATE_DOWN;
+}
+
+static void client_down (struct shard_client *sc)
+{
+    ASSERT(sc->state != CLIENT_STATE_DOWN)
+    
+    client_teardown(sc);
+    
+    // have the main thread remove the client
+    shard_push_main(sc->sh, make_msg(MSG_CLIENT_DOWN, sc->key), NULL, 0);
+}
+
+static void client_free (struct shard_client *sc)
+{
+    struct ServerShards_shard *sh = sc->sh;
+    
+    if (sc->state != CLIENT_STATE_DOWN) {
+        client_teardown(sc);
+    }
+    
+    LinkedList1_Remove(&sh->clients_list, &sc->list_node);
+    BAVL_Remove(&sh->clients_tree, &sc->tree_node);
+    
+    free(sc);
+}
+
+static void client_forward_packet (struct shard_client *sc, uint8_t *data, int data_len)
+{
+    shard_push_main(sc->sh, make_msg(MSG_CLIENT_PACKET, sc->key), data, data_len);
+}
+
+static void client_process_outmsg (struct shard_client *sc, uint8_t *data, int data_len)
+{
+    struct ServerShards_shard *sh = sc->sh;
+    ServerShards *o = sh->s;
+    
+    if (!sc->got_hello) {
+        client_log(sc, BLOG_NOTICE, "outmsg: not expected");
+        client_down(sc);
+        return;
+    }
+    
+    if (data_len < sizeof(struct sc_client_outmsg)) {
+        client_log(sc, BLOG_NOTICE, "outmsg: wrong size");
+        client_down(sc);
+        return;
+    }
+    
+    struct sc_client_outmsg msg;
+    memcpy(&msg, data, sizeof(msg));
+    peerid_t id = ltoh16(msg.clientid);
+    int payload_size = data_len - sizeof(struct sc_client_outmsg);
+    
+    if (payload_size > SC_MAX_MSGLEN) {
+        client_log(sc, BLOG_NOTICE, "outmsg: too large payload");
+        client_down(sc);
+        return;
+    }
+    
+    uint8_t *payload = data + sizeof(struct sc_client_outmsg);
+    
+    // lookup flow to destination client
+    struct shard_route *r = find_route(sc, id);
+    if (!r) {
+        client_log(sc, BLOG_INFO, "no flow for message to %d", (int)id);
+        return;
+    }
+    
+    // if sending client hasn't accepted yet, ignore message
+    if (!r->accepted) {
+        client_log(sc, BLOG_INFO, "client hasn't accepted; not forwarding message to %d", (int)id);
+        return;
+    }
+    
+    // destination in this shard, write to the flow buffer
+    if (r->dest_shard == sh->index) {
+        struct shard_endpoint *ep = find_endpoint(sh, r->flow_key);
+        if (ep) {
+            endpoint_write(ep, sc->id, payload, payload_size);
+        }
+        return;
+    }
+    
+    ServerShardQueue *q = get_queue(o, sh->index, r->dest_shard);
+    
+    // if the other shard is not keeping up, treat it like a full flow buffer
+    if (ServerShardQueue_QueuedBytes(q) > SERVERSHARDS_QUEUE_DATA_LIMIT) {
+        if (!r->overflowed) {
+            r->overflowed = 1;
+            shard_push_main(sh, make_msg(MSG_FLOW_OVERFLOW, r->flow_key), NULL, 0);
+        }
+        return;
+    }
+    
+    // pass to the other shard
+    uint8_t *p = ServerShardQueue_StartMessage(q, sizeof(struct inmsg) + payload_size);
+    if (!p) {
+        client_log(sc, BLOG_ERROR, "failed to allocate message to %d", (int)id);
+        return;
+    }
+    struct inmsg im;
+    im.type = MSG_INMSG;
+    im.src_id = sc->id;
+    im.flow_key = r->flow_key;
+    memcpy(p, &im, sizeof(im));
+    memcpy(p + sizeof(im), payload, payload_size);
+    ServerShardQueue_EndMessage(q);
+    inbox_notify(get_inbox(o, r->dest_shard));
+}
+
+static void client_input_handler_send (struct shard_client *sc, uint8_t *data, int data_len)
+{
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= SC_MAX_ENC)
+    ASSERT(sc->state == CLIENT_STATE_LINK)
+    
+    // accept packet
+    PacketPassInterface_Done(&sc->input_interface);
+    
+    // restart disconnect timer
+    BReactor_SetTimer(&sc->sh->reactor, &sc->disconnect_timer);
+    
+    // parse header
+    if (data_len < sizeof(struct sc_header)) {
+        client_log(sc, BLOG_NOTICE, "packet too short");
+        client_down(sc);
+        return;
+    }
+    struct sc_header header;
+    memcpy(&header, data, sizeof(header));
+    uint8_t type = ltoh8(header.type);
+    
+    uint8_t *payload = data + sizeof(header);
+    int payload_len = data_len - sizeof(header);
+    
+    switch (type) {
+        case SCID_KEEPALIVE:
+            client_log(sc, BLOG_DEBUG, "received keep-alive");
+            return;
+        
+        case SCID_CLIENTHELLO: {
+            // remember if the client is too old to accept peers, the main thread
+            // checks the rest
+            if (!sc->got_hello && payload_len == sizeof(struct sc_client_hello)) {
+                struct sc_client_hello msg;
+                memcpy(&msg, payload, sizeof(msg));
+                sc->implicit_accept = (ltoh16(msg.version) <= SC_OLDVERSION_NOSSL);
+            }
+            sc->got_hello = 1;
+            client_forward_packet(sc, data, data_len);
+        } return;
+        
+        case SCID_OUTMSG:
+            client_process_outmsg(sc, payload, payload_len);
+            return;
+        
+        case SCID_RESETPEER:
+            client_forward_packet(sc, data, data_len);
+            return;
+        
+        case SCID_ACCEPTPEER: {
+            // start forwarding messages on the flow; whether the accept is
+            // valid is decided by the main thread
+            if (payload_len == sizeof(struct sc_client_acceptpeer)) {
+                struct sc_client_acceptpeer msg;
+                memcpy(&msg, payload, sizeof(msg));
+                struct shard_route *r = find_route(sc, ltoh16(msg.clientid));
+                if (r) {
+                    r->accepted = 1;
+                }
+            }
+            client_forward_packet(sc, data, data_len);
+        } return;
+        
+        default:
+            client_log(sc, BLOG_NOTICE, "unknown packet type %d, removing", (int)type);
+            client_down(sc);
+            return;
+    }
+}
+
+static void client_decoder_handler_error (struct shard_client *sc)
+{
+    ASSERT(sc->state == CLIENT_STATE_LINK)
+    
+    client_log(sc, BLOG_ERROR, "decoder error");
+    
+    client_down(sc);
+    return;
+}
+
+static void client_disconnect_timer_handler (struct shard_client *sc)
+{
+    ASSERT(sc->state != CLIENT_STATE_DOWN)
+    
+    client_log(sc, BLOG_INFO, "timed out");
+    
+    client_down(sc);
+    return;
+}
+
+static void client_connection_handler (struct shard_client *sc, int event)
+{
+    ASSERT(sc->state != CLIENT_STATE_DOWN)
+    
+    if (event == BCONNECTION_EVENT_RECVCLOSED) {
+        client_log(sc, BLOG_INFO, "connection closed");
+    } else {
+        client_log(sc, BLOG_INFO, "connection error");
+    }
+    
+    client_down(sc);
+    return;
+}
+
+static int client_init_io (struct shard_client *sc)
+{
+    struct ServerShards_shard *sh = sc->sh;
+    ServerShards *o = sh->s;
+    BPendingGroup *pg = BReactor_PendingGroup(&sh->reactor);
+    
+    StreamPassInterface *send_if = (o->params.ssl ? BSSLConnection_GetSendIf(&sc->sslcon) : BConnection_SendAsync_GetIf(&sc->con));
+    StreamRecvInterface *recv_if = (o->params.ssl ? BSSLConnection_GetRecvIf(&sc->sslcon) : BConnection_RecvAsync_GetIf(&sc->con));
+    
+    // init input
+    PacketPassInterface_Init(&sc->input_interface, SC_MAX_ENC, (PacketPassInterface_handler_send)client_input_handler_send, sc, pg);
+    if (!PacketProtoDecoder_Init(&sc->input_decoder, recv_if, &sc->input_interface, pg, sc,
+        (PacketProtoDecoder_handler_error)client_decoder_handler_error
+    )) {
+        client_log(sc, BLOG_ERROR, "PacketProtoDecoder_Init failed");
+        goto fail1;
+    }
+    
+    // init output common. With SSL, coalesce packets so that they don't each
+    // become a separate record.
+    PacketPassInterface *sender_input;
+    if (o->params.ssl) {
+        if (!PacketStreamCoalescer_Init(&sc->output_coalescer, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BSSLCONNECTION_MAX_RECORD_DATA, -1, &sh->reactor)) {
+            client_log(sc, BLOG_ERROR, "PacketStreamCoalescer_Init failed");
+            goto fail2;
+        }
+        sender_input = PacketStreamCoalescer_GetInput(&sc->output_coalescer);
+    } else {
+        PacketStreamSender_Init(&sc->output_sender, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), pg);
+        sender_input = PacketStreamSender_GetInput(&sc->output_sender);
+    }
+    PacketPassPriorityQueue_Init(&sc->output_priorityqueue, sender_input, pg, 0);
+    
+    // init output control flow
+    PacketPassPriorityQueueFlow_Init(&sc->output_control_qflow, &sc->output_priorityqueue, -1);
+    if (!PacketProtoFlow_Init(
+        &sc->output_control_oflow, SC_MAX_ENC, o->params.control_buffer_packets,
+        PacketPassPriorityQueueFlow_GetInput(&sc->output_control_qflow), pg
+    )) {
+        client_log(sc, BLOG_ERROR, "PacketProtoFlow_Init failed");
+        goto fail3;
+    }
+    sc->output_control_input = PacketProtoFlow_GetInput(&sc->output_control_oflow);
+    
+    // init output peers flow, with lower priority than control flow
+    PacketPassPriorityQueueFlow_Init(&sc->output_peers_qflow, &sc->output_priorityqueue, 0);
+    if (!PacketPassFairQueue_Init(&sc->output_peers_fairqueue, PacketPassPriorityQueueFlow_GetInput(&sc->output_peers_qflow), pg, 0, 1)) {
+        client_log(sc, BLOG_ERROR, "PacketPassFairQueue_Init failed");
+        goto fail4;
+    }
+    
+    // no hello yet
+    sc->got_hello = 0;
+    sc->implicit_accept = 0;
+    
+    // init routes and endpoints
+    BAVL_Init(&sc->routes_tree, OFFSET_DIFF(struct shard_route, dest_id, tree_node), (BAVL_comparator)peerid_comparator, NULL);
+    LinkedList1_Init(&sc->endpoints_list);
+    
+    return 1;
+    
+fail4:
+    PacketPassPriorityQueueFlow_Free(&sc->output_peers_qflow);
+    PacketProtoFlow_Free(&sc->output_control_oflow);
+fail3:
+    PacketPassPriorityQueueFlow_Free(&sc->output_control_qflow);
+    PacketPassPriorityQueue_Free(&sc->output_priorityqueue);
+    client_free_sender(sc);
+fail2:
+    PacketProtoDecoder_Free(&sc->input_decoder);
+fail1:
+    PacketPassInterface_Free(&sc->input_interface);
+    return 0;
+}
+
+static void client_sslcon_handler (struct shard_client *sc, int event)
+{
+    ASSERT(sc->sh->s->params.ssl)
+    ASSERT(sc->state == CLIENT_STATE_HANDSHAKE)
+    ASSERT(event == BSSLCONNECTION_EVENT_UP || event == BSSLCONNECTION_EVENT_ERROR)
+    
+    if (event == BSSLCONNECTION_EVENT_ERROR) {
+        client_log(sc, BLOG_ERROR, "SSL error");
+        goto fail0;
+    }
+    
+    // get client certificate, the main thread will look into it
+    CERTCertificate *cert = SSL_PeerCertificate(sc->ssl_prfd);
+    if (!cert) {
+        client_log(sc, BLOG_ERROR, "SSL_PeerCertificate failed");
+        goto fail0;
+    }
+    if (cert->derCert.len > SCID_NEWCLIENT_MAX_CERT_LEN) {
+        client_log(sc, BLOG_NOTICE, "client certificate too big");
+        goto fail1;
+    }
+    
+    // init I/O chains
+    if (!client_init_io(sc)) {
+        goto fail1;
+    }
+    
+    // report to the main thread before any packets
+    shard_push_main(sc->sh, make_msg(MSG_CLIENT_UP, sc->key), cert->derCert.data, cert->derCert.len);
+    
+    CERT_DestroyCertificate(cert);
+    
+    sc->state = CLIENT_STATE_LINK;
+    
+    client_log(sc, BLOG_INFO, "handshake complete");
+    
+    return;
+    
+fail1:
+    CERT_DestroyCertificate(cert);
+fail0:
+    client_down(sc);
+}
+
+static void shard_add_client (struct ServerShards_shard *sh, struct msg *m)
+{
+    ServerShards *o = sh->s;
+    
+    struct shard_client *sc = (struct shard_client *)malloc(sizeof(*sc));
+    if (!sc) {
+        BLog(BLOG_ERROR, "shard %d: failed to allocate client", sh->index);
+        if (close(m->fd) < 0) {
+            BLog(BLOG_ERROR, "close failed");
+        }
+        goto fail0;
+    }
+    
+    sc->sh = sh;
+    sc->key = m->key;
+    sc->id = m->id;
+    sc->addr = m->addr;
+    
+    // init connection, taking over the socket
+    if (!BConnection_Init(&sc->con, BConnection_source_pipe(m->fd, 1), &sh->reactor, sc, (BConnection_handler)client_connection_handler)) {
+        client_log(sc, BLOG_ERROR, "BConnection_Init failed");
+        goto fail1;
+    }
+    
+    // limit socket send buffer, else our scheduling is pointless
+    if (o->params.socket_sndbuf > 0) {
+        if (!BConnection_SetSendBuffer(&sc->con, o->params.socket_sndbuf)) {
+            client_log(sc, BLOG_WARNING, "BConnection_SetSendBuffer failed");
+        }
+    }
+    
+    // init connection interfaces
+    BConnection_SendAsync_Init(&sc->con);
+    BConnection_RecvAsync_Init(&sc->con);
+    
+    if (o->params.ssl) {
+        // create bottom NSPR file descriptor
+        if (!BSSLConnection_MakeBackend(&sc->bottom_prfd, BConnection_SendAsync_GetIf(&sc->con), BConnection_RecvAsync_GetIf(&sc->con), &sh->twd, o->params.ssl_flags)) {
+            client_log(sc, BLOG_ERROR, "BSSLConnection_MakeBackend failed");
+            goto fail2;
+        }
+        
+        // create SSL file descriptor from the bottom NSPR file descriptor
+        if (!(sc->ssl_prfd = SSL_ImportFD(o->params.model_prfd, &sc->bottom_prfd))) {
+            client_log(sc, BLOG_ERROR, "SSL_ImportFD failed");
+            ASSERT_FORCE(PR_Close(&sc->bottom_prfd) == PR_SUCCESS)
+            goto fail2;
+        }
+        
+        // set server mode, require client certificate
+        if (SSL_ResetHandshake(sc->ssl_prfd, PR_TRUE) != SECSuccess) {
+            client_log(sc, BLOG_ERROR, "SSL_ResetHandshake failed");
+            goto fail3;
+        }
+        if (SSL_OptionSet(sc->ssl_prfd, SSL_REQUEST_CERTIFICATE, PR_TRUE) != SECSuccess) {
+            client_log(sc, BLOG_ERROR, "SSL_OptionSet(SSL_REQUEST_CERTIFICATE) failed");
+            goto fail3;
+        }
+        if (SSL_OptionSet(sc->ssl_prfd, SSL_REQUIRE_CERTIFICATE, PR_TRUE) != SECSuccess) {
+            client_log(sc, BLOG_ERROR, "SSL_OptionSet(SSL_REQUIRE_CERTIFICATE) failed");
+            goto fail3;
+        }
+        
+        // init SSL connection
+        BSSLConnection_Init(&sc->sslcon, sc->ssl_prfd, 1, BReactor_PendingGroup(&sh->reactor), sc, (BSSLConnection_handler)client_sslcon_handler);
+        
+        sc->state = CLIENT_STATE_HANDSHAKE;
+    } else {
+        // initialize I/O
+        if (!client_init_io(sc)) {
+            goto fail2;
+        }
+        
+        sc->state = CLIENT_STATE_LINK;
+    }
+    
+    // start disconnect timer
+    BTimer_Init(&sc->disconnect_timer, o->params.no_data_time_limit, (BTimer_handler)client_disconnect_timer_handler, sc);
+    BReactor_SetTimer(&sh->reactor, &sc->disconnect_timer);
+    
+    // link in
+    ASSERT_EXECUTE(BAVL_Insert(&sh->clients_tree, &sc->tree_node, NULL))
+    LinkedList1_Append(&sh->clients_list, &sc->list_node);
+    
+    client_log(sc, BLOG_DEBUG, "added to shard");
+    
+    return;
+    
+    if (o->params.ssl) {
+fail3:
+        ASSERT_FORCE(PR_Close(sc->ssl_prfd) == PR_SUCCESS)
+    }
+fail2:
+    BConnection_RecvAsync_Free(&sc->con);
+    BConnection_SendAsync_Free(&sc->con);
+    BConnection_Free(&sc->con);
+fail1:
+    free(sc);
+fail0:
+    shard_push_main(sh, make_msg(MSG_CLIENT_DOWN, m->key), NULL, 0);
+}
+
+static void shard_send_control (struct ServerShards_shard *sh, struct msg *m, const uint8_t *data, int data_len)
+{
+    struct shard_client *sc = find_client(sh, m->key);
+    if (!sc || sc->state != CLIENT_STATE_LINK) {
+        return;
+    }
+    
+    // obtain location for writing the packet
+    uint8_t *packet;
+    if (!BufferWriter_StartPacket(sc->output_control_input, &packet)) {
+        // out of buffer, kill client
+        client_log(sc, BLOG_INFO, "out of control buffer, removing");
+        client_down(sc);
+        return;
+    }
+    
+    memcpy(packet, data, data_len);
+    BufferWriter_EndPacket(sc->output_control_input, data_len);
+}
+
+static void shard_open_endpoint (struct ServerShards_shard *sh, struct msg *m)
+{
+    ServerShards *o = sh->s;
+    
+    // nothing to do if the client is gone, closing will be confirmed anyway
+    struct shard_client *sc = find_client(sh, m->key2);
+    if (!sc || sc->state != CLIENT_STATE_LINK) {
+        return;
+    }
+    
+    struct shard_endpoint *ep = (struct shard_endpoint *)malloc(sizeof(*ep));
+    if (!ep) {
+        client_log(sc, BLOG_ERROR, "failed to allocate flow");
+        goto fail0;
+    }
+    
+    ep->client = sc;
+    ep->key = m->key;
+    
+    // init queue flow
+    PacketPassFairQueueFlow_Init(&ep->qflow, &sc->output_peers_fairqueue);
+    
+    // init PacketProtoFlow
+    if (!PacketProtoFlow_Init(
+        &ep->oflow, SC_MAX_ENC, o->params.peer_buffer_packets,
+        PacketPassFairQueueFlow_GetInput(&ep->qflow), BReactor_PendingGroup(&sh->reactor)
+    )) {
+        client_log(sc, BLOG_ERROR, "PacketProtoFlow_Init failed");
+        goto fail1;
+    }
+    ep->input = PacketProtoFlow_GetInput(&ep->oflow);
+    
+    ep->closing = 0;
+    ep->overflowed = 0;
+    
+    // link in
+    ASSERT_EXECUTE(BAVL_Insert(&sh->endpoints_tree, &ep->tree_node, NULL))
+    LinkedList1_Append(&sc->endpoints_list, &ep->list_node);
+    
+    return;
+    
+fail1:
+    PacketPassFairQueueFlow_Free(&ep->qflow);
+    free(ep);
+fail0:
+    // have the flow reset
+    shard_push_main(sh, make_msg(MSG_FLOW_OVERFLOW, m->key), NULL, 0);
+}
+
+static void shard_close_endpoint (struct ServerShards_shard *sh, struct msg *m)
+{
+    struct shard_endpoint *ep = find_endpoint(sh, m->key);
+    if (!ep) {
+        // already gone along with its client, or never opened
+        shard_push_main(sh, make_msg(MSG_FLOW_DONE, m->key), NULL, 0);
+        return;
+    }
+    ASSERT(!ep->closing)
+    
+    ep->closing = 1;
+    
+    // free once the queue is done with the current packet
+    if (PacketPassFairQueueFlow_IsBusy(&ep->qflow)) {
+        PacketPassFairQueueFlow_SetBusyHandler(&ep->qflow, (PacketPassFairQueue_handler_busy)endpoint_qflow_handler_busy, ep);
+    } else {
+        endpoint_free(ep);
+    }
+}
+
+static void shard_add_route (struct ServerShards_shard *sh, struct msg *m)
+{
+    struct shard_client *sc = find_client(sh, m->key);
+    if (!sc || sc->state != CLIENT_STATE_LINK) {
+        return;
+    }
+    
+    // remove any stale route
+    struct shard_route *r = find_route(sc, m->id);
+    if (r) {
+        route_free(sc, r);
+    }
+    
+    if (!(r = (struct shard_route *)malloc(sizeof(*r)))) {
+        client_log(sc, BLOG_ERROR, "failed to allocate route to %d", (int)m->id);
+        shard_push_main(sh, make_msg(MSG_FLOW_OVERFLOW, m->key2), NULL, 0);
+        return;
+    }
+    
+    r->flow_key = m->key2;
+    r->dest_id = m->id;
+    r->dest_shard = m->shard;
+    r->accepted = sc->implicit_accept;
+    r->overflowed = 0;
+    
+    ASSERT_EXECUTE(BAVL_Insert(&sc->routes_tree, &r->tree_node, NULL))
+}
+
+static void shard_del_route (struct ServerShards_shard *sh, struct msg *m)
+{
+    struct shard_client *sc = find_client(sh, m->key);
+    if (!sc || sc->state != CLIENT_STATE_LINK) {
+        return;
+    }
+    
+    struct shard_route *r = find_route(sc, m->id);
+    if (r && r->flow_key == m->key2) {
+        route_free(sc, r);
+    }
+}
+
+static int shard_drain_source (struct ServerShards_shard *sh, int pos)
+{
+    ServerShards *o = sh->s;
+    
+    // main thread first, it opens the endpoints other shards send to
+    if (pos == 0) {
+        return o->params.num_shards;
+    }
+    
+    int from = pos - 1;
+    if (from >= sh->index) {
+        from++;
+    }
+    
+    return (from < o->params.num_shards ? from : -1);
+}
+
+static void shard_drain_restart (struct ServerShards_shard *sh)
+{
+    sh->drain_pos = 0;
+    sh->drain_count = 0;
+    BPending_Set(&sh->drain_job);
+}
+
+static void shard_process_msg (struct ServerShards_shard *sh, uint8_t *data, int data_len)
+{
+    struct msg m;
+    memcpy(&m, data, sizeof(m));
+    uint8_t *mdata = data + sizeof(m);
+    int mdata_len = data_len - sizeof(m);
+    
+    switch (m.type) {
+        case MSG_QUIT: {
+            BReactor_Quit(&sh->reactor, 0);
+        } break;
+        
+        case MSG_ADD_CLIENT: {
+            shard_add_client(sh, &m);
+        } break;
+        
+        case MSG_REMOVE_CLIENT: {
+            struct shard_client *sc = find_client(sh, m.key);
+            if (sc) {
+                client_free(sc);
+            }
+        } break;
+        
+        case MSG_CONTROL: {
+            shard_send_control(sh, &m, mdata, mdata_len);
+        } break;
+        
+        case MSG_ENDPOINT_OPEN: {
+            shard_open_endpoint(sh, &m);
+        } break;
+        
+        case MSG_ENDPOINT_CLOSE: {
+            shard_close_endpoint(sh, &m);
+        } break;
+        
+        case MSG_ROUTE_ADD: {
+            shard_add_route(sh, &m);
+        } break;
+        
+        case MSG_ROUTE_DEL: {
+            shard_del_route(sh, &m);
+        } break;
+        
+        default: ASSERT(0);
+    }
+}
+
+static void shard_drain_job_handler (struct ServerShards_shard *sh)
+{
+    ServerShards *o = sh->s;
+    
+    int from;
+    while ((from = shard_drain_source(sh, sh->drain_pos)) >= 0) {
+        ServerShardQueue *q = get_queue(o, from, sh->index);
+        
+        uint8_t *data;
+        int data_len;
+        int have = ServerShardQueue_Peek(q, &data, &data_len);
+        
+        if (have && sh->drain_count < SERVERSHARDS_DRAIN_LIMIT) {
+            int type;
+            memcpy(&type, data, sizeof(type));
+            
+            if (type == MSG_INMSG) {
+                struct inmsg im;
+                memcpy(&im, data, sizeof(im));
+                
+                struct shard_endpoint *ep = find_endpoint(sh, im.flow_key);
+                if (!ep && ServerShardQueue_Peek(get_queue(o, o->params.num_shards, sh->index), NULL, NULL)) {
+                    // the main thread opened the endpoint before the source shard could
+                    // have sent this, but we may not have got to that yet
+                    ServerShardQueue_Release(q);
+                    shard_drain_restart(sh);
+                    return;
+                }
+                
+                // continue with the next message after any jobs this one sets
+                BPending_Set(&sh->drain_job);
+                sh->drain_count++;
+                
+                if (ep) {
+                    endpoint_write(ep, im.src_id, data + sizeof(im), data_len - sizeof(im));
+                }
+            } else {
+                BPending_Set(&sh->drain_job);
+                sh->drain_count++;
+                
+                shard_process_msg(sh, data, data_len);
+            }
+            
+            ServerShardQueue_Next(q);
+            return;
+        }
+        
+        // done with this queue for now
+        sh->drain_more |= have;
+        ServerShardQueue_Release(q);
+        sh->drain_pos++;
+        sh->drain_count = 0;
+    }
+    
+    inbox_end(&sh->inbox, sh->drain_more);
+}
+
+static void shard_inbox_handler (struct ServerShards_shard *sh, int events)
+{
+    inbox_begin(&sh->inbox);
+    
+    // messages are processed one per job, like packets in the flow code, so that
+    // buffers get a chance to make room for the next one
+    if (!BPending_IsSet(&sh->drain_job)) {
+        sh->drain_more = 0;
+        shard_drain_restart(sh);
+    }
+}
+
+static void * shard_thread (struct ServerShards_shard *sh)
+{
+    BReactor_Exec(&sh->reactor);
+    
+    return NULL;
+}
+
+static int shard_init (struct ServerShards_shard *sh)
+{
+    ServerShards *o = sh->s;
+    
+    // init reactor
+    if (!BReactor_Init(&sh->reactor)) {
+        BLog(BLOG_ERROR, "BReactor_Init failed");
+        goto fail0;
+    }
+    
+    // init thread work dispatcher
+    struct BThreadWorkDispatcher_params twd_params;
+    twd_params.num_threads = o->params.num_threads;
+    twd_params.queue_size = 0;
+    twd_params.pin_threads = o->params.pin_threads;
+    if (!BThreadWorkDispatcher_Init2(&sh->twd, &sh->reactor, twd_params)) {
+        BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init2 failed");
+        goto fail1;
+    }
+    
+    // init inbox
+    if (!inbox_init(&sh->inbox, &sh->reactor, (BFileDescriptor_handler)shard_inbox_handler, sh)) {
+        goto fail2;
+    }
+    
+    // init drain job
+    BPending_Init(&sh->drain_job, BReactor_PendingGroup(&sh->reactor), (BPending_handler)shard_drain_job_handler, sh);
+    
+    // init clients and endpoints
+    BAVL_Init(&sh->clients_tree, OFFSET_DIFF(struct shard_client, key, tree_node), (BAVL_comparator)uint64_comparator, NULL);
+    LinkedList1_Init(&sh->clients_list);
+    BAVL_Init(&sh->endpoints_tree, OFFSET_DIFF(struct shard_endpoint, key, tree_node), (BAVL_comparator)uint64_comparator, NULL);
+    sh->num_clients = 0;
+    
+    return 1;
+    
+fail2:
+    BThreadWorkDispatcher_Free(&sh->twd);
+fail1:
+    BReactor_Free(&sh->reactor);
+fail0:
+    return 0;
+}
+
+static void shard_free (struct ServerShards_shard *sh)
+{
+    // free clients
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&sh->clients_list)) {
+        client_free(UPPER_OBJECT(node, struct shard_client, list_node));
+    }
+    ASSERT(BAVL_IsEmpty(&sh->endpoints_tree))
+    
+    BPending_Free(&sh->drain_job);
+    inbox_free(&sh->inbox, &sh->reactor);
+    BThreadWorkDispatcher_Free(&sh->twd);
+    BReactor_Free(&sh->reactor);
+}
+
+static void pin_shard (struct ServerShards_shard *sh, int num_cpus)
+{
+    #ifdef BADVPN_LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(sh->index % num_cpus, &set);
+    if (pthread_setaffinity_np(sh->thread, sizeof(set), &set) != 0) {
+        BLog(BLOG_WARNING, "failed to pin shard %d to CPU %d", sh->index, sh->index % num_cpus);
+    }
+    #else
+    BLog(BLOG_WARNING, "pinning threads is not supported");
+    #endif
+}
+
+static void main_inbox_handler (ServerShards *o, int events)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    inbox_begin(&o->inbox);
+    
+    int more = 0;
+    
+    for (int i = 0; i < o->params.num_shards; i++) {
+        ServerShardQueue *q = get_queue(o, i, o->params.num_shards);
+        
+        uint8_t *data;
+        int data_len;
+        int count = 0;
+        
+        while (ServerShardQueue_Peek(q, &data, &data_len)) {
+            if (count == SERVERSHARDS_DRAIN_LIMIT) {
+                more = 1;
+                break;
+            }
+            
+            struct msg m;
+            memcpy(&m, data, sizeof(m));
+            uint8_t *mdata = data + sizeof(m);
+            int mdata_len = data_len - sizeof(m);
+            
+            switch (m.type) {
+                case MSG_CLIENT_UP: {
+                    o->handler_up(o->user, m.key, mdata, mdata_len);
+                } break;
+                
+                case MSG_CLIENT_PACKET: {
+                    o->handler_packet(o->user, m.key, mdata, mdata_len);
+                } break;
+                
+                case MSG_CLIENT_DOWN: {
+                    o->handler_down(o->user, m.key);
+                } break;
+                
+                case MSG_FLOW_OVERFLOW: {
+                    o->handler_overflow(o->user, m.key);
+                } break;
+                
+                case MSG_FLOW_DONE: {
+                    o->handler_flowdone(o->user, m.key);
+                } break;
+                
+                default: ASSERT(0);
+            }
+            
+            ServerShardQueue_Next(q);
+            count++;
+        }
+        
+        ServerShardQueue_Release(q);
+    }
+    
+    inbox_end(&o->inbox, more);
+}
+
+static int reserve_removal (ServerShards *o, int num_clients)
+{
+    // a removal may have to wait for every client, including those being removed
+    int needed = num_clients + o->removals_num;
+    if (needed <= o->removals_capacity) {
+        return 1;
+    }
+    
+    int new_capacity = (o->removals_capacity > needed / 2 ? 2 * o->removals_capacity : needed);
+    
+    struct ServerShards_removal *new_removals = (struct ServerShards_removal *)BReallocArray(o->removals, new_capacity, sizeof(o->removals[0]));
+    if (!new_removals) {
+        return 0;
+    }
+    
+    o->removals = new_removals;
+    o->removals_capacity = new_capacity;
+    
+    return 1;
+}
+
+static void removals_timer_handler (ServerShards *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->removals_num > 0)
+    
+    int n = o->params.num_shards;
+    
+    // retry the removals in order, up to the first which still can't be queued
+    int done = 0;
+    while (done < o->removals_num) {
+        struct ServerShards_removal *r = &o->removals[done];
+        if (!push_msg(o, n, r->shard, make_msg(MSG_REMOVE_CLIENT, r->client_key), NULL, 0)) {
+            break;
+        }
+        done++;
+    }
+    
+    memmove(o->removals, o->removals + done, (o->removals_num - done) * sizeof(o->removals[0]));
+    o->removals_num -= done;
+    
+    if (o->removals_num > 0) {
+        BLog(BLOG_WARNING, "%d client removals still waiting", o->removals_num);
+        BReactor_SetTimer(o->reactor, &o->removals_timer);
+    }
+}
+
+int ServerShards_Init (ServerShards *o, BReactor *reactor, struct ServerShards_params params, void *user,
+                       ServerShards_handler_up handler_up, ServerShards_handler_packet handler_packet,
+                       ServerShards_handler_down handler_down, ServerShards_handler_flow handler_overflow,
+                       ServerShards_handler_flow handler_flowdone)
+{
+    ASSERT(params.num_shards > 0)
+    ASSERT(params.num_shards <= SERVERSHARDS_MAX_SHARDS)
+    ASSERT(!params.ssl || params.model_prfd)
+    ASSERT(params.control_buffer_packets > 0)
+    ASSERT(params.peer_buffer_packets > 0)
+    
+    // init arguments
+    o->reactor = reactor;
+    o->params = params;
+    o->user = user;
+    o->handler_up = handler_up;
+    o->handler_packet = handler_packet;
+    o->handler_down = handler_down;
+    o->handler_overflow = handler_overflow;
+    o->handler_flowdone = handler_flowdone;
+    
+    int n = params.num_shards;
+    
+    // no client removals waiting
+    o->removals = NULL;
+    o->removals_capacity = 0;
+    o->removals_num = 0;
+    BTimer_Init(&o->removals_timer, REMOVAL_RETRY_TIME, (BTimer_handler)removals_timer_handler, o);
+    
+    // allocate queues, one for each ordered pair of threads; the main thread is number n
+    if (!(o->queues = (ServerShardQueue *)BAllocArray((n + 1) * (n + 1), sizeof(o->queues[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail0;
+    }
+    
+    // init queues
+    int num_queues = 0;
+    while (num_queues < (n + 1) * (n + 1)) {
+        if (num_queues / (n + 1) != num_queues % (n + 1) && !ServerShardQueue_Init(&o->queues[num_queues])) {
+            BLog(BLOG_ERROR, "ServerShardQueue_Init failed");
+            goto fail1;
+        }
+        num_queues++;
+    }
+    
+    // init main inbox
+    if (!inbox_init(&o->inbox, o->reactor, (BFileDescriptor_handler)main_inbox_handler, o)) {
+        goto fail1;
+    }
+    
+    // allocate shards
+    if (!(o->shards = (struct ServerShards_shard *)BAllocArray(n, sizeof(o->shards[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail2;
+    }
+    
+    // init shards
+    int num_inited = 0;
+    while (num_inited < n) {
+        struct ServerShards_shard *sh = &o->shards[num_inited];
+        sh->s = o;
+        sh->index = num_inited;
+        if (!shard_init(sh)) {
+            goto fail3;
+        }
+        num_inited++;
+    }
+    
+    int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus <= 0) {
+        num_cpus = 1;
+    }
+    
+    // start threads
+    int num_started = 0;
+    while (num_started < n) {
+        struct ServerShards_shard *sh = &o->shards[num_started];
+        if (pthread_create(&sh->thread, NULL, (void * (*) (void *))shard_thread, sh) != 0) {
+            BLog(BLOG_ERROR, "pthread_create failed");
+            goto fail4;
+        }
+        num_started++;
+        
+        if (params.pin_threads) {
+            pin_shard(sh, num_cpus);
+        }
+    }
+    
+    BLog(BLOG_INFO, "started %d shards", n);
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail4:
+    while (num_started > 0) {
+        num_started--;
+        push_msg(o, n, num_started, make_msg(MSG_QUIT, 0), NULL, 0);
+        ASSERT_FORCE(pthread_join(o->shards[num_started].thread, NULL) == 0)
+    }
+fail3:
+    while (num_inited > 0) {
+        num_inited--;
+        shard_free(&o->shards[num_inited]);
+    }
+    BFree(o->shards);
+fail2:
+    inbox_free(&o->inbox, o->reactor);
+fail1:
+    while (num_queues > 0) {
+        num_queues--;
+        if (num_queues / (n + 1) != num_queues % (n + 1)) {
+            ServerShardQueue_Free(&o->queues[num_queues]);
+        }
+    }
+    BFree(o->queues);
+fail0:
+    return 0;
+}
+
+void ServerShards_Free (ServerShards *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    int n = o->params.num_shards;
+    
+    // stop threads
+    for (int i = 0; i < n; i++) {
+        ASSERT_FORCE(push_msg(o, n, i, make_msg(MSG_QUIT, 0), NULL, 0))
+    }
+    for (int i = 0; i < n; i++) {
+        ASSERT_FORCE(pthread_join(o->shards[i].thread, NULL) == 0)
+    }
+    
+    // free shards, along with their clients
+    for (int i = 0; i < n; i++) {
+        shard_free(&o->shards[i]);
+    }
+    BFree(o->shards);
+    
+    // free main inbox
+    inbox_free(&o->inbox, o->reactor);
+    
+    // forget waiting client removals, their shards are gone
+    BReactor_RemoveTimer(o->reactor, &o->removals_timer);
+    BFree(o->removals);
+    
+    // free queues, discarding any messages
+    for (int i = 0; i < (n + 1) * (n + 1); i++) {
+        if (i / (n + 1) != i % (n + 1)) {
+            ServerShardQueue_Free(&o->queues[i]);
+        }
+    }
+    BFree(o->queues);
+}
+
+int ServerShards_AddClient (ServerShards *o, uint64_t client_key, peerid_t id, int fd, BAddr addr)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(fd >= 0)
+    
+    int n = o->params.num_shards;
+    
+    // choose the shard with the fewest clients
+    int shard = 0;
+    int num_clients = o->shards[0].num_clients;
+    for (int i = 1; i < n; i++) {
+        if (o->shards[i].num_clients < o->shards[shard].num_clients) {
+            shard = i;
+        }
+        num_clients += o->shards[i].num_clients;
+    }
+    
+    struct msg m = make_msg(MSG_ADD_CLIENT, client_key);
+    m.fd = fd;
+    m.id = id;
+    m.addr = addr;
+    
+    // make sure the client can be removed later even if the queue can't grow then
+    if (!reserve_removal(o, num_clients + 1)) {
+        BLog(BLOG_ERROR, "failed to reserve client removal");
+        goto fail0;
+    }
+    
+    if (!push_msg(o, n, shard, m, NULL, 0)) {
+        goto fail0;
+    }
+    
+    o->shards[shard].num_clients++;
+    
+    return shard;
+    
+fail0:
+    if (close(fd) < 0) {
+        BLog(BLOG_ERROR, "close failed");
+    }
+    return -1;
+}
+
+void ServerShards_RemoveClient (ServerShards *o, int shard, uint64_t client_key)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(shard >= 0)
+    ASSERT(shard < o->params.num_shards)
+    ASSERT(o->shards[shard].num_clients > 0)
+    
+    o->shards[shard].num_clients--;
+    
+    // send it now unless earlier removals are still waiting
+    if (o->removals_num == 0 && push_msg(o, o->params.num_shards, shard, make_msg(MSG_REMOVE_CLIENT, client_key), NULL, 0)) {
+        return;
+    }
+    
+    // remember it for the retry timer, there is room reserved by ServerShards_AddClient
+    ASSERT(o->removals_num < o->removals_capacity)
+    struct ServerShards_removal *r = &o->removals[o->removals_num++];
+    r->shard = shard;
+    r->client_key = client_key;
+    
+    if (!BTimer_IsRunning(&o->removals_timer)) {
+        BReactor_SetTimer(o->reactor, &o->removals_timer);
+    }
+}
+
+void ServerShards_SendControl (ServerShards *o, int shard, uint64_t client_key, const uint8_t *data, int data_len)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(shard >= 0)
+    ASSERT(shard < o->params.num_shards)
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= SC_MAX_ENC)
+    
+    push_msg(o, o->params.num_shards, shard, make_msg(MSG_CONTROL, client_key), data, data_len);
+}
+
+void ServerShards_OpenFlow (ServerShards *o, uint64_t flow_key, int src_shard, uint64_t src_client_key,
+                            int dest_shard, uint64_t dest_client_key, peerid_t dest_id)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(src_shard >= 0)
+    ASSERT(src_shard < o->params.num_shards)
+    ASSERT(dest_shard >= 0)
+    ASSERT(dest_shard < o->params.num_shards)
+    
+    int n = o->params.num_shards;
+    
+    // open the endpoint first, so that it exists by the time messages come from the route
+    struct msg m = make_msg(MSG_ENDPOINT_OPEN, flow_key);
+    m.key2 = dest_client_key;
+    push_msg(o, n, dest_shard, m, NULL, 0);
+    
+    m = make_msg(MSG_ROUTE_ADD, src_client_key);
+    m.key2 = flow_key;
+    m.id = dest_id;
+    m.shard = dest_shard;
+    push_msg(o, n, src_shard, m, NULL, 0);
+}
+
+void ServerShards_CloseFlow (ServerShards *o, uint64_t flow_key, int src_shard, uint64_t src_client_key,
+                             int dest_shard, peerid_t dest_id)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(src_shard >= 0)
+    ASSERT(src_shard < o->params.num_shards)
+    ASSERT(dest_shard >= 0)
+    ASSERT(dest_shard < o->params.num_shards)
+    
+    int n = o->params.num_shards;
+    
+    struct msg m = make_msg(MSG_ROUTE_DEL, src_client_key);
+    m.key2 = flow_key;
+    m.id = dest_id;
+    push_msg(o, n, src_shard, m, NULL, 0);
+    
+    push_msg(o, n, dest_shard, make_msg(MSG_ENDPOINT_CLOSE, flow_key), NULL, 0);
+}
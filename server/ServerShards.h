@@ -0,0 +1,290 @@
+/**
+ * @file ServerShards.h
+ * @author Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Reactor threads which carry the client connections of a sharded
+ * badvpn-server.
+ */
+
+#ifndef BADVPN_SERVER_SERVERSHARDS_H
+#define BADVPN_SERVER_SERVERSHARDS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <prio.h>
+
+#include <protocol/scproto.h>
+#include <misc/debug.h>
+#include <structure/BAVL.h>
+#include <structure/LinkedList1.h>
+#include <base/DebugObject.h>
+#include <base/BPending.h>
+#include <system/BReactor.h>
+#include <system/BAddr.h>
+#include <threadwork/BThreadWork.h>
+#include <server/ServerShardQueue.h>
+
+/**
+ * Maximum number of shards.
+ */
+#define SERVERSHARDS_MAX_SHARDS 64
+
+/**
+ * How many messages are taken from one queue each time a thread wakes up,
+ * before going back to its reactor.
+ */
+#define SERVERSHARDS_DRAIN_LIMIT 256
+
+/**
+ * When this many bytes are waiting in the queue from one shard to another,
+ * peer messages through it are dropped, and reported like a full flow buffer.
+ */
+#define SERVERSHARDS_QUEUE_DATA_LIMIT 4194304
+
+/**
+ * Handler called when the SSL handshake of a client has completed.
+ * 
+ * @param user as in {@link ServerShards_Init}
+ * @param client_key key of the client, as in {@link ServerShards_AddClient}
+ * @param cert DER encoded client certificate
+ * @param cert_len length of the certificate
+ */
+typedef void (*ServerShards_handler_up) (void *user, uint64_t client_key, const uint8_t *cert, int cert_len);
+
+/**
+ * Handler called when a client has sent a packet for the main thread
+ * (hello, resetpeer or acceptpeer). The packet begins with a sc_header.
+ * 
+ * @param user as in {@link ServerShards_Init}
+ * @param client_key key of the client
+ * @param data packet
+ * @param data_len length of the packet, >=sizeof(struct sc_header)
+ */
+typedef void (*ServerShards_handler_packet) (void *user, uint64_t client_key, uint8_t *data, int data_len);
+
+/**
+ * Handler called when a client has failed or been disconnected by its shard.
+ * The client should be removed with {@link ServerShards_RemoveClient}.
+ * 
+ * @param user as in {@link ServerShards_Init}
+ * @param client_key key of the client
+ */
+typedef void (*ServerShards_handler_down) (void *user, uint64_t client_key);
+
+/**
+ * Handler called about a peer flow. Used when a flow has run out of buffer,
+ * and when a flow has been closed after {@link ServerShards_CloseFlow}.
+ * 
+ * @param user as in {@link ServerShards_Init}
+ * @param flow_key key of the flow, as in {@link ServerShards_OpenFlow}
+ */
+typedef void (*ServerShards_handler_flow) (void *user, uint64_t flow_key);
+
+struct ServerShards_params {
+    int num_shards;
+    int num_threads;
+    int pin_threads;
+    int ssl;
+    PRFileDesc *model_prfd;
+    int ssl_flags;
+    int socket_sndbuf;
+    int control_buffer_packets;
+    int peer_buffer_packets;
+    btime_t no_data_time_limit;
+};
+
+struct ServerShards_inbox {
+    int notified;
+    int fds[2];
+    BFileDescriptor bfd;
+    char pad[64];
+};
+
+struct ServerShards_s;
+
+struct ServerShards_removal {
+    int shard;
+    uint64_t client_key;
+};
+
+struct ServerShards_shard {
+    struct ServerShards_s *s;
+    int index;
+    BReactor reactor;
+    BThreadWorkDispatcher twd;
+    struct ServerShards_inbox inbox;
+    BPending drain_job;
+    int drain_pos;
+    int drain_count;
+    int drain_more;
+    BAVL clients_tree;
+    LinkedList1 clients_list;
+    BAVL endpoints_tree;
+    pthread_t thread;
+    int num_clients;
+};
+
+/**
+ * Reactor threads which carry the client connections of a sharded server.
+ * 
+ * The main thread accepts connections and gives each one to the shard with
+ * the fewest clients. The shard performs the SSL handshake, decodes packets
+ * from the client, answers keep-alives and runs the disconnect timer, and
+ * keeps the client's output queues. Packets which change the state of the
+ * server (hello, resetpeer, acceptpeer) are passed to the main thread, which
+ * in turn sends control packets to clients through their shards.
+ * 
+ * A peer flow consists of a route at the shard of its source client, and an
+ * endpoint (the buffer in the output of the destination client) at the shard
+ * of its destination client. Peer messages are forwarded at the source shard:
+ * into the endpoint directly when both clients are in the same shard, and
+ * through the queue to the destination shard otherwise.
+ * 
+ * Threads communicate with {@link ServerShardQueue} queues, one for every
+ * ordered pair of threads. Each thread has an eventfd which producers write
+ * to only when the thread has not been woken up already.
+ */
+typedef struct ServerShards_s {
+    BReactor *reactor;
+    struct ServerShards_params params;
+    void *user;
+    ServerShards_handler_up handler_up;
+    ServerShards_handler_packet handler_packet;
+    ServerShards_handler_down handler_down;
+    ServerShards_handler_flow handler_overflow;
+    ServerShards_handler_flow handler_flowdone;
+    struct ServerShards_shard *shards;
+    ServerShardQueue *queues;
+    struct ServerShards_inbox inbox;
+    struct ServerShards_removal *removals;
+    int removals_capacity;
+    int removals_num;
+    BTimer removals_timer;
+    DebugObject d_obj;
+} ServerShards;
+
+/**
+ * Initializes the shards and starts their threads.
+ * The threads inherit the signal mask of the calling thread.
+ * 
+ * @param o the object
+ * @param reactor reactor of the main thread
+ * @param params parameters. num_shards must be >0 and <=SERVERSHARDS_MAX_SHARDS.
+ *               If ssl is set, model_prfd is used to create the SSL file descriptors
+ *               of clients, which are given ssl_flags (see {@link BSSLConnection_MakeBackend}).
+ *               Each shard has a {@link BThreadWorkDispatcher} with num_threads threads.
+ * @param user argument to handlers
+ * @param handler_up handler called when a client has completed the SSL handshake
+ * @param handler_packet handler called with packets from clients
+ * @param handler_down handler called when a client has failed
+ * @param handler_overflow handler called when a flow has run out of buffer
+ * @param handler_flowdone handler called when a flow has been closed
+ * @return 1 on success, 0 on failure
+ */
+int ServerShards_Init (ServerShards *o, BReactor *reactor, struct ServerShards_params params, void *user,
+                       ServerShards_handler_up handler_up, ServerShards_handler_packet handler_packet,
+                       ServerShards_handler_down handler_down, ServerShards_handler_flow handler_overflow,
+                       ServerShards_handler_flow handler_flowdone) WARN_UNUSED;
+
+/**
+ * Stops the threads and frees the shards, along with any clients still in them.
+ * 
+ * @param o the object
+ */
+void ServerShards_Free (ServerShards *o);
+
+/**
+ * Gives a new client connection to the shard with the fewest clients.
+ * If not using SSL, the client can receive control packets right away;
+ * otherwise after the up handler has been called for it.
+ * 
+ * @param o the object
+ * @param client_key key identifying the client. Must not be reused.
+ * @param id client ID, for logging
+ * @param fd socket of the connection. Ownership is transferred, also on failure.
+ * @param addr client address
+ * @return shard of the client, or -1 on failure
+ */
+int ServerShards_AddClient (ServerShards *o, uint64_t client_key, peerid_t id, int fd, BAddr addr);
+
+/**
+ * Removes a client, closing its connection. Any further messages from the shard
+ * about the client are discarded.
+ * If the removal cannot be queued to the shard for lack of memory, it is retried
+ * periodically; space to remember it was reserved when the client was added.
+ * 
+ * @param o the object
+ * @param shard shard of the client
+ * @param client_key key of the client
+ */
+void ServerShards_RemoveClient (ServerShards *o, int shard, uint64_t client_key);
+
+/**
+ * Sends a control packet to a client.
+ * 
+ * @param o the object
+ * @param shard shard of the client
+ * @param client_key key of the client
+ * @param data packet, beginning with a sc_header
+ * @param data_len length of the packet. Must be >=0 and <=SC_MAX_ENC.
+ */
+void ServerShards_SendControl (ServerShards *o, int shard, uint64_t client_key, const uint8_t *data, int data_len);
+
+/**
+ * Opens a peer flow, forwarding messages from the source client to the
+ * destination client, once the source client has accepted the destination
+ * (immediately for clients too old to do that).
+ * 
+ * @param o the object
+ * @param flow_key key identifying the flow. Must not be reused.
+ * @param src_shard shard of the source client
+ * @param src_client_key key of the source client
+ * @param dest_shard shard of the destination client
+ * @param dest_client_key key of the destination client
+ * @param dest_id ID of the destination client
+ */
+void ServerShards_OpenFlow (ServerShards *o, uint64_t flow_key, int src_shard, uint64_t src_client_key,
+                            int dest_shard, uint64_t dest_client_key, peerid_t dest_id);
+
+/**
+ * Closes a peer flow. The flowdone handler is called when the buffer of the flow
+ * is no longer in use. Other messages about the flow may still be reported until then.
+ * 
+ * @param o the object
+ * @param flow_key key of the flow
+ * @param src_shard shard of the source client
+ * @param src_client_key key of the source client
+ * @param dest_shard shard of the destination client
+ * @param dest_id ID of the destination client
+ */
+void ServerShards_CloseFlow (ServerShards *o, uint64_t flow_key, int src_shard, uint64_t src_client_key,
+                             int dest_shard, peerid_t dest_id);
+
+#endif
@@ -58,6 +58,7 @@
 #include <predicate/BPredicate.h>
 #include <base/DebugObject.h>
 #include <base/BLog.h>
+#include <base/BLog_binary.h>
 #include <system/BSignal.h>
 #include <system/BTime.h>
 #include <system/BNetwork.h>
@@ -67,6 +68,7 @@
 
 #ifndef BADVPN_USE_WINAPI
 #include <base/BLog_syslog.h>
+#include <server/ServerShards.h>
 #endif
 
 #include <server/server.h>
@@ -75,6 +77,7 @@
 
 #define LOGGER_STDOUT 1
 #define LOGGER_SYSLOG 2
+#define LOGGER_BINARY 3
 
 // parsed command-line options
 struct {
@@ -85,9 +88,11 @@ struct {
     char *logger_syslog_facility;
     char *logger_syslog_ident;
     #endif
+    char *logger_binary_file;
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     int threads;
+    int pin_threads;
     int use_threads_for_ssl_handshake;
     int use_threads_for_ssl_data;
     int ssl;
@@ -99,6 +104,7 @@ struct {
     char *relay_predicate;
     int client_socket_sndbuf;
     int max_clients;
+    int shards;
 } options;
 
 // listen addresses
@@ -167,6 +173,23 @@ LinkedList1 clients;
 // clients tree (by ID)
 BAVL clients_tree;
 
+#ifndef BADVPN_USE_WINAPI
+// connection shards, if using shards
+ServerShards shards;
+
+// next key for clients and flows in shards
+uint64_t shards_nextkey;
+
+// clients tree (by shard key)
+BAVL clients_key_tree;
+
+// flows with I/O tree (by shard key)
+BAVL flows_key_tree;
+
+// buffer for building control packets for shards
+uint8_t shards_control_packet[SC_MAX_ENC];
+#endif
+
 // prints help text to standard output
 static void print_help (const char *name);
 
@@ -192,6 +215,9 @@ static void client_dealloc (struct client_data *client);
 
 static int client_compute_buffer_size (struct client_data *client);
 
+// frees the object which writes to the client connection
+static void client_free_sender (struct client_data *client);
+
 // initializes the I/O porition of the client
 static int client_init_io (struct client_data *client);
 
@@ -219,6 +245,9 @@ static void client_connection_handler (struct client_data *client, int event);
 // BSSLConnection handler
 static void client_sslcon_handler (struct client_data *client, int event);
 
+// remembers the common name and encodings of the client certificate
+static int client_read_certificate (struct client_data *client, CERTCertificate *cert);
+
 // decoder handler
 static void client_decoder_handler_error (struct client_data *client);
 
@@ -275,6 +304,9 @@ static void peer_flow_drive_reset (struct peer_flow *flow);
 
 static void peer_flow_reset_qflow_handler_busy (struct peer_flow *flow);
 
+// starts closing the flow in the shards; I/O is freed when they are done
+static void peer_flow_shard_close (struct peer_flow *flow);
+
 // resets clients knowledge after the timer expires
 static void peer_flow_reset_timer_handler (struct peer_flow *flow);
 
@@ -318,6 +350,9 @@ static int relay_predicate_func_raddr_cb (void *user, void **args);
 // comparator for peerid_t used in AVL tree
 static int peerid_comparator (void *unused, peerid_t *p1, peerid_t *p2);
 
+// comparator for shard keys used in AVL tree
+static int shard_key_comparator (void *unused, uint64_t *k1, uint64_t *k2);
+
 static struct peer_know * create_know (struct client_data *from, struct client_data *to, int relay_server, int relay_client);
 static void remove_know (struct peer_know *k);
 static void know_inform_job_handler (struct peer_know *k);
@@ -329,6 +364,19 @@ static int launch_pair (struct peer_flow *flow_to);
 // find flow from a client to some client
 static struct peer_flow * find_flow (struct client_data *client, peerid_t dest_id);
 
+#ifndef BADVPN_USE_WINAPI
+// shard handlers
+static void shards_handler_up (void *unused, uint64_t client_key, const uint8_t *cert, int cert_len);
+static void shards_handler_packet (void *unused, uint64_t client_key, uint8_t *data, int data_len);
+static void shards_handler_down (void *unused, uint64_t client_key);
+static void shards_handler_overflow (void *unused, uint64_t flow_key);
+static void shards_handler_flowdone (void *unused, uint64_t flow_key);
+
+// finds a client or flow by its shard key
+static struct client_data * find_client_by_shard_key (uint64_t key);
+static struct peer_flow * find_flow_by_shard_key (uint64_t key);
+#endif
+
 int main (int argc, char *argv[])
 {
     if (argc <= 0) {
@@ -369,6 +417,12 @@ int main (int argc, char *argv[])
             }
             break;
         #endif
+        case LOGGER_BINARY:
+            if (!BLog_InitBinary(options.logger_binary_file)) {
+                fprintf(stderr, "Failed to initialize binary logger\n");
+                goto fail0;
+            }
+            break;
         default:
             ASSERT(0);
     }
@@ -490,8 +544,12 @@ int main (int argc, char *argv[])
     }
     
     // init thread work dispatcher
-    if (!BThreadWorkDispatcher_Init(&twd, &ss, options.threads)) {
-        BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init failed");
+    struct BThreadWorkDispatcher_params twd_params;
+    twd_params.num_threads = options.threads;
+    twd_params.queue_size = 0;
+    twd_params.pin_threads = options.pin_threads;
+    if (!BThreadWorkDispatcher_Init2(&twd, &ss, twd_params)) {
+        BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init2 failed");
         goto fail3a;
     }
     
@@ -513,6 +571,34 @@ int main (int argc, char *argv[])
     // initialize clients tree
     BAVL_Init(&clients_tree, OFFSET_DIFF(struct client_data, id, tree_node), (BAVL_comparator)peerid_comparator, NULL);
     
+#ifndef BADVPN_USE_WINAPI
+    // start shards; after BSignal_Init, so that their threads don't get signals
+    if (options.shards > 0) {
+        struct ServerShards_params shards_params;
+        shards_params.num_shards = options.shards;
+        shards_params.num_threads = options.threads;
+        shards_params.pin_threads = options.pin_threads;
+        shards_params.ssl = options.ssl;
+        shards_params.model_prfd = (options.ssl ? model_prfd : NULL);
+        shards_params.ssl_flags = ssl_flags();
+        shards_params.socket_sndbuf = options.client_socket_sndbuf;
+        shards_params.control_buffer_packets = client_compute_buffer_size(NULL);
+        shards_params.peer_buffer_packets = CLIENT_PEER_FLOW_BUFFER_MIN_PACKETS;
+        shards_params.no_data_time_limit = CLIENT_NO_DATA_TIME_LIMIT;
+        
+        if (!ServerShards_Init(&shards, &ss, shards_params, NULL,
+                               shards_handler_up, shards_handler_packet, shards_handler_down,
+                               shards_handler_overflow, shards_handler_flowdone)) {
+            BLog(BLOG_ERROR, "ServerShards_Init failed");
+            goto fail5;
+        }
+        
+        shards_nextkey = 0;
+        BAVL_Init(&clients_key_tree, OFFSET_DIFF(struct client_data, shard_key, shard_tree_node), (BAVL_comparator)shard_key_comparator, NULL);
+        BAVL_Init(&flows_key_tree, OFFSET_DIFF(struct peer_flow, shard_key, shard_tree_node), (BAVL_comparator)shard_key_comparator, NULL);
+    }
+#endif
+    
     // initialize listeners
     num_listeners = 0;
     while (num_listeners < num_listen_addrs) {
@@ -553,7 +639,9 @@ int main (int argc, char *argv[])
             ASSERT(flow->src_client == client)
             
             // allow freeing queue flows at dest
-            PacketPassFairQueue_PrepareFree(&flow->dest_client->output_peers_fairqueue);
+            if (!(options.shards > 0)) {
+                PacketPassFairQueue_PrepareFree(&flow->dest_client->output_peers_fairqueue);
+            }
             
             // deallocate flow
             peer_flow_dealloc(flow);
@@ -568,6 +656,13 @@ fail10:
         BListener_Free(&listeners[num_listeners]);
     }
     
+#ifndef BADVPN_USE_WINAPI
+    // stop shards, closing their connections
+    if (options.shards > 0) {
+        ServerShards_Free(&shards);
+    }
+fail5:
+#endif
     BSignal_Finish();
 fail4:
     BThreadWorkDispatcher_Free(&twd);
@@ -626,9 +721,13 @@ void print_help (const char *name)
         "            [--syslog-ident <string>]\n"
         "        )\n"
         #endif
+        "        (logger=binary?\n"
+        "            [--binlog-file <file>]\n"
+        "        )\n"
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--threads <integer>]\n"
+        "        [--pin-threads]\n"
         "        [--use-threads-for-ssl-handshake]\n"
         "        [--use-threads-for-ssl-data]\n"
         "        [--listen-addr <addr>] ...\n"
@@ -637,6 +736,9 @@ void print_help (const char *name)
         "        [--relay-predicate <string>]\n"
         "        [--client-socket-sndbuf <bytes / 0>]\n"
         "        [--max-clients <number>]\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--shards <number>]\n"
+        #endif
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -656,11 +758,13 @@ int parse_arguments (int argc, char *argv[])
     options.logger_syslog_facility = "daemon";
     options.logger_syslog_ident = argv[0];
     #endif
+    options.logger_binary_file = "badvpn.blog";
     options.loglevel = -1;
     for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
         options.loglevels[i] = -1;
     }
     options.threads = 0;
+    options.pin_threads = 0;
     options.use_threads_for_ssl_handshake = 0;
     options.use_threads_for_ssl_data = 0;
     options.ssl = 0;
@@ -671,6 +775,7 @@ int parse_arguments (int argc, char *argv[])
     options.relay_predicate = NULL;
     options.client_socket_sndbuf = CLIENT_DEFAULT_SOCKET_SNDBUF;
     options.max_clients = DEFAULT_MAX_CLIENTS;
+    options.shards = 0;
     
     for (int i = 1; i < argc; i++) {
         char *arg = argv[i];
@@ -694,6 +799,9 @@ int parse_arguments (int argc, char *argv[])
                 options.logger = LOGGER_SYSLOG;
             }
             #endif
+            else if (!strcmp(arg2, "binary")) {
+                options.logger = LOGGER_BINARY;
+            }
             else {
                 fprintf(stderr, "%s: wrong argument\n", arg);
                 return 0;
@@ -718,6 +826,14 @@ int parse_arguments (int argc, char *argv[])
             i++;
         }
         #endif
+        else if (!strcmp(arg, "--binlog-file")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.logger_binary_file = argv[i + 1];
+            i++;
+        }
         else if (!strcmp(arg, "--loglevel")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -755,6 +871,9 @@ int parse_arguments (int argc, char *argv[])
             options.threads = atoi(argv[i + 1]);
             i++;
         }
+        else if (!strcmp(arg, "--pin-threads")) {
+            options.pin_threads = 1;
+        }
         else if (!strcmp(arg, "--use-threads-for-ssl-handshake")) {
             options.use_threads_for_ssl_handshake = 1;
         }
@@ -831,6 +950,19 @@ int parse_arguments (int argc, char *argv[])
             }
             i++;
         }
+        #ifndef BADVPN_USE_WINAPI
+        else if (!strcmp(arg, "--shards")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.shards = atoi(argv[i + 1])) < 0 || options.shards > SERVERSHARDS_MAX_SHARDS) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        #endif
         else {
             fprintf(stderr, "%s: unknown option\n", arg);
             return 0;
@@ -903,73 +1035,107 @@ void listener_handler (BListener *listener)
         goto fail0;
     }
     
-    // accept connection
-    if (!BConnection_Init(&client->con, BConnection_source_listener(listener, &client->addr), &ss, client, (BConnection_handler)client_connection_handler)) {
-        BLog(BLOG_ERROR, "BConnection_Init failed");
-        goto fail1;
-    }
-    
-    // limit socket send buffer, else our scheduling is pointless
-    if (options.client_socket_sndbuf > 0) {
-        if (!BConnection_SetSendBuffer(&client->con, options.client_socket_sndbuf)) {
-            BLog(BLOG_WARNING, "BConnection_SetSendBuffer failed");
-        }
-    }
-    
-    // assign ID
-    client->id = new_client_id();
-    
-    // set no common name
-    client->common_name = NULL;
-    
-    // now client_log() works
-    
-    // init connection interfaces
-    BConnection_SendAsync_Init(&client->con);
-    BConnection_RecvAsync_Init(&client->con);
-    
-    if (options.ssl) {
-        // create bottom NSPR file descriptor
-        if (!BSSLConnection_MakeBackend(&client->bottom_prfd, BConnection_SendAsync_GetIf(&client->con), BConnection_RecvAsync_GetIf(&client->con), &twd, ssl_flags())) {
-            client_log(client, BLOG_ERROR, "BSSLConnection_MakeBackend failed");
-            goto fail2;
+#ifndef BADVPN_USE_WINAPI
+    if (options.shards > 0) {
+        // accept connection, to be handled by a shard
+        int fd = BListener_AcceptFd(listener, &client->addr);
+        if (fd < 0) {
+            BLog(BLOG_ERROR, "BListener_AcceptFd failed");
+            goto fail1;
         }
         
-        // create SSL file descriptor from the bottom NSPR file descriptor
-        if (!(client->ssl_prfd = SSL_ImportFD(model_prfd, &client->bottom_prfd))) {
-            client_log(client, BLOG_ERROR, "SSL_ImportFD failed");
-            ASSERT_FORCE(PR_Close(&client->bottom_prfd) == PR_SUCCESS)
-            goto fail2;
+        // assign ID
+        client->id = new_client_id();
+        
+        // set no common name
+        client->common_name = NULL;
+        
+        // pass the connection to a shard, which takes over the socket
+        client->shard_key = shards_nextkey++;
+        if ((client->shard = ServerShards_AddClient(&shards, client->shard_key, client->id, fd, client->addr)) < 0) {
+            client_log(client, BLOG_ERROR, "ServerShards_AddClient failed");
+            goto fail1;
         }
         
-        // set server mode
-        if (SSL_ResetHandshake(client->ssl_prfd, PR_TRUE) != SECSuccess) {
-            client_log(client, BLOG_ERROR, "SSL_ResetHandshake failed");
-            goto fail3;
+        // with SSL, I/O is initialized after the shard has done the handshake
+        if (!options.ssl) {
+            ASSERT_EXECUTE(client_init_io(client))
         }
         
-        // set require client certificate
-        if (SSL_OptionSet(client->ssl_prfd, SSL_REQUEST_CERTIFICATE, PR_TRUE) != SECSuccess) {
-            client_log(client, BLOG_ERROR, "SSL_OptionSet(SSL_REQUEST_CERTIFICATE) failed");
-            goto fail3;
+        ASSERT_EXECUTE(BAVL_Insert(&clients_key_tree, &client->shard_tree_node, NULL))
+    } else
+#endif
+    {
+        // accept connection
+        if (!BConnection_Init(&client->con, BConnection_source_listener(listener, &client->addr), &ss, client, (BConnection_handler)client_connection_handler)) {
+            BLog(BLOG_ERROR, "BConnection_Init failed");
+            goto fail1;
         }
-        if (SSL_OptionSet(client->ssl_prfd, SSL_REQUIRE_CERTIFICATE, PR_TRUE) != SECSuccess) {
-            client_log(client, BLOG_ERROR, "SSL_OptionSet(SSL_REQUIRE_CERTIFICATE) failed");
-            goto fail3;
+        
+        // limit socket send buffer, else our scheduling is pointless
+        if (options.client_socket_sndbuf > 0) {
+            if (!BConnection_SetSendBuffer(&client->con, options.client_socket_sndbuf)) {
+                BLog(BLOG_WARNING, "BConnection_SetSendBuffer failed");
+            }
         }
         
-        // init SSL connection
-        BSSLConnection_Init(&client->sslcon, client->ssl_prfd, 1, BReactor_PendingGroup(&ss), client, (BSSLConnection_handler)client_sslcon_handler);
-    } else {
-        // initialize I/O
-        if (!client_init_io(client)) {
-            goto fail2;
+        // assign ID
+        client->id = new_client_id();
+        
+        // set no common name
+        client->common_name = NULL;
+        
+        // now client_log() works
+        
+        // init connection interfaces
+        BConnection_SendAsync_Init(&client->con);
+        BConnection_RecvAsync_Init(&client->con);
+        
+        if (options.ssl) {
+            // create bottom NSPR file descriptor
+            if (!BSSLConnection_MakeBackend(&client->bottom_prfd, BConnection_SendAsync_GetIf(&client->con), BConnection_RecvAsync_GetIf(&client->con), &twd, ssl_flags())) {
+                client_log(client, BLOG_ERROR, "BSSLConnection_MakeBackend failed");
+                goto fail2;
+            }
+            
+            // create SSL file descriptor from the bottom NSPR file descriptor
+            if (!(client->ssl_prfd = SSL_ImportFD(model_prfd, &client->bottom_prfd))) {
+                client_log(client, BLOG_ERROR, "SSL_ImportFD failed");
+                ASSERT_FORCE(PR_Close(&client->bottom_prfd) == PR_SUCCESS)
+                goto fail2;
+            }
+            
+            // set server mode
+            if (SSL_ResetHandshake(client->ssl_prfd, PR_TRUE) != SECSuccess) {
+                client_log(client, BLOG_ERROR, "SSL_ResetHandshake failed");
+                goto fail3;
+            }
+            
+            // set require client certificate
+            if (SSL_OptionSet(client->ssl_prfd, SSL_REQUEST_CERTIFICATE, PR_TRUE) != SECSuccess) {
+                client_log(client, BLOG_ERROR, "SSL_OptionSet(SSL_REQUEST_CERTIFICATE) failed");
+                goto fail3;
+            }
+            if (SSL_OptionSet(client->ssl_prfd, SSL_REQUIRE_CERTIFICATE, PR_TRUE) != SECSuccess) {
+                client_log(client, BLOG_ERROR, "SSL_OptionSet(SSL_REQUIRE_CERTIFICATE) failed");
+                goto fail3;
+            }
+            
+            // init SSL connection
+            BSSLConnection_Init(&client->sslcon, client->ssl_prfd, 1, BReactor_PendingGroup(&ss), client, (BSSLConnection_handler)client_sslcon_handler);
+        } else {
+            // initialize I/O
+            if (!client_init_io(client)) {
+                goto fail2;
+            }
         }
     }
     
-    // start disconnect timer
+    // start disconnect timer; with shards, the shard keeps the timer
     BTimer_Init(&client->disconnect_timer, CLIENT_NO_DATA_TIME_LIMIT, (BTimer_handler)client_disconnect_timer_handler, client);
-    BReactor_SetTimer(&ss, &client->disconnect_timer);
+    if (!(options.shards > 0)) {
+        BReactor_SetTimer(&ss, &client->disconnect_timer);
+    }
     
     // link in
     clients_num++;
@@ -1031,17 +1197,26 @@ void client_dealloc (struct client_data *client)
     // stop disconnect timer
     BReactor_RemoveTimer(&ss, &client->disconnect_timer);
     
+    // free common name
+    if (client->common_name) {
+        PORT_Free(client->common_name);
+    }
+    
+#ifndef BADVPN_USE_WINAPI
+    // the connection belongs to the shard
+    if (options.shards > 0) {
+        BAVL_Remove(&clients_key_tree, &client->shard_tree_node);
+        free(client);
+        return;
+    }
+#endif
+    
     // free SSL
     if (options.ssl) {
         BSSLConnection_Free(&client->sslcon);
         ASSERT_FORCE(PR_Close(client->ssl_prfd) == PR_SUCCESS)
     }
     
-    // free common name
-    if (client->common_name) {
-        PORT_Free(client->common_name);
-    }
-    
     // free connection interfaces
     BConnection_RecvAsync_Free(&client->con);
     BConnection_SendAsync_Free(&client->con);
@@ -1064,8 +1239,24 @@ int client_compute_buffer_size (struct client_data *client)
     }
 }
 
+void client_free_sender (struct client_data *client)
+{
+    if (options.ssl) {
+        PacketStreamCoalescer_Free(&client->output_coalescer);
+    } else {
+        PacketStreamSender_Free(&client->output_sender);
+    }
+}
+
 int client_init_io (struct client_data *client)
 {
+    // with shards, only the flows to us are tracked here
+    if (options.shards > 0) {
+        client->output_control_packet_len = -1;
+        LinkedList1_Init(&client->output_peers_flows);
+        return 1;
+    }
+    
     StreamPassInterface *send_if = (options.ssl ? BSSLConnection_GetSendIf(&client->sslcon) : BConnection_SendAsync_GetIf(&client->con));
     StreamRecvInterface *recv_if = (options.ssl ? BSSLConnection_GetRecvIf(&client->sslcon) : BConnection_RecvAsync_GetIf(&client->con));
     
@@ -1084,11 +1275,22 @@ int client_init_io (struct client_data *client)
     
     // init output common
     
-    // init sender
-    PacketStreamSender_Init(&client->output_sender, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(&ss));
+    // init sender. With SSL, coalesce packets so that they don't each
+    // become a separate record.
+    PacketPassInterface *sender_input;
+    if (options.ssl) {
+        if (!PacketStreamCoalescer_Init(&client->output_coalescer, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BSSLCONNECTION_MAX_RECORD_DATA, -1, &ss)) {
+            client_log(client, BLOG_ERROR, "PacketStreamCoalescer_Init failed");
+            goto fail2;
+        }
+        sender_input = PacketStreamCoalescer_GetInput(&client->output_coalescer);
+    } else {
+        PacketStreamSender_Init(&client->output_sender, send_if, PACKETPROTO_ENCLEN(SC_MAX_ENC), BReactor_PendingGroup(&ss));
+        sender_input = PacketStreamSender_GetInput(&client->output_sender);
+    }
     
     // init queue
-    PacketPassPriorityQueue_Init(&client->output_priorityqueue, PacketStreamSender_GetInput(&client->output_sender), BReactor_PendingGroup(&ss), 0);
+    PacketPassPriorityQueue_Init(&client->output_priorityqueue, sender_input, BReactor_PendingGroup(&ss), 0);
     
     // init output control flow
     
@@ -1101,7 +1303,7 @@ int client_init_io (struct client_data *client)
         PacketPassPriorityQueueFlow_GetInput(&client->output_control_qflow), BReactor_PendingGroup(&ss)
     )) {
         client_log(client, BLOG_ERROR, "PacketProtoFlow_Init failed");
-        goto fail2;
+        goto fail3;
     }
     client->output_control_input = PacketProtoFlow_GetInput(&client->output_control_oflow);
     client->output_control_packet_len = -1;
@@ -1115,7 +1317,7 @@ int client_init_io (struct client_data *client)
     // init fair queue (for different peers)
     if (!PacketPassFairQueue_Init(&client->output_peers_fairqueue, PacketPassPriorityQueueFlow_GetInput(&client->output_peers_qflow), BReactor_PendingGroup(&ss), 0, 1)) {
         client_log(client, BLOG_ERROR, "PacketPassFairQueue_Init failed");
-        goto fail3;
+        goto fail4;
     }
     
     // init list of flows
@@ -1123,14 +1325,15 @@ int client_init_io (struct client_data *client)
     
     return 1;
     
-fail3:
+fail4:
     PacketPassPriorityQueueFlow_Free(&client->output_peers_qflow);
     PacketProtoFlow_Free(&client->output_control_oflow);
-fail2:
+fail3:
     PacketPassPriorityQueueFlow_Free(&client->output_control_qflow);
     // free output common
     PacketPassPriorityQueue_Free(&client->output_priorityqueue);
-    PacketStreamSender_Free(&client->output_sender);
+    client_free_sender(client);
+fail2:
     // free input
     PacketProtoDecoder_Free(&client->input_decoder);
 fail1:
@@ -1140,13 +1343,17 @@ fail1:
 
 void client_dealloc_io (struct client_data *client)
 {
-    // stop using any buffers before they get freed
-    if (options.ssl) {
-        BSSLConnection_ReleaseBuffers(&client->sslcon);
-    }
+    int sharded = (options.shards > 0);
     
-    // allow freeing fair queue flows
-    PacketPassFairQueue_PrepareFree(&client->output_peers_fairqueue);
+    if (!sharded) {
+        // stop using any buffers before they get freed
+        if (options.ssl) {
+            BSSLConnection_ReleaseBuffers(&client->sslcon);
+        }
+        
+        // allow freeing fair queue flows
+        PacketPassFairQueue_PrepareFree(&client->output_peers_fairqueue);
+    }
     
     // remove flows to us
     LinkedList1Node *node;
@@ -1156,6 +1363,10 @@ void client_dealloc_io (struct client_data *client)
         peer_flow_dealloc(flow);
     }
     
+    if (sharded) {
+        return;
+    }
+    
     // allow freeing priority queue flows
     PacketPassPriorityQueue_PrepareFree(&client->output_priorityqueue);
     
@@ -1169,7 +1380,7 @@ void client_dealloc_io (struct client_data *client)
     
     // free output common
     PacketPassPriorityQueue_Free(&client->output_priorityqueue);
-    PacketStreamSender_Free(&client->output_sender);
+    client_free_sender(client);
     
     // free input
     PacketProtoDecoder_Free(&client->input_decoder);
@@ -1185,6 +1396,13 @@ void client_remove (struct client_data *client)
     // set dying to prevent sending this client anything
     client->dying = 1;
     
+#ifndef BADVPN_USE_WINAPI
+    // have the shard close the connection
+    if (options.shards > 0) {
+        ServerShards_RemoveClient(&shards, client->shard, client->shard_key);
+    }
+#endif
+    
     // free I/O now, removing incoming flows
     if (client->initstatus >= INITSTATUS_WAITHELLO) {
         client_dealloc_io(client);
@@ -1204,7 +1422,7 @@ void client_remove (struct client_data *client)
         ASSERT(flow->dest_client->initstatus == INITSTATUS_COMPLETE)
         ASSERT(!flow->dest_client->dying)
         
-        if (flow->have_io && PacketPassFairQueueFlow_IsBusy(&flow->qflow)) {
+        if (!(options.shards > 0) && flow->have_io && PacketPassFairQueueFlow_IsBusy(&flow->qflow)) {
             client_log(client, BLOG_DEBUG, "removing flow to %d later", (int)flow->dest_client->id);
             peer_flow_disconnect(flow);
         } else {
@@ -1237,10 +1455,9 @@ void client_dying_job (struct client_data *client)
 
 void client_logfunc (struct client_data *client)
 {
-    char addr[BADDR_MAX_PRINT_LEN];
-    BAddr_Print(&client->addr, addr);
-    
-    BLog_Append("client %d (%s)", (int)client->id, addr);
+    BLog_Append("client %d (", (int)client->id);
+    BLog_AppendAddr(&client->addr);
+    BLog_Append(")");
     if (client->common_name) {
         BLog_Append(" (%s)", client->common_name);
     }
@@ -1299,17 +1516,45 @@ void client_sslcon_handler (struct client_data *client, int event)
         goto fail0;
     }
     
+    // remember certificate
+    if (!client_read_certificate(client, cert)) {
+        goto fail1;
+    }
+    
+    // init I/O chains
+    if (!client_init_io(client)) {
+        goto fail1;
+    }
+    
+    CERT_DestroyCertificate(cert);
+    
+    // set client state
+    client->initstatus = INITSTATUS_WAITHELLO;
+    
+    client_log(client, BLOG_INFO, "handshake complete");
+    
+    return;
+    
+    // handle errors
+fail1:
+    CERT_DestroyCertificate(cert);
+fail0:
+    client_remove(client);
+}
+
+int client_read_certificate (struct client_data *client, CERTCertificate *cert)
+{
     // remember common name
     if (!(client->common_name = CERT_GetCommonName(&cert->subject))) {
         client_log(client, BLOG_NOTICE, "CERT_GetCommonName failed");
-        goto fail1;
+        goto fail0;
     }
     
     // store certificate
     SECItem der = cert->derCert;
     if (der.len > sizeof(client->cert)) {
         client_log(client, BLOG_NOTICE, "client certificate too big");
-        goto fail1;
+        goto fail0;
     }
     memcpy(client->cert, der.data, der.len);
     client->cert_len = der.len;
@@ -1317,46 +1562,32 @@ void client_sslcon_handler (struct client_data *client, int event)
     PRArenaPool *arena = PORT_NewArena(DER_DEFAULT_CHUNKSIZE);
     if (!arena) {
         client_log(client, BLOG_ERROR, "PORT_NewArena failed");
-        goto fail1;
+        goto fail0;
     }
     
     // encode certificate
     memset(&der, 0, sizeof(der));
     if (!SEC_ASN1EncodeItem(arena, &der, cert, SEC_ASN1_GET(CERT_CertificateTemplate))) {
         client_log(client, BLOG_ERROR, "SEC_ASN1EncodeItem failed");
-        goto fail2;
+        goto fail1;
     }
     
     // store re-encoded certificate (for compatibility with old clients)
     if (der.len > sizeof(client->cert_old)) {
         client_log(client, BLOG_NOTICE, "client certificate too big");
-        goto fail2;
+        goto fail1;
     }
     memcpy(client->cert_old, der.data, der.len);
     client->cert_old_len = der.len;
     
-    // init I/O chains
-    if (!client_init_io(client)) {
-        goto fail2;
-    }
-    
     PORT_FreeArena(arena, PR_FALSE);
-    CERT_DestroyCertificate(cert);
-    
-    // set client state
-    client->initstatus = INITSTATUS_WAITHELLO;
-    
-    client_log(client, BLOG_INFO, "handshake complete");
     
-    return;
+    return 1;
     
-    // handle errors
-fail2:
-    PORT_FreeArena(arena, PR_FALSE);
 fail1:
-    CERT_DestroyCertificate(cert);
+    PORT_FreeArena(arena, PR_FALSE);
 fail0:
-    client_remove(client);
+    return 0;
 }
 
 void client_decoder_handler_error (struct client_data *client)
@@ -1389,6 +1620,12 @@ int client_start_control_packet (struct client_data *client, void **data, int le
     }
 #endif
     
+#ifndef BADVPN_USE_WINAPI
+    // with shards, the packet is built here and copied to the shard
+    if (options.shards > 0) {
+        client->output_control_packet = shards_control_packet;
+    } else
+#endif
     // obtain location for writing the packet
     if (!BufferWriter_StartPacket(client->output_control_input, &client->output_control_packet)) {
         // out of buffer, kill client
@@ -1418,6 +1655,12 @@ void client_end_control_packet (struct client_data *client, uint8_t type)
     header.type = htol8(type);
     memcpy(client->output_control_packet, &header, sizeof(header));
     
+#ifndef BADVPN_USE_WINAPI
+    // pass the packet to the shard
+    if (options.shards > 0) {
+        ServerShards_SendControl(&shards, client->shard, client->shard_key, client->output_control_packet, sizeof(struct sc_header) + client->output_control_packet_len);
+    } else
+#endif
     // finish writing packet
     BufferWriter_EndPacket(client->output_control_input, sizeof(struct sc_header) + client->output_control_packet_len);
     
@@ -1821,7 +2064,9 @@ fail0:
 
 void peer_flow_dealloc (struct peer_flow *flow)
 {
-    if (flow->have_io) { PacketPassFairQueueFlow_AssertFree(&flow->qflow); }
+    if (flow->have_io && !(options.shards > 0)) {
+        PacketPassFairQueueFlow_AssertFree(&flow->qflow);
+    }
     
     // free reset timer
     BReactor_RemoveTimer(&ss, &flow->reset_timer);
@@ -1848,6 +2093,22 @@ int peer_flow_init_io (struct peer_flow *flow)
 {
     ASSERT(!flow->have_io)
     
+#ifndef BADVPN_USE_WINAPI
+    // have the shards of the two clients set up the flow
+    if (options.shards > 0) {
+        flow->shard_key = shards_nextkey++;
+        flow->shard_closing = 0;
+        ASSERT_EXECUTE(BAVL_Insert(&flows_key_tree, &flow->shard_tree_node, NULL))
+        
+        ServerShards_OpenFlow(&shards, flow->shard_key, flow->src_client->shard, flow->src_client->shard_key,
+                              flow->dest_client->shard, flow->dest_client->shard_key, flow->dest_client->id);
+        
+        flow->have_io = 1;
+        
+        return 1;
+    }
+#endif
+    
     // init queue flow
     PacketPassFairQueueFlow_Init(&flow->qflow, &flow->dest_client->output_peers_fairqueue);
     
@@ -1877,6 +2138,20 @@ fail1:
 void peer_flow_free_io (struct peer_flow *flow)
 {
     ASSERT(flow->have_io)
+    
+#ifndef BADVPN_USE_WINAPI
+    // close the flow in the shards, unless they are already at it; when freeing
+    // the flow altogether, their confirmation will be ignored
+    if (options.shards > 0) {
+        peer_flow_shard_close(flow);
+        BAVL_Remove(&flows_key_tree, &flow->shard_tree_node);
+        
+        flow->have_io = 0;
+        
+        return;
+    }
+#endif
+    
     PacketPassFairQueueFlow_AssertFree(&flow->qflow);
     
     // free PacketProtoFlow
@@ -2002,7 +2277,10 @@ void peer_flow_drive_reset (struct peer_flow *flow)
     
     // try to free I/O
     if (flow->have_io) {
-        if (PacketPassFairQueueFlow_IsBusy(&flow->qflow)) {
+        if (options.shards > 0) {
+            peer_flow_shard_close(flow);
+        }
+        else if (PacketPassFairQueueFlow_IsBusy(&flow->qflow)) {
             PacketPassFairQueueFlow_SetBusyHandler(&flow->qflow, (PacketPassFairQueue_handler_busy)peer_flow_reset_qflow_handler_busy, flow);
         } else {
             peer_flow_free_io(flow);
@@ -2011,7 +2289,10 @@ void peer_flow_drive_reset (struct peer_flow *flow)
     
     // try to free opposite I/O
     if (flow->opposite->have_io) {
-        if (PacketPassFairQueueFlow_IsBusy(&flow->opposite->qflow)) {
+        if (options.shards > 0) {
+            peer_flow_shard_close(flow->opposite);
+        }
+        else if (PacketPassFairQueueFlow_IsBusy(&flow->opposite->qflow)) {
             PacketPassFairQueueFlow_SetBusyHandler(&flow->opposite->qflow, (PacketPassFairQueue_handler_busy)peer_flow_reset_qflow_handler_busy, flow->opposite);
         } else {
             peer_flow_free_io(flow->opposite);
@@ -2044,6 +2325,23 @@ void peer_flow_reset_qflow_handler_busy (struct peer_flow *flow)
     }
 }
 
+void peer_flow_shard_close (struct peer_flow *flow)
+{
+    ASSERT(flow->have_io)
+    ASSERT(options.shards > 0)
+    
+#ifndef BADVPN_USE_WINAPI
+    if (flow->shard_closing) {
+        return;
+    }
+    
+    flow->shard_closing = 1;
+    
+    ServerShards_CloseFlow(&shards, flow->shard_key, flow->src_client->shard, flow->src_client->shard_key,
+                           flow->dest_client->shard, flow->dest_client->id);
+#endif
+}
+
 void peer_flow_reset_timer_handler (struct peer_flow *flow)
 {
     ASSERT(flow->src_client->initstatus == INITSTATUS_COMPLETE)
@@ -2229,6 +2527,11 @@ int peerid_comparator (void *unused, peerid_t *p1, peerid_t *p2)
     return B_COMPARE(*p1, *p2);
 }
 
+int shard_key_comparator (void *unused, uint64_t *k1, uint64_t *k2)
+{
+    return B_COMPARE(*k1, *k2);
+}
+
 struct peer_know * create_know (struct client_data *from, struct client_data *to, int relay_server, int relay_client)
 {
     ASSERT(from->initstatus == INITSTATUS_COMPLETE)
@@ -2392,3 +2695,154 @@ struct peer_flow * find_flow (struct client_data *client, peerid_t dest_id)
     
     return flow;
 }
+
+#ifndef BADVPN_USE_WINAPI
+
+void shards_handler_up (void *unused, uint64_t client_key, const uint8_t *cert_data, int cert_len)
+{
+    ASSERT(options.ssl)
+    
+    struct client_data *client = find_client_by_shard_key(client_key);
+    if (!client || client->dying) {
+        return;
+    }
+    ASSERT(client->initstatus == INITSTATUS_HANDSHAKE)
+    
+    // decode the certificate the shard got in the handshake
+    SECItem der;
+    der.type = siBuffer;
+    der.data = (unsigned char *)cert_data;
+    der.len = cert_len;
+    CERTCertificate *cert = CERT_NewTempCertificate(CERT_GetDefaultCertDB(), &der, NULL, PR_FALSE, PR_TRUE);
+    if (!cert) {
+        client_log(client, BLOG_ERROR, "CERT_NewTempCertificate failed");
+        goto fail0;
+    }
+    
+    // remember certificate
+    if (!client_read_certificate(client, cert)) {
+        goto fail1;
+    }
+    
+    // init I/O
+    if (!client_init_io(client)) {
+        goto fail1;
+    }
+    
+    CERT_DestroyCertificate(cert);
+    
+    // set client state
+    client->initstatus = INITSTATUS_WAITHELLO;
+    
+    client_log(client, BLOG_INFO, "handshake complete");
+    
+    return;
+    
+fail1:
+    CERT_DestroyCertificate(cert);
+fail0:
+    client_remove(client);
+}
+
+void shards_handler_packet (void *unused, uint64_t client_key, uint8_t *data, int data_len)
+{
+    ASSERT(data_len >= sizeof(struct sc_header))
+    ASSERT(data_len <= SC_MAX_ENC)
+    
+    struct client_data *client = find_client_by_shard_key(client_key);
+    if (!client || client->dying) {
+        return;
+    }
+    ASSERT(INITSTATUS_HASLINK(client->initstatus))
+    
+    // parse header
+    struct sc_header header;
+    memcpy(&header, data, sizeof(header));
+    data += sizeof(header);
+    data_len -= sizeof(header);
+    uint8_t type = ltoh8(header.type);
+    
+    // the shard passes on the packets which change the state of clients and flows
+    switch (type) {
+        case SCID_CLIENTHELLO:
+            process_packet_hello(client, data, data_len);
+            return;
+        case SCID_RESETPEER:
+            process_packet_resetpeer(client, data, data_len);
+            return;
+        case SCID_ACCEPTPEER:
+            process_packet_acceptpeer(client, data, data_len);
+            return;
+        default:
+            ASSERT(0);
+    }
+}
+
+void shards_handler_down (void *unused, uint64_t client_key)
+{
+    struct client_data *client = find_client_by_shard_key(client_key);
+    if (!client || client->dying) {
+        return;
+    }
+    
+    client_remove(client);
+}
+
+void shards_handler_overflow (void *unused, uint64_t flow_key)
+{
+    struct peer_flow *flow = find_flow_by_shard_key(flow_key);
+    if (!flow) {
+        return;
+    }
+    ASSERT(flow->have_io)
+    
+    // the flow may already be on its way out
+    if (flow->shard_closing || flow->resetting || flow->opposite->resetting) {
+        return;
+    }
+    
+    // out of buffer, reset these two clients
+    client_log(flow->src_client, BLOG_WARNING, "out of buffer; resetting to %d", (int)flow->dest_client->id);
+    peer_flow_start_reset(flow);
+}
+
+void shards_handler_flowdone (void *unused, uint64_t flow_key)
+{
+    struct peer_flow *flow = find_flow_by_shard_key(flow_key);
+    if (!flow) {
+        return;
+    }
+    ASSERT(flow->have_io)
+    ASSERT(flow->shard_closing)
+    ASSERT(flow->resetting || flow->opposite->resetting)
+    
+    peer_flow_free_io(flow);
+    
+    if (flow->resetting) {
+        peer_flow_drive_reset(flow);
+    } else {
+        peer_flow_drive_reset(flow->opposite);
+    }
+}
+
+struct client_data * find_client_by_shard_key (uint64_t key)
+{
+    BAVLNode *node;
+    if (!(node = BAVL_LookupExact(&clients_key_tree, &key))) {
+        return NULL;
+    }
+    
+    return UPPER_OBJECT(node, struct client_data, shard_tree_node);
+}
+
+struct peer_flow * find_flow_by_shard_key (uint64_t key)
+{
+    BAVLNode *node;
+    if (!(node = BAVL_LookupExact(&flows_key_tree, &key))) {
+        return NULL;
+    }
+    
+    return UPPER_OBJECT(node, struct peer_flow, shard_tree_node);
+}
+
+#endif
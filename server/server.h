@@ -37,6 +37,7 @@
 #include <flow/PacketPassPriorityQueue.h>
 #include <flow/PacketPassFairQueue.h>
 #include <flow/PacketProtoFlow.h>
+#include <flowextra/PacketStreamCoalescer.h>
 #include <system/BReactor.h>
 #include <system/BConnection.h>
 #include <nspr_support/BSSLConnection.h>
@@ -105,6 +106,10 @@ struct peer_flow {
     struct peer_know *know;
     int accepted;
     int resetting;
+    // shard flow key and node in flows tree (by key), only with shards and have_io
+    uint64_t shard_key;
+    int shard_closing;
+    BAVLNode shard_tree_node;
 };
 
 struct peer_know {
@@ -147,6 +152,12 @@ struct client_data {
     // client ID
     peerid_t id;
     
+    // shard handling the connection, and key of the client there, only with shards
+    int shard;
+    uint64_t shard_key;
+    // node in clients tree (by shard key)
+    BAVLNode shard_tree_node;
+    
     // node in clients linked list
     LinkedList1Node list_node;
     // node in clients tree (by ID)
@@ -170,6 +181,7 @@ struct client_data {
     
     // output common
     PacketStreamSender output_sender;
+    PacketStreamCoalescer output_coalescer;
     PacketPassPriorityQueue output_priorityqueue;
     
     // output control flow
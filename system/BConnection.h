@@ -91,6 +91,8 @@ struct BListener_s;
  * Object which listens for connections on an address.
  * When a connection is ready, the {@link BListener_handler} handler is called, from which
  * the connection can be accepted into a new {@link BConnection} object.
+ * On Unix, all connections which are ready (up to BCONNECTION_ACCEPT_BATCH) are
+ * accepted at once, and then offered to the handler one by one from separate jobs.
  */
 typedef struct BListener_s BListener;
 
@@ -151,6 +153,21 @@ int BListener_InitUnix (BListener *o, const char *socket_path, BReactor *reactor
  */
 void BListener_Free (BListener *o);
 
+#ifndef BADVPN_USE_WINAPI
+/**
+ * Accepts a connection into a bare file descriptor, which may then be passed
+ * to a {@link BConnection} living in another reactor (e.g. with a
+ * BCONNECTION_SOURCE_PIPE 'source' argument).
+ * Must be called from the job closure of the {@link BListener_handler}, in place
+ * of {@link BConnection_Init}.
+ * 
+ * @param o the object
+ * @param out_addr if not NULL, the address of the client will be returned here
+ * @return the new file descriptor, owned by the caller, or -1 on failure
+ */
+int BListener_AcceptFd (BListener *o, BAddr *out_addr);
+#endif
+
 
 
 struct BConnector_s;
@@ -77,6 +77,9 @@ static void addr_socket_to_sys (struct sys_addr *out, BAddr addr);
 static void addr_sys_to_socket (BAddr *out, struct sys_addr addr);
 static void listener_fd_handler (BListener *o, int events);
 static void listener_default_job_handler (BListener *o);
+static void listener_next_job_handler (BListener *o);
+static void listener_offer (BListener *o);
+static int listener_take (BListener *o, BAddr *out_addr);
 static void connector_fd_handler (BConnector *o, int events);
 static void connector_job_handler (BConnector *o);
 static void connection_report_error (BConnection *o);
@@ -150,32 +153,102 @@ static void addr_sys_to_socket (BAddr *out, struct sys_addr addr)
 static void listener_fd_handler (BListener *o, int events)
 {
     DebugObject_Access(&o->d_obj);
+    ASSERT(o->accepted_count == 0)
+    ASSERT(!BPending_IsSet(&o->default_job))
+    ASSERT(!BPending_IsSet(&o->next_job))
+    
+    // accept everything that is ready, up to a batch, so that a burst of
+    // connections is handed out from jobs rather than one per reactor iteration
+    o->accepted_start = 0;
+    while (o->accepted_count < BCONNECTION_ACCEPT_BATCH) {
+        struct sys_addr sysaddr;
+        sysaddr.len = sizeof(sysaddr.addr);
+        int newfd = accept(o->fd, &sysaddr.addr.generic, &sysaddr.len);
+        if (newfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                BLog(BLOG_ERROR, "accept failed");
+            }
+            break;
+        }
+        
+        o->accepted_fds[o->accepted_count] = newfd;
+        addr_sys_to_socket(&o->accepted_addrs[o->accepted_count], sysaddr);
+        o->accepted_count++;
+    }
     
-    // set default job
-    BPending_Set(&o->default_job);
+    if (o->accepted_count == 0) {
+        return;
+    }
     
-    // call handler
-    o->handler(o->user);
+    listener_offer(o);
     return;
 }
 
 static void listener_default_job_handler (BListener *o)
 {
     DebugObject_Access(&o->d_obj);
+    ASSERT(o->accepted_count > 0)
     
     BLog(BLOG_ERROR, "discarding connection");
     
-    // accept
-    int newfd = accept(o->fd, NULL, NULL);
-    if (newfd < 0) {
-        BLog(BLOG_ERROR, "accept failed");
+    // close new fd
+    if (close(o->accepted_fds[o->accepted_start]) < 0) {
+        BLog(BLOG_ERROR, "close failed");
+    }
+    o->accepted_start++;
+    o->accepted_count--;
+    
+    // offer the next connection of the batch
+    if (o->accepted_count > 0) {
+        listener_offer(o);
         return;
     }
+}
+
+static void listener_next_job_handler (BListener *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->accepted_count > 0)
+    ASSERT(!BPending_IsSet(&o->default_job))
     
-    // close new fd
-    if (close(newfd) < 0) {
-        BLog(BLOG_ERROR, "close failed");
+    listener_offer(o);
+    return;
+}
+
+static void listener_offer (BListener *o)
+{
+    ASSERT(o->accepted_count > 0)
+    
+    // set default job
+    BPending_Set(&o->default_job);
+    
+    // call handler
+    o->handler(o->user);
+    return;
+}
+
+static int listener_take (BListener *o, BAddr *out_addr)
+{
+    ASSERT(BPending_IsSet(&o->default_job))
+    ASSERT(o->accepted_count > 0)
+    
+    // unset default job
+    BPending_Unset(&o->default_job);
+    
+    // take the connection
+    int fd = o->accepted_fds[o->accepted_start];
+    if (out_addr) {
+        *out_addr = o->accepted_addrs[o->accepted_start];
     }
+    o->accepted_start++;
+    o->accepted_count--;
+    
+    // offer the next connection of the batch
+    if (o->accepted_count > 0) {
+        BPending_Set(&o->next_job);
+    }
+    
+    return fd;
 }
 
 static void connector_fd_handler (BConnector *o, int events)
@@ -543,6 +616,13 @@ int BListener_InitFrom (BListener *o, struct BLisCon_from from,
     // init default job
     BPending_Init(&o->default_job, BReactor_PendingGroup(o->reactor), (BPending_handler)listener_default_job_handler, o);
     
+    // init next job
+    BPending_Init(&o->next_job, BReactor_PendingGroup(o->reactor), (BPending_handler)listener_next_job_handler, o);
+    
+    // no accepted connections yet
+    o->accepted_start = 0;
+    o->accepted_count = 0;
+    
     DebugObject_Init(&o->d_obj);
     return 1;
     
@@ -566,6 +646,16 @@ void BListener_Free (BListener *o)
 {
     DebugObject_Free(&o->d_obj);
     
+    // close connections which were accepted but not taken
+    for (int i = 0; i < o->accepted_count; i++) {
+        if (close(o->accepted_fds[o->accepted_start + i]) < 0) {
+            BLog(BLOG_ERROR, "close failed");
+        }
+    }
+    
+    // free next job
+    BPending_Free(&o->next_job);
+    
     // free default job
     BPending_Free(&o->default_job);
     
@@ -590,6 +680,14 @@ void BListener_Free (BListener *o)
     }
 }
 
+int BListener_AcceptFd (BListener *o, BAddr *out_addr)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(BPending_IsSet(&o->default_job))
+    
+    return listener_take(o, out_addr);
+}
+
 int BConnector_InitFrom (BConnector *o, struct BLisCon_from from, BReactor *reactor, void *user,
                          BConnector_handler handler)
 {
@@ -750,16 +848,8 @@ int BConnection_Init (BConnection *o, struct BConnection_source source, BReactor
         case BCONNECTION_SOURCE_TYPE_LISTENER: {
             BListener *listener = source.u.listener.listener;
             
-            // unset listener's default job
-            BPending_Unset(&listener->default_job);
-            
-            // accept
-            struct sys_addr sysaddr;
-            sysaddr.len = sizeof(sysaddr.addr);
-            if ((o->fd = accept(listener->fd, &sysaddr.addr.generic, &sysaddr.len)) < 0) {
-                BLog(BLOG_ERROR, "accept failed");
-                goto fail0;
-            }
+            // take accepted connection from listener
+            o->fd = listener_take(listener, source.u.listener.out_addr);
             o->close_fd = 1;
             
             // set non-blocking
@@ -767,11 +857,6 @@ int BConnection_Init (BConnection *o, struct BConnection_source source, BReactor
                 BLog(BLOG_ERROR, "badvpn_set_nonblocking failed");
                 goto fail1;
             }
-            
-            // return address
-            if (source.u.listener.out_addr) {
-                addr_sys_to_socket(source.u.listener.out_addr, sysaddr);
-            }
         } break;
         
         case BCONNECTION_SOURCE_TYPE_CONNECTOR: {
@@ -827,7 +912,6 @@ fail1:
             BLog(BLOG_ERROR, "close failed");
         }
     }
-fail0:
     return 0;
 }
 
@@ -33,6 +33,7 @@
 #define BCONNECTION_SEND_LIMIT 2
 #define BCONNECTION_RECV_LIMIT 2
 #define BCONNECTION_LISTEN_BACKLOG 128
+#define BCONNECTION_ACCEPT_BATCH 16
 
 struct BListener_s {
     BReactor *reactor;
@@ -42,6 +43,11 @@ struct BListener_s {
     int fd;
     BFileDescriptor bfd;
     BPending default_job;
+    BPending next_job;
+    int accepted_fds[BCONNECTION_ACCEPT_BATCH];
+    BAddr accepted_addrs[BCONNECTION_ACCEPT_BATCH];
+    int accepted_start;
+    int accepted_count;
     DebugObject d_obj;
 };
 
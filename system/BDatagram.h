@@ -166,6 +166,17 @@ int BDatagram_GetFd (BDatagram *o);
  */
 int BDatagram_SetReuseAddr (BDatagram *o, int reuse);
 
+/**
+ * Sets the SO_BUSY_POLL option for the underlying socket, making blocking
+ * receives busy poll the device queue for up to the given time.
+ * This is only supported on Linux; elsewhere this fails.
+ * 
+ * @param o the object
+ * @param usecs busy poll time in microseconds. Must be >=0; 0 disables.
+ * @return 1 on success, 0 on failure
+ */
+int BDatagram_SetBusyPoll (BDatagram *o, int usecs);
+
 /**
  * Initializes the send interface.
  * The send interface must not be initialized.
@@ -777,6 +777,24 @@ int BDatagram_SetReuseAddr (BDatagram *o, int reuse)
     return 1;
 }
 
+int BDatagram_SetBusyPoll (BDatagram *o, int usecs)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(usecs >= 0)
+    
+#ifdef SO_BUSY_POLL
+    if (setsockopt(o->fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0) {
+        BLog(BLOG_ERROR, "setsockopt(SO_BUSY_POLL) failed");
+        return 0;
+    }
+    
+    return 1;
+#else
+    BLog(BLOG_ERROR, "SO_BUSY_POLL is not supported");
+    return 0;
+#endif
+}
+
 void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
 {
     DebugObject_Access(&o->d_obj);
@@ -672,6 +672,15 @@ int BDatagram_SetReuseAddr (BDatagram *o, int reuse)
     return 1;
 }
 
+int BDatagram_SetBusyPoll (BDatagram *o, int usecs)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(usecs >= 0)
+    
+    BLog(BLOG_ERROR, "SO_BUSY_POLL is not supported");
+    return 0;
+}
+
 void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
 {
     DebugObject_Access(&o->d_obj);
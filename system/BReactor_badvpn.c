@@ -39,6 +39,8 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
+#include <sched.h>
 #endif
 
 #include <misc/debug.h>
@@ -184,6 +186,62 @@ static void set_epoll_fd_pointers (BReactor *bsys)
     }
 }
 
+static int64_t get_spin_clock (void)
+{
+    struct timespec ts;
+    ASSERT_FORCE(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return ((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void got_epoll_results (BReactor *bsys, int num)
+{
+    ASSERT(num > 0)
+    ASSERT(num <= BSYSTEM_MAX_RESULTS)
+    
+    bsys->epoll_results_num = num;
+    set_epoll_fd_pointers(bsys);
+    
+    // keep spinning for a while after this activity
+    if (bsys->spin_ns > 0) {
+        bsys->spin_deadline = get_spin_clock() + bsys->spin_ns;
+    }
+}
+
+static int spin_for_events (BReactor *bsys, int have_timeout, btime_t timeout_abs)
+{
+    ASSERT(bsys->spin_ns > 0)
+    
+    while (get_spin_clock() < bsys->spin_deadline) {
+        int waitres = epoll_wait(bsys->efd, bsys->epoll_results, BSYSTEM_MAX_RESULTS, 0);
+        if (waitres < 0) {
+            int error = errno;
+            if (error == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            ASSERT_FORCE(0)
+        }
+        
+        if (waitres > 0) {
+            BLog(BLOG_DEBUG, "epoll_wait returned %d file descriptors while spinning", waitres);
+            got_epoll_results(bsys, waitres);
+            return 1;
+        }
+        
+        if (have_timeout && btime_gettime() >= timeout_abs) {
+            BLog(BLOG_DEBUG, "timed out while spinning");
+            move_first_timers(bsys);
+            return 1;
+        }
+        
+        // let other runnable threads use the CPU, in particular whoever is
+        // about to send us something if we share a core
+        sched_yield();
+    }
+    
+    return 0;
+}
+
 #endif
 
 #ifdef BADVPN_USE_KEVENT
@@ -270,6 +328,17 @@ static void set_poll_fd_pointers (BReactor *bsys)
 
 #endif
 
+static void reset_limits (BReactor *bsys)
+{
+    LinkedList1Node *list_node;
+    while (list_node = LinkedList1_GetFirst(&bsys->active_limits_list)) {
+        BReactorLimit *limit = UPPER_OBJECT(list_node, BReactorLimit, active_limits_list_node);
+        ASSERT(limit->count > 0)
+        limit->count = 0;
+        LinkedList1_Remove(&bsys->active_limits_list, &limit->active_limits_list_node);
+    }
+}
+
 static void wait_for_events (BReactor *bsys)
 {
     // must have processed all pending events
@@ -330,6 +399,27 @@ static void wait_for_events (BReactor *bsys)
         timeout_abs = first_timer->absTime;
     }
     
+    #ifdef BADVPN_USE_EPOLL
+    
+    // poll without blocking if there has been activity recently
+    if (bsys->spin_ns > 0 && spin_for_events(bsys, have_timeout, timeout_abs)) {
+        reset_limits(bsys);
+        return;
+    }
+    
+    // the spin may have taken a while, refresh the time before blocking
+    if (bsys->spin_ns > 0 && have_timeout) {
+        now = btime_gettime();
+        
+        if (move_expired_timers(bsys, now)) {
+            BLog(BLOG_DEBUG, "Got expired timers after spinning");
+            reset_limits(bsys);
+            return;
+        }
+    }
+    
+    #endif
+    
     // wait until the timeout is reached or the file descriptor / handle in ready
     while (1) {
         // compute timeout
@@ -402,8 +492,7 @@ static void wait_for_events (BReactor *bsys)
         if (waitres != 0 || timeout_rel_trunc == timeout_rel) {
             if (waitres != 0) {
                 BLog(BLOG_DEBUG, "epoll_wait returned %d file descriptors", waitres);
-                bsys->epoll_results_num = waitres;
-                set_epoll_fd_pointers(bsys);
+                got_epoll_results(bsys, waitres);
             } else {
                 BLog(BLOG_DEBUG, "epoll_wait timed out");
                 move_first_timers(bsys);
@@ -540,13 +629,7 @@ static void wait_for_events (BReactor *bsys)
     }
     
     // reset limit objects
-    LinkedList1Node *list_node;
-    while (list_node = LinkedList1_GetFirst(&bsys->active_limits_list)) {
-        BReactorLimit *limit = UPPER_OBJECT(list_node, BReactorLimit, active_limits_list_node);
-        ASSERT(limit->count > 0)
-        limit->count = 0;
-        LinkedList1_Remove(&bsys->active_limits_list, &limit->active_limits_list_node);
-    }
+    reset_limits(bsys);
 }
 
 #ifndef BADVPN_USE_WINAPI
@@ -599,6 +682,9 @@ int BReactor_Init (BReactor *bsys)
     // init jobs
     BPendingGroup_Init(&bsys->pending_jobs);
     
+    // init statistics
+    memset(&bsys->stats, 0, sizeof(bsys->stats));
+    
     // init timers
     BReactor__TimersTree_Init(&bsys->timers_tree);
     LinkedList1_Init(&bsys->timers_expired_list);
@@ -634,6 +720,10 @@ int BReactor_Init (BReactor *bsys)
     bsys->epoll_results_num = 0;
     bsys->epoll_results_pos = 0;
     
+    // spinning is disabled by default
+    bsys->spin_ns = 0;
+    bsys->spin_deadline = 0;
+    
     #endif
     
     #ifdef BADVPN_USE_KEVENT
@@ -764,14 +854,32 @@ void BReactor_Free (BReactor *bsys)
     BPendingGroup_Free(&bsys->pending_jobs);
 }
 
+static void account_batch_time (BReactor *bsys, int64_t ns)
+{
+    bsys->stats.num_timed_batches++;
+    bsys->stats.job_batch_ns += ns;
+    if (ns > bsys->stats.max_job_batch_ns) {
+        bsys->stats.max_job_batch_ns = ns;
+    }
+}
+
 int BReactor_Exec (BReactor *bsys)
 {
     BLog(BLOG_DEBUG, "Entering event loop");
     
     while (!bsys->exiting) {
-        // dispatch job
+        // dispatch a batch of jobs; all jobs run before any timer or file
+        // descriptor event, batching only avoids going around the loop
         if (BPendingGroup_HasJobs(&bsys->pending_jobs)) {
-            BPendingGroup_ExecuteJob(&bsys->pending_jobs);
+            // time a sample of the batches
+            if (bsys->stats.num_job_batches % BREACTOR_BATCH_TIMING_INTERVAL == 0) {
+                int64_t batch_start = btime_gettime_ns();
+                bsys->stats.num_jobs += BPendingGroup_ExecuteJobs(&bsys->pending_jobs, BREACTOR_JOB_BATCH_SIZE, &bsys->exiting);
+                account_batch_time(bsys, btime_gettime_ns() - batch_start);
+            } else {
+                bsys->stats.num_jobs += BPendingGroup_ExecuteJobs(&bsys->pending_jobs, BREACTOR_JOB_BATCH_SIZE, &bsys->exiting);
+            }
+            bsys->stats.num_job_batches++;
             continue;
         }
         
@@ -982,6 +1090,7 @@ int BReactor_Exec (BReactor *bsys)
         
         #endif
         
+        bsys->stats.num_waits++;
         wait_for_events(bsys);
     }
 
@@ -996,6 +1105,24 @@ void BReactor_Quit (BReactor *bsys, int code)
     bsys->exit_code = code;
 }
 
+void BReactor_GetStats (BReactor *bsys, BReactorStats *out_stats)
+{
+    DebugObject_Access(&bsys->d_obj);
+    
+    *out_stats = bsys->stats;
+}
+
+void BReactor_SetSpinTime (BReactor *bsys, int spin_us)
+{
+    DebugObject_Access(&bsys->d_obj);
+    ASSERT(spin_us >= 0)
+    
+    #ifdef BADVPN_USE_EPOLL
+    bsys->spin_ns = (int64_t)spin_us * 1000;
+    bsys->spin_deadline = 0;
+    #endif
+}
+
 void BReactor_SetSmallTimer (BReactor *bsys, BSmallTimer *bt, int mode, btime_t time)
 {
     assert_timer(bt);
@@ -230,6 +230,23 @@ void BFileDescriptor_Init (BFileDescriptor *bs, int fd, BFileDescriptor_handler
 #define BSYSTEM_MAX_RESULTS 64
 #define BSYSTEM_MAX_HANDLES 64
 #define BSYSTEM_MAX_POLL_FDS 4096
+#define BREACTOR_JOB_BATCH_SIZE 64
+#define BREACTOR_BATCH_TIMING_INTERVAL 64
+
+/**
+ * Event loop statistics, see {@link BReactor_GetStats}.
+ * Reading the clock costs about as much as a short job batch, so only one in
+ * BREACTOR_BATCH_TIMING_INTERVAL batches is timed; the average batch latency
+ * is job_batch_ns / num_timed_batches.
+ */
+typedef struct {
+    uint64_t num_jobs; // jobs executed
+    uint64_t num_job_batches; // batches the jobs were executed in
+    uint64_t num_waits; // times the reactor checked for new events
+    uint64_t num_timed_batches; // job batches whose wall time was measured (a sample)
+    int64_t job_batch_ns; // total wall time of the timed batches
+    int64_t max_job_batch_ns; // longest timed batch
+} BReactorStats;
 
 /**
  * Event loop that supports file desciptor (Linux) or HANDLE (Windows) events
@@ -242,6 +259,9 @@ typedef struct {
     // jobs
     BPendingGroup pending_jobs;
     
+    // statistics
+    BReactorStats stats;
+    
     // timers
     BReactor__TimersTree timers_tree;
     LinkedList1 timers_expired_list;
@@ -260,6 +280,8 @@ typedef struct {
     struct epoll_event epoll_results[BSYSTEM_MAX_RESULTS]; // epoll returned events buffer
     int epoll_results_num; // number of events in the array
     int epoll_results_pos; // number of events processed so far
+    int64_t spin_ns; // how long to poll without blocking after activity, 0 to disable
+    int64_t spin_deadline; // monotonic time in ns until which to keep polling
     #endif
     
     #ifdef BADVPN_USE_KEVENT
@@ -333,6 +355,28 @@ int BReactor_Exec (BReactor *bsys);
  */
 void BReactor_Quit (BReactor *bsys, int code);
 
+/**
+ * Configures adaptive spinning of the event loop.
+ * After file descriptor events have been received, the event loop will poll
+ * for new events without blocking for up to the given amount of time before
+ * going to sleep. This trades CPU time for lower wakeup latency when traffic
+ * is frequent. Spinning is only implemented with epoll; with other backends
+ * this has no effect.
+ *
+ * @param bsys the object
+ * @param spin_us spin time in microseconds. Must be >=0; 0 disables spinning
+ *                (the default).
+ */
+void BReactor_SetSpinTime (BReactor *bsys, int spin_us);
+
+/**
+ * Returns event loop statistics accumulated since the reactor was initialized.
+ *
+ * @param bsys the object
+ * @param out_stats where to store the statistics
+ */
+void BReactor_GetStats (BReactor *bsys, BReactorStats *out_stats);
+
 /**
  * Starts a timer to expire at the specified time.
  * The timer must have been initialized with {@link BSmallTimer_Init}.
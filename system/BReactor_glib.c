@@ -53,7 +53,21 @@ static void assert_timer (BSmallTimer *bt)
 static void dispatch_pending (BReactor *o)
 {
     while (!o->exiting && BPendingGroup_HasJobs(&o->pending_jobs)) {
-        BPendingGroup_ExecuteJob(&o->pending_jobs);
+        // time a sample of the batches
+        if (o->stats.num_job_batches % BREACTOR_BATCH_TIMING_INTERVAL == 0) {
+            int64_t batch_start = btime_gettime_ns();
+            o->stats.num_jobs += BPendingGroup_ExecuteJobs(&o->pending_jobs, BREACTOR_JOB_BATCH_SIZE, &o->exiting);
+            int64_t ns = btime_gettime_ns() - batch_start;
+            
+            o->stats.num_timed_batches++;
+            o->stats.job_batch_ns += ns;
+            if (ns > o->stats.max_job_batch_ns) {
+                o->stats.max_job_batch_ns = ns;
+            }
+        } else {
+            o->stats.num_jobs += BPendingGroup_ExecuteJobs(&o->pending_jobs, BREACTOR_JOB_BATCH_SIZE, &o->exiting);
+        }
+        o->stats.num_job_batches++;
     }
 }
 
@@ -132,6 +146,7 @@ static gboolean timer_source_handler (gpointer data)
         bt->handler.heavy(btimer->user);
     }
     
+    reactor->stats.num_waits++;
     dispatch_pending(reactor);
     reset_limits(reactor);
     
@@ -173,6 +188,7 @@ static gboolean fd_source_func_dispatch (GSource *source, GSourceFunc callback,
         return TRUE;
     }
     
+    reactor->stats.num_waits++;
     bfd->handler(bfd->user, events);
     dispatch_pending(reactor);
     reset_limits(reactor);
@@ -272,6 +288,21 @@ void BReactor_Quit (BReactor *bsys, int code)
     g_main_loop_quit(bsys->gloop);
 }
 
+void BReactor_SetSpinTime (BReactor *bsys, int spin_us)
+{
+    DebugObject_Access(&bsys->d_obj);
+    ASSERT(spin_us >= 0)
+    
+    // not supported with glib
+}
+
+void BReactor_GetStats (BReactor *bsys, BReactorStats *out_stats)
+{
+    DebugObject_Access(&bsys->d_obj);
+    
+    *out_stats = bsys->stats;
+}
+
 void BReactor_SetSmallTimer (BReactor *bsys, BSmallTimer *bt, int mode, btime_t time)
 {
     DebugObject_Access(&bsys->d_obj);
@@ -439,6 +470,9 @@ int BReactor_InitFromExistingGMainLoop (BReactor *bsys, GMainLoop *gloop, int un
     // init job queue
     BPendingGroup_Init(&bsys->pending_jobs);
     
+    // init statistics
+    memset(&bsys->stats, 0, sizeof(bsys->stats));
+    
     // init active limits list
     LinkedList1_Init(&bsys->active_limits_list);
     
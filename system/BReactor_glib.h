@@ -42,8 +42,26 @@
 #include <base/BPending.h>
 #include <system/BTime.h>
 
+#define BREACTOR_JOB_BATCH_SIZE 64
+#define BREACTOR_BATCH_TIMING_INTERVAL 64
+
 typedef struct BReactor_s BReactor;
 
+/**
+ * Event loop statistics, see {@link BReactor_GetStats}.
+ * Only one in BREACTOR_BATCH_TIMING_INTERVAL job batches is timed.
+ * With glib, num_waits only counts the times glib dispatched one of our
+ * timers or file descriptors, not every poll.
+ */
+typedef struct {
+    uint64_t num_jobs; // jobs executed
+    uint64_t num_job_batches; // batches the jobs were executed in
+    uint64_t num_waits; // times the reactor checked for new events
+    uint64_t num_timed_batches; // job batches whose wall time was measured (a sample)
+    int64_t job_batch_ns; // total wall time of the timed batches
+    int64_t max_job_batch_ns; // longest timed batch
+} BReactorStats;
+
 struct BSmallTimer_t;
 
 #define BTIMER_SET_ABSOLUTE 1
@@ -104,6 +122,7 @@ struct BReactor_s {
     int unref_gloop_on_free;
     GSourceFuncs fd_source_funcs;
     BPendingGroup pending_jobs;
+    BReactorStats stats;
     LinkedList1 active_limits_list;
     
     DebugCounter d_fds_counter;
@@ -116,6 +135,8 @@ int BReactor_Init (BReactor *bsys) WARN_UNUSED;
 void BReactor_Free (BReactor *bsys);
 int BReactor_Exec (BReactor *bsys);
 void BReactor_Quit (BReactor *bsys, int code);
+void BReactor_SetSpinTime (BReactor *bsys, int spin_us);
+void BReactor_GetStats (BReactor *bsys, BReactorStats *out_stats);
 void BReactor_SetSmallTimer (BReactor *bsys, BSmallTimer *bt, int mode, btime_t time);
 void BReactor_RemoveSmallTimer (BReactor *bsys, BSmallTimer *bt);
 void BReactor_SetTimer (BReactor *bsys, BTimer *bt);
@@ -137,6 +137,34 @@ static btime_t btime_gettime (void)
     #endif
 }
 
+/**
+ * Returns a monotonic time in nanoseconds, relative to an unspecified origin.
+ * Intended for measuring short intervals; unlike {@link btime_gettime}, this
+ * does not require {@link BTime_Init}.
+ */
+static int64_t btime_gettime_ns (void)
+{
+    #if defined(BADVPN_USE_WINAPI)
+    
+    LARGE_INTEGER count;
+    LARGE_INTEGER freq;
+    ASSERT_FORCE(QueryPerformanceCounter(&count))
+    ASSERT_FORCE(QueryPerformanceFrequency(&freq))
+    return (int64_t)((double)count.QuadPart * 1e9 / freq.QuadPart);
+    
+    #elif defined(BADVPN_EMSCRIPTEN)
+    
+    return (int64_t)(emscripten_get_now() * 1e6);
+    
+    #else
+    
+    struct timespec ts;
+    ASSERT_FORCE(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    
+    #endif
+}
+
 static btime_t btime_add (btime_t t1, btime_t t2)
 {
     // handle overflow
@@ -1,11 +1,17 @@
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
 
 #include <misc/debug.h>
 #include <base/BLog.h>
 #include <base/DebugObject.h>
+#include <system/BTime.h>
 #include <threadwork/BThreadWork.h>
 
+#define BENCH_WINDOW 256
+#define BENCH_WORK_LOOPS 64
+
 BReactor reactor;
 BThreadWorkDispatcher twd;
 BThreadWork tw1;
@@ -45,8 +51,142 @@ static void dummy_works (int n)
     }
 }
 
-int main ()
+struct bench_work {
+    BThreadWork tw;
+    uint32_t in;
+    uint32_t out;
+};
+
+struct bench_work bench_works[BENCH_WINDOW];
+int bench_num_works;
+int bench_started;
+int bench_done;
+
+static uint32_t bench_compute (uint32_t x)
+{
+    for (int i = 0; i < BENCH_WORK_LOOPS; i++) {
+        x = x * 1103515245 + 12345;
+    }
+    
+    return x;
+}
+
+static void bench_work_func (struct bench_work *bw)
+{
+    bw->out = bench_compute(bw->in);
+}
+
+static void bench_handler_done (struct bench_work *bw);
+
+static void bench_start (struct bench_work *bw)
+{
+    bw->in = bench_started++;
+    BThreadWork_Init(&bw->tw, &twd, (BThreadWork_handler_done)bench_handler_done, bw, (BThreadWork_work_func)bench_work_func, bw);
+}
+
+static void bench_handler_done (struct bench_work *bw)
+{
+    ASSERT_FORCE(bw->out == bench_compute(bw->in))
+    
+    BThreadWork_Free(&bw->tw);
+    bench_done++;
+    
+    if (bench_done == bench_num_works) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    // keep the window full
+    if (bench_started < bench_num_works) {
+        bench_start(bw);
+    }
+}
+
+static int bench (int threads, int num_works, int queue_size, int pin)
+{
+    int ret = 1;
+    
+    struct BThreadWorkDispatcher_params params;
+    params.num_threads = threads;
+    params.queue_size = queue_size;
+    params.pin_threads = pin;
+    
+    if (!BThreadWorkDispatcher_Init2(&twd, &reactor, params)) {
+        DEBUG("BThreadWorkDispatcher_Init2 failed");
+        return 1;
+    }
+    
+    int window = (num_works < BENCH_WINDOW ? num_works : BENCH_WINDOW);
+    bench_num_works = num_works;
+    bench_started = 0;
+    bench_done = 0;
+    
+    btime_t start = btime_gettime();
+    
+    for (int i = 0; i < window; i++) {
+        bench_start(&bench_works[i]);
+    }
+    
+    if (window > 0) {
+        BReactor_Exec(&reactor);
+    }
+    
+    btime_t elapsed = btime_gettime() - start;
+    
+    if (bench_done != num_works) {
+        printf("only %d of %d works done\n", bench_done, num_works);
+        goto out;
+    }
+    
+    // start and immediately cancel a window of works
+    for (int i = 0; i < window; i++) {
+        bench_start(&bench_works[i]);
+    }
+    for (int i = 0; i < window; i++) {
+        BThreadWork_Free(&bench_works[i].tw);
+    }
+    
+    printf("threads=%d works=%d time=%" PRIi64 "ms rate=%.0f works/s\n", threads, num_works, (int64_t)elapsed,
+           (elapsed > 0 ? (double)num_works * 1000 / elapsed : 0.0));
+    
+    ret = 0;
+    
+out:
+    BThreadWorkDispatcher_Free(&twd);
+    return ret;
+}
+
+int main (int argc, char *argv[])
 {
+    if (argc > 1) {
+        if (argc < 3 || argc > 5) {
+            printf("Usage: %s [<threads> <num_works> [queue_size] [pin]]\n", argv[0]);
+            return 1;
+        }
+        
+        int threads = atoi(argv[1]);
+        int num_works = atoi(argv[2]);
+        int queue_size = (argc > 3 ? atoi(argv[3]) : 0);
+        int pin = (argc > 4 ? atoi(argv[4]) : 0);
+        
+        BLog_InitStdout();
+        
+        BTime_Init();
+        
+        if (!BReactor_Init(&reactor)) {
+            DEBUG("BReactor_Init failed");
+            BLog_Free();
+            return 1;
+        }
+        
+        int ret = bench(threads, num_works, queue_size, pin);
+        
+        BReactor_Free(&reactor);
+        BLog_Free();
+        DebugObjectGlobal_Finish();
+        return ret;
+    }
+    
     BLog_InitStdout();
     BLog_SetChannelLoglevel(BLOG_CHANNEL_BThreadWork, BLOG_DEBUG);
     
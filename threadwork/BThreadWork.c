@@ -27,123 +27,297 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdint.h>
 #include <stddef.h>
+#include <limits.h>
 
 #ifdef BADVPN_THREADWORK_USE_PTHREAD
     #include <unistd.h>
     #include <errno.h>
     #include <fcntl.h>
+    #include <sched.h>
+    #include <signal.h>
+    #ifdef BADVPN_LINUX
+        #include <sys/eventfd.h>
+    #endif
 #endif
 
-#include <misc/offset.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
 #include <generated/blog_channel_BThreadWork.h>
 
 #include <threadwork/BThreadWork.h>
 
+#define WORK_SLOT_FORGOTTEN -1
+#define WORK_SLOT_INLINE -2
+
 #ifdef BADVPN_THREADWORK_USE_PTHREAD
 
-static void * dispatcher_thread (struct BThreadWorkDispatcher_thread *t)
+// Bounded queue of slot indices (D. Vyukov's MPMC queue). Every slot is in at most
+// one queue at a time and the queues are as large as the slot table, so pushing
+// never fails.
+
+static int ring_init (struct BThreadWorkDispatcher_ring *r, int size)
 {
-    BThreadWorkDispatcher *o = t->d;
+    if (!(r->cells = (struct BThreadWorkDispatcher_cell *)BAllocArray(size, sizeof(r->cells[0])))) {
+        return 0;
+    }
     
-    ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
+    for (int i = 0; i < size; i++) {
+        r->cells[i].seq = i;
+    }
+    
+    r->mask = size - 1;
+    r->enqueue_pos = 0;
+    r->dequeue_pos = 0;
+    
+    return 1;
+}
+
+static void ring_free (struct BThreadWorkDispatcher_ring *r)
+{
+    BFree(r->cells);
+}
+
+static void ring_push (struct BThreadWorkDispatcher_ring *r, int slot)
+{
+    size_t pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+    struct BThreadWorkDispatcher_cell *cell;
     
     while (1) {
-        // exit if requested
-        if (o->cancel) {
-            break;
+        cell = &r->cells[pos & r->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        ASSERT_FORCE(dif >= 0)
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else {
+            pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
         }
-        
-        if (LinkedList1_IsEmpty(&o->pending_list)) {
-            // wait for event
-            ASSERT_FORCE(pthread_cond_wait(&t->new_cond, &o->mutex) == 0)
-            continue;
+    }
+    
+    cell->slot = slot;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static int ring_pop (struct BThreadWorkDispatcher_ring *r, int *out_slot)
+{
+    size_t pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+    struct BThreadWorkDispatcher_cell *cell;
+    
+    while (1) {
+        cell = &r->cells[pos & r->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif < 0) {
+            return 0;
         }
-        
-        // grab the work
-        BThreadWork *w = UPPER_OBJECT(LinkedList1_GetFirst(&o->pending_list), BThreadWork, list_node);
-        ASSERT(w->state == BTHREADWORK_STATE_PENDING)
-        LinkedList1_Remove(&o->pending_list, &w->list_node);
-        t->running_work = w;
-        w->state = BTHREADWORK_STATE_RUNNING;
-        
-        // do the work
-        ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
-        w->work_func(w->work_func_user);
-        ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
-        
-        // release the work
-        t->running_work = NULL;
-        LinkedList1_Append(&o->finished_list, &w->list_node);
-        w->state = BTHREADWORK_STATE_FINISHED;
-        ASSERT_FORCE(sem_post(&w->finished_sem) == 0)
-        
-        // write to pipe
-        uint8_t b = 0;
-        int res = write(o->pipe[1], &b, sizeof(b));
-        if (res < 0) {
-            int error = errno;
-            ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else {
+            pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
         }
     }
     
-    ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
+    *out_slot = cell->slot;
+    __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
     
-    return NULL;
+    return 1;
 }
 
-static void dispatch_job (BThreadWorkDispatcher *o)
+static int ring_is_empty (struct BThreadWorkDispatcher_ring *r)
 {
-    ASSERT(o->num_threads > 0)
+    size_t pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+    size_t seq = __atomic_load_n(&r->cells[pos & r->mask].seq, __ATOMIC_ACQUIRE);
     
-    // lock
+    return ((intptr_t)seq - (intptr_t)(pos + 1) < 0);
+}
+
+static void wake_thread (BThreadWorkDispatcher *o)
+{
+    // Only one wakeup is in flight at a time; the woken thread clears the flag
+    // and wakes the next one if there is more work.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&o->num_idle, __ATOMIC_SEQ_CST) == 0 || __atomic_exchange_n(&o->waking, 1, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    
+    ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
+    
+    // idle threads only release the mutex while waiting
+    if (o->num_idle > 0) {
+        ASSERT_FORCE(pthread_cond_signal(&o->new_cond) == 0)
+    } else {
+        __atomic_store_n(&o->waking, 0, __ATOMIC_SEQ_CST);
+    }
+    
+    ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
+}
+
+static int wait_for_work (BThreadWorkDispatcher *o, int *out_slot)
+{
     ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
     
-    // check for finished job
-    if (LinkedList1_IsEmpty(&o->finished_list)) {
-        ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
+    while (1) {
+        // exit if requested
+        if (o->cancel) {
+            ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
+            return 0;
+        }
+        
+        // announce that we're going to sleep, then check the queue again,
+        // so that a concurrent BThreadWork_Init either sees us or we see its work
+        __atomic_add_fetch(&o->num_idle, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        
+        int have = ring_pop(&o->pending_ring, out_slot);
+        if (!have) {
+            ASSERT_FORCE(pthread_cond_wait(&o->new_cond, &o->mutex) == 0)
+            
+            // allow the next wakeup
+            __atomic_store_n(&o->waking, 0, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            
+            have = ring_pop(&o->pending_ring, out_slot);
+        }
+        
+        __atomic_sub_fetch(&o->num_idle, 1, __ATOMIC_SEQ_CST);
+        
+        if (have) {
+            ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
+            
+            // pass on the wakeup if there is more work
+            if (!ring_is_empty(&o->pending_ring)) {
+                wake_thread(o);
+            }
+            
+            return 1;
+        }
+    }
+}
+
+static void notify_finished (BThreadWorkDispatcher *o)
+{
+    // only the first work finishing since the event loop last looked writes
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&o->notified, 1, __ATOMIC_SEQ_CST)) {
         return;
     }
     
-    // grab finished job
-    BThreadWork *w = UPPER_OBJECT(LinkedList1_GetFirst(&o->finished_list), BThreadWork, list_node);
-    ASSERT(w->state == BTHREADWORK_STATE_FINISHED)
-    LinkedList1_Remove(&o->finished_list, &w->list_node);
+    #ifdef BADVPN_LINUX
+    uint64_t v = 1;
+    #else
+    uint8_t v = 0;
+    #endif
+    int res = write(o->notify_fds[1], &v, sizeof(v));
+    if (res < 0) {
+        int error = errno;
+        ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
+    }
+}
+
+static void * dispatcher_thread (struct BThreadWorkDispatcher_thread *t)
+{
+    BThreadWorkDispatcher *o = t->d;
     
-    // schedule more
-    if (!LinkedList1_IsEmpty(&o->finished_list)) {
-        BPending_Set(&o->more_job);
+    while (1) {
+        // grab a work, or wait for one
+        int idx;
+        if (!ring_pop(&o->pending_ring, &idx) && !wait_for_work(o, &idx)) {
+            break;
+        }
+        
+        struct BThreadWorkDispatcher_slot *s = &o->slots[idx];
+        
+        // claim the work, unless it was cancelled
+        int expected = BTHREADWORK_STATE_PENDING;
+        if (__atomic_compare_exchange_n(&s->state, &expected, BTHREADWORK_STATE_RUNNING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            BThreadWork *w = s->work;
+            
+            // do the work
+            w->work_func(w->work_func_user);
+            
+            // Release a BThreadWork_Free waiting for us. After this the work
+            // may be gone, so only the slot is used from here on.
+            ASSERT_FORCE(sem_post(&w->finished_sem) == 0)
+            __atomic_store_n(&s->state, BTHREADWORK_STATE_FINISHED, __ATOMIC_RELEASE);
+        }
+        
+        // give the slot back to the event loop (also cancelled ones, for reuse)
+        ring_push(&o->finished_ring, idx);
+        notify_finished(o);
     }
     
-    // set state forgotten
-    w->state = BTHREADWORK_STATE_FORGOTTEN;
+    return NULL;
+}
+
+static void release_slot (BThreadWorkDispatcher *o, int idx)
+{
+    struct BThreadWorkDispatcher_slot *s = &o->slots[idx];
     
-    // unlock
-    ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
+    s->work = NULL;
+    s->next_free = o->free_slot;
+    o->free_slot = idx;
+}
+
+static void dispatch_job (BThreadWorkDispatcher *o)
+{
+    ASSERT(o->num_threads > 0)
     
-    // call handler
-    w->handler_done(w->user);
-    return;
+    int idx;
+    while (ring_pop(&o->finished_ring, &idx)) {
+        struct BThreadWorkDispatcher_slot *s = &o->slots[idx];
+        
+        // slot of a freed work, just reuse it
+        if (s->detached) {
+            release_slot(o, idx);
+            continue;
+        }
+        
+        ASSERT(__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) == BTHREADWORK_STATE_FINISHED)
+        
+        BThreadWork *w = s->work;
+        ASSERT(w->slot == idx)
+        
+        // forget the work
+        w->slot = WORK_SLOT_FORGOTTEN;
+        release_slot(o, idx);
+        
+        // schedule more
+        BPending_Set(&o->more_job);
+        
+        // call handler
+        w->handler_done(w->user);
+        return;
+    }
 }
 
-static void pipe_fd_handler (BThreadWorkDispatcher *o, int events)
+static void notify_fd_handler (BThreadWorkDispatcher *o, int events)
 {
     ASSERT(o->num_threads > 0)
     DebugObject_Access(&o->d_obj);
     
-    // read data from pipe
+    // read the notification
     uint8_t b[64];
-    int res = read(o->pipe[0], b, sizeof(b));
+    int res = read(o->notify_fds[0], b, sizeof(b));
     if (res < 0) {
         int error = errno;
         ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
-    } else {
-        ASSERT(res > 0)
     }
     
+    // allow threads to notify us again, then look at what they finished
+    __atomic_store_n(&o->notified, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
     dispatch_job(o);
     return;
 }
@@ -159,34 +333,77 @@ static void more_job_handler (BThreadWorkDispatcher *o)
 
 static void stop_threads (BThreadWorkDispatcher *o)
 {
-    // set cancelling
+    // set cancelling, wake up sleeping threads
     ASSERT_FORCE(pthread_mutex_lock(&o->mutex) == 0)
     o->cancel = 1;
+    ASSERT_FORCE(pthread_cond_broadcast(&o->new_cond) == 0)
     ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
     
     while (o->num_threads > 0) {
-        struct BThreadWorkDispatcher_thread *t = &o->threads[o->num_threads - 1];
-        
-        // wake up thread
-        ASSERT_FORCE(pthread_cond_signal(&t->new_cond) == 0)
-        
         // wait for thread to exit
-        ASSERT_FORCE(pthread_join(t->thread, NULL) == 0)
-        
-        // free condition variable
-        ASSERT_FORCE(pthread_cond_destroy(&t->new_cond) == 0)
+        ASSERT_FORCE(pthread_join(o->threads[o->num_threads - 1].thread, NULL) == 0)
         
         o->num_threads--;
     }
 }
 
+static int init_notify_fds (BThreadWorkDispatcher *o)
+{
+    #ifdef BADVPN_LINUX
+    
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        BLog(BLOG_ERROR, "eventfd failed");
+        return 0;
+    }
+    o->notify_fds[0] = fd;
+    o->notify_fds[1] = fd;
+    
+    #else
+    
+    if (pipe(o->notify_fds) < 0) {
+        BLog(BLOG_ERROR, "pipe failed");
+        return 0;
+    }
+    
+    if (fcntl(o->notify_fds[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(o->notify_fds[1], F_SETFL, O_NONBLOCK) < 0) {
+        BLog(BLOG_ERROR, "fcntl failed");
+        ASSERT_FORCE(close(o->notify_fds[0]) == 0)
+        ASSERT_FORCE(close(o->notify_fds[1]) == 0)
+        return 0;
+    }
+    
+    #endif
+    
+    return 1;
+}
+
+static void free_notify_fds (BThreadWorkDispatcher *o)
+{
+    ASSERT_FORCE(close(o->notify_fds[0]) == 0)
+    if (o->notify_fds[1] != o->notify_fds[0]) {
+        ASSERT_FORCE(close(o->notify_fds[1]) == 0)
+    }
+}
+
+static void pin_thread (struct BThreadWorkDispatcher_thread *t)
+{
+    #ifdef BADVPN_LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(t->cpu, &set);
+    if (pthread_setaffinity_np(t->thread, sizeof(set), &set) != 0) {
+        BLog(BLOG_WARNING, "failed to pin thread to CPU %d", t->cpu);
+    }
+    #else
+    BLog(BLOG_WARNING, "pinning threads is not supported");
+    #endif
+}
+
 #endif
 
 static void work_job_handler (BThreadWork *o)
 {
-    #ifdef BADVPN_THREADWORK_USE_PTHREAD
-    ASSERT(o->d->num_threads == 0)
-    #endif
     DebugObject_Access(&o->d_obj);
     
     // do the work
@@ -198,90 +415,150 @@ static void work_job_handler (BThreadWork *o)
 }
 
 int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint)
+{
+    struct BThreadWorkDispatcher_params params;
+    params.num_threads = num_threads_hint;
+    params.queue_size = 0;
+    params.pin_threads = 0;
+    
+    return BThreadWorkDispatcher_Init2(o, reactor, params);
+}
+
+int BThreadWorkDispatcher_Init2 (BThreadWorkDispatcher *o, BReactor *reactor, struct BThreadWorkDispatcher_params params)
 {
     // init arguments
     o->reactor = reactor;
     
-    if (num_threads_hint < 0) {
-        num_threads_hint = 2;
+    int num_threads = params.num_threads;
+    
+    #ifdef BADVPN_THREADWORK_USE_PTHREAD
+    int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus < 1) {
+        num_cpus = 1;
+    }
+    #endif
+    
+    if (num_threads < 0) {
+        #ifdef BADVPN_THREADWORK_USE_PTHREAD
+        num_threads = num_cpus;
+        #else
+        num_threads = 0;
+        #endif
     }
-    if (num_threads_hint > BTHREADWORK_MAX_THREADS) {
-        num_threads_hint = BTHREADWORK_MAX_THREADS;
+    if (num_threads > BTHREADWORK_MAX_THREADS) {
+        num_threads = BTHREADWORK_MAX_THREADS;
     }
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
     
-    if (num_threads_hint > 0) {
-        // init pending list
-        LinkedList1_Init(&o->pending_list);
-        
-        // init finished list
-        LinkedList1_Init(&o->finished_list);
+    o->num_threads = 0;
+    
+    if (num_threads > 0) {
+        // calculate queue size, a power of two
+        int queue_size = (params.queue_size > 0 ? params.queue_size : BTHREADWORK_DEFAULT_QUEUE_SIZE);
+        o->queue_size = 1;
+        while (o->queue_size < queue_size && o->queue_size <= INT_MAX / 2) {
+            o->queue_size *= 2;
+        }
         
-        // init mutex
-        if (pthread_mutex_init(&o->mutex, NULL) != 0) {
-            BLog(BLOG_ERROR, "pthread_mutex_init failed");
+        // allocate slots
+        if (!(o->slots = (struct BThreadWorkDispatcher_slot *)BAllocArray(o->queue_size, sizeof(o->slots[0])))) {
+            BLog(BLOG_ERROR, "BAllocArray failed");
             goto fail0;
         }
         
-        // init pipe
-        if (pipe(o->pipe) < 0) {
-            BLog(BLOG_ERROR, "pipe failed");
-            goto fail1;
+        // all slots are free
+        o->free_slot = -1;
+        for (int i = o->queue_size - 1; i >= 0; i--) {
+            o->slots[i].work = NULL;
+            o->slots[i].next_free = o->free_slot;
+            o->free_slot = i;
         }
         
-        // set read end non-blocking
-        if (fcntl(o->pipe[0], F_SETFL, O_NONBLOCK) < 0) {
-            BLog(BLOG_ERROR, "fcntl failed");
+        // init queues
+        if (!ring_init(&o->pending_ring, o->queue_size)) {
+            BLog(BLOG_ERROR, "ring_init failed");
+            goto fail1;
+        }
+        if (!ring_init(&o->finished_ring, o->queue_size)) {
+            BLog(BLOG_ERROR, "ring_init failed");
             goto fail2;
         }
         
-        // set write end non-blocking
-        if (fcntl(o->pipe[1], F_SETFL, O_NONBLOCK) < 0) {
-            BLog(BLOG_ERROR, "fcntl failed");
-            goto fail2;
+        // init mutex
+        if (pthread_mutex_init(&o->mutex, NULL) != 0) {
+            BLog(BLOG_ERROR, "pthread_mutex_init failed");
+            goto fail3;
+        }
+        
+        // init condition variable
+        if (pthread_cond_init(&o->new_cond, NULL) != 0) {
+            BLog(BLOG_ERROR, "pthread_cond_init failed");
+            goto fail4;
+        }
+        
+        // init notification
+        if (!init_notify_fds(o)) {
+            goto fail5;
         }
         
         // init BFileDescriptor
-        BFileDescriptor_Init(&o->bfd, o->pipe[0], (BFileDescriptor_handler)pipe_fd_handler, o);
+        BFileDescriptor_Init(&o->bfd, o->notify_fds[0], (BFileDescriptor_handler)notify_fd_handler, o);
         if (!BReactor_AddFileDescriptor(o->reactor, &o->bfd)) {
             BLog(BLOG_ERROR, "BReactor_AddFileDescriptor failed");
-            goto fail2;
+            goto fail6;
         }
         BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, BREACTOR_READ);
         
         // init more job
         BPending_Init(&o->more_job, BReactor_PendingGroup(o->reactor), (BPending_handler)more_job_handler, o);
         
-        // set not cancelling
+        // set no idle threads, not waking, not cancelling, not notified
+        o->num_idle = 0;
+        o->waking = 0;
         o->cancel = 0;
+        o->notified = 0;
+        
+        // allocate threads
+        if (!(o->threads = (struct BThreadWorkDispatcher_thread *)BAllocArray(num_threads, sizeof(o->threads[0])))) {
+            BLog(BLOG_ERROR, "BAllocArray failed");
+            goto fail7;
+        }
+        
+        // Block all signals while creating the threads, so that the threads inherit
+        // that and signals are only ever delivered to the event loop thread.
+        sigset_t all_sigs;
+        sigset_t old_sigs;
+        sigfillset(&all_sigs);
+        ASSERT_FORCE(pthread_sigmask(SIG_SETMASK, &all_sigs, &old_sigs) == 0)
         
         // init threads
-        o->num_threads = 0;
-        for (int i = 0; i < num_threads_hint; i++) {
+        for (int i = 0; i < num_threads; i++) {
             struct BThreadWorkDispatcher_thread *t = &o->threads[i];
             
             // set parent pointer
             t->d = o;
             
-            // set no running work
-            t->running_work = NULL;
-            
-            // init condition variable
-            if (pthread_cond_init(&t->new_cond, NULL) != 0) {
-                BLog(BLOG_ERROR, "pthread_cond_init failed");
-                goto fail3;
-            }
+            // assign CPU
+            t->cpu = i % num_cpus;
             
             // init thread
             if (pthread_create(&t->thread, NULL, (void * (*) (void *))dispatcher_thread, t) != 0) {
                 BLog(BLOG_ERROR, "pthread_create failed");
-                ASSERT_FORCE(pthread_cond_destroy(&t->new_cond) == 0)
-                goto fail3;
+                ASSERT_FORCE(pthread_sigmask(SIG_SETMASK, &old_sigs, NULL) == 0)
+                goto fail8;
             }
-        
+            
             o->num_threads++;
+            
+            // pin thread
+            if (params.pin_threads) {
+                pin_thread(t);
+            }
         }
+        
+        // restore the signal mask
+        ASSERT_FORCE(pthread_sigmask(SIG_SETMASK, &old_sigs, NULL) == 0)
     }
     
     #endif
@@ -291,15 +568,24 @@ int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int
     return 1;
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
-fail3:
+fail8:
     stop_threads(o);
+    BFree(o->threads);
+fail7:
     BPending_Free(&o->more_job);
     BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
+fail6:
+    free_notify_fds(o);
+fail5:
+    ASSERT_FORCE(pthread_cond_destroy(&o->new_cond) == 0)
+fail4:
+    ASSERT_FORCE(pthread_mutex_destroy(&o->mutex) == 0)
+fail3:
+    ring_free(&o->finished_ring);
 fail2:
-    ASSERT_FORCE(close(o->pipe[0]) == 0)
-    ASSERT_FORCE(close(o->pipe[1]) == 0)
+    ring_free(&o->pending_ring);
 fail1:
-    ASSERT_FORCE(pthread_mutex_destroy(&o->mutex) == 0)
+    BFree(o->slots);
 fail0:
     return 0;
     #endif
@@ -307,13 +593,6 @@ fail0:
 
 void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o)
 {
-    #ifdef BADVPN_THREADWORK_USE_PTHREAD
-    if (o->num_threads > 0) {
-        ASSERT(LinkedList1_IsEmpty(&o->pending_list))
-        for (int i = 0; i < o->num_threads; i++) { ASSERT(!o->threads[i].running_work) }
-        ASSERT(LinkedList1_IsEmpty(&o->finished_list))
-    }
-    #endif
     DebugObject_Free(&o->d_obj);
     DebugCounter_Free(&o->d_ctr);
     
@@ -322,6 +601,7 @@ void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o)
     if (o->num_threads > 0) {
         // stop threads
         stop_threads(o);
+        BFree(o->threads);
         
         // free more job
         BPending_Free(&o->more_job);
@@ -329,12 +609,21 @@ void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o)
         // free BFileDescriptor
         BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
         
-        // free pipe
-        ASSERT_FORCE(close(o->pipe[0]) == 0)
-        ASSERT_FORCE(close(o->pipe[1]) == 0)
+        // free notification
+        free_notify_fds(o);
+        
+        // free condition variable
+        ASSERT_FORCE(pthread_cond_destroy(&o->new_cond) == 0)
         
         // free mutex
         ASSERT_FORCE(pthread_mutex_destroy(&o->mutex) == 0)
+        
+        // free queues
+        ring_free(&o->finished_ring);
+        ring_free(&o->pending_ring);
+        
+        // free slots
+        BFree(o->slots);
     }
     
     #endif
@@ -361,24 +650,27 @@ void BThreadWork_Init (BThreadWork *o, BThreadWorkDispatcher *d, BThreadWork_han
     o->work_func_user = work_func_user;
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
-    if (d->num_threads > 0) {
-        // set state
-        o->state = BTHREADWORK_STATE_PENDING;
+    if (d->num_threads > 0 && d->free_slot >= 0) {
+        // take a slot
+        int idx = d->free_slot;
+        struct BThreadWorkDispatcher_slot *s = &d->slots[idx];
+        d->free_slot = s->next_free;
+        s->work = o;
+        s->state = BTHREADWORK_STATE_PENDING;
+        s->detached = 0;
+        o->slot = idx;
         
         // init finished semaphore
         ASSERT_FORCE(sem_init(&o->finished_sem, 0, 0) == 0)
         
         // post work
-        ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
-        LinkedList1_Append(&d->pending_list, &o->list_node);
-        for (int i = 0; i < d->num_threads; i++) {
-            if (!d->threads[i].running_work) {
-                ASSERT_FORCE(pthread_cond_signal(&d->threads[i].new_cond) == 0)
-                break;
-            }
-        }
-        ASSERT_FORCE(pthread_mutex_unlock(&d->mutex) == 0)
+        ring_push(&d->pending_ring, idx);
+        
+        // wake up a thread if any are sleeping
+        wake_thread(d);
     } else {
+        // no threads, or the queue is full
+        o->slot = WORK_SLOT_INLINE;
     #endif
         // schedule job
         BPending_Init(&o->job, BReactor_PendingGroup(d->reactor), (BPending_handler)work_job_handler, o);
@@ -398,48 +690,29 @@ void BThreadWork_Free (BThreadWork *o)
     DebugCounter_Decrement(&d->d_ctr);
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
-    if (d->num_threads > 0) {
-        ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
-        
-        switch (o->state) {
-            case BTHREADWORK_STATE_PENDING: {
-                BLog(BLOG_DEBUG, "remove pending work");
-                
-                // remove from pending list
-                LinkedList1_Remove(&d->pending_list, &o->list_node);
-            } break;
+    if (o->slot != WORK_SLOT_INLINE) {
+        if (o->slot == WORK_SLOT_FORGOTTEN) {
+            BLog(BLOG_DEBUG, "remove forgotten work");
+        } else {
+            struct BThreadWorkDispatcher_slot *s = &d->slots[o->slot];
+            ASSERT(s->work == o)
+            ASSERT(!s->detached)
             
-            case BTHREADWORK_STATE_RUNNING: {
-                BLog(BLOG_DEBUG, "remove running work");
+            int expected = BTHREADWORK_STATE_PENDING;
+            if (__atomic_compare_exchange_n(&s->state, &expected, BTHREADWORK_STATE_CANCELLED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                BLog(BLOG_DEBUG, "remove pending work");
+            } else {
+                BLog(BLOG_DEBUG, "remove running or finished work");
                 
                 // wait for the work to finish running
-                ASSERT_FORCE(pthread_mutex_unlock(&d->mutex) == 0)
                 ASSERT_FORCE(sem_wait(&o->finished_sem) == 0)
-                ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
-                
-                ASSERT(o->state == BTHREADWORK_STATE_FINISHED)
-                
-                // remove from finished list
-                LinkedList1_Remove(&d->finished_list, &o->list_node);
-            } break;
-            
-            case BTHREADWORK_STATE_FINISHED: {
-                BLog(BLOG_DEBUG, "remove finished work");
-                
-                // remove from finished list
-                LinkedList1_Remove(&d->finished_list, &o->list_node);
-            } break;
-            
-            case BTHREADWORK_STATE_FORGOTTEN: {
-                BLog(BLOG_DEBUG, "remove forgotten work");
-            } break;
+            }
             
-            default:
-                ASSERT(0);
+            // the slot will be reused once it comes back through the finished queue
+            s->work = NULL;
+            s->detached = 1;
         }
         
-        ASSERT_FORCE(pthread_mutex_unlock(&d->mutex) == 0)
-        
         // free finished semaphore
         ASSERT_FORCE(sem_destroy(&o->finished_sem) == 0)
     } else {
@@ -35,22 +35,25 @@
 #ifndef BADVPN_BTHREADWORK_BTHREADWORK_H
 #define BADVPN_BTHREADWORK_BTHREADWORK_H
 
+#include <stddef.h>
+
 #ifdef BADVPN_THREADWORK_USE_PTHREAD
     #include <pthread.h>
     #include <semaphore.h>
 #endif
 
 #include <misc/debug.h>
-#include <structure/LinkedList1.h>
 #include <base/DebugObject.h>
 #include <system/BReactor.h>
 
 #define BTHREADWORK_STATE_PENDING 1
 #define BTHREADWORK_STATE_RUNNING 2
 #define BTHREADWORK_STATE_FINISHED 3
-#define BTHREADWORK_STATE_FORGOTTEN 4
+#define BTHREADWORK_STATE_CANCELLED 4
+
+#define BTHREADWORK_MAX_THREADS 256
 
-#define BTHREADWORK_MAX_THREADS 8
+#define BTHREADWORK_DEFAULT_QUEUE_SIZE 1024
 
 struct BThreadWork_s;
 struct BThreadWorkDispatcher_s;
@@ -70,27 +73,64 @@ typedef void (*BThreadWork_work_func) (void *user);
  */
 typedef void (*BThreadWork_handler_done) (void *user);
 
+/**
+ * Parameters for {@link BThreadWorkDispatcher_Init2}.
+ */
+struct BThreadWorkDispatcher_params {
+    int num_threads;
+    int queue_size;
+    int pin_threads;
+};
+
 #ifdef BADVPN_THREADWORK_USE_PTHREAD
 struct BThreadWorkDispatcher_thread {
     struct BThreadWorkDispatcher_s *d;
-    struct BThreadWork_s *running_work;
-    pthread_cond_t new_cond;
+    int cpu;
     pthread_t thread;
 };
+
+struct BThreadWorkDispatcher_slot {
+    struct BThreadWork_s *work;
+    int state;
+    int detached;
+    int next_free;
+};
+
+struct BThreadWorkDispatcher_cell {
+    size_t seq;
+    int slot;
+};
+
+struct BThreadWorkDispatcher_ring {
+    struct BThreadWorkDispatcher_cell *cells;
+    size_t mask;
+    char pad1[64];
+    size_t enqueue_pos;
+    char pad2[64];
+    size_t dequeue_pos;
+    char pad3[64];
+};
 #endif
 
 typedef struct BThreadWorkDispatcher_s {
     BReactor *reactor;
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
-    LinkedList1 pending_list;
-    LinkedList1 finished_list;
+    int num_threads;
+    int queue_size;
+    struct BThreadWorkDispatcher_slot *slots;
+    int free_slot;
+    struct BThreadWorkDispatcher_ring pending_ring;
+    struct BThreadWorkDispatcher_ring finished_ring;
     pthread_mutex_t mutex;
-    int pipe[2];
+    pthread_cond_t new_cond;
+    int num_idle;
+    int waking;
+    int cancel;
+    int notified;
+    int notify_fds[2];
     BFileDescriptor bfd;
     BPending more_job;
-    int cancel;
-    int num_threads;
-    struct BThreadWorkDispatcher_thread threads[BTHREADWORK_MAX_THREADS];
+    struct BThreadWorkDispatcher_thread *threads;
     #endif
     DebugObject d_obj;
     DebugCounter d_ctr;
@@ -102,18 +142,11 @@ typedef struct BThreadWork_s {
     void *user;
     BThreadWork_work_func work_func;
     void *work_func_user;
-    union {
-        #ifdef BADVPN_THREADWORK_USE_PTHREAD
-        struct {
-            LinkedList1Node list_node;
-            int state;
-            sem_t finished_sem;
-        };
-        #endif
-        struct {
-            BPending job;
-        };
-    };
+    #ifdef BADVPN_THREADWORK_USE_PTHREAD
+    int slot;
+    sem_t finished_sem;
+    #endif
+    BPending job;
     DebugObject d_obj;
 } BThreadWork;
 
@@ -124,13 +157,37 @@ typedef struct BThreadWork_s {
  * @param o the object
  * @param reactor reactor we live in
  * @param num_threads_hint hint for the number of threads to use:
- *                         <0 - A choice will be made automatically, probably based on the number of CPUs.
+ *                         <0 - A choice will be made automatically, based on the number of CPUs.
  *                         0 - No additional threads will be used, and computations will be performed directly
  *                             in the event loop in job handlers.
+ *                         >0 - That many threads will be used, up to BTHREADWORK_MAX_THREADS.
  * @return 1 on success, 0 on failure
  */
 int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint) WARN_UNUSED;
 
+/**
+ * Initializes the work dispatcher with additional parameters.
+ * 
+ * Works are handed to the threads through bounded lock-free queues. Threads
+ * only sleep on a condition variable when there is no work, and finished works
+ * are reported to the event loop with a single notification (an eventfd on Linux)
+ * for all works finishing while the event loop has not yet picked them up.
+ * 
+ * @param o the object
+ * @param reactor reactor we live in
+ * @param params.num_threads number of threads to use, as num_threads_hint in
+ *                           {@link BThreadWorkDispatcher_Init}. At most
+ *                           BTHREADWORK_MAX_THREADS threads are started.
+ * @param params.queue_size maximum number of works queued to or running in the threads.
+ *                          Rounded up to a power of two; if <=0, BTHREADWORK_DEFAULT_QUEUE_SIZE
+ *                          is used. Works started while the queue is full are performed in the
+ *                          event loop as if no threads were used.
+ * @param params.pin_threads if nonzero, pin each thread to a different CPU, where supported.
+ *                           Failure to pin is logged and otherwise ignored.
+ * @return 1 on success, 0 on failure
+ */
+int BThreadWorkDispatcher_Init2 (BThreadWorkDispatcher *o, BReactor *reactor, struct BThreadWorkDispatcher_params params) WARN_UNUSED;
+
 /**
  * Frees the work dispatcher.
  * There must be no {@link BThreadWork}'s with this dispatcher.
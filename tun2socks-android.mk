@@ -39,6 +39,7 @@ LOCAL_C_INCLUDES := \
 
 LOCAL_SRC_FILES := \
 	badvpn/base/BLog.c \
+	badvpn/base/BLog_binary.c \
 	badvpn/base/BLog_syslog.c \
 	badvpn/base/BPending.c \
 	badvpn/base/DebugObject.c \
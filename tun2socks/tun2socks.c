@@ -49,6 +49,7 @@
 #include <misc/concat_strings.h>
 #include <structure/LinkedList1.h>
 #include <base/BLog.h>
+#include <base/BLog_binary.h>
 #include <system/BReactor.h>
 #include <system/BSignal.h>
 #include <system/BAddr.h>
@@ -160,6 +161,7 @@ static void tcp_remove(struct tcp_pcb* pcb_list)
 
 #define LOGGER_STDOUT 1
 #define LOGGER_SYSLOG 2
+#define LOGGER_BINARY 3
 
 #define SYNC_DECL \
     BPending sync_mark; \
@@ -184,6 +186,7 @@ struct {
     char *logger_syslog_facility;
     char *logger_syslog_ident;
     #endif
+    char *logger_binary_file;
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     char *netif_ipaddr;
@@ -518,6 +521,12 @@ int main (int argc, char **argv)
             }
             break;
         #endif
+        case LOGGER_BINARY:
+            if (!BLog_InitBinary(options.logger_binary_file)) {
+                fprintf(stderr, "Failed to initialize binary logger\n");
+                goto fail0;
+            }
+            break;
         default:
             ASSERT(0);
     }
@@ -771,6 +780,9 @@ void print_help (const char *name)
         "            [--syslog-ident <string>]\n"
         "        )\n"
         #endif
+        "        (logger=binary?\n"
+        "            [--binlog-file <file>]\n"
+        "        )\n"
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
 #ifdef __ANDROID__
@@ -824,6 +836,7 @@ int parse_arguments (int argc, char *argv[])
     options.logger_syslog_facility = "daemon";
     options.logger_syslog_ident = argv[0];
     #endif
+    options.logger_binary_file = "badvpn.blog";
     options.loglevel = -1;
     for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
         options.loglevels[i] = -1;
@@ -873,6 +886,9 @@ int parse_arguments (int argc, char *argv[])
                 options.logger = LOGGER_SYSLOG;
             }
             #endif
+            else if (!strcmp(arg2, "binary")) {
+                options.logger = LOGGER_BINARY;
+            }
             else {
                 fprintf(stderr, "%s: wrong argument\n", arg);
                 return 0;
@@ -897,6 +913,14 @@ int parse_arguments (int argc, char *argv[])
             i++;
         }
         #endif
+        else if (!strcmp(arg, "--binlog-file")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.logger_binary_file = argv[i + 1];
+            i++;
+        }
         else if (!strcmp(arg, "--loglevel")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -1687,12 +1711,11 @@ err_t netif_input_func (struct pbuf *p, struct netif *inp)
 
 void client_logfunc (struct tcp_client *client)
 {
-    char local_addr_s[BADDR_MAX_PRINT_LEN];
-    BAddr_Print(&client->local_addr, local_addr_s);
-    char remote_addr_s[BADDR_MAX_PRINT_LEN];
-    BAddr_Print(&client->remote_addr, remote_addr_s);
-
-    BLog_Append("%05d (%s %s): ", num_clients, local_addr_s, remote_addr_s);
+    BLog_Append("%05d (", num_clients);
+    BLog_AppendAddr(&client->local_addr);
+    BLog_Append(" ");
+    BLog_AppendAddr(&client->remote_addr);
+    BLog_Append("): ");
 }
 
 void client_log (struct tcp_client *client, int level, const char *fmt, ...)
@@ -47,6 +47,7 @@
 #include <structure/LinkedList1.h>
 #include <structure/BAVL.h>
 #include <base/BLog.h>
+#include <base/BLog_binary.h>
 #include <system/BReactor.h>
 #include <system/BNetwork.h>
 #include <system/BConnection.h>
@@ -70,6 +71,7 @@
 
 #define LOGGER_STDOUT 1
 #define LOGGER_SYSLOG 2
+#define LOGGER_BINARY 3
 
 #define DNS_UPDATE_TIME 2000
 
@@ -127,6 +129,7 @@ struct {
     char *logger_syslog_facility;
     char *logger_syslog_ident;
     #endif
+    char *logger_binary_file;
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
     char *listen_addrs[MAX_LISTEN_ADDRS];
@@ -243,6 +246,12 @@ int main (int argc, char **argv)
             }
             break;
         #endif
+        case LOGGER_BINARY:
+            if (!BLog_InitBinary(options.logger_binary_file)) {
+                fprintf(stderr, "Failed to initialize binary logger\n");
+                goto fail0;
+            }
+            break;
         default:
             ASSERT(0);
     }
@@ -357,6 +366,9 @@ void print_help (const char *name)
         "            [--syslog-ident <string>]\n"
         "        )\n"
         #endif
+        "        (logger=binary?\n"
+        "            [--binlog-file <file>]\n"
+        "        )\n"
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
         "        [--listen-addr <addr>] ...\n"
@@ -390,6 +402,7 @@ int parse_arguments (int argc, char *argv[])
     options.logger_syslog_facility = "daemon";
     options.logger_syslog_ident = argv[0];
     #endif
+    options.logger_binary_file = "badvpn.blog";
     options.loglevel = -1;
     for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
         options.loglevels[i] = -1;
@@ -426,6 +439,9 @@ int parse_arguments (int argc, char *argv[])
                 options.logger = LOGGER_SYSLOG;
             }
             #endif
+            else if (!strcmp(arg2, "binary")) {
+                options.logger = LOGGER_BINARY;
+            }
             else {
                 fprintf(stderr, "%s: wrong argument\n", arg);
                 return 0;
@@ -450,6 +466,14 @@ int parse_arguments (int argc, char *argv[])
             i++;
         }
         #endif
+        else if (!strcmp(arg, "--binlog-file")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.logger_binary_file = argv[i + 1];
+            i++;
+        }
         else if (!strcmp(arg, "--loglevel")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -762,10 +786,9 @@ void client_free (struct client *client)
 
 void client_logfunc (struct client *client)
 {
-    char addr[BADDR_MAX_PRINT_LEN];
-    BAddr_Print(&client->addr, addr);
-    
-    BLog_Append("client (%s): ", addr);
+    BLog_Append("client (");
+    BLog_AppendAddr(&client->addr);
+    BLog_Append("): ");
 }
 
 void client_log (struct client *client, int level, const char *fmt, ...)